@@ -33,6 +33,9 @@
 #elif defined (AUDIOFFT_FFTW3)
   #define AUDIOFFT_FFTW3_USED
   #include <fftw3.h>
+#elif defined (AUDIOFFT_PFFFT)
+  #define AUDIOFFT_PFFFT_USED
+  #include <pffft.h>
 #else
   #if !defined(AUDIOFFT_OOURA)
     #define AUDIOFFT_OOURA
@@ -979,6 +982,119 @@ namespace audiofft
 
 #endif // AUDIOFFT_FFTW3_USED
 
+
+    // ================================================================
+
+
+#ifdef AUDIOFFT_PFFFT_USED
+
+
+    /**
+     * @internal
+     * @class PFFFTFFT
+     * @brief FFT implementation using PFFFT internally (SSE/NEON, see bitbucket.org/jpommier/pffft)
+     *
+     * PFFFT needs the size of a real transform to be a multiple of 32.
+     */
+    class PFFFTFFT : public AudioFFTImpl
+    {
+    public:
+      PFFFTFFT() :
+        AudioFFTImpl(),
+        _size(0),
+        _setup(0),
+        _input(0),
+        _output(0),
+        _work(0)
+      {
+      }
+
+      virtual ~PFFFTFFT()
+      {
+        init(0);
+      }
+
+      virtual void init(size_t size) override
+      {
+        if (_size != size)
+        {
+          if (_size > 0)
+          {
+            pffft_destroy_setup(_setup);
+            pffft_aligned_free(_input);
+            pffft_aligned_free(_output);
+            pffft_aligned_free(_work);
+            _setup = 0;
+            _input = 0;
+            _output = 0;
+            _work = 0;
+            _size = 0;
+          }
+
+          if (size > 0)
+          {
+            assert(size % 32 == 0);
+            _size = size;
+            _setup = pffft_new_setup(static_cast<int>(size), PFFFT_REAL);
+            _input = reinterpret_cast<float*>(pffft_aligned_malloc(_size * sizeof(float)));
+            _output = reinterpret_cast<float*>(pffft_aligned_malloc(_size * sizeof(float)));
+            _work = reinterpret_cast<float*>(pffft_aligned_malloc(_size * sizeof(float)));
+          }
+        }
+      }
+
+      // The ordered real transform packs the DC and Nyquist bins into the first two values,
+      // followed by interleaved real/imaginary pairs for the other bins
+      virtual void fft(const float* data, float* re, float* im) override
+      {
+        const size_t half = _size / 2;
+        ::memcpy(_input, data, _size * sizeof(float));
+        pffft_transform_ordered(_setup, _input, _output, _work, PFFFT_FORWARD);
+        re[0] = _output[0];
+        im[0] = 0.0f;
+        re[half] = _output[1];
+        im[half] = 0.0f;
+        for (size_t i=1; i<half; ++i)
+        {
+          re[i] = _output[2*i];
+          im[i] = _output[2*i+1];
+        }
+      }
+
+      virtual void ifft(float* data, const float* re, const float* im) override
+      {
+        const size_t half = _size / 2;
+        _input[0] = re[0];
+        _input[1] = re[half];
+        for (size_t i=1; i<half; ++i)
+        {
+          _input[2*i] = re[i];
+          _input[2*i+1] = im[i];
+        }
+        pffft_transform_ordered(_setup, _input, _output, _work, PFFFT_BACKWARD);
+        ScaleBuffer(data, _output, 1.0f / static_cast<float>(_size), _size);
+      }
+
+    private:
+      size_t _size;
+      PFFFT_Setup* _setup;
+      float* _input;
+      float* _output;
+      float* _work;
+
+      PFFFTFFT(const PFFFTFFT&) = delete;
+      PFFFTFFT& operator=(const PFFFTFFT&) = delete;
+    };
+
+
+    std::unique_ptr<AudioFFTImpl> MakeAudioFFTImpl()
+    {
+      return std::unique_ptr<PFFFTFFT>(new PFFFTFFT());
+    }
+
+
+#endif // AUDIOFFT_PFFFT_USED
+
   } // End of namespace details
 
 
@@ -30,7 +30,7 @@
 *
 * - Real-complex FFT and complex-real inverse FFT for power-of-2-sized real data.
 *
-* - Uniform interface to different FFT implementations (currently Ooura, FFTW3 and Apple Accelerate).
+* - Uniform interface to different FFT implementations (currently Ooura, FFTW3, PFFFT and Apple Accelerate).
 *
 * - Complex data is handled in "split-complex" format, i.e. there are separate
 *   arrays for the real and imaginary parts which can be useful for SIMD optimizations
@@ -51,6 +51,9 @@
 *   AUDIOFFT_FFTW3 (however, please check whether your project suits the
 *   according license).
 *
+* - PFFFT (SSE and NEON) can be used instead by linking it and defining
+*   AUDIOFFT_PFFFT. Transform sizes then have to be multiples of 32.
+*
 * - To get the best speed on Apple platforms, you can link the Apple
 *   Accelerate framework to your project and define
 *   AUDIOFFT_APPLE_ACCELERATE  (however, please check whether your
@@ -0,0 +1,131 @@
+// ==================================================================================
+// Copyright (c) 2012 HiFi-LoFi
+//
+// This is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+// ==================================================================================
+
+#ifndef _FFTCONVOLVER_TWOSTAGEFFTCONVOLVER_H
+#define _FFTCONVOLVER_TWOSTAGEFFTCONVOLVER_H
+
+#include "FFTConvolver.h"
+#include "Utilities.h"
+
+
+namespace fftconvolver
+{
+
+/**
+* @class TwoStageFFTConvolver
+* @brief FFT convolver using two different block sizes
+*
+* The 2-stage convolver consists internally of 3 convolvers:
+*
+* - A head convolver, which processes the first part of the impulse response
+*   (up to the tail block size) with a small block size, so that no latency
+*   is added.
+*
+* - A first tail convolver, which processes the next part of the impulse
+*   response (one tail block) with the head block size. Its output is only
+*   needed one tail block later, so it is simply computed in advance.
+*
+* - A second tail convolver, which processes the rest of the impulse response
+*   with the large tail block size. Its result is needed two tail blocks
+*   later, so the work can be done in a background thread while the head
+*   carries on (see startBackgroundProcessing() and
+*   waitForBackgroundProcessing()).
+*
+* The default implementation does the tail processing synchronously; derive
+* from this class to move it to another thread.
+*
+* process() may be called in place, i.e. with input == output.
+*/
+class TwoStageFFTConvolver
+{
+public:
+  TwoStageFFTConvolver();
+  virtual ~TwoStageFFTConvolver();
+
+  /**
+  * @brief Initializes the convolver
+  * @param headBlockSize The head block size
+  * @param tailBlockSize the tail block size
+  * @param ir The impulse response
+  * @param irLen Length of the impulse response in samples
+  * @return true: Success - false: Failed
+  */
+  bool init(size_t headBlockSize, size_t tailBlockSize, const Sample* ir, size_t irLen);
+
+  /**
+  * @brief Convolves the the given input samples and immediately outputs the result
+  * @param input The input samples
+  * @param output The convolution result
+  * @param len Number of input/output samples
+  */
+  void process(const Sample* input, Sample* output, size_t len);
+
+  /**
+  * @brief Resets the convolver and discards the set impulse response
+  */
+  void reset();
+
+  /**
+  * @brief Returns whether the tail is long enough to need background processing
+  */
+  bool hasBackgroundTail() const
+  {
+    return (_tailPrecalculated.size() > 0);
+  }
+
+protected:
+  /**
+  * @brief Method called by the convolver if work for background processing is available
+  *
+  * The background work itself is done by doBackgroundProcessing(), which
+  * must be called exactly once for each call of this method.
+  */
+  virtual void startBackgroundProcessing();
+
+  /**
+  * @brief Called by the convolver before it needs the result of the background processing
+  */
+  virtual void waitForBackgroundProcessing();
+
+  /**
+  * @brief Actually performs the background processing work
+  */
+  void doBackgroundProcessing();
+
+private:
+  size_t _headBlockSize;
+  size_t _tailBlockSize;
+  FFTConvolver _headConvolver;
+  FFTConvolver _tailConvolver0;
+  SampleBuffer _tailOutput0;
+  SampleBuffer _tailPrecalculated0;
+  FFTConvolver _tailConvolver;
+  SampleBuffer _tailOutput;
+  SampleBuffer _tailPrecalculated;
+  SampleBuffer _tailInput;
+  size_t _tailInputFill;
+  size_t _precalculatedPos;
+  SampleBuffer _backgroundProcessingInput;
+
+  // Prevent uncontrolled usage
+  TwoStageFFTConvolver(const TwoStageFFTConvolver&);
+  TwoStageFFTConvolver& operator=(const TwoStageFFTConvolver&);
+};
+
+} // End of namespace fftconvolver
+
+#endif // Header guard
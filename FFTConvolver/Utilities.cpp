@@ -37,6 +37,18 @@ void Sum(Sample* FFTCONVOLVER_RESTRICT result,
          size_t len)
 {
   const size_t end4 = 4 * (len / 4);
+#if defined(FFTCONVOLVER_USE_SSE)
+  // the arrays may start anywhere within a block, so no alignment can be assumed
+  for (size_t i=0; i<end4; i+=4)
+  {
+    _mm_storeu_ps(&result[i], _mm_add_ps(_mm_loadu_ps(&a[i]), _mm_loadu_ps(&b[i])));
+  }
+#elif defined(FFTCONVOLVER_USE_NEON)
+  for (size_t i=0; i<end4; i+=4)
+  {
+    vst1q_f32(&result[i], vaddq_f32(vld1q_f32(&a[i]), vld1q_f32(&b[i])));
+  }
+#else
   for (size_t i=0; i<end4; i+=4)
   {
     result[i+0] = a[i+0] + b[i+0];
@@ -44,6 +56,7 @@ void Sum(Sample* FFTCONVOLVER_RESTRICT result,
     result[i+2] = a[i+2] + b[i+2];
     result[i+3] = a[i+3] + b[i+3];
   }
+#endif
   for (size_t i=end4; i<len; ++i)
   {
     result[i] = a[i] + b[i];
@@ -59,15 +72,54 @@ void ComplexMultiplyAccumulate(SplitComplex& result, const SplitComplex& a, cons
 }
 
 
-void ComplexMultiplyAccumulate(Sample* FFTCONVOLVER_RESTRICT re, 
-                               Sample* FFTCONVOLVER_RESTRICT im,
-                               const Sample* FFTCONVOLVER_RESTRICT reA,
-                               const Sample* FFTCONVOLVER_RESTRICT imA,
-                               const Sample* FFTCONVOLVER_RESTRICT reB,
-                               const Sample* FFTCONVOLVER_RESTRICT imB,
-                               const size_t len)
+typedef void (*ComplexMultiplyAccumulateFunc)(Sample* FFTCONVOLVER_RESTRICT re,
+                                              Sample* FFTCONVOLVER_RESTRICT im,
+                                              const Sample* FFTCONVOLVER_RESTRICT reA,
+                                              const Sample* FFTCONVOLVER_RESTRICT imA,
+                                              const Sample* FFTCONVOLVER_RESTRICT reB,
+                                              const Sample* FFTCONVOLVER_RESTRICT imB,
+                                              const size_t len);
+
+
+static void ComplexMultiplyAccumulateScalar(Sample* FFTCONVOLVER_RESTRICT re,
+                                            Sample* FFTCONVOLVER_RESTRICT im,
+                                            const Sample* FFTCONVOLVER_RESTRICT reA,
+                                            const Sample* FFTCONVOLVER_RESTRICT imA,
+                                            const Sample* FFTCONVOLVER_RESTRICT reB,
+                                            const Sample* FFTCONVOLVER_RESTRICT imB,
+                                            size_t begin,
+                                            const size_t len)
 {
+  const size_t end4 = begin + 4 * ((len - begin) / 4);
+  for (size_t i=begin; i<end4; i+=4)
+  {
+    re[i+0] += reA[i+0] * reB[i+0] - imA[i+0] * imB[i+0];
+    re[i+1] += reA[i+1] * reB[i+1] - imA[i+1] * imB[i+1];
+    re[i+2] += reA[i+2] * reB[i+2] - imA[i+2] * imB[i+2];
+    re[i+3] += reA[i+3] * reB[i+3] - imA[i+3] * imB[i+3];
+    im[i+0] += reA[i+0] * imB[i+0] + imA[i+0] * reB[i+0];
+    im[i+1] += reA[i+1] * imB[i+1] + imA[i+1] * reB[i+1];
+    im[i+2] += reA[i+2] * imB[i+2] + imA[i+2] * reB[i+2];
+    im[i+3] += reA[i+3] * imB[i+3] + imA[i+3] * reB[i+3];
+  }
+  for (size_t i=end4; i<len; ++i)
+  {
+    re[i] += reA[i] * reB[i] - imA[i] * imB[i];
+    im[i] += reA[i] * imB[i] + imA[i] * reB[i];
+  }
+}
+
+
 #if defined(FFTCONVOLVER_USE_SSE)
+
+static void ComplexMultiplyAccumulateSSE(Sample* FFTCONVOLVER_RESTRICT re,
+                                         Sample* FFTCONVOLVER_RESTRICT im,
+                                         const Sample* FFTCONVOLVER_RESTRICT reA,
+                                         const Sample* FFTCONVOLVER_RESTRICT imA,
+                                         const Sample* FFTCONVOLVER_RESTRICT reB,
+                                         const Sample* FFTCONVOLVER_RESTRICT imB,
+                                         const size_t len)
+{
   const size_t end4 = 4 * (len / 4);
   for (size_t i=0; i<end4; i+=4)
   {
@@ -84,30 +136,141 @@ void ComplexMultiplyAccumulate(Sample* FFTCONVOLVER_RESTRICT re,
     imag = _mm_add_ps(imag, _mm_mul_ps(ia, rb));
     _mm_store_ps(&im[i], imag);
   }
-  for (size_t i=end4; i<len; ++i)
+  ComplexMultiplyAccumulateScalar(re, im, reA, imA, reB, imB, end4, len);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <immintrin.h>
+
+// Buffers are only guaranteed to be 16-byte aligned, hence the unaligned loads
+__attribute__((target("avx2,fma")))
+static void ComplexMultiplyAccumulateAVX2(Sample* FFTCONVOLVER_RESTRICT re,
+                                          Sample* FFTCONVOLVER_RESTRICT im,
+                                          const Sample* FFTCONVOLVER_RESTRICT reA,
+                                          const Sample* FFTCONVOLVER_RESTRICT imA,
+                                          const Sample* FFTCONVOLVER_RESTRICT reB,
+                                          const Sample* FFTCONVOLVER_RESTRICT imB,
+                                          const size_t len)
+{
+  const size_t end8 = 8 * (len / 8);
+  for (size_t i=0; i<end8; i+=8)
   {
-    re[i] += reA[i] * reB[i] - imA[i] * imB[i];
-    im[i] += reA[i] * imB[i] + imA[i] * reB[i];
+    const __m256 ra = _mm256_loadu_ps(&reA[i]);
+    const __m256 rb = _mm256_loadu_ps(&reB[i]);
+    const __m256 ia = _mm256_loadu_ps(&imA[i]);
+    const __m256 ib = _mm256_loadu_ps(&imB[i]);
+    __m256 real = _mm256_loadu_ps(&re[i]);
+    __m256 imag = _mm256_loadu_ps(&im[i]);
+    real = _mm256_fmadd_ps(ra, rb, real);
+    real = _mm256_fnmadd_ps(ia, ib, real);
+    _mm256_storeu_ps(&re[i], real);
+    imag = _mm256_fmadd_ps(ra, ib, imag);
+    imag = _mm256_fmadd_ps(ia, rb, imag);
+    _mm256_storeu_ps(&im[i], imag);
   }
+  ComplexMultiplyAccumulateScalar(re, im, reA, imA, reB, imB, end8, len);
+}
+
+static ComplexMultiplyAccumulateFunc ChooseComplexMultiplyAccumulate()
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return ComplexMultiplyAccumulateAVX2;
+  return ComplexMultiplyAccumulateSSE;
+}
+
 #else
-  const size_t end4 = 4 * (len / 4);
-  for (size_t i=0; i<end4; i+=4)
-  {
-    re[i+0] += reA[i+0] * reB[i+0] - imA[i+0] * imB[i+0];
-    re[i+1] += reA[i+1] * reB[i+1] - imA[i+1] * imB[i+1];
-    re[i+2] += reA[i+2] * reB[i+2] - imA[i+2] * imB[i+2];
-    re[i+3] += reA[i+3] * reB[i+3] - imA[i+3] * imB[i+3];
-    im[i+0] += reA[i+0] * imB[i+0] + imA[i+0] * reB[i+0];
-    im[i+1] += reA[i+1] * imB[i+1] + imA[i+1] * reB[i+1];
-    im[i+2] += reA[i+2] * imB[i+2] + imA[i+2] * reB[i+2];
-    im[i+3] += reA[i+3] * imB[i+3] + imA[i+3] * reB[i+3];
-  }
-  for (size_t i=end4; i<len; ++i)
+
+static ComplexMultiplyAccumulateFunc ChooseComplexMultiplyAccumulate()
+{
+  return ComplexMultiplyAccumulateSSE;
+}
+
+#endif
+
+#elif defined(FFTCONVOLVER_USE_NEON)
+
+// Two vectors per iteration give in-order cores like the Cortex-A53 something to do while
+// the multiplies complete
+static void ComplexMultiplyAccumulateNEON(Sample* FFTCONVOLVER_RESTRICT re,
+                                          Sample* FFTCONVOLVER_RESTRICT im,
+                                          const Sample* FFTCONVOLVER_RESTRICT reA,
+                                          const Sample* FFTCONVOLVER_RESTRICT imA,
+                                          const Sample* FFTCONVOLVER_RESTRICT reB,
+                                          const Sample* FFTCONVOLVER_RESTRICT imB,
+                                          const size_t len)
+{
+  const size_t end8 = 8 * (len / 8);
+  for (size_t i=0; i<end8; i+=8)
   {
-    re[i] += reA[i] * reB[i] - imA[i] * imB[i];
-    im[i] += reA[i] * imB[i] + imA[i] * reB[i];
+    const float32x4_t ra0 = vld1q_f32(&reA[i]);
+    const float32x4_t ra1 = vld1q_f32(&reA[i+4]);
+    const float32x4_t rb0 = vld1q_f32(&reB[i]);
+    const float32x4_t rb1 = vld1q_f32(&reB[i+4]);
+    const float32x4_t ia0 = vld1q_f32(&imA[i]);
+    const float32x4_t ia1 = vld1q_f32(&imA[i+4]);
+    const float32x4_t ib0 = vld1q_f32(&imB[i]);
+    const float32x4_t ib1 = vld1q_f32(&imB[i+4]);
+    float32x4_t real0 = vld1q_f32(&re[i]);
+    float32x4_t real1 = vld1q_f32(&re[i+4]);
+    float32x4_t imag0 = vld1q_f32(&im[i]);
+    float32x4_t imag1 = vld1q_f32(&im[i+4]);
+#if defined(__aarch64__)
+    real0 = vfmsq_f32(vfmaq_f32(real0, ra0, rb0), ia0, ib0);
+    real1 = vfmsq_f32(vfmaq_f32(real1, ra1, rb1), ia1, ib1);
+    imag0 = vfmaq_f32(vfmaq_f32(imag0, ra0, ib0), ia0, rb0);
+    imag1 = vfmaq_f32(vfmaq_f32(imag1, ra1, ib1), ia1, rb1);
+#else
+    real0 = vmlsq_f32(vmlaq_f32(real0, ra0, rb0), ia0, ib0);
+    real1 = vmlsq_f32(vmlaq_f32(real1, ra1, rb1), ia1, ib1);
+    imag0 = vmlaq_f32(vmlaq_f32(imag0, ra0, ib0), ia0, rb0);
+    imag1 = vmlaq_f32(vmlaq_f32(imag1, ra1, ib1), ia1, rb1);
+#endif
+    vst1q_f32(&re[i], real0);
+    vst1q_f32(&re[i+4], real1);
+    vst1q_f32(&im[i], imag0);
+    vst1q_f32(&im[i+4], imag1);
   }
+  ComplexMultiplyAccumulateScalar(re, im, reA, imA, reB, imB, end8, len);
+}
+
+static ComplexMultiplyAccumulateFunc ChooseComplexMultiplyAccumulate()
+{
+  return ComplexMultiplyAccumulateNEON;
+}
+
+#else
+
+static void ComplexMultiplyAccumulateGeneric(Sample* FFTCONVOLVER_RESTRICT re,
+                                             Sample* FFTCONVOLVER_RESTRICT im,
+                                             const Sample* FFTCONVOLVER_RESTRICT reA,
+                                             const Sample* FFTCONVOLVER_RESTRICT imA,
+                                             const Sample* FFTCONVOLVER_RESTRICT reB,
+                                             const Sample* FFTCONVOLVER_RESTRICT imB,
+                                             const size_t len)
+{
+  ComplexMultiplyAccumulateScalar(re, im, reA, imA, reB, imB, 0, len);
+}
+
+static ComplexMultiplyAccumulateFunc ChooseComplexMultiplyAccumulate()
+{
+  return ComplexMultiplyAccumulateGeneric;
+}
+
 #endif
+
+
+void ComplexMultiplyAccumulate(Sample* FFTCONVOLVER_RESTRICT re, 
+                               Sample* FFTCONVOLVER_RESTRICT im,
+                               const Sample* FFTCONVOLVER_RESTRICT reA,
+                               const Sample* FFTCONVOLVER_RESTRICT imA,
+                               const Sample* FFTCONVOLVER_RESTRICT reB,
+                               const Sample* FFTCONVOLVER_RESTRICT imB,
+                               const size_t len)
+{
+  static ComplexMultiplyAccumulateFunc impl = ChooseComplexMultiplyAccumulate();
+  impl(re, im, reA, imA, reB, imB, len);
 }
 
 } // End of namespace fftconvolver
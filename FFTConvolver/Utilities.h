@@ -35,10 +35,21 @@ namespace fftconvolver
 #endif
 
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #if !defined(FFTCONVOLVER_USE_NEON) && !defined(FFTCONVOLVER_DONT_USE_NEON)
+    #define FFTCONVOLVER_USE_NEON
+  #endif
+#endif
+
+
 #if defined (FFTCONVOLVER_USE_SSE)
   #include <xmmintrin.h>
 #endif
 
+#if defined (FFTCONVOLVER_USE_NEON)
+  #include <arm_neon.h>
+#endif
+
 
 #if defined(__GNUC__)
   #define FFTCONVOLVER_RESTRICT __restrict__
@@ -1,9 +1,15 @@
-
-
+#include "config.h"
+#include <atomic>
+#include <cmath>
 #include <pthread.h>
 #include <sndfile.h>
+#include <unistd.h>
+#include <vector>
+#ifdef CONFIG_SOXR
+#include <soxr.h>
+#endif
 #include "convolver.h"
-#include "FFTConvolver.h"
+#include "TwoStageFFTConvolver.h"
 #include "Utilities.h"
 
 extern "C" void _warn(const char *filename, const int linenumber, const char *format, ...);
@@ -12,59 +18,275 @@ extern "C" void _debug(const char *filename, const int linenumber, int level, co
 #define warn(...) _warn(__FILE__, __LINE__, __VA_ARGS__)
 #define debug(...) _debug(__FILE__, __LINE__, __VA_ARGS__)
 
-fftconvolver::FFTConvolver convolver_l;
-fftconvolver::FFTConvolver convolver_r;
+// A two-stage convolver whose long tail partitions are convolved on a thread of their own,
+// so that the player only ever pays for the short head block.
+class ThreadedConvolver : public fftconvolver::TwoStageFFTConvolver {
+public:
+  ThreadedConvolver() : thread_running(0), stop_requested(0), work_pending(0) {
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&work_cond, NULL);
+    pthread_cond_init(&done_cond, NULL);
+  }
 
-// always lock use this when accessing the playing conn value
-pthread_mutex_t convolver_lock = PTHREAD_MUTEX_INITIALIZER;
+  ~ThreadedConvolver() {
+    stop_thread();
+    pthread_cond_destroy(&done_cond);
+    pthread_cond_destroy(&work_cond);
+    pthread_mutex_destroy(&mutex);
+  }
 
+  // Not to be called while the convolver is in use.
+  // A tail_block_size of 0 asks for uniform partitioning of the whole impulse response.
+  bool setup(size_t block_size, size_t tail_block_size, const fftconvolver::Sample *ir,
+             size_t ir_length) {
+    stop_thread();
+    if (tail_block_size == 0)
+      tail_block_size = ir_length > block_size ? ir_length : block_size;
+    bool response = init(block_size, tail_block_size, ir, ir_length);
+    if ((response) && (hasBackgroundTail())) {
+      if (pthread_create(&thread, NULL, &ThreadedConvolver::thread_func, this) == 0)
+        thread_running = 1;
+      else
+        warn("Could not create a convolver tail thread -- the tail will be convolved on the "
+             "player thread.");
+    }
+    return response;
+  }
 
-int convolver_init(const char* filename, int max_length) {
+protected:
+  void startBackgroundProcessing() {
+    if (thread_running) {
+      pthread_mutex_lock(&mutex);
+      work_pending = 1;
+      pthread_cond_signal(&work_cond);
+      pthread_mutex_unlock(&mutex);
+    } else {
+      doBackgroundProcessing();
+    }
+  }
+
+  void waitForBackgroundProcessing() {
+    if (thread_running) {
+      pthread_mutex_lock(&mutex);
+      while (work_pending)
+        pthread_cond_wait(&done_cond, &mutex);
+      pthread_mutex_unlock(&mutex);
+    }
+  }
+
+private:
+  static void *thread_func(void *arg) {
+    ThreadedConvolver *self = static_cast<ThreadedConvolver *>(arg);
+    pthread_mutex_lock(&self->mutex);
+    for (;;) {
+      while ((self->work_pending == 0) && (self->stop_requested == 0))
+        pthread_cond_wait(&self->work_cond, &self->mutex);
+      if (self->stop_requested)
+        break;
+      pthread_mutex_unlock(&self->mutex);
+      self->doBackgroundProcessing();
+      pthread_mutex_lock(&self->mutex);
+      self->work_pending = 0;
+      pthread_cond_signal(&self->done_cond);
+    }
+    pthread_mutex_unlock(&self->mutex);
+    return NULL;
+  }
+
+  void stop_thread() {
+    if (thread_running) {
+      waitForBackgroundProcessing();
+      pthread_mutex_lock(&mutex);
+      stop_requested = 1;
+      pthread_cond_signal(&work_cond);
+      pthread_mutex_unlock(&mutex);
+      pthread_join(thread, NULL);
+      thread_running = 0;
+      stop_requested = 0;
+    }
+    work_pending = 0;
+  }
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  int thread_running;
+  int stop_requested;
+  int work_pending;
+};
+
+// The impulse response is double buffered: convolver_init prepares the pair that is not active
+// and then publishes it, so the player never has to lock anything to pick up a new one, and a
+// reload never holds up the player.
+// A pair is only rebuilt once no player is left using it.
+typedef struct {
+  ThreadedConvolver l;
+  ThreadedConvolver r;
+} convolver_pair;
+
+static convolver_pair convolvers[2];
+static std::atomic<int> active_pair(0);
+static std::atomic<int> pair_users[2];
+
+// the sample rate the active impulse response has been prepared for
+static std::atomic<int> active_sample_rate(44100);
+
+// only serialises calls to convolver_init -- it is not used on the processing path
+static pthread_mutex_t convolver_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// When there is more than one CPU, the right channel is convolved on a worker thread
+// while the player thread does the left channel. The worker holds the mutex only to pick up or
+// hand back a block, never while convolving, and convolver_init never takes it.
+static struct {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  std::atomic<int> running;
+  int pending;
+  ThreadedConvolver *convolver;
+  float *data;
+  int length;
+} channel_worker = {pthread_t(), PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                    PTHREAD_COND_INITIALIZER, {0}, 0, NULL, NULL, 0};
+
+static void *channel_worker_thread_func(__attribute__((unused)) void *arg) {
+  pthread_mutex_lock(&channel_worker.mutex);
+  for (;;) {
+    while (channel_worker.pending == 0)
+      pthread_cond_wait(&channel_worker.work_cond, &channel_worker.mutex);
+    pthread_mutex_unlock(&channel_worker.mutex);
+    channel_worker.convolver->process(channel_worker.data, channel_worker.data,
+                                      channel_worker.length);
+    pthread_mutex_lock(&channel_worker.mutex);
+    channel_worker.pending = 0;
+    pthread_cond_signal(&channel_worker.done_cond);
+  }
+  return NULL;
+}
+
+static void start_channel_worker() {
+  if ((channel_worker.running.load() == 0) && (sysconf(_SC_NPROCESSORS_ONLN) > 1)) {
+    if (pthread_create(&channel_worker.thread, NULL, &channel_worker_thread_func, NULL) == 0) {
+      pthread_detach(channel_worker.thread);
+      channel_worker.running.store(1);
+    } else {
+      warn("Could not create the convolver channel thread -- both channels will be convolved on "
+           "the player thread.");
+    }
+  }
+}
+
+// Read the impulse response a block at a time into heap storage, as interleaved frames.
+static size_t read_impulse_response(SNDFILE *file, int channels, size_t max_frames,
+                                    std::vector<float> &samples) {
+  const size_t block_frames = 4096;
+  size_t frames = 0;
+  while (frames < max_frames) {
+    size_t frames_wanted = max_frames - frames;
+    if (frames_wanted > block_frames)
+      frames_wanted = block_frames;
+    samples.resize((frames + frames_wanted) * channels);
+    sf_count_t frames_read = sf_readf_float(file, &samples[frames * channels], frames_wanted);
+    if (frames_read <= 0)
+      break;
+    frames += frames_read;
+  }
+  samples.resize(frames * channels);
+  return frames;
+}
+
+#ifdef CONFIG_SOXR
+// Resample the interleaved impulse response, keeping its gain the same at the new rate
+static size_t resample_impulse_response(std::vector<float> &samples, int channels, int from_rate,
+                                        int to_rate) {
+  const size_t frames = samples.size() / channels;
+  const size_t output_frames = (size_t)ceil((double)frames * to_rate / from_rate);
+  std::vector<float> output(output_frames * channels);
+  size_t odone = 0;
+  soxr_io_spec_t io_spec = soxr_io_spec(SOXR_FLOAT32_I, SOXR_FLOAT32_I);
+  soxr_quality_spec_t quality_spec = soxr_quality_spec(SOXR_VHQ, 0);
+  soxr_error_t error = soxr_oneshot(from_rate, to_rate, channels, samples.data(), frames, NULL,
+                                    output.data(), output_frames, &odone, &io_spec, &quality_spec,
+                                    NULL);
+  if (error) {
+    warn("Error resampling the impulse response: \"%s\".", soxr_strerror(error));
+    return 0;
+  }
+  const float scale = (float)from_rate / to_rate;
+  output.resize(odone * channels);
+  for (size_t i = 0; i < output.size(); i++)
+    output[i] *= scale;
+  samples.swap(output);
+  return odone;
+}
+#endif
+
+int convolver_init(const char* filename, int max_length, int block_size, int tail_block_size,
+                   int sample_rate) {
   int success = 0;
   SF_INFO info;
   if (filename) {
     SNDFILE* file = sf_open(filename, SFM_READ, &info);
     if (file) {
-  
-      if (info.samplerate == 44100)  {  
+#ifdef CONFIG_SOXR
+      int rate_ok = 1;
+#else
+      int rate_ok = (info.samplerate == sample_rate);
+#endif
+      if (rate_ok) {
         if ((info.channels == 1) || (info.channels == 2)) {
-          const size_t size = info.frames > max_length ? max_length : info.frames;
-          float buffer[size*info.channels];
-  
-          size_t l = sf_readf_float(file, buffer, size);
-          if (l != 0) {
-            pthread_mutex_lock(&convolver_lock);
-            convolver_l.reset(); // it is possible that init could be called more than once
-            convolver_r.reset(); // so it could be necessary to remove all previous settings
-  
-            if (info.channels == 1) {
-              convolver_l.init(352, buffer, size);
-              convolver_r.init(352, buffer, size);
-            } else {
-              // deinterleave
-              float buffer_l[size];
-              float buffer_r[size];
-    
-              unsigned int i;
-              for (i=0; i<size; ++i)
-              {
-                buffer_l[i] = buffer[2*i+0];
-                buffer_r[i] = buffer[2*i+1];
-              }
-    
-              convolver_l.init(352, buffer_l, size);
-              convolver_r.init(352, buffer_r, size);
-              
+          // read enough of the file to give max_length frames at the session rate
+          size_t frames_wanted = (size_t)ceil((double)max_length * info.samplerate / sample_rate);
+          if ((sf_count_t)frames_wanted > info.frames)
+            frames_wanted = info.frames;
+          std::vector<float> buffer;
+          size_t size = read_impulse_response(file, info.channels, frames_wanted, buffer);
+#ifdef CONFIG_SOXR
+          if ((size != 0) && (info.samplerate != sample_rate)) {
+            debug(1, "Resampling the impulse response from %d Hz to %d Hz.", info.samplerate,
+                  sample_rate);
+            size = resample_impulse_response(buffer, info.channels, info.samplerate, sample_rate);
+          }
+#endif
+          if (size > (size_t)max_length)
+            size = max_length;
+          if (size != 0) {
+            std::vector<float> buffer_l(size);
+            std::vector<float> buffer_r(size);
+            size_t i;
+            for (i = 0; i < size; ++i) {
+              // deinterleave -- a mono response is used for both channels
+              buffer_l[i] = buffer[info.channels * i];
+              buffer_r[i] = buffer[info.channels * i + info.channels - 1];
             }
+            // the file data is no longer needed
+            std::vector<float>().swap(buffer);
+
+            pthread_mutex_lock(&convolver_lock);
+            // it is possible that init could be called more than once, so set up the
+            // pair that is not in use and switch over to it when it's ready
+            int spare = 1 - active_pair.load();
+            while (pair_users[spare].load() != 0)
+              usleep(1000);
+
+            convolvers[spare].l.setup(block_size, tail_block_size, buffer_l.data(), size);
+            convolvers[spare].r.setup(block_size, tail_block_size, buffer_r.data(), size);
+
+            start_channel_worker();
+            active_sample_rate.store(sample_rate);
+            active_pair.store(spare);
             pthread_mutex_unlock(&convolver_lock);
             success = 1;
           }
-          debug(1, "IR initialized from \"%s\" with %d channels and %d samples", filename, info.channels, size);
+          debug(1, "IR initialized from \"%s\" with %d channels and %zu samples at %d Hz, block size %d, tail block size %d",
+                filename, info.channels, size, sample_rate, block_size, tail_block_size);
         } else {
           warn("Impulse file \"%s\" contains %d channels. Only 1 or 2 is supported.", filename, info.channels);
         }
       } else {
-        warn("Impulse file \"%s\" sample rate is %d Hz. Only 44100 Hz is supported", filename, info.samplerate);
+        warn("Impulse file \"%s\" sample rate is %d Hz. Only %d Hz is supported without soxr", filename, info.samplerate, sample_rate);
       }
       sf_close(file);
     }
@@ -72,14 +294,42 @@ int convolver_init(const char* filename, int max_length) {
   return success;
 }
 
-void convolver_process_l(float* data, int length) {
-  pthread_mutex_lock(&convolver_lock);
-  convolver_l.process(data, data, length);
-  pthread_mutex_unlock(&convolver_lock);
+int convolver_sample_rate(void) {
+  return active_sample_rate.load();
 }
 
-void convolver_process_r(float* data, int length) {
-  pthread_mutex_lock(&convolver_lock);
-  convolver_r.process(data, data, length);
-  pthread_mutex_unlock(&convolver_lock);
+void convolver_process(float* data_l, float* data_r, int length) {
+  // register as a user of the active pair, making sure it didn't change under us
+  int pair;
+  for (;;) {
+    pair = active_pair.load();
+    pair_users[pair]++;
+    if (active_pair.load() == pair)
+      break;
+    pair_users[pair]--;
+  }
+
+  // The player never waits for an impulse response to be loaded: convolver_init works on the pair
+  // not in use and publishes it with an atomic store. Nor does it wait to hand the right channel
+  // over -- if the worker's mutex can't be had at once, it convolves both channels itself.
+  if ((channel_worker.running.load()) && (pthread_mutex_trylock(&channel_worker.mutex) == 0)) {
+    channel_worker.convolver = &convolvers[pair].r;
+    channel_worker.data = data_r;
+    channel_worker.length = length;
+    channel_worker.pending = 1;
+    pthread_cond_signal(&channel_worker.work_cond);
+    pthread_mutex_unlock(&channel_worker.mutex);
+
+    convolvers[pair].l.process(data_l, data_l, length);
+
+    pthread_mutex_lock(&channel_worker.mutex);
+    while (channel_worker.pending)
+      pthread_cond_wait(&channel_worker.done_cond, &channel_worker.mutex);
+    pthread_mutex_unlock(&channel_worker.mutex);
+  } else {
+    convolvers[pair].l.process(data_l, data_l, length);
+    convolvers[pair].r.process(data_r, data_r, length);
+  }
+
+  pair_users[pair]--;
 }
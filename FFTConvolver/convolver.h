@@ -5,9 +5,12 @@
 extern "C" {
 #endif
   
-int convolver_init(const char* file, int max_length);
-void convolver_process_l(float* data, int length);
-void convolver_process_r(float* data, int length);
+// The impulse response is resampled to sample_rate if necessary (only possible with soxr)
+int convolver_init(const char* file, int max_length, int block_size, int tail_block_size,
+                   int sample_rate);
+// The sample rate of the impulse response currently in use
+int convolver_sample_rate(void);
+void convolver_process(float* data_l, float* data_r, int length);
   
 #ifdef __cplusplus
 }
@@ -40,6 +40,7 @@
 
 #include "activity_monitor.h"
 #include "common.h"
+#include "realtime.h"
 #include "rtsp.h"
 
 #ifdef CONFIG_DBUS_INTERFACE
@@ -55,6 +56,69 @@ pthread_t activity_monitor_thread;
 pthread_mutex_t activity_monitor_mutex;
 pthread_cond_t activity_monitor_cv;
 
+// every change of state is counted and announced here, for activity_monitor_wait_for_change
+static uint64_t state_generation = 0;
+static pthread_mutex_t state_change_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t state_change_cv;
+static pthread_once_t state_change_cv_once = PTHREAD_ONCE_INIT;
+
+static void state_change_cv_init() {
+#ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  int rc = pthread_cond_init(&state_change_cv, &attr);
+  pthread_condattr_destroy(&attr);
+#endif
+#ifdef COMPILE_FOR_OSX
+  int rc = pthread_cond_init(&state_change_cv, NULL);
+#endif
+  if (rc)
+    die("activity_monitor: error %d initialising state_change_cv.", rc);
+}
+
+static void set_state(enum am_state new_state) {
+  state = new_state;
+  pthread_once(&state_change_cv_once, state_change_cv_init);
+  pthread_mutex_lock(&state_change_mutex);
+  state_generation++;
+  pthread_cond_broadcast(&state_change_cv);
+  pthread_mutex_unlock(&state_change_mutex);
+}
+
+uint64_t activity_monitor_generation() {
+  pthread_mutex_lock(&state_change_mutex);
+  uint64_t response = state_generation;
+  pthread_mutex_unlock(&state_change_mutex);
+  return response;
+}
+
+void activity_monitor_wait_for_change(uint64_t generation, uint64_t timeout_ns) {
+  pthread_once(&state_change_cv_once, state_change_cv_init);
+  pthread_mutex_lock(&state_change_mutex);
+  pthread_cleanup_push(pthread_cleanup_debug_mutex_unlock, (void *)&state_change_mutex);
+#ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
+  struct timespec time_of_wakeup;
+  absolute_time_to_timespec(get_absolute_time_in_ns() + timeout_ns, &time_of_wakeup);
+#endif
+#ifdef COMPILE_FOR_OSX
+  struct timespec time_to_wait;
+  time_to_wait.tv_sec = timeout_ns / 1000000000;
+  time_to_wait.tv_nsec = timeout_ns % 1000000000;
+#endif
+  int rc = 0;
+  while ((state_generation == generation) && (rc != ETIMEDOUT)) {
+#ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
+    rc = pthread_cond_timedwait(&state_change_cv, &state_change_mutex,
+                                &time_of_wakeup); // this is a pthread cancellation point
+#endif
+#ifdef COMPILE_FOR_OSX
+    rc = pthread_cond_timedwait_relative_np(&state_change_cv, &state_change_mutex, &time_to_wait);
+#endif
+  }
+  pthread_cleanup_pop(1); // release the mutex
+}
+
 void going_active(int block) {
   // debug(1, "activity_monitor: state transitioning to \"active\" with%s blocking", block ? "" :
   // "out");
@@ -67,13 +131,13 @@ void going_active(int block) {
 
 #ifdef CONFIG_DBUS_INTERFACE
   if (dbus_service_is_running())
-    shairport_sync_set_active(SHAIRPORT_SYNC(shairportSyncSkeleton), TRUE);
+    dbus_service_set_active(TRUE);
 #endif
 
   if (config.disable_standby_mode == disable_standby_auto) {
 #ifdef CONFIG_DBUS_INTERFACE
     if (dbus_service_is_running())
-      shairport_sync_set_disable_standby(SHAIRPORT_SYNC(shairportSyncSkeleton), TRUE);
+      dbus_service_set_disable_standby(TRUE);
     else
       config.keep_dac_busy = 1;
 #else
@@ -94,13 +158,13 @@ void going_inactive(int block) {
 
 #ifdef CONFIG_DBUS_INTERFACE
   if (dbus_service_is_running())
-    shairport_sync_set_active(SHAIRPORT_SYNC(shairportSyncSkeleton), FALSE);
+    dbus_service_set_active(FALSE);
 #endif
 
   if (config.disable_standby_mode == disable_standby_auto) {
 #ifdef CONFIG_DBUS_INTERFACE
     if (dbus_service_is_running())
-      shairport_sync_set_disable_standby(SHAIRPORT_SYNC(shairportSyncSkeleton), FALSE);
+      dbus_service_set_disable_standby(FALSE);
     else
       config.keep_dac_busy = 0;
 #else
@@ -149,6 +213,7 @@ void activity_thread_cleanup_handler(__attribute__((unused)) void *arg) {
 }
 
 void *activity_monitor_thread_code(void *arg) {
+  thread_set_name("activity-mon");
   int rc = pthread_mutex_init(&activity_monitor_mutex, NULL);
   if (rc)
     die("activity_monitor: error %d initialising activity_monitor_mutex.", rc);
@@ -169,11 +234,13 @@ void *activity_monitor_thread_code(void *arg) {
     die("activity_monitor: error %d initialising activity_monitor_cv.");
   pthread_cleanup_push(activity_thread_cleanup_handler, arg);
 
+#ifdef COMPILE_FOR_OSX
   uint64_t sec;
   uint64_t nsec;
+#endif
   struct timespec time_for_wait;
 
-  state = am_inactive;
+  set_state(am_inactive);
   player_state = ps_inactive;
 
   pthread_mutex_lock(&activity_monitor_mutex);
@@ -183,7 +250,7 @@ void *activity_monitor_thread_code(void *arg) {
       // debug(1,"am_state: am_inactive");
       while (player_state != ps_active)
         pthread_cond_wait(&activity_monitor_cv, &activity_monitor_mutex);
-      state = am_active;
+      set_state(am_active);
       // going_active(); // this is done in activity_monitor_signify_activity
       break;
     case am_active:
@@ -191,19 +258,16 @@ void *activity_monitor_thread_code(void *arg) {
       while (player_state != ps_inactive)
         pthread_cond_wait(&activity_monitor_cv, &activity_monitor_mutex);
       if (config.active_state_timeout == 0.0) {
-        state = am_inactive;
+        set_state(am_inactive);
         // going_inactive(); // this is done in activity_monitor_signify_activity
       } else {
-        state = am_timing_out;
+        set_state(am_timing_out);
 
         uint64_t time_to_wait_for_wakeup_ns = (uint64_t)(config.active_state_timeout * 1000000000);
 
 #ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
-        uint64_t time_of_wakeup_ns = get_absolute_time_in_ns() + time_to_wait_for_wakeup_ns;
-        sec = time_of_wakeup_ns / 1000000000;
-        nsec = time_of_wakeup_ns % 1000000000;
-        time_for_wait.tv_sec = sec;
-        time_for_wait.tv_nsec = nsec;
+        absolute_time_to_timespec(get_absolute_time_in_ns() + time_to_wait_for_wakeup_ns,
+                                  &time_for_wait);
 #endif
 
 #ifdef COMPILE_FOR_OSX
@@ -228,9 +292,9 @@ void *activity_monitor_thread_code(void *arg) {
 #endif
       }
       if (player_state == ps_active)
-        state = am_active; // player has gone active -- do nothing, because it's still active
+        set_state(am_active); // player has gone active -- do nothing, because it's still active
       else if (rc == ETIMEDOUT) {
-        state = am_inactive;
+        set_state(am_inactive);
         pthread_mutex_unlock(&activity_monitor_mutex);
         going_inactive(0); // don't wait for completion -- it makes no sense
         pthread_mutex_lock(&activity_monitor_mutex);
@@ -243,7 +307,7 @@ void *activity_monitor_thread_code(void *arg) {
       break;
     default:
       debug(1, "activity monitor in an illegal state!");
-      state = am_inactive;
+      set_state(am_inactive);
       break;
     }
   } while (1);
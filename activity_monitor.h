@@ -6,3 +6,12 @@ void activity_monitor_start();
 void activity_monitor_stop();
 void activity_monitor_signify_activity(int active); // 0 means inactive, non-zero means active
 enum am_state activity_status();                    // true if non inactive; false if inactive
+
+#include <stdint.h>
+
+// For threads with nothing to do while Shairport Sync is inactive, so that they can sleep for
+// longer without being late when it becomes active. Take the generation before looking at whatever
+// decides whether there's something to do, then, if there isn't, wait for up to timeout_ns for a
+// change of activity state after that generation.
+uint64_t activity_monitor_generation();
+void activity_monitor_wait_for_change(uint64_t generation, uint64_t timeout_ns);
@@ -40,6 +40,12 @@ static const int host_bigendian = 0;
 #include <stdint.h>
 #endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 #include "alac.h"
 
 #define _Swap32(v)                                                                                 \
@@ -53,10 +59,7 @@ static const int host_bigendian = 0;
     v = (((v)&0x00FF) << 0x08) | (((v)&0xFF00) >> 0x08);                                           \
   } while (0)
 
-struct {
-  signed int x : 24;
-} se_struct_24;
-#define SignExtend24(val) (se_struct_24.x = val)
+#define SignExtend24(val) SIGN_EXTENDED32((val), 24)
 
 void alac_free(alac_file *alac) {
   if (alac->predicterror_buffer_a)
@@ -135,77 +138,59 @@ void alac_set_info(alac_file *alac, char *inputbuffer) {
 
 /* stream reading */
 
-/* supports reading 1 to 16 bits, in big endian format */
-static uint32_t readbits_16(alac_file *alac, int bits) {
-  uint32_t result;
-  int new_accumulator;
-
-  result = (alac->input_buffer[0] << 16) | (alac->input_buffer[1] << 8) | (alac->input_buffer[2]);
-
-  /* shift left by the number of bits we've already read,
-   * so that the top 'n' bits of the 24 bits we read will
-   * be the return bits */
-  result = result << alac->input_buffer_bitaccumulator;
-
-  result = result & 0x00ffffff;
-
-  /* and then only want the top 'n' bits from that, where
-   * n is 'bits' */
-  result = result >> (24 - bits);
-
-  new_accumulator = (alac->input_buffer_bitaccumulator + bits);
-
-  /* increase the buffer pointer if we've read over n bytes. */
-  alac->input_buffer += (new_accumulator >> 3);
-
-  /* and the remainder goes back into the bit accumulator */
-  alac->input_buffer_bitaccumulator = (new_accumulator & 7);
-
-  return result;
+/* The bit stream is read through a 64-bit cache holding the next unread bits,
+ * most significant bit first. A refill tops the cache up to at least 56 bits
+ * with one unaligned big-endian load, so a whole rice-coded value can be
+ * decoded from the cache without refilling part way through. The stream is
+ * read as zeros past the end of the input buffer. */
+
+static inline uint64_t load_big_endian_64(const unsigned char *p) {
+  /* compilers turn this into a single load and byte swap */
+  return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) |
+         ((uint64_t)p[3] << 32) | ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+         ((uint64_t)p[6] << 8) | ((uint64_t)p[7]);
 }
 
-/* supports reading 1 to 32 bits, in big endian format */
-static uint32_t readbits(alac_file *alac, int bits) {
-  int32_t result = 0;
-
-  if (bits > 16) {
-    bits -= 16;
-    result = readbits_16(alac, 16) << bits;
+static inline void bitstream_refill(alac_bitstream *bs) {
+  if (bs->input_buffer_end - bs->input_buffer >= 8) {
+    /* the bits below bits_in_cache are the bits that follow in the stream, so ORing the same
+     * bits in again is harmless and no masking or branching on the count is needed */
+    bs->cache |= load_big_endian_64(bs->input_buffer) >> bs->bits_in_cache;
+    bs->input_buffer += (63 - bs->bits_in_cache) >> 3;
+    bs->bits_in_cache |= 56;
+  } else {
+    /* close to the end of the buffer, so go a byte at a time */
+    while (bs->bits_in_cache <= 56) {
+      if (bs->input_buffer < bs->input_buffer_end)
+        bs->cache |= (uint64_t)(*bs->input_buffer++) << (56 - bs->bits_in_cache);
+      bs->bits_in_cache += 8;
+    }
   }
-
-  result |= readbits_16(alac, bits);
-
-  return result;
 }
 
-/* reads a single bit */
-static int readbit(alac_file *alac) {
-  int result;
-  int new_accumulator;
-
-  result = alac->input_buffer[0];
-
-  result = result << alac->input_buffer_bitaccumulator;
-
-  result = result >> 7 & 1;
-
-  new_accumulator = (alac->input_buffer_bitaccumulator + 1);
-
-  alac->input_buffer += (new_accumulator / 8);
+/* returns the next 1 to 32 bits without consuming them -- they must already be in the cache */
+static inline uint32_t bitstream_peek(alac_bitstream *bs, int bits) {
+  return (uint32_t)(bs->cache >> (64 - bits));
+}
 
-  alac->input_buffer_bitaccumulator = (new_accumulator % 8);
+static inline void bitstream_skip(alac_bitstream *bs, int bits) {
+  bs->cache <<= bits;
+  bs->bits_in_cache -= bits;
+}
 
+/* supports reading 0 to 32 bits, in big endian format */
+static inline uint32_t bitstream_read(alac_bitstream *bs, int bits) {
+  uint32_t result;
+  if (bits == 0)
+    return 0;
+  bitstream_refill(bs);
+  result = bitstream_peek(bs, bits);
+  bitstream_skip(bs, bits);
   return result;
 }
 
-static void unreadbits(alac_file *alac, int bits) {
-  int new_accumulator = (alac->input_buffer_bitaccumulator - bits);
-
-  alac->input_buffer += (new_accumulator >> 3);
-
-  alac->input_buffer_bitaccumulator = (new_accumulator & 7);
-  if (alac->input_buffer_bitaccumulator < 0)
-    alac->input_buffer_bitaccumulator *= -1;
+static uint32_t readbits(alac_file *alac, int bits) {
+  return bitstream_read(&alac->bitstream, bits);
 }
 
 /* various implementations of count_leading_zero:
@@ -233,7 +218,10 @@ static int count_leading_zeros(int32_t input)
 /* for some reason the unrolled version (below) is
  * actually faster than this. yay intel!
  */
-static int count_leading_zeros(int input) { return __builtin_clz(input); }
+static inline int count_leading_zeros(int input) {
+  /* __builtin_clz(0) is undefined, the other versions give 32 */
+  return input ? __builtin_clz(input) : 32;
+}
 #elif defined(_MSC_VER) && defined(_M_IX86)
 static int count_leading_zeros(int input) {
   int output = 0;
@@ -299,36 +287,37 @@ found:
 
 #define RICE_THRESHOLD 8 // maximum number of bits for a rice prefix.
 
-static int32_t entropy_decode_value(alac_file *alac, int readSampleSize, int k,
-                                    int rice_kmodifier_mask) {
-  int32_t x = 0; // decoded value
+static inline int32_t entropy_decode_value(alac_bitstream *bs, int readSampleSize, int k,
+                                           int rice_kmodifier_mask) {
+  int32_t x; // decoded value
+
+  /* the prefix, the extra bits and an escaped raw value all fit in a freshly filled cache */
+  bitstream_refill(bs);
 
   // read x, number of 1s before 0 represent the rice value.
-  while (x <= RICE_THRESHOLD && readbit(alac)) {
-    x++;
-  }
+  // The extra bit ORed in stops the count at RICE_THRESHOLD + 1.
+  x = count_leading_zeros(~(uint32_t)(bs->cache >> 32) | (1 << (31 - (RICE_THRESHOLD + 1))));
 
   if (x > RICE_THRESHOLD) {
     // read the number from the bit stream (raw value)
-    int32_t value;
-
-    value = readbits(alac, readSampleSize);
-
-    // mask value
-    value &= (((uint32_t)0xffffffff) >> (32 - readSampleSize));
-
-    x = value;
+    bitstream_skip(bs, RICE_THRESHOLD + 1);
+    x = bitstream_peek(bs, readSampleSize);
+    bitstream_skip(bs, readSampleSize);
   } else {
-    if (k != 1) {
-      int extraBits = readbits(alac, k);
+    bitstream_skip(bs, x + 1); // the 1s and the terminating 0
+    if (k > 1) {
+      uint32_t extraBits = bitstream_peek(bs, k);
 
       // x = x * (2^k - 1)
       x *= (((1 << k) - 1) & rice_kmodifier_mask);
 
-      if (extraBits > 1)
+      // a value of 0 or 1 in the k bits is really k - 1 bits long
+      if (extraBits > 1) {
         x += extraBits - 1;
-      else
-        unreadbits(alac, 1);
+        bitstream_skip(bs, k);
+      } else {
+        bitstream_skip(bs, k - 1);
+      }
     }
   }
 
@@ -341,6 +330,8 @@ static void entropy_rice_decode(alac_file *alac, int32_t *outputBuffer, int outp
   int outputCount;
   int history = rice_initialhistory;
   int signModifier = 0;
+  /* a local copy of the bit stream lets the compiler keep it in registers */
+  alac_bitstream bs = alac->bitstream;
 
   for (outputCount = 0; outputCount < outputSize; outputCount++) {
     int32_t decodedValue;
@@ -355,7 +346,7 @@ static void entropy_rice_decode(alac_file *alac, int32_t *outputBuffer, int outp
       k = rice_kmodifier;
 
     // note: don't use rice_kmodifier_mask here (set mask to 0xFFFFFFFF)
-    decodedValue = entropy_decode_value(alac, readSampleSize, k, 0xFFFFFFFF);
+    decodedValue = entropy_decode_value(&bs, readSampleSize, k, 0xFFFFFFFF);
 
     decodedValue += signModifier;
     finalValue = (decodedValue + 1) / 2; // inc by 1 and shift out sign bit
@@ -381,7 +372,7 @@ static void entropy_rice_decode(alac_file *alac, int32_t *outputBuffer, int outp
       k = count_leading_zeros(history) + ((history + 16) / 64) - 24;
 
       // note: blockSize is always 16bit
-      blockSize = entropy_decode_value(alac, 16, k, rice_kmodifier_mask);
+      blockSize = entropy_decode_value(&bs, 16, k, rice_kmodifier_mask);
 
       // got blockSize 0s
       if (blockSize > 0) {
@@ -395,11 +386,79 @@ static void entropy_rice_decode(alac_file *alac, int32_t *outputBuffer, int outp
       history = 0;
     }
   }
+  alac->bitstream = bs;
 }
 
 #define SIGN_EXTENDED32(val, bits) ((val << (32 - bits)) >> (32 - bits))
 
-#define SIGN_ONLY(v) ((v < 0) ? (-1) : ((v > 0) ? (1) : (0)))
+#define SIGN_ONLY(v) (((v) > 0) - ((v) < 0)) /* -1, 0 or 1, without branching */
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/* The adaptive fir filter after the warm-up samples. It's always inlined, so when it's called
+ * with a constant predictor_coef_num, the compiler can unroll the loops and keep the
+ * coefficients in registers. */
+static ALWAYS_INLINE void fir_adapt(int32_t *error_buffer, int32_t *buffer_out, int output_size,
+                                    int readsamplesize, int16_t *predictor_coef_table,
+                                    const int predictor_coef_num, int predictor_quantitization) {
+  int i;
+  for (i = predictor_coef_num + 1; i < output_size; i++) {
+    int j;
+    int sum = 0;
+    int outval;
+    int error_val = error_buffer[i];
+    int32_t base = buffer_out[0];
+
+    for (j = 0; j < predictor_coef_num; j++) {
+      sum += (buffer_out[predictor_coef_num - j] - base) * predictor_coef_table[j];
+    }
+
+    outval = (1 << (predictor_quantitization - 1)) + sum;
+    outval = outval >> predictor_quantitization;
+    outval = outval + base + error_val;
+    outval = SIGN_EXTENDED32(outval, readsamplesize);
+
+    buffer_out[predictor_coef_num + 1] = outval;
+
+    if (error_val > 0) {
+      int predictor_num = predictor_coef_num - 1;
+
+      while (predictor_num >= 0 && error_val > 0) {
+        int val = base - buffer_out[predictor_coef_num - predictor_num];
+        int sign = SIGN_ONLY(val);
+
+        predictor_coef_table[predictor_num] -= sign;
+
+        val *= sign; /* absolute value */
+
+        error_val -= ((val >> predictor_quantitization) * (predictor_coef_num - predictor_num));
+
+        predictor_num--;
+      }
+    } else if (error_val < 0) {
+      int predictor_num = predictor_coef_num - 1;
+
+      while (predictor_num >= 0 && error_val < 0) {
+        int val = base - buffer_out[predictor_coef_num - predictor_num];
+        int sign = -SIGN_ONLY(val);
+
+        predictor_coef_table[predictor_num] -= sign;
+
+        val *= sign; /* neg value */
+
+        error_val -= ((val >> predictor_quantitization) * (predictor_coef_num - predictor_num));
+
+        predictor_num--;
+      }
+    }
+
+    buffer_out++;
+  }
+}
 
 static void predictor_decompress_fir_adapt(int32_t *error_buffer, int32_t *buffer_out,
                                            int output_size, int readsamplesize,
@@ -448,89 +507,253 @@ static void predictor_decompress_fir_adapt(int32_t *error_buffer, int32_t *buffe
     }
   }
 
-#if 0
-    /* 4 and 8 are very common cases (the only ones i've seen). these
-     * should be unrolled and optimised
-     */
-    if (predictor_coef_num == 4)
-    {
-        /* FIXME: optimised general case */
-        return;
-    }
-
-    if (predictor_coef_table == 8)
-    {
-        /* FIXME: optimised general case */
-        return;
-    }
-#endif
+  /* 4 and 8 are very common cases (the only ones i've seen),
+   * so they get their own unrolled versions */
+  switch (predictor_coef_num) {
+  case 4:
+    fir_adapt(error_buffer, buffer_out, output_size, readsamplesize, predictor_coef_table, 4,
+              predictor_quantitization);
+    break;
+  case 8:
+    fir_adapt(error_buffer, buffer_out, output_size, readsamplesize, predictor_coef_table, 8,
+              predictor_quantitization);
+    break;
+  default: /* general case */
+    fir_adapt(error_buffer, buffer_out, output_size, readsamplesize, predictor_coef_table,
+              predictor_coef_num, predictor_quantitization);
+    break;
+  }
+}
 
-  /* general case */
-  if (predictor_coef_num > 0) {
-    for (i = predictor_coef_num + 1; i < output_size; i++) {
-      int j;
-      int sum = 0;
-      int outval;
-      int error_val = error_buffer[i];
-
-      for (j = 0; j < predictor_coef_num; j++) {
-        sum += (buffer_out[predictor_coef_num - j] - buffer_out[0]) * predictor_coef_table[j];
-      }
+/* Vector versions of the stereo deinterlacing below. Each one does as many whole groups of
+ * samples as it can and returns how many samples it did, leaving the rest to the scalar code. */
 
-      outval = (1 << (predictor_quantitization - 1)) + sum;
-      outval = outval >> predictor_quantitization;
-      outval = outval + buffer_out[0] + error_val;
-      outval = SIGN_EXTENDED32(outval, readsamplesize);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
 
-      buffer_out[predictor_coef_num + 1] = outval;
+__attribute__((target("sse4.1"))) static inline void
+unmix_sse41(__m128i midright, __m128i difference, __m128i weight, __m128i shift, __m128i *left,
+            __m128i *right) {
+  *right = _mm_sub_epi32(midright, _mm_sra_epi32(_mm_mullo_epi32(difference, weight), shift));
+  *left = _mm_add_epi32(*right, difference);
+}
 
-      if (error_val > 0) {
-        int predictor_num = predictor_coef_num - 1;
+__attribute__((target("sse4.1"))) static int
+deinterlace_16_sse41(int32_t *buffer_a, int32_t *buffer_b, int16_t *buffer_out, int numsamples,
+                     uint8_t interlacing_shift, uint8_t interlacing_leftweight) {
+  __m128i weight = _mm_set1_epi32(interlacing_leftweight);
+  __m128i shift = _mm_cvtsi32_si128(interlacing_shift);
+  int i = 0;
+  for (; i + 4 <= numsamples; i += 4) {
+    __m128i left = _mm_loadu_si128((__m128i *)(buffer_a + i));
+    __m128i right = _mm_loadu_si128((__m128i *)(buffer_b + i));
+    if (interlacing_leftweight)
+      unmix_sse41(left, right, weight, shift, &left, &right);
+    __m128i lo = _mm_unpacklo_epi32(left, right);
+    __m128i hi = _mm_unpackhi_epi32(left, right);
+    /* keep the bottom 16 bits, as the conversion to int16_t does, so the pack can't saturate */
+    lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+    hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+    _mm_storeu_si128((__m128i *)(buffer_out + i * 2), _mm_packs_epi32(lo, hi));
+  }
+  return i;
+}
 
-        while (predictor_num >= 0 && error_val > 0) {
-          int val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
-          int sign = SIGN_ONLY(val);
+__attribute__((target("sse4.1"))) static int
+deinterlace_24_sse41(int32_t *buffer_a, int32_t *buffer_b, int uncompressed_bytes,
+                     int32_t *uncompressed_bytes_buffer_a, int32_t *uncompressed_bytes_buffer_b,
+                     uint8_t *buffer_out, int numsamples, uint8_t interlacing_shift,
+                     uint8_t interlacing_leftweight) {
+  __m128i weight = _mm_set1_epi32(interlacing_leftweight);
+  __m128i shift = _mm_cvtsi32_si128(interlacing_shift);
+  __m128i uncompressed_shift = _mm_cvtsi32_si128(uncompressed_bytes * 8);
+  __m128i mask = _mm_set1_epi32(~(0xFFFFFFFF << (uncompressed_bytes * 8)));
+  /* the bottom three bytes of each of four samples */
+  __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  int i = 0;
+  for (; i + 4 <= numsamples; i += 4) {
+    __m128i left = _mm_loadu_si128((__m128i *)(buffer_a + i));
+    __m128i right = _mm_loadu_si128((__m128i *)(buffer_b + i));
+    if (interlacing_leftweight)
+      unmix_sse41(left, right, weight, shift, &left, &right);
+    if (uncompressed_bytes) {
+      __m128i ua = _mm_loadu_si128((__m128i *)(uncompressed_bytes_buffer_a + i));
+      __m128i ub = _mm_loadu_si128((__m128i *)(uncompressed_bytes_buffer_b + i));
+      left = _mm_or_si128(_mm_sll_epi32(left, uncompressed_shift), _mm_and_si128(ua, mask));
+      right = _mm_or_si128(_mm_sll_epi32(right, uncompressed_shift), _mm_and_si128(ub, mask));
+    }
+    __m128i lo = _mm_shuffle_epi8(_mm_unpacklo_epi32(left, right), pack);
+    __m128i hi = _mm_shuffle_epi8(_mm_unpackhi_epi32(left, right), pack);
+    uint8_t *out = buffer_out + i * 6;
+    int32_t last;
+    _mm_storel_epi64((__m128i *)out, lo);
+    last = _mm_cvtsi128_si32(_mm_srli_si128(lo, 8));
+    memcpy(out + 8, &last, 4);
+    _mm_storel_epi64((__m128i *)(out + 12), hi);
+    last = _mm_cvtsi128_si32(_mm_srli_si128(hi, 8));
+    memcpy(out + 20, &last, 4);
+  }
+  return i;
+}
 
-          predictor_coef_table[predictor_num] -= sign;
+static int deinterlace_16_none(__attribute__((unused)) int32_t *buffer_a,
+                               __attribute__((unused)) int32_t *buffer_b,
+                               __attribute__((unused)) int16_t *buffer_out,
+                               __attribute__((unused)) int numsamples,
+                               __attribute__((unused)) uint8_t interlacing_shift,
+                               __attribute__((unused)) uint8_t interlacing_leftweight) {
+  return 0;
+}
 
-          val *= sign; /* absolute value */
+static int deinterlace_24_none(__attribute__((unused)) int32_t *buffer_a,
+                               __attribute__((unused)) int32_t *buffer_b,
+                               __attribute__((unused)) int uncompressed_bytes,
+                               __attribute__((unused)) int32_t *uncompressed_bytes_buffer_a,
+                               __attribute__((unused)) int32_t *uncompressed_bytes_buffer_b,
+                               __attribute__((unused)) uint8_t *buffer_out,
+                               __attribute__((unused)) int numsamples,
+                               __attribute__((unused)) uint8_t interlacing_shift,
+                               __attribute__((unused)) uint8_t interlacing_leftweight) {
+  return 0;
+}
 
-          error_val -= ((val >> predictor_quantitization) * (predictor_coef_num - predictor_num));
+static int (*deinterlace_16_impl)(int32_t *, int32_t *, int16_t *, int, uint8_t, uint8_t) = NULL;
+static int (*deinterlace_24_impl)(int32_t *, int32_t *, int, int32_t *, int32_t *, uint8_t *, int,
+                                  uint8_t, uint8_t) = NULL;
 
-          predictor_num--;
-        }
-      } else if (error_val < 0) {
-        int predictor_num = predictor_coef_num - 1;
+static void deinterlace_choose_impl(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.1")) {
+    deinterlace_24_impl = deinterlace_24_sse41;
+    deinterlace_16_impl = deinterlace_16_sse41;
+  } else {
+    deinterlace_24_impl = deinterlace_24_none;
+    deinterlace_16_impl = deinterlace_16_none;
+  }
+}
 
-        while (predictor_num >= 0 && error_val < 0) {
-          int val = buffer_out[0] - buffer_out[predictor_coef_num - predictor_num];
-          int sign = -SIGN_ONLY(val);
+static int deinterlace_16_simd(int32_t *buffer_a, int32_t *buffer_b, int16_t *buffer_out,
+                               int numsamples, uint8_t interlacing_shift,
+                               uint8_t interlacing_leftweight) {
+  if (deinterlace_16_impl == NULL)
+    deinterlace_choose_impl();
+  return deinterlace_16_impl(buffer_a, buffer_b, buffer_out, numsamples, interlacing_shift,
+                             interlacing_leftweight);
+}
 
-          predictor_coef_table[predictor_num] -= sign;
+static int deinterlace_24_simd(int32_t *buffer_a, int32_t *buffer_b, int uncompressed_bytes,
+                               int32_t *uncompressed_bytes_buffer_a,
+                               int32_t *uncompressed_bytes_buffer_b, uint8_t *buffer_out,
+                               int numsamples, uint8_t interlacing_shift,
+                               uint8_t interlacing_leftweight) {
+  if (deinterlace_24_impl == NULL)
+    deinterlace_choose_impl();
+  return deinterlace_24_impl(buffer_a, buffer_b, uncompressed_bytes, uncompressed_bytes_buffer_a,
+                             uncompressed_bytes_buffer_b, buffer_out, numsamples,
+                             interlacing_shift, interlacing_leftweight);
+}
 
-          val *= sign; /* neg value */
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
 
-          error_val -= ((val >> predictor_quantitization) * (predictor_coef_num - predictor_num));
+static inline void unmix_neon(int32x4_t midright, int32x4_t difference, int32x4_t weight,
+                              int32x4_t shift, int32x4_t *left, int32x4_t *right) {
+  *right = vsubq_s32(midright, vshlq_s32(vmulq_s32(difference, weight), shift));
+  *left = vaddq_s32(*right, difference);
+}
 
-          predictor_num--;
-        }
-      }
+static int deinterlace_16_simd(int32_t *buffer_a, int32_t *buffer_b, int16_t *buffer_out,
+                               int numsamples, uint8_t interlacing_shift,
+                               uint8_t interlacing_leftweight) {
+  int32x4_t weight = vdupq_n_s32(interlacing_leftweight);
+  int32x4_t shift = vdupq_n_s32(-interlacing_shift); // a negative shift count is a right shift
+  int i = 0;
+  for (; i + 4 <= numsamples; i += 4) {
+    int32x4_t left = vld1q_s32(buffer_a + i);
+    int32x4_t right = vld1q_s32(buffer_b + i);
+    int16x4x2_t out;
+    if (interlacing_leftweight)
+      unmix_neon(left, right, weight, shift, &left, &right);
+    out.val[0] = vmovn_s32(left);
+    out.val[1] = vmovn_s32(right);
+    vst2_s16(buffer_out + i * 2, out); // interleaves the two channels
+  }
+  return i;
+}
 
-      buffer_out++;
+static int deinterlace_24_simd(int32_t *buffer_a, int32_t *buffer_b, int uncompressed_bytes,
+                               int32_t *uncompressed_bytes_buffer_a,
+                               int32_t *uncompressed_bytes_buffer_b, uint8_t *buffer_out,
+                               int numsamples, uint8_t interlacing_shift,
+                               uint8_t interlacing_leftweight) {
+  int32x4_t weight = vdupq_n_s32(interlacing_leftweight);
+  int32x4_t shift = vdupq_n_s32(-interlacing_shift);
+  int32x4_t uncompressed_shift = vdupq_n_s32(uncompressed_bytes * 8);
+  int32x4_t mask = vdupq_n_s32(~(0xFFFFFFFF << (uncompressed_bytes * 8)));
+  int i = 0;
+  for (; i + 4 <= numsamples; i += 4) {
+    int32x4_t left = vld1q_s32(buffer_a + i);
+    int32x4_t right = vld1q_s32(buffer_b + i);
+    if (interlacing_leftweight)
+      unmix_neon(left, right, weight, shift, &left, &right);
+    if (uncompressed_bytes) {
+      int32x4_t ua = vld1q_s32(uncompressed_bytes_buffer_a + i);
+      int32x4_t ub = vld1q_s32(uncompressed_bytes_buffer_b + i);
+      left = vorrq_s32(vshlq_s32(left, uncompressed_shift), vandq_s32(ua, mask));
+      right = vorrq_s32(vshlq_s32(right, uncompressed_shift), vandq_s32(ub, mask));
+    }
+    /* split the interleaved samples into planes of their bottom, middle and top bytes and
+     * let vst3 interleave the planes again */
+    int32x4x2_t lr = vzipq_s32(left, right);
+    uint8x8x3_t out;
+    int b;
+    for (b = 0; b < 3; b++) {
+      uint32x4_t lo = vshlq_u32(vreinterpretq_u32_s32(lr.val[0]), vdupq_n_s32(-8 * b));
+      uint32x4_t hi = vshlq_u32(vreinterpretq_u32_s32(lr.val[1]), vdupq_n_s32(-8 * b));
+      out.val[b] = vmovn_u16(vcombine_u16(vmovn_u32(lo), vmovn_u32(hi)));
     }
+    vst3_u8(buffer_out + i * 6, out);
   }
+  return i;
+}
+
+#else
+
+static int deinterlace_16_simd(__attribute__((unused)) int32_t *buffer_a,
+                               __attribute__((unused)) int32_t *buffer_b,
+                               __attribute__((unused)) int16_t *buffer_out,
+                               __attribute__((unused)) int numsamples,
+                               __attribute__((unused)) uint8_t interlacing_shift,
+                               __attribute__((unused)) uint8_t interlacing_leftweight) {
+  return 0;
+}
+
+static int deinterlace_24_simd(__attribute__((unused)) int32_t *buffer_a,
+                               __attribute__((unused)) int32_t *buffer_b,
+                               __attribute__((unused)) int uncompressed_bytes,
+                               __attribute__((unused)) int32_t *uncompressed_bytes_buffer_a,
+                               __attribute__((unused)) int32_t *uncompressed_bytes_buffer_b,
+                               __attribute__((unused)) uint8_t *buffer_out,
+                               __attribute__((unused)) int numsamples,
+                               __attribute__((unused)) uint8_t interlacing_shift,
+                               __attribute__((unused)) uint8_t interlacing_leftweight) {
+  return 0;
 }
 
+#endif
+
 static void deinterlace_16(int32_t *buffer_a, int32_t *buffer_b, int16_t *buffer_out,
                            int numchannels, int numsamples, uint8_t interlacing_shift,
                            uint8_t interlacing_leftweight) {
-  int i;
+  int i = 0;
   if (numsamples <= 0)
     return;
 
+  if ((numchannels == 2) && (!host_bigendian))
+    i = deinterlace_16_simd(buffer_a, buffer_b, buffer_out, numsamples, interlacing_shift,
+                            interlacing_leftweight);
+
   /* weighted interlacing */
   if (interlacing_leftweight) {
-    for (i = 0; i < numsamples; i++) {
+    for (; i < numsamples; i++) {
       int32_t difference, midright;
       int16_t left;
       int16_t right;
@@ -555,7 +778,7 @@ static void deinterlace_16(int32_t *buffer_a, int32_t *buffer_b, int16_t *buffer
   }
 
   /* otherwise basic interlacing took place */
-  for (i = 0; i < numsamples; i++) {
+  for (; i < numsamples; i++) {
     int16_t left, right;
 
     left = buffer_a[i];
@@ -577,13 +800,18 @@ static void deinterlace_24(int32_t *buffer_a, int32_t *buffer_b, int uncompresse
                            int32_t *uncompressed_bytes_buffer_b, void *buffer_out, int numchannels,
                            int numsamples, uint8_t interlacing_shift,
                            uint8_t interlacing_leftweight) {
-  int i;
+  int i = 0;
   if (numsamples <= 0)
     return;
 
+  if (numchannels == 2)
+    i = deinterlace_24_simd(buffer_a, buffer_b, uncompressed_bytes, uncompressed_bytes_buffer_a,
+                            uncompressed_bytes_buffer_b, buffer_out, numsamples, interlacing_shift,
+                            interlacing_leftweight);
+
   /* weighted interlacing */
   if (interlacing_leftweight) {
-    for (i = 0; i < numsamples; i++) {
+    for (; i < numsamples; i++) {
       int32_t difference, midright;
       int32_t left;
       int32_t right;
@@ -616,7 +844,7 @@ static void deinterlace_24(int32_t *buffer_a, int32_t *buffer_b, int uncompresse
   }
 
   /* otherwise basic interlacing took place */
-  for (i = 0; i < numsamples; i++) {
+  for (; i < numsamples; i++) {
     int32_t left, right;
 
     left = buffer_a[i];
@@ -641,14 +869,17 @@ static void deinterlace_24(int32_t *buffer_a, int32_t *buffer_b, int uncompresse
   }
 }
 
-void alac_decode_frame(alac_file *alac, unsigned char *inbuffer, void *outbuffer, int *outputsize) {
+void alac_decode_frame(alac_file *alac, unsigned char *inbuffer, int inbuffer_size, void *outbuffer,
+                       int *outputsize) {
   int outbuffer_allocation_size = *outputsize; // initial value
   int channels;
   int32_t outputsamples = alac->setinfo_max_samples_per_frame;
 
   /* setup the stream */
-  alac->input_buffer = inbuffer;
-  alac->input_buffer_bitaccumulator = 0;
+  alac->bitstream.input_buffer = inbuffer;
+  alac->bitstream.input_buffer_end = inbuffer + inbuffer_size;
+  alac->bitstream.cache = 0;
+  alac->bitstream.bits_in_cache = 0;
 
   channels = readbits(alac, 3);
 
@@ -35,15 +35,21 @@
 typedef struct alac_file alac_file;
 
 alac_file *alac_create(int samplesize, int numchannels);
-void alac_decode_frame(alac_file *alac, unsigned char *inbuffer, void *outbuffer, int *outputsize);
+void alac_decode_frame(alac_file *alac, unsigned char *inbuffer, int inbuffer_size, void *outbuffer,
+                       int *outputsize);
 void alac_set_info(alac_file *alac, char *inputbuffer);
 void alac_allocate_buffers(alac_file *alac);
 void alac_free(alac_file *alac);
 
+typedef struct {
+  unsigned char *input_buffer;     /* the next byte to be loaded into the cache */
+  unsigned char *input_buffer_end; /* reads beyond this return zeros */
+  uint64_t cache;                  /* unread bits, most significant bit first */
+  int bits_in_cache;
+} alac_bitstream;
+
 struct alac_file {
-  unsigned char *input_buffer;
-  int input_buffer_bitaccumulator; /* used so we can do arbitrary
-                                      bit reads */
+  alac_bitstream bitstream;
 
   int samplesize;
   int numchannels;
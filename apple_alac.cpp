@@ -24,6 +24,7 @@
  * OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <new>
 #include <string.h>
 
 // these are headers for the ALAC decoder, utilities and endian utilities
@@ -39,10 +40,16 @@ typedef struct magicCookie {
   ALACAudioChannelLayout channelLayoutInfo; // seems to be unused
 } magicCookie;
 
-magicCookie cookie;
-ALACDecoder *theDecoder;
+struct apple_alac_decoder {
+  magicCookie cookie;
+  ALACDecoder theDecoder;
+};
 
-extern "C" int apple_alac_init(int32_t fmtp[12]) {
+extern "C" apple_alac_decoder *apple_alac_create(int32_t fmtp[12]) {
+  apple_alac_decoder *decoder = new (std::nothrow) apple_alac_decoder;
+  if (decoder == NULL)
+    return NULL;
+  magicCookie &cookie = decoder->cookie;
 
   memset(&cookie, 0, sizeof(magicCookie));
 
@@ -61,24 +68,26 @@ extern "C" int apple_alac_init(int32_t fmtp[12]) {
   cookie.config.avgBitRate = Swap32NtoB(fmtp[10]);   // uint32_t should be 0;;
   cookie.config.sampleRate = Swap32NtoB(fmtp[11]);   // uint32_t expected to be 44100;
 
-  theDecoder = new ALACDecoder;
-  theDecoder->Init(&cookie, sizeof(magicCookie));
+  if (decoder->theDecoder.Init(&cookie, sizeof(magicCookie)) != 0) {
+    delete decoder;
+    return NULL;
+  }
 
-  return 0;
+  return decoder;
 }
 
-extern "C" int apple_alac_decode_frame(unsigned char *sampleBuffer, uint32_t bufferLength,
-                                       unsigned char *dest, int *outsize) {
+extern "C" int apple_alac_decode_frame(apple_alac_decoder *decoder, unsigned char *sampleBuffer,
+                                       uint32_t bufferLength, unsigned char *dest, int *outsize) {
   uint32_t numFrames = 0;
   BitBuffer theInputBuffer;
   BitBufferInit(&theInputBuffer, sampleBuffer, bufferLength);
-  theDecoder->Decode(&theInputBuffer, dest, Swap32BtoN(cookie.config.frameLength),
-                     cookie.config.numChannels, &numFrames);
+  decoder->theDecoder.Decode(&theInputBuffer, dest, Swap32BtoN(decoder->cookie.config.frameLength),
+                             decoder->cookie.config.numChannels, &numFrames);
   *outsize = numFrames;
   return 0;
 }
 
-extern "C" int apple_alac_terminate() {
-  delete (theDecoder);
+extern "C" int apple_alac_destroy(apple_alac_decoder *decoder) {
+  delete decoder;
   return 0;
 }
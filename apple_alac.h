@@ -35,10 +35,13 @@
 #define EXTERNC
 #endif
 
-EXTERNC int apple_alac_init(int32_t fmtp[12]);
-EXTERNC int apple_alac_terminate();
-EXTERNC int apple_alac_decode_frame(unsigned char *sampleBuffer, uint32_t bufferLength,
-                                    unsigned char *dest, int *outsize);
+// each stream gets its own decoder, so decoders can be used concurrently
+typedef struct apple_alac_decoder apple_alac_decoder;
+
+EXTERNC apple_alac_decoder *apple_alac_create(int32_t fmtp[12]); // NULL if it can't be created
+EXTERNC int apple_alac_destroy(apple_alac_decoder *decoder);
+EXTERNC int apple_alac_decode_frame(apple_alac_decoder *decoder, unsigned char *sampleBuffer,
+                                    uint32_t bufferLength, unsigned char *dest, int *outsize);
 
 #undef EXTERNC
 
@@ -58,6 +58,9 @@ extern audio_output audio_pipe;
 #ifdef CONFIG_STDOUT
 extern audio_output audio_stdout;
 #endif
+#ifdef CONFIG_MULTI
+extern audio_output audio_multi;
+#endif
 
 static audio_output *outputs[] = {
 #ifdef CONFIG_ALSA
@@ -84,6 +87,9 @@ static audio_output *outputs[] = {
 #ifdef CONFIG_STDOUT
     &audio_stdout,
 #endif
+#ifdef CONFIG_MULTI
+    &audio_multi,
+#endif
 #ifdef CONFIG_DUMMY
     &audio_dummy,
 #endif
@@ -103,6 +109,47 @@ audio_output *audio_get_output(const char *name) {
   return NULL;
 }
 
+// leave the first couple of seconds out of the measurement, as the ALSA backend does, because
+// the rate is often unsteady as a device starts
+#define AUDIO_RATE_MEASUREMENT_SETTLING_TIME 2000000000
+
+void audio_rate_measurement_reset(audio_rate_measurement *m) {
+  memset(m, 0, sizeof(audio_rate_measurement));
+}
+
+void audio_rate_measurement_update(audio_rate_measurement *m, uint64_t time_ns,
+                                   uint64_t frames_played) {
+  if (m->first_update_time == 0) {
+    m->first_update_time = time_ns;
+  } else if ((m->valid == 0) &&
+             (time_ns - m->first_update_time >= AUDIO_RATE_MEASUREMENT_SETTLING_TIME)) {
+    m->start_time = time_ns;
+    m->frames_played_at_start_time = frames_played;
+    m->valid = 1;
+  }
+  // the measurement can't go backwards -- if the device's clock or frame count does, start again
+  if ((m->valid) && ((time_ns < m->start_time) || (frames_played < m->frames_played_at_start_time)))
+    audio_rate_measurement_reset(m);
+  else if (m->valid) {
+    m->time = time_ns;
+    m->frames_played_at_time = frames_played;
+  }
+}
+
+int audio_rate_measurement_get(audio_rate_measurement *m, uint64_t *elapsed_time,
+                               uint64_t *frames_played) {
+  int response = -1;
+  if ((m->valid) && (m->time > m->start_time)) {
+    *elapsed_time = m->time - m->start_time;
+    *frames_played = m->frames_played_at_time - m->frames_played_at_start_time;
+    response = 0;
+  } else {
+    *elapsed_time = 0;
+    *frames_played = 0;
+  }
+  return response;
+}
+
 void audio_ls_outputs(void) {
   audio_output **out;
 
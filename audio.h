@@ -27,6 +27,12 @@ typedef struct {
   int (*play)(void *buf, int samples);
   void (*stop)(void);
 
+  // may be NULL, in which case stop is used.
+  // Called in place of stop when another session is taking over from the one playing: discard
+  // what's waiting to be played but keep the device open for the next session, which should start
+  // within a few seconds. If it doesn't, the backend should close the device itself.
+  void (*hand_over)(void);
+
   // may be null if no implemented
   int (*is_running)(
       void); // if implemented, will return 0 if everything is okay, non-zero otherwise
@@ -34,6 +40,11 @@ typedef struct {
   // may be null if not implemented
   void (*flush)(void);
 
+  // may be NULL. Called when a flush to a given frame -- a seek or a skip -- is carried out, to
+  // throw away what's waiting to be played. Only a backend that holds much more than the fraction
+  // of a second a DAC does needs it; otherwise the audio before the flush is left to play out.
+  void (*discard)(void);
+
   // returns the delay before the next frame to be sent to the device would actually be audible.
   // almost certainly wrong if the buffer is empty, so put silent buffers into it to make it busy.
   // will change dynamically, so keep watching it. Implemented in ALSA only.
@@ -42,6 +53,13 @@ typedef struct {
   int (*rate_info)(uint64_t *elapsed_time,
                    uint64_t *frames_played); // use this to get the true rate of the DAC
 
+  // may be NULL, in which case output is given to play().
+  // Otherwise, get_write_buffer returns a place with room for the given number of frames in the
+  // output format, in the device's own buffer, or NULL if that's not possible just now.
+  // The frames written there, which may be fewer, must then be passed to commit in place of play().
+  void *(*get_write_buffer)(int frames);
+  int (*commit)(int frames);
+
   // may be NULL, in which case soft volume is applied
   void (*volume)(double vol);
 
@@ -54,6 +72,25 @@ typedef struct {
 
 } audio_output;
 
+// A running measurement of the rate at which a device is really playing frames, for backends
+// that can tell when a given frame was played. Used to implement rate_info.
+typedef struct {
+  uint64_t first_update_time; // zero if nothing has been seen since the last reset
+  uint64_t start_time;
+  uint64_t frames_played_at_start_time;
+  uint64_t time;
+  uint64_t frames_played_at_time;
+  int valid; // set once the device has been playing for long enough to settle down
+} audio_rate_measurement;
+
+void audio_rate_measurement_reset(audio_rate_measurement *m);
+// frames_played is the number of frames the device had played at time_ns, the monotonic time
+void audio_rate_measurement_update(audio_rate_measurement *m, uint64_t time_ns,
+                                   uint64_t frames_played);
+// returns 0 and the elapsed time in nanoseconds and frames played in it, or -1 if not yet valid
+int audio_rate_measurement_get(audio_rate_measurement *m, uint64_t *elapsed_time,
+                               uint64_t *frames_played);
+
 audio_output *audio_get_output(const char *name);
 void audio_ls_outputs(void);
 void parse_general_audio_options(void);
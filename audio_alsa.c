@@ -31,6 +31,7 @@
 #include <inttypes.h>
 #include <math.h>
 #include <memory.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -40,6 +41,13 @@
 #include "activity_monitor.h"
 #include "audio.h"
 #include "common.h"
+#include "metrics.h"
+#include "realtime.h"
+#include "silence.h"
+
+#ifdef CONFIG_SOXR
+#include <soxr.h>
+#endif
 
 enum alsa_backend_mode {
   abm_disconnected,
@@ -58,6 +66,7 @@ static void deinit(void);
 static void start(int i_sample_rate, int i_sample_format);
 static int play(void *buf, int samples);
 static void stop(void);
+static void hand_over(void);
 static void flush(void);
 int delay(long *the_delay);
 int get_rate_information(uint64_t *elapsed_time, uint64_t *frames_played);
@@ -67,6 +76,8 @@ static void volume(double vol);
 void do_volume(double vol);
 int prepare(void);
 int do_play(void *buf, int samples);
+static void *get_write_buffer(int frames);
+static int commit(int frames);
 
 static void parameters(audio_parameters *info);
 int mute(int do_mute); // returns true if it actually is allowed to use the mute
@@ -84,11 +95,14 @@ audio_output audio_alsa = {
     .prepare = &prepare,
     .start = &start,
     .stop = &stop,
+    .hand_over = &hand_over,
     .is_running = NULL,
     .flush = &flush,
     .delay = &delay,
     .play = &play,
     .rate_info = &get_rate_information,
+    .get_write_buffer = NULL, // provided if mmap_zero_copy is enabled
+    .commit = NULL,
     .mute = NULL,        // a function will be provided if it can, and is allowed to,
                          // do hardware mute
     .volume = NULL,      // a function will be provided if it can do hardware volume
@@ -126,6 +140,17 @@ int alsa_device_initialised; // boolean to ensure the initialisation is only
 yndk_type precision_delay_available_status =
     YNDK_DONT_KNOW; // initially, we don't know if the device can do precision delay
 
+// The output format and rate found by automatic setup are remembered, along with the identity of
+// the device they were found for, so that the formats and rates the device doesn't support don't
+// have to be tried again every time it's opened. Likewise, the mixer is kept open once it has been
+// found. They're forgotten if the device can't be opened or set up, or goes away, or if a
+// different device appears under the same name.
+static int output_format_cached = 0;
+static sps_format_t cached_output_format;
+static int output_rate_cached = 0;
+static unsigned int cached_output_rate;
+static char cached_device_identity[256];
+
 snd_pcm_t *alsa_handle = NULL;
 static snd_pcm_hw_params_t *alsa_params = NULL;
 static snd_pcm_sw_params_t *alsa_swparams = NULL;
@@ -143,7 +168,7 @@ static char *alsa_mix_ctrl = NULL;
 static int alsa_mix_index = 0;
 static int has_softvol = 0;
 
-int64_t dither_random_number_store = 0;
+static size_t alsa_silence_position; // for the silence played by the backend itself
 
 static int volume_set_request = 0; // set when an external request is made to set the volume.
 
@@ -158,6 +183,27 @@ int volume_based_mute_is_active =
 // use this to allow the use of snd_pcm_writei or snd_pcm_mmap_writei
 snd_pcm_sframes_t (*alsa_pcm_write)(snd_pcm_t *, const void *, snd_pcm_uframes_t) = snd_pcm_writei;
 
+// the size of the device's buffer, and the avail_min it was opened with
+static snd_pcm_uframes_t alsa_buffer_frames;
+static snd_pcm_uframes_t alsa_default_avail_min;
+// the avail_min now in use, so the buffer monitor is woken when the buffer has drained
+static snd_pcm_uframes_t alsa_avail_min;
+
+// set if the device can give audio timestamps from the link, which are the most precise
+static int alsa_link_audio_timestamps;
+
+// The delay the device reported at the moment of its own timestamp, from the last status read,
+// before it was brought forward to the present at the nominal rate.
+// The DAC rate measurements use this, when there is one, so that they don't depend on the rate they
+// are trying to measure.
+static uint64_t status_time;
+static snd_pcm_sframes_t status_delay;
+static int status_time_is_valid;
+
+// the part of the device's buffer handed out by get_write_buffer, if any, waiting for commit
+static snd_pcm_uframes_t direct_write_offset;
+static snd_pcm_uframes_t direct_write_frames; // zero if nothing has been handed out
+
 int precision_delay_and_status(snd_pcm_state_t *state, snd_pcm_sframes_t *delay,
                                yndk_type *using_update_timestamps);
 int standard_delay_and_status(snd_pcm_state_t *state, snd_pcm_sframes_t *delay,
@@ -193,46 +239,38 @@ int precision_delay_available() {
     // and then we check the delay return. It will tell us if it
     // was able to use the (non-zero) update timestamps
 
-    int frames_of_silence = 4410;
-    size_t size_of_silence_buffer = frames_of_silence * frame_size;
-    void *silence = malloc(size_of_silence_buffer);
-    if (silence == NULL) {
-      debug(1, "alsa: precision_delay_available -- failed to "
-               "allocate memory for a "
-               "silent frame buffer.");
-    } else {
-      pthread_cleanup_push(malloc_cleanup, silence);
-      int use_dither = 0;
-      if ((alsa_mix_ctrl == NULL) && (config.ignore_volume_control == 0) &&
-          (config.airplay_volume != 0.0))
-        use_dither = 1;
-      dither_random_number_store =
-          generate_zero_frames(silence, frames_of_silence, config.output_format,
-                               use_dither, // i.e. with dither
-                               dither_random_number_store);
-      do_play(silence, frames_of_silence);
-      pthread_cleanup_pop(1);
-      // now we can get the delay, and we'll note if it uses update timestamps
-      yndk_type uses_update_timestamps;
-      snd_pcm_state_t state;
-      snd_pcm_sframes_t delay;
-      int ret = precision_delay_and_status(&state, &delay, &uses_update_timestamps);
-      // debug(3,"alsa: precision_delay_available asking for delay and status with a return status
-      // of %d, a delay of %ld and a uses_update_timestamps of %d.", ret, delay,
-      // uses_update_timestamps);
-      if (ret == 0) {
-        if ((uses_update_timestamps == YNDK_YES) && (is_a_real_hardware_device)) {
-          precision_delay_available_status = YNDK_YES;
-          debug(2, "alsa: precision delay timing is available.");
+    int use_dither = 0;
+    if ((alsa_mix_ctrl == NULL) && (config.ignore_volume_control == 0) &&
+        (config.airplay_volume != 0.0))
+      use_dither = 1;
+    size_t frames_of_silence = 4410;
+    while (frames_of_silence > 0) {
+      size_t frames;
+      const void *silence = silence_get(config.output_format, use_dither, frames_of_silence,
+                                        &alsa_silence_position, &frames);
+      do_play((void *)silence, frames);
+      frames_of_silence -= frames;
+    }
+    // now we can get the delay, and we'll note if it uses update timestamps
+    yndk_type uses_update_timestamps;
+    snd_pcm_state_t state;
+    snd_pcm_sframes_t delay;
+    int ret = precision_delay_and_status(&state, &delay, &uses_update_timestamps);
+    // debug(3,"alsa: precision_delay_available asking for delay and status with a return status
+    // of %d, a delay of %ld and a uses_update_timestamps of %d.", ret, delay,
+    // uses_update_timestamps);
+    if (ret == 0) {
+      if ((uses_update_timestamps == YNDK_YES) && (is_a_real_hardware_device)) {
+        precision_delay_available_status = YNDK_YES;
+        debug(2, "alsa: precision delay timing is available.");
+      } else {
+        if ((uses_update_timestamps == YNDK_YES) && (!is_a_real_hardware_device)) {
+          debug(2, "alsa: precision delay timing is not available because it's not definitely a "
+                   "hardware device.");
         } else {
-          if ((uses_update_timestamps == YNDK_YES) && (!is_a_real_hardware_device)) {
-            debug(2, "alsa: precision delay timing is not available because it's not definitely a "
-                     "hardware device.");
-          } else {
-            debug(2, "alsa: precision delay timing is not available.");
-          }
-          precision_delay_available_status = YNDK_NO;
+          debug(2, "alsa: precision delay timing is not available.");
         }
+        precision_delay_available_status = YNDK_NO;
       }
     }
   }
@@ -251,11 +289,55 @@ static uint64_t frames_played_at_measurement_start_time;
 
 static uint64_t measurement_time;
 static uint64_t frames_played_at_measurement_time;
+static int measurement_uses_status_time; // set if the measurements are at the device's timestamps
 
 static uint64_t frames_sent_for_playing;
 static uint64_t frame_index;
 static int measurement_data_is_valid;
 
+// while a session hands over to another, the device is kept open until then -- see hand_over()
+static uint64_t handover_deadline;
+
+#ifdef CONFIG_SOXR
+// If alsa.resample_to_rate is set, the player's output, at config.output_rate, is converted by
+// soxr to that rate before it's written to the device, for DACs that don't take multiples of
+// 44,100. The device and everything that watches it -- the stall monitor, the DAC rate
+// measurements, the buffer monitor -- work in the device's frames; delay() and
+// get_rate_information() convert them back into the player's frames.
+typedef struct {
+  int recipe;
+  const char *name;
+} resample_quality_record;
+
+static resample_quality_record resample_qualities[] = {
+    {SOXR_VHQ, "very high"}, {SOXR_HQ, "high"}, {SOXR_MQ, "medium"},
+    {SOXR_LQ, "low"},        {SOXR_QQ, "quick"}, {-1, NULL}};
+
+static unsigned int resample_to_rate = 0; // zero means the device plays at config.output_rate
+static int resample_quality = SOXR_HQ;
+static soxr_t resampler = NULL;
+static char *resample_buffer = NULL;
+static size_t resample_buffer_frames = 0;
+#endif
+
+// the rate the device itself is playing at
+static unsigned int device_rate() {
+#ifdef CONFIG_SOXR
+  if (resample_to_rate != 0)
+    return resample_to_rate;
+#endif
+  return config.output_rate;
+}
+
+// convert frames at the device's rate into frames at the player's rate
+static uint64_t device_frames_to_output_frames(uint64_t frames) {
+#ifdef CONFIG_SOXR
+  if (resample_to_rate != 0)
+    return (frames * config.output_rate) / resample_to_rate;
+#endif
+  return frames;
+}
+
 static void help(void) {
   printf("    -d output-device    set the output device, default is \"default\".\n"
          "    -c mixer-control    set the mixer control name, default is to use no mixer.\n"
@@ -270,10 +352,14 @@ static void help(void) {
 
 void set_alsa_out_dev(char *dev) { alsa_out_dev = dev; }
 
+void close_mixer();
+
 // assuming pthread cancellation is disabled
 int open_mixer() {
   int response = 0;
-  if (alsa_mix_ctrl != NULL) {
+  if ((alsa_mix_handle != NULL) && (alsa_mix_elem != NULL)) {
+    response = 1; // it's still open from the last time
+  } else if (alsa_mix_ctrl != NULL) {
     debug(3, "Open Mixer");
     int ret = 0;
     snd_mixer_selem_id_alloca(&alsa_mix_sid);
@@ -310,6 +396,8 @@ int open_mixer() {
         }
       }
     }
+    if (response != 1)
+      close_mixer();
   }
   return response;
 }
@@ -320,6 +408,42 @@ void close_mixer() {
     snd_mixer_close(alsa_mix_handle);
     alsa_mix_handle = NULL;
   }
+  alsa_mix_elem = NULL;
+}
+
+// Forget the cached output format and rate and close the mixer, which will be reopened when it's
+// next needed. If the device has changed, its mixer will be prepared again too.
+// The alsa mutex is assumed to be held, and pthread cancellation disabled.
+static void invalidate_device_capabilities(int device_has_changed) {
+  if ((output_format_cached) || (output_rate_cached))
+    debug(2, "alsa: forgetting the output format and rate found for \"%s\".", alsa_out_dev);
+  output_format_cached = 0;
+  output_rate_cached = 0;
+  pthread_mutex_lock(&alsa_mixer_mutex);
+  close_mixer();
+  pthread_mutex_unlock(&alsa_mixer_mutex);
+  if (device_has_changed) {
+    cached_device_identity[0] = '\0';
+    precision_delay_available_status = YNDK_DONT_KNOW;
+    alsa_device_initialised = 0;
+  }
+}
+
+// describe the device just opened well enough to tell if a different one appears under its name
+static void get_device_identity(char *identity, size_t size) {
+  snd_pcm_info_t *info;
+  snd_pcm_info_alloca(&info);
+  identity[0] = '\0';
+  if (snd_pcm_info(alsa_handle, info) == 0) {
+    int card = snd_pcm_info_get_card(info);
+    char *card_name = NULL;
+    if (card >= 0)
+      snd_card_get_longname(card, &card_name);
+    snprintf(identity, size, "%d,%u \"%s\" \"%s\" \"%s\"", card, snd_pcm_info_get_device(info),
+             snd_pcm_info_get_id(info), snd_pcm_info_get_name(info),
+             card_name ? card_name : "");
+    free(card_name);
+  }
 }
 
 // assuming pthread cancellation is disabled
@@ -327,8 +451,10 @@ void do_snd_mixer_selem_set_playback_dB_all(snd_mixer_elem_t *mix_elem, double v
   if (snd_mixer_selem_set_playback_dB_all(mix_elem, vol, 0) != 0) {
     debug(1, "Can't set playback volume accurately to %f dB.", vol);
     if (snd_mixer_selem_set_playback_dB_all(mix_elem, vol, -1) != 0)
-      if (snd_mixer_selem_set_playback_dB_all(mix_elem, vol, 1) != 0)
+      if (snd_mixer_selem_set_playback_dB_all(mix_elem, vol, 1) != 0) {
         debug(1, "Could not set playback dB volume on the mixer.");
+        close_mixer(); // it may have gone away -- open it afresh next time
+      }
   }
 }
 
@@ -348,6 +474,53 @@ void actual_close_alsa_device() {
   }
 }
 
+#ifdef CONFIG_SOXR
+// (re)create the resampler for the format the device is being opened with
+static int open_resampler() {
+  soxr_datatype_t datatype;
+  switch (config.output_format) {
+  case SPS_FORMAT_S16:
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  case SPS_FORMAT_S16_LE:
+#else
+  case SPS_FORMAT_S16_BE:
+#endif
+    datatype = SOXR_INT16_I;
+    break;
+  case SPS_FORMAT_S32:
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  case SPS_FORMAT_S32_LE:
+#else
+  case SPS_FORMAT_S32_BE:
+#endif
+    datatype = SOXR_INT32_I;
+    break;
+  default:
+    warn("audio_alsa: the output can only be resampled in the native-endian S16 or S32 formats, "
+         "not in \"%s\".",
+         sps_format_description_string(config.output_format));
+    return -EINVAL;
+  }
+  if (resampler) {
+    soxr_delete(resampler);
+    resampler = NULL;
+  }
+  soxr_error_t e = NULL;
+  soxr_io_spec_t io_spec = soxr_io_spec(datatype, datatype);
+  soxr_quality_spec_t quality_spec = soxr_quality_spec(resample_quality, 0);
+  resampler =
+      soxr_create(config.output_rate, resample_to_rate, 2, &e, &io_spec, &quality_spec, NULL);
+  if (resampler == NULL) {
+    warn("audio_alsa: can not create a resampler from %d to %u frames per second: %s",
+         config.output_rate, resample_to_rate, e);
+    return -ENOMEM;
+  }
+  debug(2, "alsa: resampling from %d to %u frames per second.", config.output_rate,
+        resample_to_rate);
+  return 0;
+}
+#endif
+
 // This array is a sequence of the output rates to be tried if automatic speed selection is
 // requested.
 // There is no benefit to upconverting the frame rate, other than for compatibility.
@@ -444,6 +617,16 @@ int actual_open_alsa_device(int do_auto_setup) {
     return ret;
   }
 
+  char device_identity[sizeof(cached_device_identity)];
+  get_device_identity(device_identity, sizeof(device_identity));
+  if (strcmp(device_identity, cached_device_identity) != 0) {
+    if (cached_device_identity[0] != '\0') {
+      debug(1, "alsa: a different output device has appeared as \"%s\".", alsa_out_dev);
+      invalidate_device_capabilities(1);
+    }
+    strncpy(cached_device_identity, device_identity, sizeof(cached_device_identity) - 1);
+  }
+
   snd_pcm_hw_params_alloca(&alsa_params);
   snd_pcm_sw_params_alloca(&alsa_swparams);
 
@@ -513,6 +696,17 @@ int actual_open_alsa_device(int do_auto_setup) {
     int i = 0;
     int format_found = 0;
     sps_format_t trial_format = SPS_FORMAT_UNKNOWN;
+    if (output_format_cached) {
+      // try the one found last time first
+      trial_format = cached_output_format;
+      sf = fr[trial_format].alsa_code;
+      frame_size = fr[trial_format].frame_size;
+      ret = snd_pcm_hw_params_set_format(alsa_handle, alsa_params, sf);
+      if (ret == 0)
+        format_found = 1;
+      else
+        output_format_cached = 0;
+    }
     while ((i < number_of_formats_to_try) && (format_found == 0)) {
       trial_format = formats[i];
       sf = fr[trial_format].alsa_code;
@@ -525,8 +719,12 @@ int actual_open_alsa_device(int do_auto_setup) {
     }
     if (ret == 0) {
       config.output_format = trial_format;
-      debug(1, "alsa: output format chosen is \"%s\".",
-            sps_format_description_string(config.output_format));
+      if (output_format_cached == 0) {
+        debug(1, "alsa: output format chosen is \"%s\".",
+              sps_format_description_string(config.output_format));
+        cached_output_format = trial_format;
+        output_format_cached = 1;
+      }
     } else {
       warn("audio_alsa: Could not automatically set the output format for device \"%s\": %s",
            alsa_out_dev, snd_strerror(ret));
@@ -536,10 +734,10 @@ int actual_open_alsa_device(int do_auto_setup) {
 
   if ((do_auto_setup == 0) || (config.output_rate_auto_requested == 0)) { // no auto format
     actual_sample_rate =
-        config.output_rate; // this is the requested rate -- it'll be changed to the actual rate
+        device_rate(); // this is the requested rate -- it'll be changed to the actual rate
     ret = snd_pcm_hw_params_set_rate_near(alsa_handle, alsa_params, &actual_sample_rate, &dir);
     if (ret < 0) {
-      warn("audio_alsa: Rate %iHz not available for playback: %s", config.output_rate,
+      warn("audio_alsa: Rate %iHz not available for playback: %s", device_rate(),
            snd_strerror(ret));
       return ret;
     }
@@ -553,6 +751,15 @@ int actual_open_alsa_device(int do_auto_setup) {
     int i = 0;
     int speed_found = 0;
 
+    if (output_rate_cached) {
+      // try the one found last time first
+      actual_sample_rate = cached_output_rate;
+      ret = snd_pcm_hw_params_set_rate(alsa_handle, alsa_params, actual_sample_rate, 0);
+      if (ret == 0)
+        speed_found = 1;
+      else
+        output_rate_cached = 0;
+    }
     while ((i < number_of_speeds_to_try) && (speed_found == 0)) {
       actual_sample_rate = speeds[i];
       ret = snd_pcm_hw_params_set_rate_near(alsa_handle, alsa_params, &actual_sample_rate, &dir);
@@ -566,7 +773,11 @@ int actual_open_alsa_device(int do_auto_setup) {
     }
     if (ret == 0) {
       config.output_rate = actual_sample_rate;
-      debug(1, "alsa: output speed chosen is %d.", config.output_rate);
+      if (output_rate_cached == 0) {
+        debug(1, "alsa: output speed chosen is %d.", config.output_rate);
+        cached_output_rate = actual_sample_rate;
+        output_rate_cached = 1;
+      }
     } else {
       warn("audio_alsa: Could not automatically set the output rate for device \"%s\": %s",
            alsa_out_dev, snd_strerror(ret));
@@ -640,13 +851,28 @@ int actual_open_alsa_device(int do_auto_setup) {
              buffer_size_requested, actual_buffer_size);
   }
 
-  if (actual_sample_rate != config.output_rate) {
-    warn("Can't set the D/A converter to sample rate %d.", config.output_rate);
+  if (actual_sample_rate != device_rate()) {
+    warn("Can't set the D/A converter to sample rate %d.", device_rate());
     return -EINVAL;
   }
 
+#ifdef CONFIG_SOXR
+  if (resample_to_rate != 0) {
+    ret = open_resampler();
+    if (ret < 0)
+      return ret;
+  }
+#endif
+
   use_monotonic_clock = snd_pcm_hw_params_is_monotonic(alsa_params);
 
+#if SND_LIB_MINOR != 0
+  alsa_link_audio_timestamps =
+      snd_pcm_hw_params_supports_audio_ts_type(alsa_params, SND_PCM_AUDIO_TSTAMP_TYPE_LINK);
+  debug(2, "alsa: link audio timestamps are %savailable.",
+        alsa_link_audio_timestamps ? "" : "not ");
+#endif
+
   ret = snd_pcm_hw_params_get_buffer_size(alsa_params, &actual_buffer_length);
   if (ret < 0) {
     warn("audio_alsa: Unable to get hw buffer length for device \"%s\": %s.", alsa_out_dev,
@@ -676,6 +902,9 @@ int actual_open_alsa_device(int do_auto_setup) {
          snd_strerror(ret));
     return ret;
   }
+  alsa_buffer_frames = actual_buffer_length;
+  snd_pcm_sw_params_get_avail_min(alsa_swparams, &alsa_default_avail_min);
+  alsa_avail_min = alsa_default_avail_min;
 
   ret = snd_pcm_prepare(alsa_handle);
   if (ret < 0) {
@@ -860,6 +1089,10 @@ int open_alsa_device(int do_auto_setup) {
   int oldState;
   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState); // make this un-cancellable
   result = actual_open_alsa_device(do_auto_setup);
+  if (result != 0) {
+    // it may not be the device it was, so find everything out again next time
+    invalidate_device_capabilities((result == -ENODEV) || (result == -ENOENT));
+  }
   pthread_setcancelstate(oldState, NULL);
   return result;
 }
@@ -918,6 +1151,15 @@ int prepare_mixer() {
                "a dB volume scale.",
                alsa_mix_ctrl);
 
+          // if the mixer is being prepared again, for a different device, start afresh
+          if (ctl) {
+            snd_ctl_close(ctl);
+            ctl = NULL;
+          }
+          if (elem_id) {
+            snd_ctl_elem_id_free(elem_id);
+            elem_id = NULL;
+          }
           if (snd_ctl_open(&ctl, alsa_mix_dev, 0) < 0) {
             warn("Cannot open control \"%s\"", alsa_mix_dev);
             response = -1;
@@ -970,7 +1212,7 @@ int prepare_mixer() {
       } else {
         // debug(1, "Has mixer but not using hardware mute.");
       }
-      close_mixer();
+      // the mixer is left open for next time
     }
     debug_mutex_unlock(&alsa_mixer_mutex, 3); // release the mutex
     pthread_cleanup_pop(0);
@@ -1008,6 +1250,7 @@ static int init(int argc, char **argv) {
   config.disable_standby_mode_silence_threshold =
       0.040; // start sending silent frames if the delay goes below this time
   config.disable_standby_mode_silence_scan_interval = 0.004; // check silence threshold this often
+  config.disable_standby_mode_use_device_events = 0;
 
   stall_monitor_error_threshold =
       (uint64_t)1000000 * config.alsa_maximum_stall_time; // stall time max to microseconds;
@@ -1182,6 +1425,50 @@ static int init(int argc, char **argv) {
       }
     }
 
+    /* Get the optional rate to resample the output to */
+    if (config_lookup_int(config.cfg, "alsa.resample_to_rate", &value)) {
+#ifdef CONFIG_SOXR
+      if (value == 0) {
+        resample_to_rate = 0;
+      } else if ((value < 8000) || (value > 384000)) {
+        warn("Invalid alsa resample_to_rate %d. It should be between 8000 and 384000, or 0 for "
+             "no resampling. No resampling will be done.",
+             value);
+        resample_to_rate = 0;
+      } else {
+        if (config.output_rate_auto_requested) {
+          inform("The alsa output_rate will be 44100 rather than \"auto\" because the output is "
+                 "being resampled to %d.",
+                 value);
+          config.output_rate_auto_requested = 0;
+          config.output_rate = 44100;
+        }
+        if ((unsigned int)value == (unsigned int)config.output_rate)
+          resample_to_rate = 0; // nothing to do
+        else
+          resample_to_rate = value;
+      }
+#else
+      if (value != 0)
+        warn("The alsa resample_to_rate setting is ignored because this version of Shairport "
+             "Sync was built without support for soxr.");
+#endif
+    }
+
+#ifdef CONFIG_SOXR
+    if (config_lookup_string(config.cfg, "alsa.resample_quality", &str)) {
+      resample_quality_record *q = resample_qualities;
+      while ((q->name != NULL) && (strcasecmp(str, q->name) != 0))
+        q++;
+      if (q->name != NULL)
+        resample_quality = q->recipe;
+      else
+        warn("Invalid alsa resample_quality \"%s\". It should be \"very high\", \"high\", "
+             "\"medium\", \"low\" or \"quick\". It remains set to \"high\".",
+             str);
+    }
+#endif
+
     /* Get the use_mmap_if_available setting. */
     if (config_lookup_string(config.cfg, "alsa.use_mmap_if_available", &str)) {
       if (strcasecmp(str, "no") == 0)
@@ -1195,6 +1482,27 @@ static int init(int argc, char **argv) {
         config.no_mmap = 0;
       }
     }
+
+    /* Get the mmap_zero_copy setting. */
+    if (config_lookup_string(config.cfg, "alsa.mmap_zero_copy", &str)) {
+      if (strcasecmp(str, "no") == 0)
+        config.mmap_zero_copy = 0;
+      else if (strcasecmp(str, "yes") == 0)
+        config.mmap_zero_copy = 1;
+      else {
+        warn("Invalid mmap_zero_copy option choice \"%s\". It should be "
+             "\"yes\" or \"no\". "
+             "It remains set to \"no\".",
+             str);
+        config.mmap_zero_copy = 0;
+      }
+    }
+    if ((config.mmap_zero_copy) && (config.no_mmap == 0) &&
+        (device_rate() == (unsigned int)config.output_rate)) {
+      // not when resampling -- the player's frames have to go through the resampler first
+      audio_alsa.get_write_buffer = &get_write_buffer;
+      audio_alsa.commit = &commit;
+    }
     /* Get the optional period size value */
     if (config_lookup_int(config.cfg, "alsa.period_size", &value)) {
       set_period_size_request = 1;
@@ -1257,6 +1565,18 @@ static int init(int argc, char **argv) {
       }
     }
 
+    /* Get the optional disable_standby_mode_use_device_events setting. */
+    if (config_lookup_string(config.cfg, "alsa.disable_standby_mode_use_device_events", &str)) {
+      if (strcasecmp(str, "no") == 0)
+        config.disable_standby_mode_use_device_events = 0;
+      else if (strcasecmp(str, "yes") == 0)
+        config.disable_standby_mode_use_device_events = 1;
+      else
+        warn("Invalid disable_standby_mode_use_device_events option choice \"%s\". It should be "
+             "\"yes\" or \"no\". It remains set to \"%s\".",
+             str, config.disable_standby_mode_use_device_events ? "yes" : "no");
+    }
+
     /* Get the optional disable_standby_mode setting. */
     if (config_lookup_string(config.cfg, "alsa.disable_standby_mode", &str)) {
       if ((strcasecmp(str, "no") == 0) || (strcasecmp(str, "off") == 0) ||
@@ -1304,6 +1624,8 @@ static int init(int argc, char **argv) {
           config.disable_standby_mode_silence_threshold);
     debug(1, "alsa: disable_standby_mode_silence_scan_interval is %f seconds.",
           config.disable_standby_mode_silence_scan_interval);
+    debug(1, "alsa: disable_standby_mode_use_device_events is %d.",
+          config.disable_standby_mode_use_device_events);
   }
 
   optind = 1; // optind=0 is equivalent to optind=1 plus special behaviour
@@ -1363,6 +1685,18 @@ static void deinit(void) {
   pthread_cancel(alsa_buffer_monitor_thread);
   debug(3, "Join buffer monitor thread.");
   pthread_join(alsa_buffer_monitor_thread, NULL);
+  pthread_mutex_lock(&alsa_mixer_mutex);
+  close_mixer();
+  pthread_mutex_unlock(&alsa_mixer_mutex);
+#ifdef CONFIG_SOXR
+  if (resampler) {
+    soxr_delete(resampler);
+    resampler = NULL;
+  }
+  free(resample_buffer);
+  resample_buffer = NULL;
+  resample_buffer_frames = 0;
+#endif
   pthread_setcancelstate(oldState, NULL);
 }
 
@@ -1395,7 +1729,7 @@ int set_mute_state() {
         do_snd_mixer_selem_set_playback_dB_all(alsa_mix_elem, set_volume);
       }
     }
-    close_mixer();
+    // the mixer is left open for next time
   }
   debug_mutex_unlock(&alsa_mixer_mutex, 3); // release the mutex
   pthread_cleanup_pop(0);                   // release the mutex
@@ -1448,10 +1782,24 @@ int precision_delay_and_status(snd_pcm_state_t *state, snd_pcm_sframes_t *delay,
 
   if (using_update_timestamps)
     *using_update_timestamps = YNDK_DONT_KNOW;
+  status_time_is_valid = 0;
 
   struct timespec tn;                // time now
   snd_htimestamp_t update_timestamp; // actually a struct timespec
 
+#if SND_LIB_MINOR != 0
+  // Ask for the audio position to be taken from the link, at the same moment as the system time.
+  // The driver then reads the buffer position too, so the delay is right for that moment rather
+  // than for the last period interrupt.
+  if (alsa_link_audio_timestamps) {
+    snd_pcm_audio_tstamp_config_t audio_tstamp_config;
+    memset(&audio_tstamp_config, 0, sizeof(audio_tstamp_config));
+    audio_tstamp_config.type_requested = SND_PCM_AUDIO_TSTAMP_TYPE_LINK;
+    audio_tstamp_config.report_delay = 1;
+    snd_pcm_status_set_audio_htstamp_config(alsa_snd_pcm_status, &audio_tstamp_config);
+  }
+#endif
+
   int ret = snd_pcm_status(alsa_handle, alsa_snd_pcm_status);
   if (ret == 0) {
 
@@ -1460,6 +1808,13 @@ int precision_delay_and_status(snd_pcm_state_t *state, snd_pcm_sframes_t *delay,
     snd_pcm_status_get_htstamp(alsa_snd_pcm_status, &update_timestamp);
 #else
     snd_pcm_status_get_driver_htstamp(alsa_snd_pcm_status, &update_timestamp);
+    if (alsa_link_audio_timestamps) {
+      snd_pcm_audio_tstamp_report_t audio_tstamp_report;
+      snd_pcm_status_get_audio_htstamp_report(alsa_snd_pcm_status, &audio_tstamp_report);
+      if ((audio_tstamp_report.valid) &&
+          (audio_tstamp_report.actual_type == SND_PCM_AUDIO_TSTAMP_TYPE_LINK))
+        snd_pcm_status_get_htstamp(alsa_snd_pcm_status, &update_timestamp);
+    }
 #endif
 
     *state = snd_pcm_status_get_state(alsa_snd_pcm_status);
@@ -1498,6 +1853,11 @@ int precision_delay_and_status(snd_pcm_state_t *state, snd_pcm_sframes_t *delay,
         ret = snd_pcm_delay(alsa_handle, delay);
       } else {
         *delay = snd_pcm_status_get_delay(alsa_snd_pcm_status);
+        if (use_monotonic_clock) { // the same clock as get_absolute_time_in_ns()
+          status_time = update_timestamp_ns;
+          status_delay = *delay;
+          status_time_is_valid = 1;
+        }
 
         /*
         // It seems that the alsa library uses CLOCK_REALTIME before 1.0.28, even though
@@ -1546,7 +1906,7 @@ int precision_delay_and_status(snd_pcm_state_t *state, snd_pcm_sframes_t *delay,
           uint64_t delta = time_now_ns - update_timestamp_ns;
 
           uint64_t frames_played_since_last_interrupt =
-              ((uint64_t)config.output_rate * delta) / 1000000000;
+              ((uint64_t)device_rate() * delta) / 1000000000;
           snd_pcm_sframes_t frames_played_since_last_interrupt_sized =
               frames_played_since_last_interrupt;
 
@@ -1595,6 +1955,15 @@ int delay(long *the_delay) {
 
     ret = delay_and_status(&state, &my_delay, NULL);
 
+#ifdef CONFIG_SOXR
+    if ((resample_to_rate != 0) && (my_delay >= 0)) {
+      // add the frames still inside the resampler, then convert to the player's frames
+      if (resampler)
+        my_delay += (snd_pcm_sframes_t)soxr_delay(resampler);
+      my_delay = device_frames_to_output_frames(my_delay);
+    }
+#endif
+
     debug_mutex_unlock(&alsa_mutex, 0);
     pthread_cleanup_pop(0);
     pthread_setcancelstate(oldState, NULL);
@@ -1609,7 +1978,8 @@ int get_rate_information(uint64_t *elapsed_time, uint64_t *frames_played) {
   int response = 0; // zero means okay
   if (measurement_data_is_valid) {
     *elapsed_time = measurement_time - measurement_start_time;
-    *frames_played = frames_played_at_measurement_time - frames_played_at_measurement_start_time;
+    *frames_played = device_frames_to_output_frames(frames_played_at_measurement_time -
+                                                    frames_played_at_measurement_start_time);
   } else {
     *elapsed_time = 0;
     *frames_played = 0;
@@ -1618,7 +1988,110 @@ int get_rate_information(uint64_t *elapsed_time, uint64_t *frames_played) {
   return response;
 }
 
-int do_play(void *buf, int samples) {
+// Set the avail_min of the device, i.e. how much room there must be in its buffer before a poll
+// of the device returns. Zero restores the value it was opened with.
+static void set_avail_min(snd_pcm_uframes_t avail_min) {
+  if (avail_min == 0)
+    avail_min = alsa_default_avail_min;
+  if ((alsa_handle) && (avail_min != alsa_avail_min)) {
+    snd_pcm_sw_params_t *swparams;
+    snd_pcm_sw_params_alloca(&swparams);
+    int ret = snd_pcm_sw_params_current(alsa_handle, swparams);
+    if (ret == 0)
+      ret = snd_pcm_sw_params_set_avail_min(alsa_handle, swparams, avail_min);
+    if (ret == 0)
+      ret = snd_pcm_sw_params(alsa_handle, swparams);
+    if (ret == 0)
+      alsa_avail_min = avail_min;
+    else
+      debug(1, "alsa: error %d (\"%s\") setting avail_min to %lu.", ret, snd_strerror(ret),
+            avail_min);
+  }
+}
+
+// keep the stall monitor and the DAC rate measurements up to date after a successful write
+static void note_frames_written(int samples, snd_pcm_sframes_t delay_before_writing) {
+  stall_monitor_frame_count += samples;
+
+  if (frame_index == 0) {
+    frames_sent_for_playing = samples;
+  } else {
+    frames_sent_for_playing += samples;
+  }
+
+  const uint64_t start_measurement_from_this_frame =
+      (2 * config.output_rate) / 352; // two seconds of frames
+
+  frame_index++;
+
+  if ((frame_index == start_measurement_from_this_frame) ||
+      ((frame_index > start_measurement_from_this_frame) && (frame_index % 32 == 0))) {
+
+    int use_status_time = status_time_is_valid;
+    if (use_status_time) {
+      measurement_time = status_time;
+      frames_played_at_measurement_time = frames_sent_for_playing - status_delay - samples;
+    } else {
+      measurement_time = get_absolute_time_in_ns();
+      frames_played_at_measurement_time = frames_sent_for_playing - delay_before_writing - samples;
+    }
+
+    // measurements taken in different ways can't be compared, so start again if the way changes
+    if ((frame_index == start_measurement_from_this_frame) ||
+        (use_status_time != measurement_uses_status_time)) {
+      measurement_uses_status_time = use_status_time;
+      // debug(1, "Start frame counting");
+      frames_played_at_measurement_start_time = frames_played_at_measurement_time;
+      measurement_start_time = measurement_time;
+      measurement_data_is_valid = 1;
+    }
+  }
+}
+
+static void recover_from_write_error(int ret, int samples) {
+  frame_index = 0;
+  measurement_data_is_valid = 0;
+  if (ret == -EPIPE) { /* underrun */
+    debug(1, "alsa: underrun while writing %d samples to alsa device.", samples);
+    metrics_count_event(metrics_event_underrun);
+    int tret = snd_pcm_recover(alsa_handle, ret, 1);
+    if (tret < 0) {
+      warn("alsa: can't recover from SND_PCM_STATE_XRUN: %s.", snd_strerror(tret));
+    }
+  } else if (ret == -ESTRPIPE) { /* suspended */
+    debug(1, "alsa: suspended while writing %d samples to alsa device.", samples);
+    int tret;
+    while ((tret = snd_pcm_resume(alsa_handle)) == -EAGAIN) {
+      sleep(1); /* wait until the suspend flag is released */
+      if (tret < 0) {
+        warn("alsa: can't recover from SND_PCM_STATE_SUSPENDED state, "
+             "snd_pcm_prepare() "
+             "failed: %s.",
+             snd_strerror(tret));
+      }
+    }
+  } else {
+    char errorstring[1024];
+    strerror_r(-ret, (char *)errorstring, sizeof(errorstring));
+    debug(1, "alsa: error %d (\"%s\") writing %d samples to alsa device.", ret,
+          (char *)errorstring, samples);
+    if (ret == -ENODEV) // it has been unplugged
+      invalidate_device_capabilities(1);
+  }
+}
+
+// give back any part of the device's buffer handed out by get_write_buffer -- it has not been
+// written yet and anything else written now would be overwritten by it
+static void cancel_direct_write() {
+  if (direct_write_frames != 0) {
+    debug(1, "alsa: frames put directly into the device buffer have been discarded.");
+    if (alsa_handle)
+      snd_pcm_mmap_commit(alsa_handle, direct_write_offset, 0);
+    direct_write_frames = 0;
+  }
+}
+
+static int do_device_play(void *buf, int samples) {
   // assuming the alsa_mutex has been acquired
   // debug(3,"audio_alsa play called.");
   int oldState;
@@ -1640,61 +2113,12 @@ int do_play(void *buf, int samples) {
       }
 
       // debug(3, "write %d frames.", samples);
+      cancel_direct_write();
       ret = alsa_pcm_write(alsa_handle, buf, samples);
       if (ret == samples) {
-        stall_monitor_frame_count += samples;
-
-        if (frame_index == 0) {
-          frames_sent_for_playing = samples;
-        } else {
-          frames_sent_for_playing += samples;
-        }
-
-        const uint64_t start_measurement_from_this_frame =
-            (2 * config.output_rate) / 352; // two seconds of frames
-
-        frame_index++;
-
-        if ((frame_index == start_measurement_from_this_frame) ||
-            ((frame_index > start_measurement_from_this_frame) && (frame_index % 32 == 0))) {
-
-          measurement_time = get_absolute_time_in_ns();
-          frames_played_at_measurement_time = frames_sent_for_playing - my_delay - samples;
-
-          if (frame_index == start_measurement_from_this_frame) {
-            // debug(1, "Start frame counting");
-            frames_played_at_measurement_start_time = frames_played_at_measurement_time;
-            measurement_start_time = measurement_time;
-            measurement_data_is_valid = 1;
-          }
-        }
+        note_frames_written(samples, my_delay);
       } else {
-        frame_index = 0;
-        measurement_data_is_valid = 0;
-        if (ret == -EPIPE) { /* underrun */
-          debug(1, "alsa: underrun while writing %d samples to alsa device.", samples);
-          int tret = snd_pcm_recover(alsa_handle, ret, 1);
-          if (tret < 0) {
-            warn("alsa: can't recover from SND_PCM_STATE_XRUN: %s.", snd_strerror(tret));
-          }
-        } else if (ret == -ESTRPIPE) { /* suspended */
-          debug(1, "alsa: suspended while writing %d samples to alsa device.", samples);
-          int tret;
-          while ((tret = snd_pcm_resume(alsa_handle)) == -EAGAIN) {
-            sleep(1); /* wait until the suspend flag is released */
-            if (tret < 0) {
-              warn("alsa: can't recover from SND_PCM_STATE_SUSPENDED state, "
-                   "snd_pcm_prepare() "
-                   "failed: %s.",
-                   snd_strerror(tret));
-            }
-          }
-        } else {
-          char errorstring[1024];
-          strerror_r(-ret, (char *)errorstring, sizeof(errorstring));
-          debug(1, "alsa: error %d (\"%s\") writing %d samples to alsa device.", ret,
-                (char *)errorstring, samples);
-        }
+        recover_from_write_error(ret, samples);
       }
     }
   } else {
@@ -1710,6 +2134,47 @@ int do_play(void *buf, int samples) {
   return ret;
 }
 
+// Play frames at the player's rate, resampling them first if necessary. Returns what writing to
+// the device returns -- the frames it took, at its rate, or a negative error code.
+int do_play(void *buf, int samples) {
+  // assuming the alsa_mutex has been acquired
+#ifdef CONFIG_SOXR
+  if ((resampler != NULL) && (samples != 0) && (buf != NULL)) {
+    int ret = 0;
+    size_t frames_wanted = ((size_t)samples * resample_to_rate) / config.output_rate + 64;
+    if (frames_wanted > resample_buffer_frames) {
+      char *new_buffer = realloc(resample_buffer, frames_wanted * frame_size);
+      if (new_buffer == NULL) {
+        debug(1, "alsa: can not allocate a buffer for resampling %d frames.", samples);
+        return -ENOMEM;
+      }
+      resample_buffer = new_buffer;
+      resample_buffer_frames = frames_wanted;
+    }
+    char *in = buf;
+    size_t frames_left = samples;
+    while ((frames_left > 0) && (ret >= 0)) {
+      size_t frames_in = 0, frames_out = 0;
+      soxr_error_t e = soxr_process(resampler, (soxr_in_t)in, frames_left, &frames_in,
+                                    (soxr_out_t)resample_buffer, resample_buffer_frames,
+                                    &frames_out);
+      if (e) {
+        debug(1, "alsa: error resampling: %s", e);
+        return -EINVAL;
+      }
+      in += frames_in * frame_size;
+      frames_left -= frames_in;
+      if (frames_out != 0)
+        ret = do_device_play(resample_buffer, frames_out);
+      else if (frames_in == 0)
+        break; // no progress
+    }
+    return ret;
+  }
+#endif
+  return do_device_play(buf, samples);
+}
+
 int do_open(int do_auto_setup) {
   int ret = 0;
   if (alsa_backend_state != abm_disconnected)
@@ -1744,6 +2209,7 @@ int do_close() {
   int derr = 0;
   if (alsa_handle) {
     // debug(1,"alsa: do_close() -- closing the output device");
+    cancel_direct_write();
     if ((derr = snd_pcm_drop(alsa_handle)))
       debug(1, "Error %d (\"%s\") dropping output device.", derr, snd_strerror(derr));
     usleep(5000);
@@ -1784,6 +2250,8 @@ int play(void *buf, int samples) {
     if (alsa_backend_state != abm_playing) {
       debug(2, "alsa: play() -- alsa_backend_state => abm_playing");
       alsa_backend_state = abm_playing;
+      handover_deadline = 0;
+      set_avail_min(0); // the buffer monitor may have changed it
 
       // mute_requested_internally = 0; // stop requesting a mute for backend's own
       // reasons, which might have been a flush
@@ -1799,6 +2267,110 @@ int play(void *buf, int samples) {
   return ret;
 }
 
+// When the device is accessed by mmap, the player can format its output directly into the
+// device's buffer instead of into a buffer of its own that play() would then copy from.
+// Returns NULL if there isn't a contiguous space for the frames right now, in which case the
+// player should fall back to play(), which will wait for space if necessary.
+static void *get_write_buffer(int frames) {
+  void *response = NULL;
+  int ret = 0;
+  pthread_cleanup_debug_mutex_lock(&alsa_mutex, 50000, 0);
+  int oldState;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState); // make this un-cancellable
+
+  if (alsa_backend_state == abm_disconnected) {
+    ret = do_open(0); // don't try to auto setup
+    if (ret == 0)
+      debug(2, "alsa: get_write_buffer() -- opened output device");
+  }
+
+  if ((ret == 0) && (alsa_handle != NULL) && (alsa_pcm_write == snd_pcm_mmap_writei)) {
+    if (alsa_backend_state != abm_playing) {
+      debug(2, "alsa: get_write_buffer() -- alsa_backend_state => abm_playing");
+      alsa_backend_state = abm_playing;
+      set_avail_min(0); // the buffer monitor may have changed it
+    }
+    cancel_direct_write();
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(alsa_handle);
+    if (avail >= frames) {
+      const snd_pcm_channel_area_t *areas;
+      snd_pcm_uframes_t offset;
+      snd_pcm_uframes_t contiguous_frames = frames;
+      if (snd_pcm_mmap_begin(alsa_handle, &areas, &offset, &contiguous_frames) == 0) {
+        // the interleaved frames must be packed together, and not wrap around the end of the
+        // buffer, to be written as the player writes them
+        if ((contiguous_frames >= (snd_pcm_uframes_t)frames) && (areas[0].first == 0) &&
+            (areas[0].step == (unsigned int)frame_size * 8)) {
+          direct_write_offset = offset;
+          direct_write_frames = contiguous_frames;
+          response = (char *)areas[0].addr + offset * frame_size;
+        } else {
+          snd_pcm_mmap_commit(alsa_handle, offset, 0);
+        }
+      }
+    }
+  }
+
+  pthread_setcancelstate(oldState, NULL);
+  debug_mutex_unlock(&alsa_mutex, 0);
+  pthread_cleanup_pop(0); // release the mutex
+  return response;
+}
+
+// pass the frames written into the buffer from get_write_buffer to the device
+static int commit(int frames) {
+  int ret = 0;
+  pthread_cleanup_debug_mutex_lock(&alsa_mutex, 50000, 0);
+  int oldState;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState); // make this un-cancellable
+
+  if ((direct_write_frames == 0) || (alsa_handle == NULL)) {
+    debug(1, "alsa: commit() -- the frames were discarded before they could be committed.");
+    ret = -EINVAL;
+  } else {
+    if ((snd_pcm_uframes_t)frames > direct_write_frames) {
+      debug(1, "alsa: commit() -- %d frames were written into space for only %lu frames.", frames,
+            direct_write_frames);
+      frames = direct_write_frames;
+    }
+    snd_pcm_state_t state;
+    snd_pcm_sframes_t my_delay;
+    ret = delay_and_status(&state, &my_delay, NULL);
+    if (ret == 0) {
+      snd_pcm_sframes_t committed =
+          snd_pcm_mmap_commit(alsa_handle, direct_write_offset, frames);
+      direct_write_frames = 0;
+      if (committed == frames) {
+        ret = 0;
+        note_frames_written(frames, my_delay);
+        // unlike snd_pcm_mmap_writei, committing frames doesn't start the device
+        if ((frames != 0) && (snd_pcm_state(alsa_handle) == SND_PCM_STATE_PREPARED)) {
+          int sret = snd_pcm_start(alsa_handle);
+          if (sret < 0)
+            debug(1, "alsa: commit() -- error %d (\"%s\") starting the output device.", sret,
+                  snd_strerror(sret));
+        }
+      } else {
+        ret = committed < 0 ? committed : -EIO;
+        recover_from_write_error(ret, frames);
+      }
+    } else {
+      debug(1,
+            "alsa: device status returns fault status %d and SND_PCM_STATE_* "
+            "%d  for commit.",
+            ret, state);
+      cancel_direct_write();
+      frame_index = 0;
+      measurement_data_is_valid = 0;
+    }
+  }
+
+  pthread_setcancelstate(oldState, NULL);
+  debug_mutex_unlock(&alsa_mutex, 0);
+  pthread_cleanup_pop(0); // release the mutex
+  return ret;
+}
+
 int prepare(void) {
   // this will leave the DAC open / connected.
   int ret = 0;
@@ -1828,6 +2400,10 @@ static void flush(void) {
   // debug(2, "flush() set_mute_state");
   // set_mute_state();
   // do_mute(1); // mute for backend's own reasons
+#ifdef CONFIG_SOXR
+  if (resampler)
+    soxr_clear(resampler); // don't let the end of the last stream into the next one
+#endif
   if (alsa_backend_state != abm_disconnected) { // must be playing or connected...
     if (config.keep_dac_busy != 0) {
       debug(2, "alsa: flush() -- alsa_backend_state => abm_connected.");
@@ -1848,6 +2424,35 @@ static void stop(void) {
   flush(); // flush will also close the device if appropriate
 }
 
+// Another session is taking over: throw away what's waiting to be played, but leave the device
+// open for the new session rather than closing it only for it to be opened again at once. If no
+// session starts playing before the deadline, the buffer monitor thread closes it as usual.
+#define HANDOVER_TIME_NS 5000000000
+
+static void hand_over(void) {
+  pthread_cleanup_debug_mutex_lock(&alsa_mutex, 10000, 1);
+#ifdef CONFIG_SOXR
+  if (resampler)
+    soxr_clear(resampler);
+#endif
+  if ((alsa_backend_state != abm_disconnected) && (alsa_handle)) {
+    cancel_direct_write();
+    int derr;
+    if ((derr = snd_pcm_drop(alsa_handle)))
+      debug(1, "Error %d (\"%s\") dropping output device.", derr, snd_strerror(derr));
+    if ((derr = snd_pcm_prepare(alsa_handle)))
+      debug(1, "Error %d (\"%s\") preparing output device.", derr, snd_strerror(derr));
+    stall_monitor_start_time = 0;
+    frame_index = 0;
+    measurement_data_is_valid = 0;
+    handover_deadline = get_absolute_time_in_ns() + HANDOVER_TIME_NS;
+    debug(2, "alsa: hand_over() -- alsa_backend_state => abm_connected.");
+    alsa_backend_state = abm_connected;
+  }
+  debug_mutex_unlock(&alsa_mutex, 3);
+  pthread_cleanup_pop(0); // release the mutex
+}
+
 static void parameters(audio_parameters *info) {
   info->minimum_volume_dB = alsa_mix_mindb;
   info->maximum_volume_dB = alsa_mix_maxdb;
@@ -1887,7 +2492,7 @@ void do_volume(double vol) { // caller is assumed to have the alsa_mutex when
       }
     }
     volume_set_request = 0; // any external request that has been made is now satisfied
-    close_mixer();
+    // the mixer is left open for next time
   }
   debug_mutex_unlock(&alsa_mixer_mutex, 3);
   pthread_cleanup_pop(0); // release the mutex
@@ -1933,6 +2538,7 @@ void alsa_buffer_monitor_thread_cleanup_function(__attribute__((unused)) void
 */
 
 void *alsa_buffer_monitor_thread_code(__attribute__((unused)) void *arg) {
+  thread_set_name("alsa-monitor");
   int frame_count = 0;
   int error_count = 0;
   int error_detected = 0;
@@ -1950,6 +2556,10 @@ void *alsa_buffer_monitor_thread_code(__attribute__((unused)) void *arg) {
       alsa_device_initialised = 1;
     }
     int sleep_time_us = (int)(config.disable_standby_mode_silence_scan_interval * 1000000);
+    struct pollfd poll_descriptors[8];
+    int poll_descriptor_count = 0;
+    int idle = 0;
+    uint64_t activity_generation = activity_monitor_generation();
     pthread_cleanup_debug_mutex_lock(&alsa_mutex, 200000, 0);
     // check possible state transitions here
     if ((alsa_backend_state == abm_disconnected) && (config.keep_dac_busy != 0)) {
@@ -1957,7 +2567,8 @@ void *alsa_buffer_monitor_thread_code(__attribute__((unused)) void *arg) {
       if (do_open(1) == 0) // no automatic setup of rate and speed if necessary
         debug(2, "alsa: alsa_buffer_monitor_thread_code() -- output device opened; "
                  "alsa_backend_state => abm_connected");
-    } else if ((alsa_backend_state == abm_connected) && (config.keep_dac_busy == 0)) {
+    } else if ((alsa_backend_state == abm_connected) && (config.keep_dac_busy == 0) &&
+               (get_absolute_time_in_ns() > handover_deadline)) {
       stall_monitor_start_time = 0;
       frame_index = 0;
       measurement_data_is_valid = 0;
@@ -1986,51 +2597,73 @@ void *alsa_buffer_monitor_thread_code(__attribute__((unused)) void *arg) {
               (char *)errorstring);
       }
       long buffer_size_threshold =
-          (long)(config.disable_standby_mode_silence_threshold * config.output_rate);
-      size_t size_of_silence_buffer;
+          (long)(config.disable_standby_mode_silence_threshold * device_rate());
       if (buffer_size < buffer_size_threshold) {
-        int frames_of_silence = 1024;
-        size_of_silence_buffer = frames_of_silence * frame_size;
-        void *silence = malloc(size_of_silence_buffer);
-        if (silence == NULL) {
-          warn("disable_standby_mode has been turned off because a memory allocation error "
-               "occurred.");
-          error_detected = 1;
-        } else {
-          int ret;
-          pthread_cleanup_push(malloc_cleanup, silence);
-          int use_dither = 0;
-          if ((alsa_mix_ctrl == NULL) && (config.ignore_volume_control == 0) &&
-              (config.airplay_volume != 0.0))
-            use_dither = 1;
-          dither_random_number_store =
-              generate_zero_frames(silence, frames_of_silence, config.output_format,
-                                   use_dither, // i.e. with dither
-                                   dither_random_number_store);
-          ret = do_play(silence, frames_of_silence);
-          frame_count++;
-          pthread_cleanup_pop(1); // free malloced buffer
-          if (ret < 0) {
-            error_count++;
-            char errorstring[1024];
-            strerror_r(-ret, (char *)errorstring, sizeof(errorstring));
-            debug(2,
-                  "alsa: alsa_buffer_monitor_thread_code error %d (\"%s\") writing %d samples "
-                  "to alsa device -- %d errors in %d trials.",
-                  ret, (char *)errorstring, frames_of_silence, error_count, frame_count);
-            if ((error_count > 40) && (frame_count < 100)) {
-              warn("disable_standby_mode has been turned off because too many underruns "
-                   "occurred. Is Shairport Sync outputting to a virtual device or running in a "
-                   "virtual machine?");
-              error_detected = 1;
-            }
+        int use_dither = 0;
+        if ((alsa_mix_ctrl == NULL) && (config.ignore_volume_control == 0) &&
+            (config.airplay_volume != 0.0))
+          use_dither = 1;
+        size_t frames_of_silence;
+        const void *silence = silence_get(config.output_format, use_dither, 1024,
+                                          &alsa_silence_position, &frames_of_silence);
+        int ret = do_play((void *)silence, frames_of_silence);
+        frame_count++;
+        if (ret > 0)
+          buffer_size += ret;
+        if (ret < 0) {
+          error_count++;
+          char errorstring[1024];
+          strerror_r(-ret, (char *)errorstring, sizeof(errorstring));
+          debug(2,
+                "alsa: alsa_buffer_monitor_thread_code error %d (\"%s\") writing %zu samples "
+                "to alsa device -- %d errors in %d trials.",
+                ret, (char *)errorstring, frames_of_silence, error_count, frame_count);
+          if ((error_count > 40) && (frame_count < 100)) {
+            warn("disable_standby_mode has been turned off because too many underruns "
+                 "occurred. Is Shairport Sync outputting to a virtual device or running in a "
+                 "virtual machine?");
+            error_detected = 1;
           }
         }
       }
+      if (config.disable_standby_mode_use_device_events) {
+        // Rather than scanning, sleep until the buffer should have drained to the threshold.
+        // While idle, also ask the device to wake us if it drains sooner than that.
+        if (buffer_size > buffer_size_threshold) {
+          int64_t time_to_threshold_us =
+              ((int64_t)(buffer_size - buffer_size_threshold) * 1000000) / device_rate();
+          if (time_to_threshold_us > sleep_time_us)
+            sleep_time_us = time_to_threshold_us > 100000 ? 100000 : (int)time_to_threshold_us;
+        }
+        if ((alsa_backend_state == abm_connected) && (alsa_handle) &&
+            (alsa_buffer_frames > (snd_pcm_uframes_t)buffer_size_threshold)) {
+          set_avail_min(alsa_buffer_frames - buffer_size_threshold);
+          poll_descriptor_count = snd_pcm_poll_descriptors(
+              alsa_handle, poll_descriptors, sizeof(poll_descriptors) / sizeof(struct pollfd));
+        }
+      }
     }
+    // with the DAC not to be kept busy, there's nothing to do until that changes, which it will
+    // when Shairport Sync goes active, or when asked to through an interface
+    if ((config.keep_dac_busy == 0) && (alsa_backend_state != abm_connected))
+      idle = 1;
     debug_mutex_unlock(&alsa_mutex, 0);
     pthread_cleanup_pop(0); // release the mutex
-    usleep(sleep_time_us);  // has a cancellation point in it
+    if (idle) {
+      activity_monitor_wait_for_change(activity_generation,
+                                       1000000000); // has a cancellation point in it
+    } else if (config.disable_standby_mode_use_device_events) {
+      // don't leave it too long before looking for a change of state
+      if (sleep_time_us > 100000)
+        sleep_time_us = 100000;
+      if (poll_descriptor_count > 0)
+        poll(poll_descriptors, poll_descriptor_count,
+             (sleep_time_us + 999) / 1000); // a cancellation point
+      else
+        usleep(sleep_time_us); // has a cancellation point in it
+    } else {
+      usleep(sleep_time_us); // has a cancellation point in it
+    }
   }
   pthread_exit(NULL);
 }
@@ -23,9 +23,16 @@
 #include <errno.h>
 #include <limits.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 #include <jack/jack.h>
 #include <jack/ringbuffer.h>
 
@@ -42,6 +49,12 @@ typedef jack_default_audio_sample_t sample_t;
 // Two-channel, 32bit audio:
 static const int bytes_per_frame = NPORTS * jack_sample_size;
 
+// The player gives us 16-bit samples or, if jack.output_format is "S32", 32-bit ones
+static int input_bytes_per_frame = NPORTS * sizeof(int16_t);
+
+// play(), delay() and flush() are only ever called from the player thread, and the ringbuffer is
+// lock-free, so they don't need a lock. This one protects the rate measurement, which is read on
+// behalf of other threads too.
 static pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -51,6 +64,7 @@ void jack_start(int, int);
 int play(void *, int);
 void jack_stop(void);
 int jack_delay(long *);
+int jack_rate_info(uint64_t *, uint64_t *);
 void jack_flush(void);
 
 audio_output audio_jack = {.name = "jack",
@@ -63,6 +77,7 @@ audio_output audio_jack = {.name = "jack",
                            .is_running = NULL,
                            .flush = &jack_flush,
                            .delay = &jack_delay,
+                           .rate_info = &jack_rate_info,
                            .play = &play,
                            .volume = NULL,
                            .parameters = NULL,
@@ -83,6 +98,14 @@ static int flush_please = 0;
 static jack_latency_range_t latest_latency_range[NPORTS];
 static int64_t time_of_latest_transfer;
 
+// The rate of the DAC is measured from JACK's frame time, which the server keeps locked to the
+// hardware and interpolates between cycles, rather than from our own transfers, which jitter.
+// These are protected by the buffer_mutex.
+static audio_rate_measurement rate_measurement;
+static jack_nframes_t previous_frame_time;
+static uint64_t frames_since_start; // at the JACK sample rate; the frame time itself wraps round
+static int input_sample_rate = 44100;
+
 #ifdef CONFIG_SOXR
 typedef struct soxr_quality {
   int quality;
@@ -102,21 +125,54 @@ static int parse_soxr_quality_name(const char *name) {
   return -1;
 }
 
+// The resampler is kept from one play session to the next, and just cleared if the input rate
+// hasn't changed, rather than being rebuilt for every session.
 static soxr_t soxr = NULL;
+static int soxr_input_rate = 0;
 static soxr_quality_spec_t quality_spec;
 static soxr_io_spec_t io_spec;
 #endif
 
-static inline sample_t sample_conv(short sample) {
-  // It sounds correct, but I don't understand it.
-  // Zero int needs to be zero float. Check.
-  // Plus 32767 int is 1.0. Check.
-  // Minus 32767 int is -0.99997. And here my brain shuts down.
-  // In my head, it should be 1.0, and we should tolerate an overflow
-  // at minus 32768. But I'm sure there's a textbook explanation somewhere.
-  return ((sample < 0) ? (-1.0 * sample / SHRT_MIN) : (1.0 * sample / SHRT_MAX));
+// Integer samples are scaled by a power of two, so that -32768 (or -2^31) is exactly -1.0, zero is
+// zero, and every 16-bit sample (and every 32-bit sample to within a float's 24-bit precision) is
+// converted exactly, with no branch per sample.
+static void convert_s16(const int16_t *in, sample_t *out, size_t n) {
+  size_t i;
+  for (i = 0; i < n; i++)
+    out[i] = in[i] * (1.0f / 32768.0f);
+}
+
+static void convert_s32_scalar(const int32_t *in, sample_t *out, size_t n) {
+  size_t i;
+  for (i = 0; i < n; i++)
+    out[i] = in[i] * (1.0f / 2147483648.0f);
+}
+
+#if defined(__GNUC__) && defined(__SSE2__)
+
+static void convert_s32(const int32_t *in, sample_t *out, size_t n) {
+  __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i s = _mm_loadu_si128((const __m128i *)(in + i));
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(s), scale));
+  }
+  convert_s32_scalar(in + i, out + i, n - i);
 }
 
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+static void convert_s32(const int32_t *in, sample_t *out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    vst1q_f32(out + i, vcvtq_n_f32_s32(vld1q_s32(in + i), 31)); // fixed point with 31 fraction bits
+  convert_s32_scalar(in + i, out + i, n - i);
+}
+
+#else
+#define convert_s32 convert_s32_scalar
+#endif
+
 static void deinterleave(const char *interleaved_input_buffer, sample_t *jack_output_buffer[],
                          jack_nframes_t offset, jack_nframes_t nframes) {
   jack_nframes_t f;
@@ -227,6 +283,14 @@ int jack_init(__attribute__((unused)) int argc, __attribute__((unused)) char **a
     if (config_lookup_string(config.cfg, "jack.autoconnect_pattern", &str)) {
       config.jack_autoconnect_pattern = (char *)str;
     }
+    if (config_lookup_string(config.cfg, "jack.output_format", &str)) {
+      if (strcasecmp(str, "S16") == 0)
+        config.jack_output_32_bit = 0;
+      else if (strcasecmp(str, "S32") == 0)
+        config.jack_output_32_bit = 1;
+      else
+        die("jack: invalid output_format \"%s\". It should be \"S16\" or \"S32\".", str);
+    }
 #ifdef CONFIG_SOXR
     if (config_lookup_string(config.cfg, "jack.soxr_resample_quality", &str)) {
       debug(1, "SOXR quality %s", str);
@@ -239,6 +303,18 @@ int jack_init(__attribute__((unused)) int argc, __attribute__((unused)) char **a
   if (config.jack_client_name == NULL)
     config.jack_client_name = strdup("shairport-sync");
 
+  // In 32-bit mode, the player applies the volume at full resolution and passes the samples on
+  // without dithering them, and they are converted straight to floats here.
+  if (config.jack_output_32_bit) {
+    config.output_format = SPS_FORMAT_S32;
+    input_bytes_per_frame = NPORTS * sizeof(int32_t);
+  } else {
+    config.output_format = SPS_FORMAT_S16;
+    input_bytes_per_frame = NPORTS * sizeof(int16_t);
+  }
+  config.output_is_floating_point = 1;
+  debug(1, "jack: taking %d-bit samples from the player.", config.jack_output_32_bit ? 32 : 16);
+
   // by default a buffer that can hold up to 4 seconds of 48kHz samples
   if (bufsz <= 0)
     bufsz = 48000 * 4 * bytes_per_frame;
@@ -262,7 +338,7 @@ int jack_init(__attribute__((unused)) int argc, __attribute__((unused)) char **a
 #ifdef CONFIG_SOXR
   if (config.jack_soxr_resample_quality >= SOXR_QQ) {
     quality_spec = soxr_quality_spec(config.jack_soxr_resample_quality, 0);
-    io_spec = soxr_io_spec(SOXR_INT16_I, SOXR_FLOAT32_I);
+    io_spec = soxr_io_spec(config.jack_output_32_bit ? SOXR_INT32_I : SOXR_INT16_I, SOXR_FLOAT32_I);
   } else
 #endif
       if (sample_rate != 44100) {
@@ -343,6 +419,7 @@ void jack_deinit() {
   if (soxr) {
     soxr_delete(soxr);
     soxr = NULL;
+    soxr_input_rate = 0;
   }
 #endif
 }
@@ -350,17 +427,33 @@ void jack_deinit() {
 void jack_start(int i_sample_rate, __attribute__((unused)) int i_sample_format) {
   // Nothing to do, JACK client has already been set up at jack_init().
   // Also, we have no say over the sample rate or sample format of JACK,
-  // We convert the 16bit samples to float, and die if the sample rate is != 44k1 without soxr.
+  // We convert the 16 or 32 bit samples to float, and die if the sample rate is != 44k1 without
+  // soxr.
+  pthread_mutex_lock(&buffer_mutex);
+  input_sample_rate = i_sample_rate;
+  audio_rate_measurement_reset(&rate_measurement);
+  pthread_mutex_unlock(&buffer_mutex);
 #ifdef CONFIG_SOXR
   if (config.jack_soxr_resample_quality >= SOXR_QQ) {
-    // we might improve a bit with soxr_clear if the sample_rate doesn't change
-    if (soxr) {
+    soxr_error_t e = NULL;
+    if ((soxr) && (soxr_input_rate == i_sample_rate)) {
+      // drop what's left of the previous session, but keep the filters
+      e = soxr_clear(soxr);
+      if (e) {
+        debug(1, "jack: error clearing the soxr resampler: %s", e);
+        soxr_delete(soxr);
+        soxr = NULL;
+      }
+    } else if (soxr) {
       soxr_delete(soxr);
+      soxr = NULL;
     }
-    soxr_error_t e = NULL;
-    soxr = soxr_create(i_sample_rate, sample_rate, NPORTS, &e, &io_spec, &quality_spec, NULL);
     if (!soxr) {
-      die("Unable to create soxr resampler for JACK: %s", e);
+      soxr = soxr_create(i_sample_rate, sample_rate, NPORTS, &e, &io_spec, &quality_spec, NULL);
+      if (!soxr) {
+        die("Unable to create soxr resampler for JACK: %s", e);
+      }
+      soxr_input_rate = i_sample_rate;
     }
   }
 #endif
@@ -377,16 +470,12 @@ int jack_delay(long *the_delay) {
   // ringbuffer, not into the jack buffers directly (because locking those would
   // violate real-time constraints). On average, that should lead to  just a
   // constant additional latency.
-  // Without the mutex, we could get the time of what is the last transfer of data
-  // to a jack buffer, but then a transfer could occur and we would get the buffer
-  // occupancy after another transfer had occurred, so we could "lose" a full transfer
-  // (e.g. 1024 frames @ 44,100 fps ~ 23.2 milliseconds)
-  pthread_mutex_lock(&buffer_mutex);
+  // This is called from the same thread as play(), so the time of the latest transfer and the
+  // buffer occupancy always belong to the same transfer, and no lock is needed.
   int64_t time_now = get_absolute_time_in_ns();
   int64_t delta = time_now - time_of_latest_transfer; // nanoseconds
   size_t audio_occupancy_now = jack_ringbuffer_read_space(jackbuf) / bytes_per_frame;
   debug(2, "audio_occupancy_now is %d.", audio_occupancy_now);
-  pthread_mutex_unlock(&buffer_mutex);
 
   int64_t frames_processed_since_latest_latency_check = (delta * sample_rate) / 1000000000;
   // debug(1,"delta: %" PRId64 " frames.",frames_processed_since_latest_latency_check);
@@ -398,14 +487,31 @@ int jack_delay(long *the_delay) {
   return 0;
 }
 
+int jack_rate_info(uint64_t *elapsed_time, uint64_t *frames_played) {
+  pthread_mutex_lock(&buffer_mutex);
+  uint64_t time_now = get_absolute_time_in_ns();
+  // the frame time of the start of the current cycle plus the frames since then
+  jack_nframes_t frame_time = jack_frame_time(client);
+  if (rate_measurement.first_update_time == 0)
+    frames_since_start = 0;
+  else
+    frames_since_start += (jack_nframes_t)(frame_time - previous_frame_time);
+  previous_frame_time = frame_time;
+  // the player wants the rate in its own frames, which may have been resampled on the way
+  audio_rate_measurement_update(&rate_measurement, time_now,
+                                (frames_since_start * input_sample_rate) / sample_rate);
+  int response = audio_rate_measurement_get(&rate_measurement, elapsed_time, frames_played);
+  pthread_mutex_unlock(&buffer_mutex);
+  return response;
+}
+
 int play(void *buf, int samples) {
   jack_ringbuffer_data_t v[2] = {0};
-  size_t i, j, c;
+  size_t i;
   jack_nframes_t thisbuf;
-  // It's ok to lock here since we're not in the realtime callback:
-  pthread_mutex_lock(&buffer_mutex);
+  // We are the only writer to the lock-free ringbuffer, so no lock is needed.
   jack_ringbuffer_get_write_vector(jackbuf, v);
-  short *in = (short *)buf;
+  char *in = (char *)buf;
   sample_t *out;
   for (i = 0; i < 2; ++i) {
     thisbuf = v[i].len / (jack_sample_size * NPORTS); // #samples per channel
@@ -419,26 +525,26 @@ int play(void *buf, int samples) {
         if (e)
           die("Error during soxr process: %s", e);
 
-        in += i_done * NPORTS; // advance our input buffer
+        in += i_done * input_bytes_per_frame; // advance our input buffer
         samples -= i_done;
         thisbuf -= o_done;
         jack_ringbuffer_write_advance(jackbuf, o_done * jack_sample_size * NPORTS);
       }
     } else {
 #endif
-      j = 0;
-      for (j = 0; j < thisbuf && samples > 0; ++j) {
-        for (c = 0; c < NPORTS; ++c)
-          out[j * NPORTS + c] = sample_conv(*in++);
-        --samples;
-      }
-      jack_ringbuffer_write_advance(jackbuf, j * jack_sample_size * NPORTS);
+      size_t frames = thisbuf < (jack_nframes_t)samples ? thisbuf : (size_t)samples;
+      if (config.jack_output_32_bit)
+        convert_s32((const int32_t *)in, out, frames * NPORTS);
+      else
+        convert_s16((const int16_t *)in, out, frames * NPORTS);
+      in += frames * input_bytes_per_frame;
+      samples -= frames;
+      jack_ringbuffer_write_advance(jackbuf, frames * jack_sample_size * NPORTS);
 #ifdef CONFIG_SOXR
     }
 #endif
   }
   time_of_latest_transfer = get_absolute_time_in_ns();
-  pthread_mutex_unlock(&buffer_mutex);
   if (samples) {
     warn("JACK ringbuffer overrun. Dropped %d samples.", samples);
   }
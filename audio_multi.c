@@ -0,0 +1,274 @@
+// The "multi" backend renders a session to several other backends at once. Decoding, volume
+// and DSP are done once, by the player, and the same frames are given to every output.
+//
+// The first output listed is the primary one. The player synchronises to it, through its delay()
+// and rate_info(), just as it would if it were the only backend. Each of the others keeps itself
+// in step with the primary: if it can report its delay, the difference between that and the
+// primary's delay is held at the output's offset by dropping or inserting a frame per packet,
+// and by jumping straight to the offset if it's out by more than the resync threshold. An output
+// that can't report its delay is just shifted by its offset when it starts.
+//
+// The backends keep their state in static variables, so each can appear only once. Volume is
+// always applied in software, so that all the outputs play at the same level.
+
+#include "audio.h"
+#include "common.h"
+#include "silence.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MULTI_MAXIMUM_OUTPUTS 8
+
+typedef struct {
+  audio_output *output;
+  double offset; // seconds later than the primary output, may be negative
+  int64_t offset_frames;
+  int64_t pending_frames;      // positive: frames of silence to insert, negative: frames to drop
+  uint64_t frames_since_start; // its delay isn't trustworthy until it has been playing a while
+} multi_output;
+
+static multi_output outputs[MULTI_MAXIMUM_OUTPUTS];
+static int output_count = 0;
+
+static int frame_bytes = 4;
+// backends shift their arguments back by one for getopt(), so give them a name to find there
+static char *no_arguments[] = {"multi", NULL};
+
+static char *scratch = NULL; // for inserting a frame
+static size_t scratch_frames = 0;
+
+extern audio_output audio_multi;
+
+static int multi_frame_bytes(int sample_format) {
+  switch (sample_format) {
+  case SPS_FORMAT_S8:
+  case SPS_FORMAT_U8:
+    return 2;
+  case SPS_FORMAT_S24_3LE:
+  case SPS_FORMAT_S24_3BE:
+    return 6;
+  case SPS_FORMAT_S24:
+  case SPS_FORMAT_S24_LE:
+  case SPS_FORMAT_S24_BE:
+  case SPS_FORMAT_S32:
+  case SPS_FORMAT_S32_LE:
+  case SPS_FORMAT_S32_BE:
+    return 8;
+  default:
+    return 4;
+  }
+}
+
+static void ensure_scratch(size_t frames) {
+  if (frames > scratch_frames) {
+    char *new_scratch = realloc(scratch, frames * frame_bytes);
+    if (new_scratch == NULL)
+      die("multi: can not allocate memory for %zu frames.", frames);
+    scratch = new_scratch;
+    scratch_frames = frames;
+  }
+}
+
+static void reset_compensation(void) {
+  int i;
+  for (i = 1; i < output_count; i++) {
+    outputs[i].pending_frames = outputs[i].offset_frames;
+    outputs[i].frames_since_start = 0;
+  }
+}
+
+static int init(int argc, __attribute__((unused)) char **argv) {
+  int i, j;
+  if (argc != 0)
+    die("multi: there are no command-line arguments for the \"multi\" backend");
+  if (config.cfg == NULL)
+    die("multi: the outputs to use must be given in the \"multi\" section of the configuration "
+        "file");
+  config_setting_t *setting = config_lookup(config.cfg, "multi.outputs");
+  if (setting == NULL)
+    die("multi: no multi.outputs have been given in the configuration file");
+  output_count = config_setting_length(setting);
+  if ((output_count < 1) || (output_count > MULTI_MAXIMUM_OUTPUTS))
+    die("multi: multi.outputs has %d outputs. Between 1 and %d are allowed.", output_count,
+        MULTI_MAXIMUM_OUTPUTS);
+
+  for (i = 0; i < output_count; i++) {
+    config_setting_t *element = config_setting_get_elem(setting, i);
+    const char *str;
+    if (config_setting_lookup_string(element, "backend", &str) == 0)
+      die("multi: output %d of multi.outputs has no backend.", i + 1);
+    outputs[i].output = audio_get_output(str);
+    if (outputs[i].output == NULL)
+      die("multi: invalid audio backend \"%s\" given for output %d.", str, i + 1);
+    if (outputs[i].output == &audio_multi)
+      die("multi: the \"multi\" backend can not be one of its own outputs.");
+    for (j = 0; j < i; j++)
+      if (outputs[j].output == outputs[i].output)
+        die("multi: the \"%s\" backend can only be used once.", str);
+    outputs[i].offset = 0.0;
+    if ((config_setting_lookup_float(element, "offset_in_seconds", &outputs[i].offset)) &&
+        (i == 0) && (outputs[i].offset != 0.0))
+      warn("multi: the offset of the first output is ignored -- the others are relative to it.");
+  }
+
+  // initialise the primary output last, so that its settings for the general audio options,
+  // such as the buffer length and the latency offset, are the ones the player uses
+  for (i = output_count - 1; i >= 0; i--) {
+    debug(1, "multi: output %d is \"%s\", offset by %f seconds.", i + 1,
+          outputs[i].output->name, i == 0 ? 0.0 : outputs[i].offset);
+    if (outputs[i].output->init(0, no_arguments + 1) != 0)
+      die("multi: the \"%s\" backend could not be initialised.", outputs[i].output->name);
+  }
+
+  // the player synchronises to the primary output, so offer what it offers
+  if (outputs[0].output->delay == NULL)
+    audio_multi.delay = NULL;
+  if (outputs[0].output->rate_info == NULL)
+    audio_multi.rate_info = NULL;
+  if (outputs[0].output->is_running == NULL)
+    audio_multi.is_running = NULL;
+  return 0;
+}
+
+static void deinit(void) {
+  int i;
+  for (i = 0; i < output_count; i++)
+    if (outputs[i].output->deinit)
+      outputs[i].output->deinit();
+  free(scratch);
+  scratch = NULL;
+  scratch_frames = 0;
+}
+
+static int prepare(void) {
+  int i, response = 0;
+  for (i = output_count - 1; i >= 0; i--)
+    if ((outputs[i].output->prepare) && (outputs[i].output->prepare() != 0))
+      response = -1;
+  return response;
+}
+
+static void start(int sample_rate, int sample_format) {
+  int i;
+  frame_bytes = multi_frame_bytes(sample_format);
+  free(scratch);
+  scratch = NULL;
+  scratch_frames = 0;
+  for (i = 0; i < output_count; i++) {
+    outputs[i].offset_frames = (int64_t)(outputs[i].offset * sample_rate);
+    outputs[i].output->start(sample_rate, sample_format);
+  }
+  reset_compensation();
+}
+
+// play what's due to a secondary output, applying its compensation
+static void play_secondary(multi_output *m, void *buf, int samples, long primary_delay,
+                           int primary_delay_valid) {
+  char *frames = buf;
+  int count = samples;
+  if (m->pending_frames > 0) {
+    // delay it by playing some silence first, a packet's worth at a time
+    size_t silence = m->pending_frames > samples ? samples : m->pending_frames;
+    const void *frames_of_silence =
+        silence_get(config.output_format, 0, silence, NULL, &silence);
+    m->output->play((void *)frames_of_silence, silence);
+    m->pending_frames -= silence;
+  } else if (m->pending_frames < 0) {
+    int drop = -m->pending_frames > samples ? samples : -m->pending_frames;
+    frames += drop * frame_bytes;
+    count -= drop;
+    m->pending_frames += drop;
+  } else if ((primary_delay_valid) && (m->output->delay) &&
+             (m->frames_since_start > config.output_rate)) {
+    long secondary_delay;
+    if (m->output->delay(&secondary_delay) == 0) {
+      // positive if this output is behind where it should be
+      int64_t error = (int64_t)secondary_delay - (primary_delay + m->offset_frames);
+      int64_t abs_error = error < 0 ? -error : error;
+      if ((config.resyncthreshold > 0.0) &&
+          (abs_error > config.resyncthreshold * config.output_rate)) {
+        debug(1, "multi: \"%s\" is %" PRId64 " frames out -- resynchronising it.",
+              m->output->name, error);
+        m->pending_frames = -error;
+      } else if (error > config.tolerance * config.output_rate) {
+        count--; // drop the last frame
+      } else if ((error < -config.tolerance * config.output_rate) && (count > 0)) {
+        ensure_scratch(count + 1); // repeat the last frame
+        memcpy(scratch, frames, count * frame_bytes);
+        memcpy(scratch + count * frame_bytes, frames + (count - 1) * frame_bytes, frame_bytes);
+        frames = scratch;
+        count++;
+      }
+    }
+  }
+  if (count > 0)
+    m->output->play(frames, count);
+  m->frames_since_start += count;
+}
+
+static int play(void *buf, int samples) {
+  int i;
+  int response = outputs[0].output->play(buf, samples);
+  long primary_delay = 0;
+  int primary_delay_valid = 0;
+  if ((output_count > 1) && (outputs[0].output->delay))
+    primary_delay_valid = (outputs[0].output->delay(&primary_delay) == 0);
+  for (i = 1; i < output_count; i++)
+    play_secondary(&outputs[i], buf, samples, primary_delay, primary_delay_valid);
+  return response;
+}
+
+static void stop(void) {
+  int i;
+  for (i = 0; i < output_count; i++)
+    if (outputs[i].output->stop)
+      outputs[i].output->stop();
+}
+
+static void flush(void) {
+  int i;
+  for (i = 0; i < output_count; i++)
+    if (outputs[i].output->flush)
+      outputs[i].output->flush();
+  reset_compensation();
+}
+
+static void discard(void) {
+  int i;
+  for (i = 0; i < output_count; i++)
+    if (outputs[i].output->discard)
+      outputs[i].output->discard();
+}
+
+static int is_running(void) { return outputs[0].output->is_running(); }
+
+static int delay(long *the_delay) { return outputs[0].output->delay(the_delay); }
+
+static int rate_info(uint64_t *elapsed_time, uint64_t *frames_played) {
+  return outputs[0].output->rate_info(elapsed_time, frames_played);
+}
+
+static void help(void) {
+  printf("    There are no command-line options for the multi backend.\n"
+         "    List the backends to use, the primary one first, in the \"multi\" section of the\n"
+         "    configuration file.\n");
+}
+
+audio_output audio_multi = {.name = "multi",
+                            .help = &help,
+                            .init = &init,
+                            .deinit = &deinit,
+                            .prepare = &prepare,
+                            .start = &start,
+                            .stop = &stop,
+                            .is_running = &is_running,
+                            .flush = &flush,
+                            .discard = &discard,
+                            .delay = &delay,
+                            .rate_info = &rate_info,
+                            .play = &play,
+                            .volume = NULL,
+                            .parameters = NULL,
+                            .mute = NULL};
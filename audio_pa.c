@@ -40,10 +40,11 @@
 #define FORMAT PA_SAMPLE_S16NE
 #define RATE 44100
 
-// Four seconds buffer -- should be plenty
-#define buffer_allocation 44100 * 4 * 2 * 2
+// A little under six seconds buffer -- should be plenty. It must be a power of two; see below.
+#define buffer_allocation (1 << 20)
 
-static pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Playback starts once this much is waiting, unless twice the server's buffer length is more
+#define minimum_bytes_before_uncorking 11025 * 2 * 2
 
 /*
 static struct {
@@ -57,9 +58,34 @@ pa_threaded_mainloop *mainloop;
 pa_mainloop_api *mainloop_api;
 pa_context *context;
 pa_stream *stream;
-char *audio_lmb, *audio_umb, *audio_toq, *audio_eoq;
-size_t audio_size = buffer_allocation;
-size_t audio_occupancy;
+
+// The audio waiting to be sent to the server is kept in a single-producer single-consumer ring.
+// Only play() writes to it, from the player thread, and only stream_write_cb reads from it, from
+// the mainloop thread, so neither has to wait for the other.
+// The write and read counts run on; the difference between them is the occupancy. They wrap
+// after 4 GB on 32-bit systems, so the ring's size is a power of two to keep the offsets into it
+// continuous across the wrap.
+// Flushing moves the read count, so it's only done with the mainloop locked, when the callback
+// can't be running.
+static char *audio_ring;
+static const size_t audio_size = buffer_allocation;
+static size_t audio_ring_bytes_written; // set by play()
+static size_t audio_ring_bytes_read;    // set by stream_write_cb
+static size_t bytes_before_uncorking;
+
+static inline size_t audio_occupancy() {
+  size_t bytes_read = __atomic_load_n(&audio_ring_bytes_read, __ATOMIC_ACQUIRE);
+  return __atomic_load_n(&audio_ring_bytes_written, __ATOMIC_ACQUIRE) - bytes_read;
+}
+
+static void audio_ring_flush() {
+  __atomic_store_n(&audio_ring_bytes_read,
+                   __atomic_load_n(&audio_ring_bytes_written, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+// The rate of the sink's clock is measured from the timing information the server sends, which
+// gives the position of the stream at a known moment. Protected by the mainloop lock.
+static audio_rate_measurement rate_measurement;
 
 void context_state_cb(pa_context *context, void *mainloop);
 void stream_state_cb(pa_stream *s, void *mainloop);
@@ -75,6 +101,7 @@ static int init(__attribute__((unused)) int argc, __attribute__((unused)) char *
             // instead.
 
   config.audio_backend_latency_offset = 0;
+  config.pa_server_latency = 0.1;
 
   // get settings from settings file
 
@@ -99,17 +126,30 @@ static int init(__attribute__((unused)) int argc, __attribute__((unused)) char *
     if (config_lookup_string(config.cfg, "pa.sink", &str)) {
       config.pa_sink = (char *)str;
     }
+
+    /* Get the length of the buffer the server is asked to keep. */
+    double dvalue;
+    if (config_lookup_float(config.cfg, "pa.server_latency_in_seconds", &dvalue)) {
+      if ((dvalue < 0.01) || (dvalue > config.audio_backend_buffer_desired_length / 2))
+        die("Invalid pa server_latency_in_seconds value: \"%f\". It should be between 0.01 and "
+            "half of audio_backend_buffer_desired_length_in_seconds of %.3f. The default is 0.1 "
+            "seconds.",
+            dvalue, config.audio_backend_buffer_desired_length);
+      else
+        config.pa_server_latency = dvalue;
+    }
   }
+  if (config.pa_server_latency > config.audio_backend_buffer_desired_length / 2)
+    config.pa_server_latency = config.audio_backend_buffer_desired_length / 2;
+  debug(1, "pa server latency is %.3f seconds.", config.pa_server_latency);
 
   // finish collecting settings
 
-  // allocate space for the audio buffer
-  audio_lmb = malloc(audio_size);
-  if (audio_lmb == NULL)
+  // allocate space for the audio buffer, once and for all
+  audio_ring = malloc(audio_size);
+  if (audio_ring == NULL)
     die("Can't allocate %d bytes for pulseaudio buffer.", audio_size);
-  audio_toq = audio_eoq = audio_lmb;
-  audio_umb = audio_lmb + audio_size;
-  audio_occupancy = 0;
+  audio_ring_bytes_written = audio_ring_bytes_read = 0;
 
   // Get a mainloop and its context
   mainloop = pa_threaded_mainloop_new();
@@ -161,8 +201,12 @@ static void deinit(void) {
 static void start(__attribute__((unused)) int sample_rate,
                   __attribute__((unused)) int sample_format) {
 
-  uint32_t buffer_size_in_bytes = (uint32_t)2 * 2 * RATE * 0.1; // hard wired in here
+  uint32_t buffer_size_in_bytes = (uint32_t)(2 * 2 * RATE * config.pa_server_latency);
+  buffer_size_in_bytes -= buffer_size_in_bytes % (2 * 2); // whole frames
   // debug(1, "pa_buffer size is %u bytes.", buffer_size_in_bytes);
+  bytes_before_uncorking = minimum_bytes_before_uncorking;
+  if (bytes_before_uncorking < 2 * buffer_size_in_bytes)
+    bytes_before_uncorking = 2 * buffer_size_in_bytes;
 
   pa_threaded_mainloop_lock(mainloop);
   // Create a playback stream
@@ -179,11 +223,12 @@ static void start(__attribute__((unused)) int sample_rate,
   pa_stream_set_write_callback(stream, stream_write_cb, mainloop);
   //    pa_stream_set_latency_update_callback(stream, stream_latency_cb, mainloop);
 
-  // recommended settings, i.e. server uses sensible values
+  // The server keeps the given length of audio and won't start, or restart after an underrun,
+  // until it has all of it, so that what it plays is always where the player put it.
   pa_buffer_attr buffer_attr;
   buffer_attr.maxlength = (uint32_t)-1;
   buffer_attr.tlength = buffer_size_in_bytes;
-  buffer_attr.prebuf = (uint32_t)0;
+  buffer_attr.prebuf = buffer_size_in_bytes;
   buffer_attr.minreq = (uint32_t)-1;
 
   // Settings copied as per the chromium browser source
@@ -220,6 +265,7 @@ static void start(__attribute__((unused)) int sample_rate,
     pa_threaded_mainloop_wait(mainloop);
   }
 
+  audio_rate_measurement_reset(&rate_measurement);
   pa_threaded_mainloop_unlock(mainloop);
 }
 
@@ -227,23 +273,27 @@ static int play(void *buf, int samples) {
   // debug(1,"pa_play of %d samples.",samples);
   // copy the samples into the queue
   size_t bytes_to_transfer = samples * 2 * 2;
-  size_t space_to_end_of_buffer = audio_umb - audio_eoq;
+  size_t bytes_written = audio_ring_bytes_written; // only ever changed here
+  size_t space = audio_size - (bytes_written -
+                               __atomic_load_n(&audio_ring_bytes_read, __ATOMIC_ACQUIRE));
+  if (bytes_to_transfer > space) {
+    debug(1, "pa: buffer overflow -- %zu frames dropped.",
+          (bytes_to_transfer - space) / (2 * 2));
+    bytes_to_transfer = space;
+  }
+  size_t offset = bytes_written % audio_size;
+  size_t space_to_end_of_buffer = audio_size - offset;
   if (space_to_end_of_buffer >= bytes_to_transfer) {
-    memcpy(audio_eoq, buf, bytes_to_transfer);
-    audio_occupancy += bytes_to_transfer;
-    pthread_mutex_lock(&buffer_mutex);
-    audio_eoq += bytes_to_transfer;
-    pthread_mutex_unlock(&buffer_mutex);
+    memcpy(audio_ring + offset, buf, bytes_to_transfer);
   } else {
-    memcpy(audio_eoq, buf, space_to_end_of_buffer);
-    buf += space_to_end_of_buffer;
-    memcpy(audio_lmb, buf, bytes_to_transfer - space_to_end_of_buffer);
-    pthread_mutex_lock(&buffer_mutex);
-    audio_occupancy += bytes_to_transfer;
-    pthread_mutex_unlock(&buffer_mutex);
-    audio_eoq = audio_lmb + bytes_to_transfer - space_to_end_of_buffer;
+    memcpy(audio_ring + offset, buf, space_to_end_of_buffer);
+    memcpy(audio_ring, (char *)buf + space_to_end_of_buffer,
+           bytes_to_transfer - space_to_end_of_buffer);
   }
-  if ((audio_occupancy >= 11025 * 2 * 2) && (pa_stream_is_corked(stream))) {
+  // make the audio visible to stream_write_cb only once it's all there
+  __atomic_store_n(&audio_ring_bytes_written, bytes_written + bytes_to_transfer,
+                   __ATOMIC_RELEASE);
+  if ((audio_occupancy() >= bytes_before_uncorking) && (pa_stream_is_corked(stream))) {
     // debug(1,"Uncorked");
     pa_threaded_mainloop_lock(mainloop);
     pa_stream_cork(stream, 0, stream_success_cb, mainloop);
@@ -267,13 +317,37 @@ int pa_delay(long *the_delay) {
     // debug(1,"Error %d getting latency.",gl);
     reply = -EIO;
   } else {
-    result = (audio_occupancy / (2 * 2)) + (latency * 44100) / 1000000;
+    result = (audio_occupancy() / (2 * 2)) + (latency * 44100) / 1000000;
     reply = 0;
   }
   *the_delay = result;
   return reply;
 }
 
+int pa_rate_info(uint64_t *elapsed_time, uint64_t *frames_played) {
+  pa_threaded_mainloop_lock(mainloop);
+  const pa_timing_info *timing_info = NULL;
+  if (stream)
+    timing_info = pa_stream_get_timing_info(stream);
+  if ((timing_info == NULL) || (timing_info->read_index_corrupt) || (timing_info->playing == 0)) {
+    audio_rate_measurement_reset(&rate_measurement);
+  } else {
+    // the frames that had been played when the timing information was current are the frames
+    // the server had taken from the stream less those still on their way through the sink
+    int64_t frames_read = timing_info->read_index / (2 * 2);
+    int64_t frames_in_sink = (timing_info->sink_usec * RATE) / 1000000;
+    // the timestamp is from the real-time clock, so use its age to place it on ours
+    uint64_t age = (uint64_t)pa_timeval_age(&timing_info->timestamp) * 1000; // nanoseconds
+    uint64_t time_now = get_absolute_time_in_ns();
+    if ((frames_read >= frames_in_sink) && (age < time_now))
+      audio_rate_measurement_update(&rate_measurement, time_now - age,
+                                    frames_read - frames_in_sink);
+  }
+  int response = audio_rate_measurement_get(&rate_measurement, elapsed_time, frames_played);
+  pa_threaded_mainloop_unlock(mainloop);
+  return response;
+}
+
 void flush(void) {
   // Cork the stream so it will stop playing
   pa_threaded_mainloop_lock(mainloop);
@@ -282,10 +356,9 @@ void flush(void) {
     pa_stream_flush(stream, stream_success_cb, NULL);
     pa_stream_cork(stream, 1, stream_success_cb, mainloop);
   }
+  audio_rate_measurement_reset(&rate_measurement);
+  audio_ring_flush();
   pa_threaded_mainloop_unlock(mainloop);
-  audio_toq = audio_eoq = audio_lmb;
-  audio_umb = audio_lmb + audio_size;
-  audio_occupancy = 0;
 }
 
 static void stop(void) {
@@ -296,10 +369,9 @@ static void stop(void) {
     pa_stream_flush(stream, stream_success_cb, NULL);
     pa_stream_cork(stream, 1, stream_success_cb, mainloop);
   }
+  audio_rate_measurement_reset(&rate_measurement);
+  audio_ring_flush();
   pa_threaded_mainloop_unlock(mainloop);
-  audio_toq = audio_eoq = audio_lmb;
-  audio_umb = audio_lmb + audio_size;
-  audio_occupancy = 0;
 
   // debug(1,"pa stop");
   pa_stream_disconnect(stream);
@@ -315,6 +387,7 @@ audio_output audio_pa = {.name = "pa",
                          .is_running = NULL,
                          .flush = &flush,
                          .delay = &pa_delay,
+                         .rate_info = &pa_rate_info,
                          .play = &play,
                          .volume = NULL,
                          .parameters = NULL,
@@ -360,52 +433,50 @@ void stream_write_cb(pa_stream *stream, size_t requested_bytes,
       }
     }
   */
-  int bytes_to_transfer = requested_bytes;
-  int bytes_transferred = 0;
-  uint8_t *buffer = NULL;
+  size_t bytes_to_transfer = requested_bytes;
+  size_t bytes_transferred = 0;
+  size_t bytes_read = audio_ring_bytes_read; // only ever changed here, or with the mainloop locked
+  size_t occupancy = __atomic_load_n(&audio_ring_bytes_written, __ATOMIC_ACQUIRE) - bytes_read;
+
+  if ((occupancy > 0) && (occupancy < bytes_to_transfer)) {
+    // debug(1, "Underflow? We have %d bytes but we are asked for %d bytes", occupancy,
+    //      bytes_to_transfer);
+    pa_stream_cork(stream, 1, stream_success_cb, mainloop);
+    audio_rate_measurement_reset(&rate_measurement); // the stream's position will stand still
+    // debug(1, "Corked");
+  }
+  if (bytes_to_transfer > occupancy)
+    bytes_to_transfer = occupancy;
 
-  while ((bytes_to_transfer > 0) && (audio_occupancy > 0)) {
+  while (bytes_to_transfer > 0) {
+    // Get a buffer from the server to copy the audio straight into -- it may be smaller than
+    // asked for -- and hand it back to the server in the write, so the audio is copied only once.
+    uint8_t *buffer = NULL;
     size_t bytes_we_can_transfer = bytes_to_transfer;
-    if (audio_occupancy < bytes_we_can_transfer) {
-      // debug(1, "Underflow? We have %d bytes but we are asked for %d bytes", audio_occupancy,
-      //      bytes_we_can_transfer);
-      pa_stream_cork(stream, 1, stream_success_cb, mainloop);
-      // debug(1, "Corked");
-      bytes_we_can_transfer = audio_occupancy;
+    if ((pa_stream_begin_write(stream, (void **)&buffer, &bytes_we_can_transfer) < 0) ||
+        (buffer == NULL) || (bytes_we_can_transfer == 0)) {
+      debug(1, "pa: can't get a buffer to write to the stream.");
+      break;
     }
-
-    // bytes we can transfer will never be greater than the bytes available
-
-    pa_stream_begin_write(stream, (void **)&buffer, &bytes_we_can_transfer);
-    if (bytes_we_can_transfer <= (size_t)(audio_umb - audio_toq)) {
-      // the bytes are all in a row in the audo buffer
-      memcpy(buffer, audio_toq, bytes_we_can_transfer);
-      audio_toq += bytes_we_can_transfer;
-      // lock
-      pthread_mutex_lock(&buffer_mutex);
-      audio_occupancy -= bytes_we_can_transfer;
-      pthread_mutex_unlock(&buffer_mutex);
-      // unlock
-      pa_stream_write(stream, buffer, bytes_we_can_transfer, NULL, 0LL, PA_SEEK_RELATIVE);
-      bytes_transferred += bytes_we_can_transfer;
+    if (bytes_we_can_transfer > bytes_to_transfer)
+      bytes_we_can_transfer = bytes_to_transfer;
+    size_t offset = bytes_read % audio_size;
+    size_t first_portion_to_write = audio_size - offset;
+    if (first_portion_to_write >= bytes_we_can_transfer) {
+      // the bytes are all in a row in the audio buffer
+      memcpy(buffer, audio_ring + offset, bytes_we_can_transfer);
     } else {
       // the bytes are in two places in the audio buffer
-      size_t first_portion_to_write = audio_umb - audio_toq;
-      if (first_portion_to_write != 0)
-        memcpy(buffer, audio_toq, first_portion_to_write);
-      uint8_t *new_buffer = buffer + first_portion_to_write;
-      memcpy(new_buffer, audio_lmb, bytes_we_can_transfer - first_portion_to_write);
-      pa_stream_write(stream, buffer, bytes_we_can_transfer, NULL, 0LL, PA_SEEK_RELATIVE);
-      bytes_transferred += bytes_we_can_transfer;
-      audio_toq = audio_lmb + bytes_we_can_transfer - first_portion_to_write;
-      // lock
-      pthread_mutex_lock(&buffer_mutex);
-      audio_occupancy -= bytes_we_can_transfer;
-      pthread_mutex_unlock(&buffer_mutex);
-      // unlock
+      memcpy(buffer, audio_ring + offset, first_portion_to_write);
+      memcpy(buffer + first_portion_to_write, audio_ring,
+             bytes_we_can_transfer - first_portion_to_write);
     }
+    pa_stream_write(stream, buffer, bytes_we_can_transfer, NULL, 0LL, PA_SEEK_RELATIVE);
+    bytes_read += bytes_we_can_transfer;
+    // give the space back to play()
+    __atomic_store_n(&audio_ring_bytes_read, bytes_read, __ATOMIC_RELEASE);
+    bytes_transferred += bytes_we_can_transfer;
     bytes_to_transfer -= bytes_we_can_transfer;
-    // debug(1,"audio_toq is %llx",audio_toq);
   }
 
   // debug(1,"<<<Frames requested %d, written to pa: %d, corked status:
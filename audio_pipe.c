@@ -30,6 +30,7 @@
 
 #include "audio.h"
 #include "common.h"
+#include "pipe_writer.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <memory.h>
@@ -40,12 +41,22 @@
 #include <unistd.h>
 
 static int fd = -1;
+static uint64_t time_of_last_open_attempt = 0;
 
 char *pipename = NULL;
 char *default_pipe_name = "/tmp/shairport-sync-audio";
 
-static void start(__attribute__((unused)) int sample_rate,
-                  __attribute__((unused)) int sample_format) {
+// if buffered, the pipe is written by a thread of its own, and the pipe's reader sets the pace
+static int buffered = 0;
+static pipe_writer writer;
+
+extern audio_output audio_pipe;
+
+static void start(int sample_rate, __attribute__((unused)) int sample_format) {
+  if (buffered) {
+    pipe_writer_start(&writer, sample_rate);
+    return;
+  }
 
   // this will leave fd as -1 if a reader hasn't been attached to the pipe
   // we check that it's not a "real" error though. From the "man 2 open" page:
@@ -53,6 +64,7 @@ static void start(__attribute__((unused)) int sample_rate,
   // open for reading."
 
   fd = try_to_open_pipe_for_writing(pipename);
+  time_of_last_open_attempt = get_absolute_time_in_ns();
   // we check that it's not a "real" error. From the "man 2 open" page:
   // "ENXIO  O_NONBLOCK | O_WRONLY is set, the named file is a FIFO, and no process has the FIFO
   // open for reading." Which is okay.
@@ -67,10 +79,15 @@ static void start(__attribute__((unused)) int sample_rate,
 }
 
 static int play(void *buf, int samples) {
-  // if the file is not open, try to open it.
+  if (buffered) {
+    pipe_writer_write(&writer, buf, samples * 4);
+    return 0;
+  }
+  // if the file is not open, try to open it, but not more than once a second
   char errorstring[1024];
-  if (fd == -1) {
+  if ((fd == -1) && (get_absolute_time_in_ns() - time_of_last_open_attempt > 1000000000)) {
     fd = try_to_open_pipe_for_writing(pipename);
+    time_of_last_open_attempt = get_absolute_time_in_ns();
   }
   // if it's got a reader, write to it.
   if (fd > 0) {
@@ -89,11 +106,17 @@ static void stop(void) {
   // Don't close the pipe just because a play session has stopped.
 }
 
+static int delay(long *the_delay) { return pipe_writer_delay(&writer, the_delay); }
+
+static void flush(void) { pipe_writer_flush(&writer); }
+
 static int init(int argc, char **argv) {
   //  debug(1, "pipe init");
   //  const char *str;
   //  int value;
   //  double dvalue;
+  double buffer_length = 2.0;
+  pipe_writer_overrun_policy overrun_policy = pipe_writer_drop_oldest;
 
   // set up default values first
 
@@ -109,6 +132,7 @@ static int init(int argc, char **argv) {
     if (config_lookup_string(config.cfg, "pipe.name", &str)) {
       pipename = (char *)str;
     }
+    pipe_writer_parse_options("pipe", &buffered, &buffer_length, &overrun_policy);
   }
 
   if (argc > 1)
@@ -131,10 +155,19 @@ static int init(int argc, char **argv) {
 
   debug(1, "audio pipe name is \"%s\"", pipename);
 
+  if (buffered) {
+    pipe_writer_create(&writer, "pipe", pipename, -1, buffer_length, 44100, 4, overrun_policy);
+    audio_pipe.delay = &delay;
+    audio_pipe.flush = &flush;
+    audio_pipe.discard = &flush; // the writer may hold up to buffer_length_in_seconds of audio
+  }
+
   return 0;
 }
 
 static void deinit(void) {
+  if (buffered)
+    pipe_writer_destroy(&writer);
   if (fd > 0)
     close(fd);
 }
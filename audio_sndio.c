@@ -37,6 +37,7 @@ static int play(void *, int);
 static void stop(void);
 static void onmove_cb(void *, int);
 static int delay(long *);
+static int rate_info(uint64_t *, uint64_t *);
 static void flush(void);
 
 audio_output audio_sndio = {.name = "sndio",
@@ -49,18 +50,26 @@ audio_output audio_sndio = {.name = "sndio",
                             .is_running = NULL,
                             .flush = &flush,
                             .delay = &delay,
+                            .rate_info = &rate_info,
                             .play = &play,
                             .volume = NULL,
                             .parameters = NULL,
                             .mute = NULL};
 
+// sndio_mutex is held for operations on the handle, including the sio_write in play(), which
+// blocks until the device has taken all the audio. The onmove callback is made from inside
+// sio_write, so the position it gives, and the count of what has been written, have a mutex of
+// their own -- position_mutex -- which is never held while waiting on the device. Thus delay()
+// and rate_info() don't have to wait for a write to finish, and always see the latest position.
 static pthread_mutex_t sndio_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t position_mutex = PTHREAD_MUTEX_INITIALIZER;
 static struct sio_hdl *hdl;
 static int framesize;
-static size_t played;
-static size_t written;
-int64_t time_of_last_onmove_cb;
-int at_least_one_onmove_cb_seen;
+static size_t played;  // frames
+static size_t written; // bytes
+static int64_t time_of_last_onmove_cb;
+static int at_least_one_onmove_cb_seen;
+static audio_rate_measurement rate_measurement; // from the positions given to onmove_cb
 struct sio_par par;
 
 struct sndio_formats {
@@ -83,6 +92,16 @@ static struct sndio_formats formats[] = {{"S8", SPS_FORMAT_S8, 44100, 8, 1, 1, S
                                          {"S24_3BE", SPS_FORMAT_S24_3BE, 44100, 24, 3, 1, 0},
                                          {"S32", SPS_FORMAT_S32, 44100, 24, 4, 1, SIO_LE_NATIVE}};
 
+// called with sndio_mutex held, so that no write or callback is in progress
+static void reset_position() {
+  pthread_mutex_lock(&position_mutex);
+  written = played = 0;
+  time_of_last_onmove_cb = 0;
+  at_least_one_onmove_cb_seen = 0;
+  audio_rate_measurement_reset(&rate_measurement);
+  pthread_mutex_unlock(&position_mutex);
+}
+
 static void help() { printf("    -d output-device    set the output device [default*|...]\n"); }
 
 static int init(int argc, char **argv) {
@@ -174,9 +193,7 @@ static int init(int argc, char **argv) {
   if (!hdl)
     die("sndio: cannot open audio device");
 
-  written = played = 0;
-  time_of_last_onmove_cb = 0;
-  at_least_one_onmove_cb_seen = 0;
+  reset_position();
 
   for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
     if (formats[i].fmt == config.output_format) {
@@ -223,16 +240,26 @@ static void start(__attribute__((unused)) int sample_rate,
   pthread_mutex_lock(&sndio_mutex);
   if (!sio_start(hdl))
     die("sndio: unable to start");
-  written = played = 0;
-  time_of_last_onmove_cb = 0;
-  at_least_one_onmove_cb_seen = 0;
+  reset_position();
   pthread_mutex_unlock(&sndio_mutex);
 }
 
 static int play(void *buf, int frames) {
   if (frames > 0) {
     pthread_mutex_lock(&sndio_mutex);
-    written += sio_write(hdl, buf, frames * framesize);
+    // count the audio as written before it's handed over, as sio_write() may not return until
+    // the device has played some of it, and the position given to onmove_cb in the meantime must
+    // not get ahead of what has been written
+    pthread_mutex_lock(&position_mutex);
+    written += frames * framesize;
+    pthread_mutex_unlock(&position_mutex);
+    size_t bytes_written = sio_write(hdl, buf, frames * framesize);
+    if (bytes_written != (size_t)(frames * framesize)) {
+      debug(1, "sndio: only %zu of %d bytes were written.", bytes_written, frames * framesize);
+      pthread_mutex_lock(&position_mutex);
+      written -= frames * framesize - bytes_written;
+      pthread_mutex_unlock(&position_mutex);
+    }
     pthread_mutex_unlock(&sndio_mutex);
   }
   return 0;
@@ -242,18 +269,23 @@ static void stop() {
   pthread_mutex_lock(&sndio_mutex);
   if (!sio_stop(hdl))
     die("sndio: unable to stop");
-  written = played = 0;
+  reset_position();
   pthread_mutex_unlock(&sndio_mutex);
 }
 
+// made from inside sio_write() as the device plays the audio, delta frames at a time
 static void onmove_cb(__attribute__((unused)) void *arg, int delta) {
-  time_of_last_onmove_cb = get_absolute_time_in_ns();
+  uint64_t time_now = get_absolute_time_in_ns();
+  pthread_mutex_lock(&position_mutex);
+  time_of_last_onmove_cb = time_now;
   at_least_one_onmove_cb_seen = 1;
   played += delta;
+  audio_rate_measurement_update(&rate_measurement, time_now, played);
+  pthread_mutex_unlock(&position_mutex);
 }
 
 static int delay(long *_delay) {
-  pthread_mutex_lock(&sndio_mutex);
+  pthread_mutex_lock(&position_mutex);
   size_t estimated_extra_frames_output = 0;
   if (at_least_one_onmove_cb_seen) { // when output starts, the onmove_cb callback will be made
     // calculate the difference in time between now and when the last callback occurred,
@@ -270,14 +302,21 @@ static int delay(long *_delay) {
     // %d.",played,estimated_extra_frames_output);
   }
   *_delay = (written / framesize) - (played + estimated_extra_frames_output);
-  pthread_mutex_unlock(&sndio_mutex);
+  pthread_mutex_unlock(&position_mutex);
   return 0;
 }
 
+static int rate_info(uint64_t *elapsed_time, uint64_t *frames_played) {
+  pthread_mutex_lock(&position_mutex);
+  int response = audio_rate_measurement_get(&rate_measurement, elapsed_time, frames_played);
+  pthread_mutex_unlock(&position_mutex);
+  return response;
+}
+
 static void flush() {
   pthread_mutex_lock(&sndio_mutex);
   if (!sio_stop(hdl) || !sio_start(hdl))
     die("sndio: unable to flush");
-  written = played = 0;
+  reset_position();
   pthread_mutex_unlock(&sndio_mutex);
 }
@@ -1,6 +1,8 @@
 #include "audio.h"
 #include "common.h"
+#include <errno.h>
 #include <memory.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -14,65 +16,123 @@ struct SoundIoRingBuffer *ring_buffer = NULL;
 
 static int min_int(int a, int b) { return (a < b) ? a : b; }
 
+// The player hands its audio over in its own time, but libsoundio asks for it from a thread of its
+// own in write_callback, so the audio waits in ring_buffer in between. The player renders straight
+// into the ring, through get_write_buffer and commit, and write_callback copies it into the areas
+// given by soundio_outstream_begin_write -- in one go when they are interleaved, as they usually
+// are.
+//
+// After each write, write_callback notes the stream's latency -- how long it will be before the
+// next frame it is given will be heard -- and when it was noted. From that, delay() can work out
+// how much of what has been given to the device is still to be played, and rate_info() how many
+// frames the device has played and when.
+
+static pthread_mutex_t position_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t frames_given_to_device; // since the stream started, silence included
+static uint64_t time_of_latency_measurement;
+static double latency_at_measurement; // in frames
+static audio_rate_measurement rate_measurement;
+
+static void reset_position(void) {
+  pthread_mutex_lock(&position_mutex);
+  frames_given_to_device = 0;
+  time_of_latency_measurement = 0;
+  latency_at_measurement = 0.0;
+  audio_rate_measurement_reset(&rate_measurement);
+  pthread_mutex_unlock(&position_mutex);
+}
+
+// copy frames from the ring (or silence, if in is NULL) into the areas
+static void write_frames(struct SoundIoOutStream *outstream, struct SoundIoChannelArea *areas,
+                         const char *in, int frame_count) {
+  int channel_count = outstream->layout.channel_count;
+  int bytes_per_sample = outstream->bytes_per_sample;
+  int bytes_per_frame = outstream->bytes_per_frame;
+  int interleaved = (areas[0].step == bytes_per_frame);
+  int ch;
+  for (ch = 1; (ch < channel_count) && (interleaved != 0); ch++)
+    if ((areas[ch].step != bytes_per_frame) ||
+        (areas[ch].ptr != areas[0].ptr + ch * bytes_per_sample))
+      interleaved = 0;
+  if (interleaved) {
+    if (in)
+      memcpy(areas[0].ptr, in, frame_count * bytes_per_frame);
+    else
+      memset(areas[0].ptr, 0, frame_count * bytes_per_frame);
+  } else {
+    int frame;
+    for (frame = 0; frame < frame_count; frame++) {
+      for (ch = 0; ch < channel_count; ch++) {
+        char *out = areas[ch].ptr + frame * areas[ch].step;
+        if (in) {
+          memcpy(out, in, bytes_per_sample);
+          in += bytes_per_sample;
+        } else {
+          memset(out, 0, bytes_per_sample);
+        }
+      }
+    }
+  }
+}
+
 static void write_callback(struct SoundIoOutStream *outstream, int frame_count_min,
                            int frame_count_max) {
   struct SoundIoChannelArea *areas;
-  // int frame_count;
   int err;
 
-  char *read_ptr = soundio_ring_buffer_read_ptr(ring_buffer);
-  int fill_bytes = soundio_ring_buffer_fill_count(ring_buffer);
-  int fill_count = fill_bytes / outstream->bytes_per_frame;
+  int fill_count = soundio_ring_buffer_fill_count(ring_buffer) / outstream->bytes_per_frame;
 
-  debug(3,
-        "[--->>] frame_count_min: %d , frame_count_max: %d , fill_bytes: %d , fill_count: %d , "
-        "outstream->bytes_per_frame: %d",
-        frame_count_min, frame_count_max, fill_bytes, fill_count, outstream->bytes_per_frame);
+  debug(3, "[--->>] frame_count_min: %d , frame_count_max: %d , fill_count: %d", frame_count_min,
+        frame_count_max, fill_count);
 
-  if (frame_count_min > fill_count) {
-    int frame_count = frame_count_min;
+  // send what's in the ring, up to the most the device will take, and then make up any shortfall
+  // below the least it will take with silence
+  int audio_frames_left = min_int(frame_count_max, fill_count);
+  int silent_frames_left = frame_count_min > audio_frames_left
+                               ? frame_count_min - audio_frames_left
+                               : 0;
+  if (silent_frames_left)
+    debug(3, "[--->>] %d frames of silence are needed.", silent_frames_left);
+
+  while ((audio_frames_left > 0) || (silent_frames_left > 0)) {
+    int frame_count = audio_frames_left > 0 ? audio_frames_left : silent_frames_left;
     if ((err = soundio_outstream_begin_write(outstream, &areas, &frame_count))) {
-      debug(0, "[--->>] begin write error: %s", soundio_strerror(err));
-    }
-    for (int frame = 0; frame < frame_count; frame += 1) {
-      for (int ch = 0; ch < outstream->layout.channel_count; ch += 1) {
-        memset(areas[ch].ptr, 0, outstream->bytes_per_sample);
-        areas[ch].ptr += areas[ch].step;
-      }
+      debug(1, "[--->>] begin write error: %s", soundio_strerror(err));
+      break;
     }
-    if ((err = soundio_outstream_end_write(outstream)))
-      debug(0, "[--->>] end write error: %s", soundio_strerror(err));
-    return;
-  }
-
-  int read_count = min_int(frame_count_max, fill_count);
-  int frames_left = read_count;
-
-  while (frames_left > 0) {
-    int frame_count = frames_left;
-
-    if ((err = soundio_outstream_begin_write(outstream, &areas, &frame_count)))
-      debug(0, "[--->>] begin write error: %s", soundio_strerror(err));
-
     if (frame_count <= 0)
       break;
 
-    for (int frame = 0; frame < frame_count; frame += 1) {
-      for (int ch = 0; ch < outstream->layout.channel_count; ch += 1) {
-        memcpy(areas[ch].ptr, read_ptr, outstream->bytes_per_sample);
-        areas[ch].ptr += areas[ch].step;
-        read_ptr += outstream->bytes_per_sample;
-      }
-    }
+    if (audio_frames_left > 0)
+      write_frames(outstream, areas, soundio_ring_buffer_read_ptr(ring_buffer), frame_count);
+    else
+      write_frames(outstream, areas, NULL, frame_count);
 
     if ((err = soundio_outstream_end_write(outstream)))
-      debug(0, "[--->>] end write error: %s", soundio_strerror(err));
-
-    frames_left -= frame_count;
+      debug(1, "[--->>] end write error: %s", soundio_strerror(err));
+
+    double latency = 0.0;
+    if ((err = soundio_outstream_get_latency(outstream, &latency)))
+      debug(3, "[--->>] get latency error: %s", soundio_strerror(err));
+    uint64_t time_now = get_absolute_time_in_ns();
+
+    pthread_mutex_lock(&position_mutex);
+    if (audio_frames_left > 0) {
+      soundio_ring_buffer_advance_read_ptr(ring_buffer, frame_count * outstream->bytes_per_frame);
+      audio_frames_left -= frame_count;
+    } else {
+      silent_frames_left -= frame_count;
+    }
+    frames_given_to_device += frame_count;
+    if (err == 0) {
+      time_of_latency_measurement = time_now;
+      latency_at_measurement = latency * outstream->sample_rate;
+      if (frames_given_to_device > latency_at_measurement)
+        audio_rate_measurement_update(&rate_measurement, time_now,
+                                      frames_given_to_device - (uint64_t)latency_at_measurement);
+    }
+    pthread_mutex_unlock(&position_mutex);
   }
-
-  debug(3, "[--->>]  Wrote: %d", read_count * outstream->bytes_per_frame);
-  soundio_ring_buffer_advance_read_ptr(ring_buffer, read_count * outstream->bytes_per_frame);
 }
 
 static void underflow_callback(__attribute__((unused)) struct SoundIoOutStream *outstream) {
@@ -147,13 +207,15 @@ static void start(int sample_rate, int sample_format) {
   if (outstream->layout_error)
     debug(0, "unable to set channel layout: %s\n", soundio_strerror(outstream->layout_error));
 
+  // the ring starts empty -- the player sends silence ahead of the audio itself to bring the delay
+  // up to what it needs, and write_callback makes up any shortfall with silence in the meantime
   int capacity = outstream->sample_rate * outstream->bytes_per_frame;
+  if (ring_buffer)
+    soundio_ring_buffer_destroy(ring_buffer);
   ring_buffer = soundio_ring_buffer_create(soundio, capacity);
   if (!ring_buffer)
     debug(0, "unable to create ring buffer: out of memory");
-  char *buf = soundio_ring_buffer_write_ptr(ring_buffer);
-  memset(buf, 0, capacity);
-  soundio_ring_buffer_advance_write_ptr(ring_buffer, capacity);
+  reset_position();
 
   if ((err = soundio_outstream_start(outstream))) {
     debug(0, "unable to start outstream: %s", soundio_strerror(err));
@@ -181,9 +243,54 @@ static int play(void *buf, int samples) {
     soundio_ring_buffer_advance_write_ptr(ring_buffer, write_bytes);
     debug(3, "[<<---] Written to buffer : %d\n", written_bytes);
   }
+  if (write_bytes < left_bytes)
+    debug(1, "soundio: the ring is full -- %d frames were discarded.",
+          (left_bytes - write_bytes) / outstream->bytes_per_frame);
   return 0;
 }
 
+// the ring buffer is mirrored in memory, so all its free space is contiguous and the player can
+// render into it directly
+static void *get_write_buffer(int frames) {
+  void *response = NULL;
+  if ((ring_buffer != NULL) && (outstream != NULL) &&
+      (soundio_ring_buffer_free_count(ring_buffer) >= frames * outstream->bytes_per_frame))
+    response = soundio_ring_buffer_write_ptr(ring_buffer);
+  return response;
+}
+
+static int commit(int frames) {
+  soundio_ring_buffer_advance_write_ptr(ring_buffer, frames * outstream->bytes_per_frame);
+  return 0;
+}
+
+// the frames waiting in the ring, plus those given to the device that the latency measurement,
+// brought up to date, says it has yet to play
+static int delay(long *the_delay) {
+  if ((ring_buffer == NULL) || (outstream == NULL))
+    return -EIO;
+  pthread_mutex_lock(&position_mutex);
+  long fill_count = soundio_ring_buffer_fill_count(ring_buffer) / outstream->bytes_per_frame;
+  double frames_in_device = 0.0;
+  if (time_of_latency_measurement != 0) {
+    uint64_t time_since_measurement = get_absolute_time_in_ns() - time_of_latency_measurement;
+    frames_in_device = latency_at_measurement -
+                       (time_since_measurement * 0.000000001) * outstream->sample_rate;
+    if (frames_in_device < 0.0)
+      frames_in_device = 0.0;
+  }
+  pthread_mutex_unlock(&position_mutex);
+  *the_delay = fill_count + (long)frames_in_device;
+  return 0;
+}
+
+static int rate_info(uint64_t *elapsed_time, uint64_t *frames_played) {
+  pthread_mutex_lock(&position_mutex);
+  int response = audio_rate_measurement_get(&rate_measurement, elapsed_time, frames_played);
+  pthread_mutex_unlock(&position_mutex);
+  return response;
+}
+
 static void parameters(audio_parameters *info) {
   info->minimum_volume_dB = -30.0;
   info->maximum_volume_dB = 0.0;
@@ -195,12 +302,16 @@ static void parameters(audio_parameters *info) {
 
 static void stop(void) {
   soundio_outstream_destroy(outstream);
+  outstream = NULL;
   soundio_ring_buffer_clear(ring_buffer);
+  reset_position();
   debug(1, "libsoundio output stopped\n");
 }
 
 static void flush(void) {
+  pthread_mutex_lock(&position_mutex);
   soundio_ring_buffer_clear(ring_buffer);
+  pthread_mutex_unlock(&position_mutex);
   debug(1, "libsoundio output flushed\n");
 }
 
@@ -215,7 +326,10 @@ audio_output audio_soundio = {.name = "soundio",
                               .stop = &stop,
                               .is_running = NULL,
                               .flush = &flush,
-                              .delay = NULL,
+                              .delay = &delay,
+                              .rate_info = &rate_info,
+                              .get_write_buffer = &get_write_buffer,
+                              .commit = &commit,
                               .play = &play,
                               .volume = NULL,
                               .parameters = &parameters,
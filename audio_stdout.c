@@ -29,6 +29,7 @@
 
 #include "audio.h"
 #include "common.h"
+#include "pipe_writer.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <memory.h>
@@ -38,12 +39,23 @@
 
 static int fd = -1;
 
-static void start(__attribute__((unused)) int sample_rate,
-                  __attribute__((unused)) int sample_format) {
+// if buffered, stdout is written by a thread of its own, and whatever is reading it sets the pace
+static int buffered = 0;
+static pipe_writer writer;
+
+extern audio_output audio_stdout;
+
+static void start(int sample_rate, __attribute__((unused)) int sample_format) {
   fd = STDOUT_FILENO;
+  if (buffered)
+    pipe_writer_start(&writer, sample_rate);
 }
 
 static int play(void *buf, int samples) {
+  if (buffered) {
+    pipe_writer_write(&writer, buf, samples * 4);
+    return 0;
+  }
   char errorstring[1024];
   int warned = 0;
   int rc = write(fd, buf, samples * 4);
@@ -59,6 +71,10 @@ static void stop(void) {
   // Do nothing when play stops
 }
 
+static int delay(long *the_delay) { return pipe_writer_delay(&writer, the_delay); }
+
+static void flush(void) { pipe_writer_flush(&writer); }
+
 static int init(__attribute__((unused)) int argc, __attribute__((unused)) char **argv) {
   // set up default values first
   config.audio_backend_buffer_desired_length = 1.0;
@@ -67,11 +83,25 @@ static int init(__attribute__((unused)) int argc, __attribute__((unused)) char *
   // get settings from settings file
   // do the "general" audio  options. Note, these options are in the "general" stanza!
   parse_general_audio_options();
+
+  double buffer_length = 2.0;
+  pipe_writer_overrun_policy overrun_policy = pipe_writer_drop_oldest;
+  pipe_writer_parse_options("stdout", &buffered, &buffer_length, &overrun_policy);
+  if (buffered) {
+    // the descriptor itself is left in blocking mode, as other processes may share it
+    pipe_writer_create(&writer, "stdout", NULL, STDOUT_FILENO, buffer_length, 44100, 4,
+                       overrun_policy);
+    audio_stdout.delay = &delay;
+    audio_stdout.flush = &flush;
+    audio_stdout.discard = &flush; // the writer may hold up to buffer_length_in_seconds of audio
+  }
   return 0;
 }
 
 static void deinit(void) {
   // don't close stdout
+  if (buffered)
+    pipe_writer_destroy(&writer);
 }
 
 audio_output audio_stdout = {.name = "stdout",
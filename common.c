@@ -27,6 +27,7 @@
  */
 
 #include "common.h"
+#include "log.h"
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -110,6 +111,36 @@ const char *sps_format_description_string(sps_format_t format) {
     return sps_format_description_string_array[SPS_FORMAT_INVALID];
 }
 
+int sps_format_resolution(sps_format_t format) {
+  int response = 0;
+  switch (format) {
+  case SPS_FORMAT_S32:
+  case SPS_FORMAT_S32_LE:
+  case SPS_FORMAT_S32_BE:
+    response = 32;
+    break;
+  case SPS_FORMAT_S24:
+  case SPS_FORMAT_S24_LE:
+  case SPS_FORMAT_S24_BE:
+  case SPS_FORMAT_S24_3LE:
+  case SPS_FORMAT_S24_3BE:
+    response = 24;
+    break;
+  case SPS_FORMAT_S16:
+  case SPS_FORMAT_S16_LE:
+  case SPS_FORMAT_S16_BE:
+    response = 16;
+    break;
+  case SPS_FORMAT_S8:
+  case SPS_FORMAT_U8:
+    response = 8;
+    break;
+  default:
+    break;
+  }
+  return response;
+}
+
 // true if Shairport Sync is supposed to be sending output to the output device, false otherwise
 
 static volatile int requested_connection_state_to_output = 1;
@@ -297,31 +328,71 @@ char *generate_preliminary_string(char *buffer, size_t buffer_length, double tss
   return insertion_point;
 }
 
-void _die(const char *filename, const int linenumber, const char *format, ...) {
-  int oldState;
-  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+// put the preliminaries, if any, and the prefix in front of a message and send it to the log
+static void emit_log_record(const log_record *record) {
   char b[1024];
   b[0] = 0;
   char *s;
-  if (debuglev) {
+  if (record->show_preliminaries) {
     pthread_mutex_lock(&debug_timing_lock);
-    uint64_t time_now = get_absolute_time_in_ns();
-    uint64_t time_since_start = time_now - ns_time_at_startup;
-    uint64_t time_since_last_debug_message = time_now - ns_time_at_last_debug_message;
-    ns_time_at_last_debug_message = time_now;
+    uint64_t time_since_start = record->time - ns_time_at_startup;
+    // messages queued by different threads can be a little out of order
+    int64_t time_since_last_debug_message = record->time - ns_time_at_last_debug_message;
+    if (time_since_last_debug_message > 0)
+      ns_time_at_last_debug_message = record->time;
     pthread_mutex_unlock(&debug_timing_lock);
     s = generate_preliminary_string(b, sizeof(b), 1.0 * time_since_start / 1000000000,
-                                    1.0 * time_since_last_debug_message / 1000000000, filename,
-                                    linenumber, " *fatal error: ");
+                                    1.0 * time_since_last_debug_message / 1000000000,
+                                    record->filename, record->linenumber, record->prefix);
   } else {
-    strncpy(b, "fatal error: ", sizeof(b));
+    strncpy(b, record->prefix, sizeof(b) - 1);
+    b[sizeof(b) - 1] = 0;
     s = b + strlen(b);
   }
+  snprintf(s, sizeof(b) - (s - b), "%s", record->text);
+  sps_log(record->prio, "%s", b);
+}
+
+// queue the message for the log writer, if it's running, or else log it now
+static void log_message(int prio, const char *filename, const int linenumber,
+                        int show_preliminaries, const char *prefix, const char *format,
+                        va_list args) {
+  va_list args_copy;
+  va_copy(args_copy, args);
+  int response =
+      log_async_submit(prio, filename, linenumber, show_preliminaries, prefix, format, args_copy);
+  va_end(args_copy);
+  if (response != 0) {
+    log_record record;
+    record.time = get_absolute_time_in_ns();
+    record.filename = filename;
+    record.prefix = prefix;
+    record.linenumber = linenumber;
+    record.prio = prio;
+    record.show_preliminaries = show_preliminaries;
+    vsnprintf(record.text, sizeof(record.text), format, args);
+    emit_log_record(&record);
+  }
+}
+
+void log_asynchronously() { log_async_start(emit_log_record); }
+
+void _die(const char *filename, const int linenumber, const char *format, ...) {
+  int oldState;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+  log_async_flush(); // so that the fatal error is the last thing in the log
+  log_record record;
+  record.time = get_absolute_time_in_ns();
+  record.filename = filename;
+  record.prefix = debuglev ? " *fatal error: " : "fatal error: ";
+  record.linenumber = linenumber;
+  record.prio = LOG_ERR;
+  record.show_preliminaries = (debuglev != 0);
   va_list args;
   va_start(args, format);
-  vsnprintf(s, sizeof(b) - (s - b), format, args);
+  vsnprintf(record.text, sizeof(record.text), format, args);
   va_end(args);
-  sps_log(LOG_ERR, "%s", b);
+  emit_log_record(&record);
   pthread_setcancelstate(oldState, NULL);
   emergency_exit = 1;
   exit(EXIT_FAILURE);
@@ -330,28 +401,11 @@ void _die(const char *filename, const int linenumber, const char *format, ...) {
 void _warn(const char *filename, const int linenumber, const char *format, ...) {
   int oldState;
   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
-  char b[1024];
-  b[0] = 0;
-  char *s;
-  if (debuglev) {
-    pthread_mutex_lock(&debug_timing_lock);
-    uint64_t time_now = get_absolute_time_in_ns();
-    uint64_t time_since_start = time_now - ns_time_at_startup;
-    uint64_t time_since_last_debug_message = time_now - ns_time_at_last_debug_message;
-    ns_time_at_last_debug_message = time_now;
-    pthread_mutex_unlock(&debug_timing_lock);
-    s = generate_preliminary_string(b, sizeof(b), 1.0 * time_since_start / 1000000000,
-                                    1.0 * time_since_last_debug_message / 1000000000, filename,
-                                    linenumber, " *warning: ");
-  } else {
-    strncpy(b, "warning: ", sizeof(b));
-    s = b + strlen(b);
-  }
   va_list args;
   va_start(args, format);
-  vsnprintf(s, sizeof(b) - (s - b), format, args);
+  log_message(LOG_WARNING, filename, linenumber, debuglev != 0,
+              debuglev ? " *warning: " : "warning: ", format, args);
   va_end(args);
-  sps_log(LOG_WARNING, "%s", b);
   pthread_setcancelstate(oldState, NULL);
 }
 
@@ -360,49 +414,20 @@ void _debug(const char *filename, const int linenumber, int level, const char *f
     return;
   int oldState;
   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
-  char b[1024];
-  b[0] = 0;
-  pthread_mutex_lock(&debug_timing_lock);
-  uint64_t time_now = get_absolute_time_in_ns();
-  uint64_t time_since_start = time_now - ns_time_at_startup;
-  uint64_t time_since_last_debug_message = time_now - ns_time_at_last_debug_message;
-  ns_time_at_last_debug_message = time_now;
-  pthread_mutex_unlock(&debug_timing_lock);
-  char *s = generate_preliminary_string(b, sizeof(b), 1.0 * time_since_start / 1000000000,
-                                        1.0 * time_since_last_debug_message / 1000000000, filename,
-                                        linenumber, " ");
   va_list args;
   va_start(args, format);
-  vsnprintf(s, sizeof(b) - (s - b), format, args);
+  log_message(LOG_DEBUG, filename, linenumber, 1, " ", format, args);
   va_end(args);
-  sps_log(LOG_DEBUG, "%s", b);
   pthread_setcancelstate(oldState, NULL);
 }
 
 void _inform(const char *filename, const int linenumber, const char *format, ...) {
   int oldState;
   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
-  char b[1024];
-  b[0] = 0;
-  char *s;
-  if (debuglev) {
-    pthread_mutex_lock(&debug_timing_lock);
-    uint64_t time_now = get_absolute_time_in_ns();
-    uint64_t time_since_start = time_now - ns_time_at_startup;
-    uint64_t time_since_last_debug_message = time_now - ns_time_at_last_debug_message;
-    ns_time_at_last_debug_message = time_now;
-    pthread_mutex_unlock(&debug_timing_lock);
-    s = generate_preliminary_string(b, sizeof(b), 1.0 * time_since_start / 1000000000,
-                                    1.0 * time_since_last_debug_message / 1000000000, filename,
-                                    linenumber, " ");
-  } else {
-    s = b;
-  }
   va_list args;
   va_start(args, format);
-  vsnprintf(s, sizeof(b) - (s - b), format, args);
+  log_message(LOG_INFO, filename, linenumber, debuglev != 0, debuglev ? " " : "", format, args);
   va_end(args);
-  sps_log(LOG_INFO, "%s", b);
   pthread_setcancelstate(oldState, NULL);
 }
 
@@ -644,67 +669,86 @@ static char super_secret_key[] =
     "2gG0N5hvJpzwwhbhXqFKA4zaaSrw622wDniAK5MlIE0tIAKKP4yxNGjoD2QYjhBGuhvkWKY=\n"
     "-----END RSA PRIVATE KEY-----\0";
 
+// The private key is parsed once, the first time it's needed, and the resulting context (and,
+// for mbed TLS and PolarSSL, the seeded random number generator) is kept for the life of the
+// process. Parsing the key costs much more than the RSA operation itself and it used to be
+// done afresh for every Apple-Challenge and every ANNOUNCE. The lock serialises the first use
+// and every operation thereafter, as setting the padding alters the shared context.
+static pthread_mutex_t rsa_context_lock = PTHREAD_MUTEX_INITIALIZER;
+
 #ifdef CONFIG_OPENSSL
+static RSA *rsa_context = NULL;
+
 uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
   int oldState;
   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
-  RSA *rsa = NULL;
-  if (!rsa) {
+  pthread_mutex_lock(&rsa_context_lock);
+  if (rsa_context == NULL) {
     BIO *bmem = BIO_new_mem_buf(super_secret_key, -1);
-    rsa = PEM_read_bio_RSAPrivateKey(bmem, NULL, NULL, NULL);
+    rsa_context = PEM_read_bio_RSAPrivateKey(bmem, NULL, NULL, NULL);
     BIO_free(bmem);
+    if (rsa_context == NULL)
+      die("Can't read the private key.");
   }
 
-  uint8_t *out = malloc(RSA_size(rsa));
+  uint8_t *out = malloc(RSA_size(rsa_context));
+  if (out == NULL)
+    die("Can't allocate memory for the result of an RSA operation.");
   switch (mode) {
   case RSA_MODE_AUTH:
-    *outlen = RSA_private_encrypt(inlen, input, out, rsa, RSA_PKCS1_PADDING);
+    *outlen = RSA_private_encrypt(inlen, input, out, rsa_context, RSA_PKCS1_PADDING);
     break;
   case RSA_MODE_KEY:
-    *outlen = RSA_private_decrypt(inlen, input, out, rsa, RSA_PKCS1_OAEP_PADDING);
+    *outlen = RSA_private_decrypt(inlen, input, out, rsa_context, RSA_PKCS1_OAEP_PADDING);
     break;
   default:
     die("bad rsa mode");
   }
-  RSA_free(rsa);
+  pthread_mutex_unlock(&rsa_context_lock);
   pthread_setcancelstate(oldState, NULL);
   return out;
 }
 #endif
 
 #ifdef CONFIG_MBEDTLS
+static int rsa_context_ready = 0;
+static mbedtls_pk_context rsa_pkctx;
+static mbedtls_entropy_context rsa_entropy;
+static mbedtls_ctr_drbg_context rsa_ctr_drbg;
+
 uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
-  mbedtls_pk_context pkctx;
   mbedtls_rsa_context *trsa;
-  const char *pers = "rsa_encrypt";
-  size_t olen = *outlen;
+  size_t olen;
   int rc;
-
-  mbedtls_entropy_context entropy;
-  mbedtls_ctr_drbg_context ctr_drbg;
-
-  mbedtls_entropy_init(&entropy);
-
-  mbedtls_ctr_drbg_init(&ctr_drbg);
-  mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (const unsigned char *)pers,
-                        strlen(pers));
-
-  mbedtls_pk_init(&pkctx);
-
-  rc = mbedtls_pk_parse_key(&pkctx, (unsigned char *)super_secret_key, sizeof(super_secret_key),
-                            NULL, 0);
-  if (rc != 0)
-    debug(1, "Error %d reading the private key.", rc);
+  int oldState;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+  pthread_mutex_lock(&rsa_context_lock);
+
+  if (rsa_context_ready == 0) {
+    const char *pers = "rsa_encrypt";
+    mbedtls_entropy_init(&rsa_entropy);
+    mbedtls_ctr_drbg_init(&rsa_ctr_drbg);
+    rc = mbedtls_ctr_drbg_seed(&rsa_ctr_drbg, mbedtls_entropy_func, &rsa_entropy,
+                               (const unsigned char *)pers, strlen(pers));
+    if (rc != 0)
+      debug(1, "Error %d seeding the random number generator.", rc);
+    mbedtls_pk_init(&rsa_pkctx);
+    rc = mbedtls_pk_parse_key(&rsa_pkctx, (unsigned char *)super_secret_key,
+                              sizeof(super_secret_key), NULL, 0);
+    if (rc != 0)
+      die("Error %d reading the private key.", rc);
+    rsa_context_ready = 1;
+  }
 
   uint8_t *outbuf = NULL;
-  trsa = mbedtls_pk_rsa(pkctx);
+  trsa = mbedtls_pk_rsa(rsa_pkctx);
 
   switch (mode) {
   case RSA_MODE_AUTH:
     mbedtls_rsa_set_padding(trsa, MBEDTLS_RSA_PKCS_V15, MBEDTLS_MD_NONE);
     outbuf = malloc(trsa->len);
-    rc = mbedtls_rsa_pkcs1_encrypt(trsa, mbedtls_ctr_drbg_random, &ctr_drbg, MBEDTLS_RSA_PRIVATE,
-                                   inlen, input, outbuf);
+    rc = mbedtls_rsa_pkcs1_encrypt(trsa, mbedtls_ctr_drbg_random, &rsa_ctr_drbg,
+                                   MBEDTLS_RSA_PRIVATE, inlen, input, outbuf);
     if (rc != 0)
       debug(1, "mbedtls_pk_encrypt error %d.", rc);
     *outlen = trsa->len;
@@ -712,8 +756,9 @@ uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
   case RSA_MODE_KEY:
     mbedtls_rsa_set_padding(trsa, MBEDTLS_RSA_PKCS_V21, MBEDTLS_MD_SHA1);
     outbuf = malloc(trsa->len);
-    rc = mbedtls_rsa_pkcs1_decrypt(trsa, mbedtls_ctr_drbg_random, &ctr_drbg, MBEDTLS_RSA_PRIVATE,
-                                   &olen, input, outbuf, trsa->len);
+    olen = trsa->len;
+    rc = mbedtls_rsa_pkcs1_decrypt(trsa, mbedtls_ctr_drbg_random, &rsa_ctr_drbg,
+                                   MBEDTLS_RSA_PRIVATE, &olen, input, outbuf, trsa->len);
     if (rc != 0)
       debug(1, "mbedtls_pk_decrypt error %d.", rc);
     *outlen = olen;
@@ -722,55 +767,64 @@ uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
     die("bad rsa mode");
   }
 
-  mbedtls_ctr_drbg_free(&ctr_drbg);
-  mbedtls_entropy_free(&entropy);
-  mbedtls_pk_free(&pkctx);
+  pthread_mutex_unlock(&rsa_context_lock);
+  pthread_setcancelstate(oldState, NULL);
   return outbuf;
 }
 #endif
 
 #ifdef CONFIG_POLARSSL
+static int rsa_context_ready = 0;
+static rsa_context rsa_trsa;
+static entropy_context rsa_entropy;
+static ctr_drbg_context rsa_ctr_drbg;
+
 uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
-  rsa_context trsa;
-  const char *pers = "rsa_encrypt";
   int rc;
-
-  entropy_context entropy;
-  ctr_drbg_context ctr_drbg;
-  entropy_init(&entropy);
-  if ((rc = ctr_drbg_init(&ctr_drbg, entropy_func, &entropy, (const unsigned char *)pers,
-                          strlen(pers))) != 0)
-    debug(1, "ctr_drbg_init returned %d\n", rc);
-
-  rsa_init(&trsa, RSA_PKCS_V21, POLARSSL_MD_SHA1); // padding and hash id get overwritten
-  // BTW, this seems to reset a lot of parameters in the rsa_context
-  rc = x509parse_key(&trsa, (unsigned char *)super_secret_key, strlen(super_secret_key), NULL, 0);
-  if (rc != 0)
-    debug(1, "Error %d reading the private key.");
+  int oldState;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+  pthread_mutex_lock(&rsa_context_lock);
+
+  if (rsa_context_ready == 0) {
+    const char *pers = "rsa_encrypt";
+    entropy_init(&rsa_entropy);
+    if ((rc = ctr_drbg_init(&rsa_ctr_drbg, entropy_func, &rsa_entropy,
+                            (const unsigned char *)pers, strlen(pers))) != 0)
+      debug(1, "ctr_drbg_init returned %d\n", rc);
+
+    rsa_init(&rsa_trsa, RSA_PKCS_V21, POLARSSL_MD_SHA1); // padding and hash id get overwritten
+    // BTW, this seems to reset a lot of parameters in the rsa_context
+    rc = x509parse_key(&rsa_trsa, (unsigned char *)super_secret_key, strlen(super_secret_key),
+                       NULL, 0);
+    if (rc != 0)
+      die("Error %d reading the private key.", rc);
+    rsa_context_ready = 1;
+  }
 
   uint8_t *out = NULL;
 
   switch (mode) {
   case RSA_MODE_AUTH:
-    trsa.padding = RSA_PKCS_V15;
-    trsa.hash_id = POLARSSL_MD_NONE;
+    rsa_trsa.padding = RSA_PKCS_V15;
+    rsa_trsa.hash_id = POLARSSL_MD_NONE;
     debug(2, "rsa_apply encrypt");
-    out = malloc(trsa.len);
-    rc = rsa_pkcs1_encrypt(&trsa, ctr_drbg_random, &ctr_drbg, RSA_PRIVATE, inlen, input, out);
+    out = malloc(rsa_trsa.len);
+    rc = rsa_pkcs1_encrypt(&rsa_trsa, ctr_drbg_random, &rsa_ctr_drbg, RSA_PRIVATE, inlen, input,
+                           out);
     if (rc != 0)
       debug(1, "rsa_pkcs1_encrypt error %d.", rc);
-    *outlen = trsa.len;
+    *outlen = rsa_trsa.len;
     break;
   case RSA_MODE_KEY:
     debug(2, "rsa_apply decrypt");
-    trsa.padding = RSA_PKCS_V21;
-    trsa.hash_id = POLARSSL_MD_SHA1;
-    out = malloc(trsa.len);
+    rsa_trsa.padding = RSA_PKCS_V21;
+    rsa_trsa.hash_id = POLARSSL_MD_SHA1;
+    out = malloc(rsa_trsa.len);
 #if POLARSSL_VERSION_NUMBER >= 0x01020900
-    rc = rsa_pkcs1_decrypt(&trsa, ctr_drbg_random, &ctr_drbg, RSA_PRIVATE, (size_t *)outlen, input,
-                           out, trsa.len);
+    rc = rsa_pkcs1_decrypt(&rsa_trsa, ctr_drbg_random, &rsa_ctr_drbg, RSA_PRIVATE,
+                           (size_t *)outlen, input, out, rsa_trsa.len);
 #else
-    rc = rsa_pkcs1_decrypt(&trsa, RSA_PRIVATE, outlen, input, out, trsa.len);
+    rc = rsa_pkcs1_decrypt(&rsa_trsa, RSA_PRIVATE, outlen, input, out, rsa_trsa.len);
 #endif
     if (rc != 0)
       debug(1, "decrypt error %d.", rc);
@@ -778,7 +832,8 @@ uint8_t *rsa_apply(uint8_t *input, int inlen, int *outlen, int mode) {
   default:
     die("bad rsa mode");
   }
-  rsa_free(&trsa);
+  pthread_mutex_unlock(&rsa_context_lock);
+  pthread_setcancelstate(oldState, NULL);
   debug(2, "rsa_apply exit");
   return out;
 }
@@ -1099,6 +1154,16 @@ uint64_t get_absolute_time_in_fp() {
   return time_now_fp;
 }
 
+// When a capture is being replayed faster than real time, the clock runs this many times faster
+// than real time from the origin, when the speed was set. See set_clock_speed().
+// Every thread reads these, so the origin is written before the speed is published with a
+// release store, and read only after the speed has been seen, with an acquire load, to be more
+// than 1. Since the speed is set only once, the origin never changes after that.
+static int clock_speed = 1;
+static uint64_t clock_origin_ns = 0;
+
+static inline int get_clock_speed() { return __atomic_load_n(&clock_speed, __ATOMIC_ACQUIRE); }
+
 uint64_t get_absolute_time_in_ns() {
   uint64_t time_now_ns;
 
@@ -1136,9 +1201,27 @@ uint64_t get_absolute_time_in_ns() {
   time_now_ns = time_now_mach * sTimebaseInfo.numer / sTimebaseInfo.denom;
 #endif
 
+  int speed = get_clock_speed();
+  if (speed > 1)
+    time_now_ns = clock_origin_ns + (time_now_ns - clock_origin_ns) * speed;
   return time_now_ns;
 }
 
+void set_clock_speed(int speed) {
+  if ((speed > 1) && (get_clock_speed() == 1)) {
+    clock_origin_ns = get_absolute_time_in_ns();
+    __atomic_store_n(&clock_speed, speed, __ATOMIC_RELEASE);
+  }
+}
+
+void absolute_time_to_timespec(uint64_t time_ns, struct timespec *ts) {
+  int speed = get_clock_speed();
+  if ((speed > 1) && (time_ns > clock_origin_ns))
+    time_ns = clock_origin_ns + (time_ns - clock_origin_ns) / speed;
+  ts->tv_sec = time_ns / 1000000000;
+  ts->tv_nsec = time_ns % 1000000000;
+}
+
 int try_to_open_pipe_for_writing(const char *pathname) {
   // tries to open the pipe in non-blocking mode first.
   // if it succeeds, it sets it to blocking.
@@ -1510,75 +1593,36 @@ char *get_version_string() {
   return version_string;
 }
 
-int64_t generate_zero_frames(char *outp, size_t number_of_frames, sps_format_t format,
-                             int with_dither, int64_t random_number_in) {
-  // return the last random number used
+void generate_zero_frames(char *outp, size_t number_of_frames, sps_format_t format,
+                          dither_state *dither) {
   // assuming the buffer has been assigned
+  // the dither, if any, is added by dither_apply -- see dither.c
 
-  // add a TPDF dither -- see
-  // http://educypedia.karadimov.info/library/DitherExplained.pdf
-  // and the discussion around https://www.hydrogenaud.io/forums/index.php?showtopic=16963&st=25
-
-  // I think, for a 32 --> 16 bits, the range of
-  // random numbers needs to be from -2^16 to 2^16, i.e. from -65536 to 65536 inclusive, not from
-  // -32768 to +32767
-
-  // Actually, what would be generated here is from -65535 to 65535, i.e. one less on the limits.
+  int resolution = sps_format_resolution(format);
+  if (resolution == 0)
+    die("Unexpected SPS_FORMAT_* with index %d while outputting silence", format);
+  if (dither)
+    dither_set_resolution(dither, resolution);
 
-  // See the original paper at
-  // http://www.ece.rochester.edu/courses/ECE472/resources/Papers/Lipshitz_1992.pdf
-  // by Lipshitz, Wannamaker and Vanderkooy, 1992.
-
-  int64_t dither_mask = 0;
-  switch (format) {
-  case SPS_FORMAT_S32:
-  case SPS_FORMAT_S32_LE:
-  case SPS_FORMAT_S32_BE:
-    dither_mask = (int64_t)1 << (64 - 32);
-    break;
-  case SPS_FORMAT_S24:
-  case SPS_FORMAT_S24_LE:
-  case SPS_FORMAT_S24_BE:
-  case SPS_FORMAT_S24_3LE:
-  case SPS_FORMAT_S24_3BE:
-    dither_mask = (int64_t)1 << (64 - 24);
-    break;
-  case SPS_FORMAT_S16:
-  case SPS_FORMAT_S16_LE:
-  case SPS_FORMAT_S16_BE:
-    dither_mask = (int64_t)1 << (64 - 16);
-    break;
-  case SPS_FORMAT_S8:
-  case SPS_FORMAT_U8:
-    dither_mask = (int64_t)1 << (64 - 8);
-    break;
-  case SPS_FORMAT_UNKNOWN:
-    die("Unexpected SPS_FORMAT_UNKNOWN while calculating dither mask.");
-    break;
-  case SPS_FORMAT_AUTO:
-    die("Unexpected SPS_FORMAT_AUTO while calculating dither mask.");
-    break;
-  case SPS_FORMAT_INVALID:
-    die("Unexpected SPS_FORMAT_INVALID while calculating dither mask.");
-    break;
-  }
-  dither_mask -= 1;
-
-  int64_t previous_random_number = random_number_in;
+  int64_t hyper_samples[DITHER_BLOCK_SIZE];
+  int block_position = DITHER_BLOCK_SIZE;
+  size_t samples_remaining = number_of_frames * 2;
   char *p = outp;
   size_t sample_number;
-  r64_lock; // the random number generator is not thread safe, so we need to lock it while using it
   for (sample_number = 0; sample_number < number_of_frames * 2; sample_number++) {
 
-    int64_t hyper_sample = 0;
-    int64_t r = r64i();
-
-    int64_t tpdf = (r & dither_mask) - (previous_random_number & dither_mask);
-
-    // add dither if permitted -- no need to check for clipping, as the sample is, uh, zero
-
-    if (with_dither != 0)
-      hyper_sample += tpdf;
+    if (block_position == DITHER_BLOCK_SIZE) {
+      int block_size = DITHER_BLOCK_SIZE;
+      if (samples_remaining < (size_t)block_size)
+        block_size = samples_remaining;
+      memset(hyper_samples, 0, sizeof(int64_t) * block_size);
+      // no need to worry about clipping, as the samples are, uh, zero
+      if (dither)
+        dither_apply(dither, hyper_samples, block_size);
+      samples_remaining -= block_size;
+      block_position = 0;
+    }
+    int64_t hyper_sample = hyper_samples[block_position++];
 
     // move the result to the desired position in the int64_t
     char *op = p;
@@ -1662,10 +1706,7 @@ int64_t generate_zero_frames(char *outp, size_t number_of_frames, sps_format_t f
       die("Unexpected SPS_FORMAT_* with index %d while outputting silence", format);
     }
     p += sample_length;
-    previous_random_number = r;
   }
-  r64_unlock;
-  return previous_random_number;
 }
 
 // This will check the incoming string "s" of length "len" with the existing NUL-terminated string
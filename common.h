@@ -12,6 +12,7 @@
 #include "audio.h"
 #include "config.h"
 #include "definitions.h"
+#include "dither.h"
 #include "mdns.h"
 
 // struct sockaddr_in6 is bigger than struct sockaddr. derp
@@ -33,6 +34,9 @@ typedef enum {
 #define sps_extra_code_output_stalled 32768
 #define sps_extra_code_output_state_cannot_make_ready 32769
 
+// the thread stack size used when general.low_memory is on and no other size is given
+#define LOW_MEMORY_THREAD_STACK_SIZE (256 * 1024)
+
 // yeah/no/auto
 typedef enum { YNA_AUTO = -1, YNA_NO = 0, YNA_YES = 1 } yna_type;
 
@@ -49,8 +53,14 @@ typedef enum {
   ST_basic = 0, // straight deletion or insertion of a frame in a 352-frame packet
   ST_soxr,      // use libsoxr to make a 352 frame packet one frame longer or shorter
   ST_auto,      // use soxr if compiled for it and if the soxr_index is low enough
+  ST_soxr_vr,   // keep a libsoxr variable-rate resampler running and adjust its ratio
 } stuffing_type;
 
+typedef enum {
+  SC_pi = 0,    // spread the corrections out to follow the drift -- see sync_control.h
+  SC_tolerance, // correct a frame whenever the error exceeds a random amount within the tolerance
+} sync_control_type;
+
 typedef enum {
   ST_stereo = 0,
   ST_mono,
@@ -69,6 +79,11 @@ typedef enum {
   decoder_apple_alac,
 } decoders_supported_type;
 
+typedef enum {
+  MPF_xml = 0, // each item as XML, with its data in base64
+  MPF_binary,  // each item as its type, code and length, big-endian, followed by its data
+} metadata_pipe_format_type;
+
 typedef enum {
   disable_standby_off = 0,
   disable_standby_auto,
@@ -98,6 +113,7 @@ typedef enum {
 } sps_format_t;
 
 const char *sps_format_description_string(sps_format_t format);
+int sps_format_resolution(sps_format_t format); // bits per sample, 0 if not an output format
 
 typedef struct {
   double missing_port_dacp_scan_interval_seconds; // if no DACP port number can be found, check at
@@ -123,13 +139,17 @@ typedef struct {
   // Defaults to "Shairport Sync". Shairport Sync must be playing to see it.
 
   char *pa_sink; // the name (or id) of the sink that Shairport Sync will play on.
+  double pa_server_latency; // the length of the buffer the server is asked to keep, in seconds
 #endif
 #ifdef CONFIG_METADATA
   int metadata_enabled;
   char *metadata_pipename;
+  metadata_pipe_format_type metadata_pipe_format;
   char *metadata_sockaddr;
   int metadata_sockport;
   size_t metadata_sockmsglength;
+  int metadata_socket_rate_limit;       // kilobytes per second, 0 for no limit
+  int metadata_socket_sequence_numbers; // send every item in numbered chunks
   int get_coverart;
 #endif
 #ifdef CONFIG_MQTT
@@ -146,20 +166,38 @@ typedef struct {
   int mqtt_publish_raw;
   int mqtt_publish_parsed;
   int mqtt_publish_cover;
+  int mqtt_publish_state;
   int mqtt_enable_remote;
 #endif
   uint8_t hw_addr[6];
   int port;
   int udp_port_base;
   int udp_port_range;
+  int udp_receive_buffer_size; // bytes -- -1 to size it for the latency, 0 for the system default
+  int udp_busy_poll_time;      // microseconds, 0 for none
+  int udp_request_dscp;        // -1 to leave resend and timing requests unmarked
   int ignore_volume_control;
+  int dither_noise_shaping; // shape the dither added to 16-bit output
+  int output_is_floating_point; // set by a backend that converts 32-bit output to floating point,
+                                // which can't usefully be dithered
   int volume_max_db_set; // set to 1 if a maximum volume db has been set
   int volume_max_db;
   int no_sync;            // disable synchronisation, even if it's available
   int no_mmap;            // disable use of mmap-based output, even if it's available
+  int mmap_zero_copy;     // with mmap-based output, format the output directly into the device buffer
   double resyncthreshold; // if it get's out of whack my more than this number of seconds, resync.
                           // Zero means never
                           // resync.
+  int fast_start;           // start playing with a short latency and let it grow to the full latency
+  double fast_start_latency; // seconds -- the latency to start with when fast_start is set
+  int realtime_scheduling_policy; // for the player and RTP audio threads, SCHED_OTHER for none
+  int realtime_priority;
+  uint64_t realtime_cpu_affinity; // a bit for each CPU those threads may run on, zero for any
+  int lock_memory;                // lock all memory with mlockall
+  int low_memory; // size buffers, rings and thread stacks for a small machine -- see player.c
+  int buffered_audio; // keep packets undecoded until shortly before they are due -- see player.c
+  double buffered_audio_lookahead; // seconds ahead of time that buffered packets are decoded
+  size_t thread_stack_size; // for all threads, in bytes, or 0 for the system's default
   int allow_session_interruption;
   int timeout; // while in play mode, exit if no packets of audio come in for more than this number
                // of seconds . Zero means never exit.
@@ -170,6 +208,7 @@ typedef struct {
   char *mdns_name;
   mdns_backend *mdns;
   int buffer_start_fill;
+  unsigned int audio_buffer_size; // in packets, a power of 2
   uint32_t userSuppliedLatency; // overrides all other latencies -- use with caution
   uint32_t fixedLatencyOffset;  // add this to all automatic latencies supplied to get the actual
                                 // total latency
@@ -188,6 +227,9 @@ typedef struct {
   int debugger_show_elapsed_time;  // in the debug message, display the time since startup
   int debugger_show_relative_time; // in the debug message, display the time since the last one
   int debugger_show_file_and_line; // in the debug message, display the filename and line number
+  int log_asynchronously;          // queue log messages for a writer thread rather than block
+  int metrics_enabled;             // serve metrics for monitoring over HTTP
+  int metrics_port;
   int statistics_requested, use_negotiated_latencies;
   playback_mode_type playback_mode;
   char *cmd_start, *cmd_stop, *cmd_set_volume, *cmd_unfixable;
@@ -195,8 +237,11 @@ typedef struct {
   int cmd_blocking, cmd_start_returns_output;
   double tolerance; // allow this much drift before attempting to correct it
   stuffing_type packet_stuffing;
+  sync_control_type sync_control;
   int soxr_delay_index;
   int soxr_delay_threshold; // the soxr delay must be less or equal to this for soxr interpolation
+  char *soxr_benchmark_cache_file; // where the soxr_delay_index is kept between runs
+  int deferred_startup; // advertise the service first, and start the rest in the background
                             // to be enabled under the auto setting
   int decoders_supported;
   int use_apple_decoder; // set to 1 if you want to use the apple decoder instead of the original by
@@ -216,6 +261,7 @@ typedef struct {
   double disable_standby_mode_silence_threshold; // below this, silence will be added to the output
                                                  // buffer
   double disable_standby_mode_silence_scan_interval; // check the threshold this often
+  int disable_standby_mode_use_device_events; // wait for the device rather than scan it
 
   double audio_backend_latency_offset; // this will be the offset in seconds to compensate for any
                                        // fixed latency there might be in the audio path
@@ -245,9 +291,13 @@ typedef struct {
   char *convolution_ir_file;
   float convolution_gain;
   int convolution_max_length;
+  int convolution_block_size;      // partition size of the head of the impulse response
+  int convolution_tail_block_size; // partition size of the tail, 0 for uniform partitioning
 #endif
 
   int loudness;
+  int eq; // the parametric equaliser, set up in parametric_eq
+  int dsp_fixed_point; // run the loudness filter and the equaliser in fixed point
   float loudness_reference_volume_db;
   int alsa_use_hardware_mute;
   double alsa_maximum_stall_time;
@@ -265,6 +315,7 @@ typedef struct {
 #ifdef CONFIG_METADATA_HUB
   char *cover_art_cache_dir;
   int retain_coverart;
+  size_t cover_art_cache_size_limit; // bytes, 0 for no limit, only used if retain_coverart is set
 
   int scan_interval_when_active;   // number of seconds between DACP server scans when playing
                                    // something (1)
@@ -274,13 +325,16 @@ typedef struct {
                                    // (10)
   int scan_max_inactive_count;     // number of scans to do before stopping if not made active again
                                    // (about 15 minutes worth)
+  int dacp_long_poll; // ask the DACP server to hold play status updates until something changes
 #endif
   int disable_resend_requests; // set this to stop resend request being made for missing packets
   double diagnostic_drop_packet_fraction; // pseudo randomly drop this fraction of packets, for
                                           // debugging. Currently audio packets only...
+  char *diagnostic_packet_capture_file; // capture the RTP packets of a play session to this file
 #ifdef CONFIG_JACK
   char *jack_client_name;
   char *jack_autoconnect_pattern;
+  int jack_output_32_bit; // take 32-bit samples from the player rather than 16-bit ones
 #ifdef CONFIG_SOXR
   int jack_soxr_resample_quality;
 #endif
@@ -304,6 +358,7 @@ void log_to_stderr(); // call this to direct logging to stderr;
 void log_to_stdout(); // call this to direct logging to stdout;
 void log_to_syslog(); // call this to direct logging to the system log;
 void log_to_file();   // call this to direct logging to a file or (pre-existing) pipe;
+void log_asynchronously(); // call this to have messages written by a thread of their own
 
 // true if Shairport Sync is supposed to be sending output to the output device, false otherwise
 
@@ -367,6 +422,17 @@ double vol2attn(double vol, long max_db, long min_db);
 // uint64_t get_absolute_time_in_fp(void); // obselete
 uint64_t get_absolute_time_in_ns(void);
 
+// Make get_absolute_time_in_ns() run this many times faster than real time from now on -- for
+// replaying a packet capture faster than real time. Only the first call that asks for a speed
+// above 1 has any effect. The clock is still the real one, sped up, rather than a simulated one,
+// so a replay is repeatable but not deterministic: the threads are scheduled differently each
+// time, and so a sped-up replay may not make exactly the same decisions as the original session.
+void set_clock_speed(int speed);
+
+// Convert a time from get_absolute_time_in_ns() to a deadline for a wait on a CLOCK_MONOTONIC
+// condition variable, e.g. pthread_cond_timedwait.
+void absolute_time_to_timespec(uint64_t time_ns, struct timespec *ts);
+
 // time at startup for debugging timing
 extern uint64_t ns_time_at_startup, ns_time_at_last_debug_message;
 
@@ -392,6 +458,10 @@ int mkpath(const char *path, mode_t mode);
 
 void shairport_shutdown();
 
+// returns when the backend and the other subsystems have been started -- see
+// general.deferred_startup
+void wait_for_startup_to_complete(void);
+
 extern sigset_t pselect_sigset;
 
 extern pthread_mutex_t the_conn_lock;
@@ -437,8 +507,9 @@ extern pthread_mutex_t r64_mutex;
 
 char *get_version_string(); // mallocs a string space -- remember to free it afterwards
 
-int64_t generate_zero_frames(char *outp, size_t number_of_frames, sps_format_t format,
-                             int with_dither, int64_t random_number_in);
+// with dither if dither is not NULL
+void generate_zero_frames(char *outp, size_t number_of_frames, sps_format_t format,
+                          dither_state *dither);
 
 void malloc_cleanup(void *arg);
 
@@ -0,0 +1,460 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#include "common.h"
+#include "cover_art_cache.h"
+#include "realtime.h"
+
+#ifdef CONFIG_MBEDTLS
+#include <mbedtls/md5.h>
+#include <mbedtls/version.h>
+#endif
+
+#ifdef CONFIG_POLARSSL
+#include <polarssl/md5.h>
+#endif
+
+#ifdef CONFIG_OPENSSL
+#include <openssl/md5.h>
+#endif
+
+#define cover_art_prefix "cover-"
+#define cover_art_bucket_count 256
+// the most recent image is kept in memory, if it's no bigger than this, so that when it comes in
+// again it can be recognised without being hashed
+#define cover_art_remembered_size_limit (2 * 1024 * 1024)
+
+typedef struct cover_art_entry {
+  uint8_t md5[16];
+  char ext[4];
+  size_t size;
+  int written;      // 0 until its file has been written
+  int pending_jobs; // the number of jobs in the queue that refer to it
+  int removed;      // set if writing its file failed -- it's freed when no job refers to it
+  struct cover_art_entry *next_in_bucket;
+  struct cover_art_entry *newer, *older; // in the order in which entries were last used
+} cover_art_entry;
+
+typedef struct cover_art_job {
+  cover_art_entry *entry;
+  char *data; // NULL if there's nothing to write
+  size_t length;
+  cover_art_ready_function ready; // may be NULL
+  uint64_t context;
+  struct cover_art_job *next;
+} cover_art_job;
+
+// everything here is protected by the cache lock
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_added = PTHREAD_COND_INITIALIZER;
+static cover_art_entry *buckets[cover_art_bucket_count];
+static cover_art_entry *newest = NULL, *oldest = NULL;
+static size_t cache_bytes = 0;
+static cover_art_job *first_job = NULL, *last_job = NULL;
+static char *last_image = NULL;
+static size_t last_image_length = 0;
+static cover_art_entry *last_entry = NULL;
+
+static pthread_t cache_thread;
+static int cache_thread_running = 0;
+
+static void md5_of(const char *buf, size_t len, uint8_t *img_md5) {
+#ifdef CONFIG_OPENSSL
+  MD5_CTX ctx;
+  MD5_Init(&ctx);
+  MD5_Update(&ctx, buf, len);
+  MD5_Final(img_md5, &ctx);
+#endif
+
+#ifdef CONFIG_MBEDTLS
+#if MBEDTLS_VERSION_MINOR >= 7
+  mbedtls_md5_context tctx;
+  mbedtls_md5_starts_ret(&tctx);
+  mbedtls_md5_update_ret(&tctx, (const unsigned char *)buf, len);
+  mbedtls_md5_finish_ret(&tctx, img_md5);
+#else
+  mbedtls_md5_context tctx;
+  mbedtls_md5_starts(&tctx);
+  mbedtls_md5_update(&tctx, (const unsigned char *)buf, len);
+  mbedtls_md5_finish(&tctx, img_md5);
+#endif
+#endif
+
+#ifdef CONFIG_POLARSSL
+  md5_context tctx;
+  md5_starts(&tctx);
+  md5_update(&tctx, (const unsigned char *)buf, len);
+  md5_finish(&tctx, img_md5);
+#endif
+}
+
+static char *entry_path(cover_art_entry *entry, const char *leader, const char *trailer) {
+  char md5_str[33];
+  int i;
+  for (i = 0; i < 16; i++)
+    snprintf(&md5_str[i * 2], 3, "%02x", entry->md5[i]);
+  size_t pl = strlen(config.cover_art_cache_dir) + strlen(leader) + strlen(cover_art_prefix) +
+              strlen(md5_str) + strlen(entry->ext) + strlen(trailer) + 3;
+  char *path = malloc(pl);
+  if (path == NULL)
+    die("Can't allocate memory for a cover art file name.");
+  snprintf(path, pl, "%s/%s%s%s.%s%s", config.cover_art_cache_dir, leader, cover_art_prefix,
+           md5_str, entry->ext, trailer);
+  return path;
+}
+
+static cover_art_entry *find_entry(uint8_t *md5) {
+  cover_art_entry *entry = buckets[md5[0]];
+  while ((entry) && (memcmp(entry->md5, md5, sizeof(entry->md5)) != 0))
+    entry = entry->next_in_bucket;
+  return entry;
+}
+
+static void unlink_from_use_order(cover_art_entry *entry) {
+  if (entry->newer)
+    entry->newer->older = entry->older;
+  else
+    newest = entry->older;
+  if (entry->older)
+    entry->older->newer = entry->newer;
+  else
+    oldest = entry->newer;
+  entry->newer = entry->older = NULL;
+}
+
+static void make_newest(cover_art_entry *entry) {
+  if (entry != newest) {
+    if ((entry->newer) || (entry->older) || (oldest == entry))
+      unlink_from_use_order(entry);
+    entry->older = newest;
+    if (newest)
+      newest->newer = entry;
+    newest = entry;
+    if (oldest == NULL)
+      oldest = entry;
+  }
+}
+
+static cover_art_entry *add_entry(uint8_t *md5, const char *ext, size_t size, int written) {
+  cover_art_entry *entry = calloc(1, sizeof(cover_art_entry));
+  if (entry == NULL)
+    die("Can't allocate memory for a cover art cache entry.");
+  memcpy(entry->md5, md5, sizeof(entry->md5));
+  snprintf(entry->ext, sizeof(entry->ext), "%s", ext);
+  entry->size = size;
+  entry->written = written;
+  entry->next_in_bucket = buckets[md5[0]];
+  buckets[md5[0]] = entry;
+  make_newest(entry);
+  if (written)
+    cache_bytes += size;
+  return entry;
+}
+
+static void remove_entry(cover_art_entry *entry) {
+  cover_art_entry **p = &buckets[entry->md5[0]];
+  while ((*p) && (*p != entry))
+    p = &(*p)->next_in_bucket;
+  if (*p)
+    *p = entry->next_in_bucket;
+  unlink_from_use_order(entry);
+  if (entry->written)
+    cache_bytes -= entry->size;
+  if (last_entry == entry)
+    last_entry = NULL;
+}
+
+// Delete the least recently used files until the cache is within its limit.
+// The newest entry, which is the picture in use, and entries still to be written are kept.
+static void evict(void) {
+  cover_art_entry *entry = oldest;
+  while ((entry) && (entry != newest) &&
+         ((config.retain_coverart == 0) || ((config.cover_art_cache_size_limit != 0) &&
+                                            (cache_bytes > config.cover_art_cache_size_limit)))) {
+    cover_art_entry *next = entry->newer;
+    if ((entry->written) && (entry->pending_jobs == 0)) {
+      char *path = entry_path(entry, "", "");
+      if ((unlink(path) != 0) && (errno != ENOENT))
+        debug(1, "Error %d deleting cover art file \"%s\".", errno, path);
+      free(path);
+      remove_entry(entry);
+      free(entry);
+    }
+    entry = next;
+  }
+}
+
+typedef struct {
+  struct stat st;
+  char name[64];
+} found_file;
+
+static int modification_time_compare(const void *a, const void *b) {
+  time_t ta = ((const found_file *)a)->st.st_mtime;
+  time_t tb = ((const found_file *)b)->st.st_mtime;
+  return (ta > tb) - (ta < tb);
+}
+
+// pick up the files already in the directory, oldest first
+static void scan_directory(void) {
+  found_file *files = NULL;
+  size_t file_count = 0, file_space = 0;
+  DIR *d = opendir(config.cover_art_cache_dir);
+  if (d) {
+    int dir_fd = dirfd(d);
+    struct dirent *dir;
+    while ((dir = readdir(d)) != NULL) {
+      // only the files this cache makes: "cover-" followed by 32 hex digits, a dot and jpg or png
+      size_t nl = strlen(dir->d_name);
+      size_t pl = strlen(cover_art_prefix);
+      if ((nl == pl + 32 + 4) && (strncmp(dir->d_name, cover_art_prefix, pl) == 0) &&
+          (strspn(dir->d_name + pl, "0123456789abcdef") == 32) &&
+          ((strcmp(dir->d_name + pl + 32, ".jpg") == 0) ||
+           (strcmp(dir->d_name + pl + 32, ".png") == 0))) {
+        if (file_count == file_space) {
+          file_space = file_space ? file_space * 2 : 64;
+          found_file *new_files = realloc(files, file_space * sizeof(found_file));
+          if (new_files == NULL)
+            break;
+          files = new_files;
+        }
+        if ((fstatat(dir_fd, dir->d_name, &files[file_count].st, 0) == 0) &&
+            (S_ISREG(files[file_count].st.st_mode))) {
+          memcpy(files[file_count].name, dir->d_name, nl + 1); // it fits -- see above
+          file_count++;
+        }
+      }
+    }
+    closedir(d);
+  }
+  if (file_count) {
+    qsort(files, file_count, sizeof(found_file), modification_time_compare);
+    size_t i;
+    size_t pl = strlen(cover_art_prefix);
+    for (i = 0; i < file_count; i++) {
+      uint8_t md5[16];
+      int j;
+      for (j = 0; j < 16; j++) {
+        unsigned int byte;
+        sscanf(files[i].name + pl + j * 2, "%2x", &byte);
+        md5[j] = byte;
+      }
+      if (find_entry(md5) == NULL)
+        add_entry(md5, files[i].name + pl + 33, files[i].st.st_size, 1);
+    }
+    debug(2, "%zu cover art files, of %zu bytes in all, are already in \"%s\".", file_count,
+          cache_bytes, config.cover_art_cache_dir);
+  }
+  free(files);
+}
+
+static int write_file(cover_art_entry *entry, const char *data, size_t length) {
+  int response = -1;
+  mode_t oldumask = umask(000);
+  int result = mkpath(config.cover_art_cache_dir, 0777);
+  umask(oldumask);
+  if ((result == 0) || (result == -EEXIST)) {
+    char *temporary_path = entry_path(entry, ".", ".tmp");
+    char *path = entry_path(entry, "", "");
+    int cover_fd =
+        open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (cover_fd >= 0) {
+      size_t written = 0;
+      while (written < length) {
+        ssize_t ret = write(cover_fd, data + written, length - written);
+        if (ret < 0) {
+          if (errno == EINTR)
+            continue;
+          break;
+        }
+        written += ret;
+      }
+      if ((close(cover_fd) == 0) && (written == length) && (rename(temporary_path, path) == 0)) {
+        response = 0;
+      } else {
+        warn("Writing cover art file \"%s\" failed!", path);
+        unlink(temporary_path);
+      }
+    } else {
+      warn("Could not open file \"%s\" for writing cover art", temporary_path);
+    }
+    free(path);
+    free(temporary_path);
+  } else {
+    debug(1, "Couldn't access or create the cover art cache directory \"%s\".",
+          config.cover_art_cache_dir);
+  }
+  return response;
+}
+
+static void cache_thread_cleanup_handler(__attribute__((unused)) void *arg) {
+  pthread_mutex_unlock(&cache_lock);
+}
+
+static void *cache_thread_function(__attribute__((unused)) void *arg) {
+  thread_set_name("cover-art");
+  pthread_mutex_lock(&cache_lock);
+  scan_directory();
+  pthread_mutex_unlock(&cache_lock);
+  while (1) {
+    pthread_mutex_lock(&cache_lock);
+    pthread_cleanup_push(cache_thread_cleanup_handler, NULL);
+    while (first_job == NULL)
+      pthread_cond_wait(&job_added, &cache_lock);
+    pthread_cleanup_pop(0);
+    cover_art_job *job = first_job;
+    first_job = job->next;
+    if (first_job == NULL)
+      last_job = NULL;
+    pthread_mutex_unlock(&cache_lock);
+
+    // a job, once taken, is always finished
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+    cover_art_entry *entry = job->entry;
+    int written = -1;
+    if (job->data)
+      written = write_file(entry, job->data, job->length);
+
+    pthread_mutex_lock(&cache_lock);
+    if (written == 0) {
+      entry->written = 1;
+      cache_bytes += entry->size;
+    } else if ((job->data) && (entry->removed == 0)) {
+      entry->removed = 1; // it can be tried again the next time the image comes in
+      remove_entry(entry);
+    }
+    entry->pending_jobs--;
+    int ready = (entry->written != 0) && (job->ready != NULL);
+    char *path = ready ? entry_path(entry, "", "") : NULL;
+    if ((entry->removed) && (entry->pending_jobs == 0))
+      free(entry);
+    evict();
+    pthread_mutex_unlock(&cache_lock);
+
+    if (ready)
+      job->ready(path, job->context);
+    free(path);
+    free(job->data);
+    free(job);
+    pthread_setcancelstate(oldState, NULL);
+  }
+  pthread_exit(NULL);
+}
+
+// to be called with the cache lock held
+static void add_job(cover_art_entry *entry, char *data, size_t length,
+                    cover_art_ready_function ready, uint64_t context) {
+  cover_art_job *job = calloc(1, sizeof(cover_art_job));
+  if (job == NULL)
+    die("Can't allocate memory for a cover art job.");
+  job->entry = entry;
+  job->data = data;
+  job->length = length;
+  job->ready = ready;
+  job->context = context;
+  entry->pending_jobs++;
+  if (last_job)
+    last_job->next = job;
+  else
+    first_job = job;
+  last_job = job;
+  pthread_cond_signal(&job_added);
+}
+
+// mark the entry as the one most recently used, returning its path if it has been written.
+// To be called with the cache lock held.
+static char *use_entry(cover_art_entry *entry) {
+  char *path = NULL;
+  make_newest(entry);
+  if (entry->written) {
+    path = entry_path(entry, "", "");
+    if (config.retain_coverart == 0) // the others may have to go now
+      add_job(entry, NULL, 0, NULL, 0);
+  }
+  return path;
+}
+
+char *cover_art_cache_add(const char *buf, size_t len, cover_art_ready_function ready,
+                          uint64_t context) {
+  if ((cache_thread_running == 0) || (strcmp(config.cover_art_cache_dir, "") == 0))
+    return NULL;
+  char *path = NULL;
+  // an image that came in last time is recognised without being hashed. The entry is used in the
+  // same critical section, as once the lock is let go the cache thread may remove and free it.
+  pthread_mutex_lock(&cache_lock);
+  cover_art_entry *entry = NULL;
+  if ((last_entry) && (len == last_image_length) && (memcmp(buf, last_image, len) == 0)) {
+    entry = last_entry;
+    path = use_entry(entry);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  if (entry)
+    return path;
+
+  uint8_t md5[16];
+  md5_of(buf, len, md5);
+
+  pthread_mutex_lock(&cache_lock);
+  entry = find_entry(md5);
+  if (entry == NULL) {
+    // see if the file is a jpeg or a png
+    const char *ext;
+    if ((len >= 3) && (memcmp(buf, "\xFF\xD8\xFF", 3) == 0))
+      ext = "jpg";
+    else if ((len >= 8) && (memcmp(buf, "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A", 8) == 0))
+      ext = "png";
+    else {
+      debug(1, "Unidentified image type of cover art -- jpg extension used.");
+      ext = "jpg";
+    }
+    entry = add_entry(md5, ext, len, 0);
+    add_job(entry, memdup(buf, len), len, ready, context);
+  } else if (entry->written == 0) {
+    add_job(entry, NULL, 0, ready, context); // it's on its way -- just say when it's ready
+  }
+  // remember it, so that it can be recognised without being hashed if it comes in again
+  if (len <= cover_art_remembered_size_limit) {
+    char *copy = realloc(last_image, len);
+    if (copy) {
+      memcpy(copy, buf, len);
+      last_image = copy;
+      last_image_length = len;
+      last_entry = entry;
+    } else {
+      last_entry = NULL;
+    }
+  } else {
+    last_entry = NULL;
+  }
+  path = use_entry(entry);
+  pthread_mutex_unlock(&cache_lock);
+  return path;
+}
+
+void cover_art_cache_init(void) {
+  if (cache_thread_running == 0) {
+    if (pthread_create(&cache_thread, NULL, cache_thread_function, NULL) == 0)
+      cache_thread_running = 1;
+    else
+      debug(1, "Failed to create the cover art cache thread!");
+  }
+}
+
+void cover_art_cache_stop(void) {
+  if (cache_thread_running) {
+    pthread_cancel(cache_thread);
+    pthread_join(cache_thread, NULL);
+    cache_thread_running = 0;
+  }
+}
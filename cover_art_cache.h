@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A cache of cover art files, named by the MD5 hash of their contents, in the cover art cache
+// directory. Files are written by a thread of the cache's own, through a temporary file that is
+// renamed, so that a reader never sees a partly-written image. When the cache grows beyond its
+// size limit, the least recently used files are deleted. If cover art is not to be retained,
+// only the most recent image is kept.
+
+// called from the cache's thread when the file for an image that had to be written is ready
+typedef void (*cover_art_ready_function)(const char *path, uint64_t context);
+
+void cover_art_cache_init(void);
+void cover_art_cache_stop(void);
+
+// If the image is already in the cache, its path is returned, allocated with malloc. Otherwise
+// NULL is returned and, unless it can't be, the file is written in the background, after which
+// ready(path, context) is called.
+char *cover_art_cache_add(const char *buf, size_t len, cover_art_ready_function ready,
+                          uint64_t context);
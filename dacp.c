@@ -27,8 +27,10 @@
 // https://github.com/melloware/dacp-net/blob/master/Melloware.DACP/
 
 #include "dacp.h"
+#include "activity_monitor.h"
 #include "common.h"
 #include "config.h"
+#include "realtime.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
@@ -37,8 +39,10 @@
 #include <memory.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <strings.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
@@ -54,6 +58,7 @@ typedef struct {
   uint16_t port;                       // zero if no port discovered
   short connection_family;             // AF_INET6 or AF_INET
   int always_use_revision_number_1;    // for dealing with forked-daapd;
+  int long_poll_unavailable;           // set if the server won't hold play status update requests
   uint32_t scope_id;                   // if it's an ipv6 connection, this will be its scope id
   char ip_string[INET6_ADDRSTRLEN];    // the ip string pointing to the client
   char *active_remote_id;              // send this when you want to send remote control commands
@@ -71,6 +76,7 @@ struct HttpResponse {
   ssize_t malloced_size; // this will be its allocated size
   ssize_t size;          // the current size of the content
   int code;
+  int close_connection; // set if the server is going to close the connection
 };
 
 void *response_realloc(__attribute__((unused)) void *opaque, void *ptr, int size) {
@@ -101,10 +107,13 @@ void response_body(void *opaque, const char *data, int size) {
   response->size += size;
 }
 
-static void
-response_header(__attribute__((unused)) void *opaque, __attribute__((unused)) const char *ckey,
-                __attribute__((unused)) int nkey, __attribute__((unused)) const char *cvalue,
-                __attribute__((unused)) int nvalue) { /* example doesn't care about headers */
+static void response_header(void *opaque, const char *ckey, int nkey, const char *cvalue,
+                            int nvalue) {
+  // only "Connection: close" matters -- the connection is kept open otherwise
+  struct HttpResponse *response = (struct HttpResponse *)opaque;
+  if ((nkey == 10) && (strncmp(ckey, "connection", nkey) == 0) && (nvalue == 5) &&
+      (strncasecmp(cvalue, "close", nvalue) == 0))
+    response->close_connection = 1;
 }
 
 static void response_code(void *opaque, int code) {
@@ -125,239 +134,413 @@ static pthread_mutex_t dacp_conversation_lock;
 static pthread_mutex_t dacp_server_information_lock;
 static pthread_cond_t dacp_server_information_cv;
 
-void addrinfo_cleanup(void *arg) {
-  // debug(1, "addrinfo cleanup called.");
-  struct addrinfo **info = (struct addrinfo **)arg;
-  freeaddrinfo(*info);
-}
-
 void mutex_lock_cleanup(void *arg) {
   pthread_mutex_t *m = (pthread_mutex_t *)arg;
   if (pthread_mutex_unlock(m))
     debug(1, "Error releasing mutex.");
 }
 
-void connect_cleanup(void *arg) {
-  int *fd = (int *)arg;
-  // debug(2, "dacp_send_command: close socket %d.",*fd);
-  close(*fd);
-}
-
 void http_cleanup(void *arg) {
   // debug(1, "http cleanup called.");
   struct http_roundtripper *rt = (struct http_roundtripper *)arg;
   http_free(rt);
 }
 
-int dacp_send_command(const char *command, char **body, ssize_t *bodysize) {
-  int result;
-  // debug(1,"dacp_send_command: command is: \"%s\".",command);
-
-  if (dacp_server.port == 0) {
-    // debug(3, "No DACP port specified yet");
-    result = 490; // no port specified
-  } else {
+// The connection to the DACP server is kept open from one command to the next, and the server's
+// address is only looked up again when it changes. Several commands can be sent together, with
+// their responses read back in turn. If a connection that has been idle turns out to have been
+// closed by the server, a new one is made and the unanswered commands are sent again.
+// All of this is protected by the dacp_conversation_lock.
+// A second connection is used for play status updates that the server holds until something
+// changes, so that remote control commands don't have to wait behind them.
 
-    // will malloc space for the body or set it to NULL -- the caller should free it.
-
-    // Using some custom HTTP-like return codes
-    //  498 Bad Address information for the DACP server
-    //  497 Can't establish a socket to the DACP server
-    //  496 Can't connect to the DACP server
-    //  495 Error receiving response
-    //  494 This client is already busy
-    //  493 Client failed to send a message
-    //  492 Argument out of range
-    //  491 Client refused connection
-    //  490 No port specified
-
-    struct addrinfo hints, *res;
-    int sockfd;
-
-    struct HttpResponse response;
-    response.body = NULL;
-    response.malloced_size = 0;
-    response.size = 0;
-    response.code = 0;
-
-    char portstring[10], server[1024], message[1024];
-    memset(&portstring, 0, sizeof(portstring));
-    if (dacp_server.connection_family == AF_INET6) {
-      snprintf(server, sizeof(server), "%s%%%u", dacp_server.ip_string, dacp_server.scope_id);
-    } else {
-      strcpy(server, dacp_server.ip_string);
+typedef struct {
+  int fd;
+  int address_generation;           // the server address it was made to
+  ssize_t receive_buffer_occupancy; // received but not yet parsed
+  char receive_buffer[8192];
+} dacp_connection;
+
+static dacp_connection dacp_command_connection = {-1, 0, 0, {0}};
+static dacp_connection dacp_long_poll_connection = {-1, 0, 0, {0}};
+// the long poll connection's fd is only changed with this held, so that it can be shut down from
+// other threads to interrupt a long poll
+static pthread_mutex_t dacp_long_poll_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct addrinfo *dacp_server_address = NULL;
+static char dacp_server_address_key[1024 + 16]; // the server and port it was looked up for
+static int dacp_server_address_generation = 0;
+
+static void dacp_connection_close(dacp_connection *c, int abort_it) {
+  if (c->fd >= 0) {
+    if (abort_it) {
+      struct linger so_linger;
+      so_linger.l_onoff = 1; // "true"
+      so_linger.l_linger = 0;
+      int err = setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &so_linger, sizeof so_linger);
+      if (err)
+        debug(1, "Could not set the dacp socket to abort on closing.");
     }
-    snprintf(portstring, sizeof(portstring), "%u", dacp_server.port);
+    // debug(2, "dacp_send_command: close socket %d.", c->fd);
+    close(c->fd);
+    c->fd = -1;
+  }
+  c->receive_buffer_occupancy = 0;
+}
 
-    // first, load up address structs with getaddrinfo():
+// returns 0 or one of the custom HTTP-like codes below
+static int dacp_connection_open(dacp_connection *c, int receive_timeout_us) {
+  char portstring[10], server[1024], key[sizeof(dacp_server_address_key)];
+  memset(&portstring, 0, sizeof(portstring));
+  if (dacp_server.connection_family == AF_INET6) {
+    snprintf(server, sizeof(server), "%s%%%u", dacp_server.ip_string, dacp_server.scope_id);
+  } else {
+    strcpy(server, dacp_server.ip_string);
+  }
+  snprintf(portstring, sizeof(portstring), "%u", dacp_server.port);
+  snprintf(key, sizeof(key), "%s:%s", server, portstring);
 
+  if ((dacp_server_address == NULL) || (strcmp(key, dacp_server_address_key) != 0)) {
+    if (dacp_server_address) {
+      freeaddrinfo(dacp_server_address);
+      dacp_server_address = NULL;
+    }
+    dacp_server_address_generation++; // so that connections to the old server get closed
+    struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
-
     // debug(1, "DACP port string is \"%s:%s\".", server, portstring);
-
-    int ires = getaddrinfo(server, portstring, &hints, &res);
+    int ires = getaddrinfo(server, portstring, &hints, &dacp_server_address);
     if (ires) {
       // debug(1,"Error %d \"%s\" at getaddrinfo.",ires,gai_strerror(ires));
-      response.code = 498; // Bad Address information for the DACP server
-    } else {
-      uint64_t start_time = get_absolute_time_in_ns();
-      pthread_cleanup_push(addrinfo_cleanup, (void *)&res);
-      // only do this one at a time -- not sure it is necessary, but better safe than sorry
-
-      int mutex_reply = sps_pthread_mutex_timedlock(&dacp_conversation_lock, 2000000, command, 1);
-      // int mutex_reply = pthread_mutex_lock(&dacp_conversation_lock);
-      if (mutex_reply == 0) {
-        pthread_cleanup_push(mutex_lock_cleanup, (void *)&dacp_conversation_lock);
-
-        // make a socket:
-        sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-
-        if (sockfd == -1) {
-          // debug(1, "DACP socket could not be created -- error %d:
-          // \"%s\".",errno,strerror(errno));
-          response.code = 497; // Can't establish a socket to the DACP server
-        } else {
-          pthread_cleanup_push(connect_cleanup, (void *)&sockfd);
-          // debug(2, "dacp_send_command: open socket %d.",sockfd);
-
-          // This is for limiting the time to be spent waiting for a response.
-
-          struct timeval tv;
-          tv.tv_sec = 0;
-          tv.tv_usec = 500000;
-          if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof tv) == -1)
-            debug(1, "dacp_send_command: error %d setting receive timeout.", errno);
-          if (setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (const char *)&tv, sizeof tv) == -1)
-            debug(1, "dacp_send_command: error %d setting send timeout.", errno);
-
-          // connect!
-          // debug(1, "DACP socket created.");
-          if (connect(sockfd, res->ai_addr, res->ai_addrlen) < 0) {
-            // debug(1, "dacp_send_command: connect failed with errno %d.", errno);
-            if (errno == ECONNREFUSED)
-              response.code = 491; // DACP server doesn't want to talk anymore...
-            else
-              response.code = 496; // Can't connect to the DACP server
-          } else {
-            // debug(1,"DACP connect succeeded.");
-
-            snprintf(message, sizeof(message),
-                     "GET /ctrl-int/1/%s HTTP/1.1\r\nHost: %s:%u\r\nActive-Remote: %s\r\n\r\n",
-                     command, dacp_server.ip_string, dacp_server.port,
-                     dacp_server.active_remote_id);
-
-            // Send command
-            debug(3, "dacp_send_command: \"%s\".", command);
-            ssize_t wresp = send(sockfd, message, strlen(message), 0);
-            if (wresp == -1) {
-              char errorstring[1024];
-              strerror_r(errno, (char *)errorstring, sizeof(errorstring));
-              debug(2, "dacp_send_command: write error %d: \"%s\".", errno, (char *)errorstring);
-              struct linger so_linger;
-              so_linger.l_onoff = 1; // "true"
-              so_linger.l_linger = 0;
-              int err = setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &so_linger, sizeof so_linger);
-              if (err)
-                debug(1, "Could not set the dacp socket to abort due to a write error on closing.");
-            }
-            if (wresp != (ssize_t)strlen(message)) {
-              // debug(1, "dacp_send_command: send failed.");
-              response.code = 493; // Client failed to send a message
+      dacp_server_address = NULL;
+      dacp_connection_close(c, 0);
+      return 498; // Bad Address information for the DACP server
+    }
+    strcpy(dacp_server_address_key, key);
+  }
 
-            } else {
+  if (c->address_generation != dacp_server_address_generation)
+    dacp_connection_close(c, 0); // it'll be to the old server if it's open
+  if (c->fd >= 0)
+    return 0;
+
+  struct addrinfo *res = dacp_server_address;
+  int sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (sockfd == -1) {
+    // debug(1, "DACP socket could not be created -- error %d:
+    // \"%s\".",errno,strerror(errno));
+    return 497; // Can't establish a socket to the DACP server
+  }
+  // debug(2, "dacp_send_command: open socket %d.",sockfd);
+
+  // This is for limiting the time to be spent waiting for a response.
+  struct timeval tv;
+  tv.tv_sec = receive_timeout_us / 1000000;
+  tv.tv_usec = receive_timeout_us % 1000000;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof tv) == -1)
+    debug(1, "dacp_send_command: error %d setting receive timeout.", errno);
+  tv.tv_sec = 0;
+  tv.tv_usec = 500000;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (const char *)&tv, sizeof tv) == -1)
+    debug(1, "dacp_send_command: error %d setting send timeout.", errno);
+  int flag = 1; // the requests are small and a reply is waited for, so send them at once
+  if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) == -1)
+    debug(1, "dacp_send_command: error %d setting TCP_NODELAY.", errno);
+
+  // connect!
+  // debug(1, "DACP socket created.");
+  if (connect(sockfd, res->ai_addr, res->ai_addrlen) < 0) {
+    // debug(1, "dacp_send_command: connect failed with errno %d.", errno);
+    int response = 496; // Can't connect to the DACP server
+    if (errno == ECONNREFUSED)
+      response = 491; // DACP server doesn't want to talk anymore...
+    close(sockfd);
+    return response;
+  }
+  // debug(1,"DACP connect succeeded.");
+  c->fd = sockfd;
+  c->address_generation = dacp_server_address_generation;
+  c->receive_buffer_occupancy = 0;
+  return 0;
+}
 
-              response.body = malloc(2048); // it can resize this if necessary
-              response.malloced_size = 2048;
-              pthread_cleanup_push(malloc_cleanup, response.body);
-
-              struct http_roundtripper rt;
-              http_init(&rt, responseFuncs, &response);
-              pthread_cleanup_push(http_cleanup, &rt);
-
-              int needmore = 1;
-              int looperror = 0;
-              char buffer[8192];
-              memset(buffer, 0, sizeof(buffer));
-              while (needmore && !looperror) {
-                const char *data = buffer;
-                if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof tv) == -1)
-                  debug(1, "dacp_send_command: error %d setting receive timeout.", errno);
-                ssize_t ndata = recv(sockfd, buffer, sizeof(buffer), 0);
-                // debug(3, "Received %d bytes: \"%s\".", ndata, buffer);
-                if (ndata <= 0) {
-                  if (ndata == -1) {
-                    char errorstring[1024];
-                    strerror_r(errno, (char *)errorstring, sizeof(errorstring));
-                    debug(2, "dacp_send_command: receiving error %d: \"%s\".", errno,
-                          (char *)errorstring);
-                    struct linger so_linger;
-                    so_linger.l_onoff = 1; // "true"
-                    so_linger.l_linger = 0;
-                    int err =
-                        setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &so_linger, sizeof so_linger);
-                    if (err)
-                      debug(
-                          1,
-                          "Could not set the dacp socket to abort due to a read error on closing.");
-                  }
+// send the requests for the commands in one go; returns 0 or 493
+static int dacp_send_requests(dacp_connection *c, const char **commands, int count) {
+  size_t message_size = 0;
+  int i;
+  for (i = 0; i < count; i++)
+    message_size += strlen(commands[i]) + strlen(dacp_server.ip_string) +
+                    strlen(dacp_server.active_remote_id) + 80;
+  char *message = malloc(message_size);
+  if (message == NULL)
+    return 493;
+  size_t message_length = 0;
+  for (i = 0; i < count; i++) {
+    debug(3, "dacp_send_command: \"%s\".", commands[i]);
+    message_length += snprintf(
+        message + message_length, message_size - message_length,
+        "GET /ctrl-int/1/%s HTTP/1.1\r\nHost: %s:%u\r\nActive-Remote: %s\r\n\r\n", commands[i],
+        dacp_server.ip_string, dacp_server.port, dacp_server.active_remote_id);
+  }
+  int response = 0;
+  size_t sent = 0;
+  while (sent < message_length) {
+    ssize_t wresp = send(c->fd, message + sent, message_length - sent, MSG_NOSIGNAL);
+    if (wresp == -1) {
+      if (errno == EINTR)
+        continue;
+      char errorstring[1024];
+      strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+      debug(2, "dacp_send_command: write error %d: \"%s\".", errno, (char *)errorstring);
+      response = 493; // Client failed to send a message
+      break;
+    }
+    sent += wresp;
+  }
+  free(message);
+  return response;
+}
 
-                  free(response.body);
-                  response.body = NULL;
-                  response.malloced_size = 0;
-                  response.size = 0;
-                  response.code = 495; // Error receiving response
-                  looperror = 1;
-                }
+static void response_body_cleanup(void *arg) {
+  struct HttpResponse *response = (struct HttpResponse *)arg;
+  free(response->body);
+  response->body = NULL;
+}
 
-                while (needmore && ndata && !looperror) {
-                  int read;
-                  needmore = http_data(&rt, data, ndata, &read);
-                  ndata -= read;
-                  data += read;
-                }
-              }
+// Read the next response on the connection, leaving anything received after it in the buffer.
+// Returns 0 if it was read, otherwise 489 or 495. *anything_received is set if any of it arrived.
+static int dacp_receive_response(dacp_connection *c, struct HttpResponse *response,
+                                 int *anything_received) {
+  int result = 0;
+  *anything_received = (c->receive_buffer_occupancy != 0);
+  response->body = malloc(2048); // it can resize this if necessary
+  response->malloced_size = 2048;
+  response->size = 0;
+  response->code = 0;
+  response->close_connection = 0;
+  pthread_cleanup_push(response_body_cleanup, response);
+
+  struct http_roundtripper rt;
+  http_init(&rt, responseFuncs, response);
+  pthread_cleanup_push(http_cleanup, &rt);
+
+  int needmore = 1;
+  while ((needmore) && (result == 0)) {
+    if (c->receive_buffer_occupancy == 0) {
+      ssize_t ndata = recv(c->fd, c->receive_buffer, sizeof(c->receive_buffer), 0);
+      // debug(3, "Received %d bytes: \"%s\".", ndata, c->receive_buffer);
+      if (ndata <= 0) {
+        if ((ndata == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+          result = 489; // Timed out waiting for the response
+        } else {
+          if (ndata == -1) {
+            char errorstring[1024];
+            strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+            debug(2, "dacp_send_command: receiving error %d: \"%s\".", errno, (char *)errorstring);
+          }
+          result = 495; // Error receiving response
+        }
+      } else {
+        c->receive_buffer_occupancy = ndata;
+        *anything_received = 1;
+      }
+    }
+    if (result == 0) {
+      int read;
+      needmore = http_data(&rt, c->receive_buffer, c->receive_buffer_occupancy, &read);
+      c->receive_buffer_occupancy -= read;
+      if (c->receive_buffer_occupancy)
+        memmove(c->receive_buffer, c->receive_buffer + read, c->receive_buffer_occupancy);
+    }
+  }
 
-              if (http_iserror(&rt)) {
-                debug(3, "dacp_send_command: error parsing data.");
-                free(response.body);
-                response.body = NULL;
-                response.malloced_size = 0;
-                response.size = 0;
-              }
-              // debug(1,"Size of response body is %d",response.size);
-              pthread_cleanup_pop(1); // this should call http_cleanup
-              // http_free(&rt);
-              pthread_cleanup_pop(
-                  0); // this should *not* free the malloced buffer -- just pop the malloc cleanup
+  if ((result == 0) && (http_iserror(&rt))) {
+    debug(3, "dacp_send_command: error parsing data.");
+    response->size = 0;
+    response->close_connection = 1; // can't tell where the next response starts
+  }
+  pthread_cleanup_pop(1); // this should call http_cleanup
+  pthread_cleanup_pop(0); // this should *not* free the malloced buffer -- just pop the cleanup
+  if ((result != 0) || (response->size == 0)) {
+    free(response->body);
+    response->body = NULL;
+    response->malloced_size = 0;
+    response->size = 0;
+    if (result != 0)
+      response->code = result;
+  }
+  return result;
+}
+
+static void dacp_conversation_cleanup(void *arg) {
+  // interrupted in the middle of a conversation, so the connection can't be used again
+  dacp_connection_close(&dacp_command_connection, 1);
+  mutex_lock_cleanup(arg);
+}
+
+int dacp_send_commands(const char **commands, int count, char **bodies, ssize_t *bodysizes,
+                       int *results) {
+  // Using some custom HTTP-like return codes
+  //  498 Bad Address information for the DACP server
+  //  497 Can't establish a socket to the DACP server
+  //  496 Can't connect to the DACP server
+  //  495 Error receiving response
+  //  494 This client is already busy
+  //  493 Client failed to send a message
+  //  492 Argument out of range
+  //  491 Client refused connection
+  //  490 No port specified
+  //  489 Timed out waiting for the response
+
+  // will malloc space for each body or set it to NULL -- the caller should free them.
+  int i;
+  for (i = 0; i < count; i++) {
+    bodies[i] = NULL;
+    bodysizes[i] = 0;
+    results[i] = 490; // no port specified
+  }
+  if (dacp_server.port == 0) {
+    // debug(3, "No DACP port specified yet");
+  } else {
+    uint64_t start_time = get_absolute_time_in_ns();
+    // only do this one at a time, as there's only the one connection
+
+    int mutex_reply =
+        sps_pthread_mutex_timedlock(&dacp_conversation_lock, 2000000, commands[0], 1);
+    if (mutex_reply == 0) {
+      pthread_cleanup_push(dacp_conversation_cleanup, (void *)&dacp_conversation_lock);
+      int next = 0; // the first command not yet answered
+      int attempt;
+      for (attempt = 0; (attempt < 2) && (next < count); attempt++) {
+        int reused = (dacp_command_connection.fd >= 0);
+        int code = dacp_connection_open(&dacp_command_connection, 500000);
+        if (code == 0)
+          code = dacp_send_requests(&dacp_command_connection, &commands[next], count - next);
+        while ((code == 0) && (next < count)) {
+          struct HttpResponse response;
+          int anything_received;
+          code = dacp_receive_response(&dacp_command_connection, &response, &anything_received);
+          if (code == 0) {
+            bodies[next] = response.body;
+            bodysizes[next] = response.size;
+            results[next] = response.code;
+            next++;
+            if (response.close_connection) {
+              dacp_connection_close(&dacp_command_connection, 0);
+              if (next < count) // the rest have to be sent again on a new connection
+                code = 495;
             }
+          } else if ((reused) && (anything_received == 0)) {
+            // the server has probably closed the idle connection -- try a new one
+            debug(3, "dacp_send_command: idle connection closed by the server -- reconnecting.");
+          } else {
+            attempt = 2; // don't try again
           }
-          pthread_cleanup_pop(1); // this should close the socket
-                                  // close(sockfd);
-                                  // debug(1,"DACP socket closed.");
+          reused = 0; // only the first response on a reused connection is given the benefit
+        }
+        if (code != 0) {
+          dacp_connection_close(&dacp_command_connection, 1);
+          for (i = next; i < count; i++)
+            results[i] = code;
+          if ((code != 495) && (code != 493))
+            attempt = 2; // it can't be helped by trying again
         }
-        pthread_cleanup_pop(1); // this should unlock the dacp_conversation_lock);
-        // pthread_mutex_unlock(&dacp_conversation_lock);
-        // debug(1,"Sent command\"%s\" with a response body of size %d.",command,response.size);
-        // debug(1,"dacp_conversation_lock released.");
-      } else {
-        debug(3,
-              "dacp_send_command: could not acquire a lock on the dacp transmit/receive section "
-              "when attempting to "
-              "send the command \"%s\". Possible timeout?",
-              command);
-        response.code = 494; // This client is already busy
       }
-      pthread_cleanup_pop(1); // this should free the addrinfo
-      // freeaddrinfo(res);
-      uint64_t et = get_absolute_time_in_ns() - start_time; // this will be in nanoseconds
-      debug(3, "dacp_send_command: %f seconds, response code %d, command \"%s\".",
-            (1.0 * et) / 1000000000, response.code, command);
+      pthread_cleanup_pop(0);
+      pthread_mutex_unlock(&dacp_conversation_lock);
+      // debug(1,"dacp_conversation_lock released.");
+    } else {
+      debug(3,
+            "dacp_send_command: could not acquire a lock on the dacp transmit/receive section "
+            "when attempting to "
+            "send the command \"%s\". Possible timeout?",
+            commands[0]);
+      for (i = 0; i < count; i++)
+        results[i] = 494; // This client is already busy
+    }
+    uint64_t et = get_absolute_time_in_ns() - start_time; // this will be in nanoseconds
+    debug(3, "dacp_send_command: %f seconds, response code %d, command \"%s\"%s.",
+          (1.0 * et) / 1000000000, results[0], commands[0], count > 1 ? " and others" : "");
+  }
+  return results[count - 1];
+}
+
+int dacp_send_command(const char *command, char **body, ssize_t *bodysize) {
+  // debug(1,"dacp_send_command: command is: \"%s\".",command);
+  int result;
+  dacp_send_commands(&command, 1, body, bodysize, &result);
+  return result;
+}
+
+// how long a play status update request may be held by the server before it is made again
+#define DACP_LONG_POLL_TIMEOUT_SECONDS 30
+
+static void dacp_long_poll_connection_close(int abort_it) {
+  pthread_mutex_lock(&dacp_long_poll_lock);
+  dacp_connection_close(&dacp_long_poll_connection, abort_it);
+  pthread_mutex_unlock(&dacp_long_poll_lock);
+}
+
+static void dacp_long_poll_cleanup(__attribute__((unused)) void *arg) {
+  dacp_long_poll_connection_close(1);
+}
+
+// Wake up a long poll in progress, e.g. because the DACP server has changed.
+static void dacp_long_poll_interrupt(void) {
+  pthread_mutex_lock(&dacp_long_poll_lock);
+  if (dacp_long_poll_connection.fd >= 0)
+    shutdown(dacp_long_poll_connection.fd, SHUT_RDWR);
+  pthread_mutex_unlock(&dacp_long_poll_lock);
+}
+
+// Like dacp_send_command, but on the long poll connection and without the dacp_conversation_lock
+// being held while waiting for the response, which may take a long time to come.
+// Returns 489 if nothing has come by the time DACP_LONG_POLL_TIMEOUT_SECONDS have elapsed.
+static int dacp_send_long_poll_command(const char *command, char **body, ssize_t *bodysize) {
+  *body = NULL;
+  *bodysize = 0;
+  if (dacp_server.port == 0)
+    return 490; // no port specified
+  int result = 495;
+  int attempt;
+  for (attempt = 0; attempt < 2; attempt++) {
+    // the server's address is shared with the command connection
+    if (sps_pthread_mutex_timedlock(&dacp_conversation_lock, 2000000, command, 1) != 0)
+      return 494; // This client is already busy
+    int reused;
+    pthread_cleanup_push(mutex_lock_cleanup, (void *)&dacp_conversation_lock);
+    pthread_mutex_lock(&dacp_long_poll_lock);
+    reused = (dacp_long_poll_connection.fd >= 0);
+    result = dacp_connection_open(&dacp_long_poll_connection,
+                                  DACP_LONG_POLL_TIMEOUT_SECONDS * 1000000);
+    pthread_mutex_unlock(&dacp_long_poll_lock);
+    if (result == 0)
+      result = dacp_send_requests(&dacp_long_poll_connection, &command, 1);
+    pthread_cleanup_pop(1); // unlock the dacp_conversation_lock
+
+    int anything_received = 0;
+    if (result == 0) {
+      struct HttpResponse response;
+      pthread_cleanup_push(dacp_long_poll_cleanup, NULL);
+      result = dacp_receive_response(&dacp_long_poll_connection, &response, &anything_received);
+      pthread_cleanup_pop(0);
+      if (result == 0) {
+        *body = response.body;
+        *bodysize = response.size;
+        result = response.code;
+        if (response.close_connection)
+          dacp_long_poll_connection_close(0);
+        attempt = 2;
+      }
+    }
+    if (attempt < 2) {
+      dacp_long_poll_connection_close(1);
+      // only a connection found closed while idle is worth trying again
+      if ((reused == 0) || (anything_received != 0) || ((result != 495) && (result != 493)))
+        attempt = 2;
     }
-    *body = response.body;
-    *bodysize = response.size;
-    result = response.code;
   }
   return result;
 }
@@ -415,6 +598,8 @@ void set_dacp_server_information(rtsp_conn_info *conn) {
     // This is different to other AirPlay clients
     // which return immediately with a 403 code if there are no changes.
     dacp_server.always_use_revision_number_1 = 0;
+    dacp_server.long_poll_unavailable = 0;
+    dacp_long_poll_interrupt(); // it would be waiting on the previous server
     char *p = strstr(conn->UserAgent, "forked-daapd");
     if ((p != 0) &&
         (p == conn->UserAgent)) { // must exist and be at the start of the UserAgent string
@@ -463,6 +648,8 @@ void dacp_monitor_port_update_callback(char *dacp_id, uint16_t port) {
     warn("dacp_id or dacp_server.dacp_id NULL detected");
   } else {
     if (strcmp(dacp_id, dacp_server.dacp_id) == 0) {
+      if (dacp_server.port != port)
+        dacp_long_poll_interrupt();
       dacp_server.port = port;
       if (port == 0)
         dacp_server.scan_enable = 0;
@@ -488,8 +675,10 @@ void dacp_monitor_thread_code_cleanup(__attribute__((unused)) void *arg) {
 }
 
 void *dacp_monitor_thread_code(__attribute__((unused)) void *na) {
+  thread_set_name("dacp-monitor");
   int scan_index = 0;
   int always_use_revision_number_1 = 0;
+  int long_poll = 0;
   // char server_reply[10000];
   // debug(1, "DACP monitor thread started.");
   // wait until we get a valid port number to begin monitoring it
@@ -498,6 +687,7 @@ void *dacp_monitor_thread_code(__attribute__((unused)) void *na) {
   int idle_scan_count = 0;
   while (1) {
     int result = 0;
+    uint64_t activity_generation = activity_monitor_generation();
     sps_pthread_mutex_timedlock(
         &dacp_server_information_lock, 500000,
         "dacp_monitor_thread_code couldn't get DACP server information lock in 0.5 second!.", 2);
@@ -522,20 +712,16 @@ void *dacp_monitor_thread_code(__attribute__((unused)) void *na) {
       uint64_t time_to_wait_for_wakeup_ns =
           (uint64_t)(1000000000 * config.missing_port_dacp_scan_interval_seconds);
 
+      struct timespec time_to_wait;
 #ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
-      uint64_t time_of_wakeup_ns = get_absolute_time_in_ns() + time_to_wait_for_wakeup_ns;
-      uint64_t sec = time_of_wakeup_ns / 1000000000;
-      uint64_t nsec = time_of_wakeup_ns % 1000000000;
+      absolute_time_to_timespec(get_absolute_time_in_ns() + time_to_wait_for_wakeup_ns,
+                                &time_to_wait);
 #endif
 #ifdef COMPILE_FOR_OSX
-      uint64_t sec = time_to_wait_for_wakeup_ns / 1000000000;
-      uint64_t nsec = time_to_wait_for_wakeup_ns % 1000000000;
+      time_to_wait.tv_sec = time_to_wait_for_wakeup_ns / 1000000000;
+      time_to_wait.tv_nsec = time_to_wait_for_wakeup_ns % 1000000000;
 #endif
 
-      struct timespec time_to_wait;
-      time_to_wait.tv_sec = sec;
-      time_to_wait.tv_nsec = nsec;
-
       while ((dacp_server.scan_enable == 0) && (result != ETIMEDOUT)) {
         // debug(1, "dacp_monitor_thread_code wait for an event to possibly enable scan");
 
@@ -559,6 +745,7 @@ void *dacp_monitor_thread_code(__attribute__((unused)) void *na) {
 
     always_use_revision_number_1 =
         dacp_server.always_use_revision_number_1; // set this while access is locked
+    long_poll = (config.dacp_long_poll != 0) && (dacp_server.long_poll_unavailable == 0);
 
     result = dacp_get_volume(&the_volume); // just want the http code
     pthread_cleanup_pop(1);
@@ -654,12 +841,25 @@ void *dacp_monitor_thread_code(__attribute__((unused)) void *na) {
         char *response = NULL;
         int32_t item_size;
         char command[1024] = "";
-        if (always_use_revision_number_1 != 0) // for forked-daapd
+        // forked-daapd holds the request until there's a change, so unless that's wanted...
+        if ((always_use_revision_number_1 != 0) && (long_poll == 0))
           revision_number = 1;
         snprintf(command, sizeof(command) - 1, "playstatusupdate?revision-number=%d",
                  revision_number);
         // debug(1,"dacp_monitor_thread_code: command: \"%s\"",command);
-        result = dacp_send_command(command, &response, &le);
+        if (long_poll) {
+          result = dacp_send_long_poll_command(command, &response, &le);
+          if (result == 403) {
+            // the server answers at once when there's nothing new, so it has to be polled
+            debug(2, "The DACP server does not hold play status update requests -- polling it.");
+            debug_mutex_lock(&dacp_server_information_lock, 500000, 2);
+            dacp_server.long_poll_unavailable = 1;
+            debug_mutex_unlock(&dacp_server_information_lock, 3);
+            long_poll = 0;
+          }
+        } else {
+          result = dacp_send_command(command, &response, &le);
+        }
         // debug(1,"Response to \"%s\" is %d.",command,result);
         // remember: unless the revision_number you pass in is 1,
         // response will be 200 only if there's something new to report.
@@ -919,10 +1119,15 @@ void *dacp_monitor_thread_code(__attribute__((unused)) void *na) {
         response = NULL;
       }
       */
-      if (metadata_store.player_thread_active)
-        sleep(config.scan_interval_when_active);
-      else
-        sleep(config.scan_interval_when_inactive);
+      // after a long poll that was answered or timed out, there's no need to wait to poll again
+      if ((long_poll == 0) || ((result != 200) && (result != 489))) {
+        if ((metadata_store.player_thread_active) || (activity_status() != am_inactive))
+          sleep(config.scan_interval_when_active);
+        else // but look again as soon as Shairport Sync goes active
+          activity_monitor_wait_for_change(activity_generation,
+                                           (uint64_t)config.scan_interval_when_inactive *
+                                               1000000000); // a cancellation point
+      }
     }
   }
   debug(1, "DACP monitor thread exiting -- should never happen.");
@@ -1000,6 +1205,12 @@ void dacp_monitor_stop() {
     debug(2, "dacp_monitor_stop");
     pthread_cancel(dacp_monitor_thread);
     pthread_join(dacp_monitor_thread, NULL);
+    dacp_connection_close(&dacp_command_connection, 0);
+    dacp_connection_close(&dacp_long_poll_connection, 0);
+    if (dacp_server_address) {
+      freeaddrinfo(dacp_server_address);
+      dacp_server_address = NULL;
+    }
     pthread_mutex_destroy(&dacp_server_information_lock);
     debug(3, "DACP Conversation Lock Mutex Destroyed");
     pthread_mutex_destroy(&dacp_conversation_lock);
@@ -1024,37 +1235,45 @@ uint32_t dacp_tlv_crawl(char **p, int32_t *length) {
   return type;
 }
 
-int dacp_get_client_volume(int32_t *result) {
-  // debug(1,"dacp_get_client_volume");
-  char *server_reply = NULL;
+#define dacp_client_volume_command "getproperty?properties=dmcp.volume"
+#define dacp_speaker_list_command "getspeakers"
+
+// get the overall volume from the reply to dacp_client_volume_command, or -1
+static int32_t dacp_parse_client_volume(char *server_reply, ssize_t reply_size) {
   int32_t overall_volume = -1;
-  ssize_t reply_size;
-  // debug(1,"dacp_get_client_volume: dacp_send_command");
-  int response =
-      dacp_send_command("getproperty?properties=dmcp.volume", &server_reply, &reply_size);
-  if (response == 200) { // if we get an okay
-    char *sp = server_reply;
-    int32_t item_size;
-    if (reply_size >= 8) {
-      if (dacp_tlv_crawl(&sp, &item_size) == 'cmgt') {
-        sp -= item_size; // drop down into the array -- don't skip over it
-        reply_size -= 8;
-        while (reply_size >= 8) {
-          uint32_t type = dacp_tlv_crawl(&sp, &item_size);
-          reply_size -= item_size + 8;
-          if (type == 'cmvo') { // drop down into the dictionary -- don't skip over it
-            char *t = sp - item_size;
-            overall_volume = ntohl(*(uint32_t *)(t));
-          }
+  char *sp = server_reply;
+  int32_t item_size;
+  if (reply_size >= 8) {
+    if (dacp_tlv_crawl(&sp, &item_size) == 'cmgt') {
+      sp -= item_size; // drop down into the array -- don't skip over it
+      reply_size -= 8;
+      while (reply_size >= 8) {
+        uint32_t type = dacp_tlv_crawl(&sp, &item_size);
+        reply_size -= item_size + 8;
+        if (type == 'cmvo') { // drop down into the dictionary -- don't skip over it
+          char *t = sp - item_size;
+          overall_volume = ntohl(*(uint32_t *)(t));
         }
-      } else {
-        debug(1, "Unexpected payload response from getproperty?properties=dmcp.volume");
       }
     } else {
-      debug(1, "Too short a response from getproperty?properties=dmcp.volume");
+      debug(1, "Unexpected payload response from getproperty?properties=dmcp.volume");
     }
-    // debug(1, "Overall Volume is %d.", overall_volume);
+  } else {
+    debug(1, "Too short a response from getproperty?properties=dmcp.volume");
   }
+  // debug(1, "Overall Volume is %d.", overall_volume);
+  return overall_volume;
+}
+
+int dacp_get_client_volume(int32_t *result) {
+  // debug(1,"dacp_get_client_volume");
+  char *server_reply = NULL;
+  int32_t overall_volume = -1;
+  ssize_t reply_size;
+  // debug(1,"dacp_get_client_volume: dacp_send_command");
+  int response = dacp_send_command(dacp_client_volume_command, &server_reply, &reply_size);
+  if (response == 200) // if we get an okay
+    overall_volume = dacp_parse_client_volume(server_reply, reply_size);
 
   if (server_reply) {
     // debug(1, "Freeing response memory.");
@@ -1091,127 +1310,160 @@ int dacp_set_speaker_volume(int64_t machine_number, int32_t vo) {
   // should return 204
 }
 
-int dacp_get_speaker_list(dacp_spkr_stuff *speaker_info, int max_size_of_array,
-                          int *actual_speaker_count) {
+// Fill in the speaker information from the reply to dacp_speaker_list_command.
+// Returns 200, or 413 if there are more speakers than will fit, and sets *actual_speaker_count
+// to the number of speakers, or -1 if the reply can't be understood.
+static int dacp_parse_speaker_list(char *server_reply, ssize_t le, dacp_spkr_stuff *speaker_info,
+                                   int max_size_of_array, int *actual_speaker_count) {
   // char typestring[5];
-  char *server_reply = NULL;
   int speaker_index = -1; // will be incremented before use
   int speaker_count = -1; // will be fixed if there is no problem
-  ssize_t le;
+  int response = 200;
+  char *sp = server_reply;
+  int32_t item_size;
+  if (le >= 8) {
+    if (dacp_tlv_crawl(&sp, &item_size) == 'casp') {
+      //          debug(1,"Speakers:",item_size);
+      sp -= item_size; // drop down into the array -- don't skip over it
+      le -= 8;
+      while (le >= 8) {
+        uint32_t type = dacp_tlv_crawl(&sp, &item_size);
+        if (type == 'mdcl') { // drop down into the dictionary -- don't skip over it
+          // debug(1,">>>> Dictionary:");
+          sp -= item_size;
+          le -= 8;
+          speaker_index++;
+          if (speaker_index == max_size_of_array) {
+            if (actual_speaker_count)
+              *actual_speaker_count = -1;
+            return 413; // Payload Too Large -- too many speakers
+          }
+          speaker_info[speaker_index].active = 0;
+          speaker_info[speaker_index].speaker_number = 0;
+          speaker_info[speaker_index].volume = 0;
+          speaker_info[speaker_index].name[0] = '\0';
+        } else {
+          le -= item_size + 8;
+          char *t;
+          // char u;
+          int32_t r;
+          int64_t s, v;
+          switch (type) {
+          case 'minm':
+            t = sp - item_size;
+            strncpy((char *)&speaker_info[speaker_index].name, t,
+                    sizeof(speaker_info[speaker_index].name));
+            speaker_info[speaker_index].name[sizeof(speaker_info[speaker_index].name) - 1] =
+                '\0'; // just in case
+            break;
+          case 'cmvo':
+            t = sp - item_size;
+            r = ntohl(*(uint32_t *)(t));
+            speaker_info[speaker_index].volume = r;
+            // debug(1,"The individual volume of speaker \"%s\" is
+            // \"%d\".",speaker_info[speaker_index].name,r);
+            break;
+          case 'msma':
+            t = sp - item_size;
+            s = ntohl(*(uint32_t *)(t));
+            s = s << 32;
+            t += 4;
+            v = (ntohl(*(uint32_t *)(t))) & 0xffffffff;
+            s += v;
+            speaker_info[speaker_index].speaker_number = s;
+            // debug(1,"Speaker machine number: %ld",s);
+            break;
+
+          case 'caia':
+            speaker_info[speaker_index].active = 1;
+            break;
+          /*
+                          case 'caip':
+                          case 'cavd':
+                          case 'caiv':
+                          case 'cads':
 
-  // debug(1,"dacp_speaker_list: dacp_send_command");
-  int response = dacp_send_command("getspeakers", &server_reply, &le);
-  if (response == 200) {
-    char *sp = server_reply;
-    int32_t item_size;
-    if (le >= 8) {
-      if (dacp_tlv_crawl(&sp, &item_size) == 'casp') {
-        //          debug(1,"Speakers:",item_size);
-        sp -= item_size; // drop down into the array -- don't skip over it
-        le -= 8;
-        while (le >= 8) {
-          uint32_t type = dacp_tlv_crawl(&sp, &item_size);
-          if (type == 'mdcl') { // drop down into the dictionary -- don't skip over it
-            // debug(1,">>>> Dictionary:");
-            sp -= item_size;
-            le -= 8;
-            speaker_index++;
-            if (speaker_index == max_size_of_array) {
-              return 413; // Payload Too Large -- too many speakers
-            }
-            speaker_info[speaker_index].active = 0;
-            speaker_info[speaker_index].speaker_number = 0;
-            speaker_info[speaker_index].volume = 0;
-            speaker_info[speaker_index].name[0] = '\0';
-          } else {
-            le -= item_size + 8;
-            char *t;
-            // char u;
-            int32_t r;
-            int64_t s, v;
-            switch (type) {
-            case 'minm':
-              t = sp - item_size;
-              strncpy((char *)&speaker_info[speaker_index].name, t,
-                      sizeof(speaker_info[speaker_index].name));
-              speaker_info[speaker_index].name[sizeof(speaker_info[speaker_index].name) - 1] =
-                  '\0'; // just in case
-              break;
-            case 'cmvo':
-              t = sp - item_size;
-              r = ntohl(*(uint32_t *)(t));
-              speaker_info[speaker_index].volume = r;
-              // debug(1,"The individual volume of speaker \"%s\" is
-              // \"%d\".",speaker_info[speaker_index].name,r);
-              break;
-            case 'msma':
-              t = sp - item_size;
-              s = ntohl(*(uint32_t *)(t));
-              s = s << 32;
-              t += 4;
-              v = (ntohl(*(uint32_t *)(t))) & 0xffffffff;
-              s += v;
-              speaker_info[speaker_index].speaker_number = s;
-              // debug(1,"Speaker machine number: %ld",s);
-              break;
-
-            case 'caia':
-              speaker_info[speaker_index].active = 1;
-              break;
-            /*
-                            case 'caip':
-                            case 'cavd':
-                            case 'caiv':
-                            case 'cads':
-
-                              *(uint32_t *)typestring = htonl(type);
-                              typestring[4] = 0;
-
-
-
-                              t = sp-item_size;
-                              u = *t;
-                              debug(1,"Type: '%s' Value: \"%d\".",typestring,u);
-                              break;
-            */
-            default:
-              break;
-            }
+                            *(uint32_t *)typestring = htonl(type);
+                            typestring[4] = 0;
+
+
+
+                            t = sp-item_size;
+                            u = *t;
+                            debug(1,"Type: '%s' Value: \"%d\".",typestring,u);
+                            break;
+          */
+          default:
+            break;
           }
         }
-        // debug(1,"Total of %d speakers found. Here are the active ones:",speaker_index+1);
-        speaker_count = speaker_index + 1; // number of speaker entries in the array
-      } else {
-        debug(1, "Speaker array not found.");
       }
-      /*
-              int i;
-              for (i=0;i<le;i++) {
-                if (*sp < ' ')
-                  debug(1,"%d  %02x", i, *sp);
-                else
-                  debug(1,"%d  %02x  '%c'", i, *sp,*sp);
-                sp++;
-              }
-      */
+      // debug(1,"Total of %d speakers found. Here are the active ones:",speaker_index+1);
+      speaker_count = speaker_index + 1; // number of speaker entries in the array
     } else {
-      debug(1, "Can't find any content in dacp speakers request");
+      debug(1, "Speaker array not found.");
     }
-    free(server_reply);
-    server_reply = NULL;
+    /*
+            int i;
+            for (i=0;i<le;i++) {
+              if (*sp < ' ')
+                debug(1,"%d  %02x", i, *sp);
+              else
+                debug(1,"%d  %02x  '%c'", i, *sp,*sp);
+              sp++;
+            }
+    */
   } else {
-    // debug(1, "Unexpected response %d to dacp speakers request", response);
-    if (server_reply) {
-      debug(1, "Freeing response memory.");
-      free(server_reply);
-      server_reply = NULL;
-    }
+    debug(1, "Can't find any content in dacp speakers request");
   }
   if (actual_speaker_count)
     *actual_speaker_count = speaker_count;
   return response;
 }
 
+int dacp_get_speaker_list(dacp_spkr_stuff *speaker_info, int max_size_of_array,
+                          int *actual_speaker_count) {
+  char *server_reply = NULL;
+  ssize_t le;
+  // debug(1,"dacp_speaker_list: dacp_send_command");
+  int response = dacp_send_command(dacp_speaker_list_command, &server_reply, &le);
+  if (response == 200) {
+    response = dacp_parse_speaker_list(server_reply, le, speaker_info, max_size_of_array,
+                                       actual_speaker_count);
+  } else {
+    // debug(1, "Unexpected response %d to dacp speakers request", response);
+    if (actual_speaker_count)
+      *actual_speaker_count = -1;
+  }
+  if (server_reply) {
+    free(server_reply);
+    server_reply = NULL;
+  }
+  return response;
+}
+
+// Get the overall volume and the speaker list together, with the two requests sent at once.
+// Returns 200 if both were got -- otherwise the code of the first failure.
+static int dacp_get_volume_and_speaker_list(int32_t *overall_volume, dacp_spkr_stuff *speaker_info,
+                                            int max_size_of_array, int *actual_speaker_count) {
+  const char *commands[2] = {dacp_client_volume_command, dacp_speaker_list_command};
+  char *bodies[2];
+  ssize_t sizes[2];
+  int results[2];
+  dacp_send_commands(commands, 2, bodies, sizes, results);
+  int response = results[0];
+  if (response == 200) {
+    *overall_volume = dacp_parse_client_volume(bodies[0], sizes[0]);
+    response = results[1];
+    if (response == 200)
+      response = dacp_parse_speaker_list(bodies[1], sizes[1], speaker_info, max_size_of_array,
+                                         actual_speaker_count);
+  }
+  free(bodies[0]);
+  free(bodies[1]);
+  return response;
+}
+
 int dacp_get_volume(int32_t *the_actual_volume) {
   // get the speaker volume information from the DACP source and store it in the metadata_hub
   // A volume command has been sent from the client
@@ -1222,47 +1474,43 @@ int dacp_get_volume(int32_t *the_actual_volume) {
 
   int32_t overall_volume = 0;
   int32_t actual_volume = 0;
-  int http_response = dacp_get_client_volume(&overall_volume);
+  int speaker_count = 0;
+  int http_response = dacp_get_volume_and_speaker_list(
+      &overall_volume, (dacp_spkr_stuff *)&speaker_info, 50, &speaker_count);
+  // debug(1,"Overall volume is: %u.",overall_volume);
   if (http_response == 200) {
-    // debug(1,"Overall volume is: %u.",overall_volume);
-    int speaker_count = 0;
-    http_response = dacp_get_speaker_list((dacp_spkr_stuff *)&speaker_info, 50, &speaker_count);
-    if (http_response == 200) {
-      // get our machine number
-      uint16_t *hn = (uint16_t *)config.hw_addr;
-      uint32_t *ln = (uint32_t *)(config.hw_addr + 2);
-      uint64_t t1 = ntohs(*hn);
-      uint64_t t2 = ntohl(*ln);
-      int64_t machine_number = (t1 << 32) + t2; // this form is useful
-
-      // Let's find our own speaker in the array and pick up its relative volume
-      int i;
-      int32_t relative_volume = 0;
-      for (i = 0; i < speaker_count; i++) {
-        if (speaker_info[i].speaker_number == machine_number) {
-          relative_volume = speaker_info[i].volume;
-          /*
-          debug(1,"Our speaker was found with a relative volume of: %u.",relative_volume);
-
-          if (speaker_info[i].active)
-            debug(1,"Our speaker is active.");
-          else
-            debug(1,"Our speaker is inactive.");
-          */
-        }
+    // get our machine number
+    uint16_t *hn = (uint16_t *)config.hw_addr;
+    uint32_t *ln = (uint32_t *)(config.hw_addr + 2);
+    uint64_t t1 = ntohs(*hn);
+    uint64_t t2 = ntohl(*ln);
+    int64_t machine_number = (t1 << 32) + t2; // this form is useful
+
+    // Let's find our own speaker in the array and pick up its relative volume
+    int i;
+    int32_t relative_volume = 0;
+    for (i = 0; i < speaker_count; i++) {
+      if (speaker_info[i].speaker_number == machine_number) {
+        relative_volume = speaker_info[i].volume;
+        /*
+        debug(1,"Our speaker was found with a relative volume of: %u.",relative_volume);
+
+        if (speaker_info[i].active)
+          debug(1,"Our speaker is active.");
+        else
+          debug(1,"Our speaker is inactive.");
+        */
       }
-      actual_volume = (overall_volume * relative_volume + 50) / 100;
-      // debug(1,"Overall volume: %d, relative volume: %d%, actual volume:
-      // %d.",overall_volume,relative_volume,actual_volume);
-      // debug(1,"Our actual speaker volume is %d.",actual_volume);
-      // metadata_hub_modify_prolog();
-      // metadata_store.speaker_volume = actual_volume;
-      // metadata_hub_modify_epilog(1);
-    } else {
-      debug(2, "Unexpected return code %d from dacp_get_speaker_list.", http_response);
     }
+    actual_volume = (overall_volume * relative_volume + 50) / 100;
+    // debug(1,"Overall volume: %d, relative volume: %d%, actual volume:
+    // %d.",overall_volume,relative_volume,actual_volume);
+    // debug(1,"Our actual speaker volume is %d.",actual_volume);
+    // metadata_hub_modify_prolog();
+    // metadata_store.speaker_volume = actual_volume;
+    // metadata_hub_modify_epilog(1);
   } else if ((http_response != 400) && (http_response != 490)) {
-    debug(3, "Unexpected return code %d from dacp_get_client_volume.", http_response);
+    debug(3, "Unexpected return code %d getting the volume and the speaker list.", http_response);
   }
   if (the_actual_volume) {
     // debug(1,"dacp_get_volume returns %d.",actual_volume);
@@ -1277,97 +1525,93 @@ int dacp_set_volume(int32_t vo) {
     // get the information we need -- the absolute volume, the speaker list, our ID
     struct dacp_speaker_stuff speaker_info[50];
     int32_t overall_volume;
-    http_response = dacp_get_client_volume(&overall_volume);
+    int speaker_count;
+    http_response = dacp_get_volume_and_speaker_list(
+        &overall_volume, (dacp_spkr_stuff *)&speaker_info, 50, &speaker_count);
     if (http_response == 200) {
-      int speaker_count;
-      http_response = dacp_get_speaker_list((dacp_spkr_stuff *)&speaker_info, 50, &speaker_count);
-      if (http_response == 200) {
-        // get our machine number
-        uint16_t *hn = (uint16_t *)config.hw_addr;
-        uint32_t *ln = (uint32_t *)(config.hw_addr + 2);
-        uint64_t t1 = ntohs(*hn);
-        uint64_t t2 = ntohl(*ln);
-        int64_t machine_number = (t1 << 32) + t2; // this form is useful
-
-        // Let's find our own speaker in the array and pick up its relative volume
-        int i;
-        int32_t active_speakers = 0;
-        for (i = 0; i < speaker_count; i++) {
-          if (speaker_info[i].speaker_number == machine_number) {
-            debug(2, "Our speaker number found: %ld with relative volume.", machine_number,
-                  speaker_info[i].volume);
-          }
-          if (speaker_info[i].active == 1) {
-            active_speakers++;
-          }
+      // get our machine number
+      uint16_t *hn = (uint16_t *)config.hw_addr;
+      uint32_t *ln = (uint32_t *)(config.hw_addr + 2);
+      uint64_t t1 = ntohs(*hn);
+      uint64_t t2 = ntohl(*ln);
+      int64_t machine_number = (t1 << 32) + t2; // this form is useful
+
+      // Let's find our own speaker in the array and pick up its relative volume
+      int i;
+      int32_t active_speakers = 0;
+      for (i = 0; i < speaker_count; i++) {
+        if (speaker_info[i].speaker_number == machine_number) {
+          debug(2, "Our speaker number found: %ld with relative volume.", machine_number,
+                speaker_info[i].volume);
+        }
+        if (speaker_info[i].active == 1) {
+          active_speakers++;
         }
+      }
 
-        if (active_speakers == 1) {
-          // must be just this speaker
-          debug(2, "Remote-setting volume to %d on just one speaker.", vo);
+      if (active_speakers == 1) {
+        // must be just this speaker
+        debug(2, "Remote-setting volume to %d on just one speaker.", vo);
+        http_response = dacp_set_include_speaker_volume(machine_number, vo);
+      } else if (active_speakers == 0) {
+        debug(2, "No speakers!");
+      } else {
+        debug(2, "Speakers: %d, active: %d", speaker_count, active_speakers);
+        if (vo >= overall_volume) {
+          debug(2, "Multiple speakers active, but desired new volume is highest");
           http_response = dacp_set_include_speaker_volume(machine_number, vo);
-        } else if (active_speakers == 0) {
-          debug(2, "No speakers!");
         } else {
-          debug(2, "Speakers: %d, active: %d", speaker_count, active_speakers);
-          if (vo >= overall_volume) {
-            debug(2, "Multiple speakers active, but desired new volume is highest");
+          // the desired volume is less than the current overall volume and there is more than
+          // one
+          // speaker
+          // we must find out the highest other speaker volume.
+          // If the desired volume is less than it, we must set the current_overall volume to
+          // that
+          // highest volume
+          // and set our volume relative to it.
+          // If the desired volume is greater than the highest current volume, then we can just
+          // go
+          // ahead
+          // with dacp_set_include_speaker_volume, setting the new current overall volume to the
+          // desired new level
+          // with the speaker at 100%
+
+          int32_t highest_other_volume = 0;
+          for (i = 0; i < speaker_count; i++) {
+            if ((speaker_info[i].speaker_number != machine_number) &&
+                (speaker_info[i].active == 1) &&
+                (speaker_info[i].volume > highest_other_volume)) {
+              highest_other_volume = speaker_info[i].volume;
+            }
+          }
+          highest_other_volume = (highest_other_volume * overall_volume + 50) / 100;
+          if (highest_other_volume <= vo) {
+            debug(2,
+                  "Highest other volume %d is less than or equal to the desired new volume %d.",
+                  highest_other_volume, vo);
             http_response = dacp_set_include_speaker_volume(machine_number, vo);
           } else {
-            // the desired volume is less than the current overall volume and there is more than
-            // one
-            // speaker
-            // we must find out the highest other speaker volume.
-            // If the desired volume is less than it, we must set the current_overall volume to
-            // that
-            // highest volume
-            // and set our volume relative to it.
-            // If the desired volume is greater than the highest current volume, then we can just
-            // go
-            // ahead
-            // with dacp_set_include_speaker_volume, setting the new current overall volume to the
-            // desired new level
-            // with the speaker at 100%
-
-            int32_t highest_other_volume = 0;
-            for (i = 0; i < speaker_count; i++) {
-              if ((speaker_info[i].speaker_number != machine_number) &&
-                  (speaker_info[i].active == 1) &&
-                  (speaker_info[i].volume > highest_other_volume)) {
-                highest_other_volume = speaker_info[i].volume;
-              }
-            }
-            highest_other_volume = (highest_other_volume * overall_volume + 50) / 100;
-            if (highest_other_volume <= vo) {
-              debug(2,
-                    "Highest other volume %d is less than or equal to the desired new volume %d.",
-                    highest_other_volume, vo);
-              http_response = dacp_set_include_speaker_volume(machine_number, vo);
-            } else {
-              debug(2, "Highest other volume %d is greater than the desired new volume %d.",
-                    highest_other_volume, vo);
-              // if the present overall volume is higher than the highest other volume at present,
-              // then bring it down to it.
-              if (overall_volume > highest_other_volume) {
-                debug(2, "Lower overall volume to new highest volume.");
-                http_response = dacp_set_include_speaker_volume(
-                    machine_number,
-                    highest_other_volume); // set the overall volume to the highest one
-              }
-              int32_t desired_relative_volume =
-                  (vo * 100 + (highest_other_volume / 2)) / highest_other_volume;
-              debug(2, "Set our speaker volume relative to the highest volume.");
-              http_response = dacp_set_speaker_volume(
+            debug(2, "Highest other volume %d is greater than the desired new volume %d.",
+                  highest_other_volume, vo);
+            // if the present overall volume is higher than the highest other volume at present,
+            // then bring it down to it.
+            if (overall_volume > highest_other_volume) {
+              debug(2, "Lower overall volume to new highest volume.");
+              http_response = dacp_set_include_speaker_volume(
                   machine_number,
-                  desired_relative_volume); // set the overall volume to the highest one
+                  highest_other_volume); // set the overall volume to the highest one
             }
+            int32_t desired_relative_volume =
+                (vo * 100 + (highest_other_volume / 2)) / highest_other_volume;
+            debug(2, "Set our speaker volume relative to the highest volume.");
+            http_response = dacp_set_speaker_volume(
+                machine_number,
+                desired_relative_volume); // set the overall volume to the highest one
           }
         }
-      } else {
-        debug(2, "Can't get speakers list");
       }
     } else {
-      debug(2, "Can't get client volume");
+      debug(2, "Can't get the client volume and speakers list");
     }
 
   } else {
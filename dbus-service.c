@@ -56,36 +56,44 @@ ShairportSyncAdvancedRemoteControl *shairportSyncAdvancedRemoteControlSkeleton =
 
 guint ownerID = 0;
 
-void dbus_metadata_watcher(struct metadata_bundle *argc, __attribute__((unused)) void *userdata) {
+// only the properties that have changed are set, so that clients aren't woken for nothing
+static void dbus_publish_changes(struct metadata_bundle *argc, uint64_t changes) {
   char response[100];
   gboolean current_status, new_status;
 
   const char *th;
-  shairport_sync_advanced_remote_control_set_volume(shairportSyncAdvancedRemoteControlSkeleton,
-                                                    argc->speaker_volume);
+  if (changes & MHC_speaker_volume)
+    shairport_sync_advanced_remote_control_set_volume(shairportSyncAdvancedRemoteControlSkeleton,
+                                                      argc->speaker_volume);
 
-  shairport_sync_remote_control_set_airplay_volume(shairportSyncRemoteControlSkeleton,
-                                                   argc->airplay_volume);
+  if (changes & MHC_airplay_volume)
+    shairport_sync_remote_control_set_airplay_volume(shairportSyncRemoteControlSkeleton,
+                                                     argc->airplay_volume);
 
-  shairport_sync_remote_control_set_client(shairportSyncRemoteControlSkeleton, argc->client_ip);
+  if (changes & MHC_client_ip)
+    shairport_sync_remote_control_set_client(shairportSyncRemoteControlSkeleton, argc->client_ip);
 
   // although it's a DACP server, the server is in fact, part of the the AirPlay "client" (their
   // term).
-  if (argc->dacp_server_active) {
-    shairport_sync_remote_control_set_available(shairportSyncRemoteControlSkeleton, TRUE);
-  } else {
-    shairport_sync_remote_control_set_available(shairportSyncRemoteControlSkeleton, FALSE);
+  if (changes & MHC_dacp_server_active) {
+    if (argc->dacp_server_active) {
+      shairport_sync_remote_control_set_available(shairportSyncRemoteControlSkeleton, TRUE);
+    } else {
+      shairport_sync_remote_control_set_available(shairportSyncRemoteControlSkeleton, FALSE);
+    }
   }
 
-  if (argc->advanced_dacp_server_active) {
-    shairport_sync_advanced_remote_control_set_available(shairportSyncAdvancedRemoteControlSkeleton,
-                                                         TRUE);
-  } else {
-    shairport_sync_advanced_remote_control_set_available(shairportSyncAdvancedRemoteControlSkeleton,
-                                                         FALSE);
+  if (changes & MHC_advanced_dacp_server_active) {
+    if (argc->advanced_dacp_server_active) {
+      shairport_sync_advanced_remote_control_set_available(
+          shairportSyncAdvancedRemoteControlSkeleton, TRUE);
+    } else {
+      shairport_sync_advanced_remote_control_set_available(
+          shairportSyncAdvancedRemoteControlSkeleton, FALSE);
+    }
   }
 
-  if (argc->progress_string) {
+  if ((changes & MHC_progress_string) && (argc->progress_string)) {
     // debug(1, "Check progress string");
     th = shairport_sync_remote_control_get_progress_string(shairportSyncRemoteControlSkeleton);
     if ((th == NULL) || (strcasecmp(th, argc->progress_string) != 0)) {
@@ -95,22 +103,34 @@ void dbus_metadata_watcher(struct metadata_bundle *argc, __attribute__((unused))
     }
   }
 
-  switch (argc->player_state) {
-  case PS_NOT_AVAILABLE:
-    shairport_sync_remote_control_set_player_state(shairportSyncRemoteControlSkeleton,
-                                                   "Not Available");
-    break;
-  case PS_STOPPED:
-    shairport_sync_remote_control_set_player_state(shairportSyncRemoteControlSkeleton, "Stopped");
-    break;
-  case PS_PAUSED:
-    shairport_sync_remote_control_set_player_state(shairportSyncRemoteControlSkeleton, "Paused");
-    break;
-  case PS_PLAYING:
-    shairport_sync_remote_control_set_player_state(shairportSyncRemoteControlSkeleton, "Playing");
-    break;
-  default:
-    debug(1, "This should never happen.");
+  if ((argc->receive_statistics) && (changes & MHC_receive_statistics))
+    shairport_sync_diagnostics_set_receive_statistics(shairportSyncDiagnosticsSkeleton,
+                                                      argc->receive_statistics);
+
+  if ((argc->stage_timings) && (changes & MHC_stage_timings))
+    shairport_sync_diagnostics_set_stage_timings(shairportSyncDiagnosticsSkeleton,
+                                                 argc->stage_timings);
+
+  if (changes & MHC_player_state) {
+    switch (argc->player_state) {
+    case PS_NOT_AVAILABLE:
+      shairport_sync_remote_control_set_player_state(shairportSyncRemoteControlSkeleton,
+                                                     "Not Available");
+      break;
+    case PS_STOPPED:
+      shairport_sync_remote_control_set_player_state(shairportSyncRemoteControlSkeleton,
+                                                     "Stopped");
+      break;
+    case PS_PAUSED:
+      shairport_sync_remote_control_set_player_state(shairportSyncRemoteControlSkeleton, "Paused");
+      break;
+    case PS_PLAYING:
+      shairport_sync_remote_control_set_player_state(shairportSyncRemoteControlSkeleton,
+                                                     "Playing");
+      break;
+    default:
+      debug(1, "This should never happen.");
+    }
   }
 
   switch (argc->play_status) {
@@ -191,6 +211,9 @@ void dbus_metadata_watcher(struct metadata_bundle *argc, __attribute__((unused))
                                                        new_status);
   }
 
+  if ((changes & MHC_track_metadata) == 0)
+    return;
+
   // Build the metadata array
   debug(2, "Build metadata");
   GVariantBuilder *dict_builder = g_variant_builder_new(G_VARIANT_TYPE("a{sv}"));
@@ -254,6 +277,84 @@ void dbus_metadata_watcher(struct metadata_bundle *argc, __attribute__((unused))
   shairport_sync_remote_control_set_metadata(shairportSyncRemoteControlSkeleton, dict);
 }
 
+// The watcher is called on the metadata hub's notification thread, and the activity is set on the
+// activity monitor's. Rather than setting the properties there, which takes the skeletons' locks
+// and has the loop wake for each one, the changes are gathered here with atomic operations and
+// published together by a single callback on the thread running the GLib loop. Everything set in
+// one callback goes out as one PropertiesChanged signal per interface.
+// An idle source is attached rather than using g_main_context_invoke(), which would run the
+// callback there and then if the loop didn't own the context -- reading the hub while the watcher
+// still holds it for writing.
+#define DBUS_STATE_ACTIVE 1
+#define DBUS_STATE_ACTIVE_PENDING 2
+#define DBUS_STATE_DISABLE_STANDBY 4
+#define DBUS_STATE_DISABLE_STANDBY_PENDING 8
+
+static uint64_t pending_changes = 0; // MHC_* bits
+static int pending_states = 0;       // DBUS_STATE_* bits
+static int publication_scheduled = 0;
+
+static gboolean publish_pending_changes(__attribute__((unused)) gpointer data) {
+  // clear this first, so that anything noted from now on schedules another publication
+  __atomic_store_n(&publication_scheduled, 0, __ATOMIC_SEQ_CST);
+  uint64_t changes = __atomic_exchange_n(&pending_changes, 0, __ATOMIC_SEQ_CST);
+  int states = __atomic_exchange_n(&pending_states, 0, __ATOMIC_SEQ_CST);
+  if (changes != 0) {
+    metadata_hub_read_prolog();
+    dbus_publish_changes(&metadata_store, changes);
+    metadata_hub_read_epilog();
+  }
+  if (states & DBUS_STATE_ACTIVE_PENDING)
+    shairport_sync_set_active(SHAIRPORT_SYNC(shairportSyncSkeleton),
+                              (states & DBUS_STATE_ACTIVE) ? TRUE : FALSE);
+  if (states & DBUS_STATE_DISABLE_STANDBY_PENDING)
+    shairport_sync_set_disable_standby(SHAIRPORT_SYNC(shairportSyncSkeleton),
+                                       (states & DBUS_STATE_DISABLE_STANDBY) ? TRUE : FALSE);
+  // send the changes now rather than when the skeletons' own idle sources get round to it
+  g_dbus_interface_skeleton_flush(G_DBUS_INTERFACE_SKELETON(shairportSyncSkeleton));
+  g_dbus_interface_skeleton_flush(G_DBUS_INTERFACE_SKELETON(shairportSyncDiagnosticsSkeleton));
+  g_dbus_interface_skeleton_flush(G_DBUS_INTERFACE_SKELETON(shairportSyncRemoteControlSkeleton));
+  g_dbus_interface_skeleton_flush(
+      G_DBUS_INTERFACE_SKELETON(shairportSyncAdvancedRemoteControlSkeleton));
+  return G_SOURCE_REMOVE;
+}
+
+static void schedule_publication(void) {
+  if (__atomic_exchange_n(&publication_scheduled, 1, __ATOMIC_SEQ_CST) == 0) {
+    GSource *source = g_idle_source_new();
+    g_source_set_callback(source, publish_pending_changes, NULL, NULL);
+    g_source_attach(source, NULL); // the default context, which the D-Bus thread's loop runs
+    g_source_unref(source);
+  }
+}
+
+void dbus_metadata_watcher(__attribute__((unused)) struct metadata_bundle *argc, uint64_t changes,
+                           __attribute__((unused)) void *userdata) {
+  __atomic_fetch_or(&pending_changes, changes, __ATOMIC_SEQ_CST);
+  schedule_publication();
+}
+
+static void set_pending_state(int state, int pending, int value) {
+  int old_states = __atomic_load_n(&pending_states, __ATOMIC_SEQ_CST);
+  int new_states;
+  do {
+    new_states = (old_states & ~state) | pending | (value ? state : 0);
+  } while (__atomic_compare_exchange_n(&pending_states, &old_states, new_states, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) == 0);
+  schedule_publication();
+}
+
+void dbus_service_set_active(int active) {
+  if (service_is_running)
+    set_pending_state(DBUS_STATE_ACTIVE, DBUS_STATE_ACTIVE_PENDING, active);
+}
+
+void dbus_service_set_disable_standby(int disable_standby) {
+  if (service_is_running)
+    set_pending_state(DBUS_STATE_DISABLE_STANDBY, DBUS_STATE_DISABLE_STANDBY_PENDING,
+                      disable_standby);
+}
+
 static gboolean on_handle_set_volume(ShairportSyncAdvancedRemoteControl *skeleton,
                                      GDBusMethodInvocation *invocation, const gint volume,
                                      __attribute__((unused)) gpointer user_data) {
@@ -467,7 +568,9 @@ gboolean notify_convolution_callback(ShairportSync *skeleton,
     debug(1, ">> activating convolution");
     config.convolution = 1;
     config.convolver_valid =
-        convolver_init(config.convolution_ir_file, config.convolution_max_length);
+        convolver_init(config.convolution_ir_file, config.convolution_max_length,
+                       config.convolution_block_size, config.convolution_tail_block_size,
+                     convolver_sample_rate());
   } else {
     debug(1, ">> deactivating convolution");
     config.convolution = 0;
@@ -514,7 +617,9 @@ gboolean notify_convolution_impulse_response_file_callback(ShairportSync *skelet
   debug(1, ">> setting configuration impulse response filter file to \"%s\".",
         config.convolution_ir_file);
   config.convolver_valid =
-      convolver_init(config.convolution_ir_file, config.convolution_max_length);
+      convolver_init(config.convolution_ir_file, config.convolution_max_length,
+                     config.convolution_block_size, config.convolution_tail_block_size,
+                     convolver_sample_rate());
   return TRUE;
 }
 #else
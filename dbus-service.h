@@ -9,4 +9,8 @@ int start_dbus_service();
 void stop_dbus_service();
 int dbus_service_is_running();
 
+// these may be called from any thread -- the properties are set later on the D-Bus thread
+void dbus_service_set_active(int active);
+void dbus_service_set_disable_standby(int disable_standby);
+
 #endif /* #ifndef DBUS_SERVICE_H */
@@ -0,0 +1,147 @@
+#include "dither.h"
+#include "common.h"
+#include <string.h>
+
+// Add a TPDF dither -- see
+// http://educypedia.karadimov.info/library/DitherExplained.pdf
+// and the discussion around https://www.hydrogenaud.io/forums/index.php?showtopic=16963&st=25
+// and the original paper at
+// http://www.ece.rochester.edu/courses/ECE472/resources/Papers/Lipshitz_1992.pdf
+// by Lipshitz, Wannamaker and Vanderkooy, 1992.
+
+// Each dither value is the difference between two successive uniform random numbers spanning one
+// output LSB, so it ranges from just under -1 LSB to just under +1 LSB.
+
+// When noise shaping, the error made in quantising each sample, dither included, is filtered and
+// subtracted from the next samples of the same channel. This is the three-tap "E-weighted" filter
+// of Wannamaker, "Psychoacoustically Optimal Noise Shaping", JAES 1992, which moves the noise
+// out of the range where the ear is most sensitive and up towards the Nyquist frequency.
+// The coefficients are scaled by 4096.
+static const int32_t shaping_filter[DITHER_SHAPING_ORDER] = {6648, -4022, 446};
+
+// limit the remembered error to a few LSBs so that clipping can not make the filter run away
+#define DITHER_ERROR_LIMIT (4 << 16)
+
+// from http://prng.di.unimi.it/splitmix64.c, used to make the seeds from a single number
+static uint64_t splitmix64(uint64_t *x) {
+  uint64_t z = (*x += 0x9e3779b97f4a7c15);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+void dither_init(dither_state *d, int noise_shaping) {
+  memset(d, 0, sizeof(dither_state));
+  r64_lock; // the shared random number generator is not thread safe
+  uint64_t seed = r64u();
+  r64_unlock;
+  int i, lane;
+  for (i = 0; i < 4; i++)
+    for (lane = 0; lane < DITHER_LANES; lane++)
+      d->s[i][lane] = splitmix64(&seed);
+  d->noise_shaping_requested = noise_shaping;
+}
+
+void dither_set_resolution(dither_state *d, int resolution) {
+  if (d->resolution != resolution) {
+    d->resolution = resolution;
+    d->shift = 64 - resolution;
+    d->noise_shaping = (d->noise_shaping_requested != 0) && (resolution == 16);
+    memset(d->error, 0, sizeof(d->error));
+  }
+}
+
+#define rotl(x, k) (((x) << (k)) | ((x) >> (64 - (k))))
+
+// xoshiro256+, from http://prng.di.unimi.it/xoshiro256plus.c.
+// Its weakest bits are the lowest ones, which are the ones discarded here.
+// The generators are independent, so the inner loop is over them and is easily vectorised.
+static void dither_random_block(dither_state *d, uint64_t *out, int n) {
+  uint64_t s0[DITHER_LANES], s1[DITHER_LANES], s2[DITHER_LANES], s3[DITHER_LANES];
+  int i, lane;
+  memcpy(s0, d->s[0], sizeof(s0));
+  memcpy(s1, d->s[1], sizeof(s1));
+  memcpy(s2, d->s[2], sizeof(s2));
+  memcpy(s3, d->s[3], sizeof(s3));
+  for (i = 0; i < n; i += DITHER_LANES) {
+    for (lane = 0; lane < DITHER_LANES; lane++) {
+      uint64_t t = s1[lane] << 17;
+      out[i + lane] = s0[lane] + s3[lane];
+      s2[lane] ^= s0[lane];
+      s3[lane] ^= s1[lane];
+      s1[lane] ^= s2[lane];
+      s0[lane] ^= s3[lane];
+      s2[lane] ^= t;
+      s3[lane] = rotl(s3[lane], 45);
+    }
+  }
+  memcpy(d->s[0], s0, sizeof(s0));
+  memcpy(d->s[1], s1, sizeof(s1));
+  memcpy(d->s[2], s2, sizeof(s2));
+  memcpy(d->s[3], s3, sizeof(s3));
+}
+
+static inline int64_t add_with_clipping(int64_t sample, int64_t offset) {
+  if (offset >= 0) {
+    if (INT64_MAX - offset >= sample)
+      sample += offset;
+    else
+      sample = INT64_MAX;
+  } else {
+    if (INT64_MIN - offset <= sample)
+      sample += offset;
+    else
+      sample = INT64_MIN;
+  }
+  return sample;
+}
+
+void dither_apply(dither_state *d, int64_t *samples, int n) {
+  if ((n <= 0) || (d->resolution == 0))
+    return;
+  if (n > DITHER_BLOCK_SIZE) {
+    debug(1, "dither_apply called with %d samples -- the maximum is %d.", n, DITHER_BLOCK_SIZE);
+    n = DITHER_BLOCK_SIZE;
+  }
+  uint64_t r[DITHER_BLOCK_SIZE];
+  dither_random_block(d, r, (n + DITHER_LANES - 1) & ~(DITHER_LANES - 1));
+
+  // the top bits of each random number give a uniform number spanning one output LSB
+  const int u_shift = d->resolution;
+  int64_t previous = d->previous >> u_shift;
+  int i;
+  if (d->noise_shaping == 0) {
+    for (i = 0; i < n; i++) {
+      int64_t u = r[i] >> u_shift;
+      samples[i] = add_with_clipping(samples[i], u - previous);
+      previous = u;
+    }
+  } else {
+    const int e_shift = d->shift - 16; // from the int64_t to 1/65536 of an LSB
+    int channel = d->channel;
+    for (i = 0; i < n; i++) {
+      int32_t *e = d->error[channel];
+      int64_t feedback = (int64_t)shaping_filter[0] * e[0] + (int64_t)shaping_filter[1] * e[1] +
+                         (int64_t)shaping_filter[2] * e[2];
+      feedback = (feedback >> 12) * ((int64_t)1 << e_shift);
+      int64_t v = add_with_clipping(samples[i], -feedback);
+      int64_t u = r[i] >> u_shift;
+      int64_t y = add_with_clipping(v, u - previous);
+      previous = u;
+      // this is what will be left when y is shifted down to the output resolution
+      int64_t q = (int64_t)((uint64_t)(y >> d->shift) << d->shift);
+      int64_t error = (q - v) >> e_shift;
+      if (error > DITHER_ERROR_LIMIT)
+        error = DITHER_ERROR_LIMIT;
+      else if (error < -DITHER_ERROR_LIMIT)
+        error = -DITHER_ERROR_LIMIT;
+      e[2] = e[1];
+      e[1] = e[0];
+      e[0] = (int32_t)error;
+      samples[i] = y;
+      channel ^= 1;
+    }
+  }
+  d->channel = (d->channel + n) & 1;
+  d->previous = r[n - 1];
+}
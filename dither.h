@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+// A TPDF dither generator, with optional noise shaping for 16-bit output.
+// Each stream has its own state, so no lock is needed to use it.
+// Random numbers come from four xoshiro256+ generators run side by side, so that a block of them
+// can be made with vector instructions, and everything that depends on the output resolution is
+// worked out once, when the resolution is set, rather than for every sample.
+
+#define DITHER_BLOCK_SIZE 256 // the largest number of samples dither_apply will take at a time
+#define DITHER_LANES 4
+#define DITHER_SHAPING_ORDER 3
+
+typedef struct {
+  uint64_t s[4][DITHER_LANES]; // the generator state, one column per generator
+  uint64_t previous;           // the last random number used, for the TPDF
+  int noise_shaping_requested;
+  int resolution;    // bits in an output sample, or 0 if not yet set
+  int shift;         // 64 - resolution
+  int noise_shaping; // 1 if noise shaping is requested and possible at this resolution
+  int channel;       // which channel the next sample is for
+  int32_t error[2][DITHER_SHAPING_ORDER]; // recent errors of each channel, in 1/65536 of an LSB
+} dither_state;
+
+// seeds the generators and clears the state -- noise shaping is only done on 16-bit output
+void dither_init(dither_state *d, int noise_shaping);
+
+// to be called whenever the output resolution may have changed; cheap if it hasn't
+void dither_set_resolution(dither_state *d, int resolution);
+
+// Add dither to n <= DITHER_BLOCK_SIZE samples of interleaved stereo, aligned to the top of
+// each int64_t, ready to be shifted down to the output resolution. Clips rather than wraps.
+void dither_apply(dither_state *d, int64_t *samples, int n);
@@ -0,0 +1,349 @@
+#include "eq.h"
+#include "common.h"
+#include <math.h>
+#include <string.h>
+
+eq_processor parametric_eq = EQ_PROCESSOR_INITIALIZER;
+
+int eq_band_type_from_string(const char *str, eq_band_type *type) {
+  int response = 1;
+  if (strcasecmp(str, "peaking") == 0)
+    *type = EQ_peaking;
+  else if (strcasecmp(str, "low_shelf") == 0)
+    *type = EQ_low_shelf;
+  else if (strcasecmp(str, "high_shelf") == 0)
+    *type = EQ_high_shelf;
+  else if (strcasecmp(str, "low_pass") == 0)
+    *type = EQ_low_pass;
+  else if (strcasecmp(str, "high_pass") == 0)
+    *type = EQ_high_pass;
+  else
+    response = 0;
+  return response;
+}
+
+static int32_t eq_fixed_coefficient(double c) {
+  double f = round(c * (1 << EQ_FIXED_COEFFICIENT_BITS));
+  if (f > INT32_MAX)
+    return INT32_MAX;
+  if (f < INT32_MIN)
+    return INT32_MIN;
+  return (int32_t)f;
+}
+
+// Formulas from http://www.earlevel.com/main/2011/01/02/biquad-formulas/
+// Here a0, a1 and a2 are the feed-forward coefficients and b1 and b2 the feedback ones.
+static void eq_compute_target(eq_processor *p, int band) {
+  eq_band *s = &p->bands[band];
+  double a0 = 1.0, a1 = 0.0, a2 = 0.0, b1 = 0.0, b2 = 0.0;
+  double Fs = p->sample_rate ? p->sample_rate : 44100.0;
+  double Fc = s->frequency;
+  if (Fc > Fs * 0.49)
+    Fc = Fs * 0.49;
+  double Q = s->q > 0.0 ? s->q : M_SQRT1_2;
+  double K = tan(M_PI * Fc / Fs);
+  double V = pow(10.0, fabs(s->gain) / 20.0);
+  double norm;
+
+  if (Fc <= 0.0) {
+    // leave it as a pass-through
+  } else if (s->type == EQ_peaking) {
+    if (s->gain > 0.0) {
+      norm = 1 / (1 + 1 / Q * K + K * K);
+      a0 = (1 + V / Q * K + K * K) * norm;
+      a1 = 2 * (K * K - 1) * norm;
+      a2 = (1 - V / Q * K + K * K) * norm;
+      b1 = a1;
+      b2 = (1 - 1 / Q * K + K * K) * norm;
+    } else if (s->gain < 0.0) {
+      norm = 1 / (1 + V / Q * K + K * K);
+      a0 = (1 + 1 / Q * K + K * K) * norm;
+      a1 = 2 * (K * K - 1) * norm;
+      a2 = (1 - 1 / Q * K + K * K) * norm;
+      b1 = a1;
+      b2 = (1 - V / Q * K + K * K) * norm;
+    }
+  } else if (s->type == EQ_low_shelf) {
+    if (s->gain > 0.0) {
+      norm = 1 / (1 + M_SQRT2 * K + K * K);
+      a0 = (1 + sqrt(2 * V) * K + V * K * K) * norm;
+      a1 = 2 * (V * K * K - 1) * norm;
+      a2 = (1 - sqrt(2 * V) * K + V * K * K) * norm;
+      b1 = 2 * (K * K - 1) * norm;
+      b2 = (1 - M_SQRT2 * K + K * K) * norm;
+    } else if (s->gain < 0.0) {
+      norm = 1 / (1 + sqrt(2 * V) * K + V * K * K);
+      a0 = (1 + M_SQRT2 * K + K * K) * norm;
+      a1 = 2 * (K * K - 1) * norm;
+      a2 = (1 - M_SQRT2 * K + K * K) * norm;
+      b1 = 2 * (V * K * K - 1) * norm;
+      b2 = (1 - sqrt(2 * V) * K + V * K * K) * norm;
+    }
+  } else if (s->type == EQ_high_shelf) {
+    if (s->gain > 0.0) {
+      norm = 1 / (1 + M_SQRT2 * K + K * K);
+      a0 = (V + sqrt(2 * V) * K + K * K) * norm;
+      a1 = 2 * (K * K - V) * norm;
+      a2 = (V - sqrt(2 * V) * K + K * K) * norm;
+      b1 = 2 * (K * K - 1) * norm;
+      b2 = (1 - M_SQRT2 * K + K * K) * norm;
+    } else if (s->gain < 0.0) {
+      norm = 1 / (V + sqrt(2 * V) * K + K * K);
+      a0 = (1 + M_SQRT2 * K + K * K) * norm;
+      a1 = 2 * (K * K - 1) * norm;
+      a2 = (1 - M_SQRT2 * K + K * K) * norm;
+      b1 = 2 * (K * K - V) * norm;
+      b2 = (V - sqrt(2 * V) * K + K * K) * norm;
+    }
+  } else if (s->type == EQ_low_pass) {
+    norm = 1 / (1 + K / Q + K * K);
+    a0 = K * K * norm;
+    a1 = 2 * a0;
+    a2 = a0;
+    b1 = 2 * (K * K - 1) * norm;
+    b2 = (1 - K / Q + K * K) * norm;
+  } else if (s->type == EQ_high_pass) {
+    norm = 1 / (1 + K / Q + K * K);
+    a0 = 1 * norm;
+    a1 = -2 * a0;
+    a2 = a0;
+    b1 = 2 * (K * K - 1) * norm;
+    b2 = (1 - K / Q + K * K) * norm;
+  }
+
+  p->target_a0[band] = a0;
+  p->target_a1[band] = a1;
+  p->target_a2[band] = a2;
+  p->target_b1[band] = b1;
+  p->target_b2[band] = b2;
+  p->target_fixed[band][0] = eq_fixed_coefficient(a0);
+  p->target_fixed[band][1] = eq_fixed_coefficient(a1);
+  p->target_fixed[band][2] = eq_fixed_coefficient(a2);
+  p->target_fixed[band][3] = eq_fixed_coefficient(b1);
+  p->target_fixed[band][4] = eq_fixed_coefficient(b2);
+}
+
+void eq_set_band(eq_processor *p, int band, eq_band settings) {
+  if ((band < 0) || (band >= EQ_MAXIMUM_BANDS)) {
+    warn("eq band %d is out of range -- a maximum of %d bands is allowed.", band,
+         EQ_MAXIMUM_BANDS);
+    return;
+  }
+  pthread_mutex_lock(&p->lock);
+  int i;
+  for (i = p->band_count; i < band; i++) { // any bands skipped over just pass the signal through
+    memset(&p->bands[i], 0, sizeof(eq_band));
+    eq_compute_target(p, i);
+  }
+  if (band >= p->band_count)
+    p->band_count = band + 1;
+  p->bands[band] = settings;
+  eq_compute_target(p, band);
+  p->targets_changed = 1;
+  pthread_mutex_unlock(&p->lock);
+}
+
+void eq_set_sample_rate(eq_processor *p, int sample_rate) {
+  pthread_mutex_lock(&p->lock);
+  if (p->sample_rate != sample_rate) {
+    p->sample_rate = sample_rate;
+    int i;
+    for (i = 0; i < p->band_count; i++)
+      eq_compute_target(p, i);
+    p->targets_changed = 1;
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+void eq_reset(eq_processor *p) {
+  memset(p->i1, 0, sizeof(p->i1));
+  memset(p->i2, 0, sizeof(p->i2));
+  memset(p->o1, 0, sizeof(p->o1));
+  memset(p->o2, 0, sizeof(p->o2));
+  memset(p->fixed_i1, 0, sizeof(p->fixed_i1));
+  memset(p->fixed_i2, 0, sizeof(p->fixed_i2));
+  memset(p->fixed_o1, 0, sizeof(p->fixed_o1));
+  memset(p->fixed_o2, 0, sizeof(p->fixed_o2));
+  memset(p->fixed_error, 0, sizeof(p->fixed_error));
+}
+
+// Pick up new settings, if any, without ever waiting for the lock.
+// New bands start as pass-throughs and are ramped in like any other change.
+static void eq_fetch_targets(eq_processor *p) {
+  if (pthread_mutex_trylock(&p->lock) == 0) {
+    if (p->targets_changed) {
+      int i;
+      for (i = p->active_band_count; i < p->band_count; i++) {
+        p->a0[i] = 1.0;
+        p->a1[i] = p->a2[i] = p->b1[i] = p->b2[i] = 0.0;
+        memset(p->fixed[i], 0, sizeof(p->fixed[i]));
+        p->fixed[i][0] = 1 << EQ_FIXED_COEFFICIENT_BITS;
+      }
+      p->active_band_count = p->band_count;
+      memcpy(p->ramp_a0, p->target_a0, sizeof(p->ramp_a0));
+      memcpy(p->ramp_a1, p->target_a1, sizeof(p->ramp_a1));
+      memcpy(p->ramp_a2, p->target_a2, sizeof(p->ramp_a2));
+      memcpy(p->ramp_b1, p->target_b1, sizeof(p->ramp_b1));
+      memcpy(p->ramp_b2, p->target_b2, sizeof(p->ramp_b2));
+      memcpy(p->ramp_fixed, p->target_fixed, sizeof(p->ramp_fixed));
+      p->ramping = 1;
+      p->targets_changed = 0;
+    }
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+// The recursion of a biquad is serial in time, so each band runs over the whole block in turn,
+// with both channels in the same loop and the coefficients and filter memory in registers.
+void eq_process(eq_processor *p, float *left, float *right, int frames) {
+  eq_fetch_targets(p);
+  if (frames <= 0)
+    return;
+  int band;
+  for (band = 0; band < p->active_band_count; band++) {
+    float a0 = p->a0[band], a1 = p->a1[band], a2 = p->a2[band], b1 = p->b1[band],
+          b2 = p->b2[band];
+    float li1 = p->i1[0][band], li2 = p->i2[0][band], lo1 = p->o1[0][band], lo2 = p->o2[0][band];
+    float ri1 = p->i1[1][band], ri2 = p->i2[1][band], ro1 = p->o1[1][band], ro2 = p->o2[1][band];
+    int i;
+    if (p->ramping) {
+      float step = 1.0f / frames;
+      float da0 = (p->ramp_a0[band] - a0) * step, da1 = (p->ramp_a1[band] - a1) * step,
+            da2 = (p->ramp_a2[band] - a2) * step, db1 = (p->ramp_b1[band] - b1) * step,
+            db2 = (p->ramp_b2[band] - b2) * step;
+      for (i = 0; i < frames; i++) {
+        a0 += da0;
+        a1 += da1;
+        a2 += da2;
+        b1 += db1;
+        b2 += db2;
+        float l = left[i], r = right[i];
+        float lo = a0 * l + a1 * li1 + a2 * li2 - b1 * lo1 - b2 * lo2;
+        float ro = a0 * r + a1 * ri1 + a2 * ri2 - b1 * ro1 - b2 * ro2;
+        li2 = li1;
+        li1 = l;
+        lo2 = lo1;
+        lo1 = lo;
+        ri2 = ri1;
+        ri1 = r;
+        ro2 = ro1;
+        ro1 = ro;
+        left[i] = lo;
+        right[i] = ro;
+      }
+      p->a0[band] = p->ramp_a0[band];
+      p->a1[band] = p->ramp_a1[band];
+      p->a2[band] = p->ramp_a2[band];
+      p->b1[band] = p->ramp_b1[band];
+      p->b2[band] = p->ramp_b2[band];
+    } else {
+      for (i = 0; i < frames; i++) {
+        float l = left[i], r = right[i];
+        float lo = a0 * l + a1 * li1 + a2 * li2 - b1 * lo1 - b2 * lo2;
+        float ro = a0 * r + a1 * ri1 + a2 * ri2 - b1 * ro1 - b2 * ro2;
+        li2 = li1;
+        li1 = l;
+        lo2 = lo1;
+        lo1 = lo;
+        ri2 = ri1;
+        ri1 = r;
+        ro2 = ro1;
+        ro1 = ro;
+        left[i] = lo;
+        right[i] = ro;
+      }
+    }
+    p->i1[0][band] = li1;
+    p->i2[0][band] = li2;
+    p->o1[0][band] = lo1;
+    p->o2[0][band] = lo2;
+    p->i1[1][band] = ri1;
+    p->i2[1][band] = ri2;
+    p->o1[1][band] = ro1;
+    p->o2[1][band] = ro2;
+  }
+  p->ramping = 0;
+}
+
+static inline int32_t eq_saturate(int64_t v) {
+  if (v > INT32_MAX)
+    return INT32_MAX;
+  if (v < INT32_MIN)
+    return INT32_MIN;
+  return (int32_t)v;
+}
+
+// One sample of a band in fixed point. The accumulator is 64 bits wide, and what's rounded off
+// each output is added back into the next -- without that, the error of the recursion builds
+// up badly in a filter with its poles close to the unit circle, like the loudness filter's.
+#define EQ_FIXED_STEP(x, i1, i2, o1, o2, error)                                                   \
+  do {                                                                                             \
+    int64_t acc = (int64_t)a0 * (x) + (int64_t)a1 * (i1) + (int64_t)a2 * (i2) -                    \
+                  (int64_t)b1 * (o1) - (int64_t)b2 * (o2) + (error);                               \
+    int64_t out = acc >> EQ_FIXED_COEFFICIENT_BITS;                                                \
+    (error) = acc - (out << EQ_FIXED_COEFFICIENT_BITS);                                            \
+    (i2) = (i1);                                                                                   \
+    (i1) = (x);                                                                                    \
+    (o2) = (o1);                                                                                   \
+    (o1) = eq_saturate(out);                                                                       \
+    (x) = (o1);                                                                                    \
+  } while (0)
+
+// As eq_process, but in fixed point -- see eq.h for the sample format.
+void eq_process_fixed(eq_processor *p, int32_t *left, int32_t *right, int frames) {
+  eq_fetch_targets(p);
+  if (frames <= 0)
+    return;
+  int band;
+  for (band = 0; band < p->active_band_count; band++) {
+    int32_t a0 = p->fixed[band][0], a1 = p->fixed[band][1], a2 = p->fixed[band][2],
+            b1 = p->fixed[band][3], b2 = p->fixed[band][4];
+    int32_t li1 = p->fixed_i1[0][band], li2 = p->fixed_i2[0][band], lo1 = p->fixed_o1[0][band],
+            lo2 = p->fixed_o2[0][band];
+    int32_t ri1 = p->fixed_i1[1][band], ri2 = p->fixed_i2[1][band], ro1 = p->fixed_o1[1][band],
+            ro2 = p->fixed_o2[1][band];
+    int64_t le = p->fixed_error[0][band], re = p->fixed_error[1][band];
+    int i;
+    if (p->ramping) {
+      // step the coefficients across the block, landing exactly on the new ones at the end
+      int32_t *target = p->ramp_fixed[band];
+      int32_t da0 = ((int64_t)target[0] - a0) / frames, da1 = ((int64_t)target[1] - a1) / frames,
+              da2 = ((int64_t)target[2] - a2) / frames, db1 = ((int64_t)target[3] - b1) / frames,
+              db2 = ((int64_t)target[4] - b2) / frames;
+      for (i = 0; i < frames; i++) {
+        if (i == frames - 1) {
+          a0 = target[0];
+          a1 = target[1];
+          a2 = target[2];
+          b1 = target[3];
+          b2 = target[4];
+        } else {
+          a0 += da0;
+          a1 += da1;
+          a2 += da2;
+          b1 += db1;
+          b2 += db2;
+        }
+        EQ_FIXED_STEP(left[i], li1, li2, lo1, lo2, le);
+        EQ_FIXED_STEP(right[i], ri1, ri2, ro1, ro2, re);
+      }
+      memcpy(p->fixed[band], target, sizeof(p->fixed[band]));
+    } else {
+      for (i = 0; i < frames; i++) {
+        EQ_FIXED_STEP(left[i], li1, li2, lo1, lo2, le);
+        EQ_FIXED_STEP(right[i], ri1, ri2, ro1, ro2, re);
+      }
+    }
+    p->fixed_i1[0][band] = li1;
+    p->fixed_i2[0][band] = li2;
+    p->fixed_o1[0][band] = lo1;
+    p->fixed_o2[0][band] = lo2;
+    p->fixed_i1[1][band] = ri1;
+    p->fixed_i2[1][band] = ri2;
+    p->fixed_o1[1][band] = ro1;
+    p->fixed_o2[1][band] = ro2;
+    p->fixed_error[0][band] = le;
+    p->fixed_error[1][band] = re;
+  }
+  p->ramping = 0;
+}
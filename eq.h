@@ -0,0 +1,70 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+// A cascade of biquad filters applied to both channels of the float DSP path.
+// Settings may be changed from any thread; the processing thread picks them up at the start of
+// the next block and moves the coefficients across that block so that there is no click.
+//
+// The same filters can be run in fixed point, for processors without floating point hardware,
+// on int32_t samples with EQ_FIXED_HEADROOM_BITS of headroom above full scale, which allows for
+// the largest boost a band can have. The coefficients are then fixed point numbers with
+// EQ_FIXED_COEFFICIENT_BITS fractional bits, which leaves room for the largest coefficient.
+
+#define EQ_MAXIMUM_BANDS 16
+#define EQ_FIXED_HEADROOM_BITS 4     // 24 dB
+#define EQ_FIXED_COEFFICIENT_BITS 26 // coefficients from -32 to +32
+
+typedef enum {
+  EQ_peaking = 0,
+  EQ_low_shelf,
+  EQ_high_shelf,
+  EQ_low_pass,
+  EQ_high_pass,
+} eq_band_type;
+
+typedef struct {
+  eq_band_type type;
+  double frequency; // Hz
+  double q;         // ignored by the shelves, which are fixed at a Butterworth slope
+  double gain;      // dB, ignored by the low and high pass filters
+} eq_band;
+
+typedef struct {
+  pthread_mutex_t lock; // protects the settings and the target coefficients
+  int band_count;
+  int sample_rate;
+  eq_band bands[EQ_MAXIMUM_BANDS];
+  int targets_changed;
+  float target_a0[EQ_MAXIMUM_BANDS], target_a1[EQ_MAXIMUM_BANDS], target_a2[EQ_MAXIMUM_BANDS];
+  float target_b1[EQ_MAXIMUM_BANDS], target_b2[EQ_MAXIMUM_BANDS];
+  int32_t target_fixed[EQ_MAXIMUM_BANDS][5]; // a0, a1, a2, b1 and b2 in fixed point
+
+  // only used by the processing thread
+  int active_band_count;
+  int ramping;
+  float a0[EQ_MAXIMUM_BANDS], a1[EQ_MAXIMUM_BANDS], a2[EQ_MAXIMUM_BANDS];
+  float b1[EQ_MAXIMUM_BANDS], b2[EQ_MAXIMUM_BANDS];
+  float ramp_a0[EQ_MAXIMUM_BANDS], ramp_a1[EQ_MAXIMUM_BANDS], ramp_a2[EQ_MAXIMUM_BANDS];
+  float ramp_b1[EQ_MAXIMUM_BANDS], ramp_b2[EQ_MAXIMUM_BANDS];
+  float i1[2][EQ_MAXIMUM_BANDS], i2[2][EQ_MAXIMUM_BANDS];
+  float o1[2][EQ_MAXIMUM_BANDS], o2[2][EQ_MAXIMUM_BANDS];
+  int32_t fixed[EQ_MAXIMUM_BANDS][5], ramp_fixed[EQ_MAXIMUM_BANDS][5];
+  int32_t fixed_i1[2][EQ_MAXIMUM_BANDS], fixed_i2[2][EQ_MAXIMUM_BANDS];
+  int32_t fixed_o1[2][EQ_MAXIMUM_BANDS], fixed_o2[2][EQ_MAXIMUM_BANDS];
+  int64_t fixed_error[2][EQ_MAXIMUM_BANDS]; // what was rounded off the last output
+} eq_processor;
+
+#define EQ_PROCESSOR_INITIALIZER                                                                   \
+  { .lock = PTHREAD_MUTEX_INITIALIZER }
+
+// the parametric equaliser set up in the dsp section of the configuration file
+extern eq_processor parametric_eq;
+
+int eq_band_type_from_string(const char *str, eq_band_type *type); // 0 if str is not recognised
+void eq_set_band(eq_processor *p, int band, eq_band settings);
+void eq_set_sample_rate(eq_processor *p, int sample_rate);
+void eq_reset(eq_processor *p); // clear the filter memory -- only when not processing
+void eq_process(eq_processor *p, float *left, float *right, int frames);
+void eq_process_fixed(eq_processor *p, int32_t *left, int32_t *right, int frames);
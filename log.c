@@ -0,0 +1,220 @@
+#include "log.h"
+#include "common.h"
+#include "realtime.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+// A single-producer single-consumer ring of messages.
+// The owning thread is the only one to move the head and the writer, or whoever else is
+// draining the rings with the log_drain_lock held, is the only one to move the tail.
+typedef struct log_ring {
+  struct log_ring *next;
+  uint32_t head;
+  uint32_t tail;
+  uint32_t dropped;          // set by the owning thread only
+  uint32_t dropped_reported; // set by the drainer only
+  int orphaned;              // set when the owning thread has exited
+  log_record records[LOG_RING_SIZE];
+} log_ring;
+
+static pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER; // for the list of rings
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER; // held while draining
+static log_ring *log_rings;
+static pthread_key_t log_ring_key;
+static pthread_once_t log_ring_key_once = PTHREAD_ONCE_INIT;
+static void (*log_emit)(const log_record *record);
+static int log_async_running;
+static pthread_t log_writer_thread;
+
+// The writer blocks on log_writer_cv when every ring is empty, having set log_writer_waiting
+// first. A thread that puts a message into an empty ring wakes it if it's waiting.
+static pthread_mutex_t log_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_writer_cv = PTHREAD_COND_INITIALIZER;
+static int log_writer_waiting;
+
+// called when a thread exits -- its messages may not have been written yet, so the writer frees
+// the ring when it's empty
+static void log_ring_orphan(void *arg) {
+  log_ring *ring = (log_ring *)arg;
+  __atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static void log_make_ring_key() { pthread_key_create(&log_ring_key, log_ring_orphan); }
+
+static log_ring *log_get_ring() {
+  log_ring *ring = pthread_getspecific(log_ring_key);
+  if (ring == NULL) {
+    // only done once by each thread that logs anything
+    ring = calloc(1, sizeof(log_ring));
+    if (ring != NULL) {
+      pthread_mutex_lock(&log_rings_lock);
+      ring->next = log_rings;
+      log_rings = ring;
+      pthread_mutex_unlock(&log_rings_lock);
+      pthread_setspecific(log_ring_key, ring);
+    }
+  }
+  return ring;
+}
+
+int log_async_submit(int prio, const char *filename, int linenumber, int show_preliminaries,
+                     const char *prefix, const char *format, va_list args) {
+  if (__atomic_load_n(&log_async_running, __ATOMIC_ACQUIRE) == 0)
+    return -1;
+  log_ring *ring = log_get_ring();
+  if (ring == NULL)
+    return -1;
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head - tail >= LOG_RING_SIZE) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+  } else {
+    log_record *record = &ring->records[head % LOG_RING_SIZE];
+    record->time = get_absolute_time_in_ns();
+    record->filename = filename;
+    record->prefix = prefix;
+    record->linenumber = linenumber;
+    record->prio = prio;
+    record->show_preliminaries = show_preliminaries;
+    vsnprintf(record->text, sizeof(record->text), format, args);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    // if the ring was not empty, the writer can't be waiting until it has emptied it, so it
+    // will find this message without being woken
+    if (head == tail) {
+      // pairs with the fence in log_writer_wait -- either the writer sees the new head when it
+      // looks again or this sees that it is waiting
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&log_writer_waiting, __ATOMIC_RELAXED) != 0) {
+        pthread_mutex_lock(&log_writer_lock);
+        pthread_cond_signal(&log_writer_cv);
+        pthread_mutex_unlock(&log_writer_lock);
+      }
+    }
+  }
+  return 0;
+}
+
+// must be called with the log_drain_lock held -- returns the number of messages written
+static int log_drain() {
+  int written = 0;
+  int oldState;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+  log_ring *ring;
+  for (;;) {
+    // the oldest message waiting in any ring goes out next
+    log_ring *oldest = NULL;
+    uint64_t oldest_time = 0;
+    pthread_mutex_lock(&log_rings_lock);
+    for (ring = log_rings; ring != NULL; ring = ring->next) {
+      uint32_t tail = ring->tail;
+      if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != tail) {
+        uint64_t t = ring->records[tail % LOG_RING_SIZE].time;
+        if ((oldest == NULL) || (t < oldest_time)) {
+          oldest = ring;
+          oldest_time = t;
+        }
+      }
+    }
+    pthread_mutex_unlock(&log_rings_lock);
+    if (oldest == NULL)
+      break;
+    // rings are only freed here, so it's safe to use it without the lock
+    log_emit(&oldest->records[oldest->tail % LOG_RING_SIZE]);
+    __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+    written++;
+  }
+
+  // count the messages lost and free the rings of threads that have gone
+  uint32_t lost = 0;
+  pthread_mutex_lock(&log_rings_lock);
+  log_ring **link = &log_rings;
+  while ((ring = *link) != NULL) {
+    uint32_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    lost += dropped - ring->dropped_reported;
+    ring->dropped_reported = dropped;
+    if ((__atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE) != 0) &&
+        (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail)) {
+      *link = ring->next;
+      free(ring);
+    } else {
+      link = &ring->next;
+    }
+  }
+  pthread_mutex_unlock(&log_rings_lock);
+  if (lost != 0) {
+    log_record record;
+    record.time = get_absolute_time_in_ns();
+    record.filename = __FILE__;
+    record.prefix = debuglev ? " *warning: " : "warning: ";
+    record.linenumber = __LINE__;
+    record.prio = LOG_WARNING;
+    record.show_preliminaries = (debuglev != 0);
+    snprintf(record.text, sizeof(record.text),
+             "%u log messages were lost because they came too quickly to be written.", lost);
+    log_emit(&record);
+  }
+  pthread_setcancelstate(oldState, NULL);
+  return written;
+}
+
+void log_async_flush() {
+  if (__atomic_load_n(&log_async_running, __ATOMIC_ACQUIRE) != 0) {
+    pthread_mutex_lock(&log_drain_lock);
+    log_drain();
+    pthread_mutex_unlock(&log_drain_lock);
+  }
+}
+
+static int log_rings_empty() {
+  int response = 1;
+  pthread_mutex_lock(&log_rings_lock);
+  log_ring *ring;
+  for (ring = log_rings; (ring != NULL) && (response != 0); ring = ring->next)
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail)
+      response = 0;
+  pthread_mutex_unlock(&log_rings_lock);
+  return response;
+}
+
+static void log_writer_wait_cleanup(__attribute__((unused)) void *arg) {
+  __atomic_store_n(&log_writer_waiting, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&log_writer_lock);
+}
+
+// block until a message arrives in an empty ring
+static void log_writer_wait() {
+  pthread_mutex_lock(&log_writer_lock);
+  pthread_cleanup_push(log_writer_wait_cleanup, NULL);
+  __atomic_store_n(&log_writer_waiting, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  while (log_rings_empty() != 0)
+    pthread_cond_wait(&log_writer_cv, &log_writer_lock); // a cancellation point
+  pthread_cleanup_pop(1);
+}
+
+static void *log_writer_thread_code(__attribute__((unused)) void *arg) {
+  thread_set_name("log-writer");
+  for (;;) {
+    pthread_mutex_lock(&log_drain_lock);
+    log_drain();
+    pthread_mutex_unlock(&log_drain_lock);
+    log_writer_wait();
+  }
+  pthread_exit(NULL);
+}
+
+void log_async_start(void (*emit)(const log_record *record)) {
+  if (__atomic_load_n(&log_async_running, __ATOMIC_ACQUIRE) == 0) {
+    pthread_once(&log_ring_key_once, log_make_ring_key);
+    log_emit = emit;
+    if (pthread_create(&log_writer_thread, NULL, &log_writer_thread_code, NULL) == 0) {
+      __atomic_store_n(&log_async_running, 1, __ATOMIC_RELEASE);
+      atexit(log_async_flush); // write out whatever is left when the program exits
+    } else {
+      warn("could not start the log writer thread -- messages will be logged directly.");
+    }
+  }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdarg.h>
+#include <stdint.h>
+
+// An asynchronous writer for the log.
+// Each thread queues its messages in a ring of its own, without taking a lock or making a system
+// call, and a background thread takes them out in time order and writes them to the log.
+// Only the message itself is formatted by the thread that logs it; the time, the file and line
+// and the prefix are put in front of it by the writer.
+// If a thread's ring is full, its messages are dropped and the number lost is logged later.
+
+#define LOG_RECORD_TEXT_SIZE 512 // longer messages are cut short
+#define LOG_RING_SIZE 128       // messages that can be waiting from each thread
+
+typedef struct {
+  uint64_t time;        // when the message was logged
+  const char *filename; // must remain valid, e.g. __FILE__
+  const char *prefix;   // likewise, e.g. a string literal
+  int linenumber;
+  int prio;
+  int show_preliminaries; // put the time, file and line in front of the message, as configured
+  char text[LOG_RECORD_TEXT_SIZE];
+} log_record;
+
+// start the writer thread, which will pass every message queued to emit, one at a time
+void log_async_start(void (*emit)(const log_record *record));
+
+// queue a message -- returns 0 if it has been queued (or dropped), or -1 if it must be written
+// straight away because the writer isn't running
+int log_async_submit(int prio, const char *filename, int linenumber, int show_preliminaries,
+                     const char *prefix, const char *format, va_list args);
+
+// write out everything queued, from the calling thread -- e.g. before a fatal error or at exit
+void log_async_flush(void);
@@ -1,14 +1,9 @@
 #pragma once
 
-#include <stdio.h>
+#include "eq.h"
 
-typedef struct {
-  float a0, a1, a2, b1, b2;
-  float i1, i2, o1, o2;
-} loudness_processor;
-
-extern loudness_processor loudness_r;
-extern loudness_processor loudness_l;
+// The loudness filter is a one-band preset of the equaliser: a boost at 10 Hz that grows as the
+// volume drops below the reference volume.
+extern eq_processor loudness_eq;
 
 void loudness_set_volume(float volume);
-float loudness_process(loudness_processor *p, float sample);
@@ -32,10 +32,10 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -43,21 +43,10 @@
 #include "config.h"
 
 #include "common.h"
+#include "cover_art_cache.h"
 #include "dacp.h"
 #include "metadata_hub.h"
-
-#ifdef CONFIG_MBEDTLS
-#include <mbedtls/md5.h>
-#include <mbedtls/version.h>
-#endif
-
-#ifdef CONFIG_POLARSSL
-#include <polarssl/md5.h>
-#endif
-
-#ifdef CONFIG_OPENSSL
-#include <openssl/md5.h>
-#endif
+#include "realtime.h"
 
 struct metadata_bundle metadata_store;
 
@@ -72,54 +61,182 @@ int string_update(char **str, int *flag, char *s) {
     return string_update_with_size(str, flag, NULL, 0);
 }
 
+// the flags string_update and its relatives set, and the changes they stand for
+static const struct {
+  size_t offset;
+  uint64_t change;
+} change_flags[] = {
+    {offsetof(metadata_bundle, client_ip_changed), MHC_client_ip},
+    {offsetof(metadata_bundle, server_ip_changed), MHC_server_ip},
+    {offsetof(metadata_bundle, progress_string_changed), MHC_progress_string},
+    {offsetof(metadata_bundle, receive_statistics_changed), MHC_receive_statistics},
+    {offsetof(metadata_bundle, stage_timings_changed), MHC_stage_timings},
+    {offsetof(metadata_bundle, cover_art_pathname_changed), MHC_cover_art_pathname},
+    {offsetof(metadata_bundle, item_id_changed), MHC_item_id},
+    {offsetof(metadata_bundle, item_composite_id_changed), MHC_item_composite_id},
+    {offsetof(metadata_bundle, track_name_changed), MHC_track_name},
+    {offsetof(metadata_bundle, artist_name_changed), MHC_artist_name},
+    {offsetof(metadata_bundle, album_artist_name_changed), MHC_album_artist_name},
+    {offsetof(metadata_bundle, album_name_changed), MHC_album_name},
+    {offsetof(metadata_bundle, genre_changed), MHC_genre},
+    {offsetof(metadata_bundle, comment_changed), MHC_comment},
+    {offsetof(metadata_bundle, composer_changed), MHC_composer},
+    {offsetof(metadata_bundle, file_kind_changed), MHC_file_kind},
+    {offsetof(metadata_bundle, song_description_changed), MHC_song_description},
+    {offsetof(metadata_bundle, song_album_artist_changed), MHC_song_album_artist},
+    {offsetof(metadata_bundle, sort_name_changed), MHC_sort_name},
+    {offsetof(metadata_bundle, sort_artist_changed), MHC_sort_artist},
+    {offsetof(metadata_bundle, sort_album_changed), MHC_sort_album},
+    {offsetof(metadata_bundle, sort_composer_changed), MHC_sort_composer},
+    {offsetof(metadata_bundle, songtime_in_milliseconds_changed), MHC_songtime_in_milliseconds},
+};
+
+// Watchers are run by a thread of their own, a short while after the first change to be
+// notified, with everything that has changed in the meantime.
+#define metadata_hub_notification_window_us 50000
+
+// these are protected by the hub's write lock
+static uint64_t pending_changes = 0;
+// 0 until the watchers have been run for the first time or when a watcher has been added, in
+// which case they are told that everything has changed
+static int watchers_notified = 0;
+static struct {
+  int dacp_server_active;
+  int advanced_dacp_server_active;
+  play_status_type play_status;
+  shuffle_status_type shuffle_status;
+  repeat_status_type repeat_status;
+  play_status_type player_state;
+  active_state_type active_state;
+  int speaker_volume;
+  double airplay_volume;
+} notified; // the settings the watchers were last told of
+
+static pthread_mutex_t notification_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notification_requested = PTHREAD_COND_INITIALIZER;
+static int notification_pending = 0;
+static pthread_t notification_thread;
+static int notification_thread_running = 0;
+
+// to be called with the hub's write lock held -- move the flags into the pending changes
+static void gather_changes(void) {
+  size_t i;
+  for (i = 0; i < sizeof(change_flags) / sizeof(change_flags[0]); i++) {
+    int *flag = (int *)((char *)&metadata_store + change_flags[i].offset);
+    if (*flag) {
+      pending_changes |= change_flags[i].change;
+      *flag = 0;
+    }
+  }
+}
+
+// to be called with the hub's write lock held
+void run_metadata_watchers(void) {
+  gather_changes();
+  uint64_t changes = pending_changes;
+  pending_changes = 0;
+  if (watchers_notified == 0)
+    changes = ~0ULL;
+  if ((watchers_notified == 0) || (notified.dacp_server_active != metadata_store.dacp_server_active))
+    changes |= MHC_dacp_server_active;
+  if ((watchers_notified == 0) ||
+      (notified.advanced_dacp_server_active != metadata_store.advanced_dacp_server_active))
+    changes |= MHC_advanced_dacp_server_active;
+  if ((watchers_notified == 0) || (notified.play_status != metadata_store.play_status))
+    changes |= MHC_play_status;
+  if ((watchers_notified == 0) || (notified.shuffle_status != metadata_store.shuffle_status))
+    changes |= MHC_shuffle_status;
+  if ((watchers_notified == 0) || (notified.repeat_status != metadata_store.repeat_status))
+    changes |= MHC_repeat_status;
+  if ((watchers_notified == 0) || (notified.player_state != metadata_store.player_state))
+    changes |= MHC_player_state;
+  if ((watchers_notified == 0) || (notified.active_state != metadata_store.active_state))
+    changes |= MHC_active_state;
+  if ((watchers_notified == 0) || (notified.speaker_volume != metadata_store.speaker_volume))
+    changes |= MHC_speaker_volume;
+  if ((watchers_notified == 0) || (notified.airplay_volume != metadata_store.airplay_volume))
+    changes |= MHC_airplay_volume;
+  notified.dacp_server_active = metadata_store.dacp_server_active;
+  notified.advanced_dacp_server_active = metadata_store.advanced_dacp_server_active;
+  notified.play_status = metadata_store.play_status;
+  notified.shuffle_status = metadata_store.shuffle_status;
+  notified.repeat_status = metadata_store.repeat_status;
+  notified.player_state = metadata_store.player_state;
+  notified.active_state = metadata_store.active_state;
+  notified.speaker_volume = metadata_store.speaker_volume;
+  notified.airplay_volume = metadata_store.airplay_volume;
+  watchers_notified = 1;
+  if (changes) {
+    debug(3, "MH notifying watchers of changes %" PRIx64 ".", changes);
+    int i;
+    for (i = 0; i < number_of_watchers; i++) {
+      if (metadata_store.watchers[i]) {
+        metadata_store.watchers[i](&metadata_store, changes, metadata_store.watchers_data[i]);
+      }
+    }
+  }
+}
+
+static void notification_thread_cleanup_handler(__attribute__((unused)) void *arg) {
+  pthread_mutex_unlock(&notification_lock);
+}
+
+static void *notification_thread_function(__attribute__((unused)) void *arg) {
+  thread_set_name("metadata-notify");
+  while (1) {
+    pthread_mutex_lock(&notification_lock);
+    pthread_cleanup_push(notification_thread_cleanup_handler, NULL);
+    while (notification_pending == 0)
+      pthread_cond_wait(&notification_requested, &notification_lock);
+    pthread_cleanup_pop(1);
+    usleep(metadata_hub_notification_window_us); // let a burst of changes come in
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+    pthread_rwlock_wrlock(&metadata_hub_re_lock);
+    pthread_mutex_lock(&notification_lock);
+    notification_pending = 0;
+    pthread_mutex_unlock(&notification_lock);
+    run_metadata_watchers();
+    pthread_rwlock_unlock(&metadata_hub_re_lock);
+    pthread_setcancelstate(oldState, NULL);
+  }
+  pthread_exit(NULL);
+}
+
 void metadata_hub_init(void) {
   // debug(1, "Metadata bundle initialisation.");
   memset(&metadata_store, 0, sizeof(metadata_store));
   metadata_hub_initialised = 1;
+  if (pthread_create(&notification_thread, NULL, notification_thread_function, NULL) == 0)
+    notification_thread_running = 1;
+  else
+    debug(1, "Failed to create the metadata hub notification thread -- watchers will be run "
+             "immediately.");
+  cover_art_cache_init();
 }
 
-void metadata_hub_stop(void) {}
+void metadata_hub_stop(void) {
+  cover_art_cache_stop();
+  if (notification_thread_running) {
+    pthread_cancel(notification_thread);
+    pthread_join(notification_thread, NULL);
+    notification_thread_running = 0;
+  }
+}
 
 void add_metadata_watcher(metadata_watcher fn, void *userdata) {
   int i;
+  pthread_rwlock_wrlock(&metadata_hub_re_lock);
   for (i = 0; i < number_of_watchers; i++) {
     if (metadata_store.watchers[i] == NULL) {
       metadata_store.watchers[i] = fn;
       metadata_store.watchers_data[i] = userdata;
+      watchers_notified = 0; // so that the new watcher is told of everything
       // debug(1, "Added a metadata watcher into slot %d", i);
       break;
     }
   }
-}
-
-void run_metadata_watchers(void) {
-  int i;
-  for (i = 0; i < number_of_watchers; i++) {
-    if (metadata_store.watchers[i]) {
-      metadata_store.watchers[i](&metadata_store, metadata_store.watchers_data[i]);
-    }
-  }
-  // turn off changed flags
-  metadata_store.cover_art_pathname_changed = 0;
-  metadata_store.client_ip_changed = 0;
-  metadata_store.server_ip_changed = 0;
-  metadata_store.progress_string_changed = 0;
-  metadata_store.item_id_changed = 0;
-  metadata_store.item_composite_id_changed = 0;
-  metadata_store.artist_name_changed = 0;
-  metadata_store.album_artist_name_changed = 0;
-  metadata_store.album_name_changed = 0;
-  metadata_store.track_name_changed = 0;
-  metadata_store.genre_changed = 0;
-  metadata_store.comment_changed = 0;
-  metadata_store.composer_changed = 0;
-  metadata_store.file_kind_changed = 0;
-  metadata_store.song_description_changed = 0;
-  metadata_store.song_album_artist_changed = 0;
-  metadata_store.sort_artist_changed = 0;
-  metadata_store.sort_album_changed = 0;
-  metadata_store.sort_composer_changed = 0;
-  metadata_store.songtime_in_milliseconds_changed = 0;
+  pthread_rwlock_unlock(&metadata_hub_re_lock);
 }
 
 void metadata_hub_unlock_hub_mutex_cleanup(__attribute__((unused)) void *arg) {
@@ -158,8 +275,18 @@ void _metadata_hub_modify_prolog(const char *filename, const int linenumber) {
 void _metadata_hub_modify_epilog(int modified, const char *filename, const int linenumber) {
   metadata_store.dacp_server_has_been_active =
       metadata_store.dacp_server_active; // set the scanner_has_been_active now.
+  gather_changes(); // even if they're not to be notified yet
   if (modified) {
-    run_metadata_watchers();
+    if (notification_thread_running) {
+      pthread_mutex_lock(&notification_lock);
+      if (notification_pending == 0) {
+        notification_pending = 1;
+        pthread_cond_signal(&notification_requested);
+      }
+      pthread_mutex_unlock(&notification_lock);
+    } else {
+      run_metadata_watchers();
+    }
   }
   if (metadata_hub_re_lock_access_is_delayed) {
     if (last_metadata_hub_modify_prolog_file) {
@@ -177,150 +304,46 @@ void _metadata_hub_modify_epilog(int modified, const char *filename, const int l
   // debug(3, "Metadata_hub write lock unlocked.");
 }
 
-/*
 void _metadata_hub_read_prolog(const char *filename, const int linenumber) {
   // always run this before reading an entry or a sequence of entries in the metadata_hub
   // debug(1, "locking metadata hub for reading");
   if (pthread_rwlock_tryrdlock(&metadata_hub_re_lock) != 0) {
-    debug(1, "Metadata_hub read lock is already taken -- must wait.");
+    debug(2, "Metadata_hub read lock at \"%s:%d\" must wait.", filename, linenumber);
     pthread_rwlock_rdlock(&metadata_hub_re_lock);
-    debug(1, "Okay -- acquired the metadata_hub read lock.");
+    debug(2, "Okay -- acquired the metadata_hub read lock at \"%s:%d\".", filename, linenumber);
   }
 }
 
-void _metadata_hub_read_epilog(const char *filename, const int linenumber) {
+void _metadata_hub_read_epilog(__attribute__((unused)) const char *filename,
+                               __attribute__((unused)) const int linenumber) {
   // always run this after reading an entry or a sequence of entries in the metadata_hub
   // debug(1, "unlocking metadata hub for reading");
   pthread_rwlock_unlock(&metadata_hub_re_lock);
 }
-*/
-char *metadata_write_image_file(const char *buf, int len) {
-
-  // warning -- this removes all files from the directory apart from this one, if it exists
-  // it will return a path to the image file allocated with malloc.
-  // free it if you don't need it.
-
-  char *path = NULL;                                 // this will be what is returned
-  if (strcmp(config.cover_art_cache_dir, "") != 0) { // an empty string means do not write the file
-
-    uint8_t img_md5[16];
-    // uint8_t ap_md5[16];
-
-#ifdef CONFIG_OPENSSL
-    MD5_CTX ctx;
-    MD5_Init(&ctx);
-    MD5_Update(&ctx, buf, len);
-    MD5_Final(img_md5, &ctx);
-#endif
-
-#ifdef CONFIG_MBEDTLS
-#if MBEDTLS_VERSION_MINOR >= 7
-    mbedtls_md5_context tctx;
-    mbedtls_md5_starts_ret(&tctx);
-    mbedtls_md5_update_ret(&tctx, (const unsigned char *)buf, len);
-    mbedtls_md5_finish_ret(&tctx, img_md5);
-#else
-    mbedtls_md5_context tctx;
-    mbedtls_md5_starts(&tctx);
-    mbedtls_md5_update(&tctx, (const unsigned char *)buf, len);
-    mbedtls_md5_finish(&tctx, img_md5);
-#endif
-#endif
-
-#ifdef CONFIG_POLARSSL
-    md5_context tctx;
-    md5_starts(&tctx);
-    md5_update(&tctx, (const unsigned char *)buf, len);
-    md5_finish(&tctx, img_md5);
-#endif
-
-    char img_md5_str[33];
-    memset(img_md5_str, 0, sizeof(img_md5_str));
-    char *ext;
-    char png[] = "png";
-    char jpg[] = "jpg";
-    int i;
-    for (i = 0; i < 16; i++)
-      snprintf(&img_md5_str[i * 2], 3, "%02x", (uint8_t)img_md5[i]);
-    // see if the file is a jpeg or a png
-    if (strncmp(buf, "\xFF\xD8\xFF", 3) == 0)
-      ext = jpg;
-    else if (strncmp(buf, "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A", 8) == 0)
-      ext = png;
-    else {
-      debug(1, "Unidentified image type of cover art -- jpg extension used.");
-      ext = jpg;
-    }
-    mode_t oldumask = umask(000);
-    int result = mkpath(config.cover_art_cache_dir, 0777);
-    umask(oldumask);
-    if ((result == 0) || (result == -EEXIST)) {
-      // see if the file exists by opening it.
-      // if it exists, we're done
-      char *prefix = "cover-";
-
-      size_t pl = strlen(config.cover_art_cache_dir) + 1 + strlen(prefix) + strlen(img_md5_str) +
-                  1 + strlen(ext);
-
-      path = malloc(pl + 1);
-      snprintf(path, pl + 1, "%s/%s%s.%s", config.cover_art_cache_dir, prefix, img_md5_str, ext);
-      int cover_fd = open(path, O_WRONLY | O_CREAT | O_EXCL, S_IRWXU | S_IRGRP | S_IROTH);
-      if (cover_fd > 0) {
-        // write the contents
-        if (write(cover_fd, buf, len) < len) {
-          warn("Writing cover art file \"%s\" failed!", path);
-          free(path);
-          path = NULL;
-        }
-        close(cover_fd);
-
-        // now delete all other files, if requested
-        if (config.retain_coverart == 0) {
-          DIR *d;
-          struct dirent *dir;
-          d = opendir(config.cover_art_cache_dir);
-          if (d) {
-            int fnl = strlen(prefix) + strlen(img_md5_str) + 1 + strlen(ext) + 1;
-
-            char *full_filename = malloc(fnl);
-            if (full_filename == NULL)
-              die("Can't allocate memory at metadata_write_image_file.");
-            memset(full_filename, 0, fnl);
-            snprintf(full_filename, fnl, "%s%s.%s", prefix, img_md5_str, ext);
-            int dir_fd = open(config.cover_art_cache_dir, O_DIRECTORY);
-            if (dir_fd > 0) {
-              while ((dir = readdir(d)) != NULL) {
-                if (dir->d_type == DT_REG) {
-                  if (strcmp(full_filename, dir->d_name) != 0) {
-                    if (unlinkat(dir_fd, dir->d_name, 0) != 0) {
-                      debug(1, "Error %d deleting cover art file \"%s\".", errno, dir->d_name);
-                    }
-                  }
-                }
-              }
-            } else {
-              debug(1, "Can't open the directory for deletion.");
-            }
-            free(full_filename);
-            closedir(d);
-          }
-        }
-      } else {
-        //      if (errno == EEXIST)
-        //        debug(1, "Cover art file \"%s\" already exists!", path);
-        //      else {
-        if (errno != EEXIST) {
-          warn("Could not open file \"%s\" for writing cover art", path);
-          free(path);
-          path = NULL;
-        }
-      }
-    } else {
-      debug(1, "Couldn't access or create the cover art cache directory \"%s\".",
-            config.cover_art_cache_dir);
-    }
+
+// the cover art in use is the one from the most recent picture
+static uint64_t cover_art_generation = 0;
+
+static void set_cover_art_pathname(const char *pathname) {
+  char uri[2048];
+  if (pathname)
+    snprintf(uri, sizeof(uri), "file://%s", pathname);
+  else
+    uri[0] = '\0';
+  if (string_update(&metadata_store.cover_art_pathname, &metadata_store.cover_art_pathname_changed,
+                    uri)) // if the picture's file path is different from the stored one...
+    debug(2, "MH Cover art pathname set to: \"%s\"", uri);
+}
+
+// called from the cover art cache's thread when a new picture's file has been written
+static void cover_art_ready(const char *pathname, uint64_t generation) {
+  metadata_hub_modify_prolog();
+  int changed = 0;
+  if (generation == cover_art_generation) { // ignore it if another picture has come in since
+    set_cover_art_pathname(pathname);
+    changed = metadata_store.cover_art_pathname_changed;
   }
-  return path;
+  metadata_hub_modify_epilog(changed);
 }
 
 void metadata_hub_process_metadata(uint32_t type, uint32_t code, char *data, uint32_t length) {
@@ -510,26 +533,22 @@ void metadata_hub_process_metadata(uint32_t type, uint32_t code, char *data, uin
     case 'PICT':
       debug(2, "MH Picture received, length %u bytes.", length);
 
-      char uri[2048];
+      cover_art_generation++;
       if ((length > 16) &&
           (strcmp(config.cover_art_cache_dir, "") != 0)) { // if it's okay to write the file
-                                                           // make this uncancellable
-        int oldState;
-        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState); // make this un-cancellable
-        char *pathname = metadata_write_image_file(data, length);
-        snprintf(uri, sizeof(uri), "file://%s", pathname);
-        free(pathname);
-        pthread_setcancelstate(oldState, NULL);
-
+        char *pathname = cover_art_cache_add(data, length, cover_art_ready, cover_art_generation);
+        // if it's not already in the cache, the path is set when the file has been written
+        if (pathname) {
+          set_cover_art_pathname(pathname);
+          free(pathname);
+          changed = metadata_store.cover_art_pathname_changed;
+        } else {
+          changed = 0;
+        }
       } else {
-        uri[0] = '\0';
+        set_cover_art_pathname(NULL);
+        changed = metadata_store.cover_art_pathname_changed;
       }
-      if (string_update(&metadata_store.cover_art_pathname,
-                        &metadata_store.cover_art_pathname_changed,
-                        uri)) // if the picture's file path is different from the stored one...
-        changed = 1;
-      else
-        changed = 0;
       //      pthread_cleanup_pop(0); // don't remove the lock -- it'll have been done
       break;
     case 'clip':
@@ -549,6 +568,24 @@ void metadata_hub_process_metadata(uint32_t type, uint32_t code, char *data, uin
       }
       free(cs);
       break;
+    case 'rcvs':
+      cs = strndup(data, length);
+      if (string_update(&metadata_store.receive_statistics,
+                        &metadata_store.receive_statistics_changed, cs)) {
+        changed = 1;
+        debug(3, "MH Receive Statistics set to: \"%s\"", metadata_store.receive_statistics);
+      }
+      free(cs);
+      break;
+    case 'stgt':
+      cs = strndup(data, length);
+      if (string_update(&metadata_store.stage_timings, &metadata_store.stage_timings_changed,
+                        cs)) {
+        changed = 1;
+        debug(3, "MH Stage Timings set to: \"%s\"", metadata_store.stage_timings);
+      }
+      free(cs);
+      break;
     case 'svip':
       cs = strndup(data, length);
       if (string_update(&metadata_store.server_ip, &metadata_store.server_ip_changed, cs)) {
@@ -33,9 +33,50 @@ typedef enum {
 int string_update(char **str, int *changed, char *s);
 int int_update(int *receptacle, int *changed, int value);
 
+// Changes to the hub are gathered for a short while and passed to the watchers together,
+// as a mask of these bits, so that a burst of items makes one notification.
+#define MHC_client_ip (1ULL << 0)
+#define MHC_server_ip (1ULL << 1)
+#define MHC_progress_string (1ULL << 2)
+#define MHC_receive_statistics (1ULL << 3)
+#define MHC_cover_art_pathname (1ULL << 4)
+#define MHC_item_id (1ULL << 5)
+#define MHC_item_composite_id (1ULL << 6)
+#define MHC_track_name (1ULL << 7)
+#define MHC_artist_name (1ULL << 8)
+#define MHC_album_artist_name (1ULL << 9)
+#define MHC_album_name (1ULL << 10)
+#define MHC_genre (1ULL << 11)
+#define MHC_comment (1ULL << 12)
+#define MHC_composer (1ULL << 13)
+#define MHC_file_kind (1ULL << 14)
+#define MHC_song_description (1ULL << 15)
+#define MHC_song_album_artist (1ULL << 16)
+#define MHC_sort_name (1ULL << 17)
+#define MHC_sort_artist (1ULL << 18)
+#define MHC_sort_album (1ULL << 19)
+#define MHC_sort_composer (1ULL << 20)
+#define MHC_songtime_in_milliseconds (1ULL << 21)
+#define MHC_stage_timings (1ULL << 22)
+// the following have no flags of their own -- they are compared with what was last notified
+#define MHC_dacp_server_active (1ULL << 32)
+#define MHC_advanced_dacp_server_active (1ULL << 33)
+#define MHC_play_status (1ULL << 34)
+#define MHC_shuffle_status (1ULL << 35)
+#define MHC_repeat_status (1ULL << 36)
+#define MHC_player_state (1ULL << 37)
+#define MHC_active_state (1ULL << 38)
+#define MHC_speaker_volume (1ULL << 39)
+#define MHC_airplay_volume (1ULL << 40)
+
+// the items in the MPRIS-style metadata dictionary
+#define MHC_track_metadata                                                                         \
+  (MHC_cover_art_pathname | MHC_item_id | MHC_track_name | MHC_album_name | MHC_artist_name |      \
+   MHC_genre | MHC_songtime_in_milliseconds)
+
 struct metadata_bundle;
 
-typedef void (*metadata_watcher)(struct metadata_bundle *argc, void *userdata);
+typedef void (*metadata_watcher)(struct metadata_bundle *argc, uint64_t changes, void *userdata);
 
 typedef struct metadata_bundle {
 
@@ -49,6 +90,12 @@ typedef struct metadata_bundle {
   char *progress_string; // progress string, emitted by the source from time to time
   int progress_string_changed;
 
+  char *receive_statistics; // how the audio packets are arriving -- see receive_stats.c
+  int receive_statistics_changed;
+
+  char *stage_timings; // how long the stages of the audio pipeline take -- see stage_timings.c
+  int stage_timings_changed;
+
   int player_thread_active; // true if a play thread is running
   int dacp_server_active;   // true if there's a reachable DACP server (assumed to be the Airplay
                             // client) ; false otherwise
@@ -153,15 +200,14 @@ void _metadata_hub_modify_epilog(
     int modified, const char *filename,
     const int linenumber); // set to true if modifications occurred, 0 otherwise
 
-/*
-// these are for safe reading
+// these are for safe reading -- they don't run the watchers, so they mustn't be used by a
+// watcher, which is called with the hub locked for writing
 void _metadata_hub_read_prolog(const char *filename, const int linenumber);
 void _metadata_hub_read_epilog(const char *filename, const int linenumber);
-*/
 
 #define metadata_hub_modify_prolog(void) _metadata_hub_modify_prolog(__FILE__, __LINE__)
 #define metadata_hub_modify_epilog(modified)                                                       \
   _metadata_hub_modify_epilog(modified, __FILE__, __LINE__)
 
 #define metadata_hub_read_prolog(void) _metadata_hub_read_prolog(__FILE__, __LINE__)
-#define metadata_hub_read_epilog(void) _metadata_hub_modify_epilog(__FILE__, __LINE__)
+#define metadata_hub_read_epilog(void) _metadata_hub_read_epilog(__FILE__, __LINE__)
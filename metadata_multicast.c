@@ -0,0 +1,346 @@
+// sendmmsg and struct mmsghdr need this on glibc -- see udp_receive.c
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#include "common.h"
+#include "metadata_multicast.h"
+
+#ifdef CONFIG_METADATA
+
+#if defined(HAVE_SENDMMSG) && defined(MSG_DONTWAIT)
+#define USE_SENDMMSG
+#endif
+
+#define METADATA_SNDBUF (4 * 1024 * 1024)
+#define METADATA_MULTICAST_BATCH 16 // datagrams handed to the kernel in one go
+#define METADATA_MULTICAST_QUEUE_LIMIT (8 * 1024 * 1024) // bytes of split items held at most
+#define METADATA_MULTICAST_RETRY_NS 2000000 // how soon to try again if the socket is full
+
+typedef struct metadata_multicast_item {
+  struct metadata_multicast_item *next;
+  uint32_t type;
+  uint32_t code;
+  uint32_t item_id;
+  uint32_t chunked;     // if 0, the item is sent as a single datagram without a chunk header
+  uint32_t chunk_ix;    // the next chunk to send
+  uint32_t chunk_total;
+  uint32_t chunk_size;  // the most data a chunk carries
+  uint32_t length;
+  char data[];
+} metadata_multicast_item;
+
+typedef struct {
+  metadata_multicast_item *head;
+  metadata_multicast_item *tail;
+} metadata_multicast_queue;
+
+static int metadata_sock = -1;
+static struct sockaddr_in metadata_sockaddr;
+static char *datagrams;             // METADATA_MULTICAST_BATCH buffers of metadata_sockmsglength
+static size_t datagram_lengths[METADATA_MULTICAST_BATCH];
+
+// Items that fit in a datagram go in the urgent queue and are sent as soon as they are queued,
+// whatever the token bucket holds. Items that have to be split go in the bulk queue and their
+// chunks are sent as the bucket allows, so a piece of cover art never holds up the progress and
+// volume items that come in behind it.
+// Readers rely on the order of the items between 'pcst' and 'pcen', and between 'mdst' and
+// 'mden', so those items and the markers themselves go in the bulk queue behind anything already
+// there, keeping their place, rather than jumping ahead.
+static metadata_multicast_queue urgent, bulk;
+static size_t bulk_bytes;
+static int open_brackets; // 'pcst' or 'mdst' items queued without their 'pcen' or 'mden' yet
+static uint32_t next_item_id;
+static uint32_t next_sequence_number;
+
+// the token bucket, in bytes
+static double rate_in_bytes_per_ns; // 0 for no limit
+static double tokens;
+static double bucket_size;
+static uint64_t time_of_last_refill;
+
+static void queue_append(metadata_multicast_queue *q, metadata_multicast_item *item) {
+  item->next = NULL;
+  if (q->tail)
+    q->tail->next = item;
+  else
+    q->head = item;
+  q->tail = item;
+}
+
+static metadata_multicast_item *queue_pop(metadata_multicast_queue *q) {
+  metadata_multicast_item *item = q->head;
+  if (item) {
+    q->head = item->next;
+    if (q->head == NULL)
+      q->tail = NULL;
+  }
+  return item;
+}
+
+static void queue_clear(metadata_multicast_queue *q) {
+  metadata_multicast_item *item;
+  while ((item = queue_pop(q)) != NULL)
+    free(item);
+}
+
+int metadata_multicast_open(void) {
+  if ((config.metadata_sockaddr == NULL) || (config.metadata_sockport == 0))
+    return 0;
+  metadata_sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (metadata_sock < 0) {
+    debug(1, "Could not open metadata socket");
+    return 0;
+  }
+  int buffer_size = METADATA_SNDBUF;
+  setsockopt(metadata_sock, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+  memset(&metadata_sockaddr, 0, sizeof(metadata_sockaddr));
+  metadata_sockaddr.sin_family = AF_INET;
+  metadata_sockaddr.sin_addr.s_addr = inet_addr(config.metadata_sockaddr);
+  metadata_sockaddr.sin_port = htons(config.metadata_sockport);
+  datagrams = malloc(METADATA_MULTICAST_BATCH * config.metadata_sockmsglength);
+  if (datagrams == NULL)
+    die("Could not malloc metadata multicast socket buffer");
+
+  rate_in_bytes_per_ns = config.metadata_socket_rate_limit * 0.000001; // kilobytes per second
+  // big enough for a tenth of a second's worth, and never smaller than a couple of datagrams
+  bucket_size = rate_in_bytes_per_ns * 100000000;
+  if (bucket_size < 2.0 * config.metadata_sockmsglength)
+    bucket_size = 2.0 * config.metadata_sockmsglength;
+  tokens = bucket_size;
+  time_of_last_refill = get_absolute_time_in_ns();
+  return 1;
+}
+
+void metadata_multicast_close(void) {
+  queue_clear(&urgent);
+  queue_clear(&bulk);
+  bulk_bytes = 0;
+  open_brackets = 0;
+  if (metadata_sock >= 0) {
+    shutdown(metadata_sock, SHUT_RDWR); // we want to immediately deallocate the buffer
+    close(metadata_sock);
+    metadata_sock = -1;
+  }
+  free(datagrams);
+  datagrams = NULL;
+}
+
+void metadata_multicast_queue_item(uint32_t type, uint32_t code, const char *data,
+                                   uint32_t length) {
+  if (metadata_sock < 0)
+    return;
+  uint32_t chunked, chunk_size;
+  if (config.metadata_socket_sequence_numbers) {
+    // every item is sent in chunks, each with a 32-byte header:
+    // ("ssnc", "seqc", sequence_number, item_id, chunk_ix, chunk_total, type, code, chunked_data)
+    chunked = 1;
+    chunk_size = config.metadata_sockmsglength - 32;
+  } else if (length < config.metadata_sockmsglength - 8) {
+    // (type, code, data)
+    chunked = 0;
+    chunk_size = config.metadata_sockmsglength - 8;
+  } else {
+    // ("ssnc", "chnk", chunk_ix, chunk_total, type, code, chunked_data)
+    chunked = 1;
+    chunk_size = config.metadata_sockmsglength - 24;
+  }
+  uint32_t chunk_total = (length + chunk_size - 1) / chunk_size;
+  if (chunk_total == 0)
+    chunk_total = 1;
+  if ((chunk_total > 1) && (bulk_bytes + length > METADATA_MULTICAST_QUEUE_LIMIT)) {
+    debug(1, "metadata multicast: an item of %u bytes was dropped as %zu bytes are still waiting.",
+          length, bulk_bytes);
+    return;
+  }
+  metadata_multicast_item *item = malloc(sizeof(metadata_multicast_item) + length);
+  if (item == NULL) {
+    debug(1, "metadata multicast: can't allocate memory for an item of %u bytes.", length);
+    return;
+  }
+  item->type = type;
+  item->code = code;
+  item->item_id = next_item_id++;
+  item->chunked = chunked;
+  item->chunk_ix = 0;
+  item->chunk_total = chunk_total;
+  item->chunk_size = chunk_size;
+  item->length = length;
+  if (length)
+    memcpy(item->data, data, length);
+  int bracket_start = (type == 'ssnc') && ((code == 'pcst') || (code == 'mdst'));
+  int bracket_end = (type == 'ssnc') && ((code == 'pcen') || (code == 'mden'));
+  int keeps_place = bracket_start || bracket_end || (open_brackets > 0);
+  if (bracket_start)
+    open_brackets++;
+  else if ((bracket_end) && (open_brackets > 0))
+    open_brackets--;
+  if ((chunk_total == 1) && ((keeps_place == 0) || (bulk.head == NULL))) {
+    queue_append(&urgent, item);
+  } else {
+    queue_append(&bulk, item);
+    bulk_bytes += length;
+  }
+}
+
+static char *put_uint32(char *ptr, uint32_t value) {
+  uint32_t v = htonl(value);
+  memcpy(ptr, &v, 4);
+  return ptr + 4;
+}
+
+// the length of a chunk of the item, including its header
+static size_t chunk_length(metadata_multicast_item *item, uint32_t chunk_ix) {
+  size_t header = item->chunked ? (config.metadata_socket_sequence_numbers ? 32 : 24) : 8;
+  size_t data_length = item->length - chunk_ix * item->chunk_size;
+  if (data_length > item->chunk_size)
+    data_length = item->chunk_size;
+  return header + data_length;
+}
+
+static size_t build_chunk(char *buffer, metadata_multicast_item *item, uint32_t chunk_ix,
+                          uint32_t sequence_number) {
+  size_t length = chunk_length(item, chunk_ix);
+  char *ptr = buffer;
+  if (item->chunked) {
+    memcpy(ptr, "ssnc", 4);
+    ptr += 4;
+    if (config.metadata_socket_sequence_numbers) {
+      memcpy(ptr, "seqc", 4);
+      ptr = put_uint32(ptr + 4, sequence_number);
+      ptr = put_uint32(ptr, item->item_id);
+    } else {
+      memcpy(ptr, "chnk", 4);
+      ptr += 4;
+    }
+    ptr = put_uint32(ptr, chunk_ix);
+    ptr = put_uint32(ptr, item->chunk_total);
+  }
+  ptr = put_uint32(ptr, item->type);
+  ptr = put_uint32(ptr, item->code);
+  memcpy(ptr, item->data + chunk_ix * item->chunk_size, length - (ptr - buffer));
+  return length;
+}
+
+// returns the number of datagrams taken by the kernel -- any that couldn't be sent for a reason
+// other than the socket being full are counted as taken, and lost
+static int send_datagrams(int count) {
+  int i;
+#ifdef USE_SENDMMSG
+  struct mmsghdr msgs[METADATA_MULTICAST_BATCH];
+  struct iovec iovs[METADATA_MULTICAST_BATCH];
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < count; i++) {
+    iovs[i].iov_base = datagrams + i * config.metadata_sockmsglength;
+    iovs[i].iov_len = datagram_lengths[i];
+    msgs[i].msg_hdr.msg_name = &metadata_sockaddr;
+    msgs[i].msg_hdr.msg_namelen = sizeof(metadata_sockaddr);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  int response = sendmmsg(metadata_sock, msgs, count, MSG_DONTWAIT);
+  if (response < 0) {
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+      return 0;
+    debug(1, "metadata multicast: error %d sending metadata.", errno);
+    return 1; // skip the datagram that failed
+  }
+  return response;
+#else
+  for (i = 0; i < count; i++) {
+    if (sendto(metadata_sock, datagrams + i * config.metadata_sockmsglength, datagram_lengths[i],
+               MSG_DONTWAIT, (struct sockaddr *)&metadata_sockaddr,
+               sizeof(metadata_sockaddr)) < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        break;
+      debug(1, "metadata multicast: error %d sending metadata.", errno);
+    }
+  }
+  return i;
+#endif
+}
+
+// the datagram at the front has been sent
+static void advance(void) {
+  next_sequence_number++;
+  if (urgent.head) {
+    free(queue_pop(&urgent));
+  } else if (bulk.head) {
+    if (++bulk.head->chunk_ix == bulk.head->chunk_total) {
+      bulk_bytes -= bulk.head->length;
+      free(queue_pop(&bulk));
+    }
+  }
+}
+
+uint64_t metadata_multicast_send(void) {
+  if (metadata_sock < 0)
+    return 0;
+  uint64_t time_now = get_absolute_time_in_ns();
+  tokens += (time_now - time_of_last_refill) * rate_in_bytes_per_ns;
+  if (tokens > bucket_size)
+    tokens = bucket_size;
+  time_of_last_refill = time_now;
+
+  while ((urgent.head != NULL) || (bulk.head != NULL)) {
+    // build a batch -- the urgent items first, then as many chunks as there are tokens for
+    int count = 0;
+    double budget = tokens;
+    metadata_multicast_item *item;
+    for (item = urgent.head; (item != NULL) && (count < METADATA_MULTICAST_BATCH);
+         item = item->next) {
+      datagram_lengths[count] =
+          build_chunk(datagrams + count * config.metadata_sockmsglength, item, 0,
+                      next_sequence_number + count);
+      budget -= datagram_lengths[count];
+      count++;
+    }
+    item = bulk.head;
+    uint32_t chunk_ix = item ? item->chunk_ix : 0;
+    while ((item != NULL) && (count < METADATA_MULTICAST_BATCH)) {
+      if ((rate_in_bytes_per_ns != 0.0) && (budget < chunk_length(item, chunk_ix)))
+        break;
+      datagram_lengths[count] =
+          build_chunk(datagrams + count * config.metadata_sockmsglength, item, chunk_ix,
+                      next_sequence_number + count);
+      budget -= datagram_lengths[count];
+      count++;
+      if (++chunk_ix == item->chunk_total) {
+        item = item->next;
+        if (item)
+          chunk_ix = item->chunk_ix;
+      }
+    }
+    if (count == 0)
+      break; // waiting for tokens
+
+    int sent = send_datagrams(count);
+    int i;
+    for (i = 0; i < sent; i++) {
+      tokens -= datagram_lengths[i];
+      advance();
+    }
+    if (sent < count)
+      return METADATA_MULTICAST_RETRY_NS; // the socket's buffer is full
+  }
+  if (tokens < -bucket_size)
+    tokens = -bucket_size; // don't let a run of urgent items hold the chunks up for long
+  if (bulk.head == NULL)
+    return 0;
+  if (rate_in_bytes_per_ns == 0.0)
+    return METADATA_MULTICAST_RETRY_NS;
+  double shortfall = chunk_length(bulk.head, bulk.head->chunk_ix) - tokens;
+  return (uint64_t)(shortfall / rate_in_bytes_per_ns) + 1;
+}
+
+#endif
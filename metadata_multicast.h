@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+// Sending metadata to the UDP socket given by the metadata.socket_address and socket_port
+// settings. Items are queued by the multicast thread and sent in batches, paced by a token bucket
+// of metadata.socket_rate_limit kilobytes per second. Items that fit in a single datagram go ahead
+// of the chunks of ones that have to be split, unless they are in or mark the ends of a
+// 'pcst'...'pcen' or 'mdst'...'mden' group, which is kept in order. The socket is never waited on.
+
+// returns 1 if the socket has been opened
+int metadata_multicast_open(void);
+void metadata_multicast_close(void);
+
+// the item is copied
+void metadata_multicast_queue_item(uint32_t type, uint32_t code, const char *data,
+                                   uint32_t length);
+
+// send what can be sent now, and return how many nanoseconds to wait before sending more, or 0
+// if nothing is waiting
+uint64_t metadata_multicast_send(void);
@@ -0,0 +1,355 @@
+#include "metrics.h"
+#include "common.h"
+#include "realtime.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// the upper bounds of the buckets of the absolute sync error histogram, in seconds
+static const double sync_error_bucket_bound[METRICS_SYNC_ERROR_BUCKETS] = {
+    0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1};
+
+typedef struct {
+  int playing;
+  metrics_player_counts totals;       // over all play sessions
+  metrics_player_counts session_counts; // as last given for the current play session
+  double input_frame_rate, output_frame_rate, source_drift_ppm, correction_ppm,
+      insertions_and_deletions_ppm;
+  int64_t minimum_dac_queue_size;
+  int32_t minimum_buffer_occupancy, maximum_buffer_occupancy;
+  double soxr_mean_execution_time, soxr_maximum_execution_time;
+  double last_sync_error;
+  uint64_t sync_error_bucket[METRICS_SYNC_ERROR_BUCKETS + 1]; // not cumulative; the last is +Inf
+  uint64_t sync_error_count;
+  double sync_error_sum;
+} metrics_set;
+
+static metrics_set gathering;  // only touched by the player thread
+static metrics_set published;  // written by the player thread only inside the sequence below
+static uint32_t published_sequence; // odd while published is being written
+static unsigned long event_count[metrics_number_of_events];
+
+static int metrics_socket = -1;
+static pthread_t metrics_thread;
+static int metrics_running = 0;
+
+void metrics_count_event(metrics_event event) {
+  __atomic_fetch_add(&event_count[event], 1, __ATOMIC_RELAXED);
+}
+
+void metrics_player_set_playing(int playing) { gathering.playing = playing; }
+
+void metrics_player_note_sync_error(double sync_error) {
+  double e = sync_error < 0.0 ? -sync_error : sync_error;
+  int bucket = 0;
+  while ((bucket < METRICS_SYNC_ERROR_BUCKETS) && (e > sync_error_bucket_bound[bucket]))
+    bucket++;
+  gathering.sync_error_bucket[bucket]++;
+  gathering.sync_error_count++;
+  gathering.sync_error_sum += e;
+  gathering.last_sync_error = sync_error;
+}
+
+void metrics_player_start_session() {
+  memset(&gathering.session_counts, 0, sizeof(metrics_player_counts));
+}
+
+// add what has been counted since the counts were last given
+#define add_count(field) gathering.totals.field += counts->field - gathering.session_counts.field
+
+void metrics_player_set_counts(metrics_player_counts *counts) {
+  add_count(packets);
+  add_count(missing_packets);
+  add_count(late_packets);
+  add_count(too_late_packets);
+  add_count(resend_requests);
+  add_count(frames_inserted);
+  add_count(frames_deleted);
+  gathering.session_counts = *counts;
+}
+
+void metrics_player_set_rates(double input_frame_rate, double output_frame_rate,
+                              double source_drift_ppm, double correction_ppm,
+                              double insertions_and_deletions_ppm) {
+  gathering.input_frame_rate = input_frame_rate;
+  gathering.output_frame_rate = output_frame_rate;
+  gathering.source_drift_ppm = source_drift_ppm;
+  gathering.correction_ppm = correction_ppm;
+  gathering.insertions_and_deletions_ppm = insertions_and_deletions_ppm;
+}
+
+void metrics_player_set_queues(int64_t minimum_dac_queue_size, int32_t minimum_buffer_occupancy,
+                               int32_t maximum_buffer_occupancy) {
+  gathering.minimum_dac_queue_size = minimum_dac_queue_size;
+  gathering.minimum_buffer_occupancy = minimum_buffer_occupancy;
+  gathering.maximum_buffer_occupancy = maximum_buffer_occupancy;
+}
+
+void metrics_player_set_soxr_execution_time(double mean, double maximum) {
+  gathering.soxr_mean_execution_time = mean;
+  gathering.soxr_maximum_execution_time = maximum;
+}
+
+void metrics_player_publish() {
+  __atomic_store_n(&published_sequence, published_sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&published, &gathering, sizeof(metrics_set));
+  __atomic_store_n(&published_sequence, published_sequence + 1, __ATOMIC_RELEASE);
+}
+
+static void metrics_read(metrics_set *m) {
+  uint32_t before, after;
+  do {
+    before = __atomic_load_n(&published_sequence, __ATOMIC_ACQUIRE);
+    memcpy(m, &published, sizeof(metrics_set));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&published_sequence, __ATOMIC_RELAXED);
+  } while ((before & 1) || (before != after));
+}
+
+// append to the text, as snprintf would, keeping track of the length
+static void metrics_append(char *buf, size_t size, size_t *length, const char *format, ...) {
+  if (*length < size) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + *length, size - *length, format, args);
+    va_end(args);
+    if (n > 0)
+      *length += n;
+  }
+}
+
+static void metric_header(char *buf, size_t size, size_t *length, const char *name,
+                          const char *type, const char *help) {
+  metrics_append(buf, size, length, "# HELP shairport_sync_%s %s\n# TYPE shairport_sync_%s %s\n",
+                 name, help, name, type);
+}
+
+#define gauge(name, help, format, value)                                                           \
+  do {                                                                                             \
+    metric_header(buf, size, &length, name, "gauge", help);                                        \
+    metrics_append(buf, size, &length, "shairport_sync_" name " " format "\n", value);             \
+  } while (0)
+
+#define counter(name, help, value)                                                                 \
+  do {                                                                                             \
+    metric_header(buf, size, &length, name, "counter", help);                                      \
+    metrics_append(buf, size, &length, "shairport_sync_" name " %" PRIu64 "\n", (uint64_t)value); \
+  } while (0)
+
+static size_t metrics_format(char *buf, size_t size) {
+  metrics_set m;
+  metrics_read(&m);
+  size_t length = 0;
+  gauge("playing", "Whether a play session is in progress.", "%d", m.playing);
+  gauge("sync_error_seconds", "The latest synchronisation error, positive if the output is late.",
+        "%.6f", m.last_sync_error);
+  gauge("correction_ppm", "The net correction made to the output, averaged.", "%.2f",
+        m.correction_ppm);
+  gauge("insertions_and_deletions_ppm",
+        "Frames inserted plus frames deleted to correct the output, averaged.", "%.2f",
+        m.insertions_and_deletions_ppm);
+  gauge("source_clock_drift_ppm", "The drift of the source clock relative to the local one.",
+        "%.2f", m.source_drift_ppm);
+  gauge("input_frame_rate", "The rate at which frames arrive from the source.", "%.2f",
+        m.input_frame_rate);
+  gauge("output_frame_rate", "The measured rate at which the output device plays frames.", "%.2f",
+        m.output_frame_rate);
+  gauge("minimum_dac_queue_frames",
+        "The least number of frames held in the output device in the last interval.",
+        "%" PRId64, m.minimum_dac_queue_size);
+  gauge("minimum_buffer_occupancy_packets",
+        "The least number of packets buffered in the last interval.", "%" PRId32,
+        m.minimum_buffer_occupancy);
+  gauge("maximum_buffer_occupancy_packets",
+        "The most packets buffered in the last interval.", "%" PRId32,
+        m.maximum_buffer_occupancy);
+  gauge("soxr_mean_execution_seconds", "The mean time taken by a soxr interpolation.", "%.9f",
+        m.soxr_mean_execution_time);
+  gauge("soxr_maximum_execution_seconds", "The longest time taken by a soxr interpolation.",
+        "%.9f", m.soxr_maximum_execution_time);
+
+  counter("packets_total", "Audio packets played.", m.totals.packets);
+  counter("missing_packets_total", "Audio packets that never arrived.",
+          m.totals.missing_packets);
+  counter("late_packets_total", "Audio packets that arrived late but in time to be played.",
+          m.totals.late_packets);
+  counter("too_late_packets_total", "Audio packets that arrived too late to be played.",
+          m.totals.too_late_packets);
+  counter("resend_requests_total", "Requests to the source to resend packets.",
+          m.totals.resend_requests);
+  counter("frames_inserted_total", "Frames inserted to correct the timing.",
+          m.totals.frames_inserted);
+  counter("frames_deleted_total", "Frames deleted to correct the timing.",
+          m.totals.frames_deleted);
+  counter("underruns_total", "Times the output device ran out of frames.",
+          __atomic_load_n(&event_count[metrics_event_underrun], __ATOMIC_RELAXED));
+  counter("resyncs_total", "Times synchronisation was lost and re-established.",
+          __atomic_load_n(&event_count[metrics_event_resync], __ATOMIC_RELAXED));
+  counter("play_sessions_total", "Play sessions started.",
+          __atomic_load_n(&event_count[metrics_event_play_session], __ATOMIC_RELAXED));
+
+  metric_header(buf, size, &length, "absolute_sync_error_seconds", "histogram",
+                "The size of the synchronisation error of each packet played.");
+  uint64_t cumulative = 0;
+  int i;
+  for (i = 0; i < METRICS_SYNC_ERROR_BUCKETS; i++) {
+    cumulative += m.sync_error_bucket[i];
+    metrics_append(buf, size, &length,
+                   "shairport_sync_absolute_sync_error_seconds_bucket{le=\"%g\"} %" PRIu64 "\n",
+                   sync_error_bucket_bound[i], cumulative);
+  }
+  metrics_append(buf, size, &length,
+                 "shairport_sync_absolute_sync_error_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\n"
+                 "shairport_sync_absolute_sync_error_seconds_sum %.6f\n"
+                 "shairport_sync_absolute_sync_error_seconds_count %" PRIu64 "\n",
+                 m.sync_error_count, m.sync_error_sum, m.sync_error_count);
+  return length;
+}
+
+static void metrics_write_all(int fd, const char *buf, size_t length) {
+  while (length) {
+    ssize_t n = send(fd, buf, length, 0); // SIGPIPE is ignored, so a closed socket is an error;
+    if (n <= 0) {
+      if ((n < 0) && (errno == EINTR))
+        continue;
+      debug(2, "metrics: error sending a reply.");
+      return;
+    }
+    buf += n;
+    length -= n;
+  }
+}
+
+static void metrics_serve(int fd) {
+  char request[1024];
+  size_t got = 0;
+  // read as far as the end of the headers -- nothing after them is wanted
+  while (got < sizeof(request) - 1) {
+    ssize_t n = recv(fd, request + got, sizeof(request) - 1 - got, 0);
+    if (n <= 0)
+      break;
+    got += n;
+    request[got] = '\0';
+    if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+      break;
+  }
+  request[got] = '\0';
+  char body[8192];
+  char header[256];
+  size_t body_length = 0;
+  const char *status = "200 OK";
+  if ((strncmp(request, "GET /metrics ", 13) == 0) || (strncmp(request, "GET / ", 6) == 0)) {
+    body_length = metrics_format(body, sizeof(body));
+    if (body_length >= sizeof(body))
+      body_length = sizeof(body) - 1;
+  } else {
+    status = "404 Not Found";
+  }
+  int header_length =
+      snprintf(header, sizeof(header),
+               "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+               "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+               status, body_length);
+  metrics_write_all(fd, header, header_length);
+  if (body_length)
+    metrics_write_all(fd, body, body_length);
+}
+
+static void metrics_thread_cleanup_handler(__attribute__((unused)) void *arg) {
+  if (metrics_socket >= 0)
+    close(metrics_socket);
+  metrics_socket = -1;
+}
+
+static void *metrics_thread_code(__attribute__((unused)) void *arg) {
+  thread_set_name("metrics");
+  pthread_cleanup_push(metrics_thread_cleanup_handler, NULL);
+  while (1) {
+    int fd = accept(metrics_socket, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR) {
+        debug(1, "metrics: error %d accepting a connection.", errno);
+        usleep(100000);
+      }
+      continue;
+    }
+    // don't let a slow client hold things up for long
+    struct timeval timeout = {2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+    metrics_serve(fd);
+    close(fd);
+    pthread_setcancelstate(oldState, NULL);
+  }
+  pthread_cleanup_pop(1);
+  pthread_exit(NULL);
+}
+
+void metrics_start(int port) {
+  int fd = -1, yes = 1, no = 0;
+#ifdef AF_INET6
+  fd = socket(AF_INET6, SOCK_STREAM, 0);
+  if (fd >= 0) {
+    struct sockaddr_in6 address;
+    memset(&address, 0, sizeof(address));
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(port);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no)); // take IPv4 connections too
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+#endif
+  if (fd < 0) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0) {
+      struct sockaddr_in address;
+      memset(&address, 0, sizeof(address));
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = htonl(INADDR_ANY);
+      address.sin_port = htons(port);
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+      if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(fd);
+        fd = -1;
+      }
+    }
+  }
+  if ((fd < 0) || (listen(fd, 4) != 0)) {
+    warn("metrics: can not listen on port %d -- metrics will not be available.", port);
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  metrics_socket = fd;
+  if (pthread_create(&metrics_thread, NULL, metrics_thread_code, NULL) == 0) {
+    metrics_running = 1;
+    debug(1, "metrics available on port %d.", port);
+  } else {
+    warn("metrics: can not create the metrics thread.");
+    close(fd);
+    metrics_socket = -1;
+  }
+}
+
+void metrics_stop() {
+  if (metrics_running) {
+    pthread_cancel(metrics_thread);
+    pthread_join(metrics_thread, NULL);
+    metrics_running = 0;
+    debug(2, "metrics stopped");
+  }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+// Metrics for monitoring, served in the Prometheus text format over HTTP.
+// The player thread gathers them in a private copy, without any locking or atomic operation,
+// and publishes that copy at each statistics interval. The server thread reads the published
+// copy, trying again if it was being published at the time, so neither ever waits for the other.
+// Events seen by other threads, such as output underruns, are counted with atomic increments.
+
+#define METRICS_SYNC_ERROR_BUCKETS 8
+
+typedef enum {
+  metrics_event_underrun = 0, // the output device ran out of frames
+  metrics_event_resync,       // synchronisation was lost and re-established
+  metrics_event_play_session, // a play session started
+  metrics_number_of_events,
+} metrics_event;
+
+void metrics_start(int port); // start serving the metrics on this TCP port
+void metrics_stop();
+
+void metrics_count_event(metrics_event event); // may be called from any thread
+
+// the rest are to be called only by the player thread
+
+typedef struct {
+  uint64_t packets, missing_packets, late_packets, too_late_packets, resend_requests;
+  uint64_t frames_inserted, frames_deleted;
+} metrics_player_counts;
+
+void metrics_player_set_playing(int playing);
+// sync_error is in seconds, positive if the output is late
+void metrics_player_note_sync_error(double sync_error);
+// call this as a play session starts, before its counts are first given
+void metrics_player_start_session();
+// counts are the totals for the play session
+void metrics_player_set_counts(metrics_player_counts *counts);
+void metrics_player_set_rates(double input_frame_rate, double output_frame_rate,
+                              double source_drift_ppm, double correction_ppm,
+                              double insertions_and_deletions_ppm);
+// the least the output device held in the interval, in frames, and the most and least buffered
+// packets
+void metrics_player_set_queues(int64_t minimum_dac_queue_size, int32_t minimum_buffer_occupancy,
+                               int32_t maximum_buffer_occupancy);
+void metrics_player_set_soxr_execution_time(double mean, double maximum); // seconds
+void metrics_player_publish();
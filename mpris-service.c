@@ -61,44 +61,50 @@ double mpris_volume_to_airplay_volume(double sp) {
   return sp;
 }
 
-void mpris_metadata_watcher(struct metadata_bundle *argc, __attribute__((unused)) void *userdata) {
+// only the properties that have changed are set, so that clients aren't woken for nothing
+static void mpris_publish_changes(struct metadata_bundle *argc, uint64_t changes) {
   // debug(1, "MPRIS metadata watcher called");
   char response[100];
-  media_player2_player_set_volume(mprisPlayerPlayerSkeleton,
-                                  airplay_volume_to_mpris_volume(argc->airplay_volume));
-  switch (argc->repeat_status) {
-  case RS_NOT_AVAILABLE:
-    strcpy(response, "Not Available");
-    break;
-  case RS_OFF:
-    strcpy(response, "None");
-    break;
-  case RS_ONE:
-    strcpy(response, "Track");
-    break;
-  case RS_ALL:
-    strcpy(response, "Playlist");
-    break;
-  }
+  if (changes & MHC_airplay_volume)
+    media_player2_player_set_volume(mprisPlayerPlayerSkeleton,
+                                    airplay_volume_to_mpris_volume(argc->airplay_volume));
+  if (changes & MHC_repeat_status) {
+    switch (argc->repeat_status) {
+    case RS_NOT_AVAILABLE:
+      strcpy(response, "Not Available");
+      break;
+    case RS_OFF:
+      strcpy(response, "None");
+      break;
+    case RS_ONE:
+      strcpy(response, "Track");
+      break;
+    case RS_ALL:
+      strcpy(response, "Playlist");
+      break;
+    }
 
-  media_player2_player_set_loop_status(mprisPlayerPlayerSkeleton, response);
-
-  switch (argc->player_state) {
-  case PS_NOT_AVAILABLE:
-    strcpy(response, "Not Available");
-    break;
-  case PS_STOPPED:
-    strcpy(response, "Stopped");
-    break;
-  case PS_PAUSED:
-    strcpy(response, "Paused");
-    break;
-  case PS_PLAYING:
-    strcpy(response, "Playing");
-    break;
+    media_player2_player_set_loop_status(mprisPlayerPlayerSkeleton, response);
   }
 
-  media_player2_player_set_playback_status(mprisPlayerPlayerSkeleton, response);
+  if (changes & MHC_player_state) {
+    switch (argc->player_state) {
+    case PS_NOT_AVAILABLE:
+      strcpy(response, "Not Available");
+      break;
+    case PS_STOPPED:
+      strcpy(response, "Stopped");
+      break;
+    case PS_PAUSED:
+      strcpy(response, "Paused");
+      break;
+    case PS_PLAYING:
+      strcpy(response, "Playing");
+      break;
+    }
+
+    media_player2_player_set_playback_status(mprisPlayerPlayerSkeleton, response);
+  }
 
   /*
     switch (argc->shuffle_state) {
@@ -116,20 +122,25 @@ void mpris_metadata_watcher(struct metadata_bundle *argc, __attribute__((unused)
      media_player2_player_set_shuffle_status(mprisPlayerPlayerSkeleton, response);
   */
 
-  switch (argc->shuffle_status) {
-  case SS_NOT_AVAILABLE:
-    media_player2_player_set_shuffle(mprisPlayerPlayerSkeleton, FALSE);
-    break;
-  case SS_OFF:
-    media_player2_player_set_shuffle(mprisPlayerPlayerSkeleton, FALSE);
-    break;
-  case SS_ON:
-    media_player2_player_set_shuffle(mprisPlayerPlayerSkeleton, TRUE);
-    break;
-  default:
-    debug(1, "This should never happen.");
+  if (changes & MHC_shuffle_status) {
+    switch (argc->shuffle_status) {
+    case SS_NOT_AVAILABLE:
+      media_player2_player_set_shuffle(mprisPlayerPlayerSkeleton, FALSE);
+      break;
+    case SS_OFF:
+      media_player2_player_set_shuffle(mprisPlayerPlayerSkeleton, FALSE);
+      break;
+    case SS_ON:
+      media_player2_player_set_shuffle(mprisPlayerPlayerSkeleton, TRUE);
+      break;
+    default:
+      debug(1, "This should never happen.");
+    }
   }
 
+  if ((changes & MHC_track_metadata) == 0)
+    return;
+
   /*
     // Add the TrackID if we have one
     // Build the Track ID from the 16-byte item_composite_id in hex prefixed by
@@ -226,6 +237,36 @@ void mpris_metadata_watcher(struct metadata_bundle *argc, __attribute__((unused)
   media_player2_player_set_metadata(mprisPlayerPlayerSkeleton, dict);
 }
 
+// Changes noted by the watcher are published in batches on the GLib loop's thread, just as in
+// dbus-service.c -- see there for why.
+static uint64_t pending_changes = 0; // MHC_* bits
+static int publication_scheduled = 0;
+
+static gboolean publish_pending_changes(__attribute__((unused)) gpointer data) {
+  // clear this first, so that anything noted from now on schedules another publication
+  __atomic_store_n(&publication_scheduled, 0, __ATOMIC_SEQ_CST);
+  uint64_t changes = __atomic_exchange_n(&pending_changes, 0, __ATOMIC_SEQ_CST);
+  if (changes != 0) {
+    metadata_hub_read_prolog();
+    mpris_publish_changes(&metadata_store, changes);
+    metadata_hub_read_epilog();
+    // send the changes now rather than when the skeleton's own idle source gets round to it
+    g_dbus_interface_skeleton_flush(G_DBUS_INTERFACE_SKELETON(mprisPlayerPlayerSkeleton));
+  }
+  return G_SOURCE_REMOVE;
+}
+
+void mpris_metadata_watcher(__attribute__((unused)) struct metadata_bundle *argc,
+                            uint64_t changes, __attribute__((unused)) void *userdata) {
+  __atomic_fetch_or(&pending_changes, changes, __ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n(&publication_scheduled, 1, __ATOMIC_SEQ_CST) == 0) {
+    GSource *source = g_idle_source_new();
+    g_source_set_callback(source, publish_pending_changes, NULL, NULL);
+    g_source_attach(source, NULL); // the default context, which the D-Bus thread's loop runs
+    g_source_unref(source);
+  }
+}
+
 static gboolean on_handle_quit(MediaPlayer2 *skeleton, GDBusMethodInvocation *invocation,
                                __attribute__((unused)) gpointer user_data) {
   debug(1, "quit requested (MPRIS interface).");
@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,6 +20,62 @@ struct mosquitto *global_mosq = NULL;
 char *topic = NULL;
 int connected = 0;
 
+// The parsed items, each with its topic, made once when the client is initialised. The ones with
+// a state_name are also collected into the state message, if that's enabled.
+typedef struct {
+  uint32_t type;
+  uint32_t code;
+  const char *name;
+  const char *state_name;
+  char *topic;
+} mqtt_parsed_item;
+
+static mqtt_parsed_item parsed_items[] = {
+    {'core', 'asar', "artist", "artist", NULL},
+    {'core', 'asal', "album", "album", NULL},
+    {'core', 'minm', "title", "title", NULL},
+    {'core', 'asgn', "genre", "genre", NULL},
+    {'core', 'asfm', "format", "format", NULL},
+    {'ssnc', 'asal', "songalbum", "songalbum", NULL},
+    {'ssnc', 'pvol', "volume", "volume", NULL},
+    {'ssnc', 'clip', "client_ip", "client_ip", NULL},
+    {'ssnc', 'abeg', "active_start", NULL, NULL},
+    {'ssnc', 'aend', "active_end", NULL, NULL},
+    {'ssnc', 'pbeg', "play_start", NULL, NULL},
+    {'ssnc', 'pend', "play_end", NULL, NULL},
+    {'ssnc', 'pfls', "play_flush", NULL, NULL},
+    {'ssnc', 'prsm', "play_resume", NULL, NULL},
+    {'ssnc', 'rcvs', "receive_statistics", NULL, NULL},
+    {'ssnc', 'stgt', "stage_timings", NULL, NULL},
+};
+
+#define MQTT_PARSED_ITEMS (sizeof(parsed_items) / sizeof(mqtt_parsed_item))
+
+static char *state_topic = NULL;
+static char *cover_topic = NULL;
+
+// The state, published as a single retained JSON message whenever it changes -- a track's
+// metadata, which comes as a bundle between 'mdst' and 'mden' items, is published once at the end
+// of the bundle rather than item by item.
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *state_values[MQTT_PARSED_ITEMS];
+static int state_active = 0;
+static int state_playing = 0;
+static int state_in_bundle = 0;
+static int state_changed = 0;
+static char *state_message = NULL;
+static size_t state_message_size = 0;
+
+// The cover art, published on its own topic by a thread of its own so that a large picture
+// doesn't hold up the metadata. Only the latest picture is kept -- an older one waiting to go is
+// of no interest once a newer one has arrived.
+static pthread_t cover_thread;
+static int cover_thread_running = 0;
+static pthread_mutex_t cover_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cover_available = PTHREAD_COND_INITIALIZER;
+static char *cover_data = NULL;
+static uint32_t cover_length = 0;
+
 // mosquitto logging
 void _cb_log(__attribute__((unused)) struct mosquitto *mosq, __attribute__((unused)) void *userdata,
              int level, const char *str) {
@@ -88,17 +145,29 @@ void on_connect(struct mosquitto *mosq, __attribute__((unused)) void *userdata,
     snprintf(remotetopic, strlen(config.mqtt_topic) + 8, "%s/remote", config.mqtt_topic);
     mosquitto_subscribe(mosq, NULL, remotetopic, 0);
   }
+  // the broker may have lost the retained state while we were away
+  if (config.mqtt_publish_state) {
+    pthread_mutex_lock(&state_lock);
+    state_changed = 1;
+    pthread_mutex_unlock(&state_lock);
+    mqtt_publish_state();
+  }
 }
 
-// helper function to publish under a topic and automatically append the main topic
-void mqtt_publish(char *topic, char *data, uint32_t length) {
-  char fulltopic[strlen(config.mqtt_topic) + strlen(topic) + 3];
-  snprintf(fulltopic, strlen(config.mqtt_topic) + strlen(topic) + 2, "%s/%s", config.mqtt_topic,
-           topic);
-  debug(2, "[MQTT]: publishing under %s", fulltopic);
+static char *make_topic(const char *subtopic) {
+  size_t length = strlen(config.mqtt_topic) + strlen(subtopic) + 2;
+  char *fulltopic = malloc(length);
+  if (fulltopic == NULL)
+    die("[MQTT]: could not allocate a topic string");
+  snprintf(fulltopic, length, "%s/%s", config.mqtt_topic, subtopic);
+  return fulltopic;
+}
 
+static void publish_to_full_topic(const char *fulltopic, const void *data, uint32_t length,
+                                  int qos, int retain) {
+  debug(2, "[MQTT]: publishing under %s", fulltopic);
   int rc;
-  if ((rc = mosquitto_publish(global_mosq, NULL, fulltopic, length, data, 0, 0)) !=
+  if ((rc = mosquitto_publish(global_mosq, NULL, fulltopic, length, data, qos, retain)) !=
       MOSQ_ERR_SUCCESS) {
     switch (rc) {
     case MOSQ_ERR_NO_CONN:
@@ -111,8 +180,188 @@ void mqtt_publish(char *topic, char *data, uint32_t length) {
   }
 }
 
+// helper function to publish under a topic and automatically append the main topic
+void mqtt_publish(char *topic, char *data, uint32_t length) {
+  char fulltopic[strlen(config.mqtt_topic) + strlen(topic) + 3];
+  snprintf(fulltopic, strlen(config.mqtt_topic) + strlen(topic) + 2, "%s/%s", config.mqtt_topic,
+           topic);
+  publish_to_full_topic(fulltopic, data, length, 0, 0);
+}
+
+// append the characters to the state message as a JSON string, making room as needed
+static void state_message_append(size_t *position, const char *s, size_t length, int quote) {
+  size_t needed = *position + length * 6 + 3; // every character escaped, quotes and a NUL
+  if (needed > state_message_size) {
+    size_t new_size = state_message_size ? state_message_size : 1024;
+    while (new_size < needed)
+      new_size *= 2;
+    char *new_message = realloc(state_message, new_size);
+    if (new_message == NULL)
+      die("[MQTT]: could not allocate the state message");
+    state_message = new_message;
+    state_message_size = new_size;
+  }
+  char *p = state_message + *position;
+  if (quote)
+    *p++ = '"';
+  size_t i;
+  for (i = 0; i < length; i++) {
+    unsigned char c = s[i];
+    if ((quote) && ((c == '"') || (c == '\\'))) {
+      *p++ = '\\';
+      *p++ = c;
+    } else if ((quote) && (c < 0x20)) {
+      p += snprintf(p, 7, "\\u%04x", c);
+    } else {
+      *p++ = c;
+    }
+  }
+  if (quote)
+    *p++ = '"';
+  *p = '\0';
+  *position = p - state_message;
+}
+
+// publish the state, if it has changed, as a single retained message
+void mqtt_publish_state() {
+  pthread_mutex_lock(&state_lock);
+  if ((state_changed) && (state_in_bundle == 0) && (global_mosq != NULL) && (connected == 1)) {
+    size_t position = 0;
+    state_message_append(&position, "{\"active\":", strlen("{\"active\":"), 0);
+    const char *b = state_active ? "true" : "false";
+    state_message_append(&position, b, strlen(b), 0);
+    state_message_append(&position, ",\"playing\":", strlen(",\"playing\":"), 0);
+    b = state_playing ? "true" : "false";
+    state_message_append(&position, b, strlen(b), 0);
+    unsigned int i;
+    for (i = 0; i < MQTT_PARSED_ITEMS; i++) {
+      if ((parsed_items[i].state_name != NULL) && (state_values[i] != NULL)) {
+        state_message_append(&position, ",", 1, 0);
+        state_message_append(&position, parsed_items[i].state_name,
+                             strlen(parsed_items[i].state_name), 1);
+        state_message_append(&position, ":", 1, 0);
+        state_message_append(&position, state_values[i], strlen(state_values[i]), 1);
+      }
+    }
+    state_message_append(&position, "}", 1, 0);
+    publish_to_full_topic(state_topic, state_message, position, 1, 1);
+    state_changed = 0;
+  }
+  pthread_mutex_unlock(&state_lock);
+}
+
+static void set_state_value(unsigned int item, const char *data, uint32_t length) {
+  if ((state_values[item] == NULL) || (strlen(state_values[item]) != length) ||
+      (memcmp(state_values[item], data, length) != 0)) {
+    free(state_values[item]);
+    state_values[item] = malloc(length + 1);
+    if (state_values[item] != NULL) {
+      memcpy(state_values[item], data, length);
+      state_values[item][length] = '\0';
+    }
+    state_changed = 1;
+  }
+}
+
+static void set_state_flag(int *flag, int value) {
+  if (*flag != value) {
+    *flag = value;
+    state_changed = 1;
+  }
+}
+
+static void update_state(uint32_t type, uint32_t code, char *data, uint32_t length) {
+  pthread_mutex_lock(&state_lock);
+  if (type == 'ssnc') {
+    switch (code) {
+    case 'mdst': {
+      // a new track's metadata is coming -- forget the old track's, so that anything the
+      // new one doesn't have isn't left over from the old one
+      state_in_bundle = 1;
+      unsigned int i;
+      for (i = 0; i < MQTT_PARSED_ITEMS; i++)
+        if ((parsed_items[i].type == 'core') && (state_values[i] != NULL)) {
+          free(state_values[i]);
+          state_values[i] = NULL;
+          state_changed = 1;
+        }
+    } break;
+    case 'mden':
+      state_in_bundle = 0;
+      break;
+    case 'abeg':
+      set_state_flag(&state_active, 1);
+      break;
+    case 'aend':
+      set_state_flag(&state_active, 0);
+      set_state_flag(&state_playing, 0);
+      break;
+    case 'pbeg':
+    case 'prsm':
+      set_state_flag(&state_playing, 1);
+      break;
+    case 'pend':
+    case 'pfls':
+      set_state_flag(&state_playing, 0);
+      break;
+    }
+  }
+  unsigned int i;
+  for (i = 0; i < MQTT_PARSED_ITEMS; i++)
+    if ((parsed_items[i].type == type) && (parsed_items[i].code == code) &&
+        (parsed_items[i].state_name != NULL))
+      set_state_value(i, data, length);
+  pthread_mutex_unlock(&state_lock);
+  mqtt_publish_state();
+}
+
+static void cover_thread_cleanup_handler(__attribute__((unused)) void *arg) {
+  pthread_mutex_unlock(&cover_lock);
+}
+
+static void *cover_thread_function(__attribute__((unused)) void *arg) {
+  thread_set_name("mqtt-cover");
+  while (1) {
+    pthread_mutex_lock(&cover_lock);
+    pthread_cleanup_push(cover_thread_cleanup_handler, NULL);
+    while (cover_data == NULL)
+      pthread_cond_wait(&cover_available, &cover_lock);
+    pthread_cleanup_pop(0);
+    char *data = cover_data;
+    uint32_t length = cover_length;
+    cover_data = NULL;
+    pthread_mutex_unlock(&cover_lock);
+    // the state message is retained, so the cover that goes with it is too
+    publish_to_full_topic(cover_topic, data, length, 0, config.mqtt_publish_state);
+    free(data);
+  }
+  pthread_exit(NULL);
+}
+
+static void queue_cover(char *data, uint32_t length) {
+  if (cover_thread_running == 0) {
+    publish_to_full_topic(cover_topic, data, length, 0, config.mqtt_publish_state);
+  } else {
+    char *copy = malloc(length);
+    if (copy == NULL) {
+      debug(1, "[MQTT]: could not allocate memory for the cover art -- not published");
+      return;
+    }
+    memcpy(copy, data, length);
+    pthread_mutex_lock(&cover_lock);
+    free(cover_data); // an older one that hasn't been published yet
+    cover_data = copy;
+    cover_length = length;
+    pthread_cond_signal(&cover_available);
+    pthread_mutex_unlock(&cover_lock);
+  }
+}
+
 // handler for incoming metadata
 void mqtt_process_metadata(uint32_t type, uint32_t code, char *data, uint32_t length) {
+  // keep the state up to date even while disconnected, so that it's right when we reconnect
+  if (config.mqtt_publish_state)
+    update_state(type, code, data, length);
   if (global_mosq == NULL || connected != 1) {
     debug(3, "[MQTT]: Client not connected, skipping metadata handling");
     return;
@@ -128,61 +377,17 @@ void mqtt_process_metadata(uint32_t type, uint32_t code, char *data, uint32_t le
     mqtt_publish(topic, data, length);
   }
   if (config.mqtt_publish_parsed) {
-    if (type == 'core') {
-      switch (code) {
-      case 'asar':
-        mqtt_publish("artist", data, length);
-        break;
-      case 'asal':
-        mqtt_publish("album", data, length);
-        break;
-      case 'minm':
-        mqtt_publish("title", data, length);
-        break;
-      case 'asgn':
-        mqtt_publish("genre", data, length);
-        break;
-      case 'asfm':
-        mqtt_publish("format", data, length);
+    unsigned int i;
+    for (i = 0; i < MQTT_PARSED_ITEMS; i++)
+      if ((parsed_items[i].type == type) && (parsed_items[i].code == code)) {
+        publish_to_full_topic(parsed_items[i].topic, data, length, 0, 0);
         break;
       }
-    } else if (type == 'ssnc') {
-      switch (code) {
-      case 'asal':
-        mqtt_publish("songalbum", data, length);
-        break;
-      case 'pvol':
-        mqtt_publish("volume", data, length);
-        break;
-      case 'clip':
-        mqtt_publish("client_ip", data, length);
-        break;
-      case 'abeg':
-        mqtt_publish("active_start", data, length);
-        break;
-      case 'aend':
-        mqtt_publish("active_end", data, length);
-        break;
-      case 'pbeg':
-        mqtt_publish("play_start", data, length);
-        break;
-      case 'pend':
-        mqtt_publish("play_end", data, length);
-        break;
-      case 'pfls':
-        mqtt_publish("play_flush", data, length);
-        break;
-      case 'prsm':
-        mqtt_publish("play_resume", data, length);
-        break;
-      case 'PICT':
-        if (config.mqtt_publish_cover) {
-          mqtt_publish("cover", data, length);
-        }
-        break;
-      }
-    }
   }
+  if ((config.mqtt_publish_cover) &&
+      ((config.mqtt_publish_parsed) || (config.mqtt_publish_state)) && (type == 'ssnc') &&
+      (code == 'PICT'))
+    queue_cover(data, length);
 
   return;
 }
@@ -194,6 +399,19 @@ int initialise_mqtt() {
     return 0;
   }
   int keepalive = 60;
+  unsigned int i;
+  for (i = 0; i < MQTT_PARSED_ITEMS; i++)
+    parsed_items[i].topic = make_topic(parsed_items[i].name);
+  state_topic = make_topic("state");
+  cover_topic = make_topic("cover");
+  if ((config.mqtt_publish_cover) &&
+      ((config.mqtt_publish_parsed) || (config.mqtt_publish_state))) {
+    if (pthread_create(&cover_thread, NULL, cover_thread_function, NULL) == 0)
+      cover_thread_running = 1;
+    else
+      debug(1, "[MQTT]: Failed to create the cover art thread -- the cover will be published "
+               "from the metadata thread.");
+  }
   mosquitto_lib_init();
   if (!(global_mosq = mosquitto_new(config.service_name, true, NULL))) {
     die("[MQTT]: FATAL: Could not create mosquitto object! %d\n", global_mosq);
@@ -0,0 +1,243 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "packet_capture.h"
+#include "player.h"
+#include "rtp.h"
+#include "rtsp.h"
+
+#define PACKET_CAPTURE_MAGIC "SPSRTPC1"
+
+typedef struct {
+  char magic[8];
+  int32_t encrypted;
+  int32_t type; // an audio_stream_type
+  uint8_t aesiv[16], aeskey[16];
+  int32_t fmtp[12];
+  uint32_t max_frames_per_packet, input_num_channels, input_bit_depth, input_rate;
+  int32_t input_bytes_per_frame;
+  uint32_t latency, minimum_latency, maximum_latency;
+  int32_t airplay_version;
+} packet_capture_header;
+
+typedef struct {
+  uint64_t time; // when it arrived, or, for a timing request, when it was sent
+  uint32_t length;
+  uint32_t kind; // a packet_capture_kind
+} packet_capture_record;
+
+typedef struct {
+  FILE *file;
+  pthread_mutex_t lock; // the receivers each write their own packets
+  uint64_t records;
+} packet_capture;
+
+void packet_capture_start(rtsp_conn_info *conn) {
+  if ((config.diagnostic_packet_capture_file == NULL) || (conn->packet_capture != NULL) ||
+      (conn->packet_replay != 0))
+    return;
+  packet_capture *capture = calloc(1, sizeof(packet_capture));
+  if (capture == NULL) {
+    warn("Can't allocate memory for a packet capture.");
+    return;
+  }
+  // the capture holds the session's key, so only the owner may read it, even if it was there
+  // before
+  int fd = open(config.diagnostic_packet_capture_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd >= 0) {
+    fchmod(fd, 0600);
+    capture->file = fdopen(fd, "wb");
+    if (capture->file == NULL)
+      close(fd);
+  }
+  if (capture->file == NULL) {
+    char errorstring[1024];
+    strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+    warn("Can't open \"%s\" for a packet capture: \"%s\".", config.diagnostic_packet_capture_file,
+         errorstring);
+    free(capture);
+    return;
+  }
+  pthread_mutex_init(&capture->lock, NULL);
+
+  packet_capture_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PACKET_CAPTURE_MAGIC, sizeof(header.magic));
+  header.encrypted = conn->stream.encrypted;
+  header.type = conn->stream.type;
+  memcpy(header.aesiv, conn->stream.aesiv, sizeof(header.aesiv));
+  memcpy(header.aeskey, conn->stream.aeskey, sizeof(header.aeskey));
+  memcpy(header.fmtp, conn->stream.fmtp, sizeof(header.fmtp));
+  header.max_frames_per_packet = conn->max_frames_per_packet;
+  header.input_num_channels = conn->input_num_channels;
+  header.input_bit_depth = conn->input_bit_depth;
+  header.input_rate = conn->input_rate;
+  header.input_bytes_per_frame = conn->input_bytes_per_frame;
+  header.latency = conn->latency;
+  header.minimum_latency = conn->minimum_latency;
+  header.maximum_latency = conn->maximum_latency;
+  header.airplay_version = conn->AirPlayVersion;
+  if (fwrite(&header, sizeof(header), 1, capture->file) != 1)
+    warn("Error writing the packet capture header to \"%s\".",
+         config.diagnostic_packet_capture_file);
+  inform("Connection %d: capturing RTP packets to \"%s\".", conn->connection_number,
+         config.diagnostic_packet_capture_file);
+  conn->packet_capture = capture;
+}
+
+void packet_capture_stop(rtsp_conn_info *conn) {
+  packet_capture *capture = conn->packet_capture;
+  if (capture != NULL) {
+    conn->packet_capture = NULL;
+    fclose(capture->file);
+    debug(1, "Connection %d: packet capture of %" PRIu64 " records finished.",
+          conn->connection_number, capture->records);
+    pthread_mutex_destroy(&capture->lock);
+    free(capture);
+  }
+}
+
+static void capture_record(packet_capture *capture, packet_capture_kind kind, uint64_t time,
+                           const void *data, uint32_t length) {
+  packet_capture_record record;
+  record.time = time;
+  record.length = length;
+  record.kind = kind;
+  pthread_mutex_lock(&capture->lock);
+  if ((fwrite(&record, sizeof(record), 1, capture->file) != 1) ||
+      ((length != 0) && (fwrite(data, length, 1, capture->file) != 1)))
+    debug(1, "Error writing to the packet capture.");
+  capture->records++;
+  pthread_mutex_unlock(&capture->lock);
+}
+
+void packet_capture_datagrams(rtsp_conn_info *conn, packet_capture_kind kind,
+                              const udp_datagram *datagrams, int number_of_datagrams) {
+  packet_capture *capture = conn->packet_capture;
+  if (capture != NULL) {
+    int i;
+    for (i = 0; i < number_of_datagrams; i++)
+      if (datagrams[i].length >= 0)
+        capture_record(capture, kind, datagrams[i].arrival_time, datagrams[i].data,
+                       datagrams[i].length);
+  }
+}
+
+void packet_capture_timing_request_sent(rtsp_conn_info *conn, uint64_t departure_time) {
+  packet_capture *capture = conn->packet_capture;
+  if (capture != NULL)
+    capture_record(capture, packet_capture_timing_request, departure_time, NULL, 0);
+}
+
+// wait until the (speeded up) clock reaches the time given
+static void replay_wait_until(uint64_t time_ns, int speed) {
+  uint64_t time_now_ns = get_absolute_time_in_ns();
+  if (time_ns > time_now_ns) {
+    uint64_t real_wait_ns = (time_ns - time_now_ns) / speed;
+    struct timespec wait;
+    wait.tv_sec = real_wait_ns / 1000000000;
+    wait.tv_nsec = real_wait_ns % 1000000000;
+    nanosleep(&wait, NULL);
+  }
+}
+
+void packet_replay(const char *pathname, int speed) {
+  FILE *file = fopen(pathname, "rb");
+  if (file == NULL)
+    die("Can't open the packet capture \"%s\".", pathname);
+  packet_capture_header header;
+  if ((fread(&header, sizeof(header), 1, file) != 1) ||
+      (memcmp(header.magic, PACKET_CAPTURE_MAGIC, sizeof(header.magic)) != 0))
+    die("\"%s\" is not a packet capture.", pathname);
+
+  rtsp_conn_info *conn = calloc(1, sizeof(rtsp_conn_info));
+  if (conn == NULL)
+    die("Couldn't allocate memory for an rtsp_conn_info record.");
+  rtsp_conn_initialise_locks(conn);
+  rtp_initialise(conn);
+  conn->packet_replay = 1;
+  conn->stream.encrypted = header.encrypted;
+  conn->stream.type = header.type;
+  memcpy(conn->stream.aesiv, header.aesiv, sizeof(header.aesiv));
+  memcpy(conn->stream.aeskey, header.aeskey, sizeof(header.aeskey));
+  memcpy(conn->stream.fmtp, header.fmtp, sizeof(header.fmtp));
+  conn->max_frames_per_packet = header.max_frames_per_packet;
+  conn->input_num_channels = header.input_num_channels;
+  conn->input_bit_depth = header.input_bit_depth;
+  conn->input_rate = header.input_rate;
+  conn->input_bytes_per_frame = header.input_bytes_per_frame;
+  conn->latency = header.latency;
+  conn->minimum_latency = header.minimum_latency;
+  conn->maximum_latency = header.maximum_latency;
+  conn->AirPlayVersion = header.airplay_version;
+  conn->connection_ip_family = AF_INET;
+  snprintf(conn->client_ip_string, sizeof(conn->client_ip_string), "replay");
+  snprintf(conn->self_ip_string, sizeof(conn->self_ip_string), "replay");
+
+  // the receivers read the packets from these, just as they would from the network
+  int sockets[3][2];
+  int i;
+  for (i = 0; i < 3; i++)
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets[i]) != 0)
+      die("Can't make the sockets to replay a packet capture.");
+  conn->audio_socket = sockets[packet_capture_audio][0];
+  conn->control_socket = sockets[packet_capture_control][0];
+  conn->timing_socket = sockets[packet_capture_timing][0];
+  conn->rtp_running = 1;
+
+  inform("Replaying the packet capture \"%s\" at %d times real time.", pathname, speed);
+  set_clock_speed(speed);
+  uint64_t replay_start_time = get_absolute_time_in_ns();
+  player_play(conn);
+
+  packet_capture_record record;
+  uint8_t data[sizeof(((udp_datagram *)0)->data)];
+  uint64_t first_record_time = 0;
+  uint64_t records = 0;
+  uint64_t time_due = replay_start_time;
+  while (fread(&record, sizeof(record), 1, file) == 1) {
+    if ((record.length > sizeof(data)) ||
+        ((record.length != 0) && (fread(data, record.length, 1, file) != 1))) {
+      warn("The packet capture \"%s\" is truncated or corrupt -- replay stopped.", pathname);
+      break;
+    }
+    if (records == 0)
+      first_record_time = record.time;
+    time_due = replay_start_time + (record.time - first_record_time);
+    replay_wait_until(time_due, speed);
+    if (record.kind == packet_capture_timing_request) {
+      conn->departure_time = time_due; // as the timing sender would have set it
+    } else if (record.kind <= packet_capture_timing) {
+      if (send(sockets[record.kind][1], data, record.length, 0) < 0)
+        debug(1, "Error %d replaying a packet.", errno);
+    }
+    records++;
+  }
+  fclose(file);
+
+  // let what's in the buffer play out
+  uint64_t play_out_time = 1000000000;
+  if (conn->input_rate)
+    play_out_time += ((uint64_t)conn->latency * 1000000000) / conn->input_rate;
+  replay_wait_until(time_due + play_out_time, speed);
+  player_stop(conn);
+  for (i = 0; i < 3; i++) {
+    close(sockets[i][0]);
+    close(sockets[i][1]);
+  }
+  rtp_terminate(conn);
+  inform("Replayed %" PRIu64 " packets -- %.1f seconds of the session -- in %.1f seconds.",
+         records, (time_due - replay_start_time) * 0.000000001,
+         (time_due - replay_start_time) * 0.000000001 / speed);
+  free(conn);
+}
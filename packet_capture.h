@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "player.h"
+#include "udp_receive.h"
+
+// Capture of the RTP packets of a play session -- audio, control and timing, as they arrive,
+// with their arrival times, and the times timing requests were sent -- and replay of a capture
+// through the receivers and the player, as if it were arriving from the source again.
+//
+// A capture holds the stream's parameters from the ANNOUNCE, including the decryption key, and
+// then the packets, each with a record header. It's in the byte order of the host, and is meant
+// to be replayed by the same build of Shairport Sync on the same kind of machine.
+
+typedef enum {
+  packet_capture_audio = 0,
+  packet_capture_control,
+  packet_capture_timing,
+  packet_capture_timing_request, // a timing request was sent -- no data
+} packet_capture_kind;
+
+// start capturing the session's packets to the file given by the
+// diagnostics.capture_rtp_packets_to setting, if there is one. A new capture replaces an older one.
+void packet_capture_start(rtsp_conn_info *conn);
+void packet_capture_stop(rtsp_conn_info *conn);
+
+// record the datagrams just received of the given kind, if the session is being captured
+void packet_capture_datagrams(rtsp_conn_info *conn, packet_capture_kind kind,
+                              const udp_datagram *datagrams, int number_of_datagrams);
+void packet_capture_timing_request_sent(rtsp_conn_info *conn, uint64_t departure_time);
+
+// Replay a capture, speed times faster than real time, through the output device that has been
+// set up, and return when it has been played. The dummy backend makes a good output for this.
+void packet_replay(const char *pathname, int speed);
@@ -0,0 +1,343 @@
+#include "pipe_writer.h"
+#include "common.h"
+#include "realtime.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+// the most the writer thread takes out of the ring at a time
+#define PIPE_WRITER_CHUNK_SIZE 65536
+
+// how often to look for a reader, and to throw away audio if there isn't one
+#define PIPE_WRITER_IDLE_INTERVAL_US 100000
+
+void pipe_writer_parse_options(const char *section, int *buffered, double *buffer_length,
+                               pipe_writer_overrun_policy *overrun_policy) {
+  char path[64];
+  const char *str;
+  double dvalue;
+  if (config.cfg == NULL)
+    return;
+  snprintf(path, sizeof(path), "%s.buffered", section);
+  if (config_lookup_string(config.cfg, path, &str)) {
+    if (strcasecmp(str, "no") == 0)
+      *buffered = 0;
+    else if (strcasecmp(str, "yes") == 0)
+      *buffered = 1;
+    else
+      die("Invalid %s option choice \"%s\". It should be \"yes\" or \"no\"", path, str);
+  }
+  snprintf(path, sizeof(path), "%s.buffer_length_in_seconds", section);
+  if (config_lookup_float(config.cfg, path, &dvalue)) {
+    if (dvalue <= config.audio_backend_buffer_desired_length)
+      die("Invalid %s \"%f\". It must be greater than the audio_backend_buffer_desired_length "
+          "of %f seconds.",
+          path, dvalue, config.audio_backend_buffer_desired_length);
+    *buffer_length = dvalue;
+  }
+  snprintf(path, sizeof(path), "%s.overrun_policy", section);
+  if (config_lookup_string(config.cfg, path, &str)) {
+    if (strcasecmp(str, "drop_oldest") == 0)
+      *overrun_policy = pipe_writer_drop_oldest;
+    else if (strcasecmp(str, "block") == 0)
+      *overrun_policy = pipe_writer_block;
+    else if (strcasecmp(str, "pad_with_silence") == 0)
+      *overrun_policy = pipe_writer_pad_with_silence;
+    else
+      die("Invalid %s option choice \"%s\". It should be \"drop_oldest\", \"block\" or "
+          "\"pad_with_silence\"",
+          path, str);
+  }
+}
+
+// all of these are called with the mutex held
+
+static void ring_discard(pipe_writer *w, size_t bytes) {
+  if (bytes > w->used)
+    bytes = w->used;
+  w->head = (w->head + bytes) % w->ring_size;
+  w->used -= bytes;
+}
+
+static void ring_put(pipe_writer *w, const char *buf, size_t bytes) {
+  size_t tail = (w->head + w->used) % w->ring_size;
+  size_t first = w->ring_size - tail;
+  if (first > bytes)
+    first = bytes;
+  if (buf) {
+    memcpy(w->ring + tail, buf, first);
+    memcpy(w->ring, buf + first, bytes - first);
+  } else {
+    memset(w->ring + tail, 0, first);
+    memset(w->ring, 0, bytes - first);
+  }
+  w->used += bytes;
+}
+
+static void ring_get(pipe_writer *w, char *buf, size_t bytes) {
+  size_t first = w->ring_size - w->head;
+  if (first > bytes)
+    first = bytes;
+  memcpy(buf, w->ring + w->head, first);
+  memcpy(buf + first, w->ring, bytes - first);
+  ring_discard(w, bytes);
+}
+
+static void note_overrun(pipe_writer *w, size_t bytes) {
+  w->overrun_bytes += bytes;
+  if (w->overrun_reported == 0) {
+    debug(1, "%s: the reader isn't keeping up -- the buffer is full.", w->name);
+    w->overrun_reported = 1;
+  }
+}
+
+// with nobody to write to, throw away what would have been played since the last time
+static void discard_at_nominal_rate(pipe_writer *w) {
+  uint64_t time_now = get_absolute_time_in_ns();
+  if ((w->used == 0) && (w->chunk_remaining == 0)) {
+    w->time_of_last_discard = time_now;
+  } else {
+    uint64_t frames = ((time_now - w->time_of_last_discard) * w->rate) / 1000000000;
+    size_t bytes = frames * w->frame_bytes;
+    w->time_of_last_discard += (frames * 1000000000) / w->rate;
+    if (bytes > w->chunk_remaining) {
+      bytes -= w->chunk_remaining;
+      w->chunk_remaining = 0;
+      ring_discard(w, bytes);
+    } else {
+      w->chunk_remaining -= bytes;
+      w->chunk_offset += bytes;
+    }
+    pthread_cond_broadcast(&w->space_available);
+  }
+}
+
+static void *pipe_writer_thread_func(void *arg) {
+  pipe_writer *w = (pipe_writer *)arg;
+  thread_set_name("pipe-writer");
+  char errorstring[1024];
+  pthread_mutex_lock(&w->mutex);
+  while (w->stop_requested == 0) {
+    if ((w->fd == -1) && (w->pathname != NULL)) {
+      // see if a reader has appeared
+      int fd = open(w->pathname, O_WRONLY | O_NONBLOCK);
+      if (fd >= 0) {
+        debug(1, "%s: a reader has opened \"%s\".", w->name, w->pathname);
+        w->fd = fd;
+        w->fd_is_nonblocking = 1;
+      } else if (errno != ENXIO) {
+        strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+        debug(1, "%s: error %d (\"%s\") opening \"%s\".", w->name, errno, (char *)errorstring,
+              w->pathname);
+      }
+    }
+    if (w->fd == -1) {
+      discard_at_nominal_rate(w);
+      pthread_mutex_unlock(&w->mutex);
+      usleep(PIPE_WRITER_IDLE_INTERVAL_US);
+      pthread_mutex_lock(&w->mutex);
+      continue;
+    }
+
+    if (w->chunk_remaining == 0) {
+      while ((w->used == 0) && (w->stop_requested == 0))
+        pthread_cond_wait(&w->data_available, &w->mutex);
+      if (w->stop_requested)
+        break;
+      size_t bytes = w->used < w->chunk_size ? w->used : w->chunk_size;
+      ring_get(w, w->chunk, bytes);
+      w->chunk_offset = 0;
+      w->chunk_remaining = bytes;
+      pthread_cond_broadcast(&w->space_available);
+    }
+
+    int fd = w->fd;
+    uint64_t flush_count = w->flush_count;
+    char *p = w->chunk + w->chunk_offset;
+    size_t bytes = w->chunk_remaining;
+    if ((w->fd_is_nonblocking == 0) && (bytes > PIPE_BUF))
+      bytes = PIPE_BUF;
+    ssize_t rc = 0;
+    pthread_mutex_unlock(&w->mutex);
+
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    int pc = poll(&pfd, 1, PIPE_WRITER_IDLE_INTERVAL_US / 1000);
+    if ((pc > 0) && (pfd.revents & POLLOUT))
+      rc = write(fd, p, bytes);
+    else if ((pc > 0) && (pfd.revents & (POLLERR | POLLHUP))) {
+      rc = -1;
+      errno = EPIPE;
+    } else if (pc < 0)
+      rc = (errno == EINTR) ? 0 : -1;
+
+    pthread_mutex_lock(&w->mutex);
+    if ((rc > 0) && (flush_count == w->flush_count)) {
+      w->chunk_offset += rc;
+      w->chunk_remaining -= rc;
+    } else if ((rc < 0) && (errno != EAGAIN)) {
+      if (errno != EPIPE) {
+        strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+        debug(1, "%s: error %d (\"%s\") writing.", w->name, errno, (char *)errorstring);
+      }
+      if (w->pathname != NULL) {
+        // the reader has gone away -- wait for another one
+        debug(1, "%s: the reader of \"%s\" has gone away.", w->name, w->pathname);
+        close(w->fd);
+      } else {
+        debug(1, "%s: can not write any more -- the audio will be thrown away.", w->name);
+      }
+      w->fd = -1;
+      w->time_of_last_discard = get_absolute_time_in_ns();
+    }
+  }
+  pthread_mutex_unlock(&w->mutex);
+  return NULL;
+}
+
+void pipe_writer_create(pipe_writer *w, const char *name, const char *pathname, int fd,
+                        double buffer_length, int rate, int frame_bytes,
+                        pipe_writer_overrun_policy overrun_policy) {
+  memset(w, 0, sizeof(pipe_writer));
+  w->name = name;
+  w->pathname = pathname;
+  w->fd = pathname ? -1 : fd;
+  w->overrun_policy = overrun_policy;
+  w->rate = rate;
+  w->frame_bytes = frame_bytes;
+  w->ring_size = (size_t)(buffer_length * rate) * frame_bytes;
+  if (w->ring_size < PIPE_WRITER_CHUNK_SIZE)
+    w->ring_size = (PIPE_WRITER_CHUNK_SIZE / frame_bytes) * frame_bytes;
+  w->ring = malloc(w->ring_size);
+  w->chunk_size = (PIPE_WRITER_CHUNK_SIZE / frame_bytes) * frame_bytes;
+  w->chunk = malloc(w->chunk_size);
+  if ((w->ring == NULL) || (w->chunk == NULL))
+    die("%s: can not allocate a buffer of %zu bytes.", name, w->ring_size);
+  w->time_of_last_discard = get_absolute_time_in_ns();
+  pthread_mutex_init(&w->mutex, NULL);
+  pthread_cond_init(&w->data_available, NULL);
+  pthread_cond_init(&w->space_available, NULL);
+  if (pthread_create(&w->thread, NULL, &pipe_writer_thread_func, w) != 0)
+    die("%s: can not create the writer thread.", name);
+  debug(1, "%s: buffering %zu bytes, with the \"%s\" overrun policy.", name, w->ring_size,
+        overrun_policy == pipe_writer_drop_oldest
+            ? "drop_oldest"
+            : (overrun_policy == pipe_writer_block ? "block" : "pad_with_silence"));
+}
+
+void pipe_writer_destroy(pipe_writer *w) {
+  pthread_mutex_lock(&w->mutex);
+  w->stop_requested = 1;
+  pthread_cond_broadcast(&w->data_available);
+  pthread_cond_broadcast(&w->space_available);
+  pthread_mutex_unlock(&w->mutex);
+  pthread_join(w->thread, NULL);
+  if ((w->pathname != NULL) && (w->fd >= 0))
+    close(w->fd);
+  pthread_cond_destroy(&w->space_available);
+  pthread_cond_destroy(&w->data_available);
+  pthread_mutex_destroy(&w->mutex);
+  free(w->chunk);
+  free(w->ring);
+  w->chunk = NULL;
+  w->ring = NULL;
+}
+
+void pipe_writer_start(pipe_writer *w, int rate) {
+  pthread_mutex_lock(&w->mutex);
+  w->rate = rate;
+  w->time_of_last_discard = get_absolute_time_in_ns();
+  pthread_mutex_unlock(&w->mutex);
+}
+
+size_t pipe_writer_write(pipe_writer *w, const void *buf, size_t bytes) {
+  const char *p = buf;
+  size_t accepted = 0;
+  pthread_mutex_lock(&w->mutex);
+  // silence owed to the stream goes ahead of anything new
+  if (w->pending_silence) {
+    size_t room = w->ring_size - w->used;
+    size_t silence = w->pending_silence < room ? w->pending_silence : room;
+    ring_put(w, NULL, silence);
+    w->pending_silence -= silence;
+  }
+  while ((bytes > 0) && (w->stop_requested == 0)) {
+    size_t room = w->ring_size - w->used;
+    if ((room >= bytes) && (w->pending_silence == 0)) {
+      ring_put(w, p, bytes);
+      accepted += bytes;
+      bytes = 0;
+    } else if (w->overrun_policy == pipe_writer_drop_oldest) {
+      // anything too big for the whole ring loses its own oldest audio too
+      size_t keep = bytes < w->ring_size ? bytes : w->ring_size;
+      size_t lost = bytes - keep;
+      if (keep > room) {
+        ring_discard(w, keep - room);
+        lost += keep - room;
+      }
+      note_overrun(w, lost);
+      ring_put(w, p + bytes - keep, keep);
+      accepted += keep;
+      bytes = 0;
+    } else if (w->overrun_policy == pipe_writer_block) {
+      size_t some = room < bytes ? room : bytes;
+      ring_put(w, p, some);
+      accepted += some;
+      p += some;
+      bytes -= some;
+      if (bytes) {
+        pthread_cond_signal(&w->data_available);
+        pthread_cond_wait(&w->space_available, &w->mutex);
+      }
+    } else {
+      // pad_with_silence -- whatever doesn't fit is replaced by silence later
+      size_t some = w->pending_silence ? 0 : room;
+      ring_put(w, p, some);
+      accepted += some;
+      note_overrun(w, bytes - some);
+      w->pending_silence += bytes - some;
+      // if the reader is never going to catch up, don't let the debt grow without limit
+      if (w->pending_silence > w->ring_size)
+        w->pending_silence = w->ring_size;
+      bytes = 0;
+    }
+  }
+  if ((w->overrun_reported) && (w->used < w->ring_size / 2) && (w->pending_silence == 0)) {
+    debug(1, "%s: the reader has caught up. %" PRIu64 " bytes were lost.", w->name,
+          w->overrun_bytes);
+    w->overrun_bytes = 0;
+    w->overrun_reported = 0;
+  }
+  pthread_cond_signal(&w->data_available);
+  pthread_mutex_unlock(&w->mutex);
+  return accepted;
+}
+
+int pipe_writer_delay(pipe_writer *w, long *the_delay) {
+  pthread_mutex_lock(&w->mutex);
+  size_t bytes = w->used + w->chunk_remaining + w->pending_silence;
+#ifdef FIONREAD
+  int bytes_in_pipe = 0;
+  if ((w->fd >= 0) && (ioctl(w->fd, FIONREAD, &bytes_in_pipe) == 0) && (bytes_in_pipe > 0))
+    bytes += bytes_in_pipe;
+#endif
+  pthread_mutex_unlock(&w->mutex);
+  *the_delay = bytes / w->frame_bytes;
+  return 0;
+}
+
+void pipe_writer_flush(pipe_writer *w) {
+  pthread_mutex_lock(&w->mutex);
+  ring_discard(w, w->used);
+  w->pending_silence = 0;
+  w->chunk_remaining = 0;
+  w->flush_count++;
+  pthread_cond_broadcast(&w->space_available);
+  pthread_mutex_unlock(&w->mutex);
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A buffered writer for the pipe and stdout backends. The player thread copies its audio into a
+// ring, and a thread of the writer's own moves it from there to the file descriptor, polling and
+// writing without blocking, so a slow or absent reader never holds up the player.
+//
+// While nobody is reading (or a named pipe hasn't been opened by a reader yet), the writer thread
+// throws the audio away at the nominal frame rate, as a DAC would play it, so the delay it reports
+// keeps the player in sync either way.
+
+typedef enum {
+  pipe_writer_drop_oldest = 0, // when the ring is full, throw the oldest audio away to make room
+  pipe_writer_block,           // when the ring is full, wait for the reader to make room
+  pipe_writer_pad_with_silence, // when the ring is full, throw the new audio away and send as much
+                               // silence in its place when there's room, keeping the stream's
+                               // length intact
+} pipe_writer_overrun_policy;
+
+typedef struct {
+  const char *name;     // for messages
+  const char *pathname; // a named pipe, opened by the writer thread, or NULL to use fd
+  int fd;
+  int fd_is_nonblocking; // if not, writes are limited to PIPE_BUF bytes, which poll() guarantees
+  pipe_writer_overrun_policy overrun_policy;
+  int frame_bytes;
+  int rate;
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t data_available;
+  pthread_cond_t space_available;
+  int stop_requested;
+
+  char *ring;
+  size_t ring_size; // a whole number of frames
+  size_t head;      // where the oldest byte is
+  size_t used;
+  size_t pending_silence; // bytes of silence owed to the stream by the pad_with_silence policy
+
+  // the chunk the writer thread is writing, taken out of the ring so that it can write it without
+  // the mutex
+  char *chunk;
+  size_t chunk_size;
+  size_t chunk_offset;
+  size_t chunk_remaining;
+  uint64_t flush_count; // a flush throws away the rest of the chunk too
+
+  uint64_t time_of_last_discard; // when audio was last thrown away for want of a reader
+  uint64_t overrun_bytes;        // since the last overrun report
+  int overrun_reported;
+} pipe_writer;
+
+// Start a writer with a ring of buffer_length seconds of the given rate and frame size. Give a
+// pathname for a named pipe to be opened when a reader appears, or NULL and a descriptor.
+void pipe_writer_create(pipe_writer *w, const char *name, const char *pathname, int fd,
+                        double buffer_length, int rate, int frame_bytes,
+                        pipe_writer_overrun_policy overrun_policy);
+
+void pipe_writer_destroy(pipe_writer *w);
+
+// read the "buffered", "buffer_length_in_seconds" and "overrun_policy" settings from a
+// backend's section of the configuration file, leaving any that aren't there unchanged
+void pipe_writer_parse_options(const char *section, int *buffered, double *buffer_length,
+                               pipe_writer_overrun_policy *overrun_policy);
+
+// when a play session starts, with the rate it will play at
+void pipe_writer_start(pipe_writer *w, int rate);
+
+// called by the player thread -- returns the number of bytes accepted, which is all of them
+// unless they have been thrown away according to the overrun policy
+size_t pipe_writer_write(pipe_writer *w, const void *buf, size_t bytes);
+
+// get the frames in the ring, in the writer thread's hands and in the pipe itself
+int pipe_writer_delay(pipe_writer *w, long *the_delay);
+
+void pipe_writer_flush(pipe_writer *w);
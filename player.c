@@ -43,6 +43,12 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 #include "config.h"
 
 #ifdef CONFIG_MBEDTLS
@@ -56,7 +62,7 @@
 #endif
 
 #ifdef CONFIG_OPENSSL
-#include <openssl/aes.h>
+#include <openssl/evp.h>
 #endif
 
 #ifdef CONFIG_SOXR
@@ -78,6 +84,7 @@
 #include "common.h"
 #include "mdns.h"
 #include "player.h"
+#include "realtime.h"
 #include "rtp.h"
 #include "rtsp.h"
 
@@ -90,6 +97,9 @@
 #include "loudness.h"
 
 #include "activity_monitor.h"
+#include "metrics.h"
+#include "silence.h"
+#include "sync_control.h"
 
 // make the first audio packet deliberately early to bias the sync error of
 // the very first packet, making the error more likely to be too early
@@ -99,16 +109,22 @@
 
 int64_t first_frame_early_bias = 8;
 
-// default buffer size
-// needs to be a power of 2 because of the way BUFIDX(seqno) works
-//#define BUFFER_FRAMES 512
+// On a fast start, the latency is made up to the full amount by growing it by this fraction of
+// each packet played. It is kept below one frame per 352-frame packet so that stuffing can keep up.
+#define fast_start_latency_growth 0.002
+
 #define MAX_PACKET 2048
 
 // DAC buffer occupancy stuff
 #define DAC_BUFFER_QUEUE_MINIMUM_LENGTH 2500
 
-// static abuf_t audio_buffer[BUFFER_FRAMES];
-#define BUFIDX(seqno) ((seq_t)(seqno) % BUFFER_FRAMES)
+// If no audio has arrived for this long, the input is idle, and the player, with nothing to play,
+// looks for something to do this often rather than every two thirds of a packet time
+#define PLAYER_IDLE_AFTER_NS 1000000000
+#define PLAYER_IDLE_WAIT_NS 500000000
+
+// conn->audio_buffer_size is a power of 2, no bigger than the range of a seq_t
+#define BUFIDX(seqno) ((seq_t)(seqno) & (conn->audio_buffer_size - 1))
 
 uint32_t modulo_32_offset(uint32_t from, uint32_t to) {
   if (from <= to)
@@ -126,9 +142,140 @@ uint64_t modulo_64_offset(uint64_t from, uint64_t to) {
 
 void do_flush(uint32_t timestamp, rtsp_conn_info *conn);
 
+// The missing packet bitmap has a bit for each audio buffer entry, set while the entry is between
+// ab_read and ab_write and hasn't arrived, so that finding the packets to ask for again takes time
+// in proportion to the number missing rather than to the depth of the buffer. It's only changed
+// with the ab_mutex held.
+#define MISSING_PACKET_BUCKET_SHIFT 6
+#define MISSING_PACKET_BUCKET_SIZE (1 << MISSING_PACKET_BUCKET_SHIFT)
+#define missing_packet_buckets(conn) ((conn)->audio_buffer_size >> MISSING_PACKET_BUCKET_SHIFT)
+
+static inline void missing_packet_set(rtsp_conn_info *conn, seq_t seqno) {
+  unsigned int index = BUFIDX(seqno);
+  unsigned int bucket = index >> MISSING_PACKET_BUCKET_SHIFT;
+  uint64_t bit = (uint64_t)1 << (index & (MISSING_PACKET_BUCKET_SIZE - 1));
+  if ((conn->missing_packet_bitmap[bucket] & bit) == 0) {
+    conn->missing_packet_bitmap[bucket] |= bit;
+    conn->missing_packet_count++;
+  }
+  conn->missing_packet_check_time[bucket] = 0; // look at the bucket at the next check
+}
+
+static inline void missing_packet_clear(rtsp_conn_info *conn, seq_t seqno) {
+  unsigned int index = BUFIDX(seqno);
+  uint64_t bit = (uint64_t)1 << (index & (MISSING_PACKET_BUCKET_SIZE - 1));
+  uint64_t *word = &conn->missing_packet_bitmap[index >> MISSING_PACKET_BUCKET_SHIFT];
+  if (*word & bit) {
+    *word &= ~bit;
+    conn->missing_packet_count--;
+  }
+}
+
+// In buffered audio mode, for long latencies, the audio buffer holds the packets as they arrived,
+// decrypted but not decoded, so that tens of seconds of audio take little more memory than the
+// stream itself. They are kept in compressed_chunks, one after another in the order they arrive,
+// and a chunk is given back once all its packets have been decoded or dropped. The decoder thread
+// decodes them a little ahead of time -- lookahead_packets ahead of ab_read -- into a small ring
+// of lookahead_slots decoded packets in audio_buffer_data, and a packet it hasn't got to by the
+// time it's due is decoded by the player thread itself. The compressed chunks are only changed
+// with the ab_mutex held, and the decoders, which both threads use, are only used with the
+// lookahead_decode_mutex held.
+#define COMPRESSED_CHUNK_SPARES 2
+#define LOOKAHEAD_DECODE_BATCH 16
+
+static inline signed short *lookahead_slot(rtsp_conn_info *conn, seq_t seqno) {
+  size_t entry_size = conn->input_bytes_per_frame * conn->max_frames_per_packet;
+  return (signed short *)((char *)conn->audio_buffer_data +
+                          (seqno & (conn->lookahead_slots - 1)) * entry_size);
+}
+
+// let go of a reference to a chunk, recycling it if nothing else wants it
+static void compressed_chunk_put(rtsp_conn_info *conn, compressed_chunk *chunk) {
+  chunk->packets--;
+  if ((chunk->packets == 0) && (chunk != conn->compressed_chunk)) {
+    int spares = 0;
+    compressed_chunk *c;
+    for (c = conn->spare_compressed_chunks; c != NULL; c = c->next)
+      spares++;
+    if (spares < COMPRESSED_CHUNK_SPARES) {
+      chunk->next = conn->spare_compressed_chunks;
+      conn->spare_compressed_chunks = chunk;
+    } else {
+      free(chunk);
+      conn->compressed_chunks--;
+    }
+  }
+}
+
+static void release_compressed_packet(rtsp_conn_info *conn, abuf_t *abuf) {
+  if (abuf->chunk) {
+    compressed_chunk_put(conn, abuf->chunk);
+    abuf->chunk = NULL;
+    abuf->compressed = NULL;
+    abuf->compressed_length = 0;
+  }
+}
+
+// returns 0, or -1 if there's no memory for it
+static int store_compressed_packet(rtsp_conn_info *conn, abuf_t *abuf, const uint8_t *packet,
+                                   int length) {
+  compressed_chunk *chunk = conn->compressed_chunk;
+  if ((chunk) && (chunk->packets == 0))
+    chunk->used = 0; // everything in it has gone
+  if ((chunk == NULL) || (COMPRESSED_CHUNK_SIZE - chunk->used < (size_t)length)) {
+    // move on to a new chunk -- the old one is recycled when the last of its packets has gone
+    chunk = conn->spare_compressed_chunks;
+    if (chunk) {
+      conn->spare_compressed_chunks = chunk->next;
+    } else {
+      chunk = malloc(sizeof(compressed_chunk));
+      if (chunk == NULL)
+        return -1;
+      conn->compressed_chunks++;
+      if (conn->compressed_chunks > conn->compressed_chunks_peak)
+        conn->compressed_chunks_peak = conn->compressed_chunks;
+    }
+    chunk->next = NULL;
+    chunk->used = 0;
+    chunk->packets = 0;
+    compressed_chunk *old_chunk = conn->compressed_chunk;
+    conn->compressed_chunk = chunk;
+    if (old_chunk) { // recycle it now if it's already empty
+      old_chunk->packets++;
+      compressed_chunk_put(conn, old_chunk);
+    }
+  }
+  abuf->chunk = chunk;
+  abuf->compressed = chunk->data + chunk->used;
+  abuf->compressed_length = length;
+  memcpy(abuf->compressed, packet, length);
+  chunk->used += length;
+  chunk->packets++;
+  return 0;
+}
+
+static void free_compressed_chunks(rtsp_conn_info *conn) {
+  free(conn->compressed_chunk);
+  conn->compressed_chunk = NULL;
+  while (conn->spare_compressed_chunks) {
+    compressed_chunk *chunk = conn->spare_compressed_chunks;
+    conn->spare_compressed_chunks = chunk->next;
+    free(chunk);
+  }
+  if (conn->compressed_chunks_peak)
+    debug(2, "Connection %d: buffered audio used up to %u chunks of compressed packets.",
+          conn->connection_number, conn->compressed_chunks_peak);
+  conn->compressed_chunks = 0;
+  conn->compressed_chunks_peak = 0;
+}
+
 static void ab_resync(rtsp_conn_info *conn) {
-  int i;
-  for (i = 0; i < BUFFER_FRAMES; i++) {
+  unsigned int i;
+  memset(conn->missing_packet_bitmap, 0, missing_packet_buckets(conn) * sizeof(uint64_t));
+  memset(conn->missing_packet_check_time, 0, missing_packet_buckets(conn) * sizeof(uint64_t));
+  conn->missing_packet_count = 0;
+  for (i = 0; i < conn->audio_buffer_size; i++) {
+    release_compressed_packet(conn, &conn->audio_buffer[i]);
     conn->audio_buffer[i].ready = 0;
     conn->audio_buffer[i].resend_request_number = 0;
     conn->audio_buffer[i].resend_time =
@@ -143,6 +290,40 @@ static void ab_resync(rtsp_conn_info *conn) {
   conn->ab_buffering = 1;
 }
 
+// Drop the packets at the start of the buffer that end before the frame at timestamp, keeping
+// those from there on, and get ready to start playing again from the first one kept, as if it
+// were the first packet of a stream. Sequence numbers and timestamps are assumed to be in step.
+// Returns the number of packets dropped.
+static unsigned int ab_drop_before(rtsp_conn_info *conn, uint32_t timestamp) {
+  seq_t first_kept = conn->ab_read;
+  seq_t i;
+  // find the first packet that isn't entirely before the timestamp -- anything missing before it
+  // must be before the timestamp too
+  for (i = conn->ab_read; i != conn->ab_write; i++) {
+    abuf_t *abuf = conn->audio_buffer + BUFIDX(i);
+    if (abuf->ready) {
+      if ((int32_t)(abuf->given_timestamp + abuf->length - timestamp) > 0)
+        break;
+      first_kept = i + 1;
+    }
+  }
+  unsigned int dropped = (seq_t)(first_kept - conn->ab_read);
+  for (i = conn->ab_read; i != first_kept; i++) {
+    abuf_t *abuf = conn->audio_buffer + BUFIDX(i);
+    missing_packet_clear(conn, i);
+    release_compressed_packet(conn, abuf);
+    abuf->ready = 0;
+    abuf->resend_request_number = 0;
+    abuf->resend_time = 0;
+    abuf->initialisation_time = 0;
+    abuf->sequence_number = 0;
+  }
+  conn->ab_read = first_kept;
+  conn->last_seqno_read = (seq_t)(first_kept - 1);
+  conn->ab_buffering = 1;
+  return dropped;
+}
+
 // given starting and ending points as unsigned 16-bit integers running modulo 2^16, returns the
 // position of x in the interval in *pos
 // returns true if x is actually within the buffer
@@ -233,12 +414,13 @@ void unencrypted_packet_decode(unsigned char *packet, int length, short *dest, i
                                int size_limit, rtsp_conn_info *conn) {
   if (conn->stream.type == ast_apple_lossless) {
 #ifdef CONFIG_APPLE_ALAC
-    if (config.use_apple_decoder) {
+    if ((config.use_apple_decoder) && (conn->apple_decoder_info)) {
       if (conn->decoder_in_use != 1 << decoder_apple_alac) {
         debug(2, "Apple ALAC Decoder used on encrypted audio.");
         conn->decoder_in_use = 1 << decoder_apple_alac;
       }
-      apple_alac_decode_frame(packet, length, (unsigned char *)dest, outsize);
+      apple_alac_decode_frame(conn->apple_decoder_info, packet, length, (unsigned char *)dest,
+                              outsize);
       *outsize = *outsize * 4; // bring the size to bytes
     } else
 #endif
@@ -247,7 +429,7 @@ void unencrypted_packet_decode(unsigned char *packet, int length, short *dest, i
         debug(2, "Hammerton Decoder used on encrypted audio.");
         conn->decoder_in_use = 1 << decoder_hammerton;
       }
-      alac_decode_frame(conn->decoder_info, packet, (unsigned char *)dest, outsize);
+      alac_decode_frame(conn->decoder_info, packet, length, (unsigned char *)dest, outsize);
     }
   } else if (conn->stream.type == ast_uncompressed) {
     int length_to_use = length;
@@ -268,6 +450,69 @@ void unencrypted_packet_decode(unsigned char *packet, int length, short *dest, i
   }
 }
 
+// The cipher is keyed once per session. Every packet is encrypted separately, starting from the
+// session's IV, so for each packet only the IV is reset and the key schedule is kept. With
+// OpenSSL, the EVP interface is used so that AES-NI or the ARMv8 crypto extensions are used
+// where they are available.
+static void init_decryption(rtsp_conn_info *conn) {
+#ifdef CONFIG_MBEDTLS
+  memset(&conn->dctx, 0, sizeof(mbedtls_aes_context));
+  mbedtls_aes_setkey_dec(&conn->dctx, conn->stream.aeskey, 128);
+#endif
+
+#ifdef CONFIG_POLARSSL
+  memset(&conn->dctx, 0, sizeof(aes_context));
+  aes_setkey_dec(&conn->dctx, conn->stream.aeskey, 128);
+#endif
+
+#ifdef CONFIG_OPENSSL
+  conn->aes_ctx = EVP_CIPHER_CTX_new();
+  if ((conn->aes_ctx == NULL) ||
+      (EVP_DecryptInit_ex(conn->aes_ctx, EVP_aes_128_cbc(), NULL, conn->stream.aeskey,
+                          conn->stream.aesiv) != 1))
+    die("Can not set up the AES decryption context.");
+  EVP_CIPHER_CTX_set_padding(conn->aes_ctx, 0);
+#endif
+}
+
+static void free_decryption(rtsp_conn_info *conn) {
+#ifdef CONFIG_MBEDTLS
+  mbedtls_aes_free(&conn->dctx);
+#endif
+
+#ifdef CONFIG_OPENSSL
+  if (conn->aes_ctx) {
+    EVP_CIPHER_CTX_free(conn->aes_ctx);
+    conn->aes_ctx = NULL;
+  }
+#endif
+}
+
+// Decrypt a packet in place. Only whole 16-byte blocks are encrypted -- any remainder is sent in
+// the clear.
+static void audio_packet_decrypt(uint8_t *buf, int len, rtsp_conn_info *conn) {
+  int aeslen = len & ~0xf;
+#if defined(CONFIG_MBEDTLS) || defined(CONFIG_POLARSSL)
+  unsigned char iv[16];
+  memcpy(iv, conn->stream.aesiv, sizeof(iv));
+#endif
+#ifdef CONFIG_MBEDTLS
+  mbedtls_aes_crypt_cbc(&conn->dctx, MBEDTLS_AES_DECRYPT, aeslen, iv, buf, buf);
+#endif
+#ifdef CONFIG_POLARSSL
+  aes_crypt_cbc(&conn->dctx, AES_DECRYPT, aeslen, iv, buf, buf);
+#endif
+#ifdef CONFIG_OPENSSL
+  int outlen;
+  // restart the chain from the session IV; the key schedule is left as it is
+  if ((EVP_DecryptInit_ex(conn->aes_ctx, NULL, NULL, NULL, conn->stream.aesiv) != 1) ||
+      (EVP_CIPHER_CTX_set_padding(conn->aes_ctx, 0) != 1) ||
+      (EVP_DecryptUpdate(conn->aes_ctx, buf, &outlen, buf, aeslen) != 1) || (outlen != aeslen))
+    debug(1, "Error decrypting an audio packet of %d bytes.", len);
+#endif
+}
+
+// buf must already have been decrypted, if the stream is encrypted
 int audio_packet_decode(short *dest, int *destlen, uint8_t *buf, int len, rtsp_conn_info *conn) {
   // parameters: where the decoded stuff goes, its length in samples,
   // the incoming packet, the length of the incoming packet in bytes
@@ -278,32 +523,11 @@ int audio_packet_decode(short *dest, int *destlen, uint8_t *buf, int len, rtsp_c
          MAX_PACKET);
     return -1;
   }
-  unsigned char packet[MAX_PACKET];
-  // unsigned char packetp[MAX_PACKET];
-  assert(len <= MAX_PACKET);
   int reply = 0;                                          // everything okay
   int outsize = conn->input_bytes_per_frame * (*destlen); // the size the output should be, in bytes
   int maximum_possible_outsize = outsize;
 
-  if (conn->stream.encrypted) {
-    unsigned char iv[16];
-    int aeslen = len & ~0xf;
-    memcpy(iv, conn->stream.aesiv, sizeof(iv));
-#ifdef CONFIG_MBEDTLS
-    mbedtls_aes_crypt_cbc(&conn->dctx, MBEDTLS_AES_DECRYPT, aeslen, iv, buf, packet);
-#endif
-#ifdef CONFIG_POLARSSL
-    aes_crypt_cbc(&conn->dctx, AES_DECRYPT, aeslen, iv, buf, packet);
-#endif
-#ifdef CONFIG_OPENSSL
-    AES_cbc_encrypt(buf, packet, aeslen, &conn->aes, iv, AES_DECRYPT);
-#endif
-    memcpy(packet + aeslen, buf + aeslen, len - aeslen);
-    unencrypted_packet_decode(packet, len, dest, &outsize, maximum_possible_outsize, conn);
-  } else {
-    // not encrypted
-    unencrypted_packet_decode(buf, len, dest, &outsize, maximum_possible_outsize, conn);
-  }
+  unencrypted_packet_decode(buf, len, dest, &outsize, maximum_possible_outsize, conn);
 
   if (outsize > maximum_possible_outsize) {
     debug(2,
@@ -322,6 +546,52 @@ int audio_packet_decode(short *dest, int *destlen, uint8_t *buf, int len, rtsp_c
   return reply;
 }
 
+// When another session takes over from the one playing, the old session's audio buffers and
+// decoders are left here rather than freed, and the new session takes them if they suit it,
+// saving it the work of making its own. There is room for one session's worth.
+typedef struct {
+  int buffers_valid;
+  abuf_t *audio_buffer;
+  signed short *audio_buffer_data;
+  unsigned int audio_buffer_size;
+  size_t entry_size;
+  unsigned int data_entries; // the entries in audio_buffer_data
+  packet_ring_entry *packet_ring_entries[PR_number_of_rings];
+
+  int decoders_valid;
+  int32_t fmtp[12];
+  unsigned int input_bit_depth, input_num_channels, max_frames_per_packet;
+  alac_file *decoder_info;
+#ifdef CONFIG_APPLE_ALAC
+  void *apple_decoder_info;
+#endif
+} handover_store;
+
+static handover_store handover;
+static pthread_mutex_t handover_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_handover_buffers() {
+  int i;
+  if (handover.buffers_valid) {
+    free(handover.audio_buffer_data);
+    free(handover.audio_buffer);
+    for (i = 0; i < PR_number_of_rings; i++)
+      free(handover.packet_ring_entries[i]);
+    handover.buffers_valid = 0;
+  }
+}
+
+static void free_handover_decoders() {
+  if (handover.decoders_valid) {
+    alac_free(handover.decoder_info);
+#ifdef CONFIG_APPLE_ALAC
+    if (handover.apple_decoder_info)
+      apple_alac_destroy(handover.apple_decoder_info);
+#endif
+    handover.decoders_valid = 0;
+  }
+}
+
 static int init_alac_decoder(int32_t fmtp[12], rtsp_conn_info *conn) {
 
   // This is a guess, but the format of the fmtp looks identical to the format of an
@@ -403,6 +673,29 @@ static int init_alac_decoder(int32_t fmtp[12], rtsp_conn_info *conn) {
 
   alac_file *alac;
 
+  // take the decoders left by a session that has handed over to this one, if they're the same
+  int reused = 0;
+  pthread_mutex_lock(&handover_mutex);
+  if ((handover.decoders_valid) && (memcmp(handover.fmtp, fmtp, sizeof(handover.fmtp)) == 0) &&
+      (handover.input_bit_depth == conn->input_bit_depth) &&
+      (handover.input_num_channels == conn->input_num_channels) &&
+      (handover.max_frames_per_packet == conn->max_frames_per_packet)) {
+    conn->decoder_info = handover.decoder_info;
+#ifdef CONFIG_APPLE_ALAC
+    conn->apple_decoder_info = handover.apple_decoder_info;
+#endif
+    handover.decoders_valid = 0;
+    reused = 1;
+  } else {
+    free_handover_decoders();
+  }
+  pthread_mutex_unlock(&handover_mutex);
+  if (reused) {
+    debug(2, "Connection %d: using the decoders of the previous session.",
+          conn->connection_number);
+    return 0;
+  }
+
   alac = alac_create(conn->input_bit_depth,
                      conn->input_num_channels); // no pthread cancellation point in here
   if (!alac)
@@ -423,44 +716,286 @@ static int init_alac_decoder(int32_t fmtp[12], rtsp_conn_info *conn) {
   alac_allocate_buffers(alac); // no pthread cancellation point in here
 
 #ifdef CONFIG_APPLE_ALAC
-  apple_alac_init(fmtp); // no pthread cancellation point in here
+  conn->apple_decoder_info = apple_alac_create(fmtp); // no pthread cancellation point in here
+  if (conn->apple_decoder_info == NULL)
+    warn("Can not create an Apple ALAC decoder -- the Hammerton decoder will be used instead.");
 #endif
 
   return 0;
 }
 
+// leave the decoders for the session taking over from this one -- see handover_store
+static void hand_over_decoders(rtsp_conn_info *conn) {
+  pthread_mutex_lock(&handover_mutex);
+  free_handover_decoders();
+  memcpy(handover.fmtp, conn->stream.fmtp, sizeof(handover.fmtp));
+  handover.input_bit_depth = conn->input_bit_depth;
+  handover.input_num_channels = conn->input_num_channels;
+  handover.max_frames_per_packet = conn->max_frames_per_packet;
+  handover.decoder_info = conn->decoder_info;
+  conn->decoder_info = NULL;
+#ifdef CONFIG_APPLE_ALAC
+  handover.apple_decoder_info = conn->apple_decoder_info;
+  conn->apple_decoder_info = NULL;
+#endif
+  handover.decoders_valid = 1;
+  pthread_mutex_unlock(&handover_mutex);
+}
+
 static void terminate_decoders(rtsp_conn_info *conn) {
   alac_free(conn->decoder_info);
 #ifdef CONFIG_APPLE_ALAC
-  apple_alac_terminate();
+  if (conn->apple_decoder_info) {
+    apple_alac_destroy(conn->apple_decoder_info);
+    conn->apple_decoder_info = NULL;
+  }
 #endif
 }
 
+unsigned int minimum_audio_buffer_size(uint32_t latency) {
+  int64_t maximum_latency =
+      latency + (int64_t)(config.audio_backend_latency_offset * config.output_rate);
+  int64_t packets = (maximum_latency + (352 - 1)) / 352 + 10;
+  unsigned int size = MINIMUM_BUFFER_FRAMES;
+  while (size < packets)
+    size = size << 1;
+  return size;
+}
+
+// In low memory mode, the audio buffer is made just big enough for the largest latency the session
+// may ask for, as rtp.c checks it, plus any latency the backend offset adds. The buffer is sized
+// before the first sync packet gives the latency, so that's the maximum latency the source
+// announced, if it did, or the fixed latency, if set. The audio_buffer_size_in_packets setting
+// becomes the most it can be.
+static unsigned int audio_buffer_size_for_latency(rtsp_conn_info *conn) {
+  uint32_t latency = conn->latency;
+  if (conn->maximum_latency > latency)
+    latency = conn->maximum_latency;
+  if (config.userSuppliedLatency > latency)
+    latency = config.userSuppliedLatency;
+  uint64_t frames = (uint64_t)latency + 11025;
+  if (config.audio_backend_latency_offset > 0.0)
+    frames += (uint64_t)(config.audio_backend_latency_offset * conn->input_rate);
+  uint64_t packets = (frames * 4 + 3 * conn->max_frames_per_packet - 1) /
+                     (3 * conn->max_frames_per_packet); // latencies above 3/4 of it are refused
+  unsigned int size = MINIMUM_BUFFER_FRAMES;
+  while ((size < packets) && (size < config.audio_buffer_size))
+    size = size << 1;
+  if (size > config.audio_buffer_size)
+    size = config.audio_buffer_size;
+  return size;
+}
+
 static void init_buffer(rtsp_conn_info *conn) {
-  int i;
-  for (i = 0; i < BUFFER_FRAMES; i++)
-    conn->audio_buffer[i].data = malloc(conn->input_bytes_per_frame * conn->max_frames_per_packet);
+  unsigned int i;
+  conn->audio_buffer_size = config.audio_buffer_size;
+  if ((config.low_memory) && (conn->max_frames_per_packet != 0)) {
+    conn->audio_buffer_size = audio_buffer_size_for_latency(conn);
+    debug(2,
+          "Connection %d: an audio buffer of %u packets for a latency of %u frames, and a maximum "
+          "latency of %u frames.",
+          conn->connection_number, conn->audio_buffer_size, conn->latency, conn->maximum_latency);
+  }
+  // the size was checked against the latency at startup, but the output rate, and with it the
+  // latency offset in frames, may have gone up since
+  unsigned int minimum_size = minimum_audio_buffer_size(conn->latency);
+  if (minimum_size > MAXIMUM_BUFFER_FRAMES)
+    minimum_size = MAXIMUM_BUFFER_FRAMES;
+  if (conn->audio_buffer_size < minimum_size) {
+    warn("Connection %d: an audio buffer of %u packets is too small for a latency of %u frames "
+         "and the backend latency offset, so %u packets will be used.",
+         conn->connection_number, conn->audio_buffer_size, conn->latency, minimum_size);
+    conn->audio_buffer_size = minimum_size;
+  }
+  // the data for all the entries comes from a single allocation
+  size_t entry_size = conn->input_bytes_per_frame * conn->max_frames_per_packet;
+  unsigned int data_entries = conn->audio_buffer_size;
+  conn->buffered_audio = (config.buffered_audio) && (conn->max_frames_per_packet != 0);
+  if (conn->buffered_audio) {
+    // only the packets about to be played are kept decoded, in a ring with room for twice the
+    // lookahead, so that a packet is never decoded into the place of one still being played
+    conn->lookahead_packets =
+        (unsigned int)(config.buffered_audio_lookahead * conn->input_rate) /
+            conn->max_frames_per_packet +
+        1;
+    if (conn->lookahead_packets > conn->audio_buffer_size / 4)
+      conn->lookahead_packets = conn->audio_buffer_size / 4;
+    conn->lookahead_slots = 1;
+    while (conn->lookahead_slots < 2 * conn->lookahead_packets + 2)
+      conn->lookahead_slots = conn->lookahead_slots << 1;
+    data_entries = conn->lookahead_slots;
+    debug(2,
+          "Connection %d: buffered audio of up to %u packets, decoded %u packets ahead of time.",
+          conn->connection_number, conn->audio_buffer_size, conn->lookahead_packets);
+  }
+
+  // take the buffers left by a session that has handed over to this one, if they're the same size
+  int reused = 0;
+  pthread_mutex_lock(&handover_mutex);
+  if ((handover.buffers_valid) && (handover.audio_buffer_size == conn->audio_buffer_size) &&
+      (handover.entry_size == entry_size) && (handover.data_entries == data_entries)) {
+    conn->audio_buffer = handover.audio_buffer;
+    memset(conn->audio_buffer, 0, conn->audio_buffer_size * sizeof(abuf_t));
+    conn->audio_buffer_data = handover.audio_buffer_data;
+    for (i = 0; i < PR_number_of_rings; i++)
+      conn->packet_rings[i].entries = handover.packet_ring_entries[i];
+    handover.buffers_valid = 0;
+    reused = 1;
+  } else {
+    free_handover_buffers();
+  }
+  pthread_mutex_unlock(&handover_mutex);
+  if (reused) {
+    debug(2, "Connection %d: using the audio buffers of the previous session.",
+          conn->connection_number);
+  } else {
+    conn->audio_buffer = calloc(conn->audio_buffer_size, sizeof(abuf_t));
+    if (conn->audio_buffer == NULL)
+      die("Failed to allocate memory for an audio buffer of %u packets.", conn->audio_buffer_size);
+    conn->audio_buffer_data = malloc(entry_size * data_entries);
+    if (conn->audio_buffer_data == NULL)
+      die("Failed to allocate memory for the data of an audio buffer of %u packets.",
+          conn->audio_buffer_size);
+    for (i = 0; i < PR_number_of_rings; i++) {
+      conn->packet_rings[i].entries = malloc(sizeof(packet_ring_entry) * PACKET_RING_SIZE);
+      if (conn->packet_rings[i].entries == NULL)
+        die("Failed to allocate memory for a packet ring.");
+    }
+  }
+  // in buffered audio mode, an entry is given its place in the lookahead ring when it's played
+  if (conn->buffered_audio == 0)
+    for (i = 0; i < conn->audio_buffer_size; i++)
+      conn->audio_buffer[i].data =
+          (signed short *)((char *)conn->audio_buffer_data + i * entry_size);
+  conn->missing_packet_bitmap = calloc(missing_packet_buckets(conn), sizeof(uint64_t));
+  conn->missing_packet_check_time = calloc(missing_packet_buckets(conn), sizeof(uint64_t));
+  if ((conn->missing_packet_bitmap == NULL) || (conn->missing_packet_check_time == NULL))
+    die("Failed to allocate memory for the missing packet bitmap.");
+  for (i = 0; i < PR_number_of_rings; i++) {
+    conn->packet_rings[i].head = 0;
+    conn->packet_rings[i].tail = 0;
+    conn->packet_rings[i].overruns = 0;
+  }
   ab_resync(conn);
 }
 
+// free the audio buffers, or leave them for the session taking over from this one, if there is one
 static void free_audio_buffers(rtsp_conn_info *conn) {
   int i;
-  for (i = 0; i < BUFFER_FRAMES; i++)
-    free(conn->audio_buffer[i].data);
+  unsigned int j;
+  for (j = 0; j < conn->audio_buffer_size; j++)
+    release_compressed_packet(conn, &conn->audio_buffer[j]);
+  free_compressed_chunks(conn);
+  for (i = 0; i < PR_number_of_rings; i++)
+    if (conn->packet_rings[i].overruns)
+      debug(1, "%" PRIu64 " packets were dropped because packet ring %d was full.",
+            conn->packet_rings[i].overruns, i);
+  if (conn->handover_requested) {
+    pthread_mutex_lock(&handover_mutex);
+    free_handover_buffers();
+    handover.audio_buffer = conn->audio_buffer;
+    handover.audio_buffer_data = conn->audio_buffer_data;
+    handover.audio_buffer_size = conn->audio_buffer_size;
+    handover.entry_size = conn->input_bytes_per_frame * conn->max_frames_per_packet;
+    handover.data_entries = conn->buffered_audio ? conn->lookahead_slots : conn->audio_buffer_size;
+    for (i = 0; i < PR_number_of_rings; i++)
+      handover.packet_ring_entries[i] = conn->packet_rings[i].entries;
+    handover.buffers_valid = 1;
+    pthread_mutex_unlock(&handover_mutex);
+  } else {
+    free(conn->audio_buffer_data);
+    free(conn->audio_buffer);
+    for (i = 0; i < PR_number_of_rings; i++)
+      free(conn->packet_rings[i].entries);
+  }
+  conn->audio_buffer_data = NULL;
+  conn->audio_buffer = NULL;
+  free(conn->missing_packet_bitmap);
+  conn->missing_packet_bitmap = NULL;
+  free(conn->missing_packet_check_time);
+  conn->missing_packet_check_time = NULL;
+  for (i = 0; i < PR_number_of_rings; i++)
+    conn->packet_rings[i].entries = NULL;
 }
 
-int first_possibly_missing_frame = -1;
+// This is called by the RTP receiver threads. It never blocks -- the packet is copied into the
+// ring for the calling thread and the player thread is woken up to deal with it. If the ring is
+// full, the packet is dropped and will be treated as missing.
+void player_put_packet(packet_ring_id ring_id, seq_t seqno, uint32_t actual_timestamp,
+                       uint8_t *data, int len, uint64_t arrival_time, rtsp_conn_info *conn) {
+  packet_ring *ring = &conn->packet_rings[ring_id];
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head - tail >= PACKET_RING_SIZE) {
+    ring->overruns++;
+    debug(2, "Packet ring %d is full -- packet %u dropped.", ring_id, seqno);
+  } else if ((len < 0) || (len > PACKET_RING_ENTRY_DATA_SIZE)) {
+    debug(1, "Audio packet %u of length %d is too long and has been dropped.", seqno, len);
+  } else {
+    packet_ring_entry *entry = &ring->entries[head & (PACKET_RING_SIZE - 1)];
+    entry->arrival_time = arrival_time;
+    entry->timestamp = actual_timestamp;
+    entry->seqno = seqno;
+    entry->length = len;
+    memcpy(entry->data, data, len);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    // the decoder_mutex is only ever held very briefly, while the decoder thread checks the rings
+    pthread_mutex_lock(&conn->decoder_mutex);
+    int rc = pthread_cond_signal(&conn->decoder_cond);
+    pthread_mutex_unlock(&conn->decoder_mutex);
+    if (rc)
+      debug(1, "Error signalling the decoder.");
+  }
+}
 
-void player_put_packet(seq_t seqno, uint32_t actual_timestamp, uint8_t *data, int len,
-                       rtsp_conn_info *conn) {
+// the latency in force, which is less than the latency requested while a fast start is growing it
+static inline uint32_t playing_latency(rtsp_conn_info *conn) {
+  uint32_t deficit = (uint32_t)conn->fast_start_latency_deficit;
+  if (deficit > conn->latency) // the player may have asked for a shorter latency since
+    deficit = conn->latency;
+  return conn->latency - deficit;
+}
 
-  debug_mutex_lock(&conn->ab_mutex, 30000, 0);
-  uint64_t time_now = get_absolute_time_in_ns();
+// record how much time a packet arriving now has to spare before it's due to go to the output
+static void note_packet_margin(uint32_t timestamp, uint64_t time_now, rtsp_conn_info *conn) {
+  uint64_t time_to_play;
+  if ((have_timestamp_timing_information(conn)) &&
+      (frame_to_local_time(timestamp + playing_latency(conn), &time_to_play, conn) == 0)) {
+    int64_t margin = (int64_t)(time_to_play - time_now) +
+                     (int64_t)((config.audio_backend_latency_offset -
+                                config.audio_backend_buffer_desired_length) *
+                               1000000000);
+    receive_stats_note_margin(&conn->receive_stats, margin);
+  }
+}
+
+// these are called by the decoder thread with the ab_mutex held
+
+// decoded_frames is negative if the packet could not be decoded. In buffered audio mode, decoded is
+// NULL, and the packet itself is given, to be kept until it's decoded.
+static void add_packet_to_buffer(seq_t seqno, uint32_t actual_timestamp, short *decoded,
+                                 int decoded_frames, const uint8_t *packet, int packet_length,
+                                 uint64_t time_now, rtsp_conn_info *conn) {
   conn->packet_count++;
   conn->packet_count_since_flush++;
-  conn->time_of_last_audio_packet = time_now;
+  if (player_input_is_idle(conn))
+    rtp_request_timing_burst(conn); // audio is resuming -- get the clocks compared again quickly
+  __atomic_store_n(&conn->time_of_last_audio_packet, time_now, __ATOMIC_RELAXED);
   if (conn->connection_state_to_output) { // if we are supposed to be processing these packets
     abuf_t *abuf = 0;
+    conn->receive_stats.packets++;
+    note_packet_margin(actual_timestamp, time_now, conn);
+#ifdef CONFIG_METADATA
+    // every 1024 packets, or about eight seconds, say how the packets are arriving
+    if ((conn->receive_stats.packets & 1023) == 0) {
+      char receive_statistics[512];
+      int length =
+          receive_stats_format(&conn->receive_stats, receive_statistics, sizeof(receive_statistics));
+      if ((length > 0) && ((size_t)length < sizeof(receive_statistics)))
+        send_ssnc_metadata('rcvs', receive_statistics, length,
+                           0); // don't wait if the queue is locked
+    }
+#endif
     if (!conn->ab_synced) {
       // if this is the first packet...
       debug(3, "syncing to seqno %u.", seqno);
@@ -488,6 +1023,8 @@ void player_put_packet(seq_t seqno, uint32_t actual_timestamp, uint8_t *data, in
       int i;
       for (i = 0; i < write_point_gap; i++) {
         abuf = conn->audio_buffer + BUFIDX(seq_sum(conn->ab_write, i));
+        missing_packet_set(conn, seq_sum(conn->ab_write, i));
+        release_compressed_packet(conn, abuf);
         abuf->ready = 0; // to be sure, to be sure
         abuf->resend_request_number = 0;
         abuf->initialisation_time =
@@ -502,133 +1039,495 @@ void player_put_packet(seq_t seqno, uint32_t actual_timestamp, uint8_t *data, in
     } else if (seq_diff(seqno, conn->ab_read) > 0) { // older than expected but still not too late
       conn->late_packets++;
       abuf = conn->audio_buffer + BUFIDX(seqno);
+      if (abuf->ready)
+        conn->receive_stats.duplicates++;
+      else if (abuf->resend_request_number)
+        conn->receive_stats.resend_hits++;
+      else
+        receive_stats_note_out_of_order(&conn->receive_stats,
+                                        seq_diff(conn->ab_write, seqno) - 1);
     } else { // too late.
       conn->too_late_packets++;
+      conn->receive_stats.too_late++;
     }
 
     if (abuf) {
-      int datalen = conn->max_frames_per_packet;
       abuf->initialisation_time = time_now;
       abuf->resend_time = 0;
-      if (audio_packet_decode(abuf->data, &datalen, data, len, conn) == 0) {
+      release_compressed_packet(conn, abuf); // of an earlier copy of the packet
+      if (decoded == NULL) {
+        // until it's decoded, take it to be a full packet
+        decoded_frames = conn->max_frames_per_packet;
+        if (store_compressed_packet(conn, abuf, packet, packet_length) != 0) {
+          debug(1, "No memory to keep audio packet %u -- it has been discarded.", seqno);
+          decoded_frames = -1;
+        }
+      }
+      if (decoded_frames >= 0) {
+        if (decoded)
+          memcpy(abuf->data, decoded, decoded_frames * conn->input_bytes_per_frame);
         abuf->ready = 1;
+        missing_packet_clear(conn, seqno);
         abuf->status = 0; // signifying that it was received
-        abuf->length = datalen;
+        abuf->length = decoded_frames;
         abuf->given_timestamp = actual_timestamp;
         abuf->sequence_number = seqno;
       } else {
         debug(1, "Bad audio packet detected and discarded.");
         abuf->ready = 0;
+        missing_packet_set(conn, seqno);
         abuf->status = 1 << 1; // bad packet, discarded
         abuf->resend_request_number = 0;
         abuf->given_timestamp = 0;
         abuf->sequence_number = 0;
       }
     }
+  }
+}
 
-    int rc = pthread_cond_signal(&conn->flowcontrol);
-    if (rc)
-      debug(1, "Error signalling flowcontrol.");
+// Resend requests are paced and merged so as not to add to the congestion that caused the loss:
+// - runs of missing packets separated by no more than resend_coalescing_gap received packets are
+//   asked for in one request, since resending a few packets is cheaper than another request;
+// - a packet is not asked for again until a reply could have come back, judged from the round
+//   trip time of the timing pings, nor once there is no longer time for a reply to arrive;
+// - each repeat request for a packet waits twice as long as the one before, up to a limit;
+// - packets are requested at no more than a quarter of the rate they are sent, with a burst
+//   allowance of about a second's worth, so that heavy loss can't set off a flood of requests.
+#define resend_coalescing_gap 4
+#define resend_maximum_backoff_shift 3
+#define resend_rate_fraction 0.25
+#define resend_burst_seconds 1.0
+
+// the time a reply to a request could reasonably take, as an RFC 6298 retransmission time-out
+static uint64_t resend_reply_time(rtsp_conn_info *conn) {
+  uint64_t srtt = __atomic_load_n(&conn->round_trip_time, __ATOMIC_RELAXED);
+  uint64_t rttvar = __atomic_load_n(&conn->round_trip_time_variation, __ATOMIC_RELAXED);
+  return srtt + 4 * rttvar;
+}
 
+static void resend_allowance_update(rtsp_conn_info *conn, uint64_t time_now) {
+  double packets_per_second = (1.0 * conn->input_rate) / conn->max_frames_per_packet;
+  double maximum_allowance = packets_per_second * resend_burst_seconds;
+  if (conn->resend_allowance_time == 0) {
+    conn->resend_allowance = maximum_allowance;
+  } else {
+    conn->resend_allowance += (0.000000001 * (time_now - conn->resend_allowance_time)) *
+                              packets_per_second * resend_rate_fraction;
+    if (conn->resend_allowance > maximum_allowance)
+      conn->resend_allowance = maximum_allowance;
+  }
+  conn->resend_allowance_time = time_now;
+}
+
+// ask for up to count packets from first on, as far as the allowance permits, and mark the
+// missing ones among them as requested
+static void resend_request_run(seq_t first, int count, uint64_t time_now,
+                               rtsp_conn_info *conn) {
+  if (count > (int)conn->resend_allowance)
+    count = (int)conn->resend_allowance;
+  if (count <= 0)
+    return;
+  int i;
+  for (i = 0; i < count; i++) {
+    abuf_t *check_buf = conn->audio_buffer + BUFIDX(seq_sum(first, i));
+    if (!check_buf->ready) {
+      check_buf->resend_time = time_now;
+      check_buf->resend_request_number++;
+    }
+  }
+  if (count > 1)
+    debug(3, "request resend of %d packets starting at seqno %u.", count, first);
+  rtp_request_resend(first, count, conn);
+  conn->resend_allowance -= count;
+  conn->resend_requests++;
+  conn->resend_packets_requested += count;
+}
+
+// a run of packets to be asked for in one request, which may include some that have been received
+typedef struct {
+  int start; // -1 if there is no run
+  int end;   // the last packet of the run that needs to be requested
+} resend_run;
+
+static void resend_run_end(resend_run *run, uint64_t time_now, rtsp_conn_info *conn) {
+  if (run->start != -1) {
+    if (config.disable_resend_requests == 0)
+      resend_request_run(run->start, seq_diff(run->end, run->start) + 1, time_now, conn);
+    run->start = -1;
+  }
+}
+
+static void check_for_missing_packets(rtsp_conn_info *conn) {
+  if (conn->connection_state_to_output) {
+    uint64_t time_now = get_absolute_time_in_ns();
     // resend checks
     {
+      uint64_t reply_time = resend_reply_time(conn);
       uint64_t minimum_wait_time =
           (uint64_t)(config.resend_control_first_check_time * (uint64_t)1000000000);
       uint64_t resend_repeat_interval =
           (uint64_t)(config.resend_control_check_interval_time * (uint64_t)1000000000);
-      uint64_t minimum_remaining_time = (uint64_t)(
-          (config.resend_control_last_check_time + config.audio_backend_buffer_desired_length) *
-          (uint64_t)1000000000);
-      uint64_t latency_time = (uint64_t)(conn->latency * (uint64_t)1000000000);
+      if (resend_repeat_interval < reply_time)
+        resend_repeat_interval = reply_time;
+      uint64_t last_check_time =
+          (uint64_t)(config.resend_control_last_check_time * (uint64_t)1000000000);
+      if (last_check_time < reply_time)
+        last_check_time = reply_time;
+      uint64_t minimum_remaining_time =
+          last_check_time +
+          (uint64_t)(config.audio_backend_buffer_desired_length * (uint64_t)1000000000);
+      uint64_t latency_time = (uint64_t)(playing_latency(conn) * (uint64_t)1000000000);
       latency_time = latency_time / (uint64_t)conn->input_rate;
 
-      int x; // this is the first frame to be checked
-      // if we detected a first empty frame before and if it's still in the buffer!
-      if ((first_possibly_missing_frame >= 0) &&
-          (position_in_modulo_uint16_t_buffer(first_possibly_missing_frame, conn->ab_read,
-                                              conn->ab_write, NULL))) {
-        x = first_possibly_missing_frame;
-      } else {
-        x = conn->ab_read;
-      }
-
-      first_possibly_missing_frame = -1; // has not been set
-
-      int missing_frame_run_count = 0;
-      int start_of_missing_frame_run = -1;
-      int number_of_missing_frames = 0;
-      while (x != conn->ab_write) {
-        abuf_t *check_buf = conn->audio_buffer + BUFIDX(x);
-        if (!check_buf->ready) {
-          if (first_possibly_missing_frame < 0)
-            first_possibly_missing_frame = x;
-          number_of_missing_frames++;
-          // debug(1, "frame %u's initialisation_time is 0x%" PRIx64 ", latency_time is 0x%"
-          // PRIx64 ", time_now is 0x%" PRIx64 ", minimum_remaining_time is 0x%" PRIx64 ".", x,
-          // check_buf->initialisation_time, latency_time, time_now, minimum_remaining_time);
-          int too_late = ((check_buf->initialisation_time < (time_now - latency_time)) ||
-                          ((check_buf->initialisation_time - (time_now - latency_time)) <
-                           minimum_remaining_time));
-          int too_early = ((time_now - check_buf->initialisation_time) < minimum_wait_time);
-          int too_soon_after_last_request =
-              ((check_buf->resend_time != 0) &&
-               ((time_now - check_buf->resend_time) <
-                resend_repeat_interval)); // time_now can never be less than the time_tag
-
-          if (too_late)
-            check_buf->status |= 1 << 2; // too late
-          else
-            check_buf->status &= 0xFF - (1 << 2); // not too late
-          if (too_early)
-            check_buf->status |= 1 << 3; // too early
-          else
-            check_buf->status &= 0xFF - (1 << 3); // not too early
-          if (too_soon_after_last_request)
-            check_buf->status |= 1 << 4; // too soon after last request
-          else
-            check_buf->status &= 0xFF - (1 << 4); // not too soon after last request
+      if (config.disable_resend_requests == 0)
+        resend_allowance_update(conn, time_now);
+
+      // Only the buckets of the missing packet bitmap with missing packets in them, and whose check
+      // time has come, are looked at, a packet at a time in sequence order, starting at ab_read.
+      // A bucket passed over has nothing due for a request, so it ends any run being built.
+      resend_run run;
+      run.start = -1;
+      run.end = -1;
+      if (conn->missing_packet_count != 0) {
+        unsigned int buckets = missing_packet_buckets(conn);
+        unsigned int first_index = BUFIDX(conn->ab_read);
+        unsigned int first_bucket = first_index >> MISSING_PACKET_BUCKET_SHIFT;
+        // the first bucket is looked at in two parts -- from ab_read on first, and from its start
+        // up to ab_read last -- so its check time is only updated after the second part
+        uint64_t first_bucket_check_time = UINT64_MAX;
+        int first_bucket_skipped = 0;
+        unsigned int b;
+        for (b = 0; b <= buckets; b++) {
+          unsigned int bucket = (first_bucket + b) & (buckets - 1);
+          uint64_t bits = conn->missing_packet_bitmap[bucket];
+          if (b == 0)
+            bits &= ~(uint64_t)0 << (first_index & (MISSING_PACKET_BUCKET_SIZE - 1));
+          else if (b == buckets)
+            bits &= ~(~(uint64_t)0 << (first_index & (MISSING_PACKET_BUCKET_SIZE - 1)));
+          if (bits == 0)
+            continue;
+          if ((conn->missing_packet_check_time[bucket] > time_now) ||
+              ((b == buckets) && (first_bucket_skipped))) {
+            if (b == 0)
+              first_bucket_skipped = 1;
+            resend_run_end(&run, time_now, conn);
+            continue;
+          }
+          uint64_t check_time = UINT64_MAX;
+          while (bits) {
+            unsigned int bit = __builtin_ctzll(bits);
+            bits &= bits - 1;
+            unsigned int index = (bucket << MISSING_PACKET_BUCKET_SHIFT) + bit;
+            seq_t x = seq_sum(conn->ab_read, (index - first_index) & (conn->audio_buffer_size - 1));
+            abuf_t *check_buf = conn->audio_buffer + index;
+            if ((seq_diff(x, conn->ab_write) >= 0) || (check_buf->ready)) {
+              // left behind by an aliasing reset of the buffer
+              missing_packet_clear(conn, x);
+              continue;
+            }
+            // debug(1, "frame %u's initialisation_time is 0x%" PRIx64 ", latency_time is 0x%"
+            // PRIx64 ", time_now is 0x%" PRIx64 ", minimum_remaining_time is 0x%" PRIx64 ".", x,
+            // check_buf->initialisation_time, latency_time, time_now, minimum_remaining_time);
+            int too_late = ((check_buf->initialisation_time < (time_now - latency_time)) ||
+                            ((check_buf->initialisation_time - (time_now - latency_time)) <
+                             minimum_remaining_time));
+            int too_early = ((time_now - check_buf->initialisation_time) < minimum_wait_time);
+            int backoff_shift = check_buf->resend_request_number - 1;
+            if (backoff_shift < 0)
+              backoff_shift = 0;
+            else if (backoff_shift > resend_maximum_backoff_shift)
+              backoff_shift = resend_maximum_backoff_shift;
+            int too_soon_after_last_request =
+                ((check_buf->resend_time != 0) &&
+                 ((time_now - check_buf->resend_time) <
+                  (resend_repeat_interval << backoff_shift))); // time_now can never be less than
+                                                               // the time_tag
+
+            if (too_late)
+              check_buf->status |= 1 << 2; // too late
+            else
+              check_buf->status &= 0xFF - (1 << 2); // not too late
+            if (too_early)
+              check_buf->status |= 1 << 3; // too early
+            else
+              check_buf->status &= 0xFF - (1 << 3); // not too early
+            if (too_soon_after_last_request)
+              check_buf->status |= 1 << 4; // too soon after last request
+            else
+              check_buf->status &= 0xFF - (1 << 4); // not too soon after last request
 
-          if ((!too_soon_after_last_request) && (!too_late) && (!too_early)) {
-            if (start_of_missing_frame_run == -1) {
-              start_of_missing_frame_run = x;
-              missing_frame_run_count = 1;
+            // when this packet should next be looked at
+            uint64_t packet_check_time = time_now; // at the next check
+            if (too_late) {
+              // unlikely to change, unless the latency does
+              packet_check_time = time_now + resend_repeat_interval;
             } else {
-              missing_frame_run_count++;
+              if (too_early)
+                packet_check_time = check_buf->initialisation_time + minimum_wait_time;
+              if ((too_soon_after_last_request) &&
+                  (check_buf->resend_time + (resend_repeat_interval << backoff_shift) >
+                   packet_check_time))
+                packet_check_time =
+                    check_buf->resend_time + (resend_repeat_interval << backoff_shift);
+            }
+            if (packet_check_time < check_time)
+              check_time = packet_check_time;
+
+            if ((!too_soon_after_last_request) && (!too_late) && (!too_early)) {
+              debug(3, "Frame %d is missing with ab_read of %u and ab_write of %u.", x,
+                    conn->ab_read, conn->ab_write);
+              if ((run.start != -1) && (seq_diff(x, run.end) > resend_coalescing_gap + 1))
+                resend_run_end(&run, time_now, conn);
+              if (run.start == -1)
+                run.start = x;
+              run.end = x;
+            } else {
+              // a missing packet that isn't to be requested now ends the run, so that it won't
+              // be asked for again before its time
+              resend_run_end(&run, time_now, conn);
             }
-            check_buf->resend_time = time_now; // setting the time to now because we are
-                                               // definitely going to take action
-            check_buf->resend_request_number++;
-            debug(3, "Frame %d is missing with ab_read of %u and ab_write of %u.", x, conn->ab_read,
-                  conn->ab_write);
           }
-          // if (too_late) {
-          //   debug(1,"too late to get missing frame %u.", x);
-          // }
+          if (b == 0)
+            first_bucket_check_time = check_time;
+          else if (b == buckets)
+            conn->missing_packet_check_time[bucket] =
+                check_time < first_bucket_check_time ? check_time : first_bucket_check_time;
+          else
+            conn->missing_packet_check_time[bucket] = check_time;
         }
-        // if (number_of_missing_frames != 0)
-        //  debug(1,"check with x = %u, ab_read = %u, ab_write = %u, first_possibly_missing_frame
-        //  = %d.", x, conn->ab_read, conn->ab_write, first_possibly_missing_frame);
-        x = (x + 1) & 0xffff;
-        if (((check_buf->ready) || (x == conn->ab_write)) && (missing_frame_run_count > 0)) {
-          // send a resend request
-          if (missing_frame_run_count > 1)
-            debug(3, "request resend of %d packets starting at seqno %u.", missing_frame_run_count,
-                  start_of_missing_frame_run);
-          if (config.disable_resend_requests == 0) {
-            debug_mutex_unlock(&conn->ab_mutex, 3);
-            rtp_request_resend(start_of_missing_frame_run, missing_frame_run_count, conn);
-            debug_mutex_lock(&conn->ab_mutex, 20000, 1);
-            conn->resend_requests++;
-          }
-          start_of_missing_frame_run = -1;
-          missing_frame_run_count = 0;
+        // if the first bucket had nothing before ab_read, its second part wasn't looked at
+        if ((first_bucket_skipped == 0) && (first_bucket_check_time != UINT64_MAX) &&
+            ((conn->missing_packet_bitmap[first_bucket] &
+              ~(~(uint64_t)0 << (first_index & (MISSING_PACKET_BUCKET_SIZE - 1)))) == 0))
+          conn->missing_packet_check_time[first_bucket] = first_bucket_check_time;
+      }
+      resend_run_end(&run, time_now, conn);
+    }
+  }
+}
+
+// The decoder thread takes packets from the rings in the order they arrived, decrypts and decodes
+// them without holding any lock, and then takes the ab_mutex just long enough to put the decoded
+// frames into the audio buffer. So the receivers are never held up by decoding, and decoding can
+// run alongside the DSP on the player thread.
+
+static int packet_rings_are_empty(rtsp_conn_info *conn) {
+  int i;
+  for (i = 0; i < PR_number_of_rings; i++)
+    if (__atomic_load_n(&conn->packet_rings[i].head, __ATOMIC_ACQUIRE) !=
+        conn->packet_rings[i].tail)
+      return 0;
+  return 1;
+}
+
+static void decode_packets_from_rings(rtsp_conn_info *conn, short *decoded) {
+  int packets_taken = 0;
+  int i;
+  for (i = 0; i < PR_number_of_rings; i++) {
+    packet_ring *ring = &conn->packet_rings[i];
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (conn->stream.encrypted) {
+      // decrypt everything waiting in the ring first -- after a burst of resends, this keeps the
+      // cipher's code and tables hot while it works through the run
+      uint32_t t;
+      for (t = tail; t != head; t++) {
+        packet_ring_entry *entry = &ring->entries[t & (PACKET_RING_SIZE - 1)];
+        uint64_t decrypt_start = get_absolute_time_in_ns();
+        audio_packet_decrypt(entry->data, entry->length, conn);
+        stage_timings_note(&conn->decoder_timings, stage_decrypt,
+                           get_absolute_time_in_ns() - decrypt_start);
+      }
+    }
+    while (tail != head) {
+      packet_ring_entry *entry = &ring->entries[tail & (PACKET_RING_SIZE - 1)];
+      int decoded_frames = conn->max_frames_per_packet;
+      if (conn->buffered_audio == 0) {
+        uint64_t decode_start = get_absolute_time_in_ns();
+        if (audio_packet_decode(decoded, &decoded_frames, entry->data, entry->length, conn) != 0)
+          decoded_frames = -1;
+        stage_timings_note(&conn->decoder_timings, stage_decode,
+                           get_absolute_time_in_ns() - decode_start);
+      }
+      uint64_t lock_start = get_absolute_time_in_ns();
+      debug_mutex_lock(&conn->ab_mutex, 30000, 0);
+      stage_timings_note(&conn->decoder_timings, stage_ab_mutex_wait,
+                         get_absolute_time_in_ns() - lock_start);
+      add_packet_to_buffer(entry->seqno, entry->timestamp,
+                           conn->buffered_audio ? NULL : decoded, decoded_frames, entry->data,
+                           entry->length, entry->arrival_time, conn);
+      debug_mutex_unlock(&conn->ab_mutex, 0);
+      tail++;
+      __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE); // give the slot back right away
+      packets_taken++;
+    }
+  }
+  if (packets_taken) {
+    uint64_t lock_start = get_absolute_time_in_ns();
+    debug_mutex_lock(&conn->ab_mutex, 30000, 0);
+    stage_timings_note(&conn->decoder_timings, stage_ab_mutex_wait,
+                       get_absolute_time_in_ns() - lock_start);
+    check_for_missing_packets(conn);
+    debug_mutex_unlock(&conn->ab_mutex, 0);
+    int rc = pthread_cond_signal(&conn->flowcontrol);
+    if (rc)
+      debug(1, "Error signalling flowcontrol.");
+  }
+}
+
+// decode a kept packet into dest, with the lookahead_decode_mutex held, returning the number of
+// frames, or -1 if it can't be decoded
+static int decode_compressed_packet(uint8_t *packet, int length, short *dest,
+                                    rtsp_conn_info *conn) {
+  int frames = conn->max_frames_per_packet;
+  if (audio_packet_decode(dest, &frames, packet, length, conn) != 0)
+    frames = -1;
+  return frames;
+}
+
+// with the ab_mutex held, put the decoded packet in its place in the lookahead ring, unless it
+// couldn't be decoded, in which case it's treated as missing
+static void finish_decoding(abuf_t *abuf, seq_t seqno, const short *decoded, int frames,
+                            rtsp_conn_info *conn) {
+  release_compressed_packet(conn, abuf);
+  if (frames >= 0) {
+    if (decoded)
+      memcpy(lookahead_slot(conn, seqno), decoded, frames * conn->input_bytes_per_frame);
+    abuf->length = frames;
+  } else {
+    debug(1, "Bad audio packet detected and discarded.");
+    abuf->ready = 0;
+    abuf->status = 1 << 1; // bad packet, discarded
+    abuf->resend_request_number = 0;
+    abuf->given_timestamp = 0;
+    abuf->sequence_number = 0;
+    missing_packet_set(conn, seqno);
+  }
+}
+
+// In buffered audio mode, decode what has arrived of the next lookahead_packets after ab_read.
+// They are decoded in batches, without the ab_mutex, into the decoder thread's own buffer, and
+// then copied into the lookahead ring with the ab_mutex held, if they are still wanted -- the
+// player thread may have had to decode one itself in the meantime, or a flush may have thrown
+// them away. The chunks holding them are kept while they are being decoded.
+static void decode_ahead(rtsp_conn_info *conn, short *decoded) {
+  size_t entry_size = conn->input_bytes_per_frame * conn->max_frames_per_packet;
+  int batch_size;
+  do {
+    seq_t seqnos[LOOKAHEAD_DECODE_BATCH];
+    uint8_t *packets[LOOKAHEAD_DECODE_BATCH];
+    int lengths[LOOKAHEAD_DECODE_BATCH];
+    compressed_chunk *chunks[LOOKAHEAD_DECODE_BATCH];
+    int frames[LOOKAHEAD_DECODE_BATCH];
+    int i;
+    batch_size = 0;
+    debug_mutex_lock(&conn->ab_mutex, 30000, 0);
+    if (conn->ab_synced) {
+      seq_t x = conn->ab_read;
+      unsigned int n;
+      for (n = 0; (n < conn->lookahead_packets) && (x != conn->ab_write) &&
+                  (batch_size < LOOKAHEAD_DECODE_BATCH);
+           n++, x++) {
+        abuf_t *abuf = conn->audio_buffer + BUFIDX(x);
+        if ((abuf->ready) && (abuf->compressed) && (abuf->sequence_number == x)) {
+          seqnos[batch_size] = x;
+          packets[batch_size] = abuf->compressed;
+          lengths[batch_size] = abuf->compressed_length;
+          chunks[batch_size] = abuf->chunk;
+          abuf->chunk->packets++; // keep it while the packet is being decoded
+          batch_size++;
         }
       }
-      if (number_of_missing_frames == 0)
-        first_possibly_missing_frame = conn->ab_write;
     }
+    debug_mutex_unlock(&conn->ab_mutex, 0);
+    if (batch_size) {
+      uint64_t decode_start = get_absolute_time_in_ns();
+      pthread_mutex_lock(&conn->lookahead_decode_mutex);
+      for (i = 0; i < batch_size; i++)
+        frames[i] =
+            decode_compressed_packet(packets[i], lengths[i],
+                                     (short *)((char *)decoded + i * entry_size), conn);
+      pthread_mutex_unlock(&conn->lookahead_decode_mutex);
+      uint64_t lock_start = get_absolute_time_in_ns();
+      stage_timings_note(&conn->decoder_timings, stage_decode, lock_start - decode_start);
+      debug_mutex_lock(&conn->ab_mutex, 30000, 0);
+      stage_timings_note(&conn->decoder_timings, stage_ab_mutex_wait,
+                         get_absolute_time_in_ns() - lock_start);
+      for (i = 0; i < batch_size; i++) {
+        abuf_t *abuf = conn->audio_buffer + BUFIDX(seqnos[i]);
+        if ((abuf->compressed == packets[i]) && (abuf->sequence_number == seqnos[i]) &&
+            (abuf->ready))
+          finish_decoding(abuf, seqnos[i], (short *)((char *)decoded + i * entry_size), frames[i],
+                          conn);
+        compressed_chunk_put(conn, chunks[i]);
+      }
+      debug_mutex_unlock(&conn->ab_mutex, 0);
+    }
+  } while (batch_size == LOOKAHEAD_DECODE_BATCH);
+}
+
+// In buffered audio mode, called by the player thread, with the ab_mutex held, for the packet it
+// is about to play, in case the decoder thread hasn't got to it
+static void decode_now(abuf_t *abuf, seq_t seqno, rtsp_conn_info *conn) {
+  if ((abuf->ready) && (abuf->compressed)) {
+    debug(3, "Packet %u is being decoded by the player.", seqno);
+    pthread_mutex_lock(&conn->lookahead_decode_mutex);
+    int frames = decode_compressed_packet(abuf->compressed, abuf->compressed_length,
+                                          lookahead_slot(conn, seqno), conn);
+    pthread_mutex_unlock(&conn->lookahead_decode_mutex);
+    finish_decoding(abuf, seqno, NULL, frames, conn);
   }
-  debug_mutex_unlock(&conn->ab_mutex, 0);
+  abuf->data = lookahead_slot(conn, seqno);
+}
+
+// In buffered audio mode, called by the player thread when it has taken a packet, so that the
+// decoder thread moves the lookahead on, whether packets are arriving or not
+static void request_decode_ahead(rtsp_conn_info *conn) {
+  pthread_mutex_lock(&conn->decoder_mutex);
+  conn->lookahead_decode_wanted = 1;
+  int rc = pthread_cond_signal(&conn->decoder_cond);
+  pthread_mutex_unlock(&conn->decoder_mutex);
+  if (rc)
+    debug(1, "Error signalling the decoder.");
+}
+
+int player_input_is_idle(rtsp_conn_info *conn) {
+  uint64_t last = __atomic_load_n(&conn->time_of_last_audio_packet, __ATOMIC_RELAXED);
+  return ((last == 0) || (get_absolute_time_in_ns() - last > PLAYER_IDLE_AFTER_NS));
+}
+
+static void decoder_thread_cleanup_handler(void *arg) { free(arg); }
+
+static void decoder_wait_cleanup_handler(void *arg) {
+  pthread_mutex_unlock((pthread_mutex_t *)arg);
+}
+
+static void *decoder_thread_func(void *arg) {
+  thread_set_name("decoder");
+  rtsp_conn_info *conn = (rtsp_conn_info *)arg;
+  // in buffered audio mode, packets are decoded a batch at a time
+  short *decoded = malloc(conn->input_bytes_per_frame * conn->max_frames_per_packet *
+                          (conn->buffered_audio ? LOOKAHEAD_DECODE_BATCH : 1));
+  if (decoded == NULL)
+    die("Failed to allocate memory for the decoder buffer.");
+  pthread_cleanup_push(decoder_thread_cleanup_handler, (void *)decoded);
+  while (1) {
+    pthread_mutex_lock(&conn->decoder_mutex);
+    pthread_cleanup_push(decoder_wait_cleanup_handler, (void *)&conn->decoder_mutex);
+    while ((packet_rings_are_empty(conn)) && (conn->lookahead_decode_wanted == 0))
+      pthread_cond_wait(&conn->decoder_cond, &conn->decoder_mutex); // a cancellation point
+    conn->lookahead_decode_wanted = 0;
+    pthread_cleanup_pop(1);
+    // the only cancellation point should be the wait above
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+    decode_packets_from_rings(conn, decoded);
+    if (conn->buffered_audio)
+      decode_ahead(conn, decoded);
+    pthread_setcancelstate(oldState, NULL);
+  }
+  pthread_cleanup_pop(1);
+  pthread_exit(NULL);
 }
 
 int32_t rand_in_range(int32_t exclusive_range_limit) {
@@ -648,11 +1547,14 @@ int get_and_check_effective_latency(rtsp_conn_info *conn, uint32_t *effective_la
   // large
 
   int result = 0;
+  // keep about one second of buffers back, but not more than an eighth of a small buffer
+  uint32_t headroom = config.minimum_free_buffer_headroom;
+  if (headroom > conn->audio_buffer_size / 8)
+    headroom = conn->audio_buffer_size / 8;
   if (offset_time >= 0.0) {
     uint32_t latency_addition = (uint32_t)(offset_time * conn->input_rate);
-    // keep about one second of buffers back
     if ((*effective_latency + latency_addition) <=
-        (conn->max_frames_per_packet * (BUFFER_FRAMES - config.minimum_free_buffer_headroom)))
+        (conn->max_frames_per_packet * (conn->audio_buffer_size - headroom)))
       *effective_latency += latency_addition;
     else
       result = 1;
@@ -681,9 +1583,8 @@ static inline void process_sample(int32_t sample, char **outp, sps_format_t form
   int64_t hyper_sample = sample;
   int result = 0;
 
-  if (config.loudness) {
-    hyper_sample <<=
-        32; // Do not apply volume as it has already been done with the Loudness DSP filter
+  if (conn->volume_applied_by_dsp) {
+    hyper_sample <<= 32; // Do not apply volume as it has already been done by the DSP stage
   } else {
     int64_t hyper_volume = (int64_t)volume << 16;
     hyper_sample = hyper_sample * hyper_volume; // this is 64 bit bit multiplication -- we may need
@@ -692,72 +1593,8 @@ static inline void process_sample(int32_t sample, char **outp, sps_format_t form
 
   // next, do dither, if necessary
   if (dither) {
-
-    // add a TPDF dither -- see
-    // http://educypedia.karadimov.info/library/DitherExplained.pdf
-    // and the discussion around https://www.hydrogenaud.io/forums/index.php?showtopic=16963&st=25
-
-    // I think, for a 32 --> 16 bits, the range of
-    // random numbers needs to be from -2^16 to 2^16, i.e. from -65536 to 65536 inclusive, not from
-    // -32768 to +32767
-
-    // Actually, what would be generated here is from -65535 to 65535, i.e. one less on the limits.
-
-    // See the original paper at
-    // http://www.ece.rochester.edu/courses/ECE472/resources/Papers/Lipshitz_1992.pdf
-    // by Lipshitz, Wannamaker and Vanderkooy, 1992.
-
-    int64_t dither_mask = 0;
-    switch (format) {
-    case SPS_FORMAT_S32:
-    case SPS_FORMAT_S32_LE:
-    case SPS_FORMAT_S32_BE:
-      dither_mask = (int64_t)1 << (64 - 32);
-      break;
-    case SPS_FORMAT_S24:
-    case SPS_FORMAT_S24_LE:
-    case SPS_FORMAT_S24_BE:
-    case SPS_FORMAT_S24_3LE:
-    case SPS_FORMAT_S24_3BE:
-      dither_mask = (int64_t)1 << (64 - 24);
-      break;
-    case SPS_FORMAT_S16:
-    case SPS_FORMAT_S16_LE:
-    case SPS_FORMAT_S16_BE:
-      dither_mask = (int64_t)1 << (64 - 16);
-      break;
-    case SPS_FORMAT_S8:
-    case SPS_FORMAT_U8:
-      dither_mask = (int64_t)1 << (64 - 8);
-      break;
-    case SPS_FORMAT_UNKNOWN:
-      die("Unexpected SPS_FORMAT_UNKNOWN while calculating dither mask.");
-      break;
-    case SPS_FORMAT_AUTO:
-      die("Unexpected SPS_FORMAT_AUTO while calculating dither mask.");
-      break;
-    case SPS_FORMAT_INVALID:
-      die("Unexpected SPS_FORMAT_INVALID while calculating dither mask.");
-      break;
-    }
-    dither_mask -= 1;
-    int64_t r = r64i();
-
-    int64_t tpdf = (r & dither_mask) - (conn->previous_random_number & dither_mask);
-    conn->previous_random_number = r;
-    // add dither, allowing for clipping
-    if (tpdf >= 0) {
-      if (INT64_MAX - tpdf >= hyper_sample)
-        hyper_sample += tpdf;
-      else
-        hyper_sample = INT64_MAX;
-    } else {
-      if (INT64_MIN - tpdf <= hyper_sample)
-        hyper_sample += tpdf;
-      else
-        hyper_sample = INT64_MIN;
-    }
-    // dither is complete here
+    dither_set_resolution(&conn->dither, sps_format_resolution(format));
+    dither_apply(&conn->dither, &hyper_sample, 1);
   }
 
   // move the result to the desired position in the int64_t
@@ -883,7 +1720,452 @@ static inline void process_sample(int32_t sample, char **outp, sps_format_t form
     break;
   }
 
-  *outp += result;
+  *outp += result;
+}
+
+// Block versions of process_sample.
+// The work is done in two stages over a small chunk of samples at a time:
+// (a) scale each sample by the volume and shift it down to the output resolution, leaving a
+// sign-extended int32_t, and
+// (b) pack the int32_ts into the output format.
+// The format switch is resolved at compile time, in a kernel for each format, and, when no dither
+// is being applied, stage (a) is done using SSE4.1 or AVX2 (chosen at runtime) or NEON (chosen at
+// build time) where available -- or skipped at full volume. With dither, stage (a) is done in 64
+// bits, with the dither for the whole chunk added before the shift.
+// The arithmetic is the same as in process_sample, so the output is bit-identical to it.
+
+#define SAMPLE_BLOCK_SIZE 256
+
+// Stage (a). With 0 <= volume <= 0x10000, ((int64_t)sample * volume) >> 16 always fits in an
+// int32_t, so shifting that down by (32 - resolution) gives the same result as shifting the
+// 64-bit product in process_sample down by (64 - resolution).
+static void scale_samples_scalar(const int32_t *in, int32_t *out, int n, int volume, int shift) {
+  int i;
+  for (i = 0; i < n; i++)
+    out[i] = ((int32_t)(((int64_t)in[i] * volume) >> 16)) >> shift;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+__attribute__((target("sse4.1"))) static void
+scale_samples_sse41(const int32_t *in, int32_t *out, int n, int volume, int shift) {
+  __m128i vol = _mm_set1_epi32(volume);
+  __m128i sh = _mm_cvtsi32_si128(shift);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i s = _mm_loadu_si128((const __m128i *)(in + i));
+    __m128i even = _mm_srli_epi64(_mm_mul_epi32(s, vol), 16);
+    __m128i odd = _mm_srli_epi64(_mm_mul_epi32(_mm_srli_epi64(s, 32), vol), 16);
+    __m128i r = _mm_blend_epi16(even, _mm_slli_epi64(odd, 32), 0xCC);
+    _mm_storeu_si128((__m128i *)(out + i), _mm_sra_epi32(r, sh));
+  }
+  scale_samples_scalar(in + i, out + i, n - i, volume, shift);
+}
+
+__attribute__((target("avx2"))) static void
+scale_samples_avx2(const int32_t *in, int32_t *out, int n, int volume, int shift) {
+  __m256i vol = _mm256_set1_epi32(volume);
+  __m128i sh = _mm_cvtsi32_si128(shift);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i s = _mm256_loadu_si256((const __m256i *)(in + i));
+    __m256i even = _mm256_srli_epi64(_mm256_mul_epi32(s, vol), 16);
+    __m256i odd = _mm256_srli_epi64(_mm256_mul_epi32(_mm256_srli_epi64(s, 32), vol), 16);
+    __m256i r = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+    _mm256_storeu_si256((__m256i *)(out + i), _mm256_sra_epi32(r, sh));
+  }
+  scale_samples_scalar(in + i, out + i, n - i, volume, shift);
+}
+
+static void (*scale_samples_impl)(const int32_t *, int32_t *, int, int, int) = NULL;
+
+static void scale_samples(const int32_t *in, int32_t *out, int n, int volume, int shift) {
+  if (scale_samples_impl == NULL) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      scale_samples_impl = scale_samples_avx2;
+    else if (__builtin_cpu_supports("sse4.1"))
+      scale_samples_impl = scale_samples_sse41;
+    else
+      scale_samples_impl = scale_samples_scalar;
+  }
+  scale_samples_impl(in, out, n, volume, shift);
+}
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+static void scale_samples(const int32_t *in, int32_t *out, int n, int volume, int shift) {
+  int32x2_t vol = vdup_n_s32(volume);
+  int32x4_t sh = vdupq_n_s32(-shift); // a negative shift count is a right shift
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    int32x4_t s = vld1q_s32(in + i);
+    int32x2_t lo = vshrn_n_s64(vmull_s32(vget_low_s32(s), vol), 16);
+    int32x2_t hi = vshrn_n_s64(vmull_s32(vget_high_s32(s), vol), 16);
+    vst1q_s32(out + i, vshlq_s32(vcombine_s32(lo, hi), sh));
+  }
+  scale_samples_scalar(in + i, out + i, n - i, volume, shift);
+}
+
+#else
+#define scale_samples scale_samples_scalar
+#endif
+
+// Stage (b), with the samples shifted down first by the given amount -- which, for a constant
+// format and shift, the compiler turns into a plain copy or shuffle.
+static inline __attribute__((always_inline)) char *
+pack_samples(const int32_t *in, int n, char *op, sps_format_t format, int shift) {
+  int i;
+#define S(i) (in[i] >> shift)
+  switch (format) {
+  case SPS_FORMAT_S32_LE:
+    for (i = 0; i < n; i++) {
+      *op++ = (uint8_t)S(i);
+      *op++ = (uint8_t)(S(i) >> 8);
+      *op++ = (uint8_t)(S(i) >> 16);
+      *op++ = (uint8_t)(S(i) >> 24);
+    }
+    break;
+  case SPS_FORMAT_S32_BE:
+    for (i = 0; i < n; i++) {
+      *op++ = (uint8_t)(S(i) >> 24);
+      *op++ = (uint8_t)(S(i) >> 16);
+      *op++ = (uint8_t)(S(i) >> 8);
+      *op++ = (uint8_t)S(i);
+    }
+    break;
+  case SPS_FORMAT_S24_LE:
+    for (i = 0; i < n; i++) {
+      *op++ = (uint8_t)S(i);
+      *op++ = (uint8_t)(S(i) >> 8);
+      *op++ = (uint8_t)(S(i) >> 16);
+      *op++ = 0;
+    }
+    break;
+  case SPS_FORMAT_S24_BE:
+    for (i = 0; i < n; i++) {
+      *op++ = 0;
+      *op++ = (uint8_t)(S(i) >> 16);
+      *op++ = (uint8_t)(S(i) >> 8);
+      *op++ = (uint8_t)S(i);
+    }
+    break;
+  case SPS_FORMAT_S32:
+  case SPS_FORMAT_S24:
+    if (shift == 0) {
+      memcpy(op, in, n * sizeof(int32_t));
+      op += n * sizeof(int32_t);
+    } else {
+      int32_t *ip = (int32_t *)op;
+      for (i = 0; i < n; i++)
+        *ip++ = S(i);
+      op = (char *)ip;
+    }
+    break;
+  case SPS_FORMAT_S24_3LE:
+    for (i = 0; i < n; i++) {
+      *op++ = (uint8_t)S(i);
+      *op++ = (uint8_t)(S(i) >> 8);
+      *op++ = (uint8_t)(S(i) >> 16);
+    }
+    break;
+  case SPS_FORMAT_S24_3BE:
+    for (i = 0; i < n; i++) {
+      *op++ = (uint8_t)(S(i) >> 16);
+      *op++ = (uint8_t)(S(i) >> 8);
+      *op++ = (uint8_t)S(i);
+    }
+    break;
+  case SPS_FORMAT_S16_LE:
+    for (i = 0; i < n; i++) {
+      *op++ = (uint8_t)S(i);
+      *op++ = (uint8_t)(S(i) >> 8);
+    }
+    break;
+  case SPS_FORMAT_S16_BE:
+    for (i = 0; i < n; i++) {
+      *op++ = (uint8_t)(S(i) >> 8);
+      *op++ = (uint8_t)S(i);
+    }
+    break;
+  case SPS_FORMAT_S16: {
+    int16_t *sp = (int16_t *)op;
+    for (i = 0; i < n; i++)
+      *sp++ = (int16_t)S(i);
+    op = (char *)sp;
+  } break;
+  case SPS_FORMAT_S8:
+    for (i = 0; i < n; i++)
+      *op++ = S(i);
+    break;
+  case SPS_FORMAT_U8:
+    for (i = 0; i < n; i++)
+      *op++ = S(i) + 128;
+    break;
+  default:
+    die("Unexpected output format %d while packing samples", format);
+    break;
+  }
+#undef S
+  return op;
+}
+
+// The sample kernels. There is a set of three for each output format, made from the templates
+// below with the format and its resolution as constants, so that the format switch and the
+// shifts are resolved at compile time:
+// unity -- no dither at full volume, which is just a shift and a pack into the output format,
+// scaled -- no dither, with the volume applied, and
+// dithered -- with dither, which is added a block at a time to the full 64-bit samples, as in
+// process_sample, at any volume.
+// (Loudness and the equaliser are applied before this, a block at a time, in floating point.)
+
+static inline __attribute__((always_inline)) void
+process_samples_unity(const int32_t *in, int n, char **outp, sps_format_t format, int resolution) {
+  *outp = pack_samples(in, n, *outp, format, 32 - resolution);
+}
+
+static inline __attribute__((always_inline)) void
+process_samples_scaled(const int32_t *in, int n, char **outp, int volume, sps_format_t format,
+                       int resolution) {
+  int32_t scaled[SAMPLE_BLOCK_SIZE];
+  char *op = *outp;
+  while (n > 0) {
+    int chunk = n < SAMPLE_BLOCK_SIZE ? n : SAMPLE_BLOCK_SIZE;
+    scale_samples(in, scaled, chunk, volume, 32 - resolution);
+    op = pack_samples(scaled, chunk, op, format, 0);
+    in += chunk;
+    n -= chunk;
+  }
+  *outp = op;
+}
+
+static inline __attribute__((always_inline)) void
+process_samples_dithered(const int32_t *in, int n, char **outp, int volume, rtsp_conn_info *conn,
+                         sps_format_t format, int resolution) {
+  int64_t hyper[SAMPLE_BLOCK_SIZE]; // no bigger than DITHER_BLOCK_SIZE
+  int32_t scaled[SAMPLE_BLOCK_SIZE];
+  int64_t hyper_volume = (int64_t)volume << 16;
+  int shift = 64 - resolution;
+  char *op = *outp;
+  dither_set_resolution(&conn->dither, resolution);
+  while (n > 0) {
+    int chunk = n < SAMPLE_BLOCK_SIZE ? n : SAMPLE_BLOCK_SIZE;
+    int i;
+    for (i = 0; i < chunk; i++)
+      hyper[i] = in[i] * hyper_volume;
+    dither_apply(&conn->dither, hyper, chunk);
+    for (i = 0; i < chunk; i++)
+      scaled[i] = (int32_t)(hyper[i] >> shift);
+    op = pack_samples(scaled, chunk, op, format, 0);
+    in += chunk;
+    n -= chunk;
+  }
+  *outp = op;
+}
+
+// volume is taken to be 0 to 0x10000, and 0x10000 for the unity kernel
+typedef void (*sample_kernel)(const int32_t *in, int n, char **outp, int volume,
+                              rtsp_conn_info *conn);
+
+typedef struct {
+  sample_kernel unity;
+  sample_kernel scaled;
+  sample_kernel dithered;
+} sample_kernel_set;
+
+#define SAMPLE_KERNELS(name, format, resolution)                                                   \
+  static void name##_unity(const int32_t *in, int n, char **outp,                                 \
+                           __attribute__((unused)) int volume,                                     \
+                           __attribute__((unused)) rtsp_conn_info *conn) {                         \
+    process_samples_unity(in, n, outp, format, resolution);                                        \
+  }                                                                                                \
+  static void name##_scaled(const int32_t *in, int n, char **outp, int volume,                    \
+                            __attribute__((unused)) rtsp_conn_info *conn) {                        \
+    process_samples_scaled(in, n, outp, volume, format, resolution);                               \
+  }                                                                                                \
+  static void name##_dithered(const int32_t *in, int n, char **outp, int volume,                  \
+                              rtsp_conn_info *conn) {                                              \
+    process_samples_dithered(in, n, outp, volume, conn, format, resolution);                       \
+  }
+
+SAMPLE_KERNELS(kernel_s8, SPS_FORMAT_S8, 8)
+SAMPLE_KERNELS(kernel_u8, SPS_FORMAT_U8, 8)
+SAMPLE_KERNELS(kernel_s16, SPS_FORMAT_S16, 16)
+SAMPLE_KERNELS(kernel_s16_le, SPS_FORMAT_S16_LE, 16)
+SAMPLE_KERNELS(kernel_s16_be, SPS_FORMAT_S16_BE, 16)
+SAMPLE_KERNELS(kernel_s24, SPS_FORMAT_S24, 24)
+SAMPLE_KERNELS(kernel_s24_le, SPS_FORMAT_S24_LE, 24)
+SAMPLE_KERNELS(kernel_s24_be, SPS_FORMAT_S24_BE, 24)
+SAMPLE_KERNELS(kernel_s24_3le, SPS_FORMAT_S24_3LE, 24)
+SAMPLE_KERNELS(kernel_s24_3be, SPS_FORMAT_S24_3BE, 24)
+SAMPLE_KERNELS(kernel_s32, SPS_FORMAT_S32, 32)
+SAMPLE_KERNELS(kernel_s32_le, SPS_FORMAT_S32_LE, 32)
+SAMPLE_KERNELS(kernel_s32_be, SPS_FORMAT_S32_BE, 32)
+
+#define SAMPLE_KERNEL_SET(name) {name##_unity, name##_scaled, name##_dithered}
+
+static const sample_kernel_set sample_kernels[] = {
+    [SPS_FORMAT_S8] = SAMPLE_KERNEL_SET(kernel_s8),
+    [SPS_FORMAT_U8] = SAMPLE_KERNEL_SET(kernel_u8),
+    [SPS_FORMAT_S16] = SAMPLE_KERNEL_SET(kernel_s16),
+    [SPS_FORMAT_S16_LE] = SAMPLE_KERNEL_SET(kernel_s16_le),
+    [SPS_FORMAT_S16_BE] = SAMPLE_KERNEL_SET(kernel_s16_be),
+    [SPS_FORMAT_S24] = SAMPLE_KERNEL_SET(kernel_s24),
+    [SPS_FORMAT_S24_LE] = SAMPLE_KERNEL_SET(kernel_s24_le),
+    [SPS_FORMAT_S24_BE] = SAMPLE_KERNEL_SET(kernel_s24_be),
+    [SPS_FORMAT_S24_3LE] = SAMPLE_KERNEL_SET(kernel_s24_3le),
+    [SPS_FORMAT_S24_3BE] = SAMPLE_KERNEL_SET(kernel_s24_3be),
+    [SPS_FORMAT_S32] = SAMPLE_KERNEL_SET(kernel_s32),
+    [SPS_FORMAT_S32_LE] = SAMPLE_KERNEL_SET(kernel_s32_le),
+    [SPS_FORMAT_S32_BE] = SAMPLE_KERNEL_SET(kernel_s32_be),
+};
+
+// the kernels for an output format, or NULL if it isn't one
+static const sample_kernel_set *sample_kernels_for(sps_format_t format) {
+  if ((format >= sizeof(sample_kernels) / sizeof(sample_kernel_set)) ||
+      (sample_kernels[format].unity == NULL))
+    return NULL;
+  return &sample_kernels[format];
+}
+
+// Software volume changes are ramped rather than applied all at once, which would click. The gain
+// moves towards its target by an equal step after every block of VOLUME_RAMP_BLOCK_FRAMES frames,
+// reaching it after VOLUME_RAMP_BLOCKS blocks -- about 23 milliseconds at 44,100 frames per second.
+#define VOLUME_RAMP_BLOCK_FRAMES 128
+#define VOLUME_RAMP_BLOCKS 8
+
+// Get the software volume for the next frames of output, heading for the target volume, and the
+// number of them, up to the number given, that it applies to.
+static int software_volume_block(rtsp_conn_info *conn, int target, int frames, int *block_frames) {
+  if (conn->ramped_volume < 0) // nothing has been played yet, so there's nothing to ramp from
+    conn->ramped_volume = target;
+  if (conn->ramped_volume == target) {
+    conn->volume_ramp_frames = 0;
+    *block_frames = frames;
+    return target;
+  }
+  if (target != conn->volume_ramp_target) {
+    // a new ramp, from wherever the last one had got to
+    conn->volume_ramp_target = target;
+    conn->volume_ramp_step = abs(target - conn->ramped_volume) / VOLUME_RAMP_BLOCKS;
+    if (conn->volume_ramp_step == 0)
+      conn->volume_ramp_step = 1;
+  }
+  int volume = conn->ramped_volume;
+  int frames_left_in_block = VOLUME_RAMP_BLOCK_FRAMES - conn->volume_ramp_frames;
+  *block_frames = frames < frames_left_in_block ? frames : frames_left_in_block;
+  conn->volume_ramp_frames += *block_frames;
+  if (conn->volume_ramp_frames == VOLUME_RAMP_BLOCK_FRAMES) {
+    conn->volume_ramp_frames = 0;
+    if (abs(target - conn->ramped_volume) <= conn->volume_ramp_step)
+      conn->ramped_volume = target;
+    else if (target > conn->ramped_volume)
+      conn->ramped_volume += conn->volume_ramp_step;
+    else
+      conn->ramped_volume -= conn->volume_ramp_step;
+  }
+  return volume;
+}
+
+// process n samples, i.e. n/2 frames of interleaved stereo, at the given volume, with the kernels
+// for the output format
+static void process_samples_at_volume(const int32_t *in, int n, char **outp,
+                                      const sample_kernel_set *kernels, sps_format_t format,
+                                      int volume, int dither, rtsp_conn_info *conn) {
+  if ((kernels == NULL) || (volume < 0) || (volume > 0x10000)) {
+    int i;
+    for (i = 0; i < n; i++)
+      process_sample(in[i], outp, format, volume, dither, conn);
+  } else if (dither) {
+    kernels->dithered(in, n, outp, volume, conn);
+  } else if (volume == 0x10000) {
+    kernels->unity(in, n, outp, volume, conn);
+  } else {
+    kernels->scaled(in, n, outp, volume, conn);
+  }
+}
+
+// process n samples (n/2 stereo frames), ramping the volume towards the one given
+static void process_samples(const int32_t *in, int n, char **outp, sps_format_t format, int volume,
+                            int dither, rtsp_conn_info *conn) {
+  const sample_kernel_set *kernels = sample_kernels_for(format); // once for all the samples
+  if (conn->volume_applied_by_dsp) {
+    // volume has already been applied, and ramped, by the DSP stage
+    process_samples_at_volume(in, n, outp, kernels, format, 0x10000, dither, conn);
+  } else {
+    while (n > 0) {
+      int frames;
+      int block_volume = software_volume_block(conn, volume, n / 2, &frames);
+      if (frames == 0) // an odd sample out
+        frames = 1;
+      int samples = frames * 2 < n ? frames * 2 : n;
+      process_samples_at_volume(in, samples, outp, kernels, format, block_volume, dither, conn);
+      in += samples;
+      n -= samples;
+    }
+  }
+}
+
+// play frames of silence, with dither if necessary, a piece at a time from the shared templates
+static void play_silence(rtsp_conn_info *conn, int64_t frames) {
+  while (frames > 0) {
+    size_t fs;
+    const void *silence = silence_get(config.output_format, conn->enable_dither, frames,
+                                      &conn->silence_position, &fs);
+    config.output->play((void *)silence, fs);
+    frames -= fs;
+  }
+}
+
+// overwrite frames of output with silence, with dither if necessary
+static void fill_with_silence(rtsp_conn_info *conn, char *buf, int frames) {
+  size_t frame_size = silence_frame_size(config.output_format);
+  while (frames > 0) {
+    size_t fs;
+    const void *silence = silence_get(config.output_format, conn->enable_dither, frames,
+                                      &conn->silence_position, &fs);
+    memcpy(buf, silence, fs * frame_size);
+    buf += fs * frame_size;
+    frames -= fs;
+  }
+}
+
+// Find somewhere to put the formatted output of a packet: directly into the output device's
+// own buffer, if the backend allows it and there's room, or into conn->outbuf otherwise.
+static char *get_output_buffer(rtsp_conn_info *conn, int *direct) {
+  char *response = NULL;
+  if (config.output->get_write_buffer)
+    response = config.output->get_write_buffer(conn->max_frames_per_packet *
+                                                   conn->output_sample_ratio +
+                                               conn->max_frame_size_change);
+  *direct = (response != NULL);
+  if (response == NULL)
+    response = conn->outbuf;
+  return response;
+}
+
+// play the frames put into the buffer from get_output_buffer
+static void play_output_buffer(rtsp_conn_info *conn, char *buf, int direct, int frames) {
+  if (conn->software_mute_enabled)
+    fill_with_silence(conn, buf, frames);
+  uint64_t output_start = get_absolute_time_in_ns();
+  if (direct) {
+    int ret = config.output->commit(frames);
+    if (ret != 0) {
+      // the frames can't be given to play() instead, as the space they were written into may
+      // have gone, so they are lost, and the device will have a gap, as with an underrun
+      debug(1,
+            "Connection %d: error %d committing %d frames to the output device -- they are lost.",
+            conn->connection_number, ret, frames);
+      if (ret != -EPIPE) // an underrun while committing was counted by the backend
+        metrics_count_event(metrics_event_underrun);
+    }
+  } else if (frames == 0)
+    debug(1, "play_samples==0 skipping it (1).");
+  else
+    config.output->play(buf, frames);
+  stage_timings_note(&conn->player_timings, stage_output,
+                     get_absolute_time_in_ns() - output_start);
 }
 
 void buffer_get_frame_cleanup_handler(void *arg) {
@@ -899,7 +2181,10 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
   abuf_t *curframe = NULL;
   int notified_buffer_empty = 0; // diagnostic only
 
+  uint64_t lock_start = get_absolute_time_in_ns();
   debug_mutex_lock(&conn->ab_mutex, 30000, 0);
+  stage_timings_note(&conn->player_timings, stage_ab_mutex_wait,
+                     get_absolute_time_in_ns() - lock_start);
 
   int wait;
   long dac_delay = 0; // long because alsa returns a long
@@ -938,7 +2223,11 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
       }
 
     debug_mutex_lock(&conn->flush_mutex, 1000, 0);
-    if (conn->flush_requested == 1) {
+    // Only a request to flush everything flushes the output device. Otherwise the flush point is
+    // beyond what the device has been given, which is only a fraction of a second, so it's left to
+    // play out rather than being thrown away with the device's own buffering, which would have to
+    // be built up again with a silent lead-in.
+    if ((conn->flush_requested == 1) && (conn->flush_rtp_timestamp == 0)) {
       if (conn->flush_output_flushed == 0)
         if (config.output->flush) {
           config.output->flush(); // no cancellation points
@@ -949,6 +2238,7 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
     // now check to see it the flush request is for frames in the buffer or not
     // if the first_packet_timestamp is zero, don't check
     int flush_needed = 0;
+    int partial_flush_needed = 0; // just drop the frames before the flush frame
     int drop_request = 0;
     if ((conn->flush_requested == 1) && (conn->flush_rtp_timestamp == 0)) {
       debug(1, "flush request: flush frame 0 -- flush assumed to be needed.");
@@ -975,9 +2265,9 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
               uint32_t last_frame_in_buffer = lastPacket->given_timestamp + lastPacket->length - 1;
               // now we have to work out if the flush frame is in the buffer
               // if it is later than the end of the buffer, flush everything and keep the request
-              // active. if it is in the buffer, we need to flush part of the buffer. Actually we
-              // flush the entire buffer and drop the request. if it is before the buffer, no flush
-              // is needed. Drop the request.
+              // active. if it is in the buffer, flush the part of the buffer before it, keeping
+              // the rest, which has come after the flush, and drop the request. if it is before
+              // the buffer, no flush is needed. Drop the request.
               if (offset_from_first_frame > 0) {
                 int32_t offset_to_last_frame =
                     (int32_t)(last_frame_in_buffer - conn->flush_rtp_timestamp);
@@ -988,7 +2278,7 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
                         conn->flush_rtp_timestamp, last_frame_in_buffer - first_frame_in_buffer + 1,
                         first_frame_in_buffer, last_frame_in_buffer);
                   drop_request = 1;
-                  flush_needed = 1;
+                  partial_flush_needed = 1;
                 } else {
                   debug(2,
                         "flush request: flush frame %u pending -- buffer contains %u frames, from "
@@ -1016,14 +2306,34 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
         // leave flush request pending and don't do a buffer flush, because there isn't one
       }
     }
-    if (flush_needed) {
-      debug(2, "flush request: flush done.");
-      ab_resync(conn); // no cancellation points
+    if ((flush_needed) || (partial_flush_needed)) {
+      // a flush to a given frame leaves the output device alone, as above, unless the backend
+      // holds enough audio for it to matter
+      if ((conn->flush_rtp_timestamp != 0) && (conn->flush_output_flushed == 0) &&
+          (config.output->discard)) {
+        config.output->discard();
+        conn->flush_output_flushed = 1;
+        debug(2, "flush request: audio waiting in the backend discarded.");
+      }
+      if (partial_flush_needed) {
+        unsigned int dropped = ab_drop_before(conn, conn->flush_rtp_timestamp);
+        debug(2, "flush request: partial flush done -- %u packets dropped, %u kept.", dropped,
+              (seq_t)(conn->ab_write - conn->ab_read));
+      } else {
+        debug(2, "flush request: flush done.");
+        ab_resync(conn); // no cancellation points
+      }
       conn->first_packet_timestamp = 0;
       conn->first_packet_time_to_play = 0;
       conn->time_since_play_started = 0;
       have_sent_prefiller_silence = 0;
       dac_delay = 0;
+#ifdef CONFIG_SOXR
+      if (conn->soxr_vr) { // don't let the end of the flushed audio through
+        soxr_clear(conn->soxr_vr);
+        soxr_set_io_ratio(conn->soxr_vr, 1.0, 0);
+      }
+#endif
     }
     if (drop_request) {
       debug(2, "flush request: request dropped.");
@@ -1063,6 +2373,20 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
               conn->first_packet_timestamp =
                   curframe->given_timestamp; // we will keep buffering until we are
                                              // supposed to start playing this
+              // On a fast start, start with a short latency -- but long enough for the
+              // backend buffer and a resend or two -- and let the player make up the rest later.
+              conn->fast_start_latency_deficit = 0.0;
+              if (config.fast_start) {
+                double starting_latency = config.fast_start_latency;
+                if (starting_latency < config.audio_backend_buffer_desired_length + 0.1)
+                  starting_latency = config.audio_backend_buffer_desired_length + 0.1;
+                uint32_t starting_latency_frames = (uint32_t)(starting_latency * conn->input_rate);
+                if (starting_latency_frames < conn->latency) {
+                  conn->fast_start_latency_deficit = conn->latency - starting_latency_frames;
+                  debug(2, "fast start with a latency of %u frames rather than %u frames.",
+                        starting_latency_frames, conn->latency);
+                }
+              }
 #ifdef CONFIG_METADATA
               // say we have started receiving frames here
               debug(2, "pffr");
@@ -1092,7 +2416,7 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
               // i.e. -4410 frames.
 
               uint64_t should_be_time;
-              uint32_t effective_latency = conn->latency;
+              uint32_t effective_latency = playing_latency(conn);
 
               get_and_check_effective_latency(conn, &effective_latency,
                                               config.audio_backend_latency_offset);
@@ -1130,7 +2454,7 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
               // here, we figure out whether and what silence to send.
 
               uint64_t should_be_time;
-              uint32_t effective_latency = conn->latency;
+              uint32_t effective_latency = playing_latency(conn);
 
               switch (get_and_check_effective_latency(conn, &effective_latency,
                                                       config.audio_backend_latency_offset)) {
@@ -1219,21 +2543,10 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
                                                           // compensate for it at the last minute
                       conn->ab_buffering = 0;
                     }
-                    void *silence;
                     if (fs > 0) {
-                      silence = malloc(conn->output_bytes_per_frame * fs);
-                      if (silence == NULL)
-                        debug(1, "Failed to allocate %d byte silence buffer.", fs);
-                      else {
-                        // generate frames of silence with dither if necessary
-                        conn->previous_random_number =
-                            generate_zero_frames(silence, fs, config.output_format,
-                                                 conn->enable_dither, conn->previous_random_number);
-                        config.output->play(silence, fs);
-                        // debug(1, "Sent %" PRId64 " frames of silence", fs);
-                        free(silence);
-                        have_sent_prefiller_silence = 1;
-                      }
+                      play_silence(conn, fs);
+                      // debug(1, "Sent %" PRId64 " frames of silence", fs);
+                      have_sent_prefiller_silence = 1;
                     }
                   } else {
 
@@ -1258,27 +2571,9 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
               // if the output device doesn't have a delay, we simply send the lead-in
               int64_t lead_time =
                   conn->first_packet_time_to_play - local_time_now; // negative if we are late
-              void *silence;
               int64_t frame_gap = (lead_time * config.output_rate) / 1000000000;
               // debug(1,"%d frames needed.",frame_gap);
-              while (frame_gap > 0) {
-                ssize_t fs = config.output_rate / 10;
-                if (fs > frame_gap)
-                  fs = frame_gap;
-
-                silence = malloc(conn->output_bytes_per_frame * fs);
-                if (silence == NULL)
-                  debug(1, "Failed to allocate %d frame silence buffer.", fs);
-                else {
-                  // debug(1, "No delay function -- outputting %d frames of silence.", fs);
-                  conn->previous_random_number =
-                      generate_zero_frames(silence, fs, config.output_format, conn->enable_dither,
-                                           conn->previous_random_number);
-                  config.output->play(silence, fs);
-                  free(silence);
-                }
-                frame_gap -= fs;
-              }
+              play_silence(conn, frame_gap);
               conn->ab_buffering = 0;
             }
           }
@@ -1306,6 +2601,7 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
     // Note: the last three items are expressed in frames and must be converted to time.
 
     int do_wait = 0; // don't wait unless we can really prove we must
+    uint64_t time_frame_is_due = 0; // if known, and the frame is waiting only for its time to come
     if ((conn->ab_synced) && (curframe) && (curframe->ready) && (curframe->given_timestamp)) {
       do_wait =
           1; // if the current frame exists and is ready, then wait unless it's time to let it go...
@@ -1315,7 +2611,7 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
       if (have_timestamp_timing_information(conn)) { // if we have a reference time
 
         uint64_t time_to_play;
-        uint32_t effective_latency = conn->latency;
+        uint32_t effective_latency = playing_latency(conn);
 
         switch (get_and_check_effective_latency(conn, &effective_latency,
                                                 config.audio_backend_latency_offset -
@@ -1362,6 +2658,8 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
 
         if (local_time_now >= time_to_play) {
           do_wait = 0;
+        } else {
+          time_frame_is_due = time_to_play;
         }
       }
     }
@@ -1384,14 +2682,22 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
       time_to_wait_for_wakeup_ns *= 2 * 352; // two full 352-frame packets
       time_to_wait_for_wakeup_ns /= 3;       // two thirds of a packet time
 
-#ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
-      uint64_t time_of_wakeup_ns = local_time_now + time_to_wait_for_wakeup_ns;
-      uint64_t sec = time_of_wakeup_ns / 1000000000;
-      uint64_t nsec = time_of_wakeup_ns % 1000000000;
+      // If there's nothing to play and nothing has arrived for a while, there's no point in
+      // looking again so soon -- the arrival of a packet or a flush will wake the player anyway.
+      if (((!conn->ab_synced) || (conn->ab_read == conn->ab_write)) && (player_input_is_idle(conn)))
+        time_to_wait_for_wakeup_ns = PLAYER_IDLE_WAIT_NS;
 
+      // If the frame is just waiting for its time to come, wake up exactly then, rather than up
+      // to two thirds of a packet late. The condition variable waits on an absolute
+      // CLOCK_MONOTONIC deadline -- the same timer clock_nanosleep(TIMER_ABSTIME) would use --
+      // but it can still be woken early by an incoming packet.
+      if ((time_frame_is_due != 0) &&
+          (time_frame_is_due - local_time_now < time_to_wait_for_wakeup_ns))
+        time_to_wait_for_wakeup_ns = time_frame_is_due - local_time_now;
+
+#ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
       struct timespec time_of_wakeup;
-      time_of_wakeup.tv_sec = sec;
-      time_of_wakeup.tv_nsec = nsec;
+      absolute_time_to_timespec(local_time_now + time_to_wait_for_wakeup_ns, &time_of_wakeup);
       //      pthread_cond_timedwait(&conn->flowcontrol, &conn->ab_mutex, &time_of_wakeup);
       int rc = pthread_cond_timedwait(&conn->flowcontrol, &conn->ab_mutex,
                                       &time_of_wakeup); // this is a pthread cancellation point
@@ -1411,18 +2717,42 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
 
   // seq_t read = conn->ab_read;
   if (curframe) {
+    if (conn->buffered_audio)
+      decode_now(curframe, conn->ab_read, conn);
     if (!curframe->ready) {
       // debug(1, "Supplying a silent frame for frame %u", read);
       conn->missing_packets++;
       curframe->given_timestamp = 0; // indicate a silent frame should be substituted
     }
     curframe->ready = 0;
+    release_compressed_packet(conn, curframe);
   }
+  missing_packet_clear(conn, conn->ab_read);
   conn->ab_read = SUCCESSOR(conn->ab_read);
   pthread_cleanup_pop(1);
+  if (conn->buffered_audio)
+    request_decode_ahead(conn);
   return curframe;
 }
 
+// converting an out-of-range float to an int32_t is undefined, so clip it first
+static inline int32_t float_to_int32_saturated(float f) {
+  if (f >= 2147483520.0f) // the largest float below 2^31
+    return INT32_MAX;
+  if (f <= -2147483648.0f)
+    return INT32_MIN;
+  return (int32_t)f;
+}
+
+// from the headroom of the fixed point DSP path back to full scale
+static inline int32_t fixed_to_int32_saturated(int32_t v) {
+  if (v > (INT32_MAX >> EQ_FIXED_HEADROOM_BITS))
+    return INT32_MAX;
+  if (v < (INT32_MIN >> EQ_FIXED_HEADROOM_BITS))
+    return INT32_MIN;
+  return (int32_t)((uint32_t)v << EQ_FIXED_HEADROOM_BITS);
+}
+
 static inline int32_t mean_32(int32_t a, int32_t b) {
   int64_t al = a;
   int64_t bl = b;
@@ -1450,25 +2780,24 @@ static int stuff_buffer_basic_32(int32_t *inptr, int length, sps_format_t l_outp
     tstuff = 0; // if any of these conditions hold, don't stuff anything/
   }
 
-  int i;
   int stuffsamp = length;
   if (tstuff)
     //      stuffsamp = rand() % (length - 1);
     stuffsamp =
         (rand() % (length - 2)) + 1; // ensure there's always a sample before and after the item
 
-  for (i = 0; i < stuffsamp; i++) { // the whole frame, if no stuffing
-    process_sample(*inptr++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-    process_sample(*inptr++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-  };
+  // the whole frame, if no stuffing
+  process_samples(inptr, stuffsamp * 2, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
+  inptr += stuffsamp * 2;
   if (tstuff) {
     if (tstuff == 1) {
       // debug(3, "+++++++++");
       // interpolate one sample
-      process_sample(mean_32(inptr[-2], inptr[0]), &l_outptr, l_output_format, conn->fix_volume,
-                     dither, conn);
-      process_sample(mean_32(inptr[-1], inptr[1]), &l_outptr, l_output_format, conn->fix_volume,
-                     dither, conn);
+      int32_t interpolated_frame[2];
+      interpolated_frame[0] = mean_32(inptr[-2], inptr[0]);
+      interpolated_frame[1] = mean_32(inptr[-1], inptr[1]);
+      process_samples(interpolated_frame, 2, &l_outptr, l_output_format, conn->fix_volume, dither,
+                      conn);
     } else if (stuff == -1) {
       // debug(3, "---------");
       inptr++;
@@ -1481,10 +2810,9 @@ static int stuff_buffer_basic_32(int32_t *inptr, int length, sps_format_t l_outp
     if (tstuff < 0)
       remainder = remainder + tstuff; // don't run over the correct end of the output buffer
 
-    for (i = stuffsamp; i < remainder; i++) {
-      process_sample(*inptr++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-      process_sample(*inptr++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-    }
+    if (remainder > stuffsamp)
+      process_samples(inptr, (remainder - stuffsamp) * 2, &l_outptr, l_output_format,
+                      conn->fix_volume, dither, conn);
   }
   conn->amountStuffed = tstuff;
   return length + tstuff;
@@ -1580,27 +2908,20 @@ int stuff_buffer_soxr_32(int32_t *inptr, int32_t *scratchBuffer, int length,
     }
 
     // now, do the volume, dither and formatting processing
-    ip = scratchBuffer;
     char *l_outptr = outptr;
-    for (i = 0; i < length + tstuff; i++) {
-      process_sample(*ip++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-      process_sample(*ip++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-    };
+    process_samples(scratchBuffer, (length + tstuff) * 2, &l_outptr, l_output_format,
+                    conn->fix_volume, dither, conn);
 
   } else { // the whole frame, if no stuffing
 
     // now, do the volume, dither and formatting processing
-    int32_t *ip = inptr;
     char *l_outptr = outptr;
-    int i;
-
-    for (i = 0; i < length; i++) {
-      process_sample(*ip++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-      process_sample(*ip++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-    };
+    process_samples(inptr, length * 2, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
   }
 
   if (packets_processed % 1250 == 0) {
+    if (stat_n)
+      metrics_player_set_soxr_execution_time(stat_mean, longest_soxr_execution_time);
     debug(3,
           "soxr_oneshot execution time in nanoseconds: mean, standard deviation and max "
           "for %" PRId32 " interpolations in the last "
@@ -1616,6 +2937,65 @@ int stuff_buffer_soxr_32(int32_t *inptr, int32_t *scratchBuffer, int length,
   conn->amountStuffed = tstuff;
   return length + tstuff;
 }
+
+// The variable-rate alternative to stuff_buffer_soxr_32. Rather than resample each packet
+// separately to make it a frame longer or shorter, a single resampler is kept running for the
+// session and its ratio is nudged in proportion to the sync error, so there are no edges
+// between packets and no sudden corrections.
+
+#define SOXR_VR_CORRECTION_TIME 2.0 // aim to take out a sync error over this many seconds
+#define SOXR_VR_MAXIMUM_CORRECTION 0.001 // but never change the rate by more than 1 in 1000
+#define SOXR_VR_EXTRA_FRAMES 64 // how much longer than its input the output for a packet can be
+
+static int soxr_vr_create(rtsp_conn_info *conn) {
+  soxr_error_t error;
+  soxr_io_spec_t io_spec = soxr_io_spec(SOXR_INT32_I, SOXR_INT32_I);
+  soxr_quality_spec_t q_spec = soxr_quality_spec(SOXR_HQ, SOXR_VR);
+  // for variable-rate resampling, the "input rate" is the largest ratio that will be asked for
+  conn->soxr_vr = soxr_create(1.0 + 2 * SOXR_VR_MAXIMUM_CORRECTION, 1.0, 2, &error, &io_spec,
+                              &q_spec, NULL);
+  if (error) {
+    warn("Can not create a variable-rate soxr resampler: %s -- \"basic\" interpolation will be "
+         "used.",
+         soxr_strerror(error));
+    conn->soxr_vr = NULL;
+    return -1;
+  }
+  soxr_set_io_ratio(conn->soxr_vr, 1.0, 0);
+  return 0;
+}
+
+// sync_error is in frames, positive if the output is late
+static int stuff_buffer_soxr_vr_32(int32_t *inptr, int length, sps_format_t l_output_format,
+                                   char *outptr, int64_t sync_error, int dither,
+                                   rtsp_conn_info *conn) {
+  double correction = sync_error / (SOXR_VR_CORRECTION_TIME * config.output_rate);
+  if (correction > SOXR_VR_MAXIMUM_CORRECTION)
+    correction = SOXR_VR_MAXIMUM_CORRECTION;
+  else if (correction < -SOXR_VR_MAXIMUM_CORRECTION)
+    correction = -SOXR_VR_MAXIMUM_CORRECTION;
+
+  // a ratio above 1 gives fewer output frames than input frames; slew to it over the packet
+  soxr_set_io_ratio(conn->soxr_vr, 1.0 + correction, length);
+
+  size_t idone = 0, odone = 0;
+  soxr_error_t error =
+      soxr_process(conn->soxr_vr, inptr, length, &idone, conn->sbuf,
+                   conn->max_frames_per_packet * conn->output_sample_ratio +
+                       conn->max_frame_size_change,
+                   &odone);
+  if (error)
+    die("soxr error: %s\n", soxr_strerror(error));
+  if (idone != (size_t)length)
+    debug(1, "soxr_vr: only %zu of %d frames were taken by the resampler.", idone, length);
+
+  char *l_outptr = outptr;
+  process_samples(conn->sbuf, odone * 2, &l_outptr, l_output_format, conn->fix_volume,
+                  dither, conn);
+
+  conn->amountStuffed = (int)odone - length;
+  return odone;
+}
 #endif
 
 void player_thread_initial_cleanup_handler(__attribute__((unused)) void *arg) {
@@ -1624,6 +3004,25 @@ void player_thread_initial_cleanup_handler(__attribute__((unused)) void *arg) {
         conn->connection_number);
 }
 
+// describe how long the stages of the decoder and player threads are taking, as a line of text,
+// returning the length written as snprintf does
+static int format_stage_timings(rtsp_conn_info *conn, char *buf, size_t size) {
+  char decoder_text[1024], player_text[1024];
+  stage_timings_format(&conn->decoder_timings, "decoder_", decoder_text, sizeof(decoder_text));
+  stage_timings_format(&conn->player_timings, "player_", player_text, sizeof(player_text));
+  return snprintf(buf, size, "%s%s%s", decoder_text,
+                  ((decoder_text[0] != '\0') && (player_text[0] != '\0')) ? " " : "", player_text);
+}
+
+// give the metrics this play session's counts so far
+static void player_set_metrics_counts(rtsp_conn_info *conn) {
+  conn->metrics_counts.missing_packets = conn->missing_packets;
+  conn->metrics_counts.late_packets = conn->late_packets;
+  conn->metrics_counts.too_late_packets = conn->too_late_packets;
+  conn->metrics_counts.resend_requests = conn->resend_requests;
+  metrics_player_set_counts(&conn->metrics_counts);
+}
+
 void player_thread_cleanup_handler(void *arg) {
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
   int oldState;
@@ -1631,8 +3030,17 @@ void player_thread_cleanup_handler(void *arg) {
   debug(3, "Connection %d: player thread main loop exit via player_thread_cleanup_handler.",
         conn->connection_number);
 
-  if (config.output->stop)
+  if ((conn->handover_requested) && (config.output->hand_over)) {
+    debug(2, "Connection %d: handing the output device over to the next session.",
+          conn->connection_number);
+    config.output->hand_over();
+  } else if (config.output->stop) {
     config.output->stop();
+  }
+
+  player_set_metrics_counts(conn); // so that the last of the session's counts aren't lost
+  metrics_player_set_playing(0);
+  metrics_player_publish();
 
   if (config.statistics_requested) {
     int rawSeconds = (int)difftime(time(NULL), conn->playstart);
@@ -1646,6 +3054,17 @@ void player_thread_cleanup_handler(void *arg) {
     else
       inform("Playback Stopped. Total playing time %02d:%02d:%02d. Input: %0.2f frames per second.",
              elapsedHours, elapsedMin, elapsedSec, conn->input_frame_rate);
+    if (conn->resend_requests)
+      inform("Resends: %" PRIu64 " requests for %" PRIu64 " packets, %" PRIu64
+             " packets recovered and %" PRIu64 " never received.",
+             conn->resend_requests, conn->resend_packets_requested,
+             conn->receive_stats.resend_hits, conn->receive_stats.resend_misses);
+    char receive_statistics[512];
+    receive_stats_format(&conn->receive_stats, receive_statistics, sizeof(receive_statistics));
+    inform("Receive statistics: %s.", receive_statistics);
+    char stage_timing_text[2048];
+    if (format_stage_timings(conn, stage_timing_text, sizeof(stage_timing_text)) > 0)
+      inform("Stage timings: %s.", stage_timing_text);
   }
 
 #ifdef CONFIG_DACP_CLIENT
@@ -1671,6 +3090,11 @@ void player_thread_cleanup_handler(void *arg) {
   debug(3, "Join audio thread.");
   pthread_join(conn->rtp_audio_thread, NULL);
   debug(3, "Audio thread terminated.");
+  debug(3, "Cancel decoder thread.");
+  pthread_cancel(conn->decoder_thread);
+  debug(3, "Join decoder thread.");
+  pthread_join(conn->decoder_thread, NULL);
+  debug(3, "Decoder thread terminated.");
 
   if (conn->outbuf) {
     free(conn->outbuf);
@@ -1680,18 +3104,38 @@ void player_thread_cleanup_handler(void *arg) {
     free(conn->sbuf);
     conn->sbuf = NULL;
   }
+#ifdef CONFIG_SOXR
+  if (conn->soxr_vr) {
+    soxr_delete(conn->soxr_vr);
+    conn->soxr_vr = NULL;
+  }
+#endif
   if (conn->tbuf) {
     free(conn->tbuf);
     conn->tbuf = NULL;
   }
+  if (conn->dsp_buffer_l) {
+    free(conn->dsp_buffer_l);
+    conn->dsp_buffer_l = NULL;
+  }
+  if (conn->dsp_buffer_r) {
+    free(conn->dsp_buffer_r);
+    conn->dsp_buffer_r = NULL;
+  }
 
   if (conn->statistics) {
     free(conn->statistics);
     conn->statistics = NULL;
   }
   free_audio_buffers(conn);
-  if (conn->stream.type == ast_apple_lossless)
-    terminate_decoders(conn);
+  if (conn->stream.type == ast_apple_lossless) {
+    if (conn->handover_requested)
+      hand_over_decoders(conn);
+    else
+      terminate_decoders(conn);
+  }
+  if (conn->stream.encrypted)
+    free_decryption(conn);
 
   clear_reference_timestamp(conn);
   conn->rtp_running = 0;
@@ -1699,21 +3143,24 @@ void player_thread_cleanup_handler(void *arg) {
 }
 
 void *player_thread_func(void *arg) {
+  thread_set_name("player");
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
   // pthread_cleanup_push(player_thread_initial_cleanup_handler, arg);
   conn->packet_count = 0;
   conn->packet_count_since_flush = 0;
-  conn->previous_random_number = 0;
+  dither_init(&conn->dither, config.dither_noise_shaping);
   conn->input_bytes_per_frame = 4;
   conn->decoder_in_use = 0;
   conn->ab_buffering = 1;
   conn->ab_synced = 0;
   conn->first_packet_timestamp = 0;
+  conn->fast_start_latency_deficit = 0.0;
   conn->flush_requested = 0;
   conn->flush_output_flushed = 0; // only send a flush command to the output device once
   conn->flush_rtp_timestamp = 0;  // it seems this number has a special significance -- it seems to
                                   // be used as a null operand, so we'll use it like that too
   conn->fix_volume = 0x10000;
+  conn->ramped_volume = -1; // start at whatever volume is set, without a ramp
 
   if (conn->latency == 0) {
     debug(3, "No latency has (yet) been specified. Setting 88,200 (2 seconds) frames "
@@ -1728,21 +3175,8 @@ void *player_thread_func(void *arg) {
   // This must be after init_alac_decoder
   init_buffer(conn); // will need a corresponding deallocation. No cancellation points in here
 
-  if (conn->stream.encrypted) {
-#ifdef CONFIG_MBEDTLS
-    memset(&conn->dctx, 0, sizeof(mbedtls_aes_context));
-    mbedtls_aes_setkey_dec(&conn->dctx, conn->stream.aeskey, 128);
-#endif
-
-#ifdef CONFIG_POLARSSL
-    memset(&conn->dctx, 0, sizeof(aes_context));
-    aes_setkey_dec(&conn->dctx, conn->stream.aeskey, 128);
-#endif
-
-#ifdef CONFIG_OPENSSL
-    AES_set_decrypt_key(conn->stream.aeskey, 128, &conn->aes);
-#endif
-  }
+  if (conn->stream.encrypted)
+    init_decryption(conn);
 
   conn->timestamp_epoch = 0; // indicate that the next timestamp will be the first one.
   conn->maximum_timestamp_interval = conn->input_rate * 60; // actually there shouldn't be more than
@@ -1757,6 +3191,11 @@ void *player_thread_func(void *arg) {
       1 * conn->output_sample_ratio; // we add or subtract one frame at the nominal
                                      // rate, multiply it by the frame ratio.
                                      // but, on some occasions, more than one frame could be added
+#ifdef CONFIG_SOXR
+  // the variable-rate resampler holds some frames back and releases them later
+  if (config.packet_stuffing == ST_soxr_vr)
+    conn->max_frame_size_change = SOXR_VR_EXTRA_FRAMES * conn->output_sample_ratio;
+#endif
 
   switch (config.output_format) {
   case SPS_FORMAT_S24_3LE:
@@ -1788,20 +3227,14 @@ void *player_thread_func(void *arg) {
   conn->session_corrections = 0;
   // conn->play_segment_reference_frame = 0; // zero signals that we are not in a play segment
 
-  // check that there are enough buffers to accommodate the desired latency and the latency offset
-
-  int maximum_latency =
-      conn->latency + (int)(config.audio_backend_latency_offset * config.output_rate);
-  if ((maximum_latency + (352 - 1)) / 352 + 10 > BUFFER_FRAMES)
-    die("Not enough buffers available for a total latency of %d frames. A maximum of %d 352-frame "
-        "packets may be accommodated.",
-        maximum_latency, BUFFER_FRAMES);
   conn->connection_state_to_output = get_requested_connection_state_to_output();
 // this is about half a minute
 //#define trend_interval 3758
 
 // this is about 8 seconds
 #define trend_interval 1003
+// and this is about a second, for low memory mode
+#define low_memory_trend_interval 128
 
   int number_of_statistics, oldest_statistic, newest_statistic;
   int at_least_one_frame_seen = 0;
@@ -1809,6 +3242,7 @@ void *player_thread_func(void *arg) {
   int64_t tsum_of_sync_errors, tsum_of_corrections, tsum_of_insertions_and_deletions,
       tsum_of_drifts;
   int64_t previous_sync_error = 0, previous_correction = 0;
+  sync_controller sync_control;
   uint64_t minimum_dac_queue_size = UINT64_MAX;
   int32_t minimum_buffer_occupancy = INT32_MAX;
   int32_t maximum_buffer_occupancy = INT32_MIN;
@@ -1832,8 +3266,11 @@ void *player_thread_func(void *arg) {
   // conn->shutdown_requested = 0;
   number_of_statistics = oldest_statistic = newest_statistic = 0;
   tsum_of_sync_errors = tsum_of_corrections = tsum_of_insertions_and_deletions = tsum_of_drifts = 0;
+  sync_controller_reset(&sync_control);
 
   const int print_interval = trend_interval; // don't ask...
+  // the number of checks the averages in the statistics are taken over
+  const int statistics_length = config.low_memory ? low_memory_trend_interval : trend_interval;
   // I think it's useful to keep this prime to prevent it from falling into a pattern with some
   // other process.
 
@@ -1892,6 +3329,12 @@ void *player_thread_func(void *arg) {
       (config.playback_mode == ST_mono))
     conn->enable_dither = 1;
 
+  // a 32-bit sample has more resolution than a float can keep, so dither would be lost
+  if ((config.output_is_floating_point) && (output_bit_depth == 32)) {
+    debug(3, "Dithering will be disabled because the output is converted to floating point");
+    conn->enable_dither = 0;
+  }
+
   // remember, the output device may never have been initialised prior to this call
   config.output->start(config.output_rate, config.output_format); // will need a corresponding stop
 
@@ -1903,7 +3346,19 @@ void *player_thread_func(void *arg) {
   if (conn->tbuf == NULL)
     die("Failed to allocate memory for the transition buffer.");
 
-  // initialise this, because soxr stuffing might be chosen later
+  // the DSP stage works on the left and right channels separately, in float or, on the fixed
+  // point path, in int32_t, which is the same size
+  conn->dsp_buffer_l = malloc(
+      sizeof(float) *
+      (conn->max_frames_per_packet * conn->output_sample_ratio + conn->max_frame_size_change));
+  conn->dsp_buffer_r = malloc(
+      sizeof(float) *
+      (conn->max_frames_per_packet * conn->output_sample_ratio + conn->max_frame_size_change));
+  if ((conn->dsp_buffer_l == NULL) || (conn->dsp_buffer_r == NULL))
+    die("Failed to allocate memory for the DSP buffers.");
+
+#ifdef CONFIG_SOXR
+  // initialise this, because soxr stuffing might be chosen later -- it's only used by soxr
 
   conn->sbuf = malloc(
       sizeof(int32_t) * 2 *
@@ -1911,6 +3366,26 @@ void *player_thread_func(void *arg) {
   if (conn->sbuf == NULL)
     die("Failed to allocate memory for the sbuf buffer.");
 
+  conn->soxr_vr = NULL;
+  if (config.packet_stuffing == ST_soxr_vr)
+    soxr_vr_create(conn); // if it fails, basic stuffing is used
+#endif
+
+  // the filters are designed for the rate of the stream and start with no history
+  eq_set_sample_rate(&loudness_eq, conn->input_rate);
+  eq_set_sample_rate(&parametric_eq, conn->input_rate);
+  eq_reset(&loudness_eq);
+  eq_reset(&parametric_eq);
+
+#ifdef CONFIG_CONVOLUTION
+  // the impulse response must be at the rate of the stream it's applied to
+  if ((config.convolution_ir_file) && (convolver_sample_rate() != (int)conn->input_rate))
+    config.convolver_valid =
+        convolver_init(config.convolution_ir_file, config.convolution_max_length,
+                       config.convolution_block_size, config.convolution_tail_block_size,
+                       conn->input_rate);
+#endif
+
   // The size of these dependents on the number of frames, the size of each frame and the maximum
   // size change
   conn->outbuf = malloc(
@@ -1918,12 +3393,19 @@ void *player_thread_func(void *arg) {
       (conn->max_frames_per_packet * conn->output_sample_ratio + conn->max_frame_size_change));
   if (conn->outbuf == NULL)
     die("Failed to allocate memory for an output buffer.");
+
+  conn->silence_position = 0;
   conn->first_packet_timestamp = 0;
   conn->missing_packets = conn->late_packets = conn->too_late_packets = conn->resend_requests = 0;
+  conn->resend_packets_requested = 0;
+  receive_stats_reset(&conn->receive_stats);
+  stage_timings_reset(&conn->decoder_timings);
+  stage_timings_reset(&conn->player_timings);
+  conn->resend_allowance_time = 0; // the allowance is filled when first needed
   int sync_error_out_of_bounds =
       0; // number of times in a row that there's been a serious sync error
 
-  conn->statistics = malloc(sizeof(stats_t) * trend_interval);
+  conn->statistics = malloc(sizeof(stats_t) * statistics_length);
   if (conn->statistics == NULL)
     die("Failed to allocate a statistics buffer");
 
@@ -1931,6 +3413,12 @@ void *player_thread_func(void *arg) {
   conn->framesGeneratedInThisEpoch = 0;
   conn->correctionsRequestedInThisEpoch = 0;
 
+  memset(&conn->metrics_counts, 0, sizeof(conn->metrics_counts));
+  metrics_player_start_session();
+  metrics_count_event(metrics_event_play_session);
+  metrics_player_set_playing(1);
+  metrics_player_publish();
+
   if (config.statistics_requested) {
     if ((config.output->delay)) {
       if (config.no_sync == 0) {
@@ -1982,9 +3470,18 @@ void *player_thread_func(void *arg) {
   }
 
   // create and start the timing, control and audio receiver threads
+  // the decoder thread must be ready before packets start arriving
+  // only the player and the RTP audio receiver run with real-time scheduling, if any; the others
+  // are given the ordinary policy explicitly, in case this thread has a real-time one already
+  pthread_attr_t ordinary_thread_attr;
+  realtime_ordinary_thread_attr_init(&ordinary_thread_attr);
+  pthread_create(&conn->decoder_thread, &ordinary_thread_attr, &decoder_thread_func, (void *)conn);
   pthread_create(&conn->rtp_audio_thread, NULL, &rtp_audio_receiver, (void *)conn);
-  pthread_create(&conn->rtp_control_thread, NULL, &rtp_control_receiver, (void *)conn);
-  pthread_create(&conn->rtp_timing_thread, NULL, &rtp_timing_receiver, (void *)conn);
+  pthread_create(&conn->rtp_control_thread, &ordinary_thread_attr, &rtp_control_receiver,
+                 (void *)conn);
+  pthread_create(&conn->rtp_timing_thread, &ordinary_thread_attr, &rtp_timing_receiver,
+                 (void *)conn);
+  pthread_attr_destroy(&ordinary_thread_attr);
 
   pthread_cleanup_push(player_thread_cleanup_handler, arg); // undo what's been done so far
 
@@ -2002,7 +3499,11 @@ void *player_thread_func(void *arg) {
 
   // set the default volume to whatever it was before, as stored in the config airplay_volume
   debug(2, "Set initial volume to %f.", config.airplay_volume);
-  player_volume(config.airplay_volume, conn); // will contain a cancellation point if asked to wait
+  player_volume(config.airplay_volume, conn);
+
+  // this is done only now, after the other threads of the session have been started, so that
+  // they don't inherit the CPU affinity, which can't be reset by thread attributes everywhere
+  realtime_thread_setup("player");
 
   debug(2, "Play begin");
   while (1) {
@@ -2014,6 +3515,7 @@ void *player_thread_func(void *arg) {
       inbuflength = inframe->length;
       if (inbuf) {
         play_number++;
+        conn->metrics_counts.packets++;
         //        if (play_number % 100 == 0)
         //          debug(3, "Play frame %d.", play_number);
         conn->play_number_after_flush++;
@@ -2023,22 +3525,12 @@ void *player_thread_func(void *arg) {
                 "status 0x%X after %u resend requests.",
                 SUCCESSOR(conn->last_seqno_read), play_number, inframe->status,
                 inframe->resend_request_number);
+          if (inframe->resend_request_number)
+            conn->receive_stats.resend_misses++;
           conn->last_seqno_read =
               SUCCESSOR(conn->last_seqno_read); // manage the packet out of sequence minder
 
-          void *silence = malloc(conn->output_bytes_per_frame * conn->max_frames_per_packet *
-                                 conn->output_sample_ratio);
-          if (silence == NULL) {
-            debug(1, "Failed to allocate memory for a silent frame silence buffer.");
-          } else {
-            // the player may change the contents of the buffer, so it has to be zeroed each time;
-            // might as well malloc and free it locally
-            conn->previous_random_number = generate_zero_frames(
-                silence, conn->max_frames_per_packet * conn->output_sample_ratio,
-                config.output_format, conn->enable_dither, conn->previous_random_number);
-            config.output->play(silence, conn->max_frames_per_packet * conn->output_sample_ratio);
-            free(silence);
-          }
+          play_silence(conn, conn->max_frames_per_packet * conn->output_sample_ratio);
         } else if (conn->play_number_after_flush < 10) {
           /*
           int64_t difference = 0;
@@ -2048,25 +3540,14 @@ void *player_thread_func(void *arg) {
           debug(1, "Play number %d, monotonic timestamp %llx, difference
           %lld.",conn->play_number_after_flush,inframe->timestamp,difference);
           */
-          void *silence = malloc(conn->output_bytes_per_frame * conn->max_frames_per_packet *
-                                 conn->output_sample_ratio);
-          if (silence == NULL) {
-            debug(1, "Failed to allocate memory for a flush silence buffer.");
-          } else {
-            // the player may change the contents of the buffer, so it has to be zeroed each time;
-            // might as well malloc and free it locally
-            conn->previous_random_number = generate_zero_frames(
-                silence, conn->max_frames_per_packet * conn->output_sample_ratio,
-                config.output_format, conn->enable_dither, conn->previous_random_number);
-            config.output->play(silence, conn->max_frames_per_packet * conn->output_sample_ratio);
-            free(silence);
-          }
+          play_silence(conn, conn->max_frames_per_packet * conn->output_sample_ratio);
+          sync_controller_reset(&sync_control); // the timing starts afresh after a flush
         } else {
 
           if (((config.output->parameters == NULL) && (config.ignore_volume_control == 0) &&
                (config.airplay_volume != 0.0)) ||
               (conn->input_bit_depth > output_bit_depth) || (config.playback_mode == ST_mono))
-            conn->enable_dither = 1;
+            conn->enable_dither = (config.output_is_floating_point == 0) || (output_bit_depth < 32);
           else
             conn->enable_dither = 0;
 
@@ -2214,6 +3695,11 @@ void *player_thread_func(void *arg) {
                 current_delay =
                     0; // could get a negative value if there was underrun, but ignore it.
               }
+#ifdef CONFIG_SOXR
+              // frames held in the resampler are as good as queued in the output device
+              if (conn->soxr_vr)
+                current_delay += (int64_t)soxr_delay(conn->soxr_vr);
+#endif
               if (current_delay < minimum_dac_queue_size) {
                 minimum_dac_queue_size = current_delay; // update for display later
               }
@@ -2257,8 +3743,20 @@ void *player_thread_func(void *arg) {
             // conn->output_sample_ratio; therefore, calculating the delay must be done in the light
             // of possible rollover
 
+            // After a fast start, once corrections are allowed, grow the latency a little with
+            // each packet. The output is then a little early, and stuffing slows it down to suit.
+            if ((conn->fast_start_latency_deficit > 0.0) && (conn->first_packet_time_to_play) &&
+                (local_time_now >= conn->first_packet_time_to_play + (uint64_t)5000000000)) {
+              conn->fast_start_latency_deficit -= inframe->length * fast_start_latency_growth;
+              if (conn->fast_start_latency_deficit <= 0.0) {
+                conn->fast_start_latency_deficit = 0.0;
+                debug(2, "fast start: the full latency of %u frames has been reached.",
+                      conn->latency);
+              }
+            }
+
             sync_error =
-                delay - ((int64_t)conn->latency * conn->output_sample_ratio +
+                delay - ((int64_t)playing_latency(conn) * conn->output_sample_ratio +
                          (int64_t)(config.audio_backend_latency_offset *
                                    config.output_rate)); // int64_t from int64_t - int32_t, so okay
 
@@ -2289,29 +3787,13 @@ void *player_thread_func(void *arg) {
 
               // if the packet is early, add the frames needed to put it in sync.
               if (sync_error < 0) {
-                size_t final_adjustment_length_sized = -sync_error;
-                char *final_adjustment_silence =
-                    malloc(conn->output_bytes_per_frame * final_adjustment_length_sized);
-                if (final_adjustment_silence) {
-
-                  conn->previous_random_number = generate_zero_frames(
-                      final_adjustment_silence, final_adjustment_length_sized, config.output_format,
-                      conn->enable_dither, conn->previous_random_number);
-                  int final_adjustment = -sync_error;
-                  final_adjustment = final_adjustment - first_frame_early_bias;
-                  debug(2,
-                        "final sync adjustment: %" PRId64
-                        " silent frames added with a bias of %" PRId64 " frames.",
-                        -sync_error, first_frame_early_bias);
-                  config.output->play(final_adjustment_silence, final_adjustment_length_sized);
-                  free(final_adjustment_silence);
-                } else {
-                  warn("Failed to allocate memory for a final_adjustment_silence buffer of %d "
-                       "frames for a "
-                       "sync error of %d frames.",
-                       final_adjustment_length_sized, sync_error);
-                }
+                debug(2,
+                      "final sync adjustment: %" PRId64
+                      " silent frames added with a bias of %" PRId64 " frames.",
+                      -sync_error, first_frame_early_bias);
+                play_silence(conn, -sync_error);
                 sync_error = 0; // say the error was fixed!
+                sync_controller_reset(&sync_control);
               }
             }
             // not too sure if abs() is implemented for int64_t, so we'll do it manually
@@ -2338,6 +3820,7 @@ void *player_thread_func(void *arg) {
             }
 
             if (sync_error_out_of_bounds > 3) {
+              metrics_count_event(metrics_event_resync);
               // debug(1, "New lost sync with source for %d consecutive packets -- flushing and "
               //          "resyncing. Error: %lld.",
               //        sync_error_out_of_bounds, sync_error);
@@ -2355,6 +3838,7 @@ void *player_thread_func(void *arg) {
                     inframe->given_timestamp +
                     frames_to_drop_sized; // flush all packets up to (and including?) this
                 reset_input_flow_metrics(conn);
+                sync_controller_reset(&sync_control);
                 debug_mutex_unlock(&conn->flush_mutex, 3);
 
               } else if ((sync_error < 0) && ((-sync_error) > filler_length)) {
@@ -2365,23 +3849,10 @@ void *player_thread_func(void *arg) {
                 int64_t silence_length = -sync_error;
                 if (silence_length > (filler_length * 5))
                   silence_length = filler_length * 5;
-                size_t silence_length_sized = silence_length;
-                char *long_silence = malloc(conn->output_bytes_per_frame * silence_length_sized);
-                if (long_silence) {
-
-                  conn->previous_random_number =
-                      generate_zero_frames(long_silence, silence_length_sized, config.output_format,
-                                           conn->enable_dither, conn->previous_random_number);
-
-                  debug(2, "Play a silence of %d frames.", silence_length_sized);
-                  config.output->play(long_silence, silence_length_sized);
-                  free(long_silence);
-                } else {
-                  warn("Failed to allocate memory for a long_silence buffer of %d frames for a "
-                       "sync error of %d frames.",
-                       silence_length_sized, sync_error);
-                }
+                debug(2, "Play a silence of %" PRId64 " frames.", silence_length);
+                play_silence(conn, silence_length);
                 reset_input_flow_metrics(conn);
+                sync_controller_reset(&sync_control);
               }
             } else {
 
@@ -2396,7 +3867,37 @@ void *player_thread_func(void *arg) {
               }
               */
 
-              if (amount_to_stuff == 0) {
+              // try to keep the corrections definitely below 1 in 1000 audio frames
+
+              // calculate the time elapsed since the play session started.
+
+              int stuffing_allowed = (config.no_sync == 0); // no stuffing if it's been disabled
+              if ((local_time_now) && (conn->first_packet_time_to_play) &&
+                  (local_time_now >= conn->first_packet_time_to_play)) {
+
+                int64_t tp =
+                    (local_time_now - conn->first_packet_time_to_play) /
+                    1000000000; // seconds int64_t from uint64_t which is always positive, so ok
+
+                if (tp < 5)
+                  stuffing_allowed = 0; // wait at least five seconds
+                /*
+                else if (tp < 30) {
+                  if ((random() % 1000) >
+                      352) // keep it to about 1:1000 for the first thirty seconds
+                    amount_to_stuff = 0;
+                }
+                */
+              }
+
+              if ((config.sync_control == SC_pi) && (sync_controller_is_ready(&sync_control))) {
+                // follow the drift, spreading the corrections out evenly -- only asked when a
+                // correction can be made, as it counts what it returns as made
+                if (stuffing_allowed)
+                  amount_to_stuff = sync_controller_amount_to_stuff(
+                      &sync_control, inframe->length * conn->output_sample_ratio,
+                      config.output_rate);
+              } else if (amount_to_stuff == 0) {
                 // use a "V" shaped function to decide if stuffing should occur
                 int64_t s = r64i();
                 s = s >> 31;
@@ -2414,32 +3915,8 @@ void *player_thread_func(void *arg) {
                 }
               }
 
-              // try to keep the corrections definitely below 1 in 1000 audio frames
-
-              // calculate the time elapsed since the play session started.
-
-              if (amount_to_stuff) {
-                if ((local_time_now) && (conn->first_packet_time_to_play) &&
-                    (local_time_now >= conn->first_packet_time_to_play)) {
-
-                  int64_t tp =
-                      (local_time_now - conn->first_packet_time_to_play) /
-                      1000000000; // seconds int64_t from uint64_t which is always positive, so ok
-
-                  if (tp < 5)
-                    amount_to_stuff = 0; // wait at least five seconds
-                  /*
-                  else if (tp < 30) {
-                    if ((random() % 1000) >
-                        352) // keep it to about 1:1000 for the first thirty seconds
-                      amount_to_stuff = 0;
-                  }
-                  */
-                }
-              }
-
-              if (config.no_sync != 0)
-                amount_to_stuff = 0; // no stuffing if it's been disabled
+              if (stuffing_allowed == 0)
+                amount_to_stuff = 0;
 
               // Apply DSP here
 
@@ -2447,76 +3924,126 @@ void *player_thread_func(void *arg) {
               // the frame
 
               int do_loudness = config.loudness;
+              int do_eq = config.eq;
 
 #ifdef CONFIG_CONVOLUTION
               int do_convolution = 0;
               if ((config.convolution) && (config.convolver_valid))
                 do_convolution = 1;
 
-              // we will apply the convolution gain if convolution is enabled, even if there is no
-              // valid convolution happening
-
               int convolution_is_enabled = 0;
               if (config.convolution)
                 convolution_is_enabled = 1;
 #endif
 
-              if (do_loudness
+              int do_fixed_point = config.dsp_fixed_point;
 #ifdef CONFIG_CONVOLUTION
-                  || convolution_is_enabled
+              if (convolution_is_enabled)
+                do_fixed_point = 0; // the convolver only works in float
 #endif
-              ) {
+
+              conn->volume_applied_by_dsp = 0;
+              if ((do_loudness || do_eq) && do_fixed_point) {
+                // The same, in fixed point, for processors without floating point hardware. The
+                // samples are scaled down to leave the headroom the filters need, and the volume
+                // is applied on the way, as a 64-bit integer multiply.
                 int32_t *tbuf32 = (int32_t *)conn->tbuf;
-                float fbuf_l[inbuflength];
-                float fbuf_r[inbuflength];
+                int32_t *xbuf_l = (int32_t *)conn->dsp_buffer_l;
+                int32_t *xbuf_r = (int32_t *)conn->dsp_buffer_r;
+                conn->volume_applied_by_dsp = 1;
+                uint64_t dsp_start = get_absolute_time_in_ns();
+
+                int i = 0;
+                while (i < inbuflength) {
+                  int frames;
+                  int64_t gain =
+                      software_volume_block(conn, conn->fix_volume, inbuflength - i, &frames);
+                  int end = i + frames;
+                  for (; i < end; ++i) {
+                    xbuf_l[i] = (tbuf32[2 * i] * gain) >> (16 + EQ_FIXED_HEADROOM_BITS);
+                    xbuf_r[i] = (tbuf32[2 * i + 1] * gain) >> (16 + EQ_FIXED_HEADROOM_BITS);
+                  }
+                }
+
+                if (do_loudness)
+                  eq_process_fixed(&loudness_eq, xbuf_l, xbuf_r, inbuflength);
+                if (do_eq)
+                  eq_process_fixed(&parametric_eq, xbuf_l, xbuf_r, inbuflength);
 
-                // Deinterleave, and convert to float
-                int i;
                 for (i = 0; i < inbuflength; ++i) {
-                  fbuf_l[i] = tbuf32[2 * i];
-                  fbuf_r[i] = tbuf32[2 * i + 1];
+                  tbuf32[2 * i] = fixed_to_int32_saturated(xbuf_l[i]);
+                  tbuf32[2 * i + 1] = fixed_to_int32_saturated(xbuf_r[i]);
                 }
-
+                stage_timings_note(&conn->player_timings, stage_dsp,
+                                   get_absolute_time_in_ns() - dsp_start);
+              } else if (do_loudness || do_eq
 #ifdef CONFIG_CONVOLUTION
-                // Apply convolution
-                if (do_convolution) {
-                  convolver_process_l(fbuf_l, inbuflength);
-                  convolver_process_r(fbuf_r, inbuflength);
-                }
-                if (convolution_is_enabled) {
-                  float gain = pow(10.0, config.convolution_gain / 20.0);
-                  for (i = 0; i < inbuflength; ++i) {
-                    fbuf_l[i] *= gain;
-                    fbuf_r[i] *= gain;
-                  }
-                }
+                         || convolution_is_enabled
 #endif
-
-                if (do_loudness) {
-                  // Apply volume and loudness
-                  // Volume must be applied here because the loudness filter will increase the
-                  // signal level and it would saturate the int32_t otherwise
-                  float gain = conn->fix_volume / 65536.0f;
-                  // float gain_db = 20 * log10(gain);
-                  // debug(1, "Applying soft volume dB: %f k: %f", gain_db, gain);
-
-                  for (i = 0; i < inbuflength; ++i) {
-                    fbuf_l[i] = loudness_process(&loudness_l, fbuf_l[i] * gain);
-                    fbuf_r[i] = loudness_process(&loudness_r, fbuf_r[i] * gain);
+              ) {
+                // All the fixed gains are linear, so they are folded into the conversion to float,
+                // together with the volume -- it must be applied here because the filters can
+                // increase the signal level and it would saturate the int32_t otherwise.
+                // The stages then run in place and the result is converted back in one pass.
+                int32_t *tbuf32 = (int32_t *)conn->tbuf;
+                float *fbuf_l = conn->dsp_buffer_l;
+                float *fbuf_r = conn->dsp_buffer_r;
+                float fixed_gain = 1.0f / 65536.0f;
+#ifdef CONFIG_CONVOLUTION
+                // we will apply the convolution gain if convolution is enabled, even if there is
+                // no valid convolution happening
+                if (convolution_is_enabled)
+                  fixed_gain *= pow(10.0, config.convolution_gain / 20.0);
+#endif
+                conn->volume_applied_by_dsp = 1;
+                uint64_t dsp_start = get_absolute_time_in_ns();
+
+                // Deinterleave, and convert to float, ramping the volume as process_samples would
+                int i = 0;
+                while (i < inbuflength) {
+                  int frames;
+                  float gain =
+                      software_volume_block(conn, conn->fix_volume, inbuflength - i, &frames) *
+                      fixed_gain;
+                  int end = i + frames;
+                  for (; i < end; ++i) {
+                    fbuf_l[i] = tbuf32[2 * i] * gain;
+                    fbuf_r[i] = tbuf32[2 * i + 1] * gain;
                   }
                 }
 
-                // Interleave and convert back to int32_t
+#ifdef CONFIG_CONVOLUTION
+                if (do_convolution)
+                  convolver_process(fbuf_l, fbuf_r, inbuflength);
+#endif
+                if (do_loudness)
+                  eq_process(&loudness_eq, fbuf_l, fbuf_r, inbuflength);
+                if (do_eq)
+                  eq_process(&parametric_eq, fbuf_l, fbuf_r, inbuflength);
+
+                // Interleave and convert back to int32_t, clipping anything the filters have
+                // boosted beyond full scale
                 for (i = 0; i < inbuflength; ++i) {
-                  tbuf32[2 * i] = fbuf_l[i];
-                  tbuf32[2 * i + 1] = fbuf_r[i];
+                  tbuf32[2 * i] = float_to_int32_saturated(fbuf_l[i]);
+                  tbuf32[2 * i + 1] = float_to_int32_saturated(fbuf_r[i]);
                 }
+                stage_timings_note(&conn->player_timings, stage_dsp,
+                                   get_absolute_time_in_ns() - dsp_start);
               }
 
+              int output_is_direct;
+              char *output_buffer = get_output_buffer(conn, &output_is_direct);
+              uint64_t interpolation_start = get_absolute_time_in_ns();
+
 #ifdef CONFIG_SOXR
-              if ((current_delay < conn->dac_buffer_queue_minimum_length) ||
+              if (conn->soxr_vr) {
+                play_samples = stuff_buffer_soxr_vr_32(
+                    (int32_t *)conn->tbuf, inbuflength, config.output_format, output_buffer,
+                    config.no_sync ? 0 : sync_error, conn->enable_dither, conn);
+              } else if ((current_delay < conn->dac_buffer_queue_minimum_length) ||
                   (config.packet_stuffing == ST_basic) ||
-                  (config.soxr_delay_index == 0) || // not computed yet
+                  (config.packet_stuffing == ST_soxr_vr) || // the resampler couldn't be made
+                  (config.soxr_delay_index == 0) ||         // not computed yet
                   ((config.packet_stuffing == ST_auto) &&
                    (config.soxr_delay_index >
                     config.soxr_delay_threshold)) // if the CPU is deemed too slow
@@ -2524,15 +4051,18 @@ void *player_thread_func(void *arg) {
 #endif
                 play_samples =
                     stuff_buffer_basic_32((int32_t *)conn->tbuf, inbuflength, config.output_format,
-                                          conn->outbuf, amount_to_stuff, conn->enable_dither, conn);
+                                          output_buffer, amount_to_stuff, conn->enable_dither,
+                                          conn);
 #ifdef CONFIG_SOXR
               } else { // soxr requested or auto requested with the index less or equal to the
                        // threshold
                 play_samples = stuff_buffer_soxr_32((int32_t *)conn->tbuf, (int32_t *)conn->sbuf,
-                                                    inbuflength, config.output_format, conn->outbuf,
+                                                    inbuflength, config.output_format, output_buffer,
                                                     amount_to_stuff, conn->enable_dither, conn);
               }
 #endif
+              stage_timings_note(&conn->player_timings, stage_interpolation,
+                                 get_absolute_time_in_ns() - interpolation_start);
 
               /*
               {
@@ -2549,19 +4079,10 @@ void *player_thread_func(void *arg) {
               }
               */
 
-              if (conn->outbuf == NULL)
+              if (output_buffer == NULL)
                 debug(1, "NULL outbuf to play -- skipping it.");
-              else {
-                if (play_samples == 0)
-                  debug(1, "play_samples==0 skipping it (1).");
-                else {
-                  if (conn->software_mute_enabled) {
-                    generate_zero_frames(conn->outbuf, play_samples, config.output_format,
-                                         conn->enable_dither, conn->previous_random_number);
-                  }
-                  config.output->play(conn->outbuf, play_samples);
-                }
-              }
+              else
+                play_output_buffer(conn, output_buffer, output_is_direct, play_samples);
 
               // check for loss of sync
               // timestamp of zero means an inserted silent frame in place of a missing frame
@@ -2617,18 +4138,25 @@ void *player_thread_func(void *arg) {
               at_least_one_frame_seen_this_session = 1;
             }
 
-            play_samples =
-                stuff_buffer_basic_32((int32_t *)conn->tbuf, inbuflength, config.output_format,
-                                      conn->outbuf, 0, conn->enable_dither, conn);
-            if (conn->outbuf == NULL)
+            int output_is_direct;
+            char *output_buffer = get_output_buffer(conn, &output_is_direct);
+            uint64_t interpolation_start = get_absolute_time_in_ns();
+#ifdef CONFIG_SOXR
+            if (conn->soxr_vr) // keep the resampler's frames in order
+              play_samples =
+                  stuff_buffer_soxr_vr_32((int32_t *)conn->tbuf, inbuflength, config.output_format,
+                                          output_buffer, 0, conn->enable_dither, conn);
+            else
+#endif
+              play_samples =
+                  stuff_buffer_basic_32((int32_t *)conn->tbuf, inbuflength, config.output_format,
+                                        output_buffer, 0, conn->enable_dither, conn);
+            stage_timings_note(&conn->player_timings, stage_interpolation,
+                               get_absolute_time_in_ns() - interpolation_start);
+            if (output_buffer == NULL)
               debug(1, "NULL outbuf to play -- skipping it.");
-            else {
-              if (conn->software_mute_enabled) {
-                generate_zero_frames(conn->outbuf, play_samples, config.output_format,
-                                     conn->enable_dither, conn->previous_random_number);
-              }
-              config.output->play(conn->outbuf, play_samples); // remove the (short*)!
-            }
+            else
+              play_output_buffer(conn, output_buffer, output_is_direct, play_samples);
           }
 
           // mark the frame as finished
@@ -2655,7 +4183,7 @@ void *player_thread_func(void *arg) {
           // delay figure.
           // for the present, stats are only updated when sync has been checked
           if (config.output->delay != NULL) {
-            if (number_of_statistics == trend_interval) {
+            if (number_of_statistics == statistics_length) {
               // here we remove the oldest statistical data and take it from the summaries as well
               tsum_of_sync_errors -= conn->statistics[oldest_statistic].sync_error;
               tsum_of_drifts -= conn->statistics[oldest_statistic].drift;
@@ -2664,12 +4192,17 @@ void *player_thread_func(void *arg) {
               else
                 tsum_of_insertions_and_deletions += conn->statistics[oldest_statistic].correction;
               tsum_of_corrections -= conn->statistics[oldest_statistic].correction;
-              oldest_statistic = (oldest_statistic + 1) % trend_interval;
+              oldest_statistic = (oldest_statistic + 1) % statistics_length;
               number_of_statistics--;
             }
 
             conn->statistics[newest_statistic].sync_error = sync_error;
             conn->statistics[newest_statistic].correction = conn->amountStuffed;
+            metrics_player_note_sync_error((1.0 * sync_error) / config.output_rate);
+            if (conn->amountStuffed > 0)
+              conn->metrics_counts.frames_inserted += conn->amountStuffed;
+            else
+              conn->metrics_counts.frames_deleted -= conn->amountStuffed;
 
             if (number_of_statistics == 0)
               conn->statistics[newest_statistic].drift = 0;
@@ -2679,6 +4212,7 @@ void *player_thread_func(void *arg) {
 
             previous_sync_error = sync_error;
             previous_correction = conn->amountStuffed;
+            sync_controller_note(&sync_control, local_time_now, sync_error, conn->amountStuffed);
 
             tsum_of_sync_errors += sync_error;
             tsum_of_drifts += conn->statistics[newest_statistic].drift;
@@ -2690,7 +4224,7 @@ void *player_thread_func(void *arg) {
             tsum_of_corrections += conn->amountStuffed;
             conn->session_corrections += conn->amountStuffed;
 
-            newest_statistic = (newest_statistic + 1) % trend_interval;
+            newest_statistic = (newest_statistic + 1) % statistics_length;
             number_of_statistics++;
           }
         }
@@ -2735,6 +4269,35 @@ void *player_thread_func(void *arg) {
           double moving_average_insertions_plus_deletions =
               (1.0 * tsum_of_insertions_and_deletions) / number_of_statistics;
           // double moving_average_drift = (1.0 * tsum_of_drifts) / number_of_statistics;
+
+          player_set_metrics_counts(conn);
+          metrics_player_set_rates(
+              conn->input_frame_rate, conn->frame_rate,
+              (conn->local_to_remote_time_gradient - 1.0) * 1000000,
+              number_of_statistics
+                  ? moving_average_correction * 1000000 / (352 * conn->output_sample_ratio)
+                  : 0.0,
+              number_of_statistics ? moving_average_insertions_plus_deletions * 1000000 /
+                                         (352 * conn->output_sample_ratio)
+                                   : 0.0);
+          if (at_least_one_frame_seen)
+            metrics_player_set_queues(
+                minimum_dac_queue_size == UINT64_MAX ? 0 : (int64_t)minimum_dac_queue_size,
+                minimum_buffer_occupancy, maximum_buffer_occupancy);
+          metrics_player_publish();
+
+          char stage_timing_text[2048];
+          int stage_timing_length =
+              format_stage_timings(conn, stage_timing_text, sizeof(stage_timing_text));
+          if ((stage_timing_length > 0) &&
+              ((size_t)stage_timing_length < sizeof(stage_timing_text))) {
+            debug(2, "Stage timings: %s.", stage_timing_text);
+#ifdef CONFIG_METADATA
+            send_ssnc_metadata('stgt', stage_timing_text, stage_timing_length,
+                               0); // don't wait if the queue is locked
+#endif
+          }
+
           // if ((play_number/print_interval)%20==0)
           if (config.statistics_requested) {
             if (at_least_one_frame_seen) {
@@ -2837,6 +4400,102 @@ void *player_thread_func(void *arg) {
   pthread_exit(NULL);
 }
 
+// The backend's hardware volume, the unmuting that follows it and the set-volume command are done
+// by a thread of their own, so that mixer I/O (or a blocking command) doesn't hold up the RTSP
+// thread. Requests that arrive while one is being carried out are coalesced, so when a volume
+// slider is dragged, only the latest volume is set.
+static pthread_mutex_t hardware_volume_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hardware_volume_cv = PTHREAD_COND_INITIALIZER;
+// held while the backend's volume or mute is being set, so that the two don't interleave
+static pthread_mutex_t hardware_volume_io_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t hardware_volume_once = PTHREAD_ONCE_INIT;
+static pthread_t hardware_volume_thread;
+static int set_volume_command_pending = 0;
+static double set_volume_command_volume;
+static int hardware_volume_pending = 0;
+static double hardware_volume_attenuation;
+static int hardware_unmute_pending = 0;
+
+static void *hardware_volume_thread_func(__attribute__((unused)) void *arg) {
+  thread_set_name("volume");
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  pthread_mutex_lock(&hardware_volume_mutex);
+  while (1) {
+    while ((set_volume_command_pending == 0) && (hardware_volume_pending == 0) &&
+           (hardware_unmute_pending == 0))
+      pthread_cond_wait(&hardware_volume_cv, &hardware_volume_mutex);
+    int do_command = set_volume_command_pending;
+    double command_volume = set_volume_command_volume;
+    int do_volume = hardware_volume_pending;
+    double attenuation = hardware_volume_attenuation;
+    int do_unmute = hardware_unmute_pending;
+    set_volume_command_pending = 0;
+    hardware_volume_pending = 0;
+    hardware_unmute_pending = 0;
+    pthread_mutex_unlock(&hardware_volume_mutex);
+
+    pthread_mutex_lock(&hardware_volume_io_mutex);
+    if (do_command)
+      command_set_volume(command_volume);
+    if ((do_volume) && (config.output->volume))
+      config.output->volume(attenuation);
+    if ((do_unmute) && (config.output->mute))
+      config.output->mute(0);
+    pthread_mutex_unlock(&hardware_volume_io_mutex);
+
+    pthread_mutex_lock(&hardware_volume_mutex);
+  }
+  pthread_mutex_unlock(&hardware_volume_mutex);
+  return NULL;
+}
+
+static void hardware_volume_thread_start(void) {
+  // this may be called from the player thread, so don't let it inherit real-time scheduling
+  pthread_attr_t attr;
+  realtime_ordinary_thread_attr_init(&attr);
+  if (pthread_create(&hardware_volume_thread, &attr, &hardware_volume_thread_func, NULL) != 0)
+    die("Could not create the hardware volume thread.");
+  pthread_attr_destroy(&attr);
+  pthread_detach(hardware_volume_thread);
+}
+
+static void request_set_volume_command(double airplay_volume) {
+  pthread_once(&hardware_volume_once, hardware_volume_thread_start);
+  pthread_mutex_lock(&hardware_volume_mutex);
+  set_volume_command_volume = airplay_volume;
+  set_volume_command_pending = 1;
+  pthread_cond_signal(&hardware_volume_cv);
+  pthread_mutex_unlock(&hardware_volume_mutex);
+}
+
+static void request_hardware_volume(double attenuation) {
+  pthread_once(&hardware_volume_once, hardware_volume_thread_start);
+  pthread_mutex_lock(&hardware_volume_mutex);
+  hardware_volume_attenuation = attenuation;
+  hardware_volume_pending = 1;
+  pthread_cond_signal(&hardware_volume_cv);
+  pthread_mutex_unlock(&hardware_volume_mutex);
+}
+
+static void request_hardware_unmute(void) {
+  pthread_once(&hardware_volume_once, hardware_volume_thread_start);
+  pthread_mutex_lock(&hardware_volume_mutex);
+  hardware_unmute_pending = 1;
+  pthread_cond_signal(&hardware_volume_cv);
+  pthread_mutex_unlock(&hardware_volume_mutex);
+}
+
+// muting is done at once, as whether it worked decides whether to mute in software instead
+static int hardware_mute(void) {
+  pthread_mutex_lock(&hardware_volume_mutex);
+  hardware_unmute_pending = 0; // it mustn't be unmuted after this by an earlier request
+  pthread_mutex_unlock(&hardware_volume_mutex);
+  pthread_mutex_lock(&hardware_volume_io_mutex);
+  int response = config.output->mute(1);
+  pthread_mutex_unlock(&hardware_volume_io_mutex);
+  return response;
+}
+
 void player_volume_without_notification(double airplay_volume, rtsp_conn_info *conn) {
   debug_mutex_lock(&conn->volume_control_mutex, 5000, 1);
   // first, see if we are hw only, sw only, both with hw attenuation on the top or both with sw
@@ -2910,7 +4569,7 @@ void player_volume_without_notification(double airplay_volume, rtsp_conn_info *c
   if (config.ignore_volume_control == 0) {
     if (airplay_volume == -144.0) {
 
-      if ((config.output->mute) && (config.output->mute(1) == 0))
+      if ((config.output->mute) && (hardware_mute() == 0))
         debug(2,
               "player_volume_without_notification: volume mode is %d, airplay_volume is %f, "
               "hardware mute is enabled.",
@@ -3001,7 +4660,8 @@ void player_volume_without_notification(double airplay_volume, rtsp_conn_info *c
       }
 
       if (((volume_mode == vol_hw_only) || (volume_mode == vol_both)) && (config.output->volume)) {
-        config.output->volume(hardware_attenuation); // otherwise set the output to the lowest value
+        request_hardware_volume(hardware_attenuation); // otherwise set the output to the lowest
+                                                       // value
         // debug(1,"Hardware attenuation set to %f for airplay volume of
         // %f.",hardware_attenuation,airplay_volume);
         if (volume_mode == vol_hw_only)
@@ -3041,7 +4701,7 @@ void player_volume_without_notification(double airplay_volume, rtsp_conn_info *c
 #endif
 
       if (config.output->mute)
-        config.output->mute(0);
+        request_hardware_unmute();
       conn->software_mute_enabled = 0;
 
       debug(2,
@@ -3069,7 +4729,7 @@ void player_volume_without_notification(double airplay_volume, rtsp_conn_info *c
 }
 
 void player_volume(double airplay_volume, rtsp_conn_info *conn) {
-  command_set_volume(airplay_volume);
+  request_set_volume_command(airplay_volume);
   player_volume_without_notification(airplay_volume, conn);
 }
 
@@ -3085,7 +4745,13 @@ void do_flush(uint32_t timestamp, rtsp_conn_info *conn) {
 
 void player_flush(uint32_t timestamp, rtsp_conn_info *conn) {
   debug(3, "player_flush");
+  // the player may be idling -- see buffer_get_frame. It holds the ab_mutex from looking for a
+  // flush request until it waits, so the request is made and signalled with it held too, or the
+  // wakeup could come between the two and be lost.
+  debug_mutex_lock(&conn->ab_mutex, 30000, 0);
   do_flush(timestamp, conn);
+  pthread_cond_signal(&conn->flowcontrol);
+  debug_mutex_unlock(&conn->ab_mutex, 0);
 #ifdef CONFIG_METADATA
   debug(2, "pfls");
   char numbuf[32];
@@ -3098,9 +4764,9 @@ int player_play(rtsp_conn_info *conn) {
   // need to use conn in place of stream below. Need to put the stream as a parameter to he
   if (conn->player_thread != NULL)
     die("Trying to create a second player thread for this RTSP session");
-  if (config.buffer_start_fill > BUFFER_FRAMES)
-    die("specified buffer starting fill %d > buffer size %d", config.buffer_start_fill,
-        BUFFER_FRAMES);
+  if ((unsigned int)config.buffer_start_fill > config.audio_buffer_size)
+    die("specified buffer starting fill %d > buffer size %u", config.buffer_start_fill,
+        config.audio_buffer_size);
   activity_monitor_signify_activity(
       1); // active, and should be before play's command hook, command_start()
   command_start();
@@ -3156,3 +4822,320 @@ int player_stop(rtsp_conn_info *conn) {
     return -1;
   }
 }
+
+// Time the parts of the audio path that run for every packet, using a second of generated
+// audio, and print the cost of each in nanoseconds per frame. This is for comparing builds and
+// machines, so it works without a network, a source or an output device.
+
+#define BENCHMARK_PACKETS 125 // about a second of audio at 352 frames per packet
+#define BENCHMARK_MINIMUM_TIME 200000000 // run each timed loop for at least 0.2 seconds
+
+static void benchmark_report(const char *what, uint64_t elapsed, uint64_t frames) {
+  printf("  %-50s %10.1f ns/frame\n", what, frames ? (double)elapsed / frames : 0.0);
+}
+
+// An ALAC packet holding uncompressed ("escaped") stereo 16-bit frames, which both decoders
+// understand. Returns its length in bytes.
+static int benchmark_make_alac_packet(uint8_t *packet, const int16_t *samples, int frames) {
+  uint64_t accumulator = 0;
+  int bits = 0, length = 0, i;
+#define PUT_BITS(value, n)                                                                         \
+  do {                                                                                             \
+    accumulator = (accumulator << (n)) | ((uint64_t)(value) & ((1ULL << (n)) - 1));                \
+    bits += (n);                                                                                   \
+    while (bits >= 8) {                                                                            \
+      packet[length++] = accumulator >> (bits - 8);                                                \
+      bits -= 8;                                                                                   \
+    }                                                                                              \
+  } while (0)
+  PUT_BITS(1, 3);  // a channel pair element
+  PUT_BITS(0, 4);  // element instance tag
+  PUT_BITS(0, 12); // unused
+  PUT_BITS(0, 1);  // no frame count -- it's the default
+  PUT_BITS(0, 2);  // no shifted bytes
+  PUT_BITS(1, 1);  // not compressed
+  for (i = 0; i < frames * 2; i++)
+    PUT_BITS((uint16_t)samples[i], 16);
+  PUT_BITS(7, 3); // end of frame
+  if (bits)
+    PUT_BITS(0, 8 - bits);
+#undef PUT_BITS
+  return length;
+}
+
+static void benchmark_encrypt(uint8_t *packet, int length, rtsp_conn_info *conn) {
+  uint8_t iv[16];
+  uint8_t encrypted[MAX_PACKET];
+  int aeslen = length & ~0xf;
+  memcpy(iv, conn->stream.aesiv, sizeof(iv));
+#ifdef CONFIG_MBEDTLS
+  mbedtls_aes_context ectx;
+  mbedtls_aes_init(&ectx);
+  mbedtls_aes_setkey_enc(&ectx, conn->stream.aeskey, 128);
+  mbedtls_aes_crypt_cbc(&ectx, MBEDTLS_AES_ENCRYPT, aeslen, iv, packet, encrypted);
+  mbedtls_aes_free(&ectx);
+#endif
+#ifdef CONFIG_POLARSSL
+  aes_context ectx;
+  aes_setkey_enc(&ectx, conn->stream.aeskey, 128);
+  aes_crypt_cbc(&ectx, AES_ENCRYPT, aeslen, iv, packet, encrypted);
+#endif
+#ifdef CONFIG_OPENSSL
+  int outlen;
+  EVP_CIPHER_CTX *ectx = EVP_CIPHER_CTX_new();
+  if ((ectx == NULL) ||
+      (EVP_EncryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, conn->stream.aeskey, iv) != 1))
+    die("Can not set up the AES encryption context for the benchmark.");
+  EVP_CIPHER_CTX_set_padding(ectx, 0);
+  EVP_EncryptUpdate(ectx, encrypted, &outlen, packet, aeslen);
+  EVP_CIPHER_CTX_free(ectx);
+#endif
+  memcpy(packet, encrypted, aeslen); // the remainder is sent in the clear
+}
+
+void player_benchmark(void) {
+  static const int32_t fmtp[12] = {96, 352, 0, 16, 40, 10, 14, 2, 255, 0, 0, 44100};
+  static const sps_format_t formats[] = {SPS_FORMAT_U8,     SPS_FORMAT_S8,      SPS_FORMAT_S16_LE,
+                                         SPS_FORMAT_S16_BE, SPS_FORMAT_S24_LE,  SPS_FORMAT_S24_BE,
+                                         SPS_FORMAT_S24_3LE, SPS_FORMAT_S24_3BE, SPS_FORMAT_S32_LE,
+                                         SPS_FORMAT_S32_BE};
+  const int frames = fmtp[1];
+  char label[64];
+  uint64_t start, elapsed, frame_count;
+  int i, p;
+  unsigned int f;
+
+  rtsp_conn_info *conn = calloc(1, sizeof(rtsp_conn_info));
+  uint8_t(*plain)[MAX_PACKET] = malloc(BENCHMARK_PACKETS * MAX_PACKET);
+  uint8_t(*encrypted)[MAX_PACKET] = malloc(BENCHMARK_PACKETS * MAX_PACKET);
+  uint8_t packet[MAX_PACKET];
+  int *lengths = malloc(BENCHMARK_PACKETS * sizeof(int));
+  int16_t *samples = malloc(frames * 2 * sizeof(int16_t));
+  int16_t *decoded = malloc((frames + 64) * 4);
+  if ((conn == NULL) || (plain == NULL) || (encrypted == NULL) || (lengths == NULL) ||
+      (samples == NULL) || (decoded == NULL))
+    die("Can not allocate memory for the benchmark.");
+
+  memcpy(conn->stream.fmtp, fmtp, sizeof(fmtp));
+  conn->stream.type = ast_apple_lossless;
+  conn->stream.encrypted = 1;
+  for (i = 0; i < 16; i++) {
+    conn->stream.aeskey[i] = 0x11 * i;
+    conn->stream.aesiv[i] = 0xf0 - i;
+  }
+  conn->input_bytes_per_frame = 4;
+  conn->max_frames_per_packet = frames;
+  conn->input_num_channels = fmtp[7];
+  conn->input_bit_depth = fmtp[3];
+  conn->input_rate = fmtp[11];
+  conn->output_sample_ratio = 1;
+  dither_init(&conn->dither, 0);
+  conn->max_frame_size_change = 1;
+#ifdef CONFIG_SOXR
+  conn->max_frame_size_change = SOXR_VR_EXTRA_FRAMES;
+#endif
+  conn->fix_volume = 0x8000; // -6 dB, so that the volume is really applied
+  init_alac_decoder(conn->stream.fmtp, conn);
+
+  init_decryption(conn);
+
+  // a second of music-like signal: two tones and a little noise, different in each channel
+  for (p = 0; p < BENCHMARK_PACKETS; p++) {
+    for (i = 0; i < frames; i++) {
+      double t = (double)(p * frames + i) / fmtp[11];
+      samples[i * 2] = 8000 * sin(2 * M_PI * 440 * t) + 3000 * sin(2 * M_PI * 1250 * t) +
+                       (int)(r64u() >> 54) - 512;
+      samples[i * 2 + 1] = 8000 * sin(2 * M_PI * 554 * t) + 3000 * sin(2 * M_PI * 990 * t) +
+                           (int)(r64u() >> 54) - 512;
+    }
+    lengths[p] = benchmark_make_alac_packet(plain[p], samples, frames);
+    memcpy(encrypted[p], plain[p], lengths[p]);
+    benchmark_encrypt(encrypted[p], lengths[p], conn);
+  }
+
+  printf("Audio path benchmark: %d packets of %d frames of 16-bit stereo at %d frames per "
+         "second.\n",
+         BENCHMARK_PACKETS, frames, fmtp[11]);
+  printf("Decoding:\n");
+
+#define TIMED_LOOP(body)                                                                           \
+  do {                                                                                             \
+    frame_count = 0;                                                                               \
+    start = get_absolute_time_in_ns();                                                             \
+    do {                                                                                           \
+      for (p = 0; p < BENCHMARK_PACKETS; p++) {                                                    \
+        body;                                                                                      \
+      }                                                                                            \
+      elapsed = get_absolute_time_in_ns() - start;                                                 \
+    } while (elapsed < BENCHMARK_MINIMUM_TIME);                                                    \
+  } while (0)
+
+  TIMED_LOOP({
+    int outsize = (frames + 64) * 4;
+    alac_decode_frame(conn->decoder_info, plain[p], lengths[p], (unsigned char *)decoded,
+                      &outsize);
+    frame_count += outsize / 4;
+  });
+  benchmark_report("alac_decode_frame", elapsed, frame_count);
+
+#ifdef CONFIG_APPLE_ALAC
+  if (conn->apple_decoder_info) {
+    TIMED_LOOP({
+      int outsize = 0;
+      apple_alac_decode_frame(conn->apple_decoder_info, plain[p], lengths[p],
+                              (unsigned char *)decoded, &outsize);
+      frame_count += outsize;
+    });
+    benchmark_report("apple_alac_decode_frame", elapsed, frame_count);
+  }
+#endif
+
+  TIMED_LOOP({
+    int destlen = frames + 64;
+    memcpy(packet, encrypted[p], lengths[p]); // decryption is done in place
+    audio_packet_decrypt(packet, lengths[p], conn);
+    audio_packet_decode(decoded, &destlen, packet, lengths[p], conn);
+    frame_count += destlen;
+  });
+  snprintf(label, sizeof(label), "audio_packet_decode (decrypt, %s decoder)",
+#ifdef CONFIG_APPLE_ALAC
+           ((config.use_apple_decoder) && (conn->apple_decoder_info)) ? "Apple" :
+#endif
+                                                                      "Hammerton");
+  benchmark_report(label, elapsed, frame_count);
+
+  // the rest work on the frames as the player has them, left-justified in 32 bits
+  int32_t *tbuf = malloc(sizeof(int32_t) * 2 * (frames + conn->max_frame_size_change));
+  conn->sbuf = malloc(sizeof(int32_t) * 2 * (frames + conn->max_frame_size_change));
+  conn->outbuf = malloc(8 * (frames + conn->max_frame_size_change));
+  if ((tbuf == NULL) || (conn->sbuf == NULL) || (conn->outbuf == NULL))
+    die("Can not allocate memory for the benchmark.");
+  for (i = 0; i < frames * 2; i++)
+    tbuf[i] = samples[i] << 16;
+
+  printf("Volume, interpolation and output formatting:\n");
+  for (f = 0; f < sizeof(formats) / sizeof(sps_format_t); f++) {
+    const char *format = sps_format_description_string(formats[f]);
+    int stuff;
+
+    TIMED_LOOP(frame_count += stuff_buffer_basic_32(tbuf, frames, formats[f], conn->outbuf, 0, 0,
+                                                    conn));
+    snprintf(label, sizeof(label), "%s: no interpolation", format);
+    benchmark_report(label, elapsed, frame_count);
+
+    TIMED_LOOP(frame_count += stuff_buffer_basic_32(tbuf, frames, formats[f], conn->outbuf, 0, 1,
+                                                    conn));
+    snprintf(label, sizeof(label), "%s: no interpolation, dithered", format);
+    benchmark_report(label, elapsed, frame_count);
+
+    if (sps_format_resolution(formats[f]) == 16) {
+      dither_init(&conn->dither, 1);
+      TIMED_LOOP(frame_count += stuff_buffer_basic_32(tbuf, frames, formats[f], conn->outbuf, 0, 1,
+                                                      conn));
+      snprintf(label, sizeof(label), "%s: no interpolation, noise-shaped dither", format);
+      benchmark_report(label, elapsed, frame_count);
+      dither_init(&conn->dither, 0);
+    }
+
+    stuff = 1;
+    TIMED_LOOP({
+      frame_count += stuff_buffer_basic_32(tbuf, frames, formats[f], conn->outbuf, stuff, 0, conn);
+      stuff = -stuff;
+    });
+    snprintf(label, sizeof(label), "%s: basic interpolation", format);
+    benchmark_report(label, elapsed, frame_count);
+
+#ifdef CONFIG_SOXR
+    stuff = 1;
+    TIMED_LOOP({
+      frame_count += stuff_buffer_soxr_32(tbuf, conn->sbuf, frames, formats[f], conn->outbuf,
+                                          stuff, 0, conn);
+      stuff = -stuff;
+    });
+    snprintf(label, sizeof(label), "%s: soxr interpolation", format);
+    benchmark_report(label, elapsed, frame_count);
+
+    if (soxr_vr_create(conn) == 0) {
+      TIMED_LOOP(frame_count += stuff_buffer_soxr_vr_32(tbuf, frames, formats[f], conn->outbuf,
+                                                        p - BENCHMARK_PACKETS / 2, 0, conn));
+      snprintf(label, sizeof(label), "%s: soxr_vr interpolation", format);
+      benchmark_report(label, elapsed, frame_count);
+      soxr_delete(conn->soxr_vr);
+      conn->soxr_vr = NULL;
+    }
+#endif
+  }
+
+  printf("Filters:\n");
+  float *fbuf_l = malloc(sizeof(float) * frames);
+  float *fbuf_r = malloc(sizeof(float) * frames);
+  if ((fbuf_l == NULL) || (fbuf_r == NULL))
+    die("Can not allocate memory for the benchmark.");
+  for (i = 0; i < frames; i++) {
+    fbuf_l[i] = tbuf[2 * i];
+    fbuf_r[i] = tbuf[2 * i + 1];
+  }
+
+  loudness_set_volume(-40.0);
+  TIMED_LOOP({
+    eq_process(&loudness_eq, fbuf_l, fbuf_r, frames);
+    frame_count += frames;
+  });
+  benchmark_report("loudness", elapsed, frame_count);
+
+  eq_processor benchmark_eq = EQ_PROCESSOR_INITIALIZER;
+  for (i = 0; i < 8; i++) {
+    eq_band band = {EQ_peaking, 60.0 * (1 << i), 1.0, (i & 1) ? -3.0 : 3.0};
+    eq_set_band(&benchmark_eq, i, band);
+  }
+  TIMED_LOOP({
+    eq_process(&benchmark_eq, fbuf_l, fbuf_r, frames);
+    frame_count += frames;
+  });
+  benchmark_report("eq: eight bands", elapsed, frame_count);
+
+  int32_t *xbuf_l = (int32_t *)fbuf_l;
+  int32_t *xbuf_r = (int32_t *)fbuf_r;
+  for (i = 0; i < frames; i++) {
+    xbuf_l[i] = tbuf[2 * i] >> EQ_FIXED_HEADROOM_BITS;
+    xbuf_r[i] = tbuf[2 * i + 1] >> EQ_FIXED_HEADROOM_BITS;
+  }
+  eq_reset(&loudness_eq);
+  TIMED_LOOP({
+    eq_process_fixed(&loudness_eq, xbuf_l, xbuf_r, frames);
+    frame_count += frames;
+  });
+  benchmark_report("loudness: fixed point", elapsed, frame_count);
+  for (i = 0; i < frames; i++) {
+    fbuf_l[i] = tbuf[2 * i];
+    fbuf_r[i] = tbuf[2 * i + 1];
+  }
+
+#ifdef CONFIG_CONVOLUTION
+  if (config.convolver_valid) {
+    TIMED_LOOP({
+      convolver_process(fbuf_l, fbuf_r, frames);
+      frame_count += frames;
+    });
+    benchmark_report("convolver_process", elapsed, frame_count);
+  } else {
+    printf("  convolution skipped -- no valid impulse response file has been configured.\n");
+  }
+#endif
+
+#undef TIMED_LOOP
+
+  free(fbuf_r);
+  free(fbuf_l);
+  free(conn->outbuf);
+  free(conn->sbuf);
+  free(tbuf);
+  terminate_decoders(conn);
+  free_decryption(conn);
+  free(decoded);
+  free(samples);
+  free(lengths);
+  free(encrypted);
+  free(plain);
+  free(conn);
+}
@@ -18,27 +18,75 @@
 #endif
 
 #ifdef CONFIG_OPENSSL
-#include <openssl/aes.h>
+#include <openssl/evp.h>
 #endif
 
 #include "alac.h"
 #include "audio.h"
+#include "dither.h"
+#include "metrics.h"
+#include "receive_stats.h"
+#include "stage_timings.h"
 
-#define time_ping_history_power_of_two 7
+#ifdef CONFIG_APPLE_ALAC
+#include "apple_alac.h"
+#endif
+
+#ifdef CONFIG_SOXR
+#include <soxr.h>
+#endif
+
+#define time_ping_history_power_of_two 8
 #define time_ping_history                                                                          \
-  (1 << time_ping_history_power_of_two) // 2^7 is 128. At 1 per three seconds, approximately six
-                                        // minutes of records
+  (1 << time_ping_history_power_of_two) // 2^8 is 256. At 1 per three seconds, approximately
+                                        // thirteen minutes of records
 
 typedef struct time_ping_record {
-  uint64_t dispersion;
+  uint64_t dispersion; // the return time, which is aged when the records are compared
   uint64_t local_time;
   uint64_t remote_time;
   int sequence_number;
   int chosen;
 } time_ping_record;
 
+// The time pings are kept in a ring, indexed by sequence number, and the drift is estimated from
+// running sums over the ones that have been chosen, so that each new ping takes the same time to
+// deal with, however long the history.
+typedef struct time_ping_history_info {
+  int count; // the number of pings in the history
+  int next_sequence_number;
+  struct time_ping_record pings[time_ping_history];
+  // the sequence numbers of the pings that may yet be the one with the least aged dispersion,
+  // oldest first, each with less aged dispersion than the one before it
+  int candidates[time_ping_history];
+  int first_candidate;
+  int candidate_count;
+  // sums over the chosen pings in the history used for the line of best fit, in nanoseconds
+  // relative to the base times, which are moved up from time to time to keep the sums precise
+  uint64_t base_local_time;
+  uint64_t base_remote_time;
+  int sample_count;
+  double sum_x, sum_y, sum_xx, sum_xy;
+  int updates_since_sums_recalculated;
+  // the gradient remembered from the last session with this client, and how much to trust it, in
+  // the same units as the spread of the local times in the sums. It fades as new pings arrive.
+  double prior_gradient;
+  double prior_weight;
+} time_ping_history_info;
+
 typedef uint16_t seq_t;
 
+// In buffered audio mode, packets are kept as they arrived, decrypted but not yet decoded, in
+// chunks allocated as they are needed and given back once all the packets in them are gone.
+#define COMPRESSED_CHUNK_SIZE 65536
+
+typedef struct compressed_chunk {
+  struct compressed_chunk *next; // on the list of spare chunks
+  size_t used;
+  int packets; // packets in the chunk that are still wanted
+  uint8_t data[COMPRESSED_CHUNK_SIZE];
+} compressed_chunk;
+
 typedef struct audio_buffer_entry { // decoded audio packets
   uint8_t ready;
   uint8_t status; // flags
@@ -50,14 +98,57 @@ typedef struct audio_buffer_entry { // decoded audio packets
   uint64_t resend_time;         // time of last resend request or zero
   uint32_t given_timestamp;     // for debugging and checking
   int length;                   // the length of the decoded data
+  // in buffered audio mode, the packet waiting to be decoded, or NULL
+  compressed_chunk *chunk;
+  uint8_t *compressed;
+  int compressed_length;
 } abuf_t;
 
+// Incoming packets are passed from the RTP receiver threads to the player thread through
+// lock-free single-producer single-consumer rings, so that neither side ever has to wait for the
+// other. There is one ring for each receiver thread that can supply audio packets.
+typedef enum { PR_audio_port = 0, PR_control_port, PR_number_of_rings } packet_ring_id;
+
+#define PACKET_RING_SIZE 256 // must be a power of 2
+#define PACKET_RING_ENTRY_DATA_SIZE 2048
+
+typedef struct packet_ring_entry {
+  uint64_t arrival_time;
+  uint32_t timestamp;
+  seq_t seqno;
+  int length;
+  uint8_t data[PACKET_RING_ENTRY_DATA_SIZE];
+} packet_ring_entry;
+
+typedef struct packet_ring {
+  packet_ring_entry *entries;
+  uint32_t head;     // only ever changed by the producer
+  uint32_t tail;     // only ever changed by the consumer
+  uint64_t overruns; // packets dropped because the ring was full
+} packet_ring;
+
+// What's needed to convert between RTP timestamps and local times, worked out whenever a sync
+// packet arrives and published with a sequence lock, so that the player can make the conversions
+// several times per packet without taking the reference_time_mutex. The rates are fixed point.
+#define TIMESTAMP_CONVERSION_NS_PER_FRAME_BITS 32
+#define TIMESTAMP_CONVERSION_FRAMES_PER_NS_BITS 54 // enough for rates up to 488,281 fps
+
+typedef struct {
+  uint32_t sequence;   // odd while the rest is being rewritten
+  int rate_is_nominal; // as returned by sanitised_source_rate_information
+  uint32_t reference_timestamp;
+  uint64_t remote_reference_timestamp_time;
+  uint64_t ns_per_frame;  // with TIMESTAMP_CONVERSION_NS_PER_FRAME_BITS fractional bits
+  uint64_t frames_per_ns; // with TIMESTAMP_CONVERSION_FRAMES_PER_NS_BITS fractional bits
+} timestamp_conversion;
+
 typedef struct stats { // statistics for running averages
   int64_t sync_error, correction, drift;
 } stats_t;
 
-// default buffer size
-// This needs to be a power of 2 because of the way BUFIDX(seqno) works.
+// audio buffer sizes, in packets
+// The size is set by the general "audio_buffer_size_in_packets" setting and it needs to be a power
+// of 2 because of the way BUFIDX(seqno) works.
 // 512 is the minimum for normal operation -- it gives 512*352/44100 or just over 4 seconds of
 // buffers.
 // For at least 10 seconds, you need to go to 2048.
@@ -68,7 +159,10 @@ typedef struct stats { // statistics for running averages
 // Thus, 2048 buffers will occupy about 3 megabytes -- no big deal in a normal machine but maybe a
 // problem in an embedded device.
 
-#define BUFFER_FRAMES 1024
+#define DEFAULT_BUFFER_FRAMES 1024
+#define MINIMUM_BUFFER_FRAMES 256
+#define MAXIMUM_BUFFER_FRAMES 16384
+#define BUFFERED_AUDIO_BUFFER_FRAMES 8192 // the default in buffered audio mode -- about 65 seconds
 
 typedef enum {
   ast_unknown,
@@ -99,9 +193,16 @@ typedef struct {
   int fd;
   int authorized;   // set if a password is required and has been supplied
   char *auth_nonce; // the session nonce, if needed
+  char *rtsp_buffer; // received on the fd but not yet parsed, kept from one request to the next
+  ssize_t rtsp_buffer_occupancy;
+  int served_by_listen_loop;        // set until a conversation thread is started for it
+  char *rtsp_unsent; // what the listen loop couldn't write without waiting, for the thread to send
+  size_t rtsp_unsent_length;
+  uint64_t rtsp_last_activity_time; // while it's served by the listen loop
   stream_cfg stream;
   SOCKADDR remote, local;
   volatile int stop;
+  int handover_requested; // another session is taking over -- keep what it can use, see player.c
   volatile int running;
   volatile uint64_t watchdog_bark_time;
   volatile int watchdog_barks;  // number of times the watchdog has timed out and done something
@@ -109,12 +210,13 @@ typedef struct {
 
   time_t playstart;
   pthread_t thread, timer_requester, rtp_audio_thread, rtp_control_thread, rtp_timing_thread,
-      player_watchdog_thread;
+      player_watchdog_thread, decoder_thread;
 
   // buffers to delete on exit
   signed short *tbuf;
   int32_t *sbuf;
   char *outbuf;
+  float *dsp_buffer_l, *dsp_buffer_r; // the float DSP stage works on these
 
   // for generating running statistics...
 
@@ -137,26 +239,72 @@ typedef struct {
 
   // other stuff...
   pthread_t *player_thread;
-  abuf_t audio_buffer[BUFFER_FRAMES];
+  abuf_t *audio_buffer;
+  unsigned int audio_buffer_size; // in packets, a power of 2
+  signed short *audio_buffer_data; // one allocation for the data of all the audio buffer entries,
+                                   // or of the lookahead_slots in buffered audio mode
+  // buffered audio mode -- see player.c
+  int buffered_audio;
+  compressed_chunk *compressed_chunk; // the chunk packets are being added to
+  compressed_chunk *spare_compressed_chunks;
+  unsigned int compressed_chunks, compressed_chunks_peak;
+  unsigned int lookahead_slots;   // decoded packets kept in audio_buffer_data, a power of 2
+  unsigned int lookahead_packets; // how far ahead of ab_read packets are decoded
+  int lookahead_decode_wanted;    // set when the decoder thread should look for packets to decode
+  pthread_mutex_t lookahead_decode_mutex; // held while a packet is being decoded
+  // a bit for every entry of the audio buffer between ab_read and ab_write that is still missing,
+  // in buckets of 64 entries, each with the earliest time any of its entries might be due for a
+  // resend request -- see check_for_missing_packets() in player.c
+  uint64_t *missing_packet_bitmap;
+  uint64_t *missing_packet_check_time;
+  unsigned int missing_packet_count;
+  packet_ring packet_rings[PR_number_of_rings];
   unsigned int max_frames_per_packet, input_num_channels, input_bit_depth, input_rate;
   int input_bytes_per_frame, output_bytes_per_frame, output_sample_ratio;
   int max_frame_size_change;
-  int64_t previous_random_number;
+  dither_state dither;
+  size_t silence_position; // where the next dithered silence comes from -- see silence.h
   alac_file *decoder_info;
+#ifdef CONFIG_APPLE_ALAC
+  apple_alac_decoder *apple_decoder_info;
+#endif
   uint64_t packet_count;
   uint64_t packet_count_since_flush;
   int connection_state_to_output;
   uint64_t first_packet_time_to_play;
+  double fast_start_latency_deficit; // frames the latency is short of conn->latency on a fast start
   int64_t time_since_play_started; // nanoseconds
                                    // stats
   uint64_t missing_packets, late_packets, too_late_packets, resend_requests;
+  receive_stats receive_stats;
+  stage_timings decoder_timings; // noted only by the decoder thread
+  stage_timings player_timings;  // noted only by the player thread
+  metrics_player_counts metrics_counts; // this play session's counts, kept by the player thread
+  // resend scheduling
+  uint64_t resend_packets_requested;
+  double resend_allowance;         // packets that may be requested now within the rate limit
+  uint64_t resend_allowance_time;  // when the allowance was last topped up
+  uint64_t round_trip_time;        // ns, smoothed, from the timing pings -- 0 if not yet known
+  uint64_t round_trip_time_variation; // ns
   int decoder_in_use;
   // debug variables
   int32_t last_seqno_read;
   // mutexes and condition variables
   pthread_cond_t flowcontrol;
   pthread_mutex_t ab_mutex, flush_mutex, volume_control_mutex;
+  pthread_cond_t decoder_cond; // signalled when packets are put into a packet ring
+  pthread_mutex_t decoder_mutex;
+  // for waking the timing sender early when audio resumes after a pause -- see rtp.c
+  pthread_cond_t timing_sender_cond;
+  pthread_mutex_t timing_sender_mutex;
+  int timing_sender_wakeup_requested;
   int fix_volume;
+  // software volume changes are ramped towards fix_volume a block at a time -- see player.c
+  int ramped_volume; // negative until something has been played
+  int volume_ramp_target;
+  int volume_ramp_step;
+  int volume_ramp_frames; // frames played at ramped_volume in the current block
+  int volume_applied_by_dsp; // true if the float DSP stage has already applied fix_volume
   uint32_t timestamp_epoch, last_timestamp,
       maximum_timestamp_interval; // timestamp_epoch of zero means not initialised, could start at 2
                                   // or 1.
@@ -177,10 +325,13 @@ typedef struct {
 #endif
 
 #ifdef CONFIG_OPENSSL
-  AES_KEY aes;
+  EVP_CIPHER_CTX *aes_ctx; // keyed once per session, NULL if the stream is not encrypted
 #endif
 
   int amountStuffed;
+#ifdef CONFIG_SOXR
+  soxr_t soxr_vr; // the variable-rate resampler for ST_soxr_vr, NULL if not in use
+#endif
 
   int32_t framesProcessedInThisEpoch;
   int32_t framesGeneratedInThisEpoch;
@@ -203,6 +354,8 @@ typedef struct {
   int audio_socket;                   // our local [server] audio socket
   int control_socket;                 // our local [server] control socket
   int timing_socket;                  // local timing socket
+  void *packet_capture;               // any capture being made of the session, see packet_capture.h
+  int packet_replay;                  // set if this session is a replay of a capture
 
   uint16_t remote_control_port;
   uint16_t remote_timing_port;
@@ -230,13 +383,13 @@ typedef struct {
   // debug variables
   int request_sent;
 
-  int time_ping_count;
-  struct time_ping_record time_pings[time_ping_history];
+  time_ping_history_info time_pings;
 
   uint64_t departure_time; // dangerous -- this assumes that there will never be two timing
                            // request in flight at the same time
 
-  pthread_mutex_t reference_time_mutex;
+  pthread_mutex_t reference_time_mutex; // taken by writers of the timestamp conversion too
+  timestamp_conversion timestamp_conversion;
   pthread_mutex_t watchdog_mutex;
 
   double local_to_remote_time_gradient; // if no drift, this would be exactly 1.0; likely it's
@@ -280,8 +433,14 @@ int player_stop(rtsp_conn_info *conn);
 void player_volume(double f, rtsp_conn_info *conn);
 void player_volume_without_notification(double f, rtsp_conn_info *conn);
 void player_flush(uint32_t timestamp, rtsp_conn_info *conn);
-void player_put_packet(seq_t seqno, uint32_t actual_timestamp, uint8_t *data, int len,
-                       rtsp_conn_info *conn);
+// true if no audio has arrived for a while -- when paused, between tracks or before play starts
+int player_input_is_idle(rtsp_conn_info *conn);
+void player_benchmark(void); // time the per-packet audio processing and print the results
+// the smallest audio buffer, in packets, that holds a latency of this many frames plus the
+// backend's latency offset -- a power of two, MINIMUM_BUFFER_FRAMES or more
+unsigned int minimum_audio_buffer_size(uint32_t latency);
+void player_put_packet(packet_ring_id ring_id, seq_t seqno, uint32_t actual_timestamp,
+                       uint8_t *data, int len, uint64_t arrival_time, rtsp_conn_info *conn);
 int64_t monotonic_timestamp(uint32_t timestamp,
                             rtsp_conn_info *conn); // add an epoch to the timestamp. The monotonic
 // timestamp guaranteed to start between 2^32 2^33
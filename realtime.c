@@ -0,0 +1,110 @@
+// pthread_setname_np, pthread_setaffinity_np and the CPU_SET macros need this on glibc. It's kept to this file because
+// it changes the behaviour of strerror_r, which is used elsewhere.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "config.h"
+
+#include "common.h"
+#include "realtime.h"
+
+#ifdef HAVE_MLOCKALL
+#include <sys/mman.h>
+#endif
+
+#if defined(__FreeBSD__) || defined(__OpenBSD__)
+#include <pthread_np.h>
+#endif
+
+void thread_set_name(const char *name) {
+#if defined(COMPILE_FOR_OSX)
+  pthread_setname_np(name);
+#elif defined(__linux__)
+  pthread_setname_np(pthread_self(), name); // names are truncated to 15 characters
+#elif defined(__FreeBSD__) || defined(__OpenBSD__)
+  pthread_set_name_np(pthread_self(), name);
+#else
+  (void)name;
+#endif
+}
+
+void realtime_thread_setup(const char *thread_name) {
+  if (config.realtime_scheduling_policy != SCHED_OTHER) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = config.realtime_priority;
+    int rc = pthread_setschedparam(pthread_self(), config.realtime_scheduling_policy, &param);
+    if (rc)
+      warn("Can not give the %s thread real-time priority %d: \"%s\". Does Shairport Sync have "
+           "the CAP_SYS_NICE capability or a high enough RLIMIT_RTPRIO?",
+           thread_name, config.realtime_priority, strerror(rc));
+    else
+      debug(2, "The %s thread has real-time priority %d.", thread_name, config.realtime_priority);
+  }
+#ifdef __linux__
+  if (config.realtime_cpu_affinity) {
+    cpu_set_t cpus;
+    unsigned int cpu;
+    CPU_ZERO(&cpus);
+    for (cpu = 0; cpu < 64; cpu++)
+      if (config.realtime_cpu_affinity & ((uint64_t)1 << cpu))
+        CPU_SET(cpu, &cpus);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (rc)
+      warn("Can not set the CPU affinity of the %s thread: \"%s\".", thread_name, strerror(rc));
+  }
+#endif
+}
+
+void realtime_ordinary_thread_attr_init(pthread_attr_t *attr) {
+  pthread_attr_init(attr);
+  if (config.realtime_scheduling_policy != SCHED_OTHER) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = 0;
+    pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(attr, SCHED_OTHER);
+    pthread_attr_setschedparam(attr, &param);
+  }
+}
+
+void realtime_set_thread_stack_size(void) {
+  if (config.thread_stack_size) {
+#ifdef HAVE_PTHREAD_SETATTR_DEFAULT_NP
+    size_t stack_size = config.thread_stack_size;
+    if (stack_size < (size_t)PTHREAD_STACK_MIN)
+      stack_size = PTHREAD_STACK_MIN;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    int rc = pthread_attr_setstacksize(&attr, stack_size);
+    if (rc == 0)
+      rc = pthread_setattr_default_np(&attr);
+    pthread_attr_destroy(&attr);
+    if (rc != 0)
+      warn("Can not set the thread stack size to %zu bytes: \"%s\".", stack_size, strerror(rc));
+#else
+    warn("Setting the thread stack size is not supported on this system.");
+#endif
+  }
+}
+
+void realtime_lock_memory(void) {
+  if (config.lock_memory) {
+#ifdef HAVE_MLOCKALL
+    // everything, including the stacks and buffers of sessions yet to come, stays in memory, so
+    // that a page fault can never hold up the player
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+      warn("Can not lock Shairport Sync's memory: \"%s\".", strerror(errno));
+    else
+      debug(1, "memory is locked.");
+#else
+    warn("Locking memory is not supported on this system.");
+#endif
+  }
+}
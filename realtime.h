@@ -0,0 +1,24 @@
+#pragma once
+
+#include <pthread.h>
+
+// name the calling thread, so that it can be told apart in top, ps or a debugger. Keep names
+// to 15 characters, the most Linux allows.
+void thread_set_name(const char *name);
+
+// give the calling thread the real-time scheduling policy, priority and CPU affinity, if any, set
+// in the configuration. The name is only used in messages.
+void realtime_thread_setup(const char *thread_name);
+
+// initialise thread attributes that give a new thread the ordinary SCHED_OTHER policy rather than
+// the real-time policy of the thread creating it. Use them for threads started from the player or
+// the RTP audio receiver. Destroy them with pthread_attr_destroy.
+void realtime_ordinary_thread_attr_init(pthread_attr_t *attr);
+
+// make the stack size in the configuration, if any, the default for every thread started from now
+// on, including those started by libraries. It should be called before any thread is started.
+void realtime_set_thread_stack_size(void);
+
+// lock all of Shairport Sync's memory, present and future, if the configuration asks for it.
+// It must be called after daemonising, as the lock isn't inherited across a fork.
+void realtime_lock_memory(void);
@@ -0,0 +1,57 @@
+#include "receive_stats.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+// the lower edges of the margin bins after the first, in milliseconds
+static const int margin_bin_edge[RECEIVE_STATS_MARGIN_BINS - 1] = {0,   25,   50,   100, 250,
+                                                                    500, 1000, 1500, 2000};
+
+// the lower edges of the reorder depth bins
+static const int reorder_bin_edge[RECEIVE_STATS_REORDER_BINS] = {1, 2, 3, 5, 9, 17};
+
+void receive_stats_reset(receive_stats *s) { memset(s, 0, sizeof(receive_stats)); }
+
+void receive_stats_note_margin(receive_stats *s, int64_t margin) {
+  if ((s->timed_packets == 0) || (margin < s->minimum_margin))
+    s->minimum_margin = margin;
+  s->timed_packets++;
+  int bin = 0;
+  while ((bin < RECEIVE_STATS_MARGIN_BINS - 1) &&
+         (margin >= (int64_t)margin_bin_edge[bin] * 1000000))
+    bin++;
+  s->margin[bin]++;
+}
+
+void receive_stats_note_out_of_order(receive_stats *s, int depth) {
+  s->out_of_order++;
+  int bin = 0;
+  while ((bin < RECEIVE_STATS_REORDER_BINS - 1) && (depth >= reorder_bin_edge[bin + 1]))
+    bin++;
+  s->reorder_depth[bin]++;
+}
+
+// Something like:
+// "packets=12000,duplicates=0,too_late=0,out_of_order=3,resend_hits=5,resend_misses=0,
+// minimum_margin_ms=1203.5,margin_ms=<0:0;0:0;25:0;50:0;100:0;250:0;500:0;1000:5;1500:46;2000:11949,
+// reorder_depth=1:3;2:0;3:0;5:0;9:0;17:0" -- all on one line.
+int receive_stats_format(receive_stats *s, char *buf, size_t size) {
+  char margin_text[256], reorder_text[128];
+  int i, n = snprintf(margin_text, sizeof(margin_text), "<0:%" PRIu64, s->margin[0]);
+  for (i = 1; i < RECEIVE_STATS_MARGIN_BINS; i++)
+    if ((n >= 0) && ((size_t)n < sizeof(margin_text)))
+      n += snprintf(margin_text + n, sizeof(margin_text) - n, ";%d:%" PRIu64,
+                    margin_bin_edge[i - 1], s->margin[i]);
+  n = 0;
+  for (i = 0; i < RECEIVE_STATS_REORDER_BINS; i++)
+    if ((n >= 0) && ((size_t)n < sizeof(reorder_text)))
+      n += snprintf(reorder_text + n, sizeof(reorder_text) - n, "%s%d:%" PRIu64, i ? ";" : "",
+                    reorder_bin_edge[i], s->reorder_depth[i]);
+  return snprintf(buf, size,
+                  "packets=%" PRIu64 ",duplicates=%" PRIu64 ",too_late=%" PRIu64
+                  ",out_of_order=%" PRIu64 ",resend_hits=%" PRIu64 ",resend_misses=%" PRIu64
+                  ",minimum_margin_ms=%.1f,margin_ms=%s,reorder_depth=%s",
+                  s->packets, s->duplicates, s->too_late, s->out_of_order, s->resend_hits,
+                  s->resend_misses, s->timed_packets ? 0.000001 * s->minimum_margin : 0.0,
+                  margin_text, reorder_text);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Statistics about how audio packets arrive: how much time they have to spare before they are due
+// to be sent to the output, how far out of order they come, how many are duplicates and how well
+// resend requests are answered. They are kept for each play session and are only updated with the
+// ab_mutex held, except for resend_misses, which the player thread alone updates.
+
+// time to spare, in milliseconds -- the first bin is for packets that are already late
+#define RECEIVE_STATS_MARGIN_BINS 10
+// packets that have arrived after 1, 2, 3-4, 5-8, 9-16 or 17+ later packets
+#define RECEIVE_STATS_REORDER_BINS 6
+
+typedef struct {
+  uint64_t packets;       // all the packets that arrived, including duplicates
+  uint64_t duplicates;    // packets that had already arrived
+  uint64_t too_late;      // packets that arrived after they should have been played
+  uint64_t out_of_order;  // packets that arrived after later ones, other than resent ones
+  uint64_t resend_hits;   // requested packets that arrived in time to be played
+  uint64_t resend_misses; // requested packets that never arrived in time
+  uint64_t timed_packets; // packets for which the time to spare is known
+  int64_t minimum_margin; // ns, the least time to spare of any packet, if timed_packets isn't 0
+  uint64_t margin[RECEIVE_STATS_MARGIN_BINS];
+  uint64_t reorder_depth[RECEIVE_STATS_REORDER_BINS];
+} receive_stats;
+
+void receive_stats_reset(receive_stats *s);
+
+// margin is the time, in nanoseconds, that the packet has to spare -- negative if it's late
+void receive_stats_note_margin(receive_stats *s, int64_t margin);
+
+// depth is the number of later packets that arrived before this one
+void receive_stats_note_out_of_order(receive_stats *s, int depth);
+
+// Describe the statistics as a line of text, e.g. for metadata, returning the length written
+// as snprintf does.
+int receive_stats_format(receive_stats *s, char *buf, size_t size);
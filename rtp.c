@@ -28,7 +28,10 @@
 #include "rtp.h"
 #include "common.h"
 #include "player.h"
+#include "realtime.h"
 #include "rtsp.h"
+#include "packet_capture.h"
+#include "udp_receive.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -47,7 +50,8 @@
 
 struct Nvll {
   char *name;
-  double value;
+  double value;  // the gradient
+  double weight; // how much it can be trusted -- see time_ping_history_info
   struct Nvll *next;
 };
 
@@ -56,6 +60,10 @@ typedef struct Nvll nvll;
 uint64_t local_to_remote_time_jitter;
 uint64_t local_to_remote_time_jitter_count;
 
+static void get_timestamp_conversion(rtsp_conn_info *conn, timestamp_conversion *c);
+static void publish_timestamp_conversion(rtsp_conn_info *conn);
+static void rtp_set_receive_buffer_sizes(rtsp_conn_info *conn);
+
 void rtp_initialise(rtsp_conn_info *conn) {
   conn->rtp_time_of_last_resend_request_error_ns = 0;
   conn->rtp_running = 0;
@@ -63,6 +71,7 @@ void rtp_initialise(rtsp_conn_info *conn) {
   int rc = pthread_mutex_init(&conn->reference_time_mutex, NULL);
   if (rc)
     debug(1, "Error initialising reference_time_mutex.");
+  memset(&conn->timestamp_conversion, 0, sizeof(conn->timestamp_conversion));
 }
 
 void rtp_terminate(rtsp_conn_info *conn) {
@@ -98,11 +107,16 @@ void rtp_audio_receiver_cleanup_handler(__attribute__((unused)) void *arg) {
 }
 
 void *rtp_audio_receiver(void *arg) {
+  thread_set_name("rtp-audio");
   pthread_cleanup_push(rtp_audio_receiver_cleanup_handler, arg);
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
+  realtime_thread_setup("RTP audio receiver");
 
   int32_t last_seqno = -1;
-  uint8_t packet[2048], *pktp;
+  uint8_t *packet, *pktp;
+  udp_datagram datagrams[UDP_RECEIVE_BATCH_SIZE];
+  int datagrams_received = 0;
+  int next_datagram = 0;
 
   uint64_t time_of_previous_packet_ns = 0;
   float longest_packet_time_interval_us = 0.0;
@@ -117,11 +131,18 @@ void *rtp_audio_receiver(void *arg) {
   int frame_count = 0;
   ssize_t nread;
   while (1) {
-    nread = recv(conn->audio_socket, packet, sizeof(packet), 0);
+    if (next_datagram == datagrams_received) {
+      datagrams_received = udp_receive(conn->audio_socket, datagrams, UDP_RECEIVE_BATCH_SIZE);
+      next_datagram = 0;
+      packet_capture_datagrams(conn, packet_capture_audio, datagrams, datagrams_received);
+    }
+    packet = datagrams[next_datagram].data;
+    nread = datagrams[next_datagram].length;
+    uint64_t local_time_now_ns = datagrams[next_datagram].arrival_time;
+    next_datagram++;
 
     frame_count++;
 
-    uint64_t local_time_now_ns = get_absolute_time_in_ns();
     if (time_of_previous_packet_ns) {
       float time_interval_us = (local_time_now_ns - time_of_previous_packet_ns) * 0.001;
       time_of_previous_packet_ns = local_time_now_ns;
@@ -199,7 +220,8 @@ void *rtp_audio_receiver(void *arg) {
         if (plen >= 16) {
           if ((config.diagnostic_drop_packet_fraction == 0.0) ||
               (drand48() > config.diagnostic_drop_packet_fraction))
-            player_put_packet(seqno, actual_timestamp, pktp, plen, conn);
+            player_put_packet(PR_audio_port, seqno, actual_timestamp, pktp, plen,
+                              local_time_now_ns, conn);
           else
             debug(3, "Dropping audio packet %u to simulate a bad connection.", seqno);
           continue;
@@ -233,17 +255,29 @@ void rtp_control_handler_cleanup_handler(__attribute__((unused)) void *arg) {
 }
 
 void *rtp_control_receiver(void *arg) {
+  thread_set_name("rtp-control");
   pthread_cleanup_push(rtp_control_handler_cleanup_handler, arg);
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
 
-  conn->reference_timestamp = 0; // nothing valid received yet
-  uint8_t packet[2048], *pktp;
+  clear_reference_timestamp(conn); // nothing valid received yet
+  uint8_t *packet, *pktp;
+  udp_datagram datagrams[UDP_RECEIVE_BATCH_SIZE];
+  int datagrams_received = 0;
+  int next_datagram = 0;
   // struct timespec tn;
   uint64_t remote_time_of_sync;
   uint32_t sync_rtp_timestamp;
   ssize_t nread;
   while (1) {
-    nread = recv(conn->control_socket, packet, sizeof(packet), 0);
+    if (next_datagram == datagrams_received) {
+      datagrams_received = udp_receive(conn->control_socket, datagrams, UDP_RECEIVE_BATCH_SIZE);
+      packet_capture_datagrams(conn, packet_capture_control, datagrams, datagrams_received);
+      next_datagram = 0;
+    }
+    packet = datagrams[next_datagram].data;
+    nread = datagrams[next_datagram].length;
+    uint64_t time_of_arrival = datagrams[next_datagram].arrival_time;
+    next_datagram++;
 
     if (nread >= 0) {
 
@@ -354,7 +388,10 @@ void *rtp_control_receiver(void *arg) {
               if ((conn->minimum_latency) && (conn->minimum_latency > la))
                 la = conn->minimum_latency;
 
-              const uint32_t max_frames = ((3 * BUFFER_FRAMES * 352) / 4) - 11025;
+              // the player's buffer may be smaller than the configured size in low memory mode
+              uint32_t buffer_size =
+                  conn->audio_buffer_size ? conn->audio_buffer_size : config.audio_buffer_size;
+              const uint32_t max_frames = ((3 * buffer_size * 352) / 4) - 11025;
 
               if (la > max_frames) {
                 warn("An out-of-range latency request of %" PRIu32
@@ -366,6 +403,7 @@ void *rtp_control_receiver(void *arg) {
 
                 if (la != conn->latency) {
                   conn->latency = la;
+                  rtp_set_receive_buffer_sizes(conn);
                   debug(3,
                         "New latency detected: %" PRIu32 ", sync latency: %" PRIu32
                         ", minimum latency: %" PRIu32 ", maximum "
@@ -406,6 +444,7 @@ void *rtp_control_receiver(void *arg) {
             //    remote_time_of_sync - local_to_remote_time_difference_now(conn);
             conn->reference_timestamp = sync_rtp_timestamp;
             conn->latency_delayed_timestamp = rtp_timestamp_less_latency;
+            publish_timestamp_conversion(conn);
             debug_mutex_unlock(&conn->reference_time_mutex, 0);
 
             conn->reference_to_previous_time_difference =
@@ -431,7 +470,8 @@ void *rtp_control_receiver(void *arg) {
 
           // check if packet contains enough content to be reasonable
           if (plen >= 16) {
-            player_put_packet(seqno, actual_timestamp, pktp, plen, conn);
+            player_put_packet(PR_control_port, seqno, actual_timestamp, pktp, plen,
+                              time_of_arrival, conn);
             continue;
           } else {
             debug(3, "Too-short retransmitted audio packet received in control port, ignored.");
@@ -457,7 +497,50 @@ void rtp_timing_sender_cleanup_handler(void *arg) {
   debug(3, "Connection %d: Timing Sender Cleanup.", conn->connection_number);
 }
 
+// how often to ask for the time while no audio is arriving, e.g. when paused
+#define RTP_IDLE_TIMING_INTERVAL_NS 15000000000
+
+// Wait for up to interval_ns, returning non-zero if woken early by rtp_request_timing_burst.
+// This is a thread cancellation point.
+static int timing_sender_wait(rtsp_conn_info *conn, uint64_t interval_ns) {
+  int response = 0;
+  pthread_mutex_lock(&conn->timing_sender_mutex);
+  pthread_cleanup_push(pthread_cleanup_debug_mutex_unlock, (void *)&conn->timing_sender_mutex);
+#ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
+  struct timespec time_of_wakeup;
+  absolute_time_to_timespec(get_absolute_time_in_ns() + interval_ns, &time_of_wakeup);
+#endif
+#ifdef COMPILE_FOR_OSX
+  struct timespec time_to_wait;
+  time_to_wait.tv_sec = interval_ns / 1000000000;
+  time_to_wait.tv_nsec = interval_ns % 1000000000;
+#endif
+  int rc = 0;
+  while ((conn->timing_sender_wakeup_requested == 0) && (rc != ETIMEDOUT)) {
+#ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
+    rc = pthread_cond_timedwait(&conn->timing_sender_cond, &conn->timing_sender_mutex,
+                                &time_of_wakeup); // this is a pthread cancellation point
+#endif
+#ifdef COMPILE_FOR_OSX
+    rc = pthread_cond_timedwait_relative_np(&conn->timing_sender_cond, &conn->timing_sender_mutex,
+                                            &time_to_wait);
+#endif
+  }
+  response = conn->timing_sender_wakeup_requested;
+  conn->timing_sender_wakeup_requested = 0;
+  pthread_cleanup_pop(1); // release the mutex
+  return response;
+}
+
+void rtp_request_timing_burst(rtsp_conn_info *conn) {
+  pthread_mutex_lock(&conn->timing_sender_mutex);
+  conn->timing_sender_wakeup_requested = 1;
+  pthread_cond_signal(&conn->timing_sender_cond);
+  pthread_mutex_unlock(&conn->timing_sender_mutex);
+}
+
 void *rtp_timing_sender(void *arg) {
+  thread_set_name("rtp-timing-send");
   pthread_cleanup_push(rtp_timing_sender_cleanup_handler, arg);
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
   struct timing_request {
@@ -477,7 +560,6 @@ void *rtp_timing_sender(void *arg) {
   req.filler = 0;
   req.seqno = htons(7);
 
-  conn->time_ping_count = 0;
   while (1) {
     // debug(1,"Send a timing request");
 
@@ -491,6 +573,7 @@ void *rtp_timing_sender(void *arg) {
     req.origin = req.receive = req.transmit = 0;
 
     conn->departure_time = get_absolute_time_in_ns();
+    packet_capture_timing_request_sent(conn, conn->departure_time);
     socklen_t msgsize = sizeof(struct sockaddr_in);
 #ifdef AF_INET6
     if (conn->rtp_client_timing_socket.SAFAMILY == AF_INET6) {
@@ -511,29 +594,198 @@ void *rtp_timing_sender(void *arg) {
 
     request_number++;
 
+    uint64_t interval_ns;
     if (request_number <= 6)
-      usleep(300000); // these are thread cancellation points
+      interval_ns = 300000000;
+    else if (player_input_is_idle(conn))
+      interval_ns = RTP_IDLE_TIMING_INTERVAL_NS; // the clocks won't drift far while paused
     else
-      usleep(3000000);
+      interval_ns = 3000000000;
+    if (timing_sender_wait(conn, interval_ns) != 0)
+      request_number = 0; // audio is resuming, so start again with a quick succession of requests
   }
   debug(3, "rtp_timing_sender thread interrupted. This should never happen.");
   pthread_cleanup_pop(0); // don't execute anything here.
   pthread_exit(NULL);
 }
 
+// the pings from the first minute or so are left out of the drift estimate to let things settle
+#define time_ping_settling_pings 20
+// the number of pings needed for a valid drift estimate, unless there's one from before
+#define time_ping_sample_point_minimum 8
+// the dispersion of a ping is aged by this factor (as a natural log) for every ping since, so
+// that at the end of the history it has grown tenfold
+#define time_ping_dispersion_ageing (M_LN10 / time_ping_history)
+// and the weight of the gradient remembered from before fades by this factor with every ping
+#define time_ping_prior_fade 0.97
+// until it's this small a part of the weight of the pings, when it's dropped
+#define time_ping_prior_negligible 0.01
+
+// find the gradient remembered for the client, if any
+static nvll *find_gradient(rtsp_conn_info *conn) {
+  nvll *gradients = config.gradients;
+  while ((gradients) && (strcasecmp((const char *)&conn->client_ip_string, gradients->name) != 0))
+    gradients = gradients->next;
+  return gradients;
+}
+
+static inline double time_ping_aged_dispersion(time_ping_record *r) {
+  return log(1.0 + r->dispersion) - r->sequence_number * time_ping_dispersion_ageing;
+}
+
+static inline int time_ping_is_in_fit(time_ping_record *r) {
+  return (r->chosen) && (r->sequence_number > time_ping_settling_pings);
+}
+
+static void time_ping_fit_add(time_ping_history_info *h, time_ping_record *r, double sign) {
+  double x = (int64_t)(r->local_time - h->base_local_time);
+  double y = (int64_t)(r->remote_time - h->base_remote_time);
+  h->sample_count += (sign > 0) ? 1 : -1;
+  h->sum_x += sign * x;
+  h->sum_y += sign * y;
+  h->sum_xx += sign * x * x;
+  h->sum_xy += sign * x * y;
+}
+
+// start the sums again from the newest ping, to stop rounding errors building up
+static void time_ping_fit_recalculate(time_ping_history_info *h, time_ping_record *newest) {
+  h->base_local_time = newest->local_time;
+  h->base_remote_time = newest->remote_time;
+  h->sample_count = 0;
+  h->sum_x = h->sum_y = h->sum_xx = h->sum_xy = 0.0;
+  int i;
+  for (i = 0; i < h->count; i++)
+    if (time_ping_is_in_fit(&h->pings[i]))
+      time_ping_fit_add(h, &h->pings[i], 1.0);
+  h->updates_since_sums_recalculated = 0;
+}
+
+// the spread of the local times in the fit, which is how much weight its gradient has
+static double time_ping_fit_weight(time_ping_history_info *h) {
+  double response = 0.0;
+  if (h->sample_count >= 2)
+    response = h->sum_xx - h->sum_x * h->sum_x / h->sample_count;
+  return response;
+}
+
+// Add a time ping to the history, choose the one with the least aged dispersion and update the
+// local-to-remote time difference and gradient. Everything here takes the same time, whatever the
+// length of the history.
+static void time_ping_add(rtsp_conn_info *conn, uint64_t local_time, uint64_t remote_time,
+                          uint64_t dispersion) {
+  time_ping_history_info *h = &conn->time_pings;
+  const int mask = time_ping_history - 1;
+  int sequence_number = h->next_sequence_number++;
+  time_ping_record *r = &h->pings[sequence_number & mask];
+
+  // the oldest ping makes way for the new one
+  if (h->count == time_ping_history) {
+    if (time_ping_is_in_fit(r))
+      time_ping_fit_add(h, r, -1.0);
+  } else {
+    h->count++;
+  }
+  r->local_time = local_time;
+  r->remote_time = remote_time;
+  r->sequence_number = sequence_number;
+  r->chosen = 0;
+  r->dispersion = dispersion;
+
+  // The ping with the least aged dispersion is chosen. The ageing is the same for all of them, so
+  // the order of two pings never changes and a ping can never be chosen once a later one has
+  // less dispersion. So keep only the pings that can still be chosen, in order of age.
+  if ((h->candidate_count) &&
+      (h->candidates[h->first_candidate] <= sequence_number - time_ping_history)) {
+    h->first_candidate = (h->first_candidate + 1) & mask;
+    h->candidate_count--;
+  }
+  double aged_dispersion = time_ping_aged_dispersion(r);
+  while ((h->candidate_count) &&
+         (time_ping_aged_dispersion(
+              &h->pings[h->candidates[(h->first_candidate + h->candidate_count - 1) & mask] &
+                        mask]) >= aged_dispersion))
+    h->candidate_count--;
+  h->candidates[(h->first_candidate + h->candidate_count) & mask] = sequence_number;
+  h->candidate_count++;
+
+  time_ping_record *chosen = &h->pings[h->candidates[h->first_candidate] & mask];
+  if (chosen->chosen == 0) {
+    chosen->chosen = 1; // record the fact that it has been used for timing
+    if (time_ping_is_in_fit(chosen))
+      time_ping_fit_add(h, chosen, 1.0);
+  }
+  if (++h->updates_since_sums_recalculated >= time_ping_history)
+    time_ping_fit_recalculate(h, r);
+  h->prior_weight *= time_ping_prior_fade;
+  // once it's dropped, the fit needs the minimum number of pings again
+  if ((h->prior_weight > 0.0) &&
+      (h->prior_weight < time_ping_prior_negligible * time_ping_fit_weight(h)))
+    h->prior_weight = 0.0;
+
+  conn->local_to_remote_time_difference =
+      chosen->remote_time - chosen->local_time; // make this the new local-to-remote-time-difference
+  conn->local_to_remote_time_difference_measurement_time = chosen->local_time; // done at this time.
+
+  // Use the chosen pings to estimate the drift between the local clock (x) and the remote
+  // clock (y) from the line of best fit through them, the slope being the drift.
+  // see https://www.varsitytutors.com/hotmath/hotmath_help/topics/line-of-best-fit
+  // The gradient remembered from before counts as a further point on the slope, with its
+  // weight, so that there is a good estimate from the start.
+  int sample_count = h->sample_count;
+  conn->local_to_remote_time_gradient_sample_count = sample_count;
+  if ((sample_count > time_ping_sample_point_minimum) ||
+      ((sample_count >= 2) && (h->prior_weight > 0.0))) {
+    double x_bar = h->sum_x / sample_count;
+    double y_bar = h->sum_y / sample_count;
+    double mbl = time_ping_fit_weight(h) + h->prior_weight;
+    double mtl = h->sum_xy - h->sum_x * y_bar + h->prior_gradient * h->prior_weight;
+    if (mbl > 0.0)
+      conn->local_to_remote_time_gradient = mtl / mbl;
+    else
+      debug(1, "mbl is zero. Drift remains at %.2f ppm.",
+            (conn->local_to_remote_time_gradient - 1.0) * 1000000);
+
+    uint64_t xbf = h->base_local_time + (int64_t)x_bar;
+    uint64_t ybf = h->base_remote_time + (int64_t)y_bar;
+    conn->local_to_remote_time_difference =
+        ybf - xbf; // make this the new local-to-remote-time-difference
+    conn->local_to_remote_time_difference_measurement_time = xbf;
+  } else {
+    debug(3, "not enough samples to estimate drift -- remaining at %.2f ppm.",
+          (conn->local_to_remote_time_gradient - 1.0) * 1000000);
+  }
+}
+
+// Keep a smoothed round trip time and its variation, as in RFC 6298, for the resend scheduler.
+// They are read by the player thread without a lock, so each is stored in one go.
+static void round_trip_time_add(rtsp_conn_info *conn, uint64_t round_trip_time) {
+  uint64_t srtt = conn->round_trip_time;
+  uint64_t rttvar = conn->round_trip_time_variation;
+  if (srtt == 0) {
+    srtt = round_trip_time;
+    rttvar = round_trip_time / 2;
+  } else {
+    uint64_t deviation =
+        srtt > round_trip_time ? srtt - round_trip_time : round_trip_time - srtt;
+    rttvar = (3 * rttvar + deviation) / 4;
+    srtt = (7 * srtt + round_trip_time) / 8;
+  }
+  __atomic_store_n(&conn->round_trip_time_variation, rttvar, __ATOMIC_RELAXED);
+  __atomic_store_n(&conn->round_trip_time, srtt, __ATOMIC_RELAXED);
+}
+
 void rtp_timing_receiver_cleanup_handler(void *arg) {
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
   debug(3, "Timing Receiver Cleanup.");
-  // walk down the list of DACP / gradient pairs, if any
-  nvll *gradients = config.gradients;
-  if (conn->dacp_id)
-    while ((gradients) && (strcasecmp((const char *)&conn->client_ip_string, gradients->name) != 0))
-      gradients = gradients->next;
-
-  // if gradients comes out of this non-null, it is pointing to the DACP and it's last-known
-  // gradient
+  // remember the gradient for the next session with this client, with the weight of the evidence
+  // for it
+  double weight = conn->time_pings.prior_weight;
+  if (conn->time_pings.sample_count > time_ping_sample_point_minimum)
+    weight += time_ping_fit_weight(&conn->time_pings);
+  nvll *gradients = find_gradient(conn);
   if (gradients) {
     gradients->value = conn->local_to_remote_time_gradient;
+    gradients->weight = weight;
     // debug(1,"Updating a drift of %.2f ppm for \"%s\".", (conn->local_to_remote_time_gradient
     // - 1.0)*1000000, gradients->name);
   } else {
@@ -541,6 +793,7 @@ void rtp_timing_receiver_cleanup_handler(void *arg) {
     if (new_entry) {
       new_entry->name = strdup((const char *)&conn->client_ip_string);
       new_entry->value = conn->local_to_remote_time_gradient;
+      new_entry->weight = weight;
       new_entry->next = config.gradients;
       config.gradients = new_entry;
       // debug(1,"Setting a new drift of %.2f ppm for \"%s\".", (conn->local_to_remote_time_gradient
@@ -548,23 +801,27 @@ void rtp_timing_receiver_cleanup_handler(void *arg) {
     }
   }
 
-  debug(3, "Cancel Timing Requester.");
-  pthread_cancel(conn->timer_requester);
-  int oldState;
-  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
-  debug(3, "Join Timing Requester.");
-  pthread_join(conn->timer_requester, NULL);
+  if (conn->packet_replay == 0) {
+    debug(3, "Cancel Timing Requester.");
+    pthread_cancel(conn->timer_requester);
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+    debug(3, "Join Timing Requester.");
+    pthread_join(conn->timer_requester, NULL);
+    pthread_setcancelstate(oldState, NULL);
+  }
   debug(3, "Timing Receiver Cleanup Successful.");
-  pthread_setcancelstate(oldState, NULL);
 }
 
 void *rtp_timing_receiver(void *arg) {
+  thread_set_name("rtp-timing");
   pthread_cleanup_push(rtp_timing_receiver_cleanup_handler, arg);
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
 
-  uint8_t packet[2048];
+  uint8_t *packet;
+  // timing replies come in one at a time, so there's no need to collect more than one at once
+  udp_datagram datagram;
   ssize_t nread;
-  pthread_create(&conn->timer_requester, NULL, &rtp_timing_sender, arg);
   //    struct timespec att;
   uint64_t distant_receive_time, distant_transmit_time, arrival_time, return_time;
   local_to_remote_time_jitter = 0;
@@ -574,36 +831,30 @@ void *rtp_timing_receiver(void *arg) {
 
   uint64_t first_local_to_remote_time_difference = 0;
 
-  conn->local_to_remote_time_gradient = 1.0; // initial value.
-  // walk down the list of DACP / gradient pairs, if any
-  nvll *gradients = config.gradients;
-  while ((gradients) && (strcasecmp((const char *)&conn->client_ip_string, gradients->name) != 0))
-    gradients = gradients->next;
-
-  // if gradients comes out of this non-null, it is pointing to the IP and it's last-known gradient
+  memset(&conn->time_pings, 0, sizeof(conn->time_pings));
+  conn->round_trip_time = 0;
+  conn->round_trip_time_variation = 0;
+  conn->time_pings.prior_gradient = 1.0; // initial value.
+  // if there's a gradient remembered for this client, start with it
+  nvll *gradients = find_gradient(conn);
   if (gradients) {
-    conn->local_to_remote_time_gradient = gradients->value;
-    // debug(1,"Using a stored drift of %.2f ppm for \"%s\".", (conn->local_to_remote_time_gradient
+    conn->time_pings.prior_gradient = gradients->value;
+    conn->time_pings.prior_weight = gradients->weight;
+    // debug(1,"Using a stored drift of %.2f ppm for \"%s\".", (gradients->value
     // - 1.0)*1000000, gradients->name);
   }
-
-  // calculate diffusion factor
-
-  // at the end of the array of time pings, the diffusion factor
-  // must be diffusion_expansion_factor
-  // this, at each step, the diffusion multiplication constant must
-  // be the nth root of diffusion_expansion_factor
-  // where n is the number of elements in the array
-
-  const double diffusion_expansion_factor = 10;
-  double log_of_multiplier = log10(diffusion_expansion_factor) / time_ping_history;
-  double multiplier = pow(10, log_of_multiplier);
-  uint64_t dispersion_factor = (uint64_t)(multiplier * 100);
-  // debug(1,"dispersion factor is %" PRIu64 ".", dispersion_factor);
+  conn->local_to_remote_time_gradient = conn->time_pings.prior_gradient;
+  conn->local_to_remote_time_gradient_sample_count = 0;
+  // in a replay, the timing requests' departure times come from the capture instead
+  if (conn->packet_replay == 0) {
+    pthread_attr_t attr;
+    realtime_ordinary_thread_attr_init(&attr);
+    pthread_create(&conn->timer_requester, &attr, &rtp_timing_sender, arg);
+    pthread_attr_destroy(&attr);
+  }
 
   // uint64_t first_local_to_remote_time_difference_time;
   // uint64_t l2rtd = 0;
-  int sequence_number = 0;
 
   // for getting mean and sd of return times
   int32_t stat_n = 0;
@@ -611,13 +862,16 @@ void *rtp_timing_receiver(void *arg) {
   double stat_M2 = 0.0;
 
   while (1) {
-    nread = recv(conn->timing_socket, packet, sizeof(packet), 0);
+    udp_receive(conn->timing_socket, &datagram, 1);
+    packet_capture_datagrams(conn, packet_capture_timing, &datagram, 1);
+    packet = datagram.data;
+    nread = datagram.length;
 
     if (nread >= 0) {
 
       if ((config.diagnostic_drop_packet_fraction == 0.0) ||
           (drand48() > config.diagnostic_drop_packet_fraction)) {
-        arrival_time = get_absolute_time_in_ns();
+        arrival_time = datagram.arrival_time; // from the kernel, if possible
 
         // ssize_t plen = nread;
         // debug(1,"Packet Received on Timing Port.");
@@ -666,30 +920,6 @@ void *rtp_timing_receiver(void *arg) {
             else
               debug(1, "Remote processing time greater than return time -- ignored.");
 
-            int cc;
-            // debug(1, "time ping history is %d entries.", time_ping_history);
-            for (cc = time_ping_history - 1; cc > 0; cc--) {
-              conn->time_pings[cc] = conn->time_pings[cc - 1];
-              // if ((conn->time_ping_count) && (conn->time_ping_count < 10))
-              //                conn->time_pings[cc].dispersion =
-              //                  conn->time_pings[cc].dispersion * pow(2.14,
-              //                  1.0/conn->time_ping_count);
-              if (conn->time_pings[cc].dispersion > UINT64_MAX / dispersion_factor)
-                debug(1, "dispersion factor is too large at %" PRIu64 ".");
-              else
-                conn->time_pings[cc].dispersion =
-                    (conn->time_pings[cc].dispersion * dispersion_factor) /
-                    100; // make the dispersions 'age' by this rational factor
-            }
-            // these are used for doing a least squares calculation to get the drift
-            conn->time_pings[0].local_time = arrival_time;
-            conn->time_pings[0].remote_time = distant_transmit_time + return_time / 2;
-            conn->time_pings[0].sequence_number = sequence_number++;
-            conn->time_pings[0].chosen = 0;
-            conn->time_pings[0].dispersion = return_time;
-            if (conn->time_ping_count < time_ping_history)
-              conn->time_ping_count++;
-
             // here, calculate the mean and standard deviation of the return times
 
             // mean and variance calculations from "online_variance" algorithm at
@@ -703,114 +933,13 @@ void *rtp_timing_receiver(void *arg) {
             // %d packets: %.1f, %.1f, %.1f (nanoseconds).",
             //        stat_n,return_time,stat_mean, sqrtf(stat_M2 / (stat_n - 1)));
 
-            // here, pick the record with the least dispersion, and record that it's been chosen
-
-            // uint64_t local_time_chosen = arrival_time;
-            // uint64_t remote_time_chosen = distant_transmit_time;
-            // now pick the timestamp with the lowest dispersion
-            uint64_t rt = conn->time_pings[0].remote_time;
-            uint64_t lt = conn->time_pings[0].local_time;
-            uint64_t tld = conn->time_pings[0].dispersion;
-            int chosen = 0;
-            for (cc = 1; cc < conn->time_ping_count; cc++)
-              if (conn->time_pings[cc].dispersion < tld) {
-                chosen = cc;
-                rt = conn->time_pings[cc].remote_time;
-                lt = conn->time_pings[cc].local_time;
-                tld = conn->time_pings[cc].dispersion;
-                // local_time_chosen = conn->time_pings[cc].local_time;
-                // remote_time_chosen = conn->time_pings[cc].remote_time;
-              }
-            // debug(1,"Record %d has the lowest dispersion with %0.2f us
-            // dispersion.",chosen,1.0*((tld * 1000000) >> 32));
-            conn->time_pings[chosen].chosen = 1; // record the fact that it has been used for timing
-
-            conn->local_to_remote_time_difference =
-                rt - lt; // make this the new local-to-remote-time-difference
-            conn->local_to_remote_time_difference_measurement_time = lt; // done at this time.
+            time_ping_add(conn, arrival_time, distant_transmit_time + return_time / 2, return_time);
+            round_trip_time_add(conn, return_time);
 
             if (first_local_to_remote_time_difference == 0) {
               first_local_to_remote_time_difference = conn->local_to_remote_time_difference;
               // first_local_to_remote_time_difference_time = get_absolute_time_in_fp();
             }
-
-            // here, let's try to use the timing pings that were selected because of their short
-            // return times to
-            // estimate a figure for drift between the local clock (x) and the remote clock (y)
-
-            // if we plug in a local interval, we will get back what that is in remote time
-
-            // calculate the line of best fit for relating the local time and the remote time
-            // we will calculate the slope, which is the drift
-            // see https://www.varsitytutors.com/hotmath/hotmath_help/topics/line-of-best-fit
-
-            uint64_t y_bar = 0; // remote timestamp average
-            uint64_t x_bar = 0; // local timestamp average
-            int sample_count = 0;
-
-            // approximate time in seconds to let the system settle down
-            const int settling_time = 60;
-            // number of points to have for calculating a valid drift
-            const int sample_point_minimum = 8;
-            for (cc = 0; cc < conn->time_ping_count; cc++)
-              if ((conn->time_pings[cc].chosen) &&
-                  (conn->time_pings[cc].sequence_number >
-                   (settling_time / 3))) { // wait for a approximate settling time
-                                           // have to scale them down so that the sum, possibly over
-                                           // every term in the array, doesn't overflow
-                y_bar += (conn->time_pings[cc].remote_time >> time_ping_history_power_of_two);
-                x_bar += (conn->time_pings[cc].local_time >> time_ping_history_power_of_two);
-                sample_count++;
-              }
-            conn->local_to_remote_time_gradient_sample_count = sample_count;
-            if (sample_count > sample_point_minimum) {
-              y_bar = y_bar / sample_count;
-              x_bar = x_bar / sample_count;
-
-              int64_t xid, yid;
-              double mtl, mbl;
-              mtl = 0;
-              mbl = 0;
-              for (cc = 0; cc < conn->time_ping_count; cc++)
-                if ((conn->time_pings[cc].chosen) &&
-                    (conn->time_pings[cc].sequence_number > (settling_time / 3))) {
-
-                  uint64_t slt = conn->time_pings[cc].local_time >> time_ping_history_power_of_two;
-                  if (slt > x_bar)
-                    xid = slt - x_bar;
-                  else
-                    xid = -(x_bar - slt);
-
-                  uint64_t srt = conn->time_pings[cc].remote_time >> time_ping_history_power_of_two;
-                  if (srt > y_bar)
-                    yid = srt - y_bar;
-                  else
-                    yid = -(y_bar - srt);
-
-                  mtl = mtl + (1.0 * xid) * yid;
-                  mbl = mbl + (1.0 * xid) * xid;
-                }
-              if (mbl)
-                conn->local_to_remote_time_gradient = mtl / mbl;
-              else {
-                // conn->local_to_remote_time_gradient = 1.0;
-                debug(1, "mbl is zero. Drift remains at %.2f ppm.",
-                      (conn->local_to_remote_time_gradient - 1.0) * 1000000);
-              }
-
-              // scale the numbers back up
-              uint64_t ybf = y_bar << time_ping_history_power_of_two;
-              uint64_t xbf = x_bar << time_ping_history_power_of_two;
-
-              conn->local_to_remote_time_difference =
-                  ybf - xbf; // make this the new local-to-remote-time-difference
-              conn->local_to_remote_time_difference_measurement_time = xbf;
-
-            } else {
-              debug(3, "not enough samples to estimate drift -- remaining at %.2f ppm.",
-                    (conn->local_to_remote_time_gradient - 1.0) * 1000000);
-              // conn->local_to_remote_time_gradient = 1.0;
-            }
             // debug(1,"local to remote time gradient is %12.2f ppm, based on %d
             // samples.",conn->local_to_remote_time_gradient*1000000,sample_count);
 
@@ -837,67 +966,32 @@ void *rtp_timing_receiver(void *arg) {
   pthread_exit(NULL);
 }
 
-static uint16_t bind_port(int ip_family, const char *self_ip_address, uint32_t scope_id,
-                          int *sock) {
-  // look for a port in the range, if any was specified.
-  int ret = 0;
-
-  int local_socket = socket(ip_family, SOCK_DGRAM, IPPROTO_UDP);
-  if (local_socket == -1)
-    die("Could not allocate a socket.");
-
-  /*
-    int val = 1;
-    ret = setsockopt(local_socket, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
-    if (ret < 0) {
-      char errorstring[1024];
-      strerror_r(errno, (char *)errorstring, sizeof(errorstring));
-      debug(1, "Error %d: \"%s\". Couldn't set SO_REUSEADDR");
-    }
-  */
-
+static int bind_to_port(int local_socket, int ip_family, const char *self_ip_address,
+                        uint32_t scope_id, uint16_t desired_port) {
+  int ret = -1;
   SOCKADDR myaddr;
-  int tryCount = 0;
-  uint16_t desired_port;
-  do {
-    tryCount++;
-    desired_port = nextFreeUDPPort();
-    memset(&myaddr, 0, sizeof(myaddr));
-    if (ip_family == AF_INET) {
-      struct sockaddr_in *sa = (struct sockaddr_in *)&myaddr;
-      sa->sin_family = AF_INET;
-      sa->sin_port = ntohs(desired_port);
-      inet_pton(AF_INET, self_ip_address, &(sa->sin_addr));
-      ret = bind(local_socket, (struct sockaddr *)sa, sizeof(struct sockaddr_in));
-    }
+  memset(&myaddr, 0, sizeof(myaddr));
+  if (ip_family == AF_INET) {
+    struct sockaddr_in *sa = (struct sockaddr_in *)&myaddr;
+    sa->sin_family = AF_INET;
+    sa->sin_port = ntohs(desired_port);
+    inet_pton(AF_INET, self_ip_address, &(sa->sin_addr));
+    ret = bind(local_socket, (struct sockaddr *)sa, sizeof(struct sockaddr_in));
+  }
 #ifdef AF_INET6
-    if (ip_family == AF_INET6) {
-      struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *)&myaddr;
-      sa6->sin6_family = AF_INET6;
-      sa6->sin6_port = ntohs(desired_port);
-      inet_pton(AF_INET6, self_ip_address, &(sa6->sin6_addr));
-      sa6->sin6_scope_id = scope_id;
-      ret = bind(local_socket, (struct sockaddr *)sa6, sizeof(struct sockaddr_in6));
-    }
-#endif
-
-  } while ((ret < 0) && (errno == EADDRINUSE) && (desired_port != 0) &&
-           (tryCount < config.udp_port_range));
-
-  // debug(1,"UDP port chosen: %d.",desired_port);
-
-  if (ret < 0) {
-    close(local_socket);
-    char errorstring[1024];
-    strerror_r(errno, (char *)errorstring, sizeof(errorstring));
-    die("error %d: \"%s\". Could not bind a UDP port! Check the udp_port_range is large enough -- "
-        "it must be "
-        "at least 3, and 10 or more is suggested -- or "
-        "check for restrictive firewall settings or a bad router! UDP base is %u, range is %u and "
-        "current suggestion is %u.",
-        errno, errorstring, config.udp_port_base, config.udp_port_range, desired_port);
+  if (ip_family == AF_INET6) {
+    struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *)&myaddr;
+    sa6->sin6_family = AF_INET6;
+    sa6->sin6_port = ntohs(desired_port);
+    inet_pton(AF_INET6, self_ip_address, &(sa6->sin6_addr));
+    sa6->sin6_scope_id = scope_id;
+    ret = bind(local_socket, (struct sockaddr *)sa6, sizeof(struct sockaddr_in6));
   }
+#endif
+  return ret;
+}
 
+static uint16_t socket_port(int local_socket) {
   uint16_t sport;
   SOCKADDR local;
   socklen_t local_len = sizeof(local);
@@ -912,10 +1006,140 @@ static uint16_t bind_port(int ip_family, const char *self_ip_address, uint32_t s
     struct sockaddr_in *sa = (struct sockaddr_in *)&local;
     sport = ntohs(sa->sin_port);
   }
-  *sock = local_socket;
   return sport;
 }
 
+// Open the control, timing and audio sockets and bind them to free ports in the UDP port range,
+// in a single pass through it -- each port tried goes to the next socket still to be bound.
+static void open_rtp_sockets(rtsp_conn_info *conn) {
+  int *sockets[3] = {&conn->control_socket, &conn->timing_socket, &conn->audio_socket};
+  uint16_t *ports[3] = {&conn->local_control_port, &conn->local_timing_port,
+                        &conn->local_audio_port};
+  int i;
+  for (i = 0; i < 3; i++) {
+    *sockets[i] = socket(conn->connection_ip_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (*sockets[i] == -1)
+      die("Could not allocate a socket.");
+  }
+
+  int sockets_bound = 0;
+  int tryCount = 0;
+  int ret = 0;
+  uint16_t desired_port = 0;
+  while ((sockets_bound < 3) && (tryCount < config.udp_port_range)) {
+    tryCount++;
+    desired_port = nextFreeUDPPort();
+    ret = bind_to_port(*sockets[sockets_bound], conn->connection_ip_family, conn->self_ip_string,
+                       conn->self_scope_id, desired_port);
+    if (ret == 0)
+      sockets_bound++;
+    else if (errno != EADDRINUSE)
+      break;
+  }
+
+  if (sockets_bound < 3) {
+    char errorstring[1024];
+    strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+    for (i = 0; i < 3; i++)
+      close(*sockets[i]);
+    die("error %d: \"%s\". Could not bind a UDP port! Check the udp_port_range is large enough -- "
+        "it must be "
+        "at least 3, and 10 or more is suggested -- or "
+        "check for restrictive firewall settings or a bad router! UDP base is %u, range is %u and "
+        "current suggestion is %u.",
+        errno, errorstring, config.udp_port_base, config.udp_port_range, desired_port);
+  }
+
+  for (i = 0; i < 3; i++) {
+    *ports[i] = socket_port(*sockets[i]);
+    udp_receive_enable_timestamps(*sockets[i]);
+  }
+}
+
+// Mark the resend and timing requests, sent from the control and timing sockets, with the DSCP
+// of the udp_request_dscp setting, so that a network's QoS policy can give them priority, and let
+// the local queueing discipline know too, where that's possible.
+static void mark_request_socket(int local_socket, int ip_family) {
+  if (config.udp_request_dscp < 0)
+    return;
+  int traffic_class = config.udp_request_dscp << 2; // the DSCP is the top six bits
+  int ret = -1;
+  if (ip_family == AF_INET)
+    ret = setsockopt(local_socket, IPPROTO_IP, IP_TOS, &traffic_class, sizeof(traffic_class));
+#if defined(AF_INET6) && defined(IPV6_TCLASS)
+  if (ip_family == AF_INET6)
+    ret = setsockopt(local_socket, IPPROTO_IPV6, IPV6_TCLASS, &traffic_class,
+                     sizeof(traffic_class));
+#endif
+  if (ret < 0)
+    debug(1, "Error %d setting the DSCP of an RTP socket to %d.", errno, config.udp_request_dscp);
+#ifdef SO_PRIORITY
+  // the class selector, but no higher than 6, as 7 needs special privileges
+  int priority = config.udp_request_dscp >> 3;
+  if (priority > 6)
+    priority = 6;
+  if (setsockopt(local_socket, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(priority)) < 0)
+    debug(1, "Error %d setting the priority of an RTP socket to %d.", errno, priority);
+#endif
+}
+
+// the receive buffer given to the audio and control sockets can hold this much for each packet,
+// what the kernel takes to keep a full-sized datagram
+#define RTP_RECEIVE_BUFFER_BYTES_PER_PACKET 2048
+
+// Size the receive buffers of the audio and control sockets to hold the session's latency of
+// packets, or as set by the udp_receive_buffer_size_in_kilobytes setting, so that a burst of
+// resent packets isn't dropped before the receiver threads can take it. They are only ever made
+// bigger than the system's default, and the system may limit them.
+static void rtp_set_receive_buffer_sizes(rtsp_conn_info *conn) {
+  if ((config.udp_receive_buffer_size == 0) || (conn->rtp_running == 0))
+    return;
+  int size = config.udp_receive_buffer_size;
+  if (size < 0) {
+    uint32_t latency = conn->latency ? conn->latency : 88200;
+    uint32_t frames_per_packet = conn->max_frames_per_packet ? conn->max_frames_per_packet : 352;
+    size = ((latency + 11025) / frames_per_packet + 1) * RTP_RECEIVE_BUFFER_BYTES_PER_PACKET;
+  }
+  int sockets[2] = {conn->audio_socket, conn->control_socket};
+  int i;
+  for (i = 0; i < 2; i++) {
+    int current_size = 0;
+    socklen_t option_length = sizeof(current_size);
+    if ((getsockopt(sockets[i], SOL_SOCKET, SO_RCVBUF, &current_size, &option_length) == 0) &&
+        (current_size >= size))
+      continue;
+    if (setsockopt(sockets[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+      debug(1, "Error %d setting the receive buffer of an RTP socket to %d bytes.", errno, size);
+    } else {
+      option_length = sizeof(current_size);
+      if ((getsockopt(sockets[i], SOL_SOCKET, SO_RCVBUF, &current_size, &option_length) == 0) &&
+          (current_size < size))
+        debug(1,
+              "The receive buffer of an RTP socket is limited to %d bytes rather than %d -- "
+              "the system's limit (e.g. net.core.rmem_max) may need to be raised.",
+              current_size, size);
+      else
+        debug(2, "The receive buffer of an RTP socket is %d bytes.", current_size);
+    }
+  }
+}
+
+static void tune_rtp_sockets(rtsp_conn_info *conn) {
+  mark_request_socket(conn->control_socket, conn->connection_ip_family);
+  mark_request_socket(conn->timing_socket, conn->connection_ip_family);
+  if (config.udp_busy_poll_time) {
+#ifdef SO_BUSY_POLL
+    // spin waiting for audio packets for a while rather than sleeping, trading processor time
+    // for their latency
+    if (setsockopt(conn->audio_socket, SOL_SOCKET, SO_BUSY_POLL, &config.udp_busy_poll_time,
+                   sizeof(config.udp_busy_poll_time)) < 0)
+      debug(1, "Error %d setting busy polling on the audio socket.", errno);
+#else
+    debug(1, "Busy polling of the audio socket is not available on this system.");
+#endif
+  }
+}
+
 void rtp_setup(SOCKADDR *local, SOCKADDR *remote, uint16_t cport, uint16_t tport,
                rtsp_conn_info *conn) {
 
@@ -1015,20 +1239,18 @@ void rtp_setup(SOCKADDR *local, SOCKADDR *remote, uint16_t cport, uint16_t tport
     conn->remote_control_port = cport;
     conn->remote_timing_port = tport;
 
-    conn->local_control_port = bind_port(conn->connection_ip_family, conn->self_ip_string,
-                                         conn->self_scope_id, &conn->control_socket);
-    conn->local_timing_port = bind_port(conn->connection_ip_family, conn->self_ip_string,
-                                        conn->self_scope_id, &conn->timing_socket);
-    conn->local_audio_port = bind_port(conn->connection_ip_family, conn->self_ip_string,
-                                       conn->self_scope_id, &conn->audio_socket);
+    open_rtp_sockets(conn);
+    tune_rtp_sockets(conn);
 
     debug(3, "listening for audio, control and timing on ports %d, %d, %d.", conn->local_audio_port,
           conn->local_control_port, conn->local_timing_port);
 
-    conn->reference_timestamp = 0;
+    clear_reference_timestamp(conn);
 
     conn->request_sent = 0;
     conn->rtp_running = 1;
+    rtp_set_receive_buffer_sizes(conn);
+    packet_capture_start(conn);
 
 #ifdef CONFIG_METADATA
     send_ssnc_metadata('clip', conn->client_ip_string, strlen(conn->client_ip_string), 1);
@@ -1040,18 +1262,18 @@ void rtp_setup(SOCKADDR *local, SOCKADDR *remote, uint16_t cport, uint16_t tport
 void get_reference_timestamp_stuff(uint32_t *timestamp, uint64_t *timestamp_time,
                                    uint64_t *remote_timestamp_time, rtsp_conn_info *conn) {
   // types okay
-  debug_mutex_lock(&conn->reference_time_mutex, 1000, 0);
-  *timestamp = conn->reference_timestamp;
-  *remote_timestamp_time = conn->remote_reference_timestamp_time;
-  *timestamp_time =
-      conn->remote_reference_timestamp_time - local_to_remote_time_difference_now(conn);
-  debug_mutex_unlock(&conn->reference_time_mutex, 0);
+  timestamp_conversion c;
+  get_timestamp_conversion(conn, &c);
+  *timestamp = c.reference_timestamp;
+  *remote_timestamp_time = c.remote_reference_timestamp_time;
+  *timestamp_time = c.remote_reference_timestamp_time - local_to_remote_time_difference_now(conn);
 }
 
 void clear_reference_timestamp(rtsp_conn_info *conn) {
   debug_mutex_lock(&conn->reference_time_mutex, 1000, 1);
   conn->reference_timestamp = 0;
   conn->remote_reference_timestamp_time = 0;
+  publish_timestamp_conversion(conn);
   debug_mutex_unlock(&conn->reference_time_mutex, 3);
 }
 
@@ -1101,50 +1323,100 @@ int sanitised_source_rate_information(uint32_t *frames, uint64_t *time, rtsp_con
 // the timestamp is a timestamp calculated at the input rate
 // the reference timestamps are denominated in terms of the input rate
 
-int frame_to_local_time(uint32_t timestamp, uint64_t *time, rtsp_conn_info *conn) {
-  debug_mutex_lock(&conn->reference_time_mutex, 1000, 0);
-  int result = 0;
-  uint64_t time_difference;
-  uint32_t frame_difference;
-  result = sanitised_source_rate_information(&frame_difference, &time_difference, conn);
+// numerator / denominator with the number of fractional bits given, by long division, so that the
+// rates are exactly as sanitised_source_rate_information's integers give them
+static uint64_t fixed_point_ratio(uint64_t numerator, uint64_t denominator, int fraction_bits) {
+  uint64_t result = numerator / denominator;
+  uint64_t remainder = numerator % denominator;
+  int i;
+  for (i = 0; i < fraction_bits; i++) {
+    remainder = remainder << 1;
+    result = result << 1;
+    if (remainder >= denominator) {
+      remainder -= denominator;
+      result |= 1;
+    }
+  }
+  return result;
+}
+
+// Take the current state of the reference timestamp into the timestamp conversion.
+// The caller must hold the reference_time_mutex, which keeps other writers out.
+static void publish_timestamp_conversion(rtsp_conn_info *conn) {
+  timestamp_conversion *t = &conn->timestamp_conversion;
+  uint32_t frames;
+  uint64_t time;
+  int rate_is_nominal = sanitised_source_rate_information(&frames, &time, conn);
+  uint32_t sequence = t->sequence + 1;
+  __atomic_store_n(&t->sequence, sequence, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  t->rate_is_nominal = rate_is_nominal;
+  t->reference_timestamp = conn->reference_timestamp;
+  t->remote_reference_timestamp_time = conn->remote_reference_timestamp_time;
+  if ((frames != 0) && (time != 0)) {
+    t->ns_per_frame = fixed_point_ratio(time, frames, TIMESTAMP_CONVERSION_NS_PER_FRAME_BITS);
+    t->frames_per_ns = fixed_point_ratio(frames, time, TIMESTAMP_CONVERSION_FRAMES_PER_NS_BITS);
+  } else {
+    t->ns_per_frame = 0;
+    t->frames_per_ns = 0;
+  }
+  __atomic_store_n(&t->sequence, sequence + 1, __ATOMIC_RELEASE);
+}
+
+// Get a consistent copy of the timestamp conversion without any lock, trying again if it was
+// being rewritten at the time.
+static void get_timestamp_conversion(rtsp_conn_info *conn, timestamp_conversion *c) {
+  timestamp_conversion *t = &conn->timestamp_conversion;
+  uint32_t sequence;
+  do {
+    sequence = __atomic_load_n(&t->sequence, __ATOMIC_ACQUIRE);
+    *c = *t;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (((sequence & 1) != 0) ||
+           (sequence != __atomic_load_n(&t->sequence, __ATOMIC_RELAXED)));
+}
+
+// frames * ns_per_frame, in two multiplies -- exact to within a nanosecond
+static uint64_t frames_to_ns(uint32_t frames, uint64_t ns_per_frame) {
+  return frames * (ns_per_frame >> TIMESTAMP_CONVERSION_NS_PER_FRAME_BITS) +
+         ((frames * (ns_per_frame & 0xFFFFFFFF)) >> TIMESTAMP_CONVERSION_NS_PER_FRAME_BITS);
+}
+
+// ns * frames_per_ns, kept within 64 bits by splitting ns at bit 21. It's good for up to 2^42 ns,
+// about 73 minutes, which is more than the hour that the conversions look either side of the
+// reference, and intervals outside that are clamped.
+static uint32_t ns_to_frames(uint64_t ns, uint64_t frames_per_ns) {
+  if (ns >= ((uint64_t)1 << 42))
+    ns = ((uint64_t)1 << 42) - 1;
+  uint64_t high = ns >> 21;
+  uint64_t low = ns & ((1 << 21) - 1);
+  return (high * frames_per_ns + ((low * frames_per_ns) >> 21)) >>
+         (TIMESTAMP_CONVERSION_FRAMES_PER_NS_BITS - 21);
+}
 
-  uint64_t timestamp_interval_time;
+int frame_to_local_time(uint32_t timestamp, uint64_t *time, rtsp_conn_info *conn) {
+  timestamp_conversion c;
+  get_timestamp_conversion(conn, &c);
   uint64_t remote_time_of_timestamp;
-  uint32_t timestamp_interval = modulo_32_offset(conn->reference_timestamp, timestamp);
+  uint32_t timestamp_interval = modulo_32_offset(c.reference_timestamp, timestamp);
   if (timestamp_interval <=
       conn->input_rate * 3600) { // i.e. timestamp was really after the reference timestamp
-    timestamp_interval_time = (timestamp_interval * time_difference) /
-                              frame_difference; // this is the nominal time, based on the
-                                                // fps specified between current and
-                                                // previous sync frame.
-    remote_time_of_timestamp = conn->remote_reference_timestamp_time +
-                               timestamp_interval_time; // based on the reference timestamp time
-                                                        // plus the time interval calculated based
-                                                        // on the specified fps.
+    // the nominal time, based on the rate between the current and the initial sync packets
+    remote_time_of_timestamp =
+        c.remote_reference_timestamp_time + frames_to_ns(timestamp_interval, c.ns_per_frame);
   } else { // i.e. timestamp was actually before the reference timestamp
     timestamp_interval =
-        modulo_32_offset(timestamp, conn->reference_timestamp); // fix the calculation
-    timestamp_interval_time = (timestamp_interval * time_difference) /
-                              frame_difference; // this is the nominal time, based on the
-                                                // fps specified between current and
-                                                // previous sync frame.
-    remote_time_of_timestamp = conn->remote_reference_timestamp_time -
-                               timestamp_interval_time; // based on the reference timestamp time
-                                                        // plus the time interval calculated based
-                                                        // on the specified fps.
+        modulo_32_offset(timestamp, c.reference_timestamp); // fix the calculation
+    remote_time_of_timestamp =
+        c.remote_reference_timestamp_time - frames_to_ns(timestamp_interval, c.ns_per_frame);
   }
   *time = remote_time_of_timestamp - local_to_remote_time_difference_now(conn);
-  debug_mutex_unlock(&conn->reference_time_mutex, 0);
-  return result;
+  return c.rate_is_nominal;
 }
 
 int local_time_to_frame(uint64_t time, uint32_t *frame, rtsp_conn_info *conn) {
-  debug_mutex_lock(&conn->reference_time_mutex, 1000, 0);
-  int result = 0;
-
-  uint64_t time_difference;
-  uint32_t frame_difference;
-  result = sanitised_source_rate_information(&frame_difference, &time_difference, conn);
+  timestamp_conversion c;
+  get_timestamp_conversion(conn, &c);
 
   // first, get from [local] time to remote time.
   uint64_t remote_time = time + local_to_remote_time_difference_now(conn);
@@ -1152,34 +1424,30 @@ int local_time_to_frame(uint64_t time, uint32_t *frame, rtsp_conn_info *conn) {
   uint64_t time_interval;
 
   // here, we calculate the time interval, in terms of remote time
-  uint64_t offset = modulo_64_offset(conn->remote_reference_timestamp_time, remote_time);
+  uint64_t offset = modulo_64_offset(c.remote_reference_timestamp_time, remote_time);
   int reference_time_was_earlier = (offset <= (uint64_t)3600000000000);
   if (reference_time_was_earlier) // if we haven't had a reference within the last hour, it'll be
                                   // taken as afterwards
-    time_interval = remote_time - conn->remote_reference_timestamp_time;
+    time_interval = remote_time - c.remote_reference_timestamp_time;
   else
-    time_interval = conn->remote_reference_timestamp_time - remote_time;
+    time_interval = c.remote_reference_timestamp_time - remote_time;
 
   // now, convert the remote time interval into frames using the frame rate we have observed or
-  // which has been nominated
-  uint32_t frame_interval = 0;
-  if (time_difference)
-    frame_interval = (time_interval * frame_difference) / time_difference;
+  // which has been nominated -- the RTP timestamps wrap modulo 2^32, as this arithmetic does
+  uint32_t frame_interval = ns_to_frames(time_interval, c.frames_per_ns);
+  if (reference_time_was_earlier)
+    *frame = c.reference_timestamp + frame_interval;
   else
-    debug(1, "local_time_to_frame: time_difference is zero");
-  if (reference_time_was_earlier) {
-    // debug(1,"Frame interval is %" PRId64 " frames.",frame_interval);
-    *frame = (conn->reference_timestamp + frame_interval);
-  } else {
-    // debug(1,"Frame interval is %" PRId64 " frames.",-frame_interval);
-    *frame = (conn->reference_timestamp - frame_interval);
-  }
-  debug_mutex_unlock(&conn->reference_time_mutex, 0);
-  return result;
+    *frame = c.reference_timestamp - frame_interval;
+  return c.rate_is_nominal;
 }
 
 void rtp_request_resend(seq_t first, uint32_t count, rtsp_conn_info *conn) {
-  if (conn->rtp_running) {
+  if (conn->packet_replay) {
+    debug(3, "Replay: resend request for %u packets starting at %u not sent -- any resent packets "
+             "are in the capture.",
+          count, first);
+  } else if (conn->rtp_running) {
     // if (!request_sent) {
     // debug(2, "requesting resend of %d packets starting at %u.", count, first);
     //  request_sent = 1;
@@ -16,6 +16,8 @@ void rtp_setup(SOCKADDR *local, SOCKADDR *remote, uint16_t controlport, uint16_t
                rtsp_conn_info *conn);
 void rtp_request_resend(seq_t first, uint32_t count, rtsp_conn_info *conn);
 void rtp_request_client_pause(rtsp_conn_info *conn); // ask the client to pause
+// wake the timing sender to make a quick succession of timing requests, e.g. when audio resumes
+void rtp_request_timing_burst(rtsp_conn_info *conn);
 
 void get_reference_timestamp_stuff(uint32_t *timestamp, uint64_t *timestamp_time,
                                    uint64_t *remote_timestamp_time, rtsp_conn_info *conn);
@@ -28,6 +28,7 @@
  */
 
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <memory.h>
@@ -42,6 +43,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "config.h"
@@ -60,7 +62,10 @@
 #endif
 
 #include "common.h"
+#include "metadata_multicast.h"
+#include "packet_capture.h"
 #include "player.h"
+#include "realtime.h"
 #include "rtp.h"
 #include "rtsp.h"
 
@@ -78,7 +83,6 @@
 #define INETx_ADDRSTRLEN INET_ADDRSTRLEN
 #endif
 
-#define METADATA_SNDBUF (4 * 1024 * 1024)
 
 enum rtsp_read_request_response {
   rtsp_read_request_response_ok,
@@ -96,6 +100,8 @@ int metadata_running = 0;
 
 // always lock use this when accessing the playing conn value
 static pthread_mutex_t playing_conn_lock = PTHREAD_MUTEX_INITIALIZER;
+// broadcast whenever playing_conn is let go, for ANNOUNCEs waiting to take it
+static pthread_cond_t playing_conn_released = PTHREAD_COND_INITIALIZER;
 
 // every time we want to retain or release a reference count, lock it with this
 // if a reference count is read as zero, it means the it's being deallocated.
@@ -109,29 +115,35 @@ static pthread_mutex_t reference_counter_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int RTSP_connection_index = 1;
 
-#ifdef CONFIG_METADATA
-typedef struct {
-  pthread_mutex_t pc_queue_lock;
-  pthread_cond_t pc_queue_item_added_signal;
-  pthread_cond_t pc_queue_item_removed_signal;
-  char *name;
-  size_t item_size;  // number of bytes in each item
-  uint32_t count;    // number of items in the queue
-  uint32_t capacity; // maximum number of items
-  uint32_t toq;      // first item to take
-  uint32_t eoq;      // free space at end of queue
-  void *items;       // a pointer to where the items are actually stored
-} pc_queue;          // producer-consumer queue
-#endif
-
 static int msg_indexes = 1;
 
+enum rtsp_known_header {
+  rtsp_header_active_remote,
+  rtsp_header_apple_challenge,
+  rtsp_header_authorization,
+  rtsp_header_cseq,
+  rtsp_header_content_length,
+  rtsp_header_content_type,
+  rtsp_header_dacp_id,
+  rtsp_header_rtp_info,
+  rtsp_header_transport,
+  rtsp_header_user_agent,
+  rtsp_header_x_apple_client_name,
+  rtsp_known_header_count
+};
+
 typedef struct {
   int index_number;
   uint32_t referenceCount; // we might start using this...
   unsigned int nheaders;
   char *name[16];
   char *value[16];
+  // The headers of a request are parsed in place in a copy of them, and the names and values
+  // point into it. The names and values of the headers of a response are either allocated or, if
+  // they are constant, just pointed to.
+  char *header_block;
+  uint16_t borrowed_headers; // a bit is set for each header whose name and value weren't allocated
+  signed char known_header[rtsp_known_header_count]; // one more than its index, or zero if absent
 
   int contentlength;
   char *content;
@@ -152,149 +164,172 @@ typedef struct {
   rtsp_message *carrier;
 } metadata_package;
 
-void pc_queue_init(pc_queue *the_queue, char *items, size_t item_size, uint32_t number_of_items,
-                   const char *name) {
-  if (name)
-    debug(2, "Creating metadata queue \"%s\".", name);
-  else
-    debug(1, "Creating an unnamed metadata queue.");
-  pthread_mutex_init(&the_queue->pc_queue_lock, NULL);
-  pthread_cond_init(&the_queue->pc_queue_item_added_signal, NULL);
-  pthread_cond_init(&the_queue->pc_queue_item_removed_signal, NULL);
-  the_queue->item_size = item_size;
-  the_queue->items = items;
-  the_queue->count = 0;
-  the_queue->capacity = number_of_items;
-  the_queue->toq = 0;
-  the_queue->eoq = 0;
-  if (name == NULL)
-    the_queue->name = NULL;
-  else
-    the_queue->name = strdup(name);
-}
+// Metadata is passed to the pipe, multicast, hub and MQTT threads through a single ring.
+// Each item is stored once and each thread reads every item with a cursor of its own; the last
+// thread to finish with an item releases it and frees the slot.
+// Adding an item never waits for a reader: a producer claims a slot with a compare-and-swap and,
+// if the slowest reader is still a whole ring behind, drops the item instead.
+// The only lock is the one the readers sleep on, and it's never held while an item is processed.
 
-void pc_queue_delete(pc_queue *the_queue) {
-  if (the_queue->name)
-    debug(2, "Deleting metadata queue \"%s\".", the_queue->name);
-  else
-    debug(1, "Deleting an unnamed metadata queue.");
-  if (the_queue->name != NULL)
-    free(the_queue->name);
-  // debug(2, "destroying pc_queue_item_removed_signal");
-  pthread_cond_destroy(&the_queue->pc_queue_item_removed_signal);
-  // debug(2, "destroying pc_queue_item_added_signal");
-  pthread_cond_destroy(&the_queue->pc_queue_item_added_signal);
-  // debug(2, "destroying pc_queue_lock");
-  pthread_mutex_destroy(&the_queue->pc_queue_lock);
-  // debug(2, "destroying signals and locks done");
+#define metadata_ring_size 512 // must be a power of two
+#define low_memory_metadata_ring_size 64
+
+typedef struct {
+  // the position in the ring the slot is free to be filled at or, once filled, that position + 1
+  uint32_t sequence;
+  uint32_t readers; // the number of readers yet to finish with the item
+  metadata_package pack;
+} metadata_ring_slot;
+
+typedef struct {
+  uint32_t head;      // the next position to be filled
+  int reader_count;   // no items are taken until this is set
+  pthread_mutex_t wakeup_lock;
+  pthread_cond_t item_added;
+  uint32_t size; // a power of two
+  metadata_ring_slot *slots;
+} metadata_ring;
+
+typedef struct {
+  const char *name;
+  uint32_t cursor; // the position of the next item to read
+} metadata_ring_reader;
+
+static metadata_ring metadata_items = {.wakeup_lock = PTHREAD_MUTEX_INITIALIZER,
+                                       .item_added = PTHREAD_COND_INITIALIZER};
+
+static void metadata_ring_init(void) {
+#ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
+  // so that metadata_ring_wait_until() can wait until a time on the same clock as
+  // get_absolute_time_in_ns()
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&metadata_items.item_added, &attr);
+  pthread_condattr_destroy(&attr);
+#endif
+  // in low memory mode, fewer items -- and their data -- can be waiting
+  metadata_items.size = config.low_memory ? low_memory_metadata_ring_size : metadata_ring_size;
+  metadata_items.slots = calloc(metadata_items.size, sizeof(metadata_ring_slot));
+  if (metadata_items.slots == NULL)
+    die("Could not allocate memory for the metadata ring.");
+  uint32_t i;
+  for (i = 0; i < metadata_items.size; i++)
+    metadata_items.slots[i].sequence = i;
+  metadata_items.head = 0;
+  metadata_items.reader_count = 0;
+}
+
+// returns 0 if the item has been added, EWOULDBLOCK if the ring is full or -1 if there is no
+// reader
+static int metadata_ring_add(metadata_package *pack) {
+  int reader_count = __atomic_load_n(&metadata_items.reader_count, __ATOMIC_ACQUIRE);
+  if (reader_count == 0)
+    return -1;
+  metadata_ring_slot *slot;
+  uint32_t position = __atomic_load_n(&metadata_items.head, __ATOMIC_RELAXED);
+  while (1) {
+    slot = &metadata_items.slots[position & (metadata_items.size - 1)];
+    int32_t difference =
+        (int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+    if (difference == 0) {
+      if (__atomic_compare_exchange_n(&metadata_items.head, &position, position + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break; // the slot is ours
+      // otherwise position has been updated to the current head
+    } else if (difference < 0) {
+      return EWOULDBLOCK; // the slowest reader hasn't finished with the item in it yet
+    } else {
+      position = __atomic_load_n(&metadata_items.head, __ATOMIC_RELAXED);
+    }
+  }
+  slot->pack = *pack;
+  slot->readers = reader_count;
+  __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+  // a reader checks for its item while holding this lock before waiting, so the wakeup can't be
+  // lost
+  pthread_mutex_lock(&metadata_items.wakeup_lock);
+  pthread_cond_broadcast(&metadata_items.item_added);
+  pthread_mutex_unlock(&metadata_items.wakeup_lock);
+  return 0;
 }
 
-int send_metadata(uint32_t type, uint32_t code, char *data, uint32_t length, rtsp_message *carrier,
-                  int block);
+// returns 1 if the reader's next item is ready
+static int metadata_ring_ready(metadata_ring_reader *reader) {
+  metadata_ring_slot *slot = &metadata_items.slots[reader->cursor & (metadata_items.size - 1)];
+  return (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == reader->cursor + 1);
+}
 
-int send_ssnc_metadata(uint32_t code, char *data, uint32_t length, int block) {
-  return send_metadata('ssnc', code, data, length, NULL, block);
+static void metadata_ring_wait_cleanup_handler(__attribute__((unused)) void *arg) {
+  pthread_mutex_unlock(&metadata_items.wakeup_lock);
 }
 
-void pc_queue_cleanup_handler(void *arg) {
-  // debug(1, "pc_queue_cleanup_handler called.");
-  pc_queue *the_queue = (pc_queue *)arg;
-  int rc = pthread_mutex_unlock(&the_queue->pc_queue_lock);
-  if (rc)
-    debug(1, "Error unlocking for pc_queue_add_item or pc_queue_get_item.");
+// wait for the reader's next item
+static metadata_package *metadata_ring_wait(metadata_ring_reader *reader) {
+  metadata_ring_slot *slot = &metadata_items.slots[reader->cursor & (metadata_items.size - 1)];
+  if (metadata_ring_ready(reader) == 0) {
+    pthread_mutex_lock(&metadata_items.wakeup_lock);
+    pthread_cleanup_push(metadata_ring_wait_cleanup_handler, NULL);
+    while (metadata_ring_ready(reader) == 0)
+      pthread_cond_wait(&metadata_items.item_added, &metadata_items.wakeup_lock);
+    pthread_cleanup_pop(1);
+  }
+  return &slot->pack;
 }
 
-int pc_queue_add_item(pc_queue *the_queue, const void *the_stuff, int block) {
-  int response = 0;
-  int rc;
-  if (the_queue) {
-    if (block == 0) {
-      rc = debug_mutex_lock(&the_queue->pc_queue_lock, 10000, 2);
-      if (rc == EBUSY)
-        return EBUSY;
-    } else
-      rc = pthread_mutex_lock(&the_queue->pc_queue_lock);
-    if (rc)
-      debug(1, "Error locking for pc_queue_add_item");
-    pthread_cleanup_push(pc_queue_cleanup_handler, (void *)the_queue);
-    // leave this out if you want this to return if the queue is already full
-    // irrespective of the block flag.
-    /*
-                while (the_queue->count == the_queue->capacity) {
-                        rc = pthread_cond_wait(&the_queue->pc_queue_item_removed_signal,
-       &the_queue->pc_queue_lock); if (rc) debug(1, "Error waiting for item to be removed");
-                }
-                */
-    if (the_queue->count < the_queue->capacity) {
-      uint32_t i = the_queue->eoq;
-      void *p = the_queue->items + the_queue->item_size * i;
-      //    void * p = &the_queue->qbase + the_queue->item_size*the_queue->eoq;
-      memcpy(p, the_stuff, the_queue->item_size);
-
-      // update the pointer
-      i++;
-      if (i == the_queue->capacity)
-        // fold pointer if necessary
-        i = 0;
-      the_queue->eoq = i;
-      the_queue->count++;
-      // debug(2,"metadata queue+ \"%s\" %d/%d.", the_queue->name, the_queue->count,
-      // the_queue->capacity);
-      if (the_queue->count == the_queue->capacity)
-        debug(3, "metadata queue \"%s\": is now full with %d items in it!", the_queue->name,
-              the_queue->count);
-      rc = pthread_cond_signal(&the_queue->pc_queue_item_added_signal);
-      if (rc)
-        debug(1, "metadata queue \"%s\": error signalling after pc_queue_add_item",
-              the_queue->name);
-    } else {
-      response = EWOULDBLOCK; // a bit arbitrary, this.
-      debug(3,
-            "metadata queue \"%s\": is already full with %d items in it. Not adding this item to "
-            "the queue.",
-            the_queue->name, the_queue->count);
+// wait for the reader's next item until the time given -- returns NULL if it hasn't arrived
+static metadata_package *metadata_ring_wait_until(metadata_ring_reader *reader, uint64_t time_ns) {
+  metadata_ring_slot *slot = &metadata_items.slots[reader->cursor & (metadata_items.size - 1)];
+  if (metadata_ring_ready(reader) == 0) {
+#ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
+    struct timespec time_of_wakeup;
+    absolute_time_to_timespec(time_ns, &time_of_wakeup);
+#endif
+#ifdef COMPILE_FOR_OSX
+    uint64_t time_now_ns = get_absolute_time_in_ns();
+    uint64_t timeout_ns = time_ns > time_now_ns ? time_ns - time_now_ns : 0;
+    struct timespec time_to_wait;
+    time_to_wait.tv_sec = timeout_ns / 1000000000;
+    time_to_wait.tv_nsec = timeout_ns % 1000000000;
+#endif
+    int rc = 0;
+    pthread_mutex_lock(&metadata_items.wakeup_lock);
+    pthread_cleanup_push(metadata_ring_wait_cleanup_handler, NULL);
+    while ((metadata_ring_ready(reader) == 0) && (rc != ETIMEDOUT)) {
+#ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
+      rc = pthread_cond_timedwait(&metadata_items.item_added, &metadata_items.wakeup_lock,
+                                  &time_of_wakeup);
+#endif
+#ifdef COMPILE_FOR_OSX
+      rc = pthread_cond_timedwait_relative_np(&metadata_items.item_added,
+                                              &metadata_items.wakeup_lock, &time_to_wait);
+#endif
     }
-    pthread_cleanup_pop(1); // unlock the queue lock.
-  } else {
-    debug(1, "Adding an item to a NULL queue");
+    pthread_cleanup_pop(1);
+    if (metadata_ring_ready(reader) == 0)
+      return NULL;
   }
-  return response;
+  return &slot->pack;
 }
 
-int pc_queue_get_item(pc_queue *the_queue, void *the_stuff) {
-  int rc;
-  if (the_queue) {
-    rc = pthread_mutex_lock(&the_queue->pc_queue_lock);
-    if (rc)
-      debug(1, "metadata queue \"%s\": error locking for pc_queue_get_item", the_queue->name);
-    pthread_cleanup_push(pc_queue_cleanup_handler, (void *)the_queue);
-    while (the_queue->count == 0) {
-      rc = pthread_cond_wait(&the_queue->pc_queue_item_added_signal, &the_queue->pc_queue_lock);
-      if (rc)
-        debug(1, "metadata queue \"%s\": error waiting for item to be added", the_queue->name);
-    }
-    uint32_t i = the_queue->toq;
-    //    void * p = &the_queue->qbase + the_queue->item_size*the_queue->toq;
-    void *p = the_queue->items + the_queue->item_size * i;
-    memcpy(the_stuff, p, the_queue->item_size);
-
-    // update the pointer
-    i++;
-    if (i == the_queue->capacity)
-      // fold pointer if necessary
-      i = 0;
-    the_queue->toq = i;
-    the_queue->count--;
-    debug(3, "metadata queue- \"%s\" %d/%d.", the_queue->name, the_queue->count,
-          the_queue->capacity);
-    rc = pthread_cond_signal(&the_queue->pc_queue_item_removed_signal);
-    if (rc)
-      debug(1, "metadata queue \"%s\": error signalling after pc_queue_get_item", the_queue->name);
-    pthread_cleanup_pop(1); // unlock the queue lock.
-  } else {
-    debug(1, "Removing an item from a NULL queue");
+void metadata_pack_cleanup_function(void *arg);
+
+// to be called when the reader has finished with its item -- it moves the reader on
+static void metadata_ring_release(void *arg) {
+  metadata_ring_reader *reader = (metadata_ring_reader *)arg;
+  metadata_ring_slot *slot = &metadata_items.slots[reader->cursor & (metadata_items.size - 1)];
+  if (__atomic_sub_fetch(&slot->readers, 1, __ATOMIC_ACQ_REL) == 0) {
+    metadata_pack_cleanup_function(&slot->pack);
+    __atomic_store_n(&slot->sequence, reader->cursor + metadata_items.size, __ATOMIC_RELEASE);
   }
-  return 0;
+  reader->cursor++;
+}
+
+int send_metadata(uint32_t type, uint32_t code, char *data, uint32_t length, rtsp_message *carrier,
+                  int block);
+
+int send_ssnc_metadata(uint32_t code, char *data, uint32_t length, int block) {
+  return send_metadata('ssnc', code, data, length, NULL, block);
 }
 
 #endif
@@ -314,6 +349,7 @@ void player_watchdog_thread_cleanup_handler(void *arg) {
 }
 
 void *player_watchdog_thread_code(void *arg) {
+  thread_set_name("player-watchdog");
   pthread_cleanup_push(player_watchdog_thread_cleanup_handler, arg);
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
   do {
@@ -466,35 +502,103 @@ void msg_retain(rtsp_message *msg) {
   }
 }
 
+// The headers that are looked for are found through a perfect hash of their length and second
+// character, which picks the only one of them that a name could be.
+static const char *rtsp_known_header_names[rtsp_known_header_count] = {
+    "Active-Remote", "Apple-Challenge", "Authorization", "CSeq",      "Content-Length",
+    "Content-Type",  "DACP-ID",         "RTP-Info",      "Transport", "User-Agent",
+    "X-Apple-Client-Name"};
+
+#define RTSP_KNOWN_HEADER_HASH(name, length) ((3 * (length) + tolower((name)[1])) & 31)
+
+// one more than the known header in each slot, so that zero means none
+static const signed char rtsp_known_header_hash_table[32] = {
+    [10] = rtsp_header_active_remote + 1, [29] = rtsp_header_apple_challenge + 1,
+    [28] = rtsp_header_authorization + 1, [31] = rtsp_header_cseq + 1,
+    [25] = rtsp_header_content_length + 1, [19] = rtsp_header_content_type + 1,
+    [22] = rtsp_header_dacp_id + 1,        [12] = rtsp_header_rtp_info + 1,
+    [13] = rtsp_header_transport + 1,      [17] = rtsp_header_user_agent + 1,
+    [6] = rtsp_header_x_apple_client_name + 1};
+
+// returns the rtsp_known_header the name is, or -1
+static int rtsp_known_header(const char *name, size_t length) {
+  if (length < 2)
+    return -1;
+  int h = rtsp_known_header_hash_table[RTSP_KNOWN_HEADER_HASH(name, length)] - 1;
+  if ((h >= 0) && (strlen(rtsp_known_header_names[h]) == length) &&
+      (strncasecmp(rtsp_known_header_names[h], name, length) == 0))
+    return h;
+  return -1;
+}
+
+// Messages that have been freed are kept here for reuse, rather than going back to the heap, as
+// several are made and freed for every request.
+#define MSG_POOL_SIZE 8
+static rtsp_message *msg_pool[MSG_POOL_SIZE];
+static int msg_pool_count = 0; // protected by the reference_counter_lock
+
 rtsp_message *msg_init(void) {
-  rtsp_message *msg = malloc(sizeof(rtsp_message));
+  rtsp_message *msg = NULL;
+  debug_mutex_lock(&reference_counter_lock, 1000, 0);
+  if (msg_pool_count)
+    msg = msg_pool[--msg_pool_count];
+  int index_number = msg_indexes++;
+  debug_mutex_unlock(&reference_counter_lock, 0);
+  if (msg == NULL)
+    msg = malloc(sizeof(rtsp_message));
   if (msg) {
     memset(msg, 0, sizeof(rtsp_message));
     msg->referenceCount = 1; // from now on, any access to this must be protected with the lock
-    msg->index_number = msg_indexes++;
+    msg->index_number = index_number;
     debug(3, "msg_init message %d", msg->index_number);
   } else {
-    die("msg_init -- can not allocate memory for rtsp_message %d.", msg_indexes);
+    die("msg_init -- can not allocate memory for rtsp_message %d.", index_number);
   }
   // debug(1,"msg_init -- create item %d.", msg->index_number);
   return msg;
 }
 
-int msg_add_header(rtsp_message *msg, char *name, char *value) {
+static int msg_add_header_slice(rtsp_message *msg, char *name, size_t name_length, char *value,
+                                int borrowed) {
   if (msg->nheaders >= sizeof(msg->name) / sizeof(char *)) {
     warn("too many headers?!");
     return 1;
   }
-
-  msg->name[msg->nheaders] = strdup(name);
-  msg->value[msg->nheaders] = strdup(value);
+  int h = rtsp_known_header(name, name_length);
+  if ((h >= 0) && (msg->known_header[h] == 0))
+    msg->known_header[h] = msg->nheaders + 1;
+  msg->name[msg->nheaders] = name;
+  msg->value[msg->nheaders] = value;
+  if (borrowed)
+    msg->borrowed_headers |= 1 << msg->nheaders;
   msg->nheaders++;
+  return 0;
+}
 
+// for a header whose name and value are constants and so don't need to be copied
+static int msg_add_static_header(rtsp_message *msg, const char *name, const char *value) {
+  return msg_add_header_slice(msg, (char *)name, strlen(name), (char *)value, 1);
+}
+
+int msg_add_header(rtsp_message *msg, char *name, char *value) {
+  char *n = strdup(name);
+  char *v = strdup(value);
+  if ((n == NULL) || (v == NULL) || (msg_add_header_slice(msg, n, strlen(n), v, 0) != 0)) {
+    free(n);
+    free(v);
+    return 1;
+  }
   return 0;
 }
 
 char *msg_get_header(rtsp_message *msg, char *name) {
   unsigned int i;
+  int h = rtsp_known_header(name, strlen(name));
+  if (h >= 0) {
+    if (msg->known_header[h] == 0)
+      return NULL;
+    return msg->value[msg->known_header[h] - 1];
+  }
   for (i = 0; i < msg->nheaders; i++)
     if (!strcasecmp(msg->name[i], name))
       return msg->value[i];
@@ -542,9 +646,13 @@ void msg_free(rtsp_message **msgh) {
     if (msg->referenceCount == 0) {
       unsigned int i;
       for (i = 0; i < msg->nheaders; i++) {
-        free(msg->name[i]);
-        free(msg->value[i]);
+        if ((msg->borrowed_headers & (1 << i)) == 0) {
+          free(msg->name[i]);
+          free(msg->value[i]);
+        }
       }
+      if (msg->header_block)
+        free(msg->header_block);
       if (msg->content)
         free(msg->content);
       // debug(1,"msg_free item %d -- free.",msg->index_number);
@@ -554,7 +662,10 @@ void msg_free(rtsp_message **msgh) {
       *msgh =
           (rtsp_message *)(index); // put a version of the index number of the freed message in here
       debug(3, "msg_free freed message %d", msg->index_number);
-      free(msg);
+      if (msg_pool_count < MSG_POOL_SIZE)
+        msg_pool[msg_pool_count++] = msg;
+      else
+        free(msg);
     } else {
       // debug(1,"msg_free item %d -- decrement reference to
       // %d.",msg->index_number,msg->referenceCount);
@@ -568,87 +679,119 @@ void msg_free(rtsp_message **msgh) {
   debug_mutex_unlock(&reference_counter_lock, 0);
 }
 
-int msg_handle_line(rtsp_message **pmsg, char *line) {
-  rtsp_message *msg = *pmsg;
-
-  if (!msg) {
-    msg = msg_init();
-    *pmsg = msg;
-    char *sp, *p;
-    sp = NULL; // this is to quieten a compiler warning
-
-    debug(3, "RTSP Message Received: \"%s\".", line);
-
-    p = strtok_r(line, " ", &sp);
-    if (!p)
-      goto fail;
-    strncpy(msg->method, p, sizeof(msg->method) - 1);
-
-    p = strtok_r(NULL, " ", &sp);
-    if (!p)
-      goto fail;
+// Returns the length of the request line and headers at the start of the buffer, up to and
+// including the empty line after them, or -1 if they're not all there yet.
+static ssize_t rtsp_header_length(const char *buf, ssize_t inbuf) {
+  ssize_t i;
+  for (i = 0; i + 1 < inbuf; i++) {
+    if (buf[i] == '\n') {
+      if (buf[i + 1] == '\n')
+        return i + 2;
+      if ((i + 2 < inbuf) && (buf[i + 1] == '\r') && (buf[i + 2] == '\n'))
+        return i + 3;
+    }
+  }
+  return -1;
+}
 
-    p = strtok_r(NULL, " ", &sp);
-    if (!p)
-      goto fail;
-    if (strcmp(p, "RTSP/1.0"))
-      goto fail;
+// Parse the copy of the request line and headers in the message's header_block in place.
+// Returns the content length, or -1 if it's not a proper RTSP request.
+static int msg_parse_header_block(rtsp_message *msg, ssize_t length) {
+  char *line = msg->header_block;
+  ssize_t left = length;
+  char *next = nextline(line, left);
+  if (next == NULL)
+    return -1;
+  left -= next - line;
 
+  debug(3, "RTSP Message Received: \"%s\".", line);
+  char *sp = NULL, *p;
+  p = strtok_r(line, " ", &sp);
+  if (!p)
+    return -1;
+  strncpy(msg->method, p, sizeof(msg->method) - 1);
+  p = strtok_r(NULL, " ", &sp);
+  if (!p)
+    return -1;
+  p = strtok_r(NULL, " ", &sp);
+  if ((!p) || (strcmp(p, "RTSP/1.0")))
     return -1;
-  }
 
-  if (strlen(line)) {
-    char *p;
+  line = next;
+  while ((left > 0) && ((next = nextline(line, left)) != NULL)) {
+    left -= next - line;
+    if (*line == '\0')
+      break; // the empty line at the end
     p = strstr(line, ": ");
     if (!p) {
       warn("bad header: >>%s<<", line);
-      goto fail;
+      return -1;
     }
     *p = 0;
-    p += 2;
-    msg_add_header(msg, line, p);
-    debug(3, "    %s: %s.", line, p);
-    return -1;
-  } else {
-    char *cl = msg_get_header(msg, "Content-Length");
-    if (cl)
-      return atoi(cl);
-    else
-      return 0;
+    msg_add_header_slice(msg, line, p - line, p + 2, 1);
+    debug(3, "    %s: %s.", line, p + 2);
+    line = next;
   }
+  char *cl = msg_get_header(msg, "Content-Length");
+  if (cl)
+    return atoi(cl);
+  else
+    return 0;
+}
 
-fail:
-  debug(3, "msg_handle_line fail");
-  msg_free(pmsg);
-  *pmsg = NULL;
-  return 0;
+void msg_cleanup_function(void *arg) {
+  // debug(3, "msg_cleanup_function called.");
+  msg_free((rtsp_message **)arg);
 }
 
+// Requests are parsed out of the connection's rtsp_buffer, which is kept from one request to the
+// next, so that anything received after the end of one request is there for the next. Once the
+// end of the headers has been seen, they are copied in one piece into the message and parsed
+// there in place. The content of a request is given a buffer of its own, which is passed on with
+// the message.
+#define RTSP_BUFFER_SIZE 4096
+
 enum rtsp_read_request_response rtsp_read_request(rtsp_conn_info *conn, rtsp_message **the_packet) {
 
   *the_packet = NULL; // need this for error handling
 
   enum rtsp_read_request_response reply = rtsp_read_request_response_ok;
-  ssize_t buflen = 4096;
-  int release_buffer = 0;         // on exit, don't deallocate the buffer if everything was okay
-  char *buf = malloc(buflen + 1); // add a NUL at the end
-  if (!buf) {
-    warn("Connection %d: rtsp_read_request: can't get a buffer.", conn->connection_number);
-    return (rtsp_read_request_response_error);
+  if (conn->rtsp_buffer == NULL) {
+    conn->rtsp_buffer = malloc(RTSP_BUFFER_SIZE);
+    if (!conn->rtsp_buffer) {
+      warn("Connection %d: rtsp_read_request: can't get a buffer.", conn->connection_number);
+      return (rtsp_read_request_response_error);
+    }
+    conn->rtsp_buffer_occupancy = 0;
   }
-  pthread_cleanup_push(malloc_cleanup, buf);
+  char *buf = conn->rtsp_buffer;
+  const ssize_t buflen = RTSP_BUFFER_SIZE;
+  pthread_cleanup_push(msg_cleanup_function, the_packet);
   ssize_t nread;
-  ssize_t inbuf = 0;
-  int msg_size = -1;
+  ssize_t inbuf = conn->rtsp_buffer_occupancy;
+
+  ssize_t header_length;
+  ssize_t scanned = 0; // how much of the buffer is known not to hold the end of the headers
+  while ((header_length = rtsp_header_length(buf + scanned, inbuf - scanned)) < 0) {
+    if (inbuf > 2)
+      scanned = inbuf - 2; // the end could straddle what's here and what's to come
 
-  while (msg_size < 0) {
     if (conn->stop != 0) {
       debug(3, "Connection %d: shutdown requested.", conn->connection_number);
       reply = rtsp_read_request_response_immediate_shutdown_requested;
       goto shutdown;
     }
 
-    nread = read(conn->fd, buf + inbuf, buflen - inbuf);
+    if (inbuf == buflen) {
+      debug(1, "Connection %d: rtsp_read_request: RTSP header line too long.",
+            conn->connection_number);
+      reply = rtsp_read_request_response_bad_packet;
+      goto shutdown;
+    }
+
+    // if the listen loop is serving the connection, the whole request is already here
+    nread = recv(conn->fd, buf + inbuf, buflen - inbuf,
+                 conn->served_by_listen_loop ? MSG_DONTWAIT : 0);
 
     if (nread == 0) {
       // a blocking read that returns zero means eof -- implies connection closed
@@ -660,7 +803,7 @@ enum rtsp_read_request_response rtsp_read_request(rtsp_conn_info *conn, rtsp_mes
     if (nread < 0) {
       if (errno == EINTR)
         continue;
-      if (errno == EAGAIN) {
+      if ((errno == EAGAIN) && (conn->served_by_listen_loop == 0)) {
         debug(1, "Connection %d: getting Error 11 -- EAGAIN from a blocking read!",
               conn->connection_number);
         continue;
@@ -686,40 +829,54 @@ enum rtsp_read_request_response rtsp_read_request(rtsp_conn_info *conn, rtsp_mes
     */
 
     inbuf += nread;
+  }
+  header_length += scanned;
 
-    char *next;
-    while (msg_size < 0 && (next = nextline(buf, inbuf))) {
-      msg_size = msg_handle_line(the_packet, buf);
-
-      if (!(*the_packet)) {
-        debug(1, "Connection %d: rtsp_read_request can't find an RTSP header.",
-              conn->connection_number);
-        reply = rtsp_read_request_response_bad_packet;
-        goto shutdown;
-      }
-
-      inbuf -= next - buf;
-      if (inbuf)
-        memmove(buf, next, inbuf);
-    }
+  // take a copy of the request line and headers and parse them in place
+  *the_packet = msg_init();
+  char *header_block = malloc(header_length + 1);
+  if (!header_block) {
+    warn("Connection %d: rtsp_read_request: can't get a buffer.", conn->connection_number);
+    reply = rtsp_read_request_response_error;
+    goto shutdown;
+  }
+  memcpy(header_block, buf, header_length);
+  header_block[header_length] = '\0';
+  (*the_packet)->header_block = header_block;
+  inbuf -= header_length;
+  if (inbuf)
+    memmove(buf, buf + header_length, inbuf);
+  int msg_size = msg_parse_header_block(*the_packet, header_length);
+  if (msg_size < 0) {
+    debug(1, "Connection %d: rtsp_read_request can't find an RTSP header.",
+          conn->connection_number);
+    reply = rtsp_read_request_response_bad_packet;
+    goto shutdown;
   }
 
-  if (msg_size > buflen) {
-    buf = realloc(buf, msg_size + 1);
-    if (!buf) {
-      warn("Connection %d: too much content.", conn->connection_number);
-      reply = rtsp_read_request_response_error;
-      goto shutdown;
-    }
-    buflen = msg_size;
+  char *content = malloc(msg_size + 1); // add a NUL at the end
+  if (!content) {
+    warn("Connection %d: too much content.", conn->connection_number);
+    reply = rtsp_read_request_response_error;
+    goto shutdown;
   }
+  (*the_packet)->content = content; // so that it will be freed with the message
+
+  // take what's already been received
+  ssize_t content_received = inbuf;
+  if (content_received > msg_size)
+    content_received = msg_size;
+  memcpy(content, buf, content_received);
+  inbuf -= content_received;
+  if (inbuf)
+    memmove(buf, buf + content_received, inbuf);
 
   uint64_t threshold_time =
       get_absolute_time_in_ns() + ((uint64_t)15000000000); // i.e. fifteen seconds from now
   int warning_message_sent = 0;
 
   const size_t max_read_chunk = 1024 * 1024 / 16;
-  while (inbuf < msg_size) {
+  while (content_received < msg_size) {
 
     // we are going to read the stream in chunks and time how long it takes to
     // do so.
@@ -744,11 +901,11 @@ enum rtsp_read_request_response rtsp_read_request(rtsp_conn_info *conn, rtsp_mes
       reply = rtsp_read_request_response_immediate_shutdown_requested;
       goto shutdown;
     }
-    size_t read_chunk = msg_size - inbuf;
+    size_t read_chunk = msg_size - content_received;
     if (read_chunk > max_read_chunk)
       read_chunk = max_read_chunk;
     usleep(80000); // wait about 80 milliseconds between reads of up to about 64 kB
-    nread = read(conn->fd, buf + inbuf, read_chunk);
+    nread = read(conn->fd, content + content_received, read_chunk);
     if (!nread) {
       reply = rtsp_read_request_response_error;
       goto shutdown;
@@ -769,88 +926,156 @@ enum rtsp_read_request_response rtsp_read_request(rtsp_conn_info *conn, rtsp_mes
       reply = rtsp_read_request_response_read_error;
       goto shutdown;
     }
-    inbuf += nread;
+    content_received += nread;
   }
 
-  rtsp_message *msg = *the_packet;
-  msg->contentlength = inbuf;
-  msg->content = buf;
-  char *jp = inbuf + buf;
-  *jp = '\0';
-  *the_packet = msg;
+  (*the_packet)->contentlength = content_received;
+  content[content_received] = '\0';
 shutdown:
-  if (reply != rtsp_read_request_response_ok) {
+  if (reply == rtsp_read_request_response_ok) {
+    conn->rtsp_buffer_occupancy = inbuf;
+  } else {
     msg_free(the_packet);
-    release_buffer = 1; // allow the buffer to be released
+    conn->rtsp_buffer_occupancy = 0; // what's left can't be relied on
   }
-  pthread_cleanup_pop(release_buffer);
+  pthread_cleanup_pop(0);
   return reply;
 }
 
-int msg_write_response(int fd, rtsp_message *resp) {
-  char pkt[2048];
-  int pktfree = sizeof(pkt);
-  char *p = pkt;
-  int n;
+static const char *rtsp_status_line(int respcode) {
+  switch (respcode) {
+  case 200:
+    return "RTSP/1.0 200 OK\r\n";
+  case 400:
+    return "RTSP/1.0 400 Bad Request\r\n";
+  case 401:
+    return "RTSP/1.0 401 Unauthorized\r\n";
+  case 451:
+    return "RTSP/1.0 451 Parameter Not Understood\r\n";
+  case 453:
+    return "RTSP/1.0 453 Not Enough Bandwidth\r\n";
+  case 456:
+    return "RTSP/1.0 456 Header Field Not Valid for Resource\r\n";
+  default:
+    return NULL;
+  }
+}
+
+// The response is gathered straight from where its parts are, with no copying or formatting
+// beyond that of any unusual status code and of the content length.
+// The sockets the listen loop looks after don't block, so if one of them can't take the whole
+// response, what's left is kept in conn->rtsp_unsent for a conversation thread to send.
+int msg_write_response(rtsp_conn_info *conn, rtsp_message *resp) {
+  struct iovec iov[4 + 4 * (sizeof(resp->name) / sizeof(char *))];
+  int iovcnt = 0;
+  size_t total = 0;
   unsigned int i;
 
-  n = snprintf(p, pktfree, "RTSP/1.0 %d %s\r\n", resp->respcode,
-               resp->respcode == 200 ? "OK" : "Unauthorized");
-  // debug(1, "sending response: %s", pkt);
-  pktfree -= n;
-  p += n;
+#define MSG_WRITE_RESPONSE_ADD(base, length)                                                       \
+  do {                                                                                             \
+    iov[iovcnt].iov_base = (void *)(base);                                                         \
+    iov[iovcnt].iov_len = (length);                                                                \
+    total += iov[iovcnt].iov_len;                                                                  \
+    iovcnt++;                                                                                      \
+  } while (0)
+
+  char status_line[64];
+  const char *status = rtsp_status_line(resp->respcode);
+  if (status == NULL) {
+    snprintf(status_line, sizeof(status_line), "RTSP/1.0 %d Unauthorized\r\n", resp->respcode);
+    status = status_line;
+  }
+  // debug(1, "sending response: %s", status);
+  MSG_WRITE_RESPONSE_ADD(status, strlen(status));
 
   for (i = 0; i < resp->nheaders; i++) {
     //    debug(3, "    %s: %s.", resp->name[i], resp->value[i]);
-    n = snprintf(p, pktfree, "%s: %s\r\n", resp->name[i], resp->value[i]);
-    pktfree -= n;
-    p += n;
-    if (pktfree <= 1024) {
-      debug(1, "Attempted to write overlong RTSP packet 1");
-      return -1;
-    }
+    MSG_WRITE_RESPONSE_ADD(resp->name[i], strlen(resp->name[i]));
+    MSG_WRITE_RESPONSE_ADD(": ", 2);
+    MSG_WRITE_RESPONSE_ADD(resp->value[i], strlen(resp->value[i]));
+    MSG_WRITE_RESPONSE_ADD("\r\n", 2);
   }
 
   // Here, if there's content, write the Content-Length header ...
-
+  char content_length_header[48];
   if (resp->contentlength) {
-    debug(1, "Responding with content of length %d", resp->contentlength);
-    n = snprintf(p, pktfree, "Content-Length: %d\r\n", resp->contentlength);
-    pktfree -= n;
-    p += n;
-    if (pktfree <= 1024) {
-      debug(1, "Attempted to write overlong RTSP packet 2");
-      return -2;
-    }
-    debug(1, "Content is \"%s\"", resp->content);
-    memcpy(p, resp->content, resp->contentlength);
-    pktfree -= resp->contentlength;
-    p += resp->contentlength;
-  }
-
-  n = snprintf(p, pktfree, "\r\n");
-  pktfree -= n;
-  p += n;
-
-  if (pktfree <= 1024) {
-    debug(1, "Attempted to write overlong RTSP packet 3");
-    return -3;
-  }
-  ssize_t reply = write(fd, pkt, p - pkt);
-  if (reply == -1) {
-    char errorstring[1024];
-    strerror_r(errno, (char *)errorstring, sizeof(errorstring));
-    debug(1, "msg_write_response error %d: \"%s\".", errno, (char *)errorstring);
-    return -4;
-  }
-  if (reply != p - pkt) {
-    debug(1, "msg_write_response error -- requested bytes: %d not fully written: %d.", p - pkt,
-          reply);
-    return -5;
+    debug(2, "Responding with content of length %d", resp->contentlength);
+    int n = snprintf(content_length_header, sizeof(content_length_header),
+                     "Content-Length: %d\r\n", resp->contentlength);
+    MSG_WRITE_RESPONSE_ADD(content_length_header, n);
+  }
+  MSG_WRITE_RESPONSE_ADD("\r\n", 2);
+  // ... and the content itself, after the empty line
+  if (resp->contentlength)
+    MSG_WRITE_RESPONSE_ADD(resp->content, resp->contentlength);
+#undef MSG_WRITE_RESPONSE_ADD
+
+  struct iovec *v = iov;
+  size_t written = 0;
+  while (written < total) {
+    ssize_t reply = writev(conn->fd, v, iovcnt);
+    if (reply == -1) {
+      if (errno == EINTR)
+        continue;
+      if ((conn->served_by_listen_loop != 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+        conn->rtsp_unsent = malloc(total - written);
+        if (conn->rtsp_unsent == NULL)
+          die("Couldn't allocate memory for the rest of an RTSP response.");
+        conn->rtsp_unsent_length = 0;
+        for (i = 0; i < (unsigned int)iovcnt; i++) {
+          memcpy(conn->rtsp_unsent + conn->rtsp_unsent_length, v[i].iov_base, v[i].iov_len);
+          conn->rtsp_unsent_length += v[i].iov_len;
+        }
+        debug(2, "Connection %d: %zu bytes of a response are left for a conversation thread.",
+              conn->connection_number, conn->rtsp_unsent_length);
+        return 0;
+      }
+      char errorstring[1024];
+      strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+      debug(1, "msg_write_response error %d: \"%s\".", errno, (char *)errorstring);
+      return -4;
+    }
+    if (reply == 0) {
+      debug(1, "msg_write_response error -- requested bytes: %d not fully written: %d.", total,
+            written);
+      return -5;
+    }
+    written += reply;
+    // skip over what has been written
+    while ((iovcnt) && ((size_t)reply >= v->iov_len)) {
+      reply -= v->iov_len;
+      v++;
+      iovcnt--;
+    }
+    if (iovcnt) {
+      v->iov_base = (char *)v->iov_base + reply;
+      v->iov_len -= reply;
+    }
   }
   return 0;
 }
 
+// send whatever the listen loop couldn't -- the socket blocks again by now
+static int rtsp_write_unsent(rtsp_conn_info *conn) {
+  int response = 0;
+  size_t written = 0;
+  while ((response == 0) && (written < conn->rtsp_unsent_length)) {
+    ssize_t reply =
+        write(conn->fd, conn->rtsp_unsent + written, conn->rtsp_unsent_length - written);
+    if (reply > 0) {
+      written += reply;
+    } else if ((reply == 0) || (errno != EINTR)) {
+      debug(1, "Connection %d: could not finish writing an RTSP response.",
+            conn->connection_number);
+      response = -1;
+    }
+  }
+  free(conn->rtsp_unsent);
+  conn->rtsp_unsent = NULL;
+  conn->rtsp_unsent_length = 0;
+  return response;
+}
+
 void handle_record(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp) {
   debug(2, "Connection %d: RECORD", conn->connection_number);
   if (have_player(conn)) {
@@ -869,7 +1094,7 @@ void handle_record(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp)
     // and iTunes' latency figure of 88553, when added to 11025 gives you 99578,
     // pretty close to the 99400 we guessed.
 
-    msg_add_header(resp, "Audio-Latency", "11025");
+    msg_add_static_header(resp, "Audio-Latency", "11025");
 
     char *p;
     uint32_t rtptime = 0;
@@ -900,10 +1125,10 @@ void handle_options(rtsp_conn_info *conn, __attribute__((unused)) rtsp_message *
                     rtsp_message *resp) {
   debug(3, "Connection %d: OPTIONS", conn->connection_number);
   resp->respcode = 200;
-  msg_add_header(resp, "Public",
-                 "ANNOUNCE, SETUP, RECORD, "
-                 "PAUSE, FLUSH, TEARDOWN, "
-                 "OPTIONS, GET_PARAMETER, SET_PARAMETER");
+  msg_add_static_header(resp, "Public",
+                        "ANNOUNCE, SETUP, RECORD, "
+                        "PAUSE, FLUSH, TEARDOWN, "
+                        "OPTIONS, GET_PARAMETER, SET_PARAMETER");
 }
 
 void handle_teardown(rtsp_conn_info *conn, __attribute__((unused)) rtsp_message *req,
@@ -911,7 +1136,7 @@ void handle_teardown(rtsp_conn_info *conn, __attribute__((unused)) rtsp_message
   debug(2, "Connection %d: TEARDOWN", conn->connection_number);
   if (have_player(conn)) {
     resp->respcode = 200;
-    msg_add_header(resp, "Connection", "close");
+    msg_add_static_header(resp, "Connection", "close");
     debug(
         3,
         "TEARDOWN: synchronously terminating the player thread of RTSP conversation thread %d (2).",
@@ -1051,7 +1276,7 @@ void handle_setup(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp) {
 
             msg_add_header(resp, "Transport", resphdr);
 
-            msg_add_header(resp, "Session", "1");
+            msg_add_static_header(resp, "Session", "1");
 
             resp->respcode = 200; // it all worked out okay
             debug(1,
@@ -1077,8 +1302,10 @@ void handle_setup(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp) {
     if (resp->respcode != 200) {
       debug(1, "Connection %d: SETUP error -- releasing the player lock.", conn->connection_number);
       debug_mutex_lock(&playing_conn_lock, 1000000, 3);
-      if (playing_conn == conn) // if we have the player
-        playing_conn = NULL;    // let it go
+      if (playing_conn == conn) { // if we have the player
+        playing_conn = NULL;      // let it go
+        pthread_cond_broadcast(&playing_conn_released);
+      }
       debug_mutex_unlock(&playing_conn_lock, 3);
     }
 
@@ -1189,6 +1416,14 @@ void handle_set_parameter_parameter(rtsp_conn_info *conn, rtsp_message *req,
 //              with -144.00 meaning mute.
 //              This is linear on the volume control slider of iTunes or iOS
 //              AirPlay.
+//    'rcvs' -- receive statistics -- sent every 1024 audio packets during a play session, as a
+//    line of text describing how the packets have arrived since the session started, e.g. how
+//    much time they had to spare before being due for output, how far out of order they came
+//    and how well resend requests were answered. See receive_stats.c for the format.
+//    'stgt' -- stage timings -- sent at each statistics interval during a play session, as a line
+//    of text giving, for each stage of the audio pipeline in the decoder and player threads, how
+//    many times it has run, its mean and maximum durations and a histogram of its durations.
+//    See stage_timings.c for the format.
 //    'prgr' -- progress -- this is metadata from AirPlay consisting of RTP
 //    timestamps for the start
 //    of the current play sequence, the current play point and the end of the
@@ -1282,71 +1517,67 @@ char *base64_encode_so(const unsigned char *data, size_t input_length, char *enc
 // with thanks!
 //
 
+// For the metadata pipe, the whole of an item's data is encoded in one pass, twelve bits at a
+// time, looking up the two characters for each twelve bits in a 4096-entry table.
+static char base64_pairs[4096][2];
+
+static void base64_pairs_init(void) {
+  int i;
+  for (i = 0; i < 4096; i++) {
+    base64_pairs[i][0] = encoding_table[i >> 6];
+    base64_pairs[i][1] = encoding_table[i & 0x3F];
+  }
+}
+
+// returns the number of characters written, 4 * ((input_length + 2) / 3)
+static size_t base64_encode_block(const unsigned char *data, size_t input_length,
+                                  char *encoded_data) {
+  char *out = encoded_data;
+  size_t i = 0;
+  // six bytes at a time, then three at a time
+  for (; i + 6 <= input_length; i += 6) {
+    uint32_t first = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+    uint32_t second = (data[i + 3] << 16) | (data[i + 4] << 8) | data[i + 5];
+    memcpy(out, base64_pairs[first >> 12], 2);
+    memcpy(out + 2, base64_pairs[first & 0xFFF], 2);
+    memcpy(out + 4, base64_pairs[second >> 12], 2);
+    memcpy(out + 6, base64_pairs[second & 0xFFF], 2);
+    out += 8;
+  }
+  for (; i + 3 <= input_length; i += 3) {
+    uint32_t triple = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+    memcpy(out, base64_pairs[triple >> 12], 2);
+    memcpy(out + 2, base64_pairs[triple & 0xFFF], 2);
+    out += 4;
+  }
+  if (i < input_length) {
+    uint32_t triple = data[i] << 16;
+    if (i + 1 < input_length)
+      triple |= data[i + 1] << 8;
+    memcpy(out, base64_pairs[triple >> 12], 2);
+    out[2] = (i + 1 < input_length) ? encoding_table[(triple >> 6) & 0x3F] : '=';
+    out[3] = '=';
+    out += 4;
+  }
+  return out - encoded_data;
+}
+
 static int fd = -1;
 // static int dirty = 0;
 
-pc_queue metadata_queue;
-#define metadata_queue_size 500
-metadata_package metadata_queue_items[metadata_queue_size];
 pthread_t metadata_thread;
 
 #ifdef CONFIG_METADATA_HUB
-pc_queue metadata_hub_queue;
-#define metadata_hub_queue_size 500
-metadata_package metadata_hub_queue_items[metadata_hub_queue_size];
 pthread_t metadata_hub_thread;
 #endif
 
 #ifdef CONFIG_MQTT
-pc_queue metadata_mqtt_queue;
-#define metadata_mqtt_queue_size 500
-metadata_package metadata_mqtt_queue_items[metadata_mqtt_queue_size];
 pthread_t metadata_mqtt_thread;
+static int metadata_mqtt_thread_started = 0;
 #endif
 
-static int metadata_sock = -1;
-static struct sockaddr_in metadata_sockaddr;
-static char *metadata_sockmsg;
-pc_queue metadata_multicast_queue;
-#define metadata_multicast_queue_size 500
-metadata_package metadata_multicast_queue_items[metadata_queue_size];
 pthread_t metadata_multicast_thread;
-
-void metadata_create_multicast_socket(void) {
-  if (config.metadata_enabled == 0)
-    return;
-
-  // Unlike metadata pipe, socket is opened once and stays open,
-  // so we can call it in create
-  if (config.metadata_sockaddr && config.metadata_sockport) {
-    metadata_sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (metadata_sock < 0) {
-      debug(1, "Could not open metadata socket");
-    } else {
-      int buffer_size = METADATA_SNDBUF;
-      setsockopt(metadata_sock, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
-      bzero((char *)&metadata_sockaddr, sizeof(metadata_sockaddr));
-      metadata_sockaddr.sin_family = AF_INET;
-      metadata_sockaddr.sin_addr.s_addr = inet_addr(config.metadata_sockaddr);
-      metadata_sockaddr.sin_port = htons(config.metadata_sockport);
-      metadata_sockmsg = malloc(config.metadata_sockmsglength);
-      if (metadata_sockmsg) {
-        memset(metadata_sockmsg, 0, config.metadata_sockmsglength);
-      } else {
-        die("Could not malloc metadata multicast socket buffer");
-      }
-    }
-  }
-}
-
-void metadata_delete_multicast_socket(void) {
-  if (config.metadata_enabled == 0)
-    return;
-  shutdown(metadata_sock, SHUT_RDWR); // we want to immediately deallocate the buffer
-  close(metadata_sock);
-  if (metadata_sockmsg)
-    free(metadata_sockmsg);
-}
+static int metadata_multicast_thread_started = 0;
 
 void metadata_open(void) {
   if (config.metadata_enabled == 0)
@@ -1368,133 +1599,94 @@ static void metadata_close(void) {
   fd = -1;
 }
 
-void metadata_multicast_process(uint32_t type, uint32_t code, char *data, uint32_t length) {
-  // debug(1, "Process multicast metadata with type %x, code %x and length %u.", type, code,
-  // length);
-  if (metadata_sock >= 0 && length < config.metadata_sockmsglength - 8) {
-    char *ptr = metadata_sockmsg;
-    uint32_t v;
-    v = htonl(type);
-    memcpy(ptr, &v, 4);
-    ptr += 4;
-    v = htonl(code);
-    memcpy(ptr, &v, 4);
-    ptr += 4;
-    memcpy(ptr, data, length);
-    sendto(metadata_sock, metadata_sockmsg, length + 8, 0, (struct sockaddr *)&metadata_sockaddr,
-           sizeof(metadata_sockaddr));
-  } else if (metadata_sock >= 0) {
-    // send metadata in numbered chunks using the protocol:
-    // ("ssnc", "chnk", packet_ix, packet_counts, packet_tag, packet_type, chunked_data)
-
-    uint32_t chunk_ix = 0;
-    uint32_t chunk_total = length / (config.metadata_sockmsglength - 24);
-    if (chunk_total * (config.metadata_sockmsglength - 24) < length) {
-      chunk_total++;
-    }
-    uint32_t remaining = length;
-    uint32_t v;
-    char *data_crsr = data;
-    do {
-      char *ptr = metadata_sockmsg;
-      memcpy(ptr, "ssncchnk", 8);
-      ptr += 8;
-      v = htonl(chunk_ix);
-      memcpy(ptr, &v, 4);
-      ptr += 4;
-      v = htonl(chunk_total);
-      memcpy(ptr, &v, 4);
-      ptr += 4;
-      v = htonl(type);
-      memcpy(ptr, &v, 4);
-      ptr += 4;
-      v = htonl(code);
-      memcpy(ptr, &v, 4);
-      ptr += 4;
-      size_t datalen = remaining;
-      if (datalen > config.metadata_sockmsglength - 24) {
-        datalen = config.metadata_sockmsglength - 24;
-      }
-      memcpy(ptr, data_crsr, datalen);
-      data_crsr += datalen;
-      sendto(metadata_sock, metadata_sockmsg, datalen + 24, 0,
-             (struct sockaddr *)&metadata_sockaddr, sizeof(metadata_sockaddr));
-      chunk_ix++;
-      remaining -= datalen;
-      if (remaining == 0)
-        break;
-    } while (1);
+// Items for the pipe are formatted into this buffer and written out together when there are no
+// more waiting, so a burst of metadata -- or a piece of cover art -- takes a few writes rather
+// than one for every line of base64.
+#define metadata_pipe_flush_size 65536 // write out at least this often
+static char *metadata_pipe_buffer = NULL;
+static size_t metadata_pipe_buffer_size = 0;
+static size_t metadata_pipe_buffer_occupancy = 0;
+
+static char *metadata_pipe_space(size_t count) {
+  if (metadata_pipe_buffer_occupancy + count > metadata_pipe_buffer_size) {
+    size_t new_size = metadata_pipe_buffer_size ? metadata_pipe_buffer_size : 4096;
+    while (new_size < metadata_pipe_buffer_occupancy + count)
+      new_size *= 2;
+    char *new_buffer = realloc(metadata_pipe_buffer, new_size);
+    if (new_buffer == NULL) {
+      debug(1, "can not allocate %zu bytes for the metadata pipe.", new_size);
+      return NULL;
+    }
+    metadata_pipe_buffer = new_buffer;
+    metadata_pipe_buffer_size = new_size;
+  }
+  return metadata_pipe_buffer + metadata_pipe_buffer_occupancy;
+}
+
+static void metadata_pipe_append(const char *s, size_t count) {
+  char *p = metadata_pipe_space(count);
+  if (p) {
+    memcpy(p, s, count);
+    metadata_pipe_buffer_occupancy += count;
   }
 }
 
+static void metadata_pipe_flush(void) {
+  size_t written = 0;
+  while ((fd >= 0) && (written < metadata_pipe_buffer_occupancy)) {
+    ssize_t ret = write(fd, metadata_pipe_buffer + written,
+                        metadata_pipe_buffer_occupancy - written);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      // debug(1,"metadata_pipe_flush error %d.", errno);
+      if (errno == EPIPE)
+        metadata_close(); // the reader has gone away; try to reopen it next time
+      break;
+    }
+    written += ret;
+  }
+  metadata_pipe_buffer_occupancy = 0;
+}
+
 void metadata_process(uint32_t type, uint32_t code, char *data, uint32_t length) {
   // debug(1, "Process metadata with type %x, code %x and length %u.", type, code, length);
-  int ret = 0;
   // readers may go away and come back
 
   if (fd < 0)
     metadata_open();
   if (fd < 0)
     return;
+  if (data == NULL)
+    length = 0;
+  if (config.metadata_pipe_format == MPF_binary) {
+    // type, code and length as big-endian 32-bit numbers, followed by the data itself
+    uint32_t header[3] = {htonl(type), htonl(code), htonl(length)};
+    char *p = metadata_pipe_space(sizeof(header) + length);
+    if (p) {
+      memcpy(p, header, sizeof(header));
+      if (length)
+        memcpy(p + sizeof(header), data, length);
+      metadata_pipe_buffer_occupancy += sizeof(header) + length;
+    }
+    return;
+  }
   char thestring[1024];
   snprintf(thestring, 1024, "<item><type>%x</type><code>%x</code><length>%u</length>", type, code,
            length);
-  // ret = non_blocking_write(fd, thestring, strlen(thestring));
-  ret = write(fd, thestring, strlen(thestring));
-  if (ret < 0) {
-    // debug(1,"metadata_process error %d exit 1",ret);
-    return;
-  }
-  if ((data != NULL) && (length > 0)) {
+  metadata_pipe_append(thestring, strlen(thestring));
+  if (length > 0) {
     snprintf(thestring, 1024, "\n<data encoding=\"base64\">\n");
-    // ret = non_blocking_write(fd, thestring, strlen(thestring));
-    ret = write(fd, thestring, strlen(thestring));
-    if (ret < 0) {
-      // debug(1,"metadata_process error %d exit 2",ret);
-      return;
-    }
-    // here, we write the data in base64 form using our nice base64 encoder
-    // but, we break it into lines of 76 output characters, except for the last
-    // one.
-    // thus, we send groups of (76/4)*3 =  57 bytes to the encoder at a time
-    size_t remaining_count = length;
-    char *remaining_data = data;
-    // size_t towrite_count;
-    char outbuf[76];
-    while ((remaining_count) && (ret >= 0)) {
-      size_t towrite_count = remaining_count;
-      if (towrite_count > 57)
-        towrite_count = 57;
-      size_t outbuf_size = 76; // size of output buffer on entry, length of result on exit
-      if (base64_encode_so((unsigned char *)remaining_data, towrite_count, outbuf, &outbuf_size) ==
-          NULL)
-        debug(1, "Error encoding base64 data.");
-      // debug(1,"Remaining count: %d ret: %d, outbuf_size:
-      // %d.",remaining_count,ret,outbuf_size);
-      // ret = non_blocking_write(fd, outbuf, outbuf_size);
-      ret = write(fd, outbuf, outbuf_size);
-      if (ret < 0) {
-        // debug(1,"metadata_process error %d exit 3",ret);
-        return;
-      }
-      remaining_data += towrite_count;
-      remaining_count -= towrite_count;
-    }
+    metadata_pipe_append(thestring, strlen(thestring));
+    // the data is encoded straight into the output buffer
+    char *outbuf = metadata_pipe_space(4 * (((size_t)length + 2) / 3));
+    if (outbuf)
+      metadata_pipe_buffer_occupancy += base64_encode_block((unsigned char *)data, length, outbuf);
     snprintf(thestring, 1024, "</data>");
-    // ret = non_blocking_write(fd, thestring, strlen(thestring));
-    ret = write(fd, thestring, strlen(thestring));
-    if (ret < 0) {
-      // debug(1,"metadata_process error %d exit 4",ret);
-      return;
-    }
+    metadata_pipe_append(thestring, strlen(thestring));
   }
   snprintf(thestring, 1024, "</item>\n");
-  // ret = non_blocking_write(fd, thestring, strlen(thestring));
-  ret = write(fd, thestring, strlen(thestring));
-  if (ret < 0) {
-    // debug(1,"metadata_process error %d exit 5",ret);
-    return;
-  }
+  metadata_pipe_append(thestring, strlen(thestring));
 }
 
 void metadata_pack_cleanup_function(void *arg) {
@@ -1510,27 +1702,31 @@ void metadata_pack_cleanup_function(void *arg) {
 void metadata_thread_cleanup_function(__attribute__((unused)) void *arg) {
   // debug(2, "metadata_thread_cleanup_function called");
   metadata_close();
-  pc_queue_delete(&metadata_queue);
+  free(metadata_pipe_buffer);
+  metadata_pipe_buffer = NULL;
+  metadata_pipe_buffer_size = 0;
+  metadata_pipe_buffer_occupancy = 0;
 }
 
 void *metadata_thread_function(__attribute__((unused)) void *ignore) {
-  // create a pc_queue for passing information to a threaded metadata handler
-  pc_queue_init(&metadata_queue, (char *)&metadata_queue_items, sizeof(metadata_package),
-                metadata_queue_size, "pipe");
-  metadata_create_multicast_socket();
-  metadata_package pack;
+  thread_set_name("metadata");
+  metadata_ring_reader reader = {"pipe", 0};
   pthread_cleanup_push(metadata_thread_cleanup_function, NULL);
   while (1) {
-    pc_queue_get_item(&metadata_queue, &pack);
-    pthread_cleanup_push(metadata_pack_cleanup_function, (void *)&pack);
+    if ((metadata_pipe_buffer_occupancy != 0) &&
+        ((metadata_pipe_buffer_occupancy >= metadata_pipe_flush_size) ||
+         (metadata_ring_ready(&reader) == 0)))
+      metadata_pipe_flush();
+    metadata_package *pack = metadata_ring_wait(&reader);
+    pthread_cleanup_push(metadata_ring_release, (void *)&reader);
     if (config.metadata_enabled) {
-      if (pack.carrier) {
-        debug(3, "     pipe: type %x, code %x, length %u, message %d.", pack.type, pack.code,
-              pack.length, pack.carrier->index_number);
+      if (pack->carrier) {
+        debug(3, "     pipe: type %x, code %x, length %u, message %d.", pack->type, pack->code,
+              pack->length, pack->carrier->index_number);
       } else {
-        debug(3, "     pipe: type %x, code %x, length %u.", pack.type, pack.code, pack.length);
+        debug(3, "     pipe: type %x, code %x, length %u.", pack->type, pack->code, pack->length);
       }
-      metadata_process(pack.type, pack.code, pack.data, pack.length);
+      metadata_process(pack->type, pack->code, pack->data, pack->length);
       debug(3, "     pipe: done.");
     }
     pthread_cleanup_pop(1);
@@ -1541,33 +1737,43 @@ void *metadata_thread_function(__attribute__((unused)) void *ignore) {
 
 void metadata_multicast_thread_cleanup_function(__attribute__((unused)) void *arg) {
   // debug(2, "metadata_multicast_thread_cleanup_function called");
-  metadata_delete_multicast_socket();
-  pc_queue_delete(&metadata_multicast_queue);
+  metadata_multicast_close();
 }
 
 void *metadata_multicast_thread_function(__attribute__((unused)) void *ignore) {
-  // create a pc_queue for passing information to a threaded metadata handler
-  pc_queue_init(&metadata_multicast_queue, (char *)&metadata_multicast_queue_items,
-                sizeof(metadata_package), metadata_multicast_queue_size, "multicast");
-  metadata_create_multicast_socket();
-  metadata_package pack;
+  thread_set_name("metadata-mcast");
+  int sending = 0;
+  if (config.metadata_enabled)
+    sending = metadata_multicast_open();
+  metadata_ring_reader reader = {"multicast", 0};
   pthread_cleanup_push(metadata_multicast_thread_cleanup_function, NULL);
   while (1) {
-    pc_queue_get_item(&metadata_multicast_queue, &pack);
-    pthread_cleanup_push(metadata_pack_cleanup_function, (void *)&pack);
-    if (config.metadata_enabled) {
-      if (pack.carrier) {
+    // take everything that's waiting before sending, so that it goes out in as few batches as
+    // possible, but don't wait past the time the token bucket allows more to be sent
+    uint64_t wait_time = 0;
+    if (metadata_ring_ready(&reader) == 0)
+      wait_time = metadata_multicast_send();
+    metadata_package *pack;
+    if (wait_time == 0)
+      pack = metadata_ring_wait(&reader);
+    else
+      pack = metadata_ring_wait_until(&reader, get_absolute_time_in_ns() + wait_time);
+    if (pack == NULL)
+      continue;
+    pthread_cleanup_push(metadata_ring_release, (void *)&reader);
+    if (sending) {
+      if (pack->carrier) {
         debug(3,
               "                                                                    multicast: type "
               "%x, code %x, length %u, message %d.",
-              pack.type, pack.code, pack.length, pack.carrier->index_number);
+              pack->type, pack->code, pack->length, pack->carrier->index_number);
       } else {
         debug(3,
               "                                                                    multicast: type "
               "%x, code %x, length %u.",
-              pack.type, pack.code, pack.length);
+              pack->type, pack->code, pack->length);
       }
-      metadata_multicast_process(pack.type, pack.code, pack.data, pack.length);
+      metadata_multicast_queue_item(pack->type, pack->code, pack->data, pack->length);
       debug(3,
             "                                                                    multicast: done.");
     }
@@ -1583,26 +1789,23 @@ void metadata_hub_close(void) {}
 void metadata_hub_thread_cleanup_function(__attribute__((unused)) void *arg) {
   // debug(2, "metadata_hub_thread_cleanup_function called");
   metadata_hub_close();
-  pc_queue_delete(&metadata_hub_queue);
 }
 
 void *metadata_hub_thread_function(__attribute__((unused)) void *ignore) {
-  // create a pc_queue for passing information to a threaded metadata handler
-  pc_queue_init(&metadata_hub_queue, (char *)&metadata_hub_queue_items, sizeof(metadata_package),
-                metadata_hub_queue_size, "hub");
-  metadata_package pack;
+  thread_set_name("metadata-hub");
+  metadata_ring_reader reader = {"hub", 0};
   pthread_cleanup_push(metadata_hub_thread_cleanup_function, NULL);
   while (1) {
-    pc_queue_get_item(&metadata_hub_queue, &pack);
-    pthread_cleanup_push(metadata_pack_cleanup_function, (void *)&pack);
-    if (pack.carrier) {
-      debug(3, "                    hub: type %x, code %x, length %u, message %d.", pack.type,
-            pack.code, pack.length, pack.carrier->index_number);
+    metadata_package *pack = metadata_ring_wait(&reader);
+    pthread_cleanup_push(metadata_ring_release, (void *)&reader);
+    if (pack->carrier) {
+      debug(3, "                    hub: type %x, code %x, length %u, message %d.", pack->type,
+            pack->code, pack->length, pack->carrier->index_number);
     } else {
-      debug(3, "                    hub: type %x, code %x, length %u.", pack.type, pack.code,
-            pack.length);
+      debug(3, "                    hub: type %x, code %x, length %u.", pack->type, pack->code,
+            pack->length);
     }
-    metadata_hub_process_metadata(pack.type, pack.code, pack.data, pack.length);
+    metadata_hub_process_metadata(pack->type, pack->code, pack->data, pack->length);
     debug(3, "                    hub: done.");
     pthread_cleanup_pop(1);
   }
@@ -1617,30 +1820,27 @@ void metadata_mqtt_close(void) {}
 void metadata_mqtt_thread_cleanup_function(__attribute__((unused)) void *arg) {
   // debug(2, "metadata_mqtt_thread_cleanup_function called");
   metadata_mqtt_close();
-  pc_queue_delete(&metadata_mqtt_queue);
   // debug(2, "metadata_mqtt_thread_cleanup_function done");
 }
 
 void *metadata_mqtt_thread_function(__attribute__((unused)) void *ignore) {
-  // create a pc_queue for passing information to a threaded metadata handler
-  pc_queue_init(&metadata_mqtt_queue, (char *)&metadata_mqtt_queue_items, sizeof(metadata_package),
-                metadata_mqtt_queue_size, "mqtt");
-  metadata_package pack;
+  thread_set_name("metadata-mqtt");
+  metadata_ring_reader reader = {"mqtt", 0};
   pthread_cleanup_push(metadata_mqtt_thread_cleanup_function, NULL);
   while (1) {
-    pc_queue_get_item(&metadata_mqtt_queue, &pack);
-    pthread_cleanup_push(metadata_pack_cleanup_function, (void *)&pack);
+    metadata_package *pack = metadata_ring_wait(&reader);
+    pthread_cleanup_push(metadata_ring_release, (void *)&reader);
     if (config.mqtt_enabled) {
-      if (pack.carrier) {
+      if (pack->carrier) {
         debug(3,
               "                                        mqtt: type %x, code %x, length %u, message "
               "%d.",
-              pack.type, pack.code, pack.length, pack.carrier->index_number);
+              pack->type, pack->code, pack->length, pack->carrier->index_number);
       } else {
         debug(3, "                                        mqtt: type %x, code %x, length %u.",
-              pack.type, pack.code, pack.length);
+              pack->type, pack->code, pack->length);
       }
-      mqtt_process_metadata(pack.type, pack.code, pack.data, pack.length);
+      mqtt_process_metadata(pack->type, pack->code, pack->data, pack->length);
       debug(3, "                                        mqtt: done.");
     }
 
@@ -1679,34 +1879,61 @@ void metadata_init(void) {
   }
   free(path);
 
+  base64_pairs_init();
+  metadata_ring_init();
+  int reader_count = 0;
   int ret = pthread_create(&metadata_thread, NULL, metadata_thread_function, NULL);
   if (ret)
     debug(1, "Failed to create metadata thread!");
+  else
+    reader_count++;
 
-  ret = pthread_create(&metadata_multicast_thread, NULL, metadata_multicast_thread_function, NULL);
-  if (ret)
-    debug(1, "Failed to create metadata multicast thread!");
+  // the multicast and MQTT threads are only started if they have somewhere to send the metadata
+  if ((config.metadata_sockaddr != NULL) && (config.metadata_sockport != 0)) {
+    ret =
+        pthread_create(&metadata_multicast_thread, NULL, metadata_multicast_thread_function, NULL);
+    if (ret) {
+      debug(1, "Failed to create metadata multicast thread!");
+    } else {
+      metadata_multicast_thread_started = 1;
+      reader_count++;
+    }
+  }
 
 #ifdef CONFIG_METADATA_HUB
   ret = pthread_create(&metadata_hub_thread, NULL, metadata_hub_thread_function, NULL);
   if (ret)
     debug(1, "Failed to create metadata hub thread!");
+  else
+    reader_count++;
 #endif
 #ifdef CONFIG_MQTT
-  ret = pthread_create(&metadata_mqtt_thread, NULL, metadata_mqtt_thread_function, NULL);
-  if (ret)
-    debug(1, "Failed to create metadata mqtt thread!");
+  if (config.mqtt_enabled) {
+    ret = pthread_create(&metadata_mqtt_thread, NULL, metadata_mqtt_thread_function, NULL);
+    if (ret) {
+      debug(1, "Failed to create metadata mqtt thread!");
+    } else {
+      metadata_mqtt_thread_started = 1;
+      reader_count++;
+    }
+  }
 #endif
+  // items can be added from now on
+  __atomic_store_n(&metadata_items.reader_count, reader_count, __ATOMIC_RELEASE);
   metadata_running = 1;
 }
 
 void metadata_stop(void) {
   if (metadata_running) {
     debug(2, "metadata_stop called.");
+    __atomic_store_n(&metadata_items.reader_count, 0, __ATOMIC_RELEASE); // take no more items
 #ifdef CONFIG_MQTT
     // debug(2, "metadata stop mqtt thread.");
-    pthread_cancel(metadata_mqtt_thread);
-    pthread_join(metadata_mqtt_thread, NULL);
+    if (metadata_mqtt_thread_started) {
+      pthread_cancel(metadata_mqtt_thread);
+      pthread_join(metadata_mqtt_thread, NULL);
+      metadata_mqtt_thread_started = 0;
+    }
     // debug(2, "metadata stop mqtt done.");
 #endif
 #ifdef CONFIG_METADATA_HUB
@@ -1716,8 +1943,11 @@ void metadata_stop(void) {
     // debug(2, "metadata stop hub done.");
 #endif
     // debug(2, "metadata stop multicast thread.");
-    pthread_cancel(metadata_multicast_thread);
-    pthread_join(metadata_multicast_thread, NULL);
+    if (metadata_multicast_thread_started) {
+      pthread_cancel(metadata_multicast_thread);
+      pthread_join(metadata_multicast_thread, NULL);
+      metadata_multicast_thread_started = 0;
+    }
     // debug(2, "metadata stop multicast done.");
 
     // debug(2, "metadata stop metadata_thread thread.");
@@ -1727,8 +1957,8 @@ void metadata_stop(void) {
   }
 }
 
-int send_metadata_to_queue(pc_queue *queue, uint32_t type, uint32_t code, char *data,
-                           uint32_t length, rtsp_message *carrier, int block) {
+int send_metadata(uint32_t type, uint32_t code, char *data, uint32_t length, rtsp_message *carrier,
+                  __attribute__((unused)) int block) {
 
   // parameters: type, code, pointer to data or NULL, length of data or NULL,
   // the rtsp_message or
@@ -1737,8 +1967,8 @@ int send_metadata_to_queue(pc_queue *queue, uint32_t type, uint32_t code, char *
   // and must not be
   // freed until the data has been read. So, it is passed to send_metadata to be
   // retained,
-  // sent to the thread where metadata is processed and released (and probably
-  // freed).
+  // sent to the threads where metadata is processed and released (and probably
+  // freed) by the last of them.
 
   // The rtsp_message is also sent for certain non-'core' messages.
 
@@ -1746,15 +1976,18 @@ int send_metadata_to_queue(pc_queue *queue, uint32_t type, uint32_t code, char *
   // If the rtsp_message field is non-null, then it represents an rtsp_message
   // and the data pointer is assumed to point to something within it.
   // The reference counter of the rtsp_message is incremented here and
-  // should be decremented by the metadata handler when finished.
+  // is decremented when every metadata handler has finished with it.
   // If the reference count reduces to zero, the message will be freed.
 
   // If the rtsp_message is NULL, then if the pointer is non-null then the data it
-  // points to, of the length specified, is memcpy'd and passed to the metadata
-  // handler. The handler should free it when done.
+  // points to, of the length specified, is memcpy'd once and shared by the metadata
+  // handlers. It is freed when they are all done.
   // If the rtsp_message is NULL and the pointer is also NULL, nothing further
   // is done.
 
+  // block is no longer used -- adding an item never waits. If the slowest handler has
+  // fallen a whole ring behind, the item is dropped.
+
   metadata_package pack;
   pack.type = type;
   pack.code = code;
@@ -1767,22 +2000,19 @@ int send_metadata_to_queue(pc_queue *queue, uint32_t type, uint32_t code, char *
     if (data)
       pack.data = memdup(data, length); // only if it's not a null
   }
-  int rc = pc_queue_add_item(queue, &pack, block);
+  int rc = metadata_ring_add(&pack);
   if (rc != 0) {
     if (pack.carrier) {
       if (rc == EWOULDBLOCK)
         debug(2,
-              "metadata queue \"%s\" full, dropping message item: type %x, code %x, data %x, "
+              "metadata ring full, dropping message item: type %x, code %x, data %x, "
               "length %u, message %d.",
-              queue->name, pack.type, pack.code, pack.data, pack.length,
-              pack.carrier->index_number);
+              pack.type, pack.code, pack.data, pack.length, pack.carrier->index_number);
       msg_free(&pack.carrier);
     } else {
       if (rc == EWOULDBLOCK)
-        debug(
-            2,
-            "metadata queue \"%s\" full, dropping data item: type %x, code %x, data %x, length %u.",
-            queue->name, pack.type, pack.code, pack.data, pack.length);
+        debug(2, "metadata ring full, dropping data item: type %x, code %x, data %x, length %u.",
+              pack.type, pack.code, pack.data, pack.length);
       if (pack.data)
         free(pack.data);
     }
@@ -1790,22 +2020,6 @@ int send_metadata_to_queue(pc_queue *queue, uint32_t type, uint32_t code, char *
   return rc;
 }
 
-int send_metadata(uint32_t type, uint32_t code, char *data, uint32_t length, rtsp_message *carrier,
-                  int block) {
-  int rc;
-  rc = send_metadata_to_queue(&metadata_queue, type, code, data, length, carrier, block);
-
-#ifdef CONFIG_METADATA_HUB
-  rc = send_metadata_to_queue(&metadata_hub_queue, type, code, data, length, carrier, block);
-#endif
-
-#ifdef CONFIG_MQTT
-  rc = send_metadata_to_queue(&metadata_mqtt_queue, type, code, data, length, carrier, block);
-#endif
-
-  return rc;
-}
-
 static void handle_set_parameter_metadata(__attribute__((unused)) rtsp_conn_info *conn,
                                           rtsp_message *req,
                                           __attribute__((unused)) rtsp_message *resp) {
@@ -1851,7 +2065,7 @@ static void handle_get_parameter(__attribute__((unused)) rtsp_conn_info *conn, r
     char *p = malloc(128); // will be automatically deallocated with the response is deleted
     if (p) {
       resp->content = p;
-      resp->contentlength = snprintf(p, 128, "\r\nvolume: %.6f\r\n", config.airplay_volume);
+      resp->contentlength = snprintf(p, 128, "volume: %.6f\r\n", config.airplay_volume);
     } else {
       debug(1, "Couldn't allocate space for a response.");
     }
@@ -1975,6 +2189,7 @@ static void handle_announce(rtsp_conn_info *conn, rtsp_message *req, rtsp_messag
     debug(2, "Connection %d: ANNOUNCE: asking playing connection %d to shut down.",
           conn->connection_number, playing_conn->connection_number);
     playing_conn->stop = 1;
+    playing_conn->handover_requested = 1; // so it can leave the output device open for this one
     interrupting_current_session = 1;
     should_wait = 1;
     pthread_cancel(playing_conn->thread); // asking the RTSP thread to exit
@@ -1982,21 +2197,20 @@ static void handle_announce(rtsp_conn_info *conn, rtsp_message *req, rtsp_messag
   debug_mutex_unlock(&playing_conn_lock, 3);
 
   if (should_wait) {
-    int time_remaining = 3000000; // must be signed, as it could go negative...
-
-    while ((time_remaining > 0) && (have_the_player == 0)) {
-      debug_mutex_lock(&playing_conn_lock, 1000000, 3); // get it
-      if (playing_conn == NULL) {
-        playing_conn = conn;
-        have_the_player = 1;
-      }
-      debug_mutex_unlock(&playing_conn_lock, 3);
-
-      if (have_the_player == 0) {
-        usleep(100000);
-        time_remaining -= 100000;
-      }
+    // wait for up to three seconds for the player to be let go, taking it as soon as it is
+    struct timespec time_of_wakeup;
+    clock_gettime(CLOCK_REALTIME, &time_of_wakeup); // the clock of playing_conn_released
+    time_of_wakeup.tv_sec += 3;
+    int rc = 0;
+    pthread_cleanup_debug_mutex_lock(&playing_conn_lock, 1000000, 3); // get it
+    while ((playing_conn != NULL) && (rc != ETIMEDOUT))
+      rc = pthread_cond_timedwait(&playing_conn_released, &playing_conn_lock,
+                                  &time_of_wakeup); // a cancellation point
+    if (playing_conn == NULL) {
+      playing_conn = conn;
+      have_the_player = 1;
     }
+    pthread_cleanup_pop(1); // release the lock
 
     if ((have_the_player == 1) && (interrupting_current_session == 1)) {
       debug(2, "Connection %d: ANNOUNCE got the player", conn->connection_number);
@@ -2241,8 +2455,10 @@ out:
     debug(1, "Connection %d: Error in handling ANNOUNCE. Unlocking the play lock.",
           conn->connection_number);
     debug_mutex_lock(&playing_conn_lock, 1000000, 3); // get it
-    if (playing_conn == conn)                         // if we managed to acquire it
+    if (playing_conn == conn) {                       // if we managed to acquire it
       playing_conn = NULL;                            // let it go
+      pthread_cond_broadcast(&playing_conn_released);
+    }
     debug_mutex_unlock(&playing_conn_lock, 3);
   }
 }
@@ -2260,14 +2476,14 @@ static struct method_handler {
                        {"RECORD", handle_record},
                        {NULL, NULL}};
 
-static void apple_challenge(int fd, rtsp_message *req, rtsp_message *resp) {
+// The local address that goes into the response is the one noted when the connection was
+// accepted, so there's no need to ask the kernel for it again on every challenge.
+static void apple_challenge(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp) {
   char *hdr = msg_get_header(req, "Apple-Challenge");
   if (!hdr)
     return;
 
-  SOCKADDR fdsa;
-  socklen_t sa_len = sizeof(fdsa);
-  getsockname(fd, (struct sockaddr *)&fdsa, &sa_len);
+  SOCKADDR *fdsa = (SOCKADDR *)&conn->local;
 
   int chall_len;
   uint8_t *chall = base64_dec(hdr, &chall_len);
@@ -2287,14 +2503,14 @@ static void apple_challenge(int fd, rtsp_message *req, rtsp_message *resp) {
   bp += chall_len;
 
 #ifdef AF_INET6
-  if (fdsa.SAFAMILY == AF_INET6) {
-    struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *)(&fdsa);
+  if (fdsa->SAFAMILY == AF_INET6) {
+    struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *)fdsa;
     memcpy(bp, sa6->sin6_addr.s6_addr, 16);
     bp += 16;
   } else
 #endif
   {
-    struct sockaddr_in *sa = (struct sockaddr_in *)(&fdsa);
+    struct sockaddr_in *sa = (struct sockaddr_in *)fdsa;
     memcpy(bp, &sa->sin_addr.s_addr, 4);
     bp += 4;
   }
@@ -2524,6 +2740,7 @@ void rtsp_conversation_thread_cleanup_function(void *arg) {
   if (conn->player_thread)
     player_stop(conn);
 
+  packet_capture_stop(conn);
   debug(3, "Closing timing, control and audio sockets...");
   if (conn->control_socket)
     close(conn->control_socket);
@@ -2541,6 +2758,14 @@ void rtsp_conversation_thread_cleanup_function(void *arg) {
     free(conn->auth_nonce);
     conn->auth_nonce = NULL;
   }
+  if (conn->rtsp_buffer) {
+    free(conn->rtsp_buffer);
+    conn->rtsp_buffer = NULL;
+  }
+  if (conn->rtsp_unsent) {
+    free(conn->rtsp_unsent);
+    conn->rtsp_unsent = NULL;
+  }
   rtp_terminate(conn);
 
   if (conn->dacp_id) {
@@ -2562,12 +2787,31 @@ void rtsp_conversation_thread_cleanup_function(void *arg) {
   if (rc)
     debug(1, "Connection %d: error %d destroying flow control condition variable.",
           conn->connection_number, rc);
+  rc = pthread_cond_destroy(&conn->timing_sender_cond);
+  if (rc)
+    debug(1, "Connection %d: error %d destroying timing sender condition variable.",
+          conn->connection_number, rc);
+  rc = pthread_mutex_destroy(&conn->timing_sender_mutex);
+  if (rc)
+    debug(1, "Connection %d: error %d destroying timing_sender_mutex.", conn->connection_number,
+          rc);
   rc = pthread_mutex_destroy(&conn->ab_mutex);
   if (rc)
     debug(1, "Connection %d: error %d destroying ab_mutex.", conn->connection_number, rc);
   rc = pthread_mutex_destroy(&conn->flush_mutex);
   if (rc)
     debug(1, "Connection %d: error %d destroying flush_mutex.", conn->connection_number, rc);
+  rc = pthread_cond_destroy(&conn->decoder_cond);
+  if (rc)
+    debug(1, "Connection %d: error %d destroying decoder condition variable.",
+          conn->connection_number, rc);
+  rc = pthread_mutex_destroy(&conn->decoder_mutex);
+  if (rc)
+    debug(1, "Connection %d: error %d destroying decoder_mutex.", conn->connection_number, rc);
+  rc = pthread_mutex_destroy(&conn->lookahead_decode_mutex);
+  if (rc)
+    debug(1, "Connection %d: error %d destroying lookahead_decode_mutex.", conn->connection_number,
+          rc);
 
   debug(3, "Cancel watchdog thread.");
   pthread_cancel(conn->player_watchdog_thread);
@@ -2581,6 +2825,7 @@ void rtsp_conversation_thread_cleanup_function(void *arg) {
   if (playing_conn == conn) {                       // if it's ours
     debug(3, "Connection %d: Unlocking play lock.", conn->connection_number);
     playing_conn = NULL; // let it go
+    pthread_cond_broadcast(&playing_conn_released);
   }
   debug_mutex_unlock(&playing_conn_lock, 3);
 
@@ -2589,19 +2834,89 @@ void rtsp_conversation_thread_cleanup_function(void *arg) {
   pthread_setcancelstate(oldState, NULL);
 }
 
-void msg_cleanup_function(void *arg) {
-  // debug(3, "msg_cleanup_function called.");
-  msg_free((rtsp_message **)arg);
-}
+// Respond to a request, on the conversation thread or, for the requests it deals with itself, on
+// the listen loop's thread.
+static void rtsp_respond(rtsp_conn_info *conn, rtsp_message *req) {
+  int debug_level = 3; // for printing the request and response
+  char *hdr = NULL;
+  rtsp_message *resp = msg_init();
+  pthread_cleanup_push(msg_cleanup_function, (void *)&resp);
+  resp->respcode = 400;
+
+  if (strcmp(req->method, "OPTIONS") !=
+      0) // the options message is very common, so don't log it until level 3
+    debug_level = 2;
+  debug(debug_level,
+        "Connection %d: Received an RTSP Packet of type \"%s\":", conn->connection_number,
+        req->method),
+      debug_print_msg_headers(debug_level, req);
+
+  apple_challenge(conn, req, resp);
+  hdr = msg_get_header(req, "CSeq");
+  if (hdr)
+    msg_add_header(resp, "CSeq", hdr);
+  //      msg_add_header(resp, "Audio-Jack-Status", "connected; type=analog");
+  msg_add_static_header(resp, "Server", "AirTunes/105.1");
+
+  if ((conn->authorized == 1) || (rtsp_auth(&conn->auth_nonce, req, resp)) == 0) {
+    conn->authorized = 1; // it must have been authorized or didn't need a password
+    struct method_handler *mh;
+    int method_selected = 0;
+    for (mh = method_handlers; mh->method; mh++) {
+      if (!strcmp(mh->method, req->method)) {
+        method_selected = 1;
+        mh->handler(conn, req, resp);
+        break;
+      }
+    }
+    if (method_selected == 0) {
+      debug(3, "Connection %d: Unrecognised and unhandled rtsp request \"%s\".",
+            conn->connection_number, req->method);
 
-static void *rtsp_conversation_thread_func(void *pconn) {
-  rtsp_conn_info *conn = pconn;
+      int y = req->contentlength;
+      if (y > 0) {
+        char obf[4096];
+        if (y > 4096)
+          y = 4096;
+        char *p = req->content;
+        char *obfp = obf;
+        int obfc;
+        for (obfc = 0; obfc < y; obfc++) {
+          snprintf(obfp, 3, "%02X", (unsigned int)*p);
+          p++;
+          obfp += 2;
+        };
+        *obfp = 0;
+        debug(3, "Content: \"%s\".", obf);
+      }
+    }
+  }
+  debug(debug_level, "Connection %d: RTSP Response:", conn->connection_number);
+  debug_print_msg_headers(debug_level, resp);
 
-  // create the watchdog mutex, initialise the watchdog time and start the watchdog thread;
-  conn->watchdog_bark_time = get_absolute_time_in_ns();
-  pthread_mutex_init(&conn->watchdog_mutex, NULL);
-  pthread_create(&conn->player_watchdog_thread, NULL, &player_watchdog_thread_code, (void *)conn);
+  if (conn->stop == 0) {
+    int err = msg_write_response(conn, resp);
+    if (err) {
+      debug(1,
+            "Connection %d: Unable to write an RTSP message response. Terminating the "
+            "connection.",
+            conn->connection_number);
+      struct linger so_linger;
+      so_linger.l_onoff = 1; // "true"
+      so_linger.l_linger = 0;
+      err = setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &so_linger, sizeof so_linger);
+      if (err)
+        debug(1, "Could not set the RTSP socket to abort due to a write error on closing.");
+      conn->stop = 1;
+      // if (debuglev >= 1)
+      //  debuglev = 3; // see what happens next
+    }
+  }
+  pthread_cleanup_pop(1);
+}
 
+// the mutexes and condition variables a connection needs for playing
+void rtsp_conn_initialise_locks(rtsp_conn_info *conn) {
   int rc = pthread_mutex_init(&conn->flush_mutex, NULL);
   if (rc)
     die("Connection %d: error %d initialising flush_mutex.", conn->connection_number, rc);
@@ -2614,107 +2929,72 @@ static void *rtsp_conversation_thread_func(void *pconn) {
   pthread_condattr_init(&attr);
   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // can't do this in OS X, and don't need it.
   rc = pthread_cond_init(&conn->flowcontrol, &attr);
+  if (rc == 0)
+    rc = pthread_cond_init(&conn->timing_sender_cond, &attr);
+  pthread_condattr_destroy(&attr);
 #endif
 #ifdef COMPILE_FOR_OSX
   rc = pthread_cond_init(&conn->flowcontrol, NULL);
+  if (rc == 0)
+    rc = pthread_cond_init(&conn->timing_sender_cond, NULL);
 #endif
   if (rc)
-    die("Connection %d: error %d initialising flow control condition variable.",
+    die("Connection %d: error %d initialising flow control condition variables.",
         conn->connection_number, rc);
+  rc = pthread_mutex_init(&conn->timing_sender_mutex, NULL);
+  if (rc)
+    die("Connection %d: error %d initialising timing_sender_mutex.", conn->connection_number, rc);
+  conn->timing_sender_wakeup_requested = 0;
   rc = pthread_mutex_init(&conn->volume_control_mutex, NULL);
   if (rc)
     die("Connection %d: error %d initialising volume_control_mutex.", conn->connection_number, rc);
+  rc = pthread_mutex_init(&conn->decoder_mutex, NULL);
+  if (rc)
+    die("Connection %d: error %d initialising decoder_mutex.", conn->connection_number, rc);
+  rc = pthread_cond_init(&conn->decoder_cond, NULL);
+  if (rc)
+    die("Connection %d: error %d initialising decoder condition variable.",
+        conn->connection_number, rc);
+  rc = pthread_mutex_init(&conn->lookahead_decode_mutex, NULL);
+  if (rc)
+    die("Connection %d: error %d initialising lookahead_decode_mutex.", conn->connection_number,
+        rc);
+}
+
+static void *rtsp_conversation_thread_func(void *pconn) {
+  rtsp_conn_info *conn = pconn;
+  char thread_name[16];
+  snprintf(thread_name, sizeof(thread_name), "rtsp-%d", conn->connection_number);
+  thread_set_name(thread_name);
+
+  // create the watchdog mutex, initialise the watchdog time and start the watchdog thread;
+  conn->watchdog_bark_time = get_absolute_time_in_ns();
+  pthread_mutex_init(&conn->watchdog_mutex, NULL);
+  pthread_create(&conn->player_watchdog_thread, NULL, &player_watchdog_thread_code, (void *)conn);
+
+  rtsp_conn_initialise_locks(conn);
 
   // nothing before this is cancellable
   pthread_cleanup_push(rtsp_conversation_thread_cleanup_function, (void *)conn);
 
   rtp_initialise(conn);
-  char *hdr = NULL;
+
+  // with a deferred startup, the backend may not be ready yet
+  wait_for_startup_to_complete();
 
   enum rtsp_read_request_response reply;
 
   int rtsp_read_request_attempt_count = 1; // 1 means exit immediately
-  rtsp_message *req, *resp;
+  rtsp_message *req;
+
+  if ((conn->rtsp_unsent != NULL) && (rtsp_write_unsent(conn) != 0))
+    conn->stop = 1;
 
   while (conn->stop == 0) {
-    int debug_level = 3; // for printing the request and response
     reply = rtsp_read_request(conn, &req);
     if (reply == rtsp_read_request_response_ok) {
       pthread_cleanup_push(msg_cleanup_function, (void *)&req);
-      resp = msg_init();
-      pthread_cleanup_push(msg_cleanup_function, (void *)&resp);
-      resp->respcode = 400;
-
-      if (strcmp(req->method, "OPTIONS") !=
-          0) // the options message is very common, so don't log it until level 3
-        debug_level = 2;
-      debug(debug_level,
-            "Connection %d: Received an RTSP Packet of type \"%s\":", conn->connection_number,
-            req->method),
-          debug_print_msg_headers(debug_level, req);
-
-      apple_challenge(conn->fd, req, resp);
-      hdr = msg_get_header(req, "CSeq");
-      if (hdr)
-        msg_add_header(resp, "CSeq", hdr);
-      //      msg_add_header(resp, "Audio-Jack-Status", "connected; type=analog");
-      msg_add_header(resp, "Server", "AirTunes/105.1");
-
-      if ((conn->authorized == 1) || (rtsp_auth(&conn->auth_nonce, req, resp)) == 0) {
-        conn->authorized = 1; // it must have been authorized or didn't need a password
-        struct method_handler *mh;
-        int method_selected = 0;
-        for (mh = method_handlers; mh->method; mh++) {
-          if (!strcmp(mh->method, req->method)) {
-            method_selected = 1;
-            mh->handler(conn, req, resp);
-            break;
-          }
-        }
-        if (method_selected == 0) {
-          debug(3, "Connection %d: Unrecognised and unhandled rtsp request \"%s\".",
-                conn->connection_number, req->method);
-
-          int y = req->contentlength;
-          if (y > 0) {
-            char obf[4096];
-            if (y > 4096)
-              y = 4096;
-            char *p = req->content;
-            char *obfp = obf;
-            int obfc;
-            for (obfc = 0; obfc < y; obfc++) {
-              snprintf(obfp, 3, "%02X", (unsigned int)*p);
-              p++;
-              obfp += 2;
-            };
-            *obfp = 0;
-            debug(3, "Content: \"%s\".", obf);
-          }
-        }
-      }
-      debug(debug_level, "Connection %d: RTSP Response:", conn->connection_number);
-      debug_print_msg_headers(debug_level, resp);
-
-      if (conn->stop == 0) {
-        int err = msg_write_response(conn->fd, resp);
-        if (err) {
-          debug(1,
-                "Connection %d: Unable to write an RTSP message response. Terminating the "
-                "connection.",
-                conn->connection_number);
-          struct linger so_linger;
-          so_linger.l_onoff = 1; // "true"
-          so_linger.l_linger = 0;
-          err = setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &so_linger, sizeof so_linger);
-          if (err)
-            debug(1, "Could not set the RTSP socket to abort due to a write error on closing.");
-          conn->stop = 1;
-          // if (debuglev >= 1)
-          //  debuglev = 3; // see what happens next
-        }
-      }
-      pthread_cleanup_pop(1);
+      rtsp_respond(conn, req);
       pthread_cleanup_pop(1);
     } else {
       int tstop = 0;
@@ -2793,11 +3073,141 @@ static const char *format_address(struct sockaddr *fsa) {
 }
 */
 
+// A new connection is looked after by the listen loop, without a thread of its own, until a
+// request arrives that it can't answer straight away. Only then is a conversation thread started
+// for it. Thus the OPTIONS and GET_PARAMETER requests that clients send to see if the device is
+// still there don't cost any threads at all.
+static rtsp_conn_info **listen_loop_conns = NULL;
+static int listen_loop_nconns = 0;
+static struct pollfd *listen_loop_pfds = NULL; // the listening sockets, then the connections
+
+enum rtsp_buffered_request_type {
+  rtsp_buffered_request_none,    // no whole request yet
+  rtsp_buffered_request_quick,   // the listen loop can answer it
+  rtsp_buffered_request_session, // it needs a conversation thread
+};
+
+static enum rtsp_buffered_request_type rtsp_buffered_request(rtsp_conn_info *conn) {
+  const char *buf = conn->rtsp_buffer;
+  ssize_t inbuf = conn->rtsp_buffer_occupancy;
+  int quick = ((inbuf >= 8) && (strncmp(buf, "OPTIONS ", 8) == 0)) ||
+              ((inbuf >= 14) && (strncmp(buf, "GET_PARAMETER ", 14) == 0));
+  if ((quick == 0) && ((inbuf >= 14) || (memchr(buf, '\n', inbuf) != NULL)))
+    return rtsp_buffered_request_session;
+  ssize_t i, header_end = rtsp_header_length(buf, inbuf);
+  if (header_end < 0)
+    return inbuf == RTSP_BUFFER_SIZE ? rtsp_buffered_request_session : rtsp_buffered_request_none;
+  long content_length = 0;
+  // header names are case-insensitive, and strtol skips any whitespace before the value
+  for (i = 1; i + 15 < header_end; i++)
+    if ((buf[i - 1] == '\n') && (strncasecmp(buf + i, "Content-Length:", 15) == 0))
+      content_length = strtol(buf + i + 15, NULL, 10);
+  if ((content_length < 0) || (header_end + content_length > RTSP_BUFFER_SIZE))
+    return rtsp_buffered_request_session; // it's not going to fit, so let a thread deal with it
+  if (header_end + content_length > inbuf)
+    return rtsp_buffered_request_none;
+  return rtsp_buffered_request_quick;
+}
+
+static void listen_loop_conn_free(rtsp_conn_info *conn) {
+  debug(3, "Connection %d: closed by the listen loop.", conn->connection_number);
+  close(conn->fd);
+  if (conn->auth_nonce)
+    free(conn->auth_nonce);
+  if (conn->rtsp_buffer)
+    free(conn->rtsp_buffer);
+  if (conn->rtsp_unsent)
+    free(conn->rtsp_unsent);
+  free(conn);
+}
+
+static void listen_loop_conn_start_thread(rtsp_conn_info *conn) {
+  conn->served_by_listen_loop = 0;
+  // the conversation thread does blocking reads and writes
+  int flags = fcntl(conn->fd, F_GETFL);
+  if ((flags == -1) || (fcntl(conn->fd, F_SETFL, flags & ~O_NONBLOCK) == -1))
+    debug(1, "Connection %d: error %d making the socket block.", conn->connection_number, errno);
+  int ret = pthread_create(&conn->thread, NULL, rtsp_conversation_thread_func,
+                           conn); // also acts as a memory barrier
+  if (ret) {
+    char errorstring[1024];
+    strerror_r(ret, (char *)errorstring, sizeof(errorstring));
+    die("Connection %d: cannot create an RTSP conversation thread. Error %d: \"%s\".",
+        conn->connection_number, ret, (char *)errorstring);
+  }
+  debug(3, "Successfully created RTSP receiver thread %d.", conn->connection_number);
+  conn->running = 1; // this must happen before the thread is tracked
+  track_thread(conn);
+}
+
+// Deal with what has arrived on a connection the listen loop is looking after.
+// Returns 0 if it's still to be looked after, or 1 if it's been closed or passed to a thread.
+static int listen_loop_conn_service(rtsp_conn_info *conn) {
+  ssize_t nread = recv(conn->fd, conn->rtsp_buffer + conn->rtsp_buffer_occupancy,
+                       RTSP_BUFFER_SIZE - conn->rtsp_buffer_occupancy, MSG_DONTWAIT);
+  if (nread == 0) {
+    debug(3, "Connection %d: -- connection closed.", conn->connection_number);
+    listen_loop_conn_free(conn);
+    return 1;
+  }
+  if (nread < 0) {
+    if ((errno == EINTR) || (errno == EAGAIN) || (errno == EWOULDBLOCK))
+      return 0;
+    if (errno != ECONNRESET) {
+      char errorstring[1024];
+      strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+      debug(1, "Connection %d: read error %d: \"%s\".", conn->connection_number, errno,
+            (char *)errorstring);
+    }
+    listen_loop_conn_free(conn);
+    return 1;
+  }
+  conn->rtsp_buffer_occupancy += nread;
+  conn->rtsp_last_activity_time = get_absolute_time_in_ns();
+
+  enum rtsp_buffered_request_type request_type;
+  while ((request_type = rtsp_buffered_request(conn)) == rtsp_buffered_request_quick) {
+    rtsp_message *req;
+    // the whole request is in the buffer, so this won't wait
+    enum rtsp_read_request_response reply = rtsp_read_request(conn, &req);
+    if (reply == rtsp_read_request_response_ok) {
+      pthread_cleanup_push(msg_cleanup_function, (void *)&req);
+      rtsp_respond(conn, req);
+      pthread_cleanup_pop(1);
+    } else {
+      debug(1, "Connection %d: rtsp_read_request error %d.", conn->connection_number, (int)reply);
+      conn->stop = 1;
+    }
+    if (conn->stop) {
+      listen_loop_conn_free(conn);
+      return 1;
+    }
+    // the client isn't keeping up, so let a thread wait for it rather than hold up the loop
+    if (conn->rtsp_unsent != NULL) {
+      request_type = rtsp_buffered_request_session;
+      break;
+    }
+  }
+  if (request_type == rtsp_buffered_request_session) {
+    listen_loop_conn_start_thread(conn);
+    return 1;
+  }
+  return 0;
+}
+
 void rtsp_listen_loop_cleanup_handler(__attribute__((unused)) void *arg) {
   int oldState;
   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
   debug(2, "rtsp_listen_loop_cleanup_handler called.");
   cancel_all_RTSP_threads();
+  int i;
+  for (i = 0; i < listen_loop_nconns; i++)
+    listen_loop_conn_free(listen_loop_conns[i]);
+  listen_loop_nconns = 0;
+  free(listen_loop_conns);
+  listen_loop_conns = NULL;
+  free(listen_loop_pfds);
+  listen_loop_pfds = NULL;
   int *sockfd = (int *)arg;
   mdns_unregister();
   if (sockfd)
@@ -2898,29 +3308,34 @@ void rtsp_listen_loop(void) {
   freeaddrinfo(info);
 
   if (nsock) {
-    int maxfd = -1;
-    fd_set fds;
-    FD_ZERO(&fds);
-    for (i = 0; i < nsock; i++) {
-      if (sockfd[i] > maxfd)
-        maxfd = sockfd[i];
-    }
-
     mdns_register();
 
     pthread_setcancelstate(oldState, NULL);
-    int acceptfd;
-    struct timeval tv;
+    int pfds_size = 0;
     pthread_cleanup_push(rtsp_listen_loop_cleanup_handler, (void *)sockfd);
     do {
       pthread_testcancel();
-      tv.tv_sec = 60;
-      tv.tv_usec = 0;
 
-      for (i = 0; i < nsock; i++)
-        FD_SET(sockfd[i], &fds);
+      int npfds = nsock + listen_loop_nconns;
+      if (npfds > pfds_size) {
+        listen_loop_pfds = realloc(listen_loop_pfds, npfds * sizeof(struct pollfd));
+        if (listen_loop_pfds == NULL)
+          die("could not reallocate memory for \"listen_loop_pfds\" in rtsp.c.");
+        pfds_size = npfds;
+      }
+      for (i = 0; i < nsock; i++) {
+        listen_loop_pfds[i].fd = sockfd[i];
+        listen_loop_pfds[i].events = POLLIN;
+        listen_loop_pfds[i].revents = 0;
+      }
+      for (i = 0; i < listen_loop_nconns; i++) {
+        listen_loop_pfds[nsock + i].fd = listen_loop_conns[i]->fd;
+        listen_loop_pfds[nsock + i].events = POLLIN;
+        listen_loop_pfds[nsock + i].revents = 0;
+      }
 
-      ret = select(maxfd + 1, &fds, 0, 0, &tv);
+      // wake up once a second to check for idle connections, if there are any
+      ret = poll(listen_loop_pfds, npfds, listen_loop_nconns ? 1000 : 60000);
       if (ret < 0) {
         if (errno == EINTR)
           continue;
@@ -2929,14 +3344,35 @@ void rtsp_listen_loop(void) {
 
       cleanup_threads();
 
-      acceptfd = -1;
+      // look after the connections already being served, from the last so that any that goes can
+      // be replaced by the last one
+      uint64_t time_now = get_absolute_time_in_ns();
+      for (i = listen_loop_nconns - 1; i >= 0; i--) {
+        rtsp_conn_info *conn = listen_loop_conns[i];
+        int gone = 0;
+        if (listen_loop_pfds[nsock + i].revents != 0) {
+          gone = listen_loop_conn_service(conn);
+        } else if ((config.dont_check_timeout == 0) && (config.timeout != 0) &&
+                   (time_now - conn->rtsp_last_activity_time >
+                    (uint64_t)config.timeout * 1000000000)) {
+          debug(2, "Connection %d: closing idle connection.", conn->connection_number);
+          listen_loop_conn_free(conn);
+          gone = 1;
+        }
+        if (gone) {
+          listen_loop_nconns--;
+          listen_loop_conns[i] = listen_loop_conns[listen_loop_nconns];
+        }
+      }
+
+      int acceptfd = -1;
       for (i = 0; i < nsock; i++) {
-        if (FD_ISSET(sockfd[i], &fds)) {
+        if (listen_loop_pfds[i].revents & POLLIN) {
           acceptfd = sockfd[i];
           break;
         }
       }
-      if (acceptfd < 0) // timeout
+      if (acceptfd < 0) // timeout, or only existing connections to look after
         continue;
 
       rtsp_conn_info *conn = malloc(sizeof(rtsp_conn_info));
@@ -2993,24 +3429,21 @@ void rtsp_listen_loop(void) {
         } else {
           debug(1, "Error figuring out Shairport Sync's own IP number.");
         }
-        //      usleep(500000);
-        //      pthread_t rtsp_conversation_thread;
-        //      conn->thread = rtsp_conversation_thread;
-        //      conn->stop = 0; // record's memory has been zeroed
-        //      conn->authorized = 0; // record's memory has been zeroed
-        // fcntl(conn->fd, F_SETFL, O_NONBLOCK);
-
-        ret = pthread_create(&conn->thread, NULL, rtsp_conversation_thread_func,
-                             conn); // also acts as a memory barrier
-        if (ret) {
-          char errorstring[1024];
-          strerror_r(ret, (char *)errorstring, sizeof(errorstring));
-          die("Connection %d: cannot create an RTSP conversation thread. Error %d: \"%s\".",
-              conn->connection_number, ret, (char *)errorstring);
-        }
-        debug(3, "Successfully created RTSP receiver thread %d.", conn->connection_number);
-        conn->running = 1; // this must happen before the thread is tracked
-        track_thread(conn);
+        conn->rtsp_buffer = malloc(RTSP_BUFFER_SIZE);
+        if (conn->rtsp_buffer == NULL)
+          die("Couldn't allocate memory for an RTSP connection buffer.");
+        // the listen loop mustn't wait for any one client
+        int flags = fcntl(conn->fd, F_GETFL);
+        if ((flags == -1) || (fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) == -1))
+          debug(1, "Connection %d: error %d making the socket non-blocking.",
+                conn->connection_number, errno);
+        conn->served_by_listen_loop = 1;
+        conn->rtsp_last_activity_time = get_absolute_time_in_ns();
+        listen_loop_conns =
+            realloc(listen_loop_conns, sizeof(rtsp_conn_info *) * (listen_loop_nconns + 1));
+        if (listen_loop_conns == NULL)
+          die("could not reallocate memory for \"listen_loop_conns\" in rtsp.c.");
+        listen_loop_conns[listen_loop_nconns++] = conn;
       }
     } while (1);
     pthread_cleanup_pop(1); // should never happen
@@ -12,6 +12,8 @@ void rtsp_request_shutdown_stream(void);
 
 void cancel_all_RTSP_threads(void);
 
+void rtsp_conn_initialise_locks(rtsp_conn_info *conn);
+
 // initialise and completely delete the metadata stuff
 
 void metadata_init(void);
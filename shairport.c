@@ -28,16 +28,20 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <libconfig.h>
 #include <libgen.h>
+#include <math.h>
 #include <memory.h>
 #include <net/if.h>
 #include <popt.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/utsname.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -61,8 +65,12 @@
 #endif
 
 #include "activity_monitor.h"
+#include "metrics.h"
 #include "audio.h"
 #include "common.h"
+#include "eq.h"
+#include "packet_capture.h"
+#include "realtime.h"
 #include "rtp.h"
 #include "rtsp.h"
 
@@ -111,6 +119,9 @@ int this_is_the_daemon_process = 0;
 #endif
 
 int killOption = 0;
+int benchmarkOption = 0;
+char *replayFile = NULL;
+int replaySpeed = 1;
 int daemonisewith = 0;
 int daemonisewithout = 0;
 
@@ -131,7 +142,82 @@ void print_version(void) {
 }
 #ifdef CONFIG_SOXR
 pthread_t soxr_time_check_thread;
+int soxr_time_check_thread_started = 0;
+
+// What the soxr delay index was measured for, so that a cached one can be checked: the version of
+// Shairport Sync, the version of libsoxr in use, which can be upgraded separately, and the machine.
+static void soxr_benchmark_key(char *key, size_t size) {
+  struct utsname name;
+  char *version = get_version_string();
+  if (uname(&name) != 0)
+    strcpy(name.machine, "unknown");
+  snprintf(key, size, "%s %s %s %ld", version ? version : "unknown", soxr_version(), name.machine,
+           sysconf(_SC_NPROCESSORS_ONLN));
+  if (version)
+    free(version);
+}
+
+// returns 1 if a soxr delay index for this build on this machine has been cached
+static int soxr_benchmark_cache_read(void) {
+  int response = 0;
+  if ((config.soxr_benchmark_cache_file != NULL) && (config.soxr_benchmark_cache_file[0] != '\0')) {
+    FILE *f = fopen(config.soxr_benchmark_cache_file, "r");
+    if (f) {
+      char key[512], cached_key[512];
+      int index;
+      soxr_benchmark_key(key, sizeof(key));
+      if ((fgets(cached_key, sizeof(cached_key), f) != NULL) && (fscanf(f, "%d", &index) == 1)) {
+        cached_key[strcspn(cached_key, "\n")] = '\0';
+        if ((strcmp(key, cached_key) == 0) && (index > 0)) {
+          config.soxr_delay_index = index;
+          response = 1;
+        } else {
+          debug(2, "the cached soxr delay index is for \"%s\" and is out of date.", cached_key);
+        }
+      }
+      fclose(f);
+    }
+  }
+  return response;
+}
+
+static void soxr_benchmark_cache_write(void) {
+  if ((config.soxr_benchmark_cache_file != NULL) && (config.soxr_benchmark_cache_file[0] != '\0')) {
+    char *dirc = strdup(config.soxr_benchmark_cache_file);
+    if (dirc) {
+      mkpath(dirname(dirc), 0755);
+      free(dirc);
+    }
+    FILE *f = fopen(config.soxr_benchmark_cache_file, "w");
+    if (f) {
+      char key[512];
+      soxr_benchmark_key(key, sizeof(key));
+      fprintf(f, "%s\n%d\n", key, config.soxr_delay_index);
+      fclose(f);
+    } else {
+      debug(1, "can't cache the soxr delay index in \"%s\".", config.soxr_benchmark_cache_file);
+    }
+  }
+}
+
+static void soxr_delay_index_known(void) {
+  if ((config.packet_stuffing == ST_soxr) &&
+      (config.soxr_delay_index > config.soxr_delay_threshold))
+    inform("Note: this device may be too slow for \"soxr\" interpolation. Consider choosing the "
+           "\"basic\" or \"auto\" interpolation setting.");
+  if (config.packet_stuffing == ST_auto)
+    debug(1, "\"%s\" interpolation has been chosen.",
+          config.soxr_delay_index <= config.soxr_delay_threshold ? "soxr" : "basic");
+}
+
 void *soxr_time_check(__attribute__((unused)) void *arg) {
+  thread_set_name("soxr-check");
+  if (soxr_benchmark_cache_read()) {
+    debug(2, "soxr_delay_index: %d, from \"%s\".", config.soxr_delay_index,
+          config.soxr_benchmark_cache_file);
+    soxr_delay_index_known();
+    pthread_exit(NULL);
+  }
   const int buffer_length = 352;
   int32_t inbuffer[buffer_length * 2];
   int32_t outbuffer[(buffer_length + 1) * 2];
@@ -192,16 +278,16 @@ void *soxr_time_check(__attribute__((unused)) void *arg) {
   // free(inbuffer);
   config.soxr_delay_index = (int)(0.9 + soxr_execution_time_ns / (number_of_iterations * 1000000));
   debug(2, "soxr_delay_index: %d.", config.soxr_delay_index);
-  if ((config.packet_stuffing == ST_soxr) &&
-      (config.soxr_delay_index > config.soxr_delay_threshold))
-    inform("Note: this device may be too slow for \"soxr\" interpolation. Consider choosing the "
-           "\"basic\" or \"auto\" interpolation setting.");
-  if (config.packet_stuffing == ST_auto)
-    debug(1, "\"%s\" interpolation has been chosen.",
-          config.soxr_delay_index <= config.soxr_delay_threshold ? "soxr" : "basic");
+  soxr_benchmark_cache_write();
+  soxr_delay_index_known();
   pthread_exit(NULL);
 }
 
+static void soxr_time_check_start(void) {
+  if (pthread_create(&soxr_time_check_thread, NULL, &soxr_time_check, NULL) == 0)
+    soxr_time_check_thread_started = 1;
+}
+
 #endif
 
 void usage(char *progname) {
@@ -234,8 +320,10 @@ void usage(char *progname) {
          "packet frames with low processor overhead, and \n");
   printf("                            \"soxr\" uses libsoxr to minimally resample packet frames -- "
          "moderate processor overhead.\n");
-  printf(
-      "                            \"soxr\" option only available if built with soxr support.\n");
+  printf("                            \"soxr_vr\" keeps a libsoxr resampler running and varies its "
+         "rate slightly -- no frames are inserted or deleted.\n");
+  printf("                            \"soxr\" and \"soxr_vr\" options only available if built "
+         "with soxr support.\n");
   printf("    -B, --on-start=PROGRAM  run PROGRAM when playback is about to begin.\n");
   printf("    -E, --on-stop=PROGRAM   run PROGRAM when playback has ended.\n");
   printf("                            For -B and -E options, specify the full path to the program, "
@@ -256,6 +344,12 @@ void usage(char *progname) {
          "communications of this many seconds (default 120). Set to 0 never to exit play mode.\n");
   printf("    --statistics            print some interesting statistics -- output to the logfile "
          "if running as a daemon.\n");
+  printf("    --benchmark             time the audio processing done for every packet, print the "
+         "results and exit.\n");
+  printf("    --replay=FILE           play the RTP packet capture FILE, made with the diagnostics "
+         "capture_rtp_packets_to setting, instead of waiting for a source, and exit.\n");
+  printf("    --replay-speed=N        replay the capture N times faster than real time (default "
+         "1).\n");
   printf("    --tolerance=TOLERANCE   [Deprecated] allow a synchronization error of TOLERANCE "
          "frames (default "
          "88) before trying to correct it.\n");
@@ -290,6 +384,9 @@ int parse_options(int argc, char **argv) {
   struct poptOption optionsTable[] = {
       {"verbose", 'v', POPT_ARG_NONE, NULL, 'v', NULL, NULL},
       {"kill", 'k', POPT_ARG_NONE, &killOption, 0, NULL, NULL},
+      {"benchmark", 0, POPT_ARG_NONE, &benchmarkOption, 0, NULL, NULL},
+      {"replay", 0, POPT_ARG_STRING, &replayFile, 0, NULL, NULL},
+      {"replay-speed", 0, POPT_ARG_INT, &replaySpeed, 0, NULL, NULL},
       {"daemon", 'd', POPT_ARG_NONE, &daemonisewith, 0, NULL, NULL},
       {"justDaemoniseNoPIDFile", 'j', POPT_ARG_NONE, &daemonisewithout, 0, NULL, NULL},
       {"configfile", 'c', POPT_ARG_STRING, &config.configfile, 0, NULL, NULL},
@@ -400,6 +497,9 @@ int parse_options(int argc, char **argv) {
   config.soxr_delay_threshold = 30; // the soxr measurement time (milliseconds) of two oneshots must
                                     // not exceed this if soxr interpolation is to be chosen
                                     // automatically.
+#ifdef CONFIG_SOXR
+  config.soxr_benchmark_cache_file = "/var/cache/shairport-sync/soxr_benchmark";
+#endif
   config.volume_range_hw_priority =
       0; // if combining software and hardware volume control, give the software priority
          // i.e. when reducing volume, reduce the sw first before reducing the software.
@@ -428,8 +528,13 @@ int parse_options(int argc, char **argv) {
 
 #ifdef CONFIG_CONVOLUTION
   config.convolution_max_length = 8192;
+  config.convolution_block_size = 352;
+  config.convolution_tail_block_size = 0;
 #endif
   config.loudness_reference_volume_db = -20;
+#ifdef CONFIG_FIXED_POINT_DSP
+  config.dsp_fixed_point = 1;
+#endif
 
 #ifdef CONFIG_METADATA_HUB
   config.cover_art_cache_dir = "/tmp/shairport-sync/.cache/coverart";
@@ -519,6 +624,49 @@ int parse_options(int argc, char **argv) {
           config.udp_port_range = value;
       }
 
+      /* Get the receive buffer size for the audio and control sockets. If it isn't given, it's
+       * sized to hold the session's latency of packets. Zero leaves the system's default. */
+      if (config_lookup_int(config.cfg, "general.udp_receive_buffer_size_in_kilobytes", &value)) {
+        if ((value < 0) || (value > 65536))
+          die("Invalid udp_receive_buffer_size_in_kilobytes \"%d\". It should be between 0 and "
+              "65536.",
+              value);
+        else
+          config.udp_receive_buffer_size = value * 1024;
+      }
+
+      /* Get the time to busy-poll the audio socket for packets, in microseconds. */
+      if (config_lookup_int(config.cfg, "general.udp_busy_poll_in_microseconds", &value)) {
+        if ((value < 0) || (value > 1000000))
+          die("Invalid udp_busy_poll_in_microseconds \"%d\". It should be between 0 and "
+              "1000000.",
+              value);
+        else
+          config.udp_busy_poll_time = value;
+      }
+
+      /* Get the DSCP with which to mark resend and timing requests. */
+      if (config_lookup_int(config.cfg, "general.udp_request_dscp", &value)) {
+        if ((value < -1) || (value > 63))
+          die("Invalid udp_request_dscp \"%d\". It should be between 0 and 63, or -1 to leave "
+              "requests unmarked.",
+              value);
+        else
+          config.udp_request_dscp = value;
+      }
+
+      /* Get the audio buffer size setting. This is the number of packets of audio that can be
+       * held, and it must be a power of two. */
+      if (config_lookup_int(config.cfg, "general.audio_buffer_size_in_packets", &value)) {
+        if ((value < MINIMUM_BUFFER_FRAMES) || (value > MAXIMUM_BUFFER_FRAMES) ||
+            ((value & (value - 1)) != 0))
+          die("Invalid audio_buffer_size_in_packets \"%d\". It should be a power of two from %d "
+              "to %d, default is %d.",
+              value, MINIMUM_BUFFER_FRAMES, MAXIMUM_BUFFER_FRAMES, DEFAULT_BUFFER_FRAMES);
+        else
+          config.audio_buffer_size = value;
+      }
+
       /* Get the password setting. */
       if (config_lookup_string(config.cfg, "general.password", &str))
         config.password = (char *)str;
@@ -535,9 +683,18 @@ int parse_options(int argc, char **argv) {
           warn("The soxr option not available because this version of shairport-sync was built "
                "without libsoxr "
                "support. Change the \"general/interpolation\" setting in the configuration file.");
+#endif
+        else if (strcasecmp(str, "soxr_vr") == 0)
+#ifdef CONFIG_SOXR
+          config.packet_stuffing = ST_soxr_vr;
+#else
+          warn("The soxr_vr option not available because this version of shairport-sync was built "
+               "without libsoxr "
+               "support. Change the \"general/interpolation\" setting in the configuration file.");
 #endif
         else
-          die("Invalid interpolation option choice. It should be \"auto\", \"basic\" or \"soxr\"");
+          die("Invalid interpolation option choice. It should be \"auto\", \"basic\", \"soxr\" "
+              "or \"soxr_vr\"");
       }
 
 #ifdef CONFIG_SOXR
@@ -582,6 +739,140 @@ int parse_options(int argc, char **argv) {
       if (config_lookup_float(config.cfg, "general.resync_threshold_in_seconds", &dvalue))
         config.resyncthreshold = dvalue;
 
+      /* Get the deferred startup setting. */
+      if (config_lookup_string(config.cfg, "general.deferred_startup", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.deferred_startup = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.deferred_startup = 1;
+        else
+          die("Invalid deferred_startup option choice \"%s\". It should be \"yes\" or \"no\"",
+              str);
+      }
+
+#ifdef CONFIG_SOXR
+      /* Get the soxr benchmark cache setting. */
+      if (config_lookup_string(config.cfg, "general.soxr_benchmark_cache_file", &str))
+        config.soxr_benchmark_cache_file = (char *)str;
+#endif
+
+      /* Get the sync control setting. */
+      if (config_lookup_string(config.cfg, "general.sync_control", &str)) {
+        if (strcasecmp(str, "pi") == 0)
+          config.sync_control = SC_pi;
+        else if (strcasecmp(str, "tolerance") == 0)
+          config.sync_control = SC_tolerance;
+        else
+          die("Invalid sync_control option choice \"%s\". It should be \"pi\" or \"tolerance\"",
+              str);
+      }
+
+      /* Get the fast start setting. */
+      if (config_lookup_string(config.cfg, "general.fast_start", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.fast_start = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.fast_start = 1;
+        else
+          die("Invalid fast_start option choice \"%s\". It should be \"yes\" or \"no\"", str);
+      }
+
+      /* Get the fast start latency setting. */
+      if (config_lookup_float(config.cfg, "general.fast_start_latency_in_seconds", &dvalue)) {
+        if (dvalue < 0.0)
+          die("Invalid fast_start_latency_in_seconds \"%f\". It can not be negative.", dvalue);
+        config.fast_start_latency = dvalue;
+      }
+
+      /* Get the real-time scheduling settings. */
+      if (config_lookup_string(config.cfg, "general.realtime_scheduling", &str)) {
+        if (strcasecmp(str, "none") == 0)
+          config.realtime_scheduling_policy = SCHED_OTHER;
+        else if (strcasecmp(str, "fifo") == 0)
+          config.realtime_scheduling_policy = SCHED_FIFO;
+        else if (strcasecmp(str, "rr") == 0)
+          config.realtime_scheduling_policy = SCHED_RR;
+        else
+          die("Invalid realtime_scheduling option choice \"%s\". It should be \"none\", "
+              "\"fifo\" or \"rr\"",
+              str);
+      }
+
+      if (config_lookup_int(config.cfg, "general.realtime_priority", &value)) {
+        if ((config.realtime_scheduling_policy != SCHED_OTHER) &&
+            ((value < sched_get_priority_min(config.realtime_scheduling_policy)) ||
+             (value > sched_get_priority_max(config.realtime_scheduling_policy))))
+          die("Invalid realtime_priority %d. It should be between %d and %d.", value,
+              sched_get_priority_min(config.realtime_scheduling_policy),
+              sched_get_priority_max(config.realtime_scheduling_policy));
+        config.realtime_priority = value;
+      }
+
+      config_setting_t *cpu_affinity = config_lookup(config.cfg, "general.realtime_cpu_affinity");
+      if (cpu_affinity) {
+        int cpu_count = config_setting_length(cpu_affinity);
+        int c;
+        config.realtime_cpu_affinity = 0;
+        for (c = 0; c < cpu_count; c++) {
+          int cpu = config_setting_get_int_elem(cpu_affinity, c);
+          if ((cpu < 0) || (cpu > 63))
+            die("Invalid CPU %d in realtime_cpu_affinity. It should be between 0 and 63.", cpu);
+          config.realtime_cpu_affinity |= (uint64_t)1 << cpu;
+        }
+      }
+
+      if (config_lookup_string(config.cfg, "general.lock_memory", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.lock_memory = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.lock_memory = 1;
+        else
+          die("Invalid lock_memory option choice \"%s\". It should be \"yes\" or \"no\"", str);
+      }
+
+      /* Get the low memory setting. */
+      if (config_lookup_string(config.cfg, "general.low_memory", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.low_memory = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.low_memory = 1;
+        else
+          die("Invalid low_memory option choice \"%s\". It should be \"yes\" or \"no\"", str);
+      }
+      if (config.low_memory)
+        config.thread_stack_size = LOW_MEMORY_THREAD_STACK_SIZE;
+
+      /* Get the buffered audio settings. */
+      if (config_lookup_string(config.cfg, "general.buffered_audio", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.buffered_audio = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.buffered_audio = 1;
+        else
+          die("Invalid buffered_audio option choice \"%s\". It should be \"yes\" or \"no\"", str);
+      }
+      // unless it's been given, the audio buffer is made big enough for long latencies
+      if ((config.buffered_audio) &&
+          (config_lookup_int(config.cfg, "general.audio_buffer_size_in_packets", &value) == 0))
+        config.audio_buffer_size = BUFFERED_AUDIO_BUFFER_FRAMES;
+      if (config_lookup_float(config.cfg, "general.buffered_audio_lookahead_in_seconds", &dvalue)) {
+        if ((dvalue < 0.05) || (dvalue > 5.0))
+          die("Invalid buffered_audio_lookahead_in_seconds \"%f\". It should be between 0.05 and "
+              "5.0 seconds.",
+              dvalue);
+        else
+          config.buffered_audio_lookahead = dvalue;
+      }
+
+      /* Get the thread stack size setting. */
+      if (config_lookup_int(config.cfg, "general.thread_stack_size_in_kilobytes", &value)) {
+        if ((value != 0) && (value < 64))
+          die("Invalid thread_stack_size_in_kilobytes setting %d. It should be 0, for the system's "
+              "default, or 64 or more.",
+              value);
+        config.thread_stack_size = (size_t)value * 1024;
+      }
+
       /* Get the verbosity setting. */
       if (config_lookup_int(config.cfg, "general.log_verbosity", &value)) {
         warn("The \"general\" \"log_verbosity\" setting is deprecated. Please use the "
@@ -638,6 +929,38 @@ int parse_options(int argc, char **argv) {
               "should be \"yes\" or \"no\"");
       }
 
+      /* Get the metrics settings. */
+      if (config_lookup_string(config.cfg, "diagnostics.metrics", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.metrics_enabled = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.metrics_enabled = 1;
+        else
+          die("Invalid diagnostics metrics option choice \"%s\". It should be \"yes\" or \"no\"",
+              str);
+      }
+
+      if (config_lookup_int(config.cfg, "diagnostics.metrics_port", &value)) {
+        if ((value < 1) || (value > 65535))
+          die("Invalid diagnostics metrics_port \"%d\". It should be between 1 and 65535, "
+              "default is 9464",
+              value);
+        else
+          config.metrics_port = value;
+      }
+
+      /* Get the asynchronous logging setting. */
+      if (config_lookup_string(config.cfg, "diagnostics.log_asynchronously", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.log_asynchronously = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.log_asynchronously = 1;
+        else
+          die("Invalid diagnostics log_asynchronously option choice \"%s\". It should be "
+              "\"yes\" or \"no\"",
+              str);
+      }
+
       /* Get the statistics setting. */
       if (config_lookup_string(config.cfg, "diagnostics.statistics", &str)) {
         if (strcasecmp(str, "no") == 0)
@@ -675,6 +998,9 @@ int parse_options(int argc, char **argv) {
               dvalue);
       }
 
+      if (config_lookup_string(config.cfg, "diagnostics.capture_rtp_packets_to", &str))
+        config.diagnostic_packet_capture_file = (char *)str;
+
       /* Get the diagnostics output default. */
       if (config_lookup_string(config.cfg, "diagnostics.log_output_to", &str)) {
         if (strcasecmp(str, "syslog") == 0)
@@ -699,6 +1025,17 @@ int parse_options(int argc, char **argv) {
           die("Invalid ignore_volume_control option choice \"%s\". It should be \"yes\" or \"no\"");
       }
 
+      /* Get the dither_noise_shaping setting. */
+      if (config_lookup_string(config.cfg, "general.dither_noise_shaping", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.dither_noise_shaping = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.dither_noise_shaping = 1;
+        else
+          die("Invalid dither_noise_shaping option choice \"%s\". It should be \"yes\" or \"no\"",
+              str);
+      }
+
       /* Get the optional volume_max_db setting. */
       if (config_lookup_float(config.cfg, "general.volume_max_db", &dvalue)) {
         // debug(1, "Max volume setting of %f dB", dvalue);
@@ -882,6 +1219,17 @@ int parse_options(int argc, char **argv) {
         config.metadata_pipename = (char *)str;
       }
 
+      if (config_lookup_string(config.cfg, "metadata.pipe_format", &str)) {
+        if (strcasecmp(str, "xml") == 0)
+          config.metadata_pipe_format = MPF_xml;
+        else if (strcasecmp(str, "binary") == 0)
+          config.metadata_pipe_format = MPF_binary;
+        else
+          die("Invalid metadata pipe_format option choice \"%s\". It should be \"xml\" or "
+              "\"binary\"",
+              str);
+      }
+
       if (config_lookup_string(config.cfg, "metadata.socket_address", &str)) {
         config.metadata_sockaddr = (char *)str;
       }
@@ -892,6 +1240,22 @@ int parse_options(int argc, char **argv) {
       if (config_lookup_int(config.cfg, "metadata.socket_msglength", &value)) {
         config.metadata_sockmsglength = value < 500 ? 500 : value > 65000 ? 65000 : value;
       }
+      config.metadata_socket_rate_limit = 500;
+      if (config_lookup_int(config.cfg, "metadata.socket_rate_limit", &value)) {
+        if (value < 0)
+          die("Invalid metadata socket_rate_limit setting %d. It must be zero or more.", value);
+        config.metadata_socket_rate_limit = value;
+      }
+      if (config_lookup_string(config.cfg, "metadata.socket_sequence_numbers", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.metadata_socket_sequence_numbers = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.metadata_socket_sequence_numbers = 1;
+        else
+          die("Invalid metadata socket_sequence_numbers option choice \"%s\". It should be "
+              "\"yes\" or \"no\"",
+              str);
+      }
 
 #endif
 
@@ -900,6 +1264,15 @@ int parse_options(int argc, char **argv) {
         config.cover_art_cache_dir = (char *)str;
       }
 
+      if (config_lookup_float(config.cfg, "metadata.cover_art_cache_size_limit_in_megabytes",
+                              &dvalue)) {
+        if (dvalue < 0.0)
+          die("Invalid metadata cover_art_cache_size_limit_in_megabytes setting %f. It must be zero "
+              "or greater.",
+              dvalue);
+        config.cover_art_cache_size_limit = (size_t)(dvalue * 1024 * 1024);
+      }
+
       if (config_lookup_string(config.cfg, "diagnostics.retain_cover_art", &str)) {
         if (strcasecmp(str, "no") == 0)
           config.retain_coverart = 0;
@@ -1006,10 +1379,28 @@ int parse_options(int argc, char **argv) {
           die("dsp.convolution_max_length must be within 1 and 200000");
       }
 
+      if (config_lookup_int(config.cfg, "dsp.convolution_block_size", &value)) {
+        config.convolution_block_size = value;
+
+        if (value < 16 || value > 16384)
+          die("dsp.convolution_block_size must be within 16 and 16384");
+      }
+
+      if (config_lookup_int(config.cfg, "dsp.convolution_tail_block_size", &value)) {
+        config.convolution_tail_block_size = value;
+
+        if (value != 0 && (value <= config.convolution_block_size || value > 65536))
+          die("dsp.convolution_tail_block_size must be 0 or greater than "
+              "dsp.convolution_block_size and no more than 65536");
+      }
+
       if (config_lookup_string(config.cfg, "dsp.convolution_ir_file", &str)) {
         config.convolution_ir_file = strdup(str);
-        config.convolver_valid =
-            convolver_init(config.convolution_ir_file, config.convolution_max_length);
+        if (config.deferred_startup == 0) // otherwise, it's loaded by the deferred startup
+          config.convolver_valid =
+              convolver_init(config.convolution_ir_file, config.convolution_max_length,
+                         config.convolution_block_size, config.convolution_tail_block_size,
+                         convolver_sample_rate());
       }
 
       if (config.convolution && config.convolution_ir_file == NULL) {
@@ -1037,6 +1428,57 @@ int parse_options(int argc, char **argv) {
         die("Loudness activated but hardware volume is active. You must remove "
             "\"alsa.mixer_control_name\" to use the loudness filter.");
 
+      if (config_lookup_string(config.cfg, "dsp.fixed_point", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.dsp_fixed_point = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.dsp_fixed_point = 1;
+        else
+          die("Invalid dsp.fixed_point. It should be \"yes\" or \"no\"");
+      }
+
+      if (config_lookup_string(config.cfg, "dsp.eq", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.eq = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.eq = 1;
+        else
+          die("Invalid dsp.eq. It should be \"yes\" or \"no\"");
+      }
+
+      config_setting_t *eq_bands = config_lookup(config.cfg, "dsp.eq_bands");
+      if (eq_bands) {
+        int band_count = config_setting_length(eq_bands);
+        if (band_count > EQ_MAXIMUM_BANDS)
+          die("dsp.eq_bands has %d bands. A maximum of %d is allowed.", band_count,
+              EQ_MAXIMUM_BANDS);
+        int b;
+        for (b = 0; b < band_count; b++) {
+          config_setting_t *setting = config_setting_get_elem(eq_bands, b);
+          eq_band band = {EQ_peaking, 0.0, M_SQRT1_2, 0.0};
+          if ((config_setting_lookup_string(setting, "type", &str)) &&
+              (eq_band_type_from_string(str, &band.type) == 0))
+            die("Invalid type \"%s\" for band %d of dsp.eq_bands. It should be \"peaking\", "
+                "\"low_shelf\", \"high_shelf\", \"low_pass\" or \"high_pass\".",
+                str, b + 1);
+          if ((config_setting_lookup_float(setting, "frequency", &band.frequency) == 0) ||
+              (band.frequency <= 0.0))
+            die("Band %d of dsp.eq_bands needs a frequency greater than 0 Hz.", b + 1);
+          if ((config_setting_lookup_float(setting, "q", &band.q)) && (band.q <= 0.0))
+            die("Invalid q \"%f\" for band %d of dsp.eq_bands. It should be greater than 0.",
+                band.q, b + 1);
+          if ((config_setting_lookup_float(setting, "gain", &band.gain)) &&
+              ((band.gain > 24.0) || (band.gain < -48.0)))
+            die("Invalid gain \"%f\" for band %d of dsp.eq_bands. It should be between -48 and "
+                "+24 dB.",
+                band.gain, b + 1);
+          eq_set_band(&parametric_eq, b, band);
+        }
+      }
+
+      if (config.eq && (eq_bands == NULL))
+        warn("The equaliser is enabled but no dsp.eq_bands are provided");
+
     } else {
       if (config_error_type(&config_file_stuff) == CONFIG_ERR_FILE_IO)
         debug(2, "Error reading configuration file \"%s\": \"%s\".",
@@ -1072,6 +1514,18 @@ int parse_options(int argc, char **argv) {
     }
 #endif
 
+#ifdef CONFIG_DACP_CLIENT
+    /* Get the DACP long poll setting. */
+    if (config_lookup_string(config.cfg, "general.dacp_long_poll", &str)) {
+      if (strcasecmp(str, "no") == 0)
+        config.dacp_long_poll = 0;
+      else if (strcasecmp(str, "yes") == 0)
+        config.dacp_long_poll = 1;
+      else
+        die("Invalid dacp_long_poll option choice \"%s\". It should be \"yes\" or \"no\"", str);
+    }
+#endif
+
 #ifdef CONFIG_MQTT
     config_set_lookup_bool(config.cfg, "mqtt.enabled", &config.mqtt_enabled);
     if (config.mqtt_enabled && !config.metadata_enabled) {
@@ -1127,6 +1581,7 @@ int parse_options(int argc, char **argv) {
     config_set_lookup_bool(config.cfg, "mqtt.publish_raw", &config.mqtt_publish_raw);
     config_set_lookup_bool(config.cfg, "mqtt.publish_parsed", &config.mqtt_publish_parsed);
     config_set_lookup_bool(config.cfg, "mqtt.publish_cover", &config.mqtt_publish_cover);
+    config_set_lookup_bool(config.cfg, "mqtt.publish_state", &config.mqtt_publish_state);
     if (config.mqtt_publish_cover && !config.get_coverart) {
       die("You need to have metadata.include_cover_art enabled in order to use mqtt.publish_cover");
     }
@@ -1192,9 +1647,18 @@ int parse_options(int argc, char **argv) {
         die("The soxr option not available because this version of shairport-sync was built "
             "without libsoxr "
             "support. Change the -S option setting.");
+#endif
+      else if (strcmp(stuffing, "soxr_vr") == 0)
+#ifdef CONFIG_SOXR
+        config.packet_stuffing = ST_soxr_vr;
+#else
+        die("The soxr_vr option not available because this version of shairport-sync was built "
+            "without libsoxr "
+            "support. Change the -S option setting.");
 #endif
       else
-        die("Illegal stuffing option \"%s\" -- must be \"basic\" or \"soxr\"", stuffing);
+        die("Illegal stuffing option \"%s\" -- must be \"basic\", \"soxr\" or \"soxr_vr\"",
+            stuffing);
       break;
     }
   }
@@ -1295,6 +1759,7 @@ static GMainLoop *g_main_loop = NULL;
 
 pthread_t dbus_thread;
 void *dbus_thread_func(__attribute__((unused)) void *arg) {
+  thread_set_name("dbus");
   g_main_loop = g_main_loop_new(NULL, FALSE);
   g_main_loop_run(g_main_loop);
   debug(2, "g_main_loop thread exit");
@@ -1313,6 +1778,102 @@ const char *pid_file_proc(void) {
 }
 #endif
 
+// With general.deferred_startup, the service is advertised as soon as the settings have been read,
+// and the backend and the other subsystems are started by a thread of their own meanwhile. An RTSP
+// conversation that arrives first waits for them.
+static pthread_mutex_t startup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startup_complete_cv = PTHREAD_COND_INITIALIZER;
+static int startup_complete = 0;
+pthread_t deferred_startup_thread;
+int deferred_startup_thread_started = 0;
+static int deferred_startup_argc;
+static char **deferred_startup_argv;
+
+static void startup_is_complete(void) {
+  pthread_mutex_lock(&startup_mutex);
+  startup_complete = 1;
+  pthread_cond_broadcast(&startup_complete_cv);
+  pthread_mutex_unlock(&startup_mutex);
+}
+
+static void startup_wait_cleanup_handler(__attribute__((unused)) void *arg) {
+  pthread_mutex_unlock(&startup_mutex);
+}
+
+void wait_for_startup_to_complete(void) {
+  pthread_mutex_lock(&startup_mutex);
+  if (startup_complete == 0) {
+    debug(2, "waiting for the startup to complete.");
+    pthread_cleanup_push(startup_wait_cleanup_handler, NULL);
+    while (startup_complete == 0)
+      pthread_cond_wait(&startup_complete_cv, &startup_mutex);
+    pthread_cleanup_pop(0);
+  }
+  pthread_mutex_unlock(&startup_mutex);
+}
+
+// start everything that isn't needed to advertise the service and accept connections
+static void start_subsystems(void) {
+#ifdef CONFIG_METADATA
+  metadata_init(); // create the metadata pipe if necessary
+#endif
+
+#ifdef CONFIG_METADATA_HUB
+  // debug(1, "Initialising metadata hub");
+  metadata_hub_init();
+#endif
+
+#ifdef CONFIG_DACP_CLIENT
+  // debug(1, "Requesting DACP Monitor");
+  dacp_monitor_start();
+#endif
+
+#if defined(CONFIG_DBUS_INTERFACE) || defined(CONFIG_MPRIS_INTERFACE)
+  // Start up DBUS services after initial settings are all made
+  // debug(1, "Starting up D-Bus services");
+  pthread_create(&dbus_thread, NULL, &dbus_thread_func, NULL);
+#ifdef CONFIG_DBUS_INTERFACE
+  start_dbus_service();
+#endif
+#ifdef CONFIG_MPRIS_INTERFACE
+  start_mpris_service();
+#endif
+#endif
+
+#ifdef CONFIG_MQTT
+  if (config.mqtt_enabled) {
+    initialise_mqtt();
+  }
+#endif
+
+  if (config.metrics_enabled)
+    metrics_start(config.metrics_port);
+
+  activity_monitor_start();
+}
+
+static void *deferred_startup(__attribute__((unused)) void *arg) {
+  thread_set_name("startup");
+  uint64_t start_time = get_absolute_time_in_ns();
+  config.output->init(deferred_startup_argc, deferred_startup_argv);
+#ifdef CONFIG_CONVOLUTION
+  if (config.convolution_ir_file)
+    config.convolver_valid =
+        convolver_init(config.convolution_ir_file, config.convolution_max_length,
+                       config.convolution_block_size, config.convolution_tail_block_size,
+                       convolver_sample_rate());
+#endif
+  start_subsystems();
+  startup_is_complete();
+  debug(1, "deferred startup completed in %.3f seconds.",
+        (get_absolute_time_in_ns() - start_time) * 0.000000001);
+#ifdef CONFIG_SOXR
+  // last, so as not to hold up the rest
+  soxr_time_check_start();
+#endif
+  return NULL;
+}
+
 void exit_function() {
 
   if (emergency_exit == 0) {
@@ -1325,6 +1886,10 @@ void exit_function() {
                                    // actually deamonised at all
 #endif
       debug(2, "exit function called...");
+      // let a deferred startup finish before shutting down what it starts
+      if ((deferred_startup_thread_started) &&
+          (pthread_equal(deferred_startup_thread, pthread_self()) == 0))
+        pthread_join(deferred_startup_thread, NULL);
       /*
       Actually, there is no terminate_mqtt() function.
       #ifdef CONFIG_MQTT
@@ -1366,6 +1931,7 @@ void exit_function() {
 #endif
 
       activity_monitor_stop(0);
+      metrics_stop();
 
       if ((config.output) && (config.output->deinit)) {
         debug(2, "Deinitialise the audio backend.");
@@ -1374,7 +1940,8 @@ void exit_function() {
 
 #ifdef CONFIG_SOXR
       // be careful -- not sure if the thread can be cancelled cleanly, so wait for it to shut down
-      pthread_join(soxr_time_check_thread, NULL);
+      if (soxr_time_check_thread_started)
+        pthread_join(soxr_time_check_thread, NULL);
 #endif
 
       if (conns)
@@ -1531,10 +2098,16 @@ int main(int argc, char **argv) {
   config.debugger_show_relative_time =
       1;                         // by default, log the  time back to the previous debug message
   config.resyncthreshold = 0.05; // 50 ms
+  config.metrics_port = 9464;
+  config.fast_start_latency = 0.3; // seconds, used only if fast_start is set
+  config.realtime_scheduling_policy = SCHED_OTHER;
+  config.realtime_priority = 20; // used only if real-time scheduling is chosen
   config.timeout = 120; // this number of seconds to wait for [more] audio before switching to idle.
   config.tolerance =
       0.002; // this number of seconds of timing error before attempting to correct it.
   config.buffer_start_fill = 220;
+  config.audio_buffer_size = DEFAULT_BUFFER_FRAMES;
+  config.buffered_audio_lookahead = 0.5;
   config.port = 5000;
 
 #ifdef CONFIG_SOXR
@@ -1553,6 +2126,9 @@ int main(int argc, char **argv) {
   config.audio_backend_buffer_desired_length = 0.15; // seconds
   config.udp_port_base = 6001;
   config.udp_port_range = 10;
+  config.udp_receive_buffer_size = -1; // size it for the latency
+  config.udp_busy_poll_time = 0;
+  config.udp_request_dscp = -1;
   config.output_format = SPS_FORMAT_S16_LE; // default
   config.output_format_auto_requested = 1;  // default auto select format
   config.output_rate = 44100;               // default
@@ -1598,6 +2174,11 @@ int main(int argc, char **argv) {
     config.service_name[50] = '\0'; // truncate it and carry on...
   }
 
+  if (benchmarkOption != 0) {
+    player_benchmark();
+    return 0;
+  }
+
   /* Check if we are called with -k or --kill option */
   if (killOption != 0) {
 #ifdef CONFIG_LIBDAEMON
@@ -1726,6 +2307,14 @@ int main(int argc, char **argv) {
   }
 
 #endif
+
+  // before any thread is started
+  realtime_set_thread_stack_size();
+
+  // start the log writer thread only now, as a thread started before daemonising would be lost
+  if (config.log_asynchronously)
+    log_asynchronously();
+
   debug(1, "Started!");
 
   // stop a pipe signal from killing the program
@@ -1760,13 +2349,23 @@ int main(int argc, char **argv) {
   }
 
   debug(1, "log verbosity is %d.", debuglev);
+  debug(1, "log messages are %swritten asynchronously.", config.log_asynchronously ? "" : "not ");
+  if (config.metrics_enabled)
+    debug(1, "metrics are served on port %d.", config.metrics_port);
+  else
+    debug(1, "metrics are not served.");
 
   config.output = audio_get_output(config.output_name);
   if (!config.output) {
     die("Invalid audio backend \"%s\" selected!",
         config.output_name == NULL ? "<unspecified>" : config.output_name);
   }
-  config.output->init(argc - audio_arg, argv + audio_arg);
+  if (config.deferred_startup) {
+    deferred_startup_argc = argc - audio_arg;
+    deferred_startup_argv = argv + audio_arg;
+  } else {
+    config.output->init(argc - audio_arg, argv + audio_arg);
+  }
 
   pthread_cleanup_push(main_thread_cleanup_handler, NULL);
 
@@ -1800,10 +2399,26 @@ int main(int argc, char **argv) {
            "instead to compensate for timing issues.");
     if ((config.userSuppliedLatency != 0) &&
         ((config.userSuppliedLatency < 4410) ||
-         (config.userSuppliedLatency > BUFFER_FRAMES * 352 - 22050)))
+         (config.userSuppliedLatency > config.audio_buffer_size * 352 - 22050)))
       die("An out-of-range fixed latency has been specified. It must be between 4410 and %d (at "
           "44100 frames per second).",
-          BUFFER_FRAMES * 352 - 22050);
+          config.audio_buffer_size * 352 - 22050);
+  }
+
+  // A session starts with the fixed latency, if any, or 88,200 frames, so the audio buffer must
+  // hold that plus the backend's latency offset. Make it big enough now rather than turn sessions
+  // away.
+  unsigned int minimum_buffer_size =
+      minimum_audio_buffer_size(config.userSuppliedLatency ? config.userSuppliedLatency : 88200);
+  if (minimum_buffer_size > MAXIMUM_BUFFER_FRAMES)
+    die("The audio_backend_latency_offset_in_seconds setting is too large for an audio buffer of "
+        "%d packets, the most there can be.",
+        MAXIMUM_BUFFER_FRAMES);
+  if (config.audio_buffer_size < minimum_buffer_size) {
+    warn("The audio_buffer_size_in_packets setting of %u is too small for the latency and the "
+         "audio_backend_latency_offset_in_seconds setting -- %u packets will be used.",
+         config.audio_buffer_size, minimum_buffer_size);
+    config.audio_buffer_size = minimum_buffer_size;
   }
 
   /* Print out options */
@@ -1820,6 +2435,13 @@ int main(int argc, char **argv) {
   debug(1, "rtsp listening port is %d.", config.port);
   debug(1, "udp base port is %d.", config.udp_port_base);
   debug(1, "udp port range is %d.", config.udp_port_range);
+  if (config.udp_receive_buffer_size < 0)
+    debug(1, "udp receive buffers are sized for the latency.");
+  else
+    debug(1, "udp receive buffer size is %d bytes.", config.udp_receive_buffer_size);
+  debug(1, "udp busy poll time is %d microseconds.", config.udp_busy_poll_time);
+  debug(1, "udp request dscp is %d.", config.udp_request_dscp);
+  debug(1, "audio buffer size is %u packets.", config.audio_buffer_size);
   debug(1, "player name is \"%s\".", config.service_name);
   debug(1, "backend is \"%s\".", config.output_name);
   debug(1, "run_this_before_play_begins action is \"%s\".", config.cmd_start);
@@ -1833,15 +2455,42 @@ int main(int argc, char **argv) {
   debug(1, "mdns backend \"%s\".", config.mdns_name);
   debug(2, "userSuppliedLatency is %d.", config.userSuppliedLatency);
   debug(1, "interpolation setting is \"%s\".",
-        config.packet_stuffing == ST_basic ? "basic"
-                                           : config.packet_stuffing == ST_soxr ? "soxr" : "auto");
+        config.packet_stuffing == ST_basic
+            ? "basic"
+            : config.packet_stuffing == ST_soxr
+                  ? "soxr"
+                  : config.packet_stuffing == ST_soxr_vr ? "soxr_vr" : "auto");
   debug(1, "interpolation soxr_delay_threshold is %d.", config.soxr_delay_threshold);
   debug(1, "resync time is %f seconds.", config.resyncthreshold);
+  if (config.fast_start)
+    debug(1, "fast start is on, starting with a latency of %f seconds.",
+          config.fast_start_latency);
+  else
+    debug(1, "fast start is off.");
+  if (config.realtime_scheduling_policy == SCHED_OTHER)
+    debug(1, "real-time scheduling is off.");
+  else
+    debug(1, "real-time scheduling is \"%s\" at priority %d.",
+          config.realtime_scheduling_policy == SCHED_FIFO ? "fifo" : "rr",
+          config.realtime_priority);
+  if (config.realtime_cpu_affinity)
+    debug(1, "real-time CPU affinity mask is 0x%" PRIx64 ".", config.realtime_cpu_affinity);
+  debug(1, "memory locking is %s.", config.lock_memory ? "on" : "off");
+  debug(1, "low memory mode is %s.", config.low_memory ? "on" : "off");
+  debug(1, "buffered audio mode is %s, decoding %.3f seconds ahead.",
+        config.buffered_audio ? "on" : "off", config.buffered_audio_lookahead);
+  if (config.thread_stack_size)
+    debug(1, "thread stack size is %zu kilobytes.", config.thread_stack_size / 1024);
+  else
+    debug(1, "thread stack size is the system's default.");
   debug(1, "allow a session to be interrupted: %d.", config.allow_session_interruption);
   debug(1, "busy timeout time is %d.", config.timeout);
   debug(1, "drift tolerance is %f seconds.", config.tolerance);
+  debug(1, "sync control is %s.", config.sync_control == SC_pi ? "pi" : "tolerance");
+  debug(1, "deferred startup is %d.", config.deferred_startup);
   debug(1, "password is \"%s\".", config.password);
   debug(1, "ignore_volume_control is %d.", config.ignore_volume_control);
+  debug(1, "dither_noise_shaping is %d.", config.dither_noise_shaping);
   if (config.volume_max_db_set)
     debug(1, "volume_max_db is %d.", config.volume_max_db);
   else
@@ -1856,6 +2505,7 @@ int main(int argc, char **argv) {
         config.playback_mode);
   debug(1, "disable_synchronization is %d.", config.no_sync);
   debug(1, "use_mmap_if_available is %d.", config.no_mmap ? 0 : 1);
+  debug(1, "mmap_zero_copy is %d.", config.mmap_zero_copy);
   debug(1, "output_format automatic selection is %sabled.",
         config.output_format_auto_requested ? "en" : "dis");
   if (config.output_format_auto_requested == 0)
@@ -1893,6 +2543,8 @@ int main(int argc, char **argv) {
 #ifdef CONFIG_METADATA
   debug(1, "metadata enabled is %d.", config.metadata_enabled);
   debug(1, "metadata pipename is \"%s\".", config.metadata_pipename);
+  debug(1, "metadata pipe format is \"%s\".",
+        config.metadata_pipe_format == MPF_binary ? "binary" : "xml");
   debug(1, "metadata socket address is \"%s\" port %d.", config.metadata_sockaddr,
         config.metadata_sockport);
   debug(1, "metadata socket packet size is \"%d\".", config.metadata_sockmsglength);
@@ -1905,22 +2557,34 @@ int main(int argc, char **argv) {
   debug(1, "mqtt will%s publish raw metadata.", config.mqtt_publish_raw ? "" : " not");
   debug(1, "mqtt will%s publish parsed metadata.", config.mqtt_publish_parsed ? "" : " not");
   debug(1, "mqtt will%s publish cover Art.", config.mqtt_publish_cover ? "" : " not");
+  debug(1, "mqtt will%s publish a retained state message.",
+        config.mqtt_publish_state ? "" : " not");
   debug(1, "mqtt remote control is %sabled.", config.mqtt_enable_remote ? "en" : "dis");
 #endif
+#ifdef CONFIG_DACP_CLIENT
+  debug(1, "dacp long poll is %sabled.", config.dacp_long_poll ? "en" : "dis");
+#endif
 
 #ifdef CONFIG_CONVOLUTION
   debug(1, "convolution is %d.", config.convolution);
   debug(1, "convolution IR file is \"%s\"", config.convolution_ir_file);
   debug(1, "convolution max length %d", config.convolution_max_length);
+  debug(1, "convolution block size %d", config.convolution_block_size);
+  debug(1, "convolution tail block size %d", config.convolution_tail_block_size);
   debug(1, "convolution gain is %f", config.convolution_gain);
 #endif
   debug(1, "loudness is %d.", config.loudness);
   debug(1, "loudness reference level is %f", config.loudness_reference_volume_db);
+  debug(1, "fixed point DSP is %d.", config.dsp_fixed_point);
+  debug(1, "eq is %d with %d bands.", config.eq, parametric_eq.band_count);
+
+  realtime_lock_memory();
 
   uint8_t ap_md5[16];
 
 #ifdef CONFIG_SOXR
-  pthread_create(&soxr_time_check_thread, NULL, &soxr_time_check, NULL);
+  if (config.deferred_startup == 0)
+    soxr_time_check_start();
 #endif
 
 #ifdef CONFIG_OPENSSL
@@ -1951,40 +2615,24 @@ int main(int argc, char **argv) {
   md5_finish(&tctx, ap_md5);
 #endif
   memcpy(config.hw_addr, ap_md5, sizeof(config.hw_addr));
-#ifdef CONFIG_METADATA
-  metadata_init(); // create the metadata pipe if necessary
-#endif
-
-#ifdef CONFIG_METADATA_HUB
-  // debug(1, "Initialising metadata hub");
-  metadata_hub_init();
-#endif
-
-#ifdef CONFIG_DACP_CLIENT
-  // debug(1, "Requesting DACP Monitor");
-  dacp_monitor_start();
-#endif
-
-#if defined(CONFIG_DBUS_INTERFACE) || defined(CONFIG_MPRIS_INTERFACE)
-  // Start up DBUS services after initial settings are all made
-  // debug(1, "Starting up D-Bus services");
-  pthread_create(&dbus_thread, NULL, &dbus_thread_func, NULL);
-#ifdef CONFIG_DBUS_INTERFACE
-  start_dbus_service();
-#endif
-#ifdef CONFIG_MPRIS_INTERFACE
-  start_mpris_service();
-#endif
-#endif
 
-#ifdef CONFIG_MQTT
-  if (config.mqtt_enabled) {
-    initialise_mqtt();
+  if (config.deferred_startup) {
+    if (pthread_create(&deferred_startup_thread, NULL, &deferred_startup, NULL) != 0)
+      die("Can not start the deferred startup thread.");
+    deferred_startup_thread_started = 1;
+  } else {
+    start_subsystems();
+    startup_is_complete();
   }
-#endif
 
-  activity_monitor_start();
-  rtsp_listen_loop();
+  if (replayFile != NULL) {
+    wait_for_startup_to_complete();
+    if ((replaySpeed < 1) || (replaySpeed > 1000))
+      die("Invalid replay speed %d. It should be between 1 and 1000.", replaySpeed);
+    packet_replay(replayFile, replaySpeed);
+  } else {
+    rtsp_listen_loop();
+  }
   pthread_cleanup_pop(1);
   return 0;
 }
@@ -0,0 +1,91 @@
+#include "silence.h"
+#include "dither.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+// Pure silence is handed out in runs of up to this many frames -- enough for a few packets.
+#define SILENCE_FRAMES 4096
+
+// Dithered silence is cycled through this many frames, two seconds at 44,100 frames per second.
+// It's long enough that the repetition can't be heard in noise at the level of the LSB.
+#define DITHERED_SILENCE_FRAMES (2 * 44100)
+
+typedef struct {
+  char *silence;
+  char *dithered_silence;
+} silence_templates;
+
+// one pair for every SPS_FORMAT_*, made when first asked for and kept until exit
+static silence_templates templates[SPS_FORMAT_INVALID + 1];
+static pthread_mutex_t templates_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+size_t silence_frame_size(sps_format_t format) {
+  switch (format) {
+  case SPS_FORMAT_S8:
+  case SPS_FORMAT_U8:
+    return 2;
+  case SPS_FORMAT_S16:
+  case SPS_FORMAT_S16_LE:
+  case SPS_FORMAT_S16_BE:
+    return 4;
+  case SPS_FORMAT_S24_3LE:
+  case SPS_FORMAT_S24_3BE:
+    return 6;
+  case SPS_FORMAT_S24:
+  case SPS_FORMAT_S24_LE:
+  case SPS_FORMAT_S24_BE:
+  case SPS_FORMAT_S32:
+  case SPS_FORMAT_S32_LE:
+  case SPS_FORMAT_S32_BE:
+    return 8;
+  default:
+    return 0;
+  }
+}
+
+static char *make_template(sps_format_t format, size_t frames, int dithered) {
+  char *t = malloc(frames * silence_frame_size(format));
+  if (t == NULL)
+    die("Failed to allocate memory for a silence template.");
+  if (dithered) {
+    dither_state d;
+    dither_init(&d, config.dither_noise_shaping);
+    generate_zero_frames(t, frames, format, &d);
+  } else {
+    generate_zero_frames(t, frames, format, NULL); // not necessarily zero bytes, e.g. for U8
+  }
+  return t;
+}
+
+const void *silence_get(sps_format_t format, int dithered, size_t frames, size_t *position,
+                        size_t *frames_available) {
+  size_t frame_size = silence_frame_size(format);
+  if (frame_size == 0)
+    die("Unexpected SPS_FORMAT_* with index %d while outputting silence", format);
+
+  pthread_mutex_lock(&templates_mutex);
+  silence_templates *st = &templates[format];
+  if ((dithered) && (st->dithered_silence == NULL))
+    st->dithered_silence = make_template(format, DITHERED_SILENCE_FRAMES, 1);
+  else if ((!dithered) && (st->silence == NULL))
+    st->silence = make_template(format, SILENCE_FRAMES, 0);
+  char *t = dithered ? st->dithered_silence : st->silence;
+  pthread_mutex_unlock(&templates_mutex);
+
+  const char *response;
+  if (dithered) {
+    if (*position >= DITHERED_SILENCE_FRAMES)
+      *position = 0;
+    size_t available = DITHERED_SILENCE_FRAMES - *position;
+    if (frames > available)
+      frames = available;
+    response = t + *position * frame_size;
+    *position += frames;
+  } else {
+    if (frames > SILENCE_FRAMES)
+      frames = SILENCE_FRAMES;
+    response = t;
+  }
+  *frames_available = frames;
+  return response;
+}
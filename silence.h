@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "common.h"
+
+// Silence, ready packed in each output format, for anything that has to play it. Pure silence is
+// a short run of frames, made once; dithered silence is a couple of seconds of dither noise,
+// made once and then cycled through, so neither the dither generator nor the packing is run
+// every time silence is played. The frames are shared and must not be written to.
+
+// Get up to frames frames of silence in the format given. Returns a read-only pointer to them
+// and sets *frames_available to how many there are, which may be fewer than asked for, in which
+// case call again for the rest.
+// Dithered silence continues from *position, which the caller should keep, initially zero, and
+// which is moved on past the frames returned. It is ignored, and may be NULL, for pure silence.
+const void *silence_get(sps_format_t format, int dithered, size_t frames, size_t *position,
+                        size_t *frames_available);
+
+// bytes in a frame of interleaved stereo in the format given, or 0 if it isn't an output format
+size_t silence_frame_size(sps_format_t format);
@@ -0,0 +1,52 @@
+#include "stage_timings.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *stage_name[stage_timings_number_of_stages] = {
+    "decrypt", "decode", "dsp", "interpolation", "output", "ab_mutex_wait"};
+
+// the lower edges of the bins after the first, in microseconds
+static const int bin_edge[STAGE_TIMINGS_BINS - 1] = {10, 30, 100, 300, 1000, 3000, 10000, 30000};
+
+void stage_timings_reset(stage_timings *t) { memset(t, 0, sizeof(stage_timings)); }
+
+void stage_timings_note(stage_timings *t, stage_timings_stage stage, uint64_t duration_ns) {
+  stage_timing *s = &t->stage[stage];
+  int bin = 0;
+  while ((bin < STAGE_TIMINGS_BINS - 1) && (duration_ns >= (uint64_t)bin_edge[bin] * 1000))
+    bin++;
+  // only this thread writes them, so there's no need for anything stronger
+  __atomic_store_n(&s->count, s->count + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&s->total_ns, s->total_ns + duration_ns, __ATOMIC_RELAXED);
+  if (duration_ns > s->maximum_ns)
+    __atomic_store_n(&s->maximum_ns, duration_ns, __ATOMIC_RELAXED);
+  __atomic_store_n(&s->bin[bin], s->bin[bin] + 1, __ATOMIC_RELAXED);
+}
+
+// Something like:
+// "player_dsp=count:12000,mean_us:41.3,maximum_us:812.0,us=<10:0;10:0;30:11842;100:150;300:8;
+// 1000:0;3000:0;10000:0;30000:0 player_output=..." -- all on one line.
+int stage_timings_format(stage_timings *t, const char *prefix, char *buf, size_t size) {
+  int i, b, n = 0;
+  if (size > 0)
+    buf[0] = '\0';
+  for (i = 0; i < stage_timings_number_of_stages; i++) {
+    stage_timing *s = &t->stage[i];
+    uint64_t count = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+    if ((count != 0) && (n >= 0) && ((size_t)n < size)) {
+      uint64_t total_ns = __atomic_load_n(&s->total_ns, __ATOMIC_RELAXED);
+      uint64_t maximum_ns = __atomic_load_n(&s->maximum_ns, __ATOMIC_RELAXED);
+      n += snprintf(buf + n, size - n,
+                    "%s%s%s=count:%" PRIu64 ",mean_us:%.1f,maximum_us:%.1f,us=<%d:%" PRIu64,
+                    n ? " " : "", prefix, stage_name[i], count, 0.001 * total_ns / count,
+                    0.001 * maximum_ns, bin_edge[0],
+                    __atomic_load_n(&s->bin[0], __ATOMIC_RELAXED));
+      for (b = 1; b < STAGE_TIMINGS_BINS; b++)
+        if ((n >= 0) && ((size_t)n < size))
+          n += snprintf(buf + n, size - n, ";%d:%" PRIu64, bin_edge[b - 1],
+                        __atomic_load_n(&s->bin[b], __ATOMIC_RELAXED));
+    }
+  }
+  return n;
+}
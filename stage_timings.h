@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Histograms of how long each stage of the audio pipeline takes, kept for each play session, to
+// find which stage is responsible when a particular device underruns. Each set of timings is
+// noted by only one thread, but may be formatted by another, so the counts are updated and read
+// with relaxed atomic operations -- they're always whole, though not necessarily in step with
+// one another.
+
+typedef enum {
+  stage_decrypt = 0,   // decrypting a packet
+  stage_decode,        // decoding a packet
+  stage_dsp,           // convolution, loudness and equalisation of a packet
+  stage_interpolation, // stuffing or resampling a packet and converting it to the output format
+  stage_output,        // the backend's play() or commit() of a packet
+  stage_ab_mutex_wait, // waiting to take the ab_mutex
+  stage_timings_number_of_stages,
+} stage_timings_stage;
+
+// durations in microseconds -- the bins are below 10, 10 to 30, 30 to 100, ..., and 30000 or more
+#define STAGE_TIMINGS_BINS 9
+
+typedef struct {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t maximum_ns;
+  uint64_t bin[STAGE_TIMINGS_BINS];
+} stage_timing;
+
+typedef struct {
+  stage_timing stage[stage_timings_number_of_stages];
+} stage_timings;
+
+void stage_timings_reset(stage_timings *t);
+
+void stage_timings_note(stage_timings *t, stage_timings_stage stage, uint64_t duration_ns);
+
+// Describe the stages that have been noted as a line of text, each name preceded by the prefix,
+// returning the length written as snprintf does.
+int stage_timings_format(stage_timings *t, const char *prefix, char *buf, size_t size);
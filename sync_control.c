@@ -0,0 +1,94 @@
+#include "sync_control.h"
+#include <math.h>
+#include <string.h>
+
+// the time constant of the exponential weighting of the estimate
+#define SYNC_CONTROL_TREND_TIME_CONSTANT 8.0
+// the least time and the least number of samples the estimate needs before it can be used
+#define SYNC_CONTROL_MINIMUM_TREND_TIME 2.0
+#define SYNC_CONTROL_MINIMUM_SAMPLES 16
+// an error is taken out over about this many seconds...
+#define SYNC_CONTROL_PROPORTIONAL_TIME 5.0
+// ...and any bias left over by the drift estimate over about this many
+#define SYNC_CONTROL_INTEGRAL_TIME 60.0
+// keep the corrections below 1 in 1000 frames
+#define SYNC_CONTROL_MAXIMUM_CORRECTION_RATE 0.001
+
+void sync_controller_reset(sync_controller *c) { memset(c, 0, sizeof(sync_controller)); }
+
+void sync_controller_note(sync_controller *c, uint64_t time, int64_t sync_error,
+                          int64_t correction) {
+  // the error there would have been without the corrections made so far
+  double y = sync_error - c->corrections;
+  if (c->samples != 0) {
+    double dx = 0.0;
+    if (time > c->time_of_last_sample)
+      dx = (time - c->time_of_last_sample) * 0.000000001;
+    // move the older samples dx back in time, so that this one is at zero...
+    c->sxx += dx * (dx * c->sw + 2.0 * c->sx);
+    c->sxy += dx * c->sy;
+    c->sx += dx * c->sw;
+    // ...and age them by as much
+    double decay = exp(-dx / SYNC_CONTROL_TREND_TIME_CONSTANT);
+    c->sw *= decay;
+    c->sx *= decay;
+    c->sy *= decay;
+    c->sxy *= decay;
+    c->sxx *= decay;
+    if (sync_controller_is_ready(c))
+      c->integral += sync_controller_sync_error(c) * dx;
+  }
+  c->sw += 1.0;
+  c->sy += y;
+  c->time_of_last_sample = time;
+  c->samples++;
+  c->corrections += correction;
+}
+
+int sync_controller_is_ready(sync_controller *c) {
+  return (c->samples >= SYNC_CONTROL_MINIMUM_SAMPLES) &&
+         (c->sw > 0.0) && (c->sx / c->sw >= SYNC_CONTROL_MINIMUM_TREND_TIME / 2);
+}
+
+double sync_controller_drift(sync_controller *c) {
+  double d = c->sw * c->sxx - c->sx * c->sx;
+  if (d <= 0.0)
+    return 0.0;
+  // x is time before the last sample, so the slope comes out negated
+  return -(c->sw * c->sxy - c->sx * c->sy) / d;
+}
+
+double sync_controller_sync_error(sync_controller *c) {
+  if (c->sw <= 0.0)
+    return 0.0;
+  // the regression line at x = 0, with the corrections put back in
+  return (c->sy + sync_controller_drift(c) * c->sx) / c->sw + c->corrections;
+}
+
+int sync_controller_amount_to_stuff(sync_controller *c, int frames, int rate) {
+  double maximum_rate = rate * SYNC_CONTROL_MAXIMUM_CORRECTION_RATE;
+  // cancel the drift, take out the error, and then any error that persists
+  double r = -sync_controller_drift(c) -
+             sync_controller_sync_error(c) / SYNC_CONTROL_PROPORTIONAL_TIME -
+             c->integral / (SYNC_CONTROL_PROPORTIONAL_TIME * SYNC_CONTROL_INTEGRAL_TIME);
+  if (r > maximum_rate) {
+    r = maximum_rate;
+    if (c->integral < 0.0) // don't wind up the integral while the rate is limited
+      c->integral = 0.0;
+  } else if (r < -maximum_rate) {
+    r = -maximum_rate;
+    if (c->integral > 0.0)
+      c->integral = 0.0;
+  }
+  c->correction_rate = r;
+  c->stuffing_owed += (r * frames) / rate;
+  int response = 0;
+  if (c->stuffing_owed >= 1.0) {
+    response = 1;
+    c->stuffing_owed -= 1.0;
+  } else if (c->stuffing_owed <= -1.0) {
+    response = -1;
+    c->stuffing_owed += 1.0;
+  }
+  return response;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+// The drift between the source's clock and the output device's, estimated from the sync errors of
+// successive packets, and a proportional-integral controller that uses it to spread insertions and
+// deletions of frames evenly over time, instead of waiting for the error to grow past a threshold.
+//
+// The estimate is an exponentially weighted linear regression of the sync error the output would
+// have had if no corrections had been made, against time. Its sums are shifted so that the newest
+// sample is always at time zero, and decayed as each sample is added, which makes every update
+// O(1) and keeps them small, however long the session.
+
+typedef struct {
+  uint64_t time_of_last_sample;
+  int samples;
+  double corrections; // the frames inserted, less the frames deleted, since the reset
+  // the weighted sums of 1, x, y, xy and x^2, x in seconds before the last sample, y in frames
+  double sw, sx, sy, sxy, sxx;
+  double integral;        // of the estimated sync error, in frame-seconds
+  double stuffing_owed;   // the fraction of a frame of correction carried to the next packet
+  double correction_rate; // the last rate asked for, in frames per second
+} sync_controller;
+
+void sync_controller_reset(sync_controller *c);
+
+// note the sync error, in frames, measured at the time given, and the correction, in frames,
+// made in the packet it was measured for -- positive for an insertion, negative for a deletion
+void sync_controller_note(sync_controller *c, uint64_t time, int64_t sync_error,
+                          int64_t correction);
+
+// whether the estimate has enough behind it to be used
+int sync_controller_is_ready(sync_controller *c);
+
+// the drift in frames per second -- positive if the output is falling behind the source
+double sync_controller_drift(sync_controller *c);
+
+// the sync error now, in frames, as estimated from the trend
+double sync_controller_sync_error(sync_controller *c);
+
+// the correction to make in a packet of the number of frames given at the output rate given:
+// -1 to delete a frame, 1 to insert one, or 0
+int sync_controller_amount_to_stuff(sync_controller *c, int frames, int rate);
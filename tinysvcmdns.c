@@ -1151,6 +1151,29 @@ size_t mdns_encode_pkt(struct mdns_pkt *answer, uint8_t *pkt_buf, size_t pkt_len
 
 #define SERVICES_DNS_SD_NLABEL ((uint8_t *)"\x09_services\x07_dns-sd\x04_udp\x05local")
 
+// The answers to the questions that can be asked about each of our names are encoded in advance,
+// so that most queries can be answered -- or, much more often, found to be nothing to do with us --
+// straight from the packet, without parsing it into lists.
+#define ANSWER_CACHE_BUCKETS 32
+
+// An identical reply isn't sent again within this time, as RFC 6762 section 6 asks.
+#define REPEATED_REPLY_INTERVAL 1000000000 // nanoseconds
+#define RECENT_REPLIES 16
+
+struct cached_answer {
+  uint32_t hash; // of the name
+  uint8_t *name;
+  enum rr_type type;
+  uint8_t *packet; // the encoded reply, or NULL if there is no answer
+  size_t packet_length;
+  struct cached_answer *next;
+};
+
+struct recent_reply {
+  uint32_t hash;
+  uint64_t time_sent;
+};
+
 struct mdnsd {
   pthread_mutex_t data_lock;
   int sockfd;
@@ -1161,6 +1184,12 @@ struct mdnsd {
   struct rr_list *announce;
   struct rr_list *services;
   uint8_t *hostname;
+
+  // only used by the main loop, except for answer_cache_is_valid, which is protected by data_lock
+  int answer_cache_is_valid;
+  struct cached_answer *answer_cache[ANSWER_CACHE_BUCKETS];
+  struct recent_reply recent_replies[RECENT_REPLIES];
+  int next_recent_reply;
 };
 
 struct mdns_service {
@@ -1391,6 +1420,181 @@ static int process_mdns_pkt(struct mdnsd *svr, struct mdns_pkt *pkt, struct mdns
   return 0;
 }
 
+// FNV-1a
+static uint32_t hash_bytes(const uint8_t *p, size_t length) {
+  uint32_t h = 2166136261u;
+  size_t i;
+  for (i = 0; i < length; i++) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static void answer_cache_clear(struct mdnsd *svr) {
+  int i;
+  for (i = 0; i < ANSWER_CACHE_BUCKETS; i++) {
+    struct cached_answer *a = svr->answer_cache[i];
+    while (a) {
+      struct cached_answer *next = a->next;
+      free(a->name);
+      free(a->packet);
+      free(a);
+      a = next;
+    }
+    svr->answer_cache[i] = NULL;
+  }
+}
+
+// encode the reply to a question of the given name and type, as process_mdns_pkt would make it to
+// a query with no known answers, and add it to the cache -- with no packet if there's no answer
+static void answer_cache_add(struct mdnsd *svr, uint8_t *name, enum rr_type type,
+                             struct mdns_pkt *reply, uint8_t *pkt_buffer) {
+  struct cached_answer *a;
+  MALLOC_ZERO_STRUCT(a, cached_answer);
+  if (a == NULL)
+    die("can not allocate memory for \"a\" in tinysvcmdns");
+  a->name = dup_nlabel(name);
+  a->hash = hash_bytes(name, strlen((char *)name));
+  a->type = type;
+
+  mdns_init_reply(reply, 0);
+  reply->num_ans_rr += populate_answers(svr, &reply->rr_ans, name, type);
+  if (reply->num_ans_rr > 0) {
+    add_related_rr(svr, reply->rr_ans, reply);
+    add_related_rr(svr, reply->rr_add, reply);
+    a->packet_length = mdns_encode_pkt(reply, pkt_buffer, PACKET_SIZE);
+    a->packet = malloc(a->packet_length);
+    if (a->packet == NULL)
+      die("can not allocate memory for a cached answer in tinysvcmdns");
+    memcpy(a->packet, pkt_buffer, a->packet_length);
+  }
+  mdns_init_reply(reply, 0);
+
+  a->next = svr->answer_cache[a->hash % ANSWER_CACHE_BUCKETS];
+  svr->answer_cache[a->hash % ANSWER_CACHE_BUCKETS] = a;
+}
+
+// (re)build the cache of answers, for every type of record under each name, and for RR_ANY
+static void answer_cache_build(struct mdnsd *svr, struct mdns_pkt *reply, uint8_t *pkt_buffer) {
+  struct rr_list *questions = NULL; // made-up entries, holding the names and types to cache
+  answer_cache_clear(svr);
+
+  pthread_mutex_lock(&svr->data_lock);
+  struct rr_group *g;
+  for (g = svr->group; g; g = g->next) {
+    struct rr_list *n;
+    rr_list_append(&questions, rr_create(dup_nlabel(g->name), RR_ANY));
+    for (n = g->rr; n; n = n->next)
+      if (rr_entry_find(questions, g->name, n->e->type) == NULL)
+        rr_list_append(&questions, rr_create(dup_nlabel(g->name), n->e->type));
+  }
+  svr->answer_cache_is_valid = 1;
+  pthread_mutex_unlock(&svr->data_lock);
+
+  // populate_answers takes the data_lock for itself
+  int count = 0;
+  struct rr_list *q;
+  for (q = questions; q; q = q->next) {
+    answer_cache_add(svr, q->e->name, q->e->type, reply, pkt_buffer);
+    count++;
+  }
+  rr_list_destroy(questions, 1);
+  DEBUG_PRINTF("answer cache rebuilt with %d entries\n", count);
+}
+
+static struct cached_answer *answer_cache_find(struct mdnsd *svr, const uint8_t *name,
+                                               size_t name_length, enum rr_type type,
+                                               int *name_is_ours) {
+  uint32_t hash = hash_bytes(name, name_length);
+  struct cached_answer *a;
+  *name_is_ours = 0;
+  for (a = svr->answer_cache[hash % ANSWER_CACHE_BUCKETS]; a; a = a->next)
+    if ((a->hash == hash) && (strlen((char *)a->name) == name_length) &&
+        (memcmp(a->name, name, name_length) == 0)) {
+      *name_is_ours = 1;
+      if (a->type == type)
+        return a;
+    }
+  return NULL;
+}
+
+// returns 1 if the same reply was sent too recently to be sent again, noting it as sent otherwise
+static int reply_was_sent_recently(struct mdnsd *svr, const uint8_t *packet, size_t length) {
+  if (length <= 2)
+    return 0;
+  uint32_t hash = hash_bytes(packet + 2, length - 2); // all but the transaction ID
+  uint64_t time_now = get_absolute_time_in_ns();
+  int i;
+  for (i = 0; i < RECENT_REPLIES; i++)
+    if ((svr->recent_replies[i].time_sent != 0) && (svr->recent_replies[i].hash == hash) &&
+        (time_now - svr->recent_replies[i].time_sent < REPEATED_REPLY_INTERVAL))
+      return 1;
+  svr->recent_replies[svr->next_recent_reply].hash = hash;
+  svr->recent_replies[svr->next_recent_reply].time_sent = time_now;
+  svr->next_recent_reply = (svr->next_recent_reply + 1) % RECENT_REPLIES;
+  return 0;
+}
+
+static void send_reply(struct mdnsd *svr, const uint8_t *packet, size_t length) {
+  if (reply_was_sent_recently(svr, packet, length))
+    DEBUG_PRINTF("not repeating a reply sent less than a second ago\n");
+  else
+    send_packet(svr->sockfd, packet, length);
+}
+
+// Deal with a packet from its raw bytes if that can be done, returning 1 if it has been dealt
+// with and 0 if it needs to be parsed and processed in full:
+// - responses and other non-queries are dropped, as process_mdns_pkt would drop them;
+// - queries none of whose questions are about our names are dropped;
+// - a query with a single question and no known answers is answered from the cache.
+// Anything with a compressed name in a question, or that is malformed, is left to the parser.
+static int process_mdns_pkt_from_cache(struct mdnsd *svr, uint8_t *pkt_buf, size_t pkt_len) {
+  if (pkt_len < 12)
+    return 0;
+  uint16_t flags = mdns_read_u16(pkt_buf + 2);
+  if (((flags & MDNS_FLAG_RESP) != 0) || (MDNS_FLAG_GET_OPCODE(flags) != 0))
+    return 1;
+  uint16_t num_qn = mdns_read_u16(pkt_buf + 4);
+  uint16_t num_ans_rr = mdns_read_u16(pkt_buf + 6);
+  if (num_qn == 0)
+    return 0;
+
+  size_t off = 12;
+  int i, any_name_is_ours = 0;
+  struct cached_answer *answer = NULL;
+  for (i = 0; i < num_qn; i++) {
+    size_t name_start = off;
+    while ((off < pkt_len) && (pkt_buf[off] != 0)) {
+      if ((pkt_buf[off] & 0xC0) != 0)
+        return 0; // compressed
+      off += pkt_buf[off] + 1;
+    }
+    if (off + 5 > pkt_len)
+      return 0; // malformed
+    size_t name_length = off - name_start; // without the root label
+    off++;
+    enum rr_type type = mdns_read_u16(pkt_buf + off);
+    int unicast_query = (pkt_buf[off + 2] & 0x80) == 0x80;
+    off += 4;
+    int name_is_ours;
+    answer = answer_cache_find(svr, pkt_buf + name_start, name_length, type, &name_is_ours);
+    if (name_is_ours && !unicast_query) // unicast queries are ignored
+      any_name_is_ours = 1;
+  }
+  if (any_name_is_ours == 0)
+    return 1;
+  if ((num_qn != 1) || (num_ans_rr != 0))
+    return 0; // the answers must be put together, or some of them may be known already
+  if ((answer != NULL) && (answer->packet != NULL)) {
+    uint16_t id = mdns_read_u16(pkt_buf);
+    memcpy(pkt_buf, answer->packet, answer->packet_length);
+    mdns_write_u16(pkt_buf, id);
+    send_reply(svr, pkt_buf, answer->packet_length);
+  }
+  return 1;
+}
+
 int create_pipe(int handles[2]) {
 #ifdef _WIN32
   SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -1502,16 +1706,25 @@ void *main_loop(struct mdnsd *svr) {
       }
 
       DEBUG_PRINTF("data from=%s size=%ld\n", inet_ntoa(fromaddr.sin_addr), (long)recvsize);
-      struct mdns_pkt *mdns = mdns_parse_pkt(pkt_buffer, recvsize);
-      if (mdns != NULL) {
-        if (process_mdns_pkt(svr, mdns, mdns_reply)) {
-          size_t replylen = mdns_encode_pkt(mdns_reply, pkt_buffer, PACKET_SIZE);
-          send_packet(svr->sockfd, pkt_buffer, replylen);
-        } else if (mdns->num_qn == 0) {
-          DEBUG_PRINTF("(no questions in packet)\n\n");
+      if (recvsize > 0) {
+        pthread_mutex_lock(&svr->data_lock);
+        int answer_cache_is_valid = svr->answer_cache_is_valid;
+        pthread_mutex_unlock(&svr->data_lock);
+        if (answer_cache_is_valid == 0)
+          answer_cache_build(svr, mdns_reply, pkt_buffer);
+        if (process_mdns_pkt_from_cache(svr, pkt_buffer, recvsize) == 0) {
+          struct mdns_pkt *mdns = mdns_parse_pkt(pkt_buffer, recvsize);
+          if (mdns != NULL) {
+            if (process_mdns_pkt(svr, mdns, mdns_reply)) {
+              size_t replylen = mdns_encode_pkt(mdns_reply, pkt_buffer, PACKET_SIZE);
+              send_reply(svr, pkt_buffer, replylen);
+            } else if (mdns->num_qn == 0) {
+              DEBUG_PRINTF("(no questions in packet)\n\n");
+            }
+
+            mdns_pkt_destroy(mdns);
+          }
         }
-
-        mdns_pkt_destroy(mdns);
       }
     }
 
@@ -1562,6 +1775,7 @@ void *main_loop(struct mdnsd *svr) {
   // destroy packet
   mdns_init_reply(mdns_reply, 0);
   free(mdns_reply);
+  answer_cache_clear(svr);
 
   free(pkt_buffer);
 
@@ -1590,6 +1804,7 @@ void mdnsd_set_hostname(struct mdnsd *svr, const char *hostname, uint32_t ip) {
   svr->hostname = create_nlabel(hostname);
   rr_group_add(&svr->group, a_e);
   rr_group_add(&svr->group, nsec_e);
+  svr->answer_cache_is_valid = 0;
   pthread_mutex_unlock(&svr->data_lock);
 }
 
@@ -1610,12 +1825,14 @@ void mdnsd_set_hostname_v6(struct mdnsd *svr, const char *hostname, struct in6_a
   svr->hostname = create_nlabel(hostname);
   rr_group_add(&svr->group, aaaa_e);
   rr_group_add(&svr->group, nsec_e);
+  svr->answer_cache_is_valid = 0;
   pthread_mutex_unlock(&svr->data_lock);
 }
 
 void mdnsd_add_rr(struct mdnsd *svr, struct rr_entry *rr) {
   pthread_mutex_lock(&svr->data_lock);
   rr_group_add(&svr->group, rr);
+  svr->answer_cache_is_valid = 0;
   pthread_mutex_unlock(&svr->data_lock);
 }
 
@@ -1675,6 +1892,7 @@ struct mdns_service *mdnsd_register_svc(struct mdnsd *svr, const char *instance_
   // append PTR entry to announce list
   rr_list_append(&svr->announce, ptr_e);
   rr_list_append(&svr->services, ptr_e);
+  svr->answer_cache_is_valid = 0;
 
   pthread_mutex_unlock(&svr->data_lock);
 
@@ -0,0 +1,94 @@
+// recvmmsg and struct mmsghdr need this on glibc. It's kept to this file because it changes the
+// behaviour of strerror_r, which is used elsewhere.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "config.h"
+
+#include "common.h"
+#include "udp_receive.h"
+
+#if defined(HAVE_RECVMMSG) && defined(SO_TIMESTAMPNS)
+#define USE_RECVMMSG
+#endif
+
+void udp_receive_enable_timestamps(int fd) {
+#ifdef USE_RECVMMSG
+  int val = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &val, sizeof(val)) < 0)
+    debug(1, "Error %d: couldn't set SO_TIMESTAMPNS -- packet arrival times will be less accurate.",
+          errno);
+#else
+  (void)fd;
+#endif
+}
+
+#ifdef USE_RECVMMSG
+
+int udp_receive(int fd, udp_datagram *datagrams, int number_of_datagrams) {
+  struct mmsghdr msgs[UDP_RECEIVE_BATCH_SIZE];
+  struct iovec iovecs[UDP_RECEIVE_BATCH_SIZE];
+  char control[UDP_RECEIVE_BATCH_SIZE][CMSG_SPACE(sizeof(struct timespec))];
+  if (number_of_datagrams > UDP_RECEIVE_BATCH_SIZE)
+    number_of_datagrams = UDP_RECEIVE_BATCH_SIZE;
+  int i;
+  for (i = 0; i < number_of_datagrams; i++) {
+    iovecs[i].iov_base = datagrams[i].data;
+    iovecs[i].iov_len = sizeof(datagrams[i].data);
+    memset(&msgs[i], 0, sizeof(struct mmsghdr));
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = control[i];
+    msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+  }
+
+  // wait for the first one, then take whatever else is already there
+  int response = recvmmsg(fd, msgs, number_of_datagrams, MSG_WAITFORONE, NULL);
+  pthread_testcancel(); // in case recvmmsg isn't a cancellation point here
+  uint64_t local_time_now = get_absolute_time_in_ns();
+  if (response <= 0) {
+    datagrams[0].length = -1;
+    datagrams[0].arrival_time = local_time_now;
+    return 1;
+  }
+
+  // the kernel timestamps are CLOCK_REALTIME, so convert them using the age of each datagram
+  struct timespec tn;
+  clock_gettime(CLOCK_REALTIME, &tn);
+  uint64_t real_time_now = (uint64_t)tn.tv_sec * 1000000000 + tn.tv_nsec;
+
+  for (i = 0; i < response; i++) {
+    datagrams[i].length = msgs[i].msg_len;
+    datagrams[i].arrival_time = local_time_now;
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+      if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPNS)) {
+        struct timespec ts;
+        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+        uint64_t arrival_real_time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        uint64_t age = real_time_now - arrival_real_time;
+        // ignore it if the real time clock has been stepped in the meantime
+        if ((arrival_real_time <= real_time_now) && (age < 1000000000) && (age < local_time_now))
+          datagrams[i].arrival_time = local_time_now - age;
+      }
+    }
+  }
+  return response;
+}
+
+#else
+
+int udp_receive(int fd, udp_datagram *datagrams, __attribute__((unused)) int number_of_datagrams) {
+  datagrams[0].length = recv(fd, datagrams[0].data, sizeof(datagrams[0].data), 0);
+  datagrams[0].arrival_time = get_absolute_time_in_ns();
+  return 1;
+}
+
+#endif
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// a datagram as received, with the time it arrived, in the same timebase as
+// get_absolute_time_in_ns()
+typedef struct {
+  uint64_t arrival_time;
+  ssize_t length; // negative if there was an error receiving it
+  uint8_t data[2048];
+} udp_datagram;
+
+// the maximum number of datagrams collected in one go
+#define UDP_RECEIVE_BATCH_SIZE 16
+
+// ask the kernel to timestamp incoming datagrams on this socket, if it can
+void udp_receive_enable_timestamps(int fd);
+
+// wait for at least one datagram to arrive on the socket, and collect as many as are waiting,
+// up to the number given. The number collected is returned and is always at least one -- an
+// error is returned as a datagram with a negative length. This is a thread cancellation point.
+int udp_receive(int fd, udp_datagram *datagrams, int number_of_datagrams);